@@ -20,6 +20,7 @@ use alvr_graphics::{
 use alvr_packets::{ButtonEntry, ButtonValue, FaceData, TrackingData};
 use alvr_session::{
     CodecType, FoveatedEncodingConfig, MediacodecPropType, MediacodecProperty, UpscalingConfig,
+    settings_schema::Switch,
 };
 use std::{
     cell::RefCell,
@@ -224,6 +225,7 @@ pub extern "C" fn alvr_initialize(capabilities: AlvrClientCapabilities) {
         prefer_10bit: capabilities.prefer_10bit,
         preferred_encoding_gamma: capabilities.preferred_encoding_gamma,
         prefer_hdr: capabilities.prefer_hdr,
+        decoder_tiles: None,
     };
     *CLIENT_CORE_CONTEXT.lock() = Some(ClientCoreContext::new(capabilities));
 }
@@ -690,6 +692,8 @@ pub extern "C" fn alvr_start_stream_opengl(config: AlvrStreamConfig) {
         center_shift_y: config.foveation_center_shift_y,
         edge_ratio_x: config.foveation_edge_ratio_x,
         edge_ratio_y: config.foveation_edge_ratio_y,
+        qp_falloff: Switch::Disabled,
+        radial: Switch::Disabled,
     });
     let upscaling = config.enable_upscaling.then_some(UpscalingConfig {
         edge_direction: config.upscaling_edge_direction,
@@ -66,6 +66,8 @@ pub struct ConnectionContext {
     pub decoder_callback: Mutex<Option<Box<DecoderCallback>>>,
     pub global_view_params_queue: Mutex<VecDeque<(Duration, [ViewParams; 2])>>,
     pub max_prediction: RwLock<Duration>,
+    // Of the last frame received, 0 before the first one
+    pub framerate_divider: RwLock<u32>,
 }
 
 fn set_hud_message(event_queue: &Mutex<VecDeque<ClientCoreEvent>>, message: &str) {
@@ -120,6 +122,31 @@ pub fn connection_lifecycle_loop(
     dbg_connection!("connection_lifecycle_loop: End");
 }
 
+// Returns false if the decoder couldn't take the frame
+fn submit_frame(
+    ctx: &ConnectionContext,
+    timestamp: Duration,
+    global_view_params: [ViewParams; 2],
+    nal: &[u8],
+) -> bool {
+    // The view params must be enqueued before calling the decoder callback, there is no problem if
+    // the callback fails
+    {
+        let global_view_params_queue_lock = &mut ctx.global_view_params_queue.lock();
+
+        global_view_params_queue_lock.push_back((timestamp, global_view_params));
+
+        while global_view_params_queue_lock.len() > 128 {
+            global_view_params_queue_lock.pop_front();
+        }
+    }
+
+    ctx.decoder_callback
+        .lock()
+        .as_mut()
+        .is_some_and(|callback| callback(timestamp, nal))
+}
+
 fn connection_pipeline(
     capabilities: ClientCapabilities,
     ctx: Arc<ConnectionContext>,
@@ -182,7 +209,9 @@ fn connection_pipeline(
                         prefer_hdr: capabilities.prefer_hdr,
                         ext_str: String::new(),
                     }
-                    .with_ext(VideoStreamingCapabilitiesExt {}),
+                    .with_ext(VideoStreamingCapabilitiesExt {
+                        decoder_tiles: capabilities.decoder_tiles,
+                    }),
                 ),
             },
         )))
@@ -276,6 +305,14 @@ fn connection_pipeline(
         let ctx = Arc::clone(&ctx);
         move || {
             let mut stream_corrupted = true;
+            // Slices of the frame being received, which is decoded once complete
+            let mut frame_slices = Vec::new();
+            let mut frame_slices_timestamp = Duration::ZERO;
+            let mut frame_slices_view_params = [ViewParams::DUMMY; 2];
+            let mut frame_slices_loss = false;
+            // Last frame received in full since the stream started from an IDR. The server can
+            // repair a loss by encoding the next frame from it instead of sending an IDR
+            let mut last_received_timestamp = None;
             while is_streaming(&ctx) {
                 let data = match video_receiver.recv(STREAMING_RECV_TIMEOUT) {
                     Ok(data) => data,
@@ -286,43 +323,72 @@ fn connection_pipeline(
                     return;
                 };
 
+                if !frame_slices.is_empty() && header.timestamp != frame_slices_timestamp {
+                    // The last slice of the previous frame was lost. The slices are sent whole, so
+                    // the decoder can still show the ones received until the repaired frame
+                    if !settings.connection.avoid_video_glitching {
+                        submit_frame(
+                            &ctx,
+                            frame_slices_timestamp,
+                            frame_slices_view_params,
+                            &frame_slices,
+                        );
+                    }
+                    frame_slices.clear();
+                    frame_slices_loss = true;
+                }
+                let had_packet_loss = data.had_packet_loss() || frame_slices_loss;
+
+                if !header.is_last_slice {
+                    frame_slices.extend_from_slice(nal);
+                    frame_slices_timestamp = header.timestamp;
+                    frame_slices_view_params = header.global_view_params;
+                    frame_slices_loss = had_packet_loss;
+                    continue;
+                }
+                frame_slices_loss = false;
+
+                let nal = if frame_slices.is_empty() {
+                    nal
+                } else {
+                    frame_slices.extend_from_slice(nal);
+                    &frame_slices[..]
+                };
+
                 if let Some(stats) = &mut *ctx.statistics_manager.lock() {
                     stats.report_video_packet_received(header.timestamp);
                 }
+                *ctx.framerate_divider.write() = header.framerate_divider as u32;
 
-                if header.is_idr {
+                if header.is_idr && !had_packet_loss {
                     stream_corrupted = false;
-                } else if data.had_packet_loss() {
+                } else if had_packet_loss {
                     stream_corrupted = true;
                     if let Some(sender) = &mut *ctx.control_sender.lock() {
-                        sender.send(&ClientControlPacket::RequestIdr).ok();
+                        // The repaired frames would be discarded while waiting for an IDR
+                        match last_received_timestamp {
+                            Some(timestamp) if !settings.connection.avoid_video_glitching => {
+                                sender
+                                    .send(&ClientControlPacket::VideoFramesLost {
+                                        last_received_timestamp: timestamp,
+                                    })
+                                    .ok();
+                            }
+                            _ => {
+                                sender.send(&ClientControlPacket::RequestIdr).ok();
+                            }
+                        }
                     }
                     warn!("Network dropped video packet");
                 }
+                if !had_packet_loss && (header.is_idr || last_received_timestamp.is_some()) {
+                    last_received_timestamp = Some(header.timestamp);
+                }
 
                 if !stream_corrupted || !settings.connection.avoid_video_glitching {
-                    // The view params must be enqueued before calling the decoder callback, there
-                    // is no problem if the callback fails
-                    {
-                        let global_view_params_queue_lock =
-                            &mut ctx.global_view_params_queue.lock();
-
-                        global_view_params_queue_lock
-                            .push_back((header.timestamp, header.global_view_params));
-
-                        while global_view_params_queue_lock.len() > 128 {
-                            global_view_params_queue_lock.pop_front();
-                        }
-                    }
-
-                    let submitted = ctx
-                        .decoder_callback
-                        .lock()
-                        .as_mut()
-                        .is_some_and(|callback| callback(header.timestamp, nal));
-
-                    if !submitted {
+                    if !submit_frame(&ctx, header.timestamp, header.global_view_params, nal) {
                         stream_corrupted = true;
+                        last_received_timestamp = None;
                         if let Some(sender) = &mut *ctx.control_sender.lock() {
                             sender.send(&ClientControlPacket::RequestIdr).ok();
                         }
@@ -334,6 +400,8 @@ fn connection_pipeline(
                     }
                     warn!("Dropped video packet. Reason: Waiting for IDR frame")
                 }
+
+                frame_slices.clear();
             }
         }
     });
@@ -71,6 +71,8 @@ pub struct ClientCapabilities {
     pub prefer_10bit: bool,
     pub preferred_encoding_gamma: f32,
     pub prefer_hdr: bool,
+    // Tile columns and rows the decoder decodes in parallel, if known
+    pub decoder_tiles: Option<UVec2>,
 }
 
 pub struct ClientCoreContext {
@@ -293,6 +295,11 @@ impl ClientCoreContext {
         *global_view_params_lock
     }
 
+    // The server encodes one frame in this many, there is no new frame for the vsyncs in between
+    pub fn framerate_divider(&self) -> u32 {
+        u32::max(*self.connection_context.framerate_divider.read(), 1)
+    }
+
     pub fn report_submit(&self, timestamp: Duration, vsync_queue: Duration) {
         dbg_client_core!("report_submit");
 
@@ -201,6 +201,7 @@ fn client_thread(
         prefer_10bit: false,
         preferred_encoding_gamma: 1.0,
         prefer_hdr: false,
+        decoder_tiles: None,
     };
     let client_core_context = Arc::new(ClientCoreContext::new(capabilities));
 
@@ -292,6 +292,8 @@ pub fn entry_point() {
             prefer_10bit: false,
             preferred_encoding_gamma: 1.0,
             prefer_hdr: false,
+            // One tile per eye, the standalone headset decoders have several cores
+            decoder_tiles: (platform != Platform::Unknown).then_some(UVec2::new(2, 1)),
         };
         let core_context = Arc::new(ClientCoreContext::new(capabilities));
 
@@ -19,6 +19,7 @@ use alvr_packets::{RealTimeConfig, StreamConfig, TrackingData};
 use alvr_session::{
     ClientsideFoveationConfig, ClientsideFoveationMode, ClientsidePostProcessingConfig, CodecType,
     FoveatedEncodingConfig, MediacodecProperty, PassthroughMode, UpscalingConfig,
+    settings_schema::Switch,
 };
 use alvr_system_info::Platform;
 use openxr as xr;
@@ -61,7 +62,20 @@ impl ParsedStreamConfig {
                 .negotiated_config
                 .enable_foveated_encoding
                 .then(|| config.settings.video.foveated_encoding.as_option().cloned())
-                .flatten(),
+                .flatten()
+                .map(|mut foveated_encoding| {
+                    // The server falls back to the axis aligned compression if it can't do the
+                    // radial one
+                    if !config
+                        .negotiated_config
+                        .ext()
+                        .unwrap_or_default()
+                        .radial_foveation
+                    {
+                        foveated_encoding.radial = Switch::Disabled;
+                    }
+                    foveated_encoding
+                }),
             clientside_foveation_config: config
                 .settings
                 .video
@@ -99,6 +113,8 @@ pub struct StreamContext {
     renderer: StreamRenderer,
     decoder: Option<(VideoDecoderConfig, VideoDecoderSource)>,
     use_custom_reprojection: bool,
+    // Vsyncs left for which the server encodes no frame
+    vsyncs_without_frame: u32,
 }
 
 impl StreamContext {
@@ -243,6 +259,7 @@ impl StreamContext {
             target_view_resolution,
             renderer,
             decoder: None,
+            vsyncs_without_frame: 0,
         };
 
         this.update_reference_space();
@@ -344,17 +361,28 @@ impl StreamContext {
         vsync_time: Duration,
     ) -> (ProjectionLayerBuilder<'_>, Duration) {
         let xr_vsync_time = xr::Time::from_nanos(vsync_time.as_nanos() as _);
-        let frame_poll_deadline = Instant::now()
-            + Duration::from_secs_f32(
-                frame_interval.as_secs_f32() * DECODER_MAX_TIMEOUT_MULTIPLIER,
-            );
+        // No frame is waited for at the vsyncs the server doesn't encode one, the previous frame
+        // is reprojected right away. A late one is still taken if it's already decoded
+        let frame_poll_timeout = if self.vsyncs_without_frame > 0 {
+            self.vsyncs_without_frame -= 1;
+            Duration::ZERO
+        } else {
+            Duration::from_secs_f32(frame_interval.as_secs_f32() * DECODER_MAX_TIMEOUT_MULTIPLIER)
+        };
+        let frame_poll_deadline = Instant::now() + frame_poll_timeout;
         let mut frame_result = None;
         if let Some((_, source)) = &mut self.decoder {
-            while frame_result.is_none() && Instant::now() < frame_poll_deadline {
+            loop {
                 frame_result = source.get_frame();
+                if frame_result.is_some() || Instant::now() >= frame_poll_deadline {
+                    break;
+                }
                 thread::sleep(Duration::from_micros(500));
             }
         }
+        if frame_result.is_some() {
+            self.vsyncs_without_frame = self.core_context.framerate_divider() - 1;
+        }
 
         let (timestamp, view_params, buffer_ptr) =
             if let Some((timestamp, buffer_ptr)) = frame_result {
@@ -9,20 +9,32 @@ pub fn debug_tab_ui(ui: &mut Ui) -> Option<ServerRequest> {
 For that, use other means of recording, for example through headset or desktop VR output.",
     );
 
-    ui.columns(4, |ui| {
+    ui.columns(7, |ui| {
         if ui[0].button("Capture frame").clicked() {
             request = Some(ServerRequest::CaptureFrame);
         }
 
-        if ui[1].button("Insert IDR").clicked() {
+        if ui[1].button("Capture trace").clicked() {
+            request = Some(ServerRequest::CaptureTrace);
+        }
+
+        if ui[2].button("Flight recorder").clicked() {
+            request = Some(ServerRequest::DumpFlightRecorder);
+        }
+
+        if ui[3].button("Record frames").clicked() {
+            request = Some(ServerRequest::RecordFrames);
+        }
+
+        if ui[4].button("Insert IDR").clicked() {
             request = Some(ServerRequest::InsertIdr);
         }
 
-        if ui[2].button("Start recording").clicked() {
+        if ui[5].button("Start recording").clicked() {
             request = Some(ServerRequest::StartRecording);
         }
 
-        if ui[3].button("Stop recording").clicked() {
+        if ui[6].button("Stop recording").clicked() {
             request = Some(ServerRequest::StopRecording);
         }
     });
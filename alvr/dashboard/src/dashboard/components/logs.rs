@@ -51,6 +51,7 @@ impl LogsTab {
                     event.event_type,
                     EventType::StatisticsSummary(_)
                         | EventType::GraphStatistics(_)
+                        | EventType::FrameStageStatistics(_)
                         | EventType::Tracking(_)
                 ))
             .then_some(log_colors::EVENT_LIGHT)
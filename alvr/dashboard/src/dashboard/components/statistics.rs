@@ -1,5 +1,5 @@
 use crate::dashboard::{ServerRequest, theme::graph_colors};
-use alvr_events::{GraphStatistics, StatisticsSummary};
+use alvr_events::{FrameStageStatistics, GraphStatistics, StatisticsSummary};
 use alvr_gui_common::theme;
 use eframe::{
     egui::{
@@ -14,6 +14,8 @@ use std::{collections::VecDeque, ops::RangeInclusive};
 
 const GRAPH_HISTORY_SIZE: usize = 1000;
 const UPPER_QUANTILE: f64 = 0.90;
+// Stage statistics are reported every 0.5s, this keeps the last 5s
+const FRAME_STAGES_HISTORY_SIZE: usize = 10;
 
 fn draw_lines(painter: &Painter, points: Vec<Pos2>, color: Color32) {
     painter.add(Shape::line(points, Stroke::new(1.0, color)));
@@ -22,6 +24,7 @@ fn draw_lines(painter: &Painter, points: Vec<Pos2>, color: Color32) {
 pub struct StatisticsTab {
     history: VecDeque<GraphStatistics>,
     last_statistics_summary: Option<StatisticsSummary>,
+    frame_stages_history: VecDeque<FrameStageStatistics>,
 }
 
 impl StatisticsTab {
@@ -31,6 +34,7 @@ impl StatisticsTab {
                 .into_iter()
                 .collect(),
             last_statistics_summary: None,
+            frame_stages_history: VecDeque::new(),
         }
     }
 
@@ -43,6 +47,13 @@ impl StatisticsTab {
         self.history.push_back(statistics);
     }
 
+    pub fn update_frame_stage_statistics(&mut self, statistics: FrameStageStatistics) {
+        if self.frame_stages_history.len() >= FRAME_STAGES_HISTORY_SIZE {
+            self.frame_stages_history.pop_front();
+        }
+        self.frame_stages_history.push_back(statistics);
+    }
+
     pub fn ui(&self, ui: &mut Ui) -> Option<ServerRequest> {
         if let Some(stats) = &self.last_statistics_summary {
             ScrollArea::new([false, true]).show(ui, |ui| {
@@ -50,6 +61,7 @@ impl StatisticsTab {
                 self.draw_latency_graph(ui, available_width);
                 self.draw_fps_graph(ui, available_width);
                 self.draw_bitrate_graph(ui, available_width);
+                self.draw_frame_stages(ui, available_width);
                 self.draw_statistics_overview(ui, stats);
             });
         } else {
@@ -432,6 +444,99 @@ impl StatisticsTab {
         )
     }
 
+    fn draw_frame_stages(&self, ui: &mut Ui, available_width: f32) {
+        let Some(last) = self.frame_stages_history.back() else {
+            return;
+        };
+        let bucket_width_ms = last.bucket_width_s * 1000.0;
+
+        ui.add_space(10.0);
+        ui.label(RichText::new("Streamer stages").size(20.0));
+
+        for (index, stage) in last.stages.iter().enumerate() {
+            // Sum the histograms of the whole history window
+            let mut counts = vec![0; stage.counts.len()];
+            for stats in &self.frame_stages_history {
+                if let Some(other) = stats.stages.get(index).filter(|s| s.name == stage.name) {
+                    for (count, other_count) in counts.iter_mut().zip(&other.counts) {
+                        *count += other_count;
+                    }
+                }
+            }
+
+            let total = counts.iter().sum::<u32>();
+            let quantile_ms = |quantile: f32| {
+                let mut sum = 0;
+                let bucket = counts
+                    .iter()
+                    .position(|count| {
+                        sum += count;
+                        sum as f32 >= quantile * total as f32
+                    })
+                    .unwrap_or(0);
+                (bucket + 1) as f32 * bucket_width_ms
+            };
+
+            ui.add_space(5.0);
+            if total > 0 {
+                ui.label(format!(
+                    "{}: p50 < {:.1}ms, p99 < {:.1}ms",
+                    stage.name,
+                    quantile_ms(0.5),
+                    quantile_ms(0.99)
+                ));
+            } else {
+                ui.label(format!("{}: no data", stage.name));
+                continue;
+            }
+
+            let max_count = counts.iter().copied().max().unwrap_or(0);
+
+            let canvas_response = Frame::canvas(ui.style()).show(ui, |ui| {
+                let size = available_width * vec2(1.0, 0.05);
+                let (_id, canvas_rect) = ui.allocate_space(size);
+                let data_rect =
+                    Rect::from_x_y_ranges(0.0..=counts.len() as f32, max_count as f32..=0.0);
+                let to_screen = RectTransform::from_to(data_rect, canvas_rect);
+                let painter = ui.painter().with_clip_rect(canvas_rect);
+
+                for (bucket, count) in counts.iter().enumerate() {
+                    painter.rect_filled(
+                        Rect {
+                            min: to_screen * pos2(bucket as f32, *count as f32),
+                            max: to_screen * pos2(bucket as f32 + 0.9, 0.0),
+                        },
+                        CornerRadius::ZERO,
+                        graph_colors::RENDER,
+                    );
+                }
+
+                data_rect
+            });
+
+            if let Some(pos) = canvas_response.response.hover_pos() {
+                let graph_pos = RectTransform::from_to(
+                    canvas_response.response.rect,
+                    canvas_response.inner,
+                ) * pos;
+                let bucket = (graph_pos.x as usize).clamp(0, counts.len() - 1);
+                let upper = if bucket == counts.len() - 1 {
+                    "+".into()
+                } else {
+                    format!("-{:.1}", (bucket + 1) as f32 * bucket_width_ms)
+                };
+
+                canvas_response.response.on_hover_ui_at_pointer(|ui| {
+                    ui.label(format!(
+                        "{:.1}{upper}ms: {} frames",
+                        bucket as f32 * bucket_width_ms,
+                        counts[bucket]
+                    ));
+                });
+            }
+        }
+    }
+
     fn draw_statistics_overview(&self, ui: &mut Ui, statistics: &StatisticsSummary) {
         ui.add_space(10.0);
 
@@ -466,6 +571,76 @@ impl StatisticsTab {
             ui[0].label("Streamer FPS:");
             ui[1].label(format!("{} FPS", statistics.server_fps));
 
+            ui[0].label("Streamer missed vsyncs:");
+            ui[1].label(format!(
+                "{} ({:.1}/s)",
+                statistics.server_missed_vsyncs_total, statistics.server_missed_vsyncs_per_sec
+            ));
+
+            ui[0].label("Frames without pose:");
+            ui[1].label(format!(
+                "{} ({:.1}/s)",
+                statistics.server_frames_without_pose_total,
+                statistics.server_frames_without_pose_per_sec
+            ));
+
+            ui[0].label("IDR frames:");
+            ui[1].label(format!(
+                "{} ({:.1}/s)",
+                statistics.server_idrs_total, statistics.server_idrs_per_sec
+            ));
+
+            ui[0].label("Compositor sync failures:");
+            ui[1].label(format!("{}", statistics.server_acquire_sync_failures_total));
+
+            // The static frame skipping only exists on Windows
+            if cfg!(windows) {
+                ui[0].label("Static frames skipped:");
+                ui[1].label(format!(
+                    "{} ({:.1}/s)",
+                    statistics.server_static_frames_skipped_total,
+                    statistics.server_static_frames_skipped_per_sec
+                ));
+            }
+
+            ui[0].label("Duplicate frames:");
+            ui[1].label(format!(
+                "{} ({:.1}/s)",
+                statistics.server_duplicate_frames_total,
+                statistics.server_duplicate_frames_per_sec
+            ));
+
+            if let Some(depth) = statistics.server_send_queue_average_depth {
+                ui[0].label("Send queue depth / dropped:");
+                ui[1].label(format!(
+                    "{depth:.1} / {} ({:.1}/s)",
+                    statistics.server_send_queue_dropped_frames_total,
+                    statistics.server_send_queue_dropped_frames_per_sec
+                ));
+            }
+
+            ui[0].label("Encoder output:");
+            ui[1].label(format!("{:.1} Mbps", statistics.encoder_output_mbits_per_sec));
+
+            let percent =
+                |value: Option<f32>| value.map_or("unknown".into(), |value| format!("{value:.0}%"));
+            ui[0].label("Peak GPU 3D / video engine:");
+            ui[1].label(format!(
+                "{} / {}",
+                percent(statistics.gpu_graphics_peak_percent),
+                percent(statistics.gpu_encoder_peak_percent)
+            ));
+
+            let mbytes = |value: Option<f32>| {
+                value.map_or("unknown".into(), |value| format!("{value:.0} MB/s"))
+            };
+            ui[0].label("Peak PCIe to / from GPU:");
+            ui[1].label(format!(
+                "{} / {}",
+                mbytes(statistics.gpu_pcie_rx_peak_mbytes_per_sec),
+                mbytes(statistics.gpu_pcie_tx_peak_mbytes_per_sec)
+            ));
+
             ui[0].label("Headset battery");
             ui[1].label(format!(
                 "{}% ({})",
@@ -30,6 +30,9 @@ pub enum ServerRequest {
         action: ClientConnectionsAction,
     },
     CaptureFrame,
+    CaptureTrace,
+    DumpFlightRecorder,
+    RecordFrames,
     InsertIdr,
     StartRecording,
     StopRecording,
@@ -159,6 +162,9 @@ impl eframe::App for Dashboard {
                 EventType::StatisticsSummary(statistics) => {
                     self.statistics_tab.update_statistics(statistics)
                 }
+                EventType::FrameStageStatistics(statistics) => self
+                    .statistics_tab
+                    .update_frame_stage_statistics(statistics),
                 EventType::Session(session) => {
                     let settings = session.to_settings();
 
@@ -303,6 +303,9 @@ impl DataSources {
                                     }
                                 }
                                 ServerRequest::CaptureFrame
+                                | ServerRequest::CaptureTrace
+                                | ServerRequest::DumpFlightRecorder
+                                | ServerRequest::RecordFrames
                                 | ServerRequest::InsertIdr
                                 | ServerRequest::StartRecording
                                 | ServerRequest::StopRecording => {
@@ -364,6 +367,9 @@ impl DataSources {
                                     post_body(&rq, &base_uri, "drivers/unregister", Some(path))
                                 }
                                 ServerRequest::CaptureFrame => post("capture-frame"),
+                                ServerRequest::CaptureTrace => post("capture-trace"),
+                                ServerRequest::DumpFlightRecorder => post("flight-recorder"),
+                                ServerRequest::RecordFrames => post("record-frames"),
                                 ServerRequest::InsertIdr => post("insert-idr"),
                                 ServerRequest::StartRecording => post("recording/start"),
                                 ServerRequest::StopRecording => post("recording/stop"),
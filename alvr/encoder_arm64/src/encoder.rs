@@ -2,9 +2,12 @@
 
 use anyhow::{Context, Result, bail};
 use std::ptr;
-use tracing::{debug, info};
+use std::time::Instant;
+use tracing::{debug, error, info};
 
-use crate::ipc::{FrameData, PacketData, PixelFormat};
+use crate::ipc::{EncoderParams, FrameData, PacketData, PixelFormat};
+use windows::core::Interface;
+use windows::Win32::Graphics::Direct3D11::{ID3D11Device, ID3D11Texture2D};
 
 // FFmpeg bindings (由 build.rs 生成)
 #[allow(non_upper_case_globals)]
@@ -55,6 +58,9 @@ impl VideoEncoder {
             (*codec_ctx).gop_size = 0; // All intra
             (*codec_ctx).max_b_frames = 0;
             (*codec_ctx).bit_rate = 30_000_000; // 30 Mbps default
+            // x264 can only change the bitrate at runtime if VBV is enabled when it's opened
+            (*codec_ctx).rc_max_rate = (*codec_ctx).bit_rate;
+            (*codec_ctx).rc_buffer_size = ((*codec_ctx).bit_rate as f64 / 72.0 * 1.1) as i32;
             
             // 设置低延迟选项
             let mut opts: *mut ffi::AVDictionary = ptr::null_mut();
@@ -107,7 +113,14 @@ impl VideoEncoder {
     }
     
     /// 编码一帧
-    pub fn encode_frame(&mut self, frame_data: &FrameData) -> Result<Vec<PacketData>> {
+    ///
+    /// Each packet is passed to on_packet straight from the AVPacket, without an owned copy
+    pub fn encode_frame(
+        &mut self,
+        frame_data: &FrameData,
+        mut on_packet: impl FnMut(&PacketData) -> Result<()>,
+    ) -> Result<()> {
+        let start = Instant::now();
         unsafe {
             // 确保 sws_ctx 已初始化
             if self.sws_ctx.is_null() {
@@ -115,8 +128,17 @@ impl VideoEncoder {
             }
             
             // 准备输入数据
-            let src_data = [frame_data.data.as_ptr(), ptr::null(), ptr::null(), ptr::null()];
-            let src_linesize = [frame_data.row_pitch as i32, 0, 0, 0];
+            // NV12/P010 的 UV plane 紧跟在 Y plane 之后
+            let mut src_data = [frame_data.data.as_ptr(), ptr::null(), ptr::null(), ptr::null()];
+            let mut src_linesize = [frame_data.row_pitch as i32, 0, 0, 0];
+            if !matches!(frame_data.pixel_format, PixelFormat::Rgba) {
+                let luma_size = frame_data.row_pitch as usize * frame_data.height as usize;
+                if frame_data.data.len() < luma_size + luma_size / 2 {
+                    bail!("Frame data too small: {}", frame_data.data.len());
+                }
+                src_data[1] = frame_data.data.as_ptr().add(luma_size);
+                src_linesize[1] = frame_data.row_pitch as i32;
+            }
             
             // 颜色空间转换
             ffi::sws_scale(
@@ -144,43 +166,14 @@ impl VideoEncoder {
             }
             
             // 接收编码后的数据包
-            let mut packets = Vec::new();
-            let packet = ffi::av_packet_alloc();
-            
-            loop {
-                let ret = ffi::avcodec_receive_packet(self.codec_ctx, packet);
-                // EAGAIN = 11 on Windows/POSIX, AVERROR_EOF = FFERRTAG('E','O','F',' ')
-                const EAGAIN: i32 = 11;
-                const AVERROR_EOF: i32 = -(('E' as i32) | (('O' as i32) << 8) | (('F' as i32) << 16) | ((' ' as i32) << 24));
-                if ret == averror(EAGAIN) || ret == AVERROR_EOF {
-                    break;
-                }
-                if ret < 0 {
-                    ffi::av_packet_free(&mut (packet as *mut _));
-                    bail!("Error receiving packet: {}", ret);
-                }
-                
-                // 复制数据包数据
-                let data = std::slice::from_raw_parts((*packet).data, (*packet).size as usize);
-                let is_idr = ((*packet).flags & ffi::AV_PKT_FLAG_KEY as i32) != 0;
-                
-                packets.push(PacketData {
-                    data: data.to_vec(),
-                    timestamp_ns: (*packet).pts as u64,
-                    is_idr,
-                });
-                
-                ffi::av_packet_unref(packet);
-            }
-            
-            ffi::av_packet_free(&mut (packet as *mut _));
+            receive_packets(self.codec_ctx, start, &mut on_packet)?;
             
             self.frame_count += 1;
             if self.frame_count % 100 == 0 {
                 debug!("Encoded {} frames", self.frame_count);
             }
             
-            Ok(packets)
+            Ok(())
         }
     }
     
@@ -215,11 +208,9 @@ impl VideoEncoder {
         }
     }
     
-    /// 更新比特率
-    pub fn set_bitrate(&mut self, bitrate_bps: u64) {
-        unsafe {
-            (*self.codec_ctx).bit_rate = bitrate_bps as i64;
-        }
+    /// 更新码率和帧率, applied by libx264 from the next frame
+    pub fn set_params(&mut self, params: &EncoderParams) {
+        unsafe { apply_rate_control(self.codec_ctx, params) }
     }
 }
 
@@ -239,6 +230,254 @@ impl Drop for VideoEncoder {
     }
 }
 
+/// 硬件视频编码器 - Media Foundation (h264_mf/hevc_mf) 直接编码共享的 D3D11 纹理
+pub struct HwVideoEncoder {
+    codec_ctx: *mut ffi::AVCodecContext,
+    frame: *mut ffi::AVFrame,
+    device_ctx: *mut ffi::AVBufferRef,
+    frames_ctx: *mut ffi::AVBufferRef,
+    width: u32,
+    height: u32,
+}
+
+impl HwVideoEncoder {
+    pub fn new(width: u32, height: u32, codec_name: &str, device: &ID3D11Device) -> Result<Self> {
+        unsafe {
+            let encoder_name = match codec_name {
+                "hevc" | "h265" => "hevc_mf",
+                _ => "h264_mf",
+            };
+            let name = std::ffi::CString::new(encoder_name).unwrap();
+            let codec = ffi::avcodec_find_encoder_by_name(name.as_ptr());
+            if codec.is_null() {
+                bail!("Could not find encoder {}", encoder_name);
+            }
+
+            // The encoder works on the device the shared textures are opened on. FFmpeg releases
+            // the device with the context, so it gets its own reference
+            let mut device_ctx =
+                ffi::av_hwdevice_ctx_alloc(ffi::AVHWDeviceType_AV_HWDEVICE_TYPE_D3D11VA);
+            if device_ctx.is_null() {
+                bail!("Could not allocate D3D11 device context");
+            }
+            let hw_device = (*device_ctx).data as *mut ffi::AVHWDeviceContext;
+            let d3d11_device = (*hw_device).hwctx as *mut ffi::AVD3D11VADeviceContext;
+            (*d3d11_device).device = device.clone().into_raw() as *mut ffi::ID3D11Device;
+            let ret = ffi::av_hwdevice_ctx_init(device_ctx);
+            if ret < 0 {
+                ffi::av_buffer_unref(&mut device_ctx);
+                bail!("Could not initialize D3D11 device context: error {}", ret);
+            }
+
+            let mut frames_ctx = ffi::av_hwframe_ctx_alloc(device_ctx);
+            if frames_ctx.is_null() {
+                ffi::av_buffer_unref(&mut device_ctx);
+                bail!("Could not allocate D3D11 frames context");
+            }
+            let hw_frames = (*frames_ctx).data as *mut ffi::AVHWFramesContext;
+            (*hw_frames).format = ffi::AVPixelFormat_AV_PIX_FMT_D3D11;
+            (*hw_frames).sw_format = ffi::AVPixelFormat_AV_PIX_FMT_NV12;
+            (*hw_frames).width = width as i32;
+            (*hw_frames).height = height as i32;
+            let ret = ffi::av_hwframe_ctx_init(frames_ctx);
+            if ret < 0 {
+                ffi::av_buffer_unref(&mut frames_ctx);
+                ffi::av_buffer_unref(&mut device_ctx);
+                bail!("Could not initialize D3D11 frames context: error {}", ret);
+            }
+
+            let codec_ctx = ffi::avcodec_alloc_context3(codec);
+            if codec_ctx.is_null() {
+                ffi::av_buffer_unref(&mut frames_ctx);
+                ffi::av_buffer_unref(&mut device_ctx);
+                bail!("Could not allocate codec context");
+            }
+
+            (*codec_ctx).width = width as i32;
+            (*codec_ctx).height = height as i32;
+            (*codec_ctx).time_base = ffi::AVRational { num: 1, den: 1_000_000_000 }; // nanoseconds
+            (*codec_ctx).framerate = ffi::AVRational { num: 72, den: 1 };
+            (*codec_ctx).pix_fmt = ffi::AVPixelFormat_AV_PIX_FMT_D3D11;
+            (*codec_ctx).hw_frames_ctx = ffi::av_buffer_ref(frames_ctx);
+            (*codec_ctx).gop_size = 0; // All intra
+            (*codec_ctx).max_b_frames = 0;
+            (*codec_ctx).bit_rate = 30_000_000; // 30 Mbps default
+
+            // 设置低延迟选项
+            let mut opts: *mut ffi::AVDictionary = ptr::null_mut();
+            for (key, value) in [("hw_encoding", "1"), ("scenario", "display_remoting")] {
+                let key = std::ffi::CString::new(key).unwrap();
+                let value = std::ffi::CString::new(value).unwrap();
+                ffi::av_dict_set(&mut opts, key.as_ptr(), value.as_ptr(), 0);
+            }
+
+            let ret = ffi::avcodec_open2(codec_ctx, codec, &mut opts);
+            ffi::av_dict_free(&mut opts);
+            if ret < 0 {
+                ffi::avcodec_free_context(&mut (codec_ctx as *mut _));
+                ffi::av_buffer_unref(&mut frames_ctx);
+                ffi::av_buffer_unref(&mut device_ctx);
+                bail!("Could not open codec: error {}", ret);
+            }
+
+            // The frame only points to the shared textures. Like in the driver, buf[0] is set so
+            // that avcodec_send_frame references the frame instead of copying it
+            let frame = ffi::av_frame_alloc();
+            if frame.is_null() {
+                ffi::avcodec_free_context(&mut (codec_ctx as *mut _));
+                ffi::av_buffer_unref(&mut frames_ctx);
+                ffi::av_buffer_unref(&mut device_ctx);
+                bail!("Could not allocate frame");
+            }
+            (*frame).buf[0] = ffi::av_buffer_alloc(1);
+            (*frame).hw_frames_ctx = ffi::av_buffer_ref(frames_ctx);
+            (*frame).format = ffi::AVPixelFormat_AV_PIX_FMT_D3D11 as i32;
+            (*frame).width = width as i32;
+            (*frame).height = height as i32;
+
+            info!("HwVideoEncoder initialized: {}x{}, encoder: {}", width, height, encoder_name);
+
+            Ok(Self {
+                codec_ctx,
+                frame,
+                device_ctx,
+                frames_ctx,
+                width,
+                height,
+            })
+        }
+    }
+
+    /// 编码一个共享纹理
+    pub fn encode_texture(
+        &mut self,
+        texture: &ID3D11Texture2D,
+        frame_data: &FrameData,
+        mut on_packet: impl FnMut(&PacketData) -> Result<()>,
+    ) -> Result<()> {
+        if frame_data.width != self.width || frame_data.height != self.height {
+            bail!("Unexpected frame size {}x{}", frame_data.width, frame_data.height);
+        }
+
+        let start = Instant::now();
+        unsafe {
+            // data[0] 是纹理, data[1] 是数组索引
+            (*self.frame).data[0] = texture.as_raw() as *mut u8;
+            (*self.frame).data[1] = ptr::null_mut();
+            (*self.frame).pts = frame_data.timestamp_ns as i64;
+            (*self.frame).pict_type = if frame_data.insert_idr {
+                ffi::AVPictureType_AV_PICTURE_TYPE_I
+            } else {
+                ffi::AVPictureType_AV_PICTURE_TYPE_NONE
+            };
+
+            let ret = ffi::avcodec_send_frame(self.codec_ctx, self.frame);
+            if ret < 0 {
+                bail!("Error sending frame for encoding: {}", ret);
+            }
+
+            receive_packets(self.codec_ctx, start, &mut on_packet)
+        }
+    }
+
+    /// 更新码率和帧率
+    ///
+    /// The Media Foundation wrapper of FFmpeg only reads the rate control when it's opened, so
+    /// this only takes effect for encoders that reconfigure themselves
+    pub fn set_params(&mut self, params: &EncoderParams) {
+        unsafe { apply_rate_control(self.codec_ctx, params) }
+    }
+}
+
+impl Drop for HwVideoEncoder {
+    fn drop(&mut self) {
+        unsafe {
+            if !self.frame.is_null() {
+                ffi::av_frame_free(&mut self.frame);
+            }
+            if !self.codec_ctx.is_null() {
+                ffi::avcodec_free_context(&mut self.codec_ctx);
+            }
+            ffi::av_buffer_unref(&mut self.frames_ctx);
+            ffi::av_buffer_unref(&mut self.device_ctx);
+        }
+    }
+}
+
+/// 应用码率和帧率, 与驱动内置编码器的设置一致
+unsafe fn apply_rate_control(codec_ctx: *mut ffi::AVCodecContext, params: &EncoderParams) {
+    (*codec_ctx).bit_rate = params.bitrate_bps as i64;
+    (*codec_ctx).rc_max_rate = (*codec_ctx).bit_rate;
+    (*codec_ctx).rc_buffer_size =
+        (params.bitrate_bps as f64 / params.framerate as f64 * 1.1) as i32;
+    (*codec_ctx).framerate = ffi::AVRational {
+        num: params.framerate as i32,
+        den: 1,
+    };
+}
+
+/// 数据包的平均 QP, 来自编码器导出的 quality stats
+unsafe fn packet_qp(packet: *const ffi::AVPacket) -> Option<u8> {
+    let mut size = 0;
+    let stats = ffi::av_packet_get_side_data(
+        packet,
+        ffi::AVPacketSideDataType_AV_PKT_DATA_QUALITY_STATS,
+        &mut size,
+    );
+    if stats.is_null() || size < 4 {
+        return None;
+    }
+
+    // The first field is the quality as a little endian u32, in lambda units
+    let quality = u32::from_le_bytes(*(stats as *const [u8; 4]));
+    Some((quality / ffi::FF_QP2LAMBDA).min(u8::MAX as u32 - 1) as u8)
+}
+
+/// 接收编码后的数据包, 逐个传给 on_packet
+///
+/// start is when the frame was handed to the encoder, it's reported as the encode time
+unsafe fn receive_packets(
+    codec_ctx: *mut ffi::AVCodecContext,
+    start: Instant,
+    on_packet: &mut impl FnMut(&PacketData) -> Result<()>,
+) -> Result<()> {
+    let packet = ffi::av_packet_alloc();
+    
+    loop {
+        let ret = ffi::avcodec_receive_packet(codec_ctx, packet);
+        // EAGAIN = 11 on Windows/POSIX, AVERROR_EOF = FFERRTAG('E','O','F',' ')
+        const EAGAIN: i32 = 11;
+        const AVERROR_EOF: i32 = -(('E' as i32) | (('O' as i32) << 8) | (('F' as i32) << 16) | ((' ' as i32) << 24));
+        if ret == averror(EAGAIN) || ret == AVERROR_EOF {
+            break;
+        }
+        if ret < 0 {
+            ffi::av_packet_free(&mut (packet as *mut _));
+            bail!("Error receiving packet: {}", ret);
+        }
+        
+        let data = std::slice::from_raw_parts((*packet).data, (*packet).size as usize);
+        let is_idr = ((*packet).flags & ffi::AV_PKT_FLAG_KEY as i32) != 0;
+        
+        let result = on_packet(&PacketData {
+            data,
+            timestamp_ns: (*packet).pts as u64,
+            is_idr,
+            encode_time_us: start.elapsed().as_micros() as u32,
+            qp: packet_qp(packet),
+        });
+        
+        ffi::av_packet_unref(packet);
+        if let Err(e) = result {
+            error!("Failed to send packet: {}", e);
+        }
+    }
+    
+    ffi::av_packet_free(&mut (packet as *mut _));
+    
+    Ok(())
+}
+
 // FFmpeg AVERROR 宏的 Rust 实现
 #[inline]
 const fn averror(e: i32) -> i32 {
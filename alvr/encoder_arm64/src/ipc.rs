@@ -2,93 +2,233 @@
 
 use anyhow::{Context, Result, bail};
 use serde::{Deserialize, Serialize};
+use std::cell::Cell;
 use std::ffi::c_void;
 use std::ptr;
+use std::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+use tracing::{debug, info};
 use windows::core::PCWSTR;
-use windows::Win32::Foundation::{CloseHandle, HANDLE, WAIT_OBJECT_0};
+use windows::Win32::Foundation::{CloseHandle, GetLastError, HANDLE, WAIT_OBJECT_0};
+use windows::Win32::Security::{
+    AdjustTokenPrivileges, LookupPrivilegeValueW, SE_LOCK_MEMORY_NAME, SE_PRIVILEGE_ENABLED,
+    TOKEN_ADJUST_PRIVILEGES, TOKEN_PRIVILEGES,
+};
 use windows::Win32::System::Memory::{
-    CreateFileMappingW, MapViewOfFile, UnmapViewOfFile, FILE_MAP_ALL_ACCESS,
-    PAGE_READWRITE,
+    CreateFileMappingW, GetLargePageMinimum, MapViewOfFile, UnmapViewOfFile, FILE_MAP_ALL_ACCESS,
+    PAGE_READWRITE, SEC_COMMIT, SEC_LARGE_PAGES,
 };
 use windows::Win32::System::Threading::{
-    CreateEventW, OpenEventW, SetEvent, WaitForSingleObject, EVENT_ALL_ACCESS, INFINITE,
+    CreateEventW, GetCurrentProcess, GetCurrentProcessId, OpenEventW, OpenProcessToken, SetEvent,
+    WaitForSingleObject, EVENT_ALL_ACCESS, INFINITE,
+};
+
+use crate::{
+    ENCODER_READY_EVENT, FRAME_FREE_EVENT, FRAME_READY_EVENT, PACKET_FREE_EVENT,
+    PACKET_READY_EVENT, SHARED_MEM_NAME,
 };
 
-use crate::{ENCODER_READY_EVENT, FRAME_READY_EVENT, PACKET_READY_EVENT, SHARED_MEM_NAME};
+/// 槽位对齐 (必须与 C++ 端一致)
+const SLOT_ALIGNMENT: usize = 4096;
+/// The slot header takes a cache line, the data follows it
+const SLOT_HEADER_SIZE: usize = 64;
+/// 数据包缓冲区最小大小 (编码后数据通常更小)
+const MIN_PACKET_BUFFER_SIZE: usize = 4 * 1024 * 1024; // 4MB
+/// 环形缓冲区槽位数量 (必须与 C++ 端一致)
+const FRAME_SLOT_COUNT: u64 = 3;
+const PACKET_SLOT_COUNT: u64 = 4;
+/// 等待驱动释放数据包槽位的超时
+const PACKET_FREE_TIMEOUT_MS: u32 = 1000;
+/// 编码器不报告 QP 时的值 (必须与 C++ 端一致)
+const UNKNOWN_QP: u8 = 0xFF;
+
+/// 共享内存布局: the ring header, then the frame slots and the packet slots, each slot a header
+/// and its data. The slot data is sized for the resolution this process encodes, and the sizes
+/// are written to the ring header for the driver.
+///
+/// Frame n goes to slot n % FRAME_SLOT_COUNT. The writer fills the slot and then stores n + 1 in
+/// its sequence, the reader hands the slot back by advancing the read counter of the ring. The
+/// packet ring works the same way in the other direction.
+#[derive(Clone, Copy)]
+struct Layout {
+    frame_buffer_size: usize,
+    packet_buffer_size: usize,
+}
+
+impl Layout {
+    fn new(width: u32, height: u32) -> Self {
+        // The largest frame of the size in any pixel format, RGBA with the row pitch of a staging
+        // texture
+        let frame_buffer_size = align_up(width as usize * 4, 256) * height as usize;
+        Self {
+            frame_buffer_size,
+            packet_buffer_size: (frame_buffer_size / 8).max(MIN_PACKET_BUFFER_SIZE),
+        }
+    }
+
+    fn frame_slot_offset(&self, slot: u64) -> usize {
+        align_up(size_of::<RingHeader>(), SLOT_ALIGNMENT)
+            + slot as usize * align_up(SLOT_HEADER_SIZE + self.frame_buffer_size, SLOT_ALIGNMENT)
+    }
+
+    fn packet_slot_offset(&self, slot: u64) -> usize {
+        self.frame_slot_offset(FRAME_SLOT_COUNT)
+            + slot as usize * align_up(SLOT_HEADER_SIZE + self.packet_buffer_size, SLOT_ALIGNMENT)
+    }
+
+    fn size(&self) -> usize {
+        self.packet_slot_offset(PACKET_SLOT_COUNT)
+    }
+}
+
+fn align_up(size: usize, alignment: usize) -> usize {
+    size.div_ceil(alignment) * alignment
+}
+
+/// 环形缓冲区状态
+#[repr(C)]
+pub struct RingHeader {
+    /// 编码器已释放的帧数
+    pub frame_read: AtomicU64,
+    /// 驱动已释放的数据包数
+    pub packet_read: AtomicU64,
+    /// 关闭信号
+    pub shutdown: AtomicU32,
+    /// 编码器进程 ID, 驱动用它复制句柄
+    pub encoder_pid: u32,
+    /// 共享纹理设置状态, 见 SharedTextureState
+    pub shared_texture_state: AtomicU32,
+    _padding: u32,
+    /// 适配器 LUID (HighPart << 32 | LowPart)
+    pub adapter_luid: u64,
+    /// 已复制到本进程的句柄
+    pub fence_handle: u64,
+    pub texture_handles: [u64; FRAME_SLOT_COUNT as usize],
+    /// 编码参数, 驱动写入后递增 params_sequence
+    pub bitrate_bps: AtomicU64,
+    pub framerate: AtomicU32,
+    pub params_sequence: AtomicU32,
+    /// 编码分辨率和缓冲区大小, 在通知就绪之前写入
+    pub width: u32,
+    pub height: u32,
+    pub frame_buffer_size: u64,
+    pub packet_buffer_size: u64,
+}
+
+/// 共享纹理设置状态 (必须与 C++ 端一致)
+#[repr(u32)]
+#[derive(Clone, Copy, PartialEq, Eq)]
+pub enum SharedTextureState {
+    None = 0,
+    Requested = 1,
+    Accepted = 2,
+    Rejected = 3,
+}
 
-/// 帧缓冲区大小 (支持 4K RGBA)
-const FRAME_BUFFER_SIZE: usize = 4096 * 2160 * 4;
-/// 数据包缓冲区大小 (编码后数据通常更小)
-const PACKET_BUFFER_SIZE: usize = 4 * 1024 * 1024; // 4MB
+/// 后面紧跟 SLOT_HEADER_SIZE 偏移处的帧数据
+#[repr(C)]
+pub struct FrameSlot {
+    pub sequence: AtomicU64,
+    pub header: FrameHeader,
+}
 
-/// 共享内存布局
+/// 后面紧跟 SLOT_HEADER_SIZE 偏移处的数据包数据
 #[repr(C)]
-pub struct SharedMemoryLayout {
-    /// 帧元数据
-    pub frame_header: FrameHeader,
-    /// 数据包元数据
-    pub packet_header: PacketHeader,
-    /// 帧数据缓冲区
-    pub frame_buffer: [u8; FRAME_BUFFER_SIZE],
-    /// 数据包缓冲区
-    pub packet_buffer: [u8; PACKET_BUFFER_SIZE],
+pub struct PacketSlot {
+    pub sequence: AtomicU64,
+    pub header: PacketHeader,
 }
 
-/// 帧头信息
+const _: () = assert!(size_of::<FrameSlot>() <= SLOT_HEADER_SIZE);
+const _: () = assert!(size_of::<PacketSlot>() <= SLOT_HEADER_SIZE);
+
+/// 帧头信息 (字段顺序保证两端都没有隐式填充)
 #[repr(C)]
 #[derive(Clone, Copy, Default)]
 pub struct FrameHeader {
+    /// 帧时间戳
+    pub timestamp_ns: u64,
+    /// 共享纹理模式下, 栅栏达到此值后纹理可读
+    pub fence_value: u64,
     /// 帧宽度
     pub width: u32,
     /// 帧高度
     pub height: u32,
-    /// 帧时间戳
-    pub timestamp_ns: u64,
-    /// 是否请求 IDR 帧
-    pub insert_idr: u8,
-    /// 像素格式 (0=RGBA, 1=NV12, 2=P010)
-    pub pixel_format: u8,
     /// 行跨度 (stride)
     pub row_pitch: u32,
     /// 帧数据大小
     pub data_size: u32,
-    /// 关闭信号
-    pub shutdown: u8,
+    /// 是否请求 IDR 帧
+    pub insert_idr: u8,
+    /// 像素格式 (0=RGBA, 1=NV12, 2=P010)
+    pub pixel_format: u8,
+    /// 帧在槽位的共享纹理中而不是槽位数据中
+    pub shared_texture: u8,
     /// 填充对齐
-    _padding: [u8; 3],
+    _padding: [u8; 5],
 }
 
 /// 数据包头信息
 #[repr(C)]
 #[derive(Clone, Copy, Default)]
 pub struct PacketHeader {
-    /// 数据包大小
-    pub size: u32,
     /// 时间戳
     pub timestamp_ns: u64,
+    /// 数据包大小
+    pub size: u32,
+    /// 从送入编码器到收到数据包的时间
+    pub encode_time_us: u32,
     /// 是否为 IDR 帧
     pub is_idr: u8,
+    /// 平均 QP, UNKNOWN_QP 表示未知
+    pub qp: u8,
     /// 填充对齐
-    _padding: [u8; 3],
+    _padding: [u8; 6],
 }
 
-/// 帧数据 (反序列化后的)
-pub struct FrameData {
+/// 帧数据, 直接引用共享内存中的槽位, 在 release_frame 之前有效
+pub struct FrameData<'a> {
     pub width: u32,
     pub height: u32,
     pub timestamp_ns: u64,
     pub insert_idr: bool,
     pub pixel_format: PixelFormat,
     pub row_pitch: u32,
-    pub data: Vec<u8>,
-    pub shutdown: bool,
+    pub data: &'a [u8],
+    /// 槽位索引, 也是共享纹理的索引
+    pub slot: usize,
+    /// 共享纹理模式下等待的栅栏值
+    pub fence_value: Option<u64>,
+}
+
+/// 驱动请求的共享纹理
+pub struct SharedTextureSetup {
+    pub adapter_luid: u64,
+    pub fence_handle: HANDLE,
+    pub texture_handles: Vec<HANDLE>,
+}
+
+/// wait_for_frame 的结果
+pub enum IpcMessage<'a> {
+    Frame(FrameData<'a>),
+    /// Must be answered with answer_shared_textures
+    SharedTextures(SharedTextureSetup),
+    Shutdown,
 }
 
 /// 编码后的数据包
-pub struct PacketData {
-    pub data: Vec<u8>,
+pub struct PacketData<'a> {
+    pub data: &'a [u8],
     pub timestamp_ns: u64,
     pub is_idr: bool,
+    pub encode_time_us: u32,
+    pub qp: Option<u8>,
+}
+
+/// 驱动设置的编码参数
+#[derive(Clone, Copy, Debug)]
+pub struct EncoderParams {
+    pub bitrate_bps: u64,
+    pub framerate: u32,
 }
 
 /// 像素格式
@@ -112,10 +252,20 @@ impl From<u8> for PixelFormat {
 /// IPC 管理器
 pub struct EncoderIpc {
     shared_memory: HANDLE,
-    shared_ptr: *mut SharedMemoryLayout,
+    /// Start of the mapping, the slots are found through layout
+    shared_ptr: *mut RingHeader,
+    layout: Layout,
     frame_ready_event: HANDLE,
     packet_ready_event: HANDLE,
     encoder_ready_event: HANDLE,
+    frame_free_event: HANDLE,
+    packet_free_event: HANDLE,
+    /// 下一个要读取的帧序号
+    next_frame: Cell<u64>,
+    /// 下一个要写入的数据包序号
+    next_packet: Cell<u64>,
+    /// 已应用的编码参数序号
+    params_sequence: Cell<u32>,
     width: u32,
     height: u32,
 }
@@ -124,15 +274,9 @@ impl EncoderIpc {
     pub fn new(width: u32, height: u32) -> Result<Self> {
         unsafe {
             // 创建共享内存
-            let mem_name = to_wide_string(SHARED_MEM_NAME);
-            let shared_memory = CreateFileMappingW(
-                HANDLE(-1isize as *mut c_void), // INVALID_HANDLE_VALUE
-                None,
-                PAGE_READWRITE,
-                0,
-                std::mem::size_of::<SharedMemoryLayout>() as u32,
-                PCWSTR(mem_name.as_ptr()),
-            ).context("Failed to create shared memory")?;
+            let layout = Layout::new(width, height);
+            let shared_memory = create_shared_memory(layout.size())
+                .context("Failed to create shared memory")?;
 
             let shared_ptr = MapViewOfFile(
                 shared_memory,
@@ -147,42 +291,58 @@ impl EncoderIpc {
             }
 
             // 创建事件
-            let frame_event_name = to_wide_string(FRAME_READY_EVENT);
-            let frame_ready_event = CreateEventW(
-                None,
-                false, // auto-reset
-                false, // initial state
-                PCWSTR(frame_event_name.as_ptr()),
-            ).context("Failed to create frame ready event")?;
-
-            let packet_event_name = to_wide_string(PACKET_READY_EVENT);
-            let packet_ready_event = CreateEventW(
-                None,
-                false,
-                false,
-                PCWSTR(packet_event_name.as_ptr()),
-            ).context("Failed to create packet ready event")?;
-
-            let encoder_event_name = to_wide_string(ENCODER_READY_EVENT);
-            let encoder_ready_event = CreateEventW(
-                None,
-                true, // manual-reset for encoder ready
-                false,
-                PCWSTR(encoder_event_name.as_ptr()),
-            ).context("Failed to create encoder ready event")?;
+            let frame_ready_event = create_event(FRAME_READY_EVENT, false)
+                .context("Failed to create frame ready event")?;
+            let packet_ready_event = create_event(PACKET_READY_EVENT, false)
+                .context("Failed to create packet ready event")?;
+            // manual-reset for encoder ready
+            let encoder_ready_event = create_event(ENCODER_READY_EVENT, true)
+                .context("Failed to create encoder ready event")?;
+            let frame_free_event = create_event(FRAME_FREE_EVENT, false)
+                .context("Failed to create frame free event")?;
+            let packet_free_event = create_event(PACKET_FREE_EVENT, false)
+                .context("Failed to create packet free event")?;
+
+            let shared_ptr = shared_ptr.Value as *mut RingHeader;
+            (*shared_ptr).encoder_pid = GetCurrentProcessId();
+            (*shared_ptr).width = width;
+            (*shared_ptr).height = height;
+            (*shared_ptr).frame_buffer_size = layout.frame_buffer_size as u64;
+            (*shared_ptr).packet_buffer_size = layout.packet_buffer_size as u64;
+
+            // 共享内存可能已被驱动打开, 从当前位置继续
+            let next_frame = (*shared_ptr).frame_read.load(Ordering::Acquire);
+            let next_packet = (*shared_ptr).packet_read.load(Ordering::Acquire);
+            let params_sequence = (*shared_ptr).params_sequence.load(Ordering::Acquire);
 
             Ok(Self {
                 shared_memory,
-                shared_ptr: shared_ptr.Value as *mut SharedMemoryLayout,
+                shared_ptr,
+                layout,
                 frame_ready_event,
                 packet_ready_event,
                 encoder_ready_event,
+                frame_free_event,
+                packet_free_event,
+                next_frame: Cell::new(next_frame),
+                next_packet: Cell::new(next_packet),
+                params_sequence: Cell::new(params_sequence),
                 width,
                 height,
             })
         }
     }
 
+    fn frame_slot(&self, index: u64) -> *mut FrameSlot {
+        let offset = self.layout.frame_slot_offset(index % FRAME_SLOT_COUNT);
+        unsafe { self.shared_ptr.cast::<u8>().add(offset).cast() }
+    }
+
+    fn packet_slot(&self, index: u64) -> *mut PacketSlot {
+        let offset = self.layout.packet_slot_offset(index % PACKET_SLOT_COUNT);
+        unsafe { self.shared_ptr.cast::<u8>().add(offset).cast() }
+    }
+
     /// 通知 ALVR 驱动编码器已就绪
     pub fn signal_encoder_ready(&self) -> Result<()> {
         unsafe {
@@ -192,28 +352,52 @@ impl EncoderIpc {
         Ok(())
     }
 
-    /// 等待帧数据
-    pub fn wait_for_frame(&self) -> Result<FrameData> {
+    /// 等待帧数据或驱动的请求
+    ///
+    /// The frame is read in place and must be handed back with release_frame
+    pub fn wait_for_frame(&self) -> Result<IpcMessage<'_>> {
         unsafe {
-            // 等待帧就绪事件
-            let result = WaitForSingleObject(self.frame_ready_event, INFINITE);
-            if result != WAIT_OBJECT_0 {
-                bail!("Wait for frame failed");
+            let ring = &*self.shared_ptr;
+            let next_frame = self.next_frame.get();
+            let slot_ptr = self.frame_slot(next_frame);
+            let slot = &*slot_ptr;
+
+            loop {
+                if ring.shutdown.load(Ordering::Acquire) != 0 {
+                    return Ok(IpcMessage::Shutdown);
+                }
+                if ring.shared_texture_state.load(Ordering::Acquire)
+                    == SharedTextureState::Requested as u32
+                {
+                    return Ok(IpcMessage::SharedTextures(SharedTextureSetup {
+                        adapter_luid: ring.adapter_luid,
+                        fence_handle: HANDLE(ring.fence_handle as *mut c_void),
+                        texture_handles: ring
+                            .texture_handles
+                            .iter()
+                            .map(|&handle| HANDLE(handle as *mut c_void))
+                            .collect(),
+                    }));
+                }
+                if slot.sequence.load(Ordering::Acquire) == next_frame + 1 {
+                    break;
+                }
+
+                // 等待帧就绪事件
+                let result = WaitForSingleObject(self.frame_ready_event, INFINITE);
+                if result != WAIT_OBJECT_0 {
+                    bail!("Wait for frame failed");
+                }
             }
 
-            // 读取帧头
-            let header = (*self.shared_ptr).frame_header;
-            
-            // 复制帧数据
-            let data_size = header.data_size as usize;
-            let mut data = vec![0u8; data_size];
-            ptr::copy_nonoverlapping(
-                (*self.shared_ptr).frame_buffer.as_ptr(),
-                data.as_mut_ptr(),
+            let header = slot.header;
+            let data_size = (header.data_size as usize).min(self.layout.frame_buffer_size);
+            let data = std::slice::from_raw_parts(
+                slot_ptr.cast::<u8>().add(SLOT_HEADER_SIZE),
                 data_size,
             );
 
-            Ok(FrameData {
+            Ok(IpcMessage::Frame(FrameData {
                 width: header.width,
                 height: header.height,
                 timestamp_ns: header.timestamp_ns,
@@ -221,29 +405,100 @@ impl EncoderIpc {
                 pixel_format: header.pixel_format.into(),
                 row_pitch: header.row_pitch,
                 data,
-                shutdown: header.shutdown != 0,
-            })
+                slot: (next_frame % FRAME_SLOT_COUNT) as usize,
+                fence_value: (header.shared_texture != 0).then_some(header.fence_value),
+            }))
+        }
+    }
+
+    /// 取出驱动更新的编码参数, 自上次调用后没有更新时返回 None
+    pub fn take_encoder_params(&self) -> Option<EncoderParams> {
+        let ring = unsafe { &*self.shared_ptr };
+        let sequence = ring.params_sequence.load(Ordering::Acquire);
+        if sequence == self.params_sequence.get() {
+            return None;
+        }
+        self.params_sequence.set(sequence);
+
+        let params = EncoderParams {
+            bitrate_bps: ring.bitrate_bps.load(Ordering::Relaxed),
+            framerate: ring.framerate.load(Ordering::Relaxed),
+        };
+        (params.bitrate_bps > 0 && params.framerate > 0).then_some(params)
+    }
+
+    /// 应答共享纹理请求
+    pub fn answer_shared_textures(&self, accepted: bool) {
+        let state = if accepted {
+            SharedTextureState::Accepted
+        } else {
+            SharedTextureState::Rejected
+        };
+        unsafe {
+            (*self.shared_ptr)
+                .shared_texture_state
+                .store(state as u32, Ordering::Release);
         }
     }
 
-    /// 发送编码后的数据包
-    pub fn send_packet(&mut self, packet: &PacketData) -> Result<()> {
+    /// 释放当前帧的槽位
+    pub fn release_frame(&self) -> Result<()> {
+        let next_frame = self.next_frame.get() + 1;
+        self.next_frame.set(next_frame);
         unsafe {
+            (*self.shared_ptr).frame_read.store(next_frame, Ordering::Release);
+            SetEvent(self.frame_free_event).context("Failed to signal frame free")?;
+        }
+        Ok(())
+    }
+
+    /// 发送编码后的数据包, 直接写入数据包环形缓冲区
+    pub fn send_packet(&self, packet: &PacketData) -> Result<()> {
+        if packet.data.len() > self.layout.packet_buffer_size {
+            bail!("Packet too large: {}", packet.data.len());
+        }
+
+        unsafe {
+            // The frame being encoded is still borrowed, so only the packet slot is borrowed
+            // mutably
+            let ring = &*self.shared_ptr;
+            let next_packet = self.next_packet.get();
+
+            // 等待空闲的数据包槽位
+            while next_packet - ring.packet_read.load(Ordering::Acquire) >= PACKET_SLOT_COUNT {
+                if ring.shutdown.load(Ordering::Acquire) != 0 {
+                    bail!("Shutting down");
+                }
+                let result = WaitForSingleObject(self.packet_free_event, PACKET_FREE_TIMEOUT_MS);
+                if result != WAIT_OBJECT_0 {
+                    bail!("Timed out waiting for a free packet slot");
+                }
+            }
+
+            let slot_ptr = self.packet_slot(next_packet);
+            let slot = &mut *slot_ptr;
+
             // 写入数据包头
-            (*self.shared_ptr).packet_header = PacketHeader {
-                size: packet.data.len() as u32,
+            slot.header = PacketHeader {
                 timestamp_ns: packet.timestamp_ns,
+                size: packet.data.len() as u32,
+                encode_time_us: packet.encode_time_us,
                 is_idr: if packet.is_idr { 1 } else { 0 },
-                _padding: [0; 3],
+                qp: packet.qp.unwrap_or(UNKNOWN_QP),
+                _padding: [0; 6],
             };
 
             // 复制数据包数据
             ptr::copy_nonoverlapping(
                 packet.data.as_ptr(),
-                (*self.shared_ptr).packet_buffer.as_mut_ptr(),
+                slot_ptr.cast::<u8>().add(SLOT_HEADER_SIZE),
                 packet.data.len(),
             );
 
+            // 发布槽位
+            self.next_packet.set(next_packet + 1);
+            slot.sequence.store(next_packet + 1, Ordering::Release);
+
             // 通知数据包就绪
             SetEvent(self.packet_ready_event)
                 .context("Failed to signal packet ready")?;
@@ -272,8 +527,69 @@ impl Drop for EncoderIpc {
             if !self.encoder_ready_event.is_invalid() {
                 let _ = CloseHandle(self.encoder_ready_event);
             }
+            if !self.frame_free_event.is_invalid() {
+                let _ = CloseHandle(self.frame_free_event);
+            }
+            if !self.packet_free_event.is_invalid() {
+                let _ = CloseHandle(self.packet_free_event);
+            }
+        }
+    }
+}
+
+/// 创建共享内存, backed by large pages when the account may lock pages in memory. Fewer TLB
+/// misses for the copy of every frame in and out of it
+unsafe fn create_shared_memory(size: usize) -> windows::core::Result<HANDLE> {
+    let mem_name = to_wide_string(SHARED_MEM_NAME);
+    let create = |size: usize, flags| {
+        CreateFileMappingW(
+            HANDLE(-1isize as *mut c_void), // INVALID_HANDLE_VALUE
+            None,
+            flags,
+            (size as u64 >> 32) as u32,
+            size as u32,
+            PCWSTR(mem_name.as_ptr()),
+        )
+    };
+
+    let large_page_size = GetLargePageMinimum();
+    if large_page_size > 0 && enable_lock_memory_privilege() {
+        let flags = PAGE_READWRITE | SEC_COMMIT | SEC_LARGE_PAGES;
+        match create(align_up(size, large_page_size), flags) {
+            Ok(handle) => {
+                info!("Shared memory backed by {} KB pages", large_page_size / 1024);
+                return Ok(handle);
+            }
+            Err(e) => debug!("Large pages not available: {e}"),
         }
     }
+    create(size, PAGE_READWRITE)
+}
+
+/// Large pages need SeLockMemoryPrivilege, which the account must have been granted
+unsafe fn enable_lock_memory_privilege() -> bool {
+    let mut token = HANDLE::default();
+    if OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &mut token).is_err() {
+        return false;
+    }
+    let mut privileges = TOKEN_PRIVILEGES {
+        PrivilegeCount: 1,
+        ..Default::default()
+    };
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    let luid = &mut privileges.Privileges[0].Luid;
+    let mut enabled = LookupPrivilegeValueW(PCWSTR::null(), SE_LOCK_MEMORY_NAME, luid).is_ok()
+        && AdjustTokenPrivileges(token, false, Some(&privileges), 0, None, None).is_ok();
+    // AdjustTokenPrivileges succeeds without assigning it when the account doesn't hold it
+    enabled = enabled && GetLastError().is_ok();
+    let _ = CloseHandle(token);
+    enabled
+}
+
+/// 创建命名事件
+unsafe fn create_event(name: &str, manual_reset: bool) -> windows::core::Result<HANDLE> {
+    let name = to_wide_string(name);
+    CreateEventW(None, manual_reset, false, PCWSTR(name.as_ptr()))
 }
 
 /// 转换为 Windows 宽字符串
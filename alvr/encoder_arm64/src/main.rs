@@ -5,10 +5,13 @@
 
 mod encoder;
 mod ipc;
+mod shared_texture;
 
 use anyhow::{Context, Result};
-use ipc::{EncoderIpc, FrameData, PacketData};
-use tracing::{error, info, Level};
+use encoder::HwVideoEncoder;
+use ipc::{EncoderIpc, IpcMessage};
+use shared_texture::SharedTextures;
+use tracing::{debug, error, info, Level};
 use tracing_subscriber::FmtSubscriber;
 
 /// 共享内存名称前缀
@@ -19,6 +22,10 @@ pub const FRAME_READY_EVENT: &str = "ALVR_ARM64_FRAME_READY";
 pub const PACKET_READY_EVENT: &str = "ALVR_ARM64_PACKET_READY";
 /// 编码器就绪事件名称
 pub const ENCODER_READY_EVENT: &str = "ALVR_ARM64_ENCODER_READY";
+/// 帧槽位释放事件名称
+pub const FRAME_FREE_EVENT: &str = "ALVR_ARM64_FRAME_FREE";
+/// 数据包槽位释放事件名称
+pub const PACKET_FREE_EVENT: &str = "ALVR_ARM64_PACKET_FREE";
 
 fn main() -> Result<()> {
     // 初始化日志
@@ -37,7 +44,7 @@ fn main() -> Result<()> {
     info!("Encoder config: {}x{}, codec: {}", width, height, codec);
     
     // 初始化 IPC
-    let mut ipc = EncoderIpc::new(width, height)
+    let ipc = EncoderIpc::new(width, height)
         .context("Failed to initialize IPC")?;
     
     info!("IPC initialized, waiting for frames...");
@@ -51,32 +58,70 @@ fn main() -> Result<()> {
     // 通知 ALVR 驱动编码器已就绪
     ipc.signal_encoder_ready()?;
     
+    // 共享纹理模式下的硬件编码器, 由驱动请求时创建
+    let mut shared_encoder: Option<(SharedTextures, HwVideoEncoder)> = None;
+
     // 主循环
     loop {
         // 等待帧数据
         match ipc.wait_for_frame() {
-            Ok(frame_data) => {
-                // 检查是否收到退出信号
-                if frame_data.shutdown {
-                    info!("Received shutdown signal, exiting...");
-                    break;
+            Ok(IpcMessage::Frame(frame_data)) => {
+                // 应用驱动的自适应码率
+                if let Some(params) = ipc.take_encoder_params() {
+                    debug!("Encoder params: {} bps, {} fps", params.bitrate_bps, params.framerate);
+                    video_encoder.set_params(&params);
+                    if let Some((_, hw_encoder)) = shared_encoder.as_mut() {
+                        hw_encoder.set_params(&params);
+                    }
+                }
+
+                // 编码帧, 数据包直接写入共享内存
+                let result = match (frame_data.fence_value, shared_encoder.as_mut()) {
+                    (Some(fence_value), Some((shared, hw_encoder))) => {
+                        shared.wait(fence_value).and_then(|_| {
+                            hw_encoder.encode_texture(
+                                &shared.textures[frame_data.slot],
+                                &frame_data,
+                                |packet| ipc.send_packet(packet),
+                            )
+                        })
+                    }
+                    (Some(_), None) => Err(anyhow::anyhow!("Shared frame without shared textures")),
+                    (None, _) => {
+                        video_encoder.encode_frame(&frame_data, |packet| ipc.send_packet(packet))
+                    }
+                };
+                if let Err(e) = result {
+                    error!("Encoding failed: {}", e);
                 }
-                
-                // 编码帧
-                match video_encoder.encode_frame(&frame_data) {
-                    Ok(packets) => {
-                        // 发送编码后的数据包
-                        for packet in packets {
-                            if let Err(e) = ipc.send_packet(&packet) {
-                                error!("Failed to send packet: {}", e);
-                            }
-                        }
+
+                // 编码器已复制输入帧, 释放槽位
+                if let Err(e) = ipc.release_frame() {
+                    error!("Failed to release frame: {}", e);
+                }
+            }
+            Ok(IpcMessage::SharedTextures(setup)) => {
+                let result = SharedTextures::open(&setup).and_then(|shared| {
+                    let hw_encoder = HwVideoEncoder::new(width, height, codec, &shared.device)?;
+                    Ok((shared, hw_encoder))
+                });
+                match result {
+                    Ok(encoder) => {
+                        info!("Shared textures opened, using the hardware encoder");
+                        shared_encoder = Some(encoder);
+                        ipc.answer_shared_textures(true);
                     }
                     Err(e) => {
-                        error!("Encoding failed: {}", e);
+                        error!("Failed to set up shared textures: {:#}", e);
+                        ipc.answer_shared_textures(false);
                     }
                 }
             }
+            Ok(IpcMessage::Shutdown) => {
+                // 收到退出信号
+                info!("Received shutdown signal, exiting...");
+                break;
+            }
             Err(e) => {
                 error!("Failed to receive frame: {}", e);
                 // 短暂等待后重试
@@ -84,7 +129,7 @@ fn main() -> Result<()> {
             }
         }
     }
-    
+
     info!("ALVR ARM64 Encoder shutting down");
     Ok(())
 }
@@ -0,0 +1,121 @@
+//! 共享纹理模块 - 打开驱动共享的 D3D11 纹理和栅栏
+//!
+//! The driver copies each frame into the shared texture of its ring slot and signals the fence,
+//! so the frames reach the hardware encoder without a readback.
+
+use anyhow::{bail, Context, Result};
+use windows::core::{Interface, PCWSTR};
+use windows::Win32::Foundation::{CloseHandle, HANDLE, LUID, WAIT_OBJECT_0};
+use windows::Win32::Graphics::Direct3D::D3D_DRIVER_TYPE_UNKNOWN;
+use windows::Win32::Graphics::Direct3D11::{
+    D3D11CreateDevice, ID3D11Device, ID3D11Device1, ID3D11Device5, ID3D11Fence, ID3D11Texture2D,
+    D3D11_CREATE_DEVICE_BGRA_SUPPORT, D3D11_CREATE_DEVICE_VIDEO_SUPPORT, D3D11_SDK_VERSION,
+};
+use windows::Win32::Graphics::Dxgi::{CreateDXGIFactory1, IDXGIAdapter, IDXGIFactory4};
+use windows::Win32::System::Threading::{CreateEventW, WaitForSingleObject};
+
+use crate::ipc::SharedTextureSetup;
+
+/// 等待栅栏的超时
+const FENCE_TIMEOUT_MS: u32 = 1000;
+
+pub struct SharedTextures {
+    pub device: ID3D11Device,
+    pub textures: Vec<ID3D11Texture2D>,
+    fence: ID3D11Fence,
+    fence_event: HANDLE,
+}
+
+impl SharedTextures {
+    /// 在驱动使用的适配器上打开共享资源
+    ///
+    /// The handles were duplicated into this process and are closed here in any case
+    pub fn open(setup: &SharedTextureSetup) -> Result<Self> {
+        let result = unsafe { Self::open_handles(setup) };
+
+        unsafe {
+            let _ = CloseHandle(setup.fence_handle);
+            for &handle in &setup.texture_handles {
+                let _ = CloseHandle(handle);
+            }
+        }
+
+        result
+    }
+
+    unsafe fn open_handles(setup: &SharedTextureSetup) -> Result<Self> {
+        let factory: IDXGIFactory4 = CreateDXGIFactory1().context("Failed to create DXGI factory")?;
+        let luid = LUID {
+            LowPart: setup.adapter_luid as u32,
+            HighPart: (setup.adapter_luid >> 32) as i32,
+        };
+        let adapter: IDXGIAdapter = factory
+            .EnumAdapterByLuid(luid)
+            .context("Driver adapter not found")?;
+
+        let mut device = None;
+        D3D11CreateDevice(
+            &adapter,
+            D3D_DRIVER_TYPE_UNKNOWN,
+            None,
+            D3D11_CREATE_DEVICE_VIDEO_SUPPORT | D3D11_CREATE_DEVICE_BGRA_SUPPORT,
+            None,
+            D3D11_SDK_VERSION,
+            Some(&mut device),
+            None,
+            None,
+        )
+        .context("Failed to create D3D11 device")?;
+        let device = device.context("No D3D11 device")?;
+
+        let device1: ID3D11Device1 = device.cast()?;
+        let device5: ID3D11Device5 = device.cast().context("ID3D11Device5 not supported")?;
+
+        let mut textures = Vec::new();
+        for &handle in &setup.texture_handles {
+            let texture: ID3D11Texture2D = device1
+                .OpenSharedResource1(handle)
+                .context("Failed to open shared texture")?;
+            textures.push(texture);
+        }
+
+        let fence: ID3D11Fence = device5
+            .OpenSharedFence(setup.fence_handle)
+            .context("Failed to open shared fence")?;
+
+        let fence_event =
+            CreateEventW(None, false, false, PCWSTR::null()).context("Failed to create event")?;
+
+        Ok(Self {
+            device,
+            textures,
+            fence,
+            fence_event,
+        })
+    }
+
+    /// 等待驱动的复制完成
+    pub fn wait(&self, fence_value: u64) -> Result<()> {
+        unsafe {
+            if self.fence.GetCompletedValue() >= fence_value {
+                return Ok(());
+            }
+
+            self.fence
+                .SetEventOnCompletion(fence_value, self.fence_event)
+                .context("Failed to wait for the fence")?;
+            if WaitForSingleObject(self.fence_event, FENCE_TIMEOUT_MS) != WAIT_OBJECT_0 {
+                bail!("Timed out waiting for fence value {}", fence_value);
+            }
+        }
+        Ok(())
+    }
+}
+
+impl Drop for SharedTextures {
+    fn drop(&mut self) {
+        unsafe {
+            let _ = CloseHandle(self.fence_event);
+        }
+    }
+}
@@ -16,6 +16,28 @@ pub struct StatisticsSummary {
     pub decode_latency_ms: f32,
     pub client_fps: u32,
     pub server_fps: u32,
+    pub server_missed_vsyncs_total: usize,
+    pub server_missed_vsyncs_per_sec: f32,
+    pub server_frames_without_pose_total: usize,
+    pub server_frames_without_pose_per_sec: f32,
+    pub server_idrs_total: usize,
+    pub server_idrs_per_sec: f32,
+    pub server_acquire_sync_failures_total: usize,
+    pub server_static_frames_skipped_total: usize,
+    pub server_static_frames_skipped_per_sec: f32,
+    pub server_duplicate_frames_total: usize,
+    pub server_duplicate_frames_per_sec: f32,
+    // Frames already waiting in the send queue when a frame is added to it, None when the queue
+    // is disabled
+    pub server_send_queue_average_depth: Option<f32>,
+    pub server_send_queue_dropped_frames_total: usize,
+    pub server_send_queue_dropped_frames_per_sec: f32,
+    pub encoder_output_mbits_per_sec: f32,
+    // Highest GPU utilization since the last summary, None when the GPU doesn't report it
+    pub gpu_graphics_peak_percent: Option<f32>,
+    pub gpu_encoder_peak_percent: Option<f32>,
+    pub gpu_pcie_rx_peak_mbytes_per_sec: Option<f32>,
+    pub gpu_pcie_tx_peak_mbytes_per_sec: Option<f32>,
     pub battery_hmd: u32,
     pub hmd_plugged: bool,
 }
@@ -30,6 +52,11 @@ pub struct BitrateDirectives {
     pub manual_max_throughput_bps: Option<f32>,
     pub manual_min_throughput_bps: Option<f32>,
     pub requested_bitrate_bps: f32,
+    // Over the last frames, when the encoder reports it
+    pub encoder_average_qp: Option<f32>,
+    // Of the sampled reconstructed frames, in dB and from 0 to 1
+    pub encoder_psnr: Option<f32>,
+    pub encoder_ssim: Option<f32>,
 }
 
 #[derive(Serialize, Deserialize, Clone, Debug, Default)]
@@ -48,6 +75,24 @@ pub struct GraphStatistics {
     pub bitrate_directives: BitrateDirectives,
     pub throughput_bps: f32,
     pub bitrate_bps: f32,
+    // Last GPU sample, None when the GPU doesn't report it
+    pub gpu_graphics_percent: Option<f32>,
+    pub gpu_encoder_percent: Option<f32>,
+}
+
+// Frames per latency bucket of one stage of the driver
+#[derive(Serialize, Deserialize, Clone, Debug, Default)]
+pub struct FrameStageHistogram {
+    pub name: String,
+    pub counts: Vec<u32>,
+}
+
+// Per-stage latencies of the frames traced since the previous report. The last bucket also counts
+// the frames above it
+#[derive(Serialize, Deserialize, Clone, Debug, Default)]
+pub struct FrameStageStatistics {
+    pub bucket_width_s: f32,
+    pub stages: Vec<FrameStageHistogram>,
 }
 
 #[derive(Serialize, Deserialize, Clone, Debug)]
@@ -84,6 +129,7 @@ pub enum EventType {
     Session(Box<SessionConfig>),
     StatisticsSummary(StatisticsSummary),
     GraphStatistics(GraphStatistics),
+    FrameStageStatistics(FrameStageStatistics),
     Tracking(Box<TrackingEvent>),
     Buttons(Vec<ButtonEvent>),
     Haptics(HapticsEvent),
@@ -112,6 +158,7 @@ impl Event {
             EventType::Session(_) => "SESSION".to_string(),
             EventType::StatisticsSummary(_) => "STATS".to_string(),
             EventType::GraphStatistics(_) => "GRAPH".to_string(),
+            EventType::FrameStageStatistics(_) => "STAGES".to_string(),
             EventType::Tracking(_) => "TRACKING".to_string(),
             EventType::Buttons(_) => "BUTTONS".to_string(),
             EventType::Haptics(_) => "HAPTICS".to_string(),
@@ -127,7 +174,9 @@ impl Event {
             EventType::Log(log_entry) => log_entry.content.clone(),
             EventType::DebugGroup { message, .. } => message.clone(),
             EventType::Session(_) => "Updated".into(),
-            EventType::StatisticsSummary(_) | EventType::GraphStatistics(_) => "".into(),
+            EventType::StatisticsSummary(_)
+            | EventType::GraphStatistics(_)
+            | EventType::FrameStageStatistics(_) => "".into(),
             EventType::Tracking(tracking) => serde_json::to_string(tracking).unwrap(),
             EventType::Buttons(buttons) => serde_json::to_string(buttons).unwrap(),
             EventType::Haptics(haptics) => serde_json::to_string(haptics).unwrap(),
@@ -39,12 +39,17 @@ override B_RIGHT_Y: f32 = 0.0;
 override C_RIGHT_X: f32 = 0.0;
 override C_RIGHT_Y: f32 = 0.0;
 
+override ENABLE_RADIAL_FFE: bool = false;
+override RADIAL_SCALE: f32 = 0.0;
+override RADIAL_CENTER: f32 = 0.0;
+override RADIAL_CURVE: f32 = 0.0;
+
 struct PushConstant {
     reprojection_transform: mat4x4f,
     view_idx: u32,
     passthrough_mode: u32, // 0: Blend, 1: RGB chroma key, 2: HSV chroma key
     blend_alpha: f32,
-    _align: u32,
+    lens_center: u32, // packed 2x16 unorm, in the eye UV mirrored for the right eye
     ck_channel0: vec4f,
     ck_channel1: vec4f,
     ck_channel2: vec4f,
@@ -76,46 +81,65 @@ fn fragment_main(@location(0) uv: vec2f) -> @location(0) vec4f {
     var upscale_source_resolution = 1.0;
     if ENABLE_FFE {
         let view_size_ratio = vec2f(VIEW_WIDTH_RATIO, VIEW_HEIGHT_RATIO);
-        let edge_ratio = vec2f(EDGE_X_RATIO, EDGE_Y_RATIO);
-
-        let c1 = vec2f(C1_X, C1_Y);
-        let c2 = vec2f(C2_X, C2_Y);
-        let lo_bound = vec2f(LO_BOUND_X, LO_BOUND_Y);
-        let hi_bound = vec2f(HI_BOUND_X, HI_BOUND_Y);
-
-        let a_left = vec2f(A_LEFT_X, A_LEFT_Y);
-        let b_left = vec2f(B_LEFT_X, B_LEFT_Y);
-
-        let a_right = vec2f(A_RIGHT_X, A_RIGHT_Y);
-        let b_right = vec2f(B_RIGHT_X, B_RIGHT_Y);
-        let c_right = vec2f(C_RIGHT_X, C_RIGHT_Y);
 
         if pc.view_idx == 1 {
             corrected_uv.x = 1.0 - corrected_uv.x;
         }
 
-        let center = (corrected_uv - c1) * edge_ratio / c2;
-        let left_edge = (-b_left + sqrt(b_left * b_left + 4.0 * a_left * corrected_uv)) / (2.0 * a_left);
-        let right_edge = (-b_right + sqrt(b_right * b_right - 4.0 * (c_right - a_right * corrected_uv))) / (2.0 * a_right);
-
-        if corrected_uv.x < lo_bound.x {
-            corrected_uv.x = left_edge.x;
-            upscale_source_resolution = upscale_source_resolution * edge_ratio.x;
-        } else if corrected_uv.x > hi_bound.x {
-            corrected_uv.x = right_edge.x;
-            upscale_source_resolution = upscale_source_resolution * edge_ratio.x;
-        } else {
-            corrected_uv.x = center.x;
-        }
-
-        if corrected_uv.y < lo_bound.y {
-            corrected_uv.y = left_edge.y;
-            upscale_source_resolution = upscale_source_resolution * edge_ratio.y;
-        } else if corrected_uv.y > hi_bound.y {
-            corrected_uv.y = right_edge.y;
-            upscale_source_resolution = upscale_source_resolution * edge_ratio.y;
+        if ENABLE_RADIAL_FFE {
+            // Inverse of the compression around the lens center of the server. Distances are
+            // relative to the distance from the lens center to the edge of the eye on each side
+            let lens_center = unpack2x16unorm(pc.lens_center);
+            let extent = select(1.0 - lens_center, lens_center, corrected_uv < lens_center);
+            let offset = (corrected_uv - lens_center) / extent;
+            let radius = length(offset);
+
+            var compressed_radius = radius / RADIAL_SCALE;
+            if RADIAL_CURVE > 0.0 && radius > RADIAL_SCALE * RADIAL_CENTER {
+                let discriminant = RADIAL_SCALE * RADIAL_SCALE + 4.0 * RADIAL_CURVE * (radius - RADIAL_SCALE * RADIAL_CENTER);
+                compressed_radius = RADIAL_CENTER + (sqrt(discriminant) - RADIAL_SCALE) / (2.0 * RADIAL_CURVE);
+                upscale_source_resolution = 1.0 + 2.0 * RADIAL_CURVE * (compressed_radius - RADIAL_CENTER) / RADIAL_SCALE;
+            }
+
+            corrected_uv = lens_center + offset * (compressed_radius / max(radius, 1e-6)) * extent;
         } else {
-            corrected_uv.y = center.y;
+            let edge_ratio = vec2f(EDGE_X_RATIO, EDGE_Y_RATIO);
+
+            let c1 = vec2f(C1_X, C1_Y);
+            let c2 = vec2f(C2_X, C2_Y);
+            let lo_bound = vec2f(LO_BOUND_X, LO_BOUND_Y);
+            let hi_bound = vec2f(HI_BOUND_X, HI_BOUND_Y);
+
+            let a_left = vec2f(A_LEFT_X, A_LEFT_Y);
+            let b_left = vec2f(B_LEFT_X, B_LEFT_Y);
+
+            let a_right = vec2f(A_RIGHT_X, A_RIGHT_Y);
+            let b_right = vec2f(B_RIGHT_X, B_RIGHT_Y);
+            let c_right = vec2f(C_RIGHT_X, C_RIGHT_Y);
+
+            let center = (corrected_uv - c1) * edge_ratio / c2;
+            let left_edge = (-b_left + sqrt(b_left * b_left + 4.0 * a_left * corrected_uv)) / (2.0 * a_left);
+            let right_edge = (-b_right + sqrt(b_right * b_right - 4.0 * (c_right - a_right * corrected_uv))) / (2.0 * a_right);
+
+            if corrected_uv.x < lo_bound.x {
+                corrected_uv.x = left_edge.x;
+                upscale_source_resolution = upscale_source_resolution * edge_ratio.x;
+            } else if corrected_uv.x > hi_bound.x {
+                corrected_uv.x = right_edge.x;
+                upscale_source_resolution = upscale_source_resolution * edge_ratio.x;
+            } else {
+                corrected_uv.x = center.x;
+            }
+
+            if corrected_uv.y < lo_bound.y {
+                corrected_uv.y = left_edge.y;
+                upscale_source_resolution = upscale_source_resolution * edge_ratio.y;
+            } else if corrected_uv.y > hi_bound.y {
+                corrected_uv.y = right_edge.y;
+                upscale_source_resolution = upscale_source_resolution * edge_ratio.y;
+            } else {
+                corrected_uv.y = center.y;
+            }
         }
 
         corrected_uv = corrected_uv * view_size_ratio;
@@ -3,7 +3,10 @@ use alvr_common::{
     ViewParams,
     glam::{self, Mat4, UVec2, Vec3, Vec4},
 };
-use alvr_session::{FoveatedEncodingConfig, PassthroughMode, UpscalingConfig};
+use alvr_session::{
+    FoveatedEncodingConfig, PassthroughMode, RadialFoveationConfig, UpscalingConfig,
+    settings_schema::Switch,
+};
 use std::{ffi::c_void, iter, mem, rc::Rc};
 use wgpu::{
     BindGroup, BindGroupDescriptor, BindGroupEntry, BindGroupLayoutDescriptor,
@@ -24,7 +27,8 @@ const TRANSFORM_CONST_OFFSET: u32 = 0;
 const VIEW_INDEX_CONST_OFFSET: u32 = TRANSFORM_SIZE;
 const PASSTHROUGH_MODE_OFFSET: u32 = VIEW_INDEX_CONST_OFFSET + U32_SIZE;
 const ALPHA_CONST_OFFSET: u32 = PASSTHROUGH_MODE_OFFSET + U32_SIZE;
-const CK_CHANNEL0_CONST_OFFSET: u32 = ALPHA_CONST_OFFSET + FLOAT_SIZE + U32_SIZE;
+const LENS_CENTER_CONST_OFFSET: u32 = ALPHA_CONST_OFFSET + FLOAT_SIZE;
+const CK_CHANNEL0_CONST_OFFSET: u32 = LENS_CENTER_CONST_OFFSET + U32_SIZE;
 const CK_CHANNEL1_CONST_OFFSET: u32 = CK_CHANNEL0_CONST_OFFSET + VEC4_SIZE;
 const CK_CHANNEL2_CONST_OFFSET: u32 = CK_CHANNEL1_CONST_OFFSET + VEC4_SIZE;
 const PUSH_CONSTANTS_SIZE: u32 = CK_CHANNEL2_CONST_OFFSET + VEC4_SIZE;
@@ -303,6 +307,18 @@ impl StreamRenderer {
                         -1.0,
                     ))
                     * Mat4::from_scale(Vec3::new(width, height, 1.));
+            // Where the view direction is straight ahead, the radial foveated encoding is centered
+            // there. Like the server, the right eye is mirrored
+            let lens_center_x = -tanl / width;
+            let lens_center = glam::vec2(
+                if view_idx == 1 {
+                    1.0 - lens_center_x
+                } else {
+                    lens_center_x
+                },
+                tanu / height,
+            );
+
             let view_mat = output_mat4.inverse() * input_mat4;
             let proj_mat = super::projection_from_fov(view_params.output_view_params.fov);
 
@@ -325,6 +341,11 @@ impl StreamRenderer {
                 VIEW_INDEX_CONST_OFFSET,
                 &(view_idx as u32).to_le_bytes(),
             );
+            render_pass.set_push_constants(
+                ShaderStages::VERTEX_FRAGMENT,
+                LENS_CENTER_CONST_OFFSET,
+                &pack_unorm_2x16(lens_center).to_le_bytes(),
+            );
             render_pass.set_bind_group(0, &self.views_objects[view_idx].bind_group, &[]);
             set_passthrough_push_constants(&mut render_pass, passthrough);
             render_pass.draw(0..4, 0..1);
@@ -437,12 +458,57 @@ fn set_passthrough_push_constants(render_pass: &mut RenderPass, config: Option<&
     }
 }
 
+// Same packing as unpack2x16unorm() of WGSL
+fn pack_unorm_2x16(value: glam::Vec2) -> u32 {
+    let value = (value.clamp(glam::Vec2::ZERO, glam::Vec2::ONE) * 65535.0).round();
+    value.x as u32 | ((value.y as u32) << 16)
+}
+
+// Scale of the encoded eye, distance from the lens center where the compression starts and
+// curvature of the compression after it. The distances are relative to the distance from the
+// lens center to the edge of the eye, along each axis. Same as FFR.cpp of the server
+fn radial_foveation_params(config: &RadialFoveationConfig) -> (f32, f32, f32) {
+    let center_radius = config.center_radius.clamp(0.0, 0.9);
+    let edge_ratio = config.edge_ratio.max(1.0);
+
+    // Past the center the compression grows linearly to edge_ratio at the edges of the eye
+    let scale = (2.0 + (edge_ratio - 1.0) * center_radius) / (edge_ratio + 1.0);
+    let center = center_radius / scale;
+    let curve = (1.0 - scale) / ((1.0 - center) * (1.0 - center));
+
+    (scale, center, curve)
+}
+
 pub fn foveated_encoding_shader_constants(
     expanded_view_resolution: UVec2,
     config: FoveatedEncodingConfig,
 ) -> (UVec2, Vec<(&'static str, f64)>) {
     let view_resolution = expanded_view_resolution.as_vec2();
 
+    if let Switch::Enabled(radial) = &config.radial {
+        let (scale, center, curve) = radial_foveation_params(radial);
+
+        let optimized_view_resolution = scale * view_resolution;
+        let optimized_view_resolution_aligned =
+            optimized_view_resolution.map(|v| (v / 32.).ceil() * 32.);
+        let view_ratio_aligned = optimized_view_resolution / optimized_view_resolution_aligned;
+
+        let constants = [
+            ("ENABLE_FFE", 1.),
+            ("ENABLE_RADIAL_FFE", 1.),
+            ("VIEW_WIDTH_RATIO", view_ratio_aligned.x),
+            ("VIEW_HEIGHT_RATIO", view_ratio_aligned.y),
+            ("RADIAL_SCALE", scale),
+            ("RADIAL_CENTER", center),
+            ("RADIAL_CURVE", curve),
+        ]
+        .iter()
+        .map(|(k, v)| (*k, *v as f64))
+        .collect();
+
+        return (optimized_view_resolution_aligned.as_uvec2(), constants);
+    }
+
     let center_size = glam::vec2(config.center_size_x, config.center_size_y);
     let center_shift = glam::vec2(config.center_shift_x, config.center_shift_y);
     let edge_ratio = glam::vec2(config.edge_ratio_x, config.edge_ratio_y);
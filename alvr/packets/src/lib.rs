@@ -22,9 +22,10 @@ pub const AUDIO: u16 = 2;
 pub const VIDEO: u16 = 3;
 pub const STATISTICS: u16 = 4;
 
-#[derive(Serialize, Deserialize, Clone)]
+#[derive(Serialize, Deserialize, Clone, Default)]
 pub struct VideoStreamingCapabilitiesExt {
-    // Nothing for now
+    // Tile columns and rows the decoder decodes in parallel, if the client knows them
+    pub decoder_tiles: Option<UVec2>,
 }
 
 #[derive(Serialize, Deserialize, Clone)]
@@ -52,11 +53,14 @@ impl VideoStreamingCapabilities {
     }
 
     pub fn ext(&self) -> Result<VideoStreamingCapabilitiesExt> {
-        let _ext_json = json::from_str::<json::Value>(&self.ext_str)?;
+        let ext_json = json::from_str::<json::Value>(&self.ext_str)?;
 
-        // decode values here
+        // Values the client doesn't send are left unset
+        let decoder_tiles = ext_json
+            .get("decoder_tiles")
+            .and_then(|value| json::from_value(value.clone()).ok());
 
-        Ok(VideoStreamingCapabilitiesExt {})
+        Ok(VideoStreamingCapabilitiesExt { decoder_tiles })
     }
 }
 
@@ -74,9 +78,10 @@ pub enum ClientConnectionResult {
     ClientStandby,
 }
 
-#[derive(Serialize, Deserialize)]
+#[derive(Serialize, Deserialize, Default)]
 pub struct NegotiatedStreamingConfigExt {
-    // Nothing for now
+    // The foveated encoding compresses around the lens center rather than along each axis
+    pub radial_foveation: bool,
 }
 
 #[derive(Serialize, Deserialize, Clone)]
@@ -100,11 +105,15 @@ impl NegotiatedStreamingConfig {
     }
 
     pub fn ext(&self) -> Result<NegotiatedStreamingConfigExt> {
-        let _ext_json = json::from_str::<json::Value>(&self.ext_str)?;
+        let ext_json = json::from_str::<json::Value>(&self.ext_str)?;
 
-        // decode values here
+        // Values the server doesn't send are left unset
+        let radial_foveation = ext_json
+            .get("radial_foveation")
+            .and_then(|value| value.as_bool())
+            .unwrap_or(false);
 
-        Ok(NegotiatedStreamingConfigExt {})
+        Ok(NegotiatedStreamingConfigExt { radial_foveation })
     }
 }
 
@@ -198,6 +207,10 @@ pub enum ClientControlPacket {
         message: String,
     },
     ProximityState(bool),
+    // Sent instead of RequestIdr when the frames after last_received_timestamp are incomplete
+    VideoFramesLost {
+        last_received_timestamp: Duration,
+    },
     Reserved(String),
     ReservedBuffer(Vec<u8>),
 }
@@ -236,6 +249,11 @@ pub struct VideoPacketHeader {
     pub timestamp: Duration,
     pub global_view_params: [ViewParams; 2],
     pub is_idr: bool,
+    // False for all but the last slice, when a frame is sent before being fully encoded
+    pub is_last_slice: bool,
+    // The server encodes one composited frame in this many. The client reprojects the previous
+    // frame at the vsyncs in between instead of waiting for one
+    pub framerate_divider: u8,
 }
 
 #[derive(Serialize, Deserialize)]
@@ -9,10 +9,39 @@ use std::{
 };
 
 const UPDATE_INTERVAL: Duration = Duration::from_secs(1);
+// Above this share of intra coded pixels, a frame that isn't an IDR is taken for a scene cut
+const SCENE_CUT_INTRA_RATIO: f32 = 0.5;
+// Network samples of the new content to wait for before updating the bitrate after a scene cut
+const SCENE_CUT_SAMPLES: usize = 5;
+// The frame size cap leaves the encoder this many average frames at least, below that it would
+// starve the rate control instead of bounding the spikes
+const MIN_FRAME_SIZE_CAP_FRAMES: f32 = 2.0;
+// With a constant bitrate the encoder is only updated for the cap once it moved by this share
+const FRAME_SIZE_CAP_UPDATE_RATIO: f32 = 0.25;
+// The full framerate is restored this far above the decimation bitrate, so that a bitrate that
+// wobbles around it doesn't switch the framerate at each update
+const FRAMERATE_DECIMATION_HYSTERESIS: f32 = 1.25;
 
 pub struct DynamicEncoderParams {
     pub bitrate_bps: f32,
+    // Of the encoded frames, a fraction of the composited ones with the framerate decimation
     pub framerate: f32,
+    // No frame is larger, so that none takes longer than a frame interval to transmit
+    pub max_frame_bytes: Option<u32>,
+}
+
+// Statistics the encoder reports for each frame, None for the ones it doesn't provide
+pub struct EncoderStats {
+    // In the quantizer scale of the codec, the q index for AV1
+    pub average_qp: Option<f32>,
+    // Share of the picture coded intra
+    pub intra_ratio: Option<f32>,
+    // The frame alone didn't fit in the VBV buffer of the rate control
+    pub vbv_overflow: bool,
+    // Of the reconstructed frame against the input, in dB and from 0 to 1. Only measured on some
+    // frames
+    pub psnr: Option<f32>,
+    pub ssim: Option<f32>,
 }
 
 pub struct BitrateManager {
@@ -24,10 +53,20 @@ pub struct BitrateManager {
     packet_bytes_average: SlidingWindowAverage<f32>,
     network_latency_average: SlidingWindowAverage<Duration>,
     encoder_latency_average: SlidingWindowAverage<Duration>,
+    encoder_qp_average: Option<SlidingWindowAverage<f32>>,
+    encoder_psnr_average: Option<SlidingWindowAverage<f32>>,
+    encoder_ssim_average: Option<SlidingWindowAverage<f32>>,
+    // Counts down the network samples since the content changed, the bitrate is updated at 0
+    scene_cut_samples_left: Option<usize>,
+    max_history_size: usize,
     decoder_latency_overstep_count: usize,
     last_frame_instant: Instant,
     last_update_instant: Instant,
     dynamic_decoder_max_bytes_per_frame: f32,
+    last_link_frame_bytes: Option<f32>,
+    // One composited frame in this many is encoded
+    framerate_divider: u32,
+    frames_skipped: u32,
     previous_config: Option<BitrateConfig>,
     update_needed: bool,
 }
@@ -50,10 +89,18 @@ impl BitrateManager {
                 Duration::from_millis(5),
                 max_history_size,
             ),
+            encoder_qp_average: None,
+            encoder_psnr_average: None,
+            encoder_ssim_average: None,
+            scene_cut_samples_left: None,
+            max_history_size,
             decoder_latency_overstep_count: 0,
             last_frame_instant: Instant::now(),
             last_update_instant: Instant::now(),
             dynamic_decoder_max_bytes_per_frame: f32::MAX,
+            last_link_frame_bytes: None,
+            framerate_divider: 1,
+            frames_skipped: 0,
             previous_config: None,
             update_needed: true,
         }
@@ -83,6 +130,24 @@ impl BitrateManager {
         }
     }
 
+    // Called for each composited frame before it's encoded. The ones skipped are reprojected by
+    // the client from the previous one
+    pub fn should_encode_frame(&mut self) -> bool {
+        if self.frames_skipped + 1 >= self.framerate_divider {
+            self.frames_skipped = 0;
+
+            true
+        } else {
+            self.frames_skipped += 1;
+
+            false
+        }
+    }
+
+    pub fn framerate_divider(&self) -> u32 {
+        self.framerate_divider
+    }
+
     pub fn report_frame_encoded(
         &mut self,
         timestamp: Duration,
@@ -94,6 +159,39 @@ impl BitrateManager {
         self.packet_bytes_history.push_back((timestamp, size_bytes));
     }
 
+    // A frame that overflowed the VBV buffer, or a scene cut that the encoder coded mostly intra,
+    // is followed by frames of another size. The history describes the previous content, so most
+    // of it is dropped, and the bitrate is updated once a few frames of the new content were
+    // measured instead of at the next interval
+    pub fn report_encoder_stats(&mut self, is_idr: bool, stats: EncoderStats) {
+        if let Some(qp) = stats.average_qp {
+            self.encoder_qp_average
+                .get_or_insert_with(|| SlidingWindowAverage::new(qp, self.max_history_size))
+                .submit_sample(qp);
+        }
+        // The probed frames are few, the same history covers a longer time
+        if let Some(psnr) = stats.psnr {
+            self.encoder_psnr_average
+                .get_or_insert_with(|| SlidingWindowAverage::new(psnr, self.max_history_size))
+                .submit_sample(psnr);
+        }
+        if let Some(ssim) = stats.ssim {
+            self.encoder_ssim_average
+                .get_or_insert_with(|| SlidingWindowAverage::new(ssim, self.max_history_size))
+                .submit_sample(ssim);
+        }
+
+        let scene_cut = !is_idr
+            && stats
+                .intra_ratio
+                .is_some_and(|ratio| ratio > SCENE_CUT_INTRA_RATIO);
+        if (stats.vbv_overflow || scene_cut) && self.scene_cut_samples_left.is_none() {
+            self.packet_bytes_average.retain(SCENE_CUT_SAMPLES);
+            self.network_latency_average.retain(SCENE_CUT_SAMPLES);
+            self.scene_cut_samples_left = Some(SCENE_CUT_SAMPLES);
+        }
+    }
+
     // decoder_latency is used to learn a suitable maximum bitrate bound to avoid decoder runaway
     // latency
     pub fn report_frame_latencies(
@@ -112,6 +210,14 @@ impl BitrateManager {
                 self.packet_bytes_average.submit_sample(size_bytes as f32);
                 self.network_latency_average.submit_sample(network_latency);
 
+                if let Some(left) = &mut self.scene_cut_samples_left {
+                    *left -= 1;
+                    if *left == 0 {
+                        self.scene_cut_samples_left = None;
+                        self.update_needed = true;
+                    }
+                }
+
                 self.packet_bytes_history.pop_front();
 
                 break;
@@ -151,12 +257,29 @@ impl BitrateManager {
     ) -> Option<(DynamicEncoderParams, BitrateDirectives)> {
         let now = Instant::now();
 
+        let frame_interval = if config.adapt_to_framerate.enabled() {
+            self.frame_interval_average.get_average()
+        } else {
+            self.nominal_frame_interval
+        };
+
+        // What the link carries in a frame interval, from the measured throughput without the
+        // saturation margin. The floor is applied once the bitrate is known
+        let link_frame_bytes = config.cap_frame_size.then(|| {
+            self.packet_bytes_average.get_average() * frame_interval.as_secs_f32()
+                / self.network_latency_average.get_average().as_secs_f32()
+        });
+        let cap_moved = match (link_frame_bytes, self.last_link_frame_bytes) {
+            (Some(bytes), Some(last)) => (bytes - last).abs() > last * FRAME_SIZE_CAP_UPDATE_RATIO,
+            _ => false,
+        };
+
         if self.previous_config.as_ref() != Some(config) {
             self.previous_config = Some(config.clone());
             // Continue method. Always update bitrate in this case
         } else if !self.update_needed
             && (now < self.last_update_instant + UPDATE_INTERVAL
-                || matches!(config.mode, BitrateMode::ConstantMbps(_)))
+                || (matches!(config.mode, BitrateMode::ConstantMbps(_)) && !cap_moved))
         {
             return None;
         }
@@ -164,12 +287,6 @@ impl BitrateManager {
         self.last_update_instant = now;
         self.update_needed = false;
 
-        let frame_interval = if config.adapt_to_framerate.enabled() {
-            self.frame_interval_average.get_average()
-        } else {
-            self.nominal_frame_interval
-        };
-
         let mut bitrate_directives = BitrateDirectives::default();
 
         let bitrate_bps = match &config.mode {
@@ -240,11 +357,48 @@ impl BitrateManager {
         };
 
         bitrate_directives.requested_bitrate_bps = bitrate_bps;
+        bitrate_directives.encoder_average_qp =
+            self.encoder_qp_average.as_ref().map(|qp| qp.get_average());
+        bitrate_directives.encoder_psnr = self
+            .encoder_psnr_average
+            .as_ref()
+            .map(|psnr| psnr.get_average());
+        bitrate_directives.encoder_ssim = self
+            .encoder_ssim_average
+            .as_ref()
+            .map(|ssim| ssim.get_average());
+
+        // The bitrate stays the same, each encoded frame gets the bits of the skipped ones
+        self.framerate_divider = match &config.framerate_decimation {
+            Switch::Enabled(decimation) => {
+                let below_bps = decimation.below_mbps as f32 * 1e6;
+                if bitrate_bps < below_bps
+                    || (self.framerate_divider > 1
+                        && bitrate_bps < below_bps * FRAMERATE_DECIMATION_HYSTERESIS)
+                {
+                    decimation.divider.max(1)
+                } else {
+                    1
+                }
+            }
+            Switch::Disabled => 1,
+        };
+        let encode_interval_s = frame_interval.as_secs_f32() * self.framerate_divider as f32;
+
+        let max_frame_bytes = link_frame_bytes.map(|bytes| {
+            let average_frame_bytes = bitrate_bps / 8.0 * encode_interval_s;
+            f32::max(
+                bytes * self.framerate_divider as f32,
+                average_frame_bytes * MIN_FRAME_SIZE_CAP_FRAMES,
+            ) as u32
+        });
+        self.last_link_frame_bytes = link_frame_bytes;
 
         Some((
             DynamicEncoderParams {
                 bitrate_bps,
-                framerate: 1.0 / f32::min(frame_interval.as_secs_f32(), 1.0),
+                framerate: 1.0 / f32::min(encode_interval_s, 1.0),
+                max_frame_bytes,
             },
             bitrate_directives,
         ))
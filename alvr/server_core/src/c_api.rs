@@ -284,7 +284,9 @@ pub unsafe extern "C" fn alvr_poll_event(out_event: *mut AlvrEvent, timeout_ns:
                 BUTTONS_QUEUE.lock().push_back(entries);
                 unsafe { *out_event = AlvrEvent::ButtonsUpdated };
             }
-            ServerCoreEvent::RequestIDR => unsafe { *out_event = AlvrEvent::RequestIDR },
+            ServerCoreEvent::RequestIDR | ServerCoreEvent::VideoFramesLost { .. } => unsafe {
+                *out_event = AlvrEvent::RequestIDR
+            },
             ServerCoreEvent::CaptureFrame => unsafe { *out_event = AlvrEvent::CaptureFrame },
             ServerCoreEvent::RestartPending => unsafe {
                 *out_event = AlvrEvent::RestartPending;
@@ -293,6 +295,9 @@ pub unsafe extern "C" fn alvr_poll_event(out_event: *mut AlvrEvent, timeout_ns:
                 *out_event = AlvrEvent::ShutdownPending;
             },
             ServerCoreEvent::GameRenderLatencyFeedback(_)
+            | ServerCoreEvent::CaptureTrace { .. }
+            | ServerCoreEvent::DumpFlightRecorder(_)
+            | ServerCoreEvent::RecordFrames { .. }
             | ServerCoreEvent::SetOpenvrProperty { .. } => {} // implementation not needed
             ServerCoreEvent::ProximityState(headset_is_worn) => unsafe {
                 *out_event = AlvrEvent::ProximityState(headset_is_worn);
@@ -446,7 +451,9 @@ pub unsafe extern "C" fn alvr_send_video_nal(
             Duration::from_nanos(timestamp_ns),
             global_view_params,
             is_idr,
-            buffer.to_vec(),
+            true,
+            0,
+            Box::new(buffer.to_vec()),
         );
     }
 }
@@ -10,7 +10,8 @@ use crate::{
 use alvr_adb::{WiredConnection, WiredConnectionStatus};
 use alvr_common::{
     AnyhowToCon, BUTTON_INFO, CONTROLLER_PROFILE_INFO, ConResult, ConnectionError, ConnectionState,
-    LifecycleState, QUEST_CONTROLLER_PROFILE_PATH, con_bail, dbg_connection, debug, error,
+    LifecycleState, QUEST_CONTROLLER_PROFILE_PATH, ViewParams, con_bail, dbg_connection, debug,
+    error,
     glam::{UVec2, Vec2},
     info,
     parking_lot::{Condvar, Mutex, RwLock},
@@ -24,8 +25,8 @@ use alvr_packets::{
     ServerControlPacket, StreamConfigPacket, TRACKING, TrackingData, VIDEO, VideoPacketHeader,
 };
 use alvr_session::{
-    BodyTrackingSinkConfig, CodecType, ControllersEmulationMode, FrameSize, H264Profile,
-    OpenvrConfig, SessionConfig, SocketProtocol,
+    BodyTrackingSinkConfig, CodecType, ControllersEmulationMode, DecoderTilesConfig, FrameSize,
+    H264Profile, OpenvrConfig, SendQueueFullPolicy, SessionConfig, SocketProtocol,
 };
 use alvr_sockets::{
     CONTROL_PORT, KEEPALIVE_INTERVAL, KEEPALIVE_TIMEOUT, PeerType, ProtoControlSocket,
@@ -47,15 +48,57 @@ const REAL_TIME_UPDATE_INTERVAL: Duration = Duration::from_secs(1);
 
 const MAX_UNREAD_PACKETS: usize = 10; // Applies per stream
 
+/// Encoded frame data. It can be split in multiple chunks and live in memory owned by the encoder,
+/// which is returned by dropping the payload.
+pub trait VideoPayload: Send {
+    fn for_each_chunk(&self, f: &mut dyn FnMut(&[u8]));
+
+    fn size(&self) -> usize {
+        let mut size = 0;
+        self.for_each_chunk(&mut |chunk| size += chunk.len());
+
+        size
+    }
+
+    fn copy_to(&self, buffer: &mut [u8]) {
+        let mut offset = 0;
+        self.for_each_chunk(&mut |chunk| {
+            buffer[offset..][..chunk.len()].copy_from_slice(chunk);
+            offset += chunk.len();
+        });
+    }
+
+    fn to_vec(&self) -> Vec<u8> {
+        let mut buffer = vec![0; self.size()];
+        self.copy_to(&mut buffer);
+
+        buffer
+    }
+}
+
+impl VideoPayload for Vec<u8> {
+    fn for_each_chunk(&self, f: &mut dyn FnMut(&[u8])) {
+        f(self)
+    }
+}
+
 pub struct VideoPacket {
     pub header: VideoPacketHeader,
-    pub payload: Vec<u8>,
+    pub payload: Box<dyn VideoPayload>,
 }
 
 fn align32(value: f32) -> u32 {
     ((value / 32.).floor() * 32.) as u32
 }
 
+// Bit 63 is left out, the driver reads the mask as a signed JSON integer
+fn cpu_mask(cores: &[u32]) -> u64 {
+    cores
+        .iter()
+        .filter(|&&core| core < 63)
+        .fold(0, |mask, &core| mask | (1 << core))
+}
+
 fn is_streaming(client_hostname: &str) -> bool {
     SESSION_MANAGER
         .read()
@@ -64,6 +107,21 @@ fn is_streaming(client_hostname: &str) -> bool {
         .is_some_and(|c| c.connection_state == ConnectionState::Streaming)
 }
 
+// Largest video payload that fits in a single packet with its header
+fn video_packet_payload_size(packet_size: usize) -> usize {
+    alvr_sockets::single_shard_payload_size(
+        packet_size,
+        // Duration::MAX takes the most bytes once varint encoded
+        &VideoPacketHeader {
+            timestamp: Duration::MAX,
+            global_view_params: [ViewParams::DUMMY; 2],
+            is_idr: false,
+            is_last_slice: false,
+            framerate_divider: 1,
+        },
+    )
+}
+
 pub fn contruct_openvr_config(session: &SessionConfig) -> OpenvrConfig {
     let old_config = session.openvr_config.clone();
     let settings = session.to_settings();
@@ -117,12 +175,20 @@ pub fn contruct_openvr_config(session: &SessionConfig) -> OpenvrConfig {
         .map(|c| c.sources.meta.prefer_full_body)
         .unwrap_or(false);
 
+    let pose_filter = settings.headset.driver_pose_filter.as_option();
+    let threads = &settings.extra.driver_threads;
+
     let mut foveation_center_size_x = 0.0;
     let mut foveation_center_size_y = 0.0;
     let mut foveation_center_shift_x = 0.0;
     let mut foveation_center_shift_y = 0.0;
     let mut foveation_edge_ratio_x = 0.0;
     let mut foveation_edge_ratio_y = 0.0;
+    let mut foveated_qp_max_delta = 0;
+    let mut foveated_qp_follow_gaze = false;
+    let mut enable_radial_foveation = false;
+    let mut radial_foveation_center_radius = 0.0;
+    let mut radial_foveation_edge_ratio = 0.0;
     let enable_foveated_encoding = if let Switch::Enabled(config) = settings.video.foveated_encoding
     {
         foveation_center_size_x = config.center_size_x;
@@ -131,6 +197,15 @@ pub fn contruct_openvr_config(session: &SessionConfig) -> OpenvrConfig {
         foveation_center_shift_y = config.center_shift_y;
         foveation_edge_ratio_x = config.edge_ratio_x;
         foveation_edge_ratio_y = config.edge_ratio_y;
+        if let Switch::Enabled(falloff) = &config.qp_falloff {
+            foveated_qp_max_delta = falloff.max_qp_delta;
+            foveated_qp_follow_gaze = falloff.follow_eye_gaze;
+        }
+        if let Switch::Enabled(radial) = &config.radial {
+            enable_radial_foveation = true;
+            radial_foveation_center_radius = radial.center_radius;
+            radial_foveation_edge_ratio = radial.edge_ratio;
+        }
 
         true
     } else {
@@ -153,20 +228,77 @@ pub fn contruct_openvr_config(session: &SessionConfig) -> OpenvrConfig {
         false
     };
 
+    // Auto is resolved once the client reported its decoder
+    let (encoder_tile_columns, encoder_tile_rows) =
+        match settings.video.encoder_config.decoder_tiles {
+            DecoderTilesConfig::Auto => (1, 1),
+            DecoderTilesConfig::Custom { columns, rows } => (columns, rows),
+        };
+
     let nvenc_overrides = settings.video.encoder_config.nvenc;
     let amf_controls = settings.video.encoder_config.amf;
     let hdr_controls = settings.video.encoder_config.hdr;
+    let intra_refresh = settings.video.encoder_config.intra_refresh.as_option();
+    let send_queue = settings.video.encoder_config.send_queue.as_option();
+    let dynamic_resolution = settings.video.dynamic_resolution.as_option();
+    let spectator_stream = settings.video.spectator_stream.as_option();
 
     OpenvrConfig {
         tracking_ref_only: settings.headset.tracking_ref_only,
         enable_vive_tracker_proxy: settings.headset.enable_vive_tracker_proxy,
         minimum_idr_interval_ms: settings.connection.minimum_idr_interval_ms,
+        reference_frame_invalidation: settings.connection.reference_frame_invalidation,
+        skip_static_frames: settings.video.skip_static_frames,
+        skip_duplicate_frames: settings.video.skip_duplicate_frames,
+        late_latch_pose: settings.video.late_latch_pose,
+        share_depth_swap_textures: settings.video.share_depth_swap_textures,
+        dynamic_resolution_enabled: dynamic_resolution.is_some(),
+        dynamic_resolution_full_mbps: dynamic_resolution
+            .map(|d| d.full_resolution_mbps)
+            .unwrap_or_default(),
+        dynamic_resolution_min_scale: dynamic_resolution.map(|d| d.min_scale).unwrap_or(1.0),
+        spectator_stream_enabled: spectator_stream.is_some(),
+        spectator_width: spectator_stream.map(|s| s.width).unwrap_or_default(),
+        spectator_framerate_divisor: spectator_stream.map(|s| s.framerate_divisor).unwrap_or(1),
+        spectator_bitrate_mbps: spectator_stream.map(|s| s.bitrate_mbps).unwrap_or_default(),
         adapter_index: settings.video.adapter_index,
+        encoder_adapter_index: settings.video.encoder_adapter_index,
         codec: settings.video.preferred_codec as _,
         h264_profile: settings.video.encoder_config.h264_profile as u32,
         rate_control_mode: settings.video.encoder_config.rate_control_mode as u32,
         filler_data: settings.video.encoder_config.filler_data,
         entropy_coding: settings.video.encoder_config.entropy_coding as u32,
+        gradual_intra_refresh: intra_refresh.is_some(),
+        gradual_intra_refresh_period: intra_refresh.map(|c| c.period_frames).unwrap_or(0),
+        encoder_frame_queue_depth: settings.video.encoder_config.frame_queue_depth,
+        encoder_target_latency_ms: settings.video.encoder_config.target_latency_ms.unwrap_or(0),
+        encoder_overlay_qp_reduction: settings
+            .video
+            .encoder_config
+            .overlay_qp_reduction
+            .unwrap_or(0),
+        encoder_warmup_frames: settings.video.encoder_config.warmup_frames,
+        encoder_temporal_layers: settings.video.encoder_config.temporal_layers,
+        encoder_slice_size_bytes: if settings.video.encoder_config.packet_sized_slices {
+            video_packet_payload_size(settings.connection.packet_size as _) as u32
+        } else {
+            0
+        },
+        encoder_send_queue_depth: send_queue.map(|c| c.depth_frames).unwrap_or(0),
+        encoder_send_queue_drop_oldest: send_queue
+            .map(|c| c.full_policy == SendQueueFullPolicy::DropOldest)
+            .unwrap_or(false),
+        encoder_low_latency_headers: settings.video.encoder_config.low_latency_decoder_headers,
+        encoder_frame_metadata: settings.video.encoder_config.in_band_frame_metadata,
+        encoder_load_budget_percent: settings
+            .video
+            .encoder_config
+            .adaptive_encoder_load
+            .as_option()
+            .map(|c| c.budget_percent)
+            .unwrap_or(0),
+        encoder_tile_columns,
+        encoder_tile_rows,
         force_hdr_srgb_correction: hdr_controls.force_hdr_srgb_correction,
         clamp_hdr_extended_range: hdr_controls.clamp_hdr_extended_range,
         enable_amf_pre_analysis: amf_controls.enable_pre_analysis,
@@ -175,6 +307,8 @@ pub fn contruct_openvr_config(session: &SessionConfig) -> OpenvrConfig {
         use_amf_preproc: amf_controls.use_preproc,
         amf_preproc_sigma: amf_controls.preproc_sigma,
         amf_preproc_tor: amf_controls.preproc_tor,
+        amf_drain_threads: amf_controls.drain_threads,
+        amf_quality_probe_interval: amf_controls.quality_probe_interval,
         nvenc_quality_preset: nvenc_overrides.quality_preset as u32,
         encoder_quality_preset: settings.video.encoder_config.quality_preset as u32,
         force_sw_encoding: settings
@@ -183,10 +317,20 @@ pub fn contruct_openvr_config(session: &SessionConfig) -> OpenvrConfig {
             .software
             .force_software_encoding,
         sw_thread_count: settings.video.encoder_config.software.thread_count,
+        sw_sub_frame_output: settings.video.encoder_config.software.sub_frame_output,
+        sw_gpu_color_conversion: settings.video.encoder_config.software.gpu_color_conversion,
+        sw_arm64_frame_sharing: settings.video.encoder_config.software.arm64_frame_sharing,
         controllers_enabled,
         controller_is_tracker,
         body_tracking_vive_enabled,
         body_tracking_has_legs,
+        pose_filter_head: pose_filter.is_some_and(|c| c.filter_head),
+        pose_filter_trackers: pose_filter.is_some_and(|c| c.filter_trackers),
+        pose_filter_min_cutoff_hz: pose_filter.map(|c| c.min_cutoff_hz).unwrap_or(0.0),
+        pose_filter_beta: pose_filter.map(|c| c.beta).unwrap_or(0.0),
+        pose_filter_tracker_prediction_s: pose_filter
+            .map(|c| c.tracker_prediction_ms as f32 / 1000.0)
+            .unwrap_or(0.0),
         enable_foveated_encoding,
         foveation_center_size_x,
         foveation_center_size_y,
@@ -194,14 +338,50 @@ pub fn contruct_openvr_config(session: &SessionConfig) -> OpenvrConfig {
         foveation_center_shift_y,
         foveation_edge_ratio_x,
         foveation_edge_ratio_y,
+        foveated_qp_max_delta,
+        foveated_qp_follow_gaze,
+        enable_radial_foveation,
+        radial_foveation_center_radius,
+        radial_foveation_edge_ratio,
         enable_color_correction,
         brightness,
         contrast,
         saturation,
         gamma,
         sharpening,
+        color_lut_path: settings.video.color_lut_path.clone(),
+        hidden_area_mask_radius: settings
+            .video
+            .hidden_area_mask
+            .as_option()
+            .map(|c| c.radius)
+            .unwrap_or(0.0),
+        edge_adaptive_upscaling: settings.video.edge_adaptive_upscaling,
         linux_async_compute: settings.extra.patches.linux_async_compute,
         linux_async_reprojection: settings.extra.patches.linux_async_reprojection,
+        linux_pipelined_encoding: settings.extra.patches.linux_pipelined_encoding,
+        linux_async_output: settings.extra.patches.linux_async_output,
+        linux_single_frame_vbv: settings.extra.patches.linux_single_frame_vbv,
+        linux_swapchain_images: settings.extra.patches.linux_swapchain_images,
+        linux_dma_buf_swapchain: settings.extra.patches.linux_dma_buf_swapchain,
+        linux_direct_submit: settings.extra.patches.linux_direct_submit,
+        linux_encode_device: settings.extra.patches.linux_encode_device.clone(),
+        linux_vaapi_color_correction: settings.extra.patches.linux_vaapi_color_correction,
+        linux_vaapi_async_depth: settings.extra.patches.linux_vaapi_async_depth,
+        linux_vaapi_denoise: settings.extra.patches.linux_vaapi_denoise,
+        linux_vaapi_denoise_max_bitrate_mbps: settings
+            .extra
+            .patches
+            .linux_vaapi_denoise_max_bitrate_mbps,
+        thread_encoder_priority: threads.encoder.priority as u32,
+        thread_encoder_cpu_mask: cpu_mask(&threads.encoder.cpu_affinity),
+        thread_encoder_output_priority: threads.encoder_output.priority as u32,
+        thread_encoder_output_cpu_mask: cpu_mask(&threads.encoder_output.cpu_affinity),
+        thread_vsync_priority: threads.vsync.priority as u32,
+        thread_vsync_cpu_mask: cpu_mask(&threads.vsync.cpu_affinity),
+        thread_tracking_priority: threads.tracking.priority as u32,
+        thread_tracking_cpu_mask: cpu_mask(&threads.tracking.cpu_affinity),
+        gpu_priority: threads.gpu_priority as u32,
         nvenc_tuning_preset: nvenc_overrides.tuning_preset as u32,
         nvenc_multi_pass: nvenc_overrides.multi_pass as u32,
         nvenc_adaptive_quantization_mode: nvenc_overrides.adaptive_quantization_mode as u32,
@@ -219,7 +399,12 @@ pub fn contruct_openvr_config(session: &SessionConfig) -> OpenvrConfig {
         rc_max_bitrate: nvenc_overrides.rc_max_bitrate,
         rc_average_bitrate: nvenc_overrides.rc_average_bitrate,
         nvenc_enable_weighted_prediction: nvenc_overrides.enable_weighted_prediction,
+        nvenc_async_output: nvenc_overrides.async_output,
+        nvenc_head_motion_hints: nvenc_overrides.head_motion_hints,
+        nvenc_split_encode: nvenc_overrides.split_encode as u32,
+        nvenc_sub_frame_slices: nvenc_overrides.sub_frame_slices,
         capture_frame_dir: settings.extra.capture.capture_frame_dir,
+        capture_frame_count: settings.extra.capture.capture_frame_count,
         amd_bitrate_corruption_fix: settings.video.bitrate.image_corruption_fix,
         use_separate_hand_trackers,
         _controller_profile: controller_profile,
@@ -568,6 +753,7 @@ fn connection_pipeline(
     let Some(streaming_caps) = maybe_streaming_caps else {
         con_bail!("Only streaming clients are supported for now");
     };
+    let streaming_caps_ext = streaming_caps.ext().unwrap_or_default();
 
     dbg_connection!("connection_pipeline: setting up negotiated streaming config");
 
@@ -670,6 +856,15 @@ fn connection_pipeline(
             false
         };
 
+    // The Linux shaders take the foveation as specialization constants, fixed before the client
+    // reports the field of view the lens center is found from
+    let enable_radial_foveation = enable_foveated_encoding
+        && cfg!(windows)
+        && matches!(
+            &initial_settings.video.foveated_encoding,
+            Switch::Enabled(config) if config.radial.as_option().is_some()
+        );
+
     let encoder_profile = if initial_settings.video.encoder_config.h264_profile == H264Profile::High
     {
         let profile = if streaming_caps.encoder_high_profile {
@@ -774,7 +969,9 @@ fn connection_pipeline(
             wired,
             ext_str: String::new(),
         }
-        .with_ext(NegotiatedStreamingConfigExt {}),
+        .with_ext(NegotiatedStreamingConfigExt {
+            radial_foveation: enable_radial_foveation,
+        }),
     )
     .to_con()?;
     proto_socket.send(&stream_config_packet).to_con()?;
@@ -789,11 +986,18 @@ fn connection_pipeline(
     new_openvr_config.target_eye_resolution_height = emulated_headset_view_resolution.y;
     new_openvr_config.refresh_rate = fps as _;
     new_openvr_config.enable_foveated_encoding = enable_foveated_encoding;
+    new_openvr_config.enable_radial_foveation = enable_radial_foveation;
     new_openvr_config.h264_profile = encoder_profile as _;
     new_openvr_config.use_10bit_encoder = enable_10_bits_encoding;
     new_openvr_config.enable_hdr = enable_hdr;
     new_openvr_config.encoding_gamma = encoding_gamma;
     new_openvr_config.codec = codec as _;
+    if initial_settings.video.encoder_config.decoder_tiles == DecoderTilesConfig::Auto
+        && let Some(tiles) = streaming_caps_ext.decoder_tiles
+    {
+        new_openvr_config.encoder_tile_columns = tiles.x.max(1);
+        new_openvr_config.encoder_tile_rows = tiles.y.max(1);
+    }
 
     if session_manager_lock.session().openvr_config != new_openvr_config {
         session_manager_lock.session_mut().openvr_config = new_openvr_config;
@@ -822,6 +1026,7 @@ fn connection_pipeline(
         } else {
             0.0
         },
+        initial_settings.video.adaptive_server_frame_pacing,
     ));
 
     *ctx.bitrate_manager.lock() =
@@ -879,10 +1084,9 @@ fn connection_pipeline(
                     .unrecenter_view_params(&mut header.global_view_params);
 
                 let mut buffer = video_sender.get_buffer(&header).unwrap();
-                // todo: make encoder write to socket buffers directly to avoid copy
-                buffer
-                    .get_range_mut(0, payload.len())
-                    .copy_from_slice(&payload);
+                // This is the only copy of the frame, the encoder memory is returned right after
+                payload.copy_to(buffer.get_range_mut(0, payload.size()));
+                drop(payload);
                 video_sender.send(buffer).ok();
             }
         }
@@ -1309,6 +1513,15 @@ fn connection_pipeline(
                             .send(ServerCoreEvent::ProximityState(headset_is_worn))
                             .ok();
                     }
+                    ClientControlPacket::VideoFramesLost {
+                        last_received_timestamp,
+                    } => {
+                        ctx.events_sender
+                            .send(ServerCoreEvent::VideoFramesLost {
+                                last_received_timestamp,
+                            })
+                            .ok();
+                    }
                     ClientControlPacket::Reserved(_) | ClientControlPacket::ReservedBuffer(_) => (),
                 }
 
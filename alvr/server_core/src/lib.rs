@@ -8,17 +8,21 @@ mod logging_backend;
 mod sockets;
 mod statistics;
 mod tracking;
+mod video_recording;
 mod web_server;
 
+pub use bitrate::EncoderStats;
 pub use c_api::*;
+pub use connection::VideoPayload;
 pub use logging_backend::init_logging;
+pub use statistics::{DriverCounters, FrameStageTimestamps, GpuUtilization};
 pub use tracking::HandType;
 
 use crate::connection::VideoPacket;
 use alvr_common::{
     ConnectionState, DEVICE_ID_TO_PATH, DeviceMotion, LifecycleState, Pose, RelaxedAtomic,
     ViewParams, dbg_server_core, error,
-    glam::Vec2,
+    glam::{Quat, Vec2},
     parking_lot::{Mutex, RwLock},
     settings_schema::Switch,
     warn,
@@ -38,11 +42,10 @@ use std::{
     collections::HashSet,
     env,
     ffi::OsStr,
-    fs::File,
-    io::Write,
+    path::PathBuf,
     sync::{
         Arc, LazyLock, OnceLock,
-        atomic::{AtomicBool, Ordering},
+        atomic::{AtomicBool, AtomicU8, AtomicUsize, Ordering},
         mpsc::{self, SyncSender, TrySendError},
     },
     thread::{self, JoinHandle},
@@ -50,6 +53,10 @@ use std::{
 };
 use tokio::{runtime::Runtime, sync::broadcast};
 use tracking::TrackingManager;
+use video_recording::VideoRecorder;
+
+// Packets kept for a slow spectator, it skips to the next IDR when it lags behind more than this
+const SPECTATOR_CHANNEL_CAPACITY: usize = 64;
 
 static FILESYSTEM_LAYOUT: OnceLock<afs::Layout> = OnceLock::new();
 
@@ -85,7 +92,23 @@ pub enum ServerCoreEvent {
     },
     Buttons(Vec<ButtonEntry>), // Note: this is after mapping
     RequestIDR,
+    // The encoder can repair the stream from the last frame the client received
+    VideoFramesLost {
+        last_received_timestamp: Duration,
+    },
     CaptureFrame,
+    // Write a Chrome trace of the driver to the file for the given duration
+    CaptureTrace {
+        path: PathBuf,
+        duration: Duration,
+    },
+    // Write the recent frame timings and encoder events of the driver to the file
+    DumpFlightRecorder(PathBuf),
+    // Save the next frames presented by the game to the file
+    RecordFrames {
+        path: PathBuf,
+        frame_count: u32,
+    },
     GameRenderLatencyFeedback(Duration), // only used for SteamVR
     ShutdownPending,
     RestartPending,
@@ -99,7 +122,9 @@ pub struct ConnectionContext {
     tracking_manager: RwLock<TrackingManager>,
     decoder_config: Mutex<Option<DecoderInitializationConfig>>,
     video_mirror_sender: Mutex<Option<broadcast::Sender<Vec<u8>>>>,
-    video_recording_file: Mutex<Option<File>>,
+    video_recording_file: Mutex<Option<VideoRecorder>>,
+    // Downscaled H.264 copy of the stream, served to the spectator websockets
+    spectator_sender: broadcast::Sender<Vec<u8>>,
     connection_threads: Mutex<Vec<JoinHandle<()>>>,
     clients_to_be_removed: Mutex<HashSet<String>>,
     video_channel_sender: Mutex<Option<SyncSender<VideoPacket>>>,
@@ -119,23 +144,17 @@ pub fn create_recording_file(connection_context: &ConnectionContext, settings: &
         chrono::Local::now().format("%F.%H-%M-%S")
     ));
 
-    match File::create(path) {
-        Ok(mut file) => {
-            if let Some(config) = &*connection_context.decoder_config.lock() {
-                file.write_all(&config.config_buffer).ok();
-            }
-
-            *connection_context.video_recording_file.lock() = Some(file);
-
-            connection_context
-                .events_sender
-                .send(ServerCoreEvent::RequestIDR)
-                .ok();
-        }
-        Err(e) => {
-            error!("Failed to record video on disk: {e}");
-        }
-    }
+    let header = connection_context
+        .decoder_config
+        .lock()
+        .as_ref()
+        .map(|config| config.config_buffer.clone());
+    *connection_context.video_recording_file.lock() = Some(VideoRecorder::new(path, header));
+
+    connection_context
+        .events_sender
+        .send(ServerCoreEvent::RequestIDR)
+        .ok();
 }
 
 pub fn notify_restart_driver() {
@@ -199,6 +218,7 @@ impl ServerCoreContext {
             } else {
                 0.0
             },
+            initial_settings.video.adaptive_server_frame_pacing,
         );
 
         let connection_context = Arc::new(ConnectionContext {
@@ -211,6 +231,7 @@ impl ServerCoreContext {
             decoder_config: Mutex::new(None),
             video_mirror_sender: Mutex::new(None),
             video_recording_file: Mutex::new(None),
+            spectator_sender: broadcast::channel(SPECTATOR_CHANNEL_CAPACITY).0,
             connection_threads: Mutex::new(Vec::new()),
             clients_to_be_removed: Mutex::new(HashSet::new()),
             video_channel_sender: Mutex::new(None),
@@ -276,6 +297,16 @@ impl ServerCoreContext {
             .copied()
     }
 
+    // Head space, None when the client doesn't track the eyes
+    pub fn get_eye_gaze(&self, timestamp: Duration) -> Option<Quat> {
+        dbg_server_core!("get_eye_gaze: ts={timestamp:?}");
+
+        self.connection_context
+            .tracking_manager
+            .read()
+            .get_eye_gaze(timestamp)
+    }
+
     pub fn get_motion_to_photon_latency(&self) -> Duration {
         dbg_server_core!("get_motion_to_photon_latency");
 
@@ -353,8 +384,8 @@ impl ServerCoreContext {
             sender.send(config_buffer.clone()).ok();
         }
 
-        if let Some(file) = &mut *self.connection_context.video_recording_file.lock() {
-            file.write_all(&config_buffer).ok();
+        if let Some(recorder) = &mut *self.connection_context.video_recording_file.lock() {
+            recorder.write(config_buffer.clone());
         }
 
         *self.connection_context.decoder_config.lock() = Some(DecoderInitializationConfig {
@@ -364,12 +395,21 @@ impl ServerCoreContext {
         });
     }
 
+    // Dropped if no spectator is connected
+    pub fn send_spectator_video(&self, buffer: Vec<u8>) {
+        self.connection_context.spectator_sender.send(buffer).ok();
+    }
+
+    // temporal_id is the temporal layer of the frame. When the network can't keep up, the frames
+    // above the base layer 0 are dropped instead of requesting an IDR
     pub fn send_video_nal(
         &self,
         timestamp: Duration,
         global_view_params: [ViewParams; 2],
         is_idr: bool,
-        nal_buffer: Vec<u8>,
+        is_last_slice: bool,
+        temporal_id: u8,
+        nal_buffer: Box<dyn VideoPayload>,
     ) {
         dbg_server_core!("send_video_nal");
 
@@ -377,13 +417,30 @@ impl ServerCoreContext {
         static STREAM_CORRUPTED: AtomicBool = AtomicBool::new(true);
         static LAST_IDR_INSTANT: LazyLock<Mutex<Instant>> =
             LazyLock::new(|| Mutex::new(Instant::now()));
+        // Set while the slices of a frame are being sent
+        static FRAME_IN_PROGRESS: AtomicBool = AtomicBool::new(false);
+        static FRAME_SIZE: AtomicUsize = AtomicUsize::new(0);
+        // Lowest temporal layer a frame was dropped from since a frame of that layer or below was
+        // sent. The frames of the layers above it may reference the dropped one
+        static DROPPED_TEMPORAL_ID: AtomicU8 = AtomicU8::new(u8::MAX);
+        // The slices of the current frame are dropped
+        static DROPPING_FRAME: AtomicBool = AtomicBool::new(false);
 
         if let Some(sender) = &*self.connection_context.video_channel_sender.lock() {
-            let buffer_size = nal_buffer.len();
+            let buffer_size = nal_buffer.size();
+            let is_first_slice = !FRAME_IN_PROGRESS.swap(!is_last_slice, Ordering::SeqCst);
 
-            if is_idr {
+            if is_idr && is_first_slice {
                 STREAM_CORRUPTED.store(false, Ordering::SeqCst);
+                DROPPED_TEMPORAL_ID.store(u8::MAX, Ordering::SeqCst);
             }
+            if is_first_slice {
+                DROPPING_FRAME.store(
+                    temporal_id > DROPPED_TEMPORAL_ID.load(Ordering::SeqCst),
+                    Ordering::SeqCst,
+                );
+            }
+            let dropping_frame = DROPPING_FRAME.load(Ordering::SeqCst);
 
             if let Switch::Enabled(config) = &SESSION_MANAGER
                 .read()
@@ -399,7 +456,7 @@ impl ServerCoreContext {
                     .send(ServerCoreEvent::RequestIDR)
                     .ok();
 
-                if is_idr {
+                if is_idr && is_first_slice {
                     create_recording_file(
                         &self.connection_context,
                         SESSION_MANAGER.read().settings(),
@@ -416,44 +473,88 @@ impl ServerCoreContext {
                     .avoid_video_glitching
             {
                 if let Some(sender) = &*self.connection_context.video_mirror_sender.lock() {
-                    sender.send(nal_buffer.clone()).ok();
+                    sender.send(nal_buffer.to_vec()).ok();
                 }
 
-                if let Some(file) = &mut *self.connection_context.video_recording_file.lock() {
-                    file.write_all(&nal_buffer).ok();
+                if let Some(recorder) = &mut *self.connection_context.video_recording_file.lock() {
+                    recorder.write(nal_buffer.to_vec());
                 }
 
-                let sender_result = sender.try_send(VideoPacket {
-                    header: VideoPacketHeader {
-                        timestamp,
-                        global_view_params,
-                        is_idr,
-                    },
-                    payload: nal_buffer,
-                });
-                if matches!(sender_result, Err(TrySendError::Full(_))) {
-                    STREAM_CORRUPTED.store(true, Ordering::SeqCst);
-                    self.connection_context
-                        .events_sender
-                        .send(ServerCoreEvent::RequestIDR)
-                        .ok();
-                    warn!("Dropping video packet. Reason: Can't push to network");
+                let framerate_divider = self
+                    .connection_context
+                    .bitrate_manager
+                    .lock()
+                    .framerate_divider()
+                    .clamp(1, u8::MAX as u32) as u8;
+                let sender_result = if dropping_frame {
+                    Ok(())
+                } else {
+                    sender.try_send(VideoPacket {
+                        header: VideoPacketHeader {
+                            timestamp,
+                            global_view_params,
+                            is_idr,
+                            is_last_slice,
+                            framerate_divider,
+                        },
+                        payload: nal_buffer,
+                    })
+                };
+                match sender_result {
+                    // Nothing references the frame from the base layer, the client keeps decoding
+                    // without it. A frame already partly sent can't be dropped
+                    Err(TrySendError::Full(_)) if is_first_slice && temporal_id > 0 => {
+                        DROPPED_TEMPORAL_ID.fetch_min(temporal_id, Ordering::SeqCst);
+                        DROPPING_FRAME.store(true, Ordering::SeqCst);
+                        warn!(
+                            "Dropping video frame of temporal layer {temporal_id}. Reason: Can't \
+                            push to network"
+                        );
+                    }
+                    Err(TrySendError::Full(_)) => {
+                        STREAM_CORRUPTED.store(true, Ordering::SeqCst);
+                        self.connection_context
+                            .events_sender
+                            .send(ServerCoreEvent::RequestIDR)
+                            .ok();
+                        warn!("Dropping video packet. Reason: Can't push to network");
+                    }
+                    Ok(()) if is_first_slice && !dropping_frame => {
+                        if temporal_id <= DROPPED_TEMPORAL_ID.load(Ordering::SeqCst) {
+                            DROPPED_TEMPORAL_ID.store(u8::MAX, Ordering::SeqCst);
+                        }
+                    }
+                    _ => (),
                 }
             } else {
                 warn!("Dropping video packet. Reason: Waiting for IDR frame");
             }
 
-            if let Some(stats) = &mut *self.connection_context.statistics_manager.write() {
-                let encoder_latency = stats.report_frame_encoded(timestamp, buffer_size);
+            let frame_size = FRAME_SIZE.fetch_add(buffer_size, Ordering::SeqCst) + buffer_size;
+            if is_last_slice {
+                FRAME_SIZE.store(0, Ordering::SeqCst);
 
-                self.connection_context
-                    .bitrate_manager
-                    .lock()
-                    .report_frame_encoded(timestamp, encoder_latency, buffer_size);
+                if let Some(stats) = &mut *self.connection_context.statistics_manager.write() {
+                    let encoder_latency = stats.report_frame_encoded(timestamp, frame_size);
+
+                    self.connection_context
+                        .bitrate_manager
+                        .lock()
+                        .report_frame_encoded(timestamp, encoder_latency, frame_size);
+                }
             }
         }
     }
 
+    pub fn report_encoder_stats(&self, is_idr: bool, stats: EncoderStats) {
+        dbg_server_core!("report_encoder_stats");
+
+        self.connection_context
+            .bitrate_manager
+            .lock()
+            .report_encoder_stats(is_idr, stats);
+    }
+
     pub fn get_dynamic_encoder_params(&self) -> Option<DynamicEncoderParams> {
         dbg_server_core!("get_dynamic_encoder_params");
 
@@ -476,6 +577,16 @@ impl ServerCoreContext {
         }
     }
 
+    // Called for each composited frame before it's encoded, the framerate decimation skips some
+    pub fn should_encode_frame(&self) -> bool {
+        dbg_server_core!("should_encode_frame");
+
+        self.connection_context
+            .bitrate_manager
+            .lock()
+            .should_encode_frame()
+    }
+
     pub fn report_composed(&self, target_timestamp: Duration, offset: Duration) {
         dbg_server_core!("report_composed");
 
@@ -484,6 +595,15 @@ impl ServerCoreContext {
         }
     }
 
+    // Vsyncs the compositor skipped, only known on Linux
+    pub fn report_missed_vsyncs(&self, count: usize) {
+        dbg_server_core!("report_missed_vsyncs");
+
+        if let Some(stats) = &mut *self.connection_context.statistics_manager.write() {
+            stats.report_missed_vsyncs(count);
+        }
+    }
+
     pub fn report_present(&self, target_timestamp: Duration, offset: Duration) {
         dbg_server_core!("report_present");
 
@@ -504,6 +624,30 @@ impl ServerCoreContext {
             );
     }
 
+    pub fn report_driver_counters(&self, counters: DriverCounters) {
+        dbg_server_core!("report_driver_counters");
+
+        if let Some(stats) = &mut *self.connection_context.statistics_manager.write() {
+            stats.report_driver_counters(counters);
+        }
+    }
+
+    pub fn report_gpu_utilization(&self, samples: &[GpuUtilization]) {
+        dbg_server_core!("report_gpu_utilization");
+
+        if let Some(stats) = &mut *self.connection_context.statistics_manager.write() {
+            stats.report_gpu_utilization(samples);
+        }
+    }
+
+    pub fn report_frame_stages(&self, frames: &[FrameStageTimestamps]) {
+        dbg_server_core!("report_frame_stages");
+
+        if let Some(stats) = &mut *self.connection_context.statistics_manager.write() {
+            stats.report_frame_stages(frames);
+        }
+    }
+
     pub fn duration_until_next_vsync(&self) -> Option<Duration> {
         dbg_server_core!("duration_until_next_vsync");
 
@@ -514,6 +658,28 @@ impl ServerCoreContext {
             .map(|stats| stats.duration_until_next_vsync())
     }
 
+    // Time until the next vsync and the vsync interval, locked to the client display
+    pub fn vsync_timing(&self) -> Option<(Duration, Duration)> {
+        dbg_server_core!("vsync_timing");
+
+        self.connection_context
+            .statistics_manager
+            .write()
+            .as_mut()
+            .map(|stats| (stats.duration_until_next_vsync(), stats.frame_interval()))
+    }
+
+    // Motion-to-photon, network and client side latencies, averaged over the last frames
+    pub fn client_pipeline_timing(&self) -> Option<(Duration, Duration, Duration)> {
+        dbg_server_core!("client_pipeline_timing");
+
+        self.connection_context
+            .statistics_manager
+            .read()
+            .as_ref()
+            .map(|stats| stats.client_pipeline_timing())
+    }
+
     pub fn restart(self) {
         dbg_server_core!("restart");
 
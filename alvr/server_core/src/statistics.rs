@@ -1,5 +1,8 @@
 use alvr_common::{HEAD_ID, SlidingWindowAverage};
-use alvr_events::{BitrateDirectives, EventType, GraphStatistics, StatisticsSummary};
+use alvr_events::{
+    BitrateDirectives, EventType, FrameStageHistogram, FrameStageStatistics, GraphStatistics,
+    StatisticsSummary,
+};
 use alvr_packets::ClientStatistics;
 use std::{
     collections::{HashMap, VecDeque},
@@ -8,6 +11,75 @@ use std::{
 
 const FULL_REPORT_INTERVAL: Duration = Duration::from_millis(500);
 const EPS_INTERVAL: Duration = Duration::from_micros(1);
+// Fraction of the client vsync phase and interval errors corrected on each frame. Small enough to
+// filter out the network jitter of the estimates
+const VSYNC_PHASE_GAIN: f64 = 0.05;
+const VSYNC_INTERVAL_GAIN: f64 = 0.01;
+// Client frame intervals further than this from the nominal one span dropped or repeated frames
+const VSYNC_INTERVAL_TOLERANCE: f64 = 0.1;
+// Adaptive pacing: the client vsync queue is averaged over about 1 / PACING_SLACK_WEIGHT frames
+// and compared to the margin, taken from the spread of the last PACING_WINDOW_SIZE frames. Errors
+// within the deadband are ignored, the rest moves the frame start by a fraction per frame, faster
+// towards earlier since a late frame costs a whole vsync
+const PACING_SLACK_WEIGHT: f64 = 0.1;
+const PACING_WINDOW_SIZE: usize = 90;
+const PACING_MIN_MARGIN: Duration = Duration::from_millis(1);
+const PACING_DEADBAND: Duration = Duration::from_micros(500);
+const PACING_LATER_GAIN: f64 = 0.005;
+const PACING_EARLIER_GAIN: f64 = 0.02;
+// Of the frame interval, either way
+const PACING_MAX_OFFSET: f64 = 0.5;
+const STAGE_BUCKET_WIDTH: Duration = Duration::from_micros(500);
+// The last bucket also counts all longer intervals
+const STAGE_BUCKETS_COUNT: usize = 40;
+const STAGE_NAMES: [&str; 7] = [
+    "Compositor queue",
+    "Compositor",
+    "Encoder queue",
+    "Encode",
+    "Encode to first NAL",
+    "Send",
+    "Total",
+];
+
+// Times at which a frame went through each stage of the driver, on the same (arbitrary) steady
+// clock. Stages that weren't recorded for the frame are None.
+#[derive(Clone, Default)]
+pub struct FrameStageTimestamps {
+    pub present: Option<Duration>,
+    pub pose_matched: Option<Duration>,
+    pub composite_begin: Option<Duration>,
+    pub composite_end: Option<Duration>,
+    pub encode_submit: Option<Duration>,
+    pub encode_complete: Option<Duration>,
+    pub first_nal_sent: Option<Duration>,
+    pub last_nal_sent: Option<Duration>,
+}
+
+// Event totals of the driver since it started
+#[derive(Clone, Copy, Default)]
+pub struct DriverCounters {
+    pub frames_without_pose: u64,
+    pub idrs_inserted: u64,
+    pub acquire_sync_failures: u64,
+    pub nal_bytes: u64,
+    pub static_frames_skipped: u64,
+    pub duplicate_frames: u64,
+    pub send_queue_frames: u64,
+    pub send_queue_depth_sum: u64,
+    pub send_queue_dropped_frames: u64,
+}
+
+// How busy the GPU engines were at timestamp, on the clock of FrameStageTimestamps. None for the
+// values the GPU doesn't report
+#[derive(Clone, Copy, Default)]
+pub struct GpuUtilization {
+    pub timestamp: Duration,
+    pub graphics_percent: Option<f32>,
+    pub encoder_percent: Option<f32>,
+    pub pcie_rx_mbytes_per_sec: Option<f32>,
+    pub pcie_tx_mbytes_per_sec: Option<f32>,
+}
 
 pub struct HistoryFrame {
     target_timestamp: Duration,
@@ -50,12 +122,35 @@ pub struct StatisticsManager {
     video_packets_partial_sum: usize,
     video_bytes_total: usize,
     video_bytes_partial_sum: usize,
+    missed_vsyncs_total: usize,
+    missed_vsyncs_partial_sum: usize,
     battery_gauges: HashMap<u64, BatteryData>,
     steamvr_pipeline_latency: Duration,
     motion_to_photon_latency_average: SlidingWindowAverage<Duration>,
+    network_latency_average: SlidingWindowAverage<Duration>,
+    // Decode, decoder queue, rendering and vsync queue on the client
+    client_latency_average: SlidingWindowAverage<Duration>,
     last_vsync_time: Instant,
     frame_interval: Duration,
+    nominal_frame_interval: Duration,
     last_throughput_directives: BitrateDirectives,
+    last_stage_report_instant: Instant,
+    stage_histograms: [[u32; STAGE_BUCKETS_COUNT]; STAGE_NAMES.len()],
+    driver_counters: DriverCounters,
+    // Values at the last full report, the rates are computed from the difference. The counters
+    // keep counting across connections, so this starts from the first values of this one
+    reported_driver_counters: Option<DriverCounters>,
+    last_gpu_utilization: Option<GpuUtilization>,
+    // Highest values since the last full report
+    peak_gpu_utilization: GpuUtilization,
+    adaptive_frame_pacing: bool,
+    // Present to last NAL sent, and network latency, of the last frames
+    server_latency_window: VecDeque<Duration>,
+    network_latency_window: VecDeque<Duration>,
+    // Average time the frames wait for vsync on the client
+    client_slack_s: f64,
+    // How much later than the client vsync the streamer vsync is placed. Negative is earlier
+    pacing_offset_s: f64,
 }
 
 impl StatisticsManager {
@@ -64,6 +159,7 @@ impl StatisticsManager {
         max_history_size: usize,
         nominal_server_frame_interval: Duration,
         steamvr_pipeline_frames: f32,
+        adaptive_frame_pacing: bool,
     ) -> Self {
         Self {
             history_buffer: VecDeque::new(),
@@ -75,6 +171,8 @@ impl StatisticsManager {
             video_packets_partial_sum: 0,
             video_bytes_total: 0,
             video_bytes_partial_sum: 0,
+            missed_vsyncs_total: 0,
+            missed_vsyncs_partial_sum: 0,
             battery_gauges: HashMap::new(),
             steamvr_pipeline_latency: Duration::from_secs_f32(
                 steamvr_pipeline_frames * nominal_server_frame_interval.as_secs_f32(),
@@ -83,9 +181,23 @@ impl StatisticsManager {
                 Duration::ZERO,
                 max_history_size,
             ),
+            network_latency_average: SlidingWindowAverage::new(Duration::ZERO, max_history_size),
+            client_latency_average: SlidingWindowAverage::new(Duration::ZERO, max_history_size),
             last_vsync_time: Instant::now(),
             frame_interval: nominal_server_frame_interval,
+            nominal_frame_interval: nominal_server_frame_interval,
             last_throughput_directives: BitrateDirectives::default(),
+            last_stage_report_instant: Instant::now(),
+            stage_histograms: [[0; STAGE_BUCKETS_COUNT]; STAGE_NAMES.len()],
+            driver_counters: DriverCounters::default(),
+            reported_driver_counters: None,
+            last_gpu_utilization: None,
+            peak_gpu_utilization: GpuUtilization::default(),
+            adaptive_frame_pacing,
+            server_latency_window: VecDeque::new(),
+            network_latency_window: VecDeque::new(),
+            client_slack_s: 0.0,
+            pacing_offset_s: 0.0,
         }
     }
 
@@ -123,6 +235,11 @@ impl StatisticsManager {
         }
     }
 
+    pub fn report_missed_vsyncs(&mut self, count: usize) {
+        self.missed_vsyncs_total += count;
+        self.missed_vsyncs_partial_sum += count;
+    }
+
     pub fn report_frame_composed(&mut self, target_timestamp: Duration, offset: Duration) {
         if let Some(frame) = self
             .history_buffer
@@ -161,6 +278,89 @@ impl StatisticsManager {
         }
     }
 
+    pub fn report_frame_stages(&mut self, frames: &[FrameStageTimestamps]) {
+        fn interval(start: Option<Duration>, end: Option<Duration>) -> Option<Duration> {
+            Some(end?.saturating_sub(start?))
+        }
+
+        for frame in frames {
+            let start = match (frame.present, frame.pose_matched) {
+                (Some(present), Some(pose_matched)) => Some(Duration::min(present, pose_matched)),
+                (present, pose_matched) => present.or(pose_matched),
+            };
+
+            let intervals = [
+                interval(start, frame.composite_begin),
+                interval(frame.composite_begin, frame.composite_end),
+                interval(frame.composite_end, frame.encode_submit),
+                interval(frame.encode_submit, frame.encode_complete),
+                interval(frame.encode_submit, frame.first_nal_sent),
+                interval(frame.first_nal_sent, frame.last_nal_sent),
+                interval(start, frame.last_nal_sent),
+            ];
+
+            if let Some(total) = intervals[STAGE_NAMES.len() - 1] {
+                push_to_window(&mut self.server_latency_window, total);
+            }
+
+            for (histogram, interval) in self.stage_histograms.iter_mut().zip(intervals) {
+                if let Some(interval) = interval {
+                    let bucket = (interval.as_nanos() / STAGE_BUCKET_WIDTH.as_nanos()) as usize;
+                    histogram[usize::min(bucket, STAGE_BUCKETS_COUNT - 1)] += 1;
+                }
+            }
+        }
+
+        if self.last_stage_report_instant + FULL_REPORT_INTERVAL < Instant::now() {
+            self.last_stage_report_instant = Instant::now();
+
+            alvr_events::send_event(EventType::FrameStageStatistics(FrameStageStatistics {
+                bucket_width_s: STAGE_BUCKET_WIDTH.as_secs_f32(),
+                stages: STAGE_NAMES
+                    .iter()
+                    .zip(&self.stage_histograms)
+                    .map(|(name, counts)| FrameStageHistogram {
+                        name: (*name).into(),
+                        counts: counts.to_vec(),
+                    })
+                    .collect(),
+            }));
+
+            self.stage_histograms = [[0; STAGE_BUCKETS_COUNT]; STAGE_NAMES.len()];
+        }
+    }
+
+    pub fn report_driver_counters(&mut self, counters: DriverCounters) {
+        self.driver_counters = counters;
+        self.reported_driver_counters.get_or_insert(counters);
+    }
+
+    // Oldest first
+    pub fn report_gpu_utilization(&mut self, samples: &[GpuUtilization]) {
+        fn max(peak: &mut Option<f32>, value: Option<f32>) {
+            *peak = match (*peak, value) {
+                (Some(peak), Some(value)) => Some(f32::max(peak, value)),
+                (peak, value) => peak.or(value),
+            };
+        }
+
+        for sample in samples {
+            let peak = &mut self.peak_gpu_utilization;
+            max(&mut peak.graphics_percent, sample.graphics_percent);
+            max(&mut peak.encoder_percent, sample.encoder_percent);
+            max(
+                &mut peak.pcie_rx_mbytes_per_sec,
+                sample.pcie_rx_mbytes_per_sec,
+            );
+            max(
+                &mut peak.pcie_tx_mbytes_per_sec,
+                sample.pcie_tx_mbytes_per_sec,
+            );
+
+            self.last_gpu_utilization = Some(*sample);
+        }
+    }
+
     pub fn report_battery(&mut self, device_id: u64, gauge_value: f32, is_plugged: bool) {
         *self.battery_gauges.entry(device_id).or_default() = BatteryData {
             gauge_value,
@@ -185,6 +385,11 @@ impl StatisticsManager {
         {
             frame.total_pipeline_latency = client_stats.total_pipeline_latency;
 
+            // The client sampled the tracking of this frame a constant time (the uplink latency)
+            // before it was received, so this is the client vsync shifted by that constant
+            let client_vsync = frame.tracking_received + client_stats.total_pipeline_latency;
+            let client_frame_interval = client_stats.frame_interval;
+
             let game_time_latency = frame
                 .frame_present
                 .saturating_duration_since(frame.tracking_received);
@@ -212,6 +417,13 @@ impl StatisticsManager {
                     + client_stats.rendering
                     + client_stats.vsync_queue,
             );
+            self.network_latency_average.submit_sample(network_latency);
+            self.client_latency_average.submit_sample(
+                client_stats.video_decode
+                    + client_stats.video_decoder_queue
+                    + client_stats.rendering
+                    + client_stats.vsync_queue,
+            );
 
             let client_fps =
                 1.0 / Duration::max(client_stats.frame_interval, EPS_INTERVAL).as_secs_f32();
@@ -222,6 +434,8 @@ impl StatisticsManager {
                 self.last_full_report_instant += FULL_REPORT_INTERVAL;
 
                 let interval_secs = FULL_REPORT_INTERVAL.as_secs_f32();
+                let counters = self.driver_counters;
+                let reported = self.reported_driver_counters.unwrap_or(counters);
 
                 alvr_events::send_event(EventType::StatisticsSummary(StatisticsSummary {
                     video_packets_total: self.video_packets_total,
@@ -237,6 +451,64 @@ impl StatisticsManager {
                     decode_latency_ms: client_stats.video_decode.as_secs_f32() * 1000.,
                     client_fps: client_fps as _,
                     server_fps: server_fps as _,
+                    server_missed_vsyncs_total: self.missed_vsyncs_total,
+                    server_missed_vsyncs_per_sec: self.missed_vsyncs_partial_sum as f32
+                        / interval_secs,
+                    server_frames_without_pose_total: counters.frames_without_pose as _,
+                    server_frames_without_pose_per_sec: counters
+                        .frames_without_pose
+                        .saturating_sub(reported.frames_without_pose)
+                        as f32
+                        / interval_secs,
+                    server_idrs_total: counters.idrs_inserted as _,
+                    server_idrs_per_sec: counters
+                        .idrs_inserted
+                        .saturating_sub(reported.idrs_inserted)
+                        as f32
+                        / interval_secs,
+                    server_acquire_sync_failures_total: counters.acquire_sync_failures as _,
+                    server_static_frames_skipped_total: counters.static_frames_skipped as _,
+                    server_static_frames_skipped_per_sec: counters
+                        .static_frames_skipped
+                        .saturating_sub(reported.static_frames_skipped)
+                        as f32
+                        / interval_secs,
+                    server_duplicate_frames_total: counters.duplicate_frames as _,
+                    server_duplicate_frames_per_sec: counters
+                        .duplicate_frames
+                        .saturating_sub(reported.duplicate_frames)
+                        as f32
+                        / interval_secs,
+                    server_send_queue_average_depth: {
+                        let frames = counters
+                            .send_queue_frames
+                            .saturating_sub(reported.send_queue_frames);
+                        let depth_sum = counters
+                            .send_queue_depth_sum
+                            .saturating_sub(reported.send_queue_depth_sum);
+                        (frames > 0).then(|| depth_sum as f32 / frames as f32)
+                    },
+                    server_send_queue_dropped_frames_total: counters.send_queue_dropped_frames as _,
+                    server_send_queue_dropped_frames_per_sec: counters
+                        .send_queue_dropped_frames
+                        .saturating_sub(reported.send_queue_dropped_frames)
+                        as f32
+                        / interval_secs,
+                    encoder_output_mbits_per_sec: counters
+                        .nal_bytes
+                        .saturating_sub(reported.nal_bytes)
+                        as f32
+                        * 8.
+                        / 1e6
+                        / interval_secs,
+                    gpu_graphics_peak_percent: self.peak_gpu_utilization.graphics_percent,
+                    gpu_encoder_peak_percent: self.peak_gpu_utilization.encoder_percent,
+                    gpu_pcie_rx_peak_mbytes_per_sec: self
+                        .peak_gpu_utilization
+                        .pcie_rx_mbytes_per_sec,
+                    gpu_pcie_tx_peak_mbytes_per_sec: self
+                        .peak_gpu_utilization
+                        .pcie_tx_mbytes_per_sec,
                     battery_hmd: (self
                         .battery_gauges
                         .get(&HEAD_ID)
@@ -254,6 +526,9 @@ impl StatisticsManager {
 
                 self.video_packets_partial_sum = 0;
                 self.video_bytes_partial_sum = 0;
+                self.missed_vsyncs_partial_sum = 0;
+                self.reported_driver_counters = Some(counters);
+                self.peak_gpu_utilization = GpuUtilization::default();
             }
 
             let packet_bits = frame.video_packet_bytes as f32 * 8.0;
@@ -279,8 +554,19 @@ impl StatisticsManager {
                 bitrate_directives: self.last_throughput_directives.clone(),
                 throughput_bps,
                 bitrate_bps,
+                gpu_graphics_percent: self
+                    .last_gpu_utilization
+                    .and_then(|utilization| utilization.graphics_percent),
+                gpu_encoder_percent: self
+                    .last_gpu_utilization
+                    .and_then(|utilization| utilization.encoder_percent),
             }));
 
+            if self.adaptive_frame_pacing {
+                self.pace_vsync(client_stats.vsync_queue, network_latency);
+            }
+            self.lock_vsync(client_vsync, client_frame_interval);
+
             (network_latency, game_time_latency)
         } else {
             (Duration::ZERO, Duration::ZERO)
@@ -291,11 +577,91 @@ impl StatisticsManager {
         self.motion_to_photon_latency_average.get_average()
     }
 
+    // Averages of the motion-to-photon, network and client side latencies
+    pub fn client_pipeline_timing(&self) -> (Duration, Duration, Duration) {
+        (
+            self.motion_to_photon_latency_average.get_average(),
+            self.network_latency_average.get_average(),
+            self.client_latency_average.get_average(),
+        )
+    }
+
     pub fn tracker_pose_time_offset(&self) -> Duration {
         // This is the opposite of the client's StatisticsManager::tracker_prediction_offset().
         self.steamvr_pipeline_latency
     }
 
+    // Moves the streamer vsync a fraction of the way towards the client one, so that it follows the
+    // headset display clock instead of drifting away from it
+    fn lock_vsync(&mut self, client_vsync: Instant, client_frame_interval: Duration) {
+        let nominal_s = self.nominal_frame_interval.as_secs_f64();
+        let client_interval_s = client_frame_interval.as_secs_f64();
+        if (client_interval_s - nominal_s).abs() < nominal_s * VSYNC_INTERVAL_TOLERANCE {
+            let interval_s = self.frame_interval.as_secs_f64();
+            self.frame_interval = Duration::from_secs_f64(
+                interval_s + (client_interval_s - interval_s) * VSYNC_INTERVAL_GAIN,
+            );
+        }
+
+        let interval_s = self.frame_interval.as_secs_f64();
+        let offset_s = if client_vsync >= self.last_vsync_time {
+            (client_vsync - self.last_vsync_time).as_secs_f64()
+        } else {
+            -(self.last_vsync_time - client_vsync).as_secs_f64()
+        };
+        // The target is the client vsync moved by the pacing offset
+        let offset_s = offset_s + self.pacing_offset_s;
+        // Closest client vsync, either way
+        let error_s = offset_s - (offset_s / interval_s).round() * interval_s;
+        let correction = Duration::from_secs_f64((error_s * VSYNC_PHASE_GAIN).abs());
+        if error_s >= 0.0 {
+            self.last_vsync_time += correction;
+        } else if let Some(time) = self.last_vsync_time.checked_sub(correction) {
+            self.last_vsync_time = time;
+        }
+
+        // duration_until_next_vsync() expects it in the past
+        let now = Instant::now();
+        while self.last_vsync_time > now
+            && let Some(time) = self.last_vsync_time.checked_sub(self.frame_interval)
+        {
+            self.last_vsync_time = time;
+        }
+    }
+
+    // Moves the streamer vsync, relative to the client one, so that frames wait on the client only
+    // as long as needed to absorb the variations of the compositor, encoder, send and network
+    // times. Moving it later lets the game render with a later pose and cuts the latency by as much
+    fn pace_vsync(&mut self, client_vsync_queue: Duration, network_latency: Duration) {
+        push_to_window(&mut self.network_latency_window, network_latency);
+
+        self.client_slack_s +=
+            (client_vsync_queue.as_secs_f64() - self.client_slack_s) * PACING_SLACK_WEIGHT;
+
+        // The frames slower than average still have to arrive in time
+        let margin_s = PACING_MIN_MARGIN.as_secs_f64()
+            + window_spread_s(&self.server_latency_window)
+            + window_spread_s(&self.network_latency_window);
+
+        let error_s = self.client_slack_s - margin_s;
+        if error_s.abs() < PACING_DEADBAND.as_secs_f64() {
+            return;
+        }
+
+        let gain = if error_s > 0.0 {
+            PACING_LATER_GAIN
+        } else {
+            PACING_EARLIER_GAIN
+        };
+        let max_offset_s = self.frame_interval.as_secs_f64() * PACING_MAX_OFFSET;
+        self.pacing_offset_s =
+            (self.pacing_offset_s + error_s * gain).clamp(-max_offset_s, max_offset_s);
+    }
+
+    pub fn frame_interval(&self) -> Duration {
+        self.frame_interval
+    }
+
     // NB: this call is non-blocking, waiting should be done externally
     pub fn duration_until_next_vsync(&mut self) -> Duration {
         let now = Instant::now();
@@ -308,3 +674,22 @@ impl StatisticsManager {
         (self.last_vsync_time + self.frame_interval).saturating_duration_since(now)
     }
 }
+
+fn push_to_window(window: &mut VecDeque<Duration>, value: Duration) {
+    if window.len() >= PACING_WINDOW_SIZE {
+        window.pop_front();
+    }
+    window.push_back(value);
+}
+
+// How much longer than average the slowest value of the window is
+fn window_spread_s(window: &VecDeque<Duration>) -> f64 {
+    if window.is_empty() {
+        return 0.0;
+    }
+
+    let max = window.iter().max().copied().unwrap_or_default();
+    let average = window.iter().sum::<Duration>() / window.len() as u32;
+
+    max.saturating_sub(average).as_secs_f64()
+}
@@ -56,6 +56,7 @@ pub struct TrackingManager {
     inverse_recentering_origin: Pose, // client's reference space
     device_motions_history: HashMap<u64, VecDeque<(Duration, DeviceMotion)>>,
     hand_skeletons_history: [VecDeque<(Duration, [Pose; 26])>; 2],
+    eye_gaze_history: VecDeque<(Duration, Quat)>, // head space
     max_history_size: usize,
 }
 
@@ -66,6 +67,7 @@ impl TrackingManager {
             inverse_recentering_origin: Pose::IDENTITY,
             device_motions_history: HashMap::new(),
             hand_skeletons_history: [VecDeque::new(), VecDeque::new()],
+            eye_gaze_history: VecDeque::new(),
             max_history_size,
         }
     }
@@ -261,6 +263,22 @@ impl TrackingManager {
             .map(|(_, skeleton)| skeleton)
     }
 
+    // The gaze is relative to the head, so it is unaffected by recentering
+    pub fn report_eye_gaze(&mut self, timestamp: Duration, gaze: Quat) {
+        self.eye_gaze_history.push_back((timestamp, gaze));
+
+        if self.eye_gaze_history.len() > self.max_history_size {
+            self.eye_gaze_history.pop_front();
+        }
+    }
+
+    pub fn get_eye_gaze(&self, sample_timestamp: Duration) -> Option<Quat> {
+        self.eye_gaze_history
+            .iter()
+            .find(|(timestamp, _)| *timestamp == sample_timestamp)
+            .map(|(_, gaze)| *gaze)
+    }
+
     pub fn unrecenter_view_params(&self, view_params: &mut [ViewParams; 2]) {
         for params in view_params {
             params.pose = self.inverse_recentering_origin.inverse() * params.pose;
@@ -379,6 +397,9 @@ pub fn tracking_loop(
             if let Some(skeleton) = tracking.hand_skeletons[1] {
                 tracking_manager_lock.report_hand_skeleton(HandType::Right, timestamp, skeleton);
             }
+            if let Some(gaze) = tracking.face.eyes_combined {
+                tracking_manager_lock.report_eye_gaze(timestamp, gaze);
+            }
 
             if let Some(sink) = &mut face_tracking_sink {
                 sink.send_tracking(&tracking.face);
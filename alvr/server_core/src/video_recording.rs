@@ -0,0 +1,66 @@
+use alvr_common::{error, warn};
+use std::{
+    fs::File,
+    io::{BufWriter, Write},
+    path::PathBuf,
+    sync::mpsc::{self, SyncSender, TrySendError},
+    thread,
+};
+
+// Enough for a few seconds of slices at high refresh rates
+const QUEUE_CAPACITY: usize = 1024;
+
+// Writes the recorded video on its own thread, so that the encoder threads that send the frames
+// never wait for the disk. The file is closed once the recorder is dropped and the queued data is
+// written.
+pub struct VideoRecorder {
+    sender: SyncSender<Vec<u8>>,
+    dropping: bool,
+}
+
+impl VideoRecorder {
+    // header is written first, it holds the codec config NALs if they are known already
+    pub fn new(path: PathBuf, header: Option<Vec<u8>>) -> Self {
+        let (sender, receiver) = mpsc::sync_channel::<Vec<u8>>(QUEUE_CAPACITY);
+
+        thread::spawn(move || {
+            let file = match File::create(&path) {
+                Ok(file) => file,
+                Err(e) => {
+                    error!("Failed to record video on disk: {e}");
+                    return;
+                }
+            };
+            let mut writer = BufWriter::new(file);
+
+            for buffer in header.into_iter().chain(receiver) {
+                if let Err(e) = writer.write_all(&buffer) {
+                    error!("Failed to write {}: {e}", path.display());
+                    return;
+                }
+            }
+
+            writer.flush().ok();
+        });
+
+        Self {
+            sender,
+            dropping: false,
+        }
+    }
+
+    // Never blocks. If the disk can't keep up the buffer is dropped, the recording is then corrupted
+    // until the next IDR
+    pub fn write(&mut self, buffer: Vec<u8>) {
+        match self.sender.try_send(buffer) {
+            Ok(()) => self.dropping = false,
+            Err(TrySendError::Full(_)) => {
+                if !self.dropping {
+                    warn!("Dropping recorded video. Reason: The disk is too slow");
+                    self.dropping = true;
+                }
+            }
+            Err(TrySendError::Disconnected(_)) => (),
+        }
+    }
+}
@@ -18,7 +18,7 @@ use axum::{
     routing,
 };
 use serde_json as json;
-use std::{net::SocketAddr, path::PathBuf, sync::Arc};
+use std::{net::SocketAddr, path::PathBuf, sync::Arc, time::Duration};
 use tokio::{net::TcpListener, sync::broadcast::error::RecvError};
 use tower_http::{
     cors::{self, CorsLayer},
@@ -66,6 +66,7 @@ pub async fn web_server(connection_context: Arc<ConnectionContext>) -> Result<()
             "/api",
             Router::new()
                 .route("/events", routing::get(events_websocket))
+                .route("/spectator", routing::get(spectator_websocket))
                 .route("/log", routing::post(set_log))
                 .nest(
                     "/session",
@@ -80,6 +81,9 @@ pub async fn web_server(connection_context: Arc<ConnectionContext>) -> Result<()
                 .route("/buttons", routing::post(set_buttons))
                 .route("/insert-idr", routing::post(insert_idr))
                 .route("/capture-frame", routing::post(capture_frame))
+                .route("/capture-trace", routing::post(capture_trace))
+                .route("/flight-recorder", routing::post(dump_flight_recorder))
+                .route("/record-frames", routing::post(record_frames))
                 .nest(
                     "/recording",
                     Router::new()
@@ -152,6 +156,30 @@ async fn events_websocket(ws: WebSocketUpgrade) -> Response {
     })
 }
 
+// Raw H.264 packets. SPS and PPS are repeated with every IDR, so a spectator can start decoding
+// from the first IDR it receives
+async fn spectator_websocket(
+    State(ctx): State<Arc<ConnectionContext>>,
+    ws: WebSocketUpgrade,
+) -> Response {
+    ws.on_upgrade(async move |mut ws| {
+        let mut spectator_receiver = ctx.spectator_sender.subscribe();
+
+        loop {
+            match spectator_receiver.recv().await {
+                Ok(packet) => {
+                    if let Err(e) = ws.send(Message::Binary(packet.into())).await {
+                        info!("Failed to send spectator video with websocket: {e}");
+                        break;
+                    }
+                }
+                Err(RecvError::Lagged(_)) => (),
+                Err(RecvError::Closed) => break,
+            }
+        }
+    })
+}
+
 async fn set_log(Json(entry): Json<LogEntry>) {
     let level = entry.severity.into_log_level();
     log::log!(level, "{}", entry.content);
@@ -196,6 +224,54 @@ async fn capture_frame(State(ctx): State<Arc<ConnectionContext>>) {
     ctx.events_sender.send(ServerCoreEvent::CaptureFrame).ok();
 }
 
+async fn capture_trace(State(ctx): State<Arc<ConnectionContext>>) {
+    let path = FILESYSTEM_LAYOUT.get().unwrap().log_dir.join(format!(
+        "trace.{}.json",
+        chrono::Local::now().format("%F.%H-%M-%S")
+    ));
+    let duration_s = SESSION_MANAGER
+        .read()
+        .settings()
+        .extra
+        .capture
+        .trace_duration_s;
+
+    ctx.events_sender
+        .send(ServerCoreEvent::CaptureTrace {
+            path,
+            duration: Duration::from_secs(duration_s),
+        })
+        .ok();
+}
+
+async fn dump_flight_recorder(State(ctx): State<Arc<ConnectionContext>>) {
+    let path = FILESYSTEM_LAYOUT.get().unwrap().log_dir.join(format!(
+        "flight_recorder.{}.txt",
+        chrono::Local::now().format("%F.%H-%M-%S")
+    ));
+
+    ctx.events_sender
+        .send(ServerCoreEvent::DumpFlightRecorder(path))
+        .ok();
+}
+
+async fn record_frames(State(ctx): State<Arc<ConnectionContext>>) {
+    let path = FILESYSTEM_LAYOUT.get().unwrap().log_dir.join(format!(
+        "frames.{}.alvrrec",
+        chrono::Local::now().format("%F.%H-%M-%S")
+    ));
+    let frame_count = SESSION_MANAGER
+        .read()
+        .settings()
+        .extra
+        .capture
+        .frame_recording_count;
+
+    ctx.events_sender
+        .send(ServerCoreEvent::RecordFrames { path, frame_count })
+        .ok();
+}
+
 async fn start_recording(State(ctx): State<Arc<ConnectionContext>>) {
     crate::create_recording_file(&ctx, crate::SESSION_MANAGER.read().settings())
 }
@@ -21,6 +21,11 @@ fn get_linux_x264_path() -> PathBuf {
     alvr_filesystem::deps_dir().join("linux/x264/alvr_build")
 }
 
+#[cfg(target_os = "linux")]
+fn get_linux_svt_av1_path() -> PathBuf {
+    alvr_filesystem::deps_dir().join("linux/SVT-AV1/alvr_build")
+}
+
 fn main() {
     let platform_name = env::var("CARGO_CFG_TARGET_OS").unwrap();
     let out_dir = PathBuf::from(env::var("OUT_DIR").unwrap());
@@ -38,6 +43,7 @@ fn main() {
             entry.file_name() != "tools"
                 && entry.file_name() != "platform"
                 && (platform_name != "macos" || entry.file_name() != "amf")
+                && (platform_name != "macos" || entry.file_name() != "nvenc")
                 && (platform_name != "linux" || entry.file_name() != "amf")
         });
 
@@ -90,6 +96,16 @@ fn main() {
         build.include(ffmpeg_path.join("include"));
     }
 
+    // Only fetched when FFmpeg is built with NVENC, enables the CUDA interop of its pipeline
+    #[cfg(target_os = "linux")]
+    {
+        let nv_codec_headers_path =
+            alvr_filesystem::deps_dir().join("linux/nv-codec-headers/build/include");
+        if nv_codec_headers_path.exists() {
+            build.include(nv_codec_headers_path);
+        }
+    }
+
     #[cfg(all(target_os = "linux", feature = "gpl"))]
     {
         let x264_path = get_linux_x264_path();
@@ -101,6 +117,9 @@ fn main() {
     #[cfg(feature = "gpl")]
     build.define("ALVR_GPL", None);
 
+    #[cfg(feature = "driver-benchmark")]
+    build.define("ALVR_DRIVER_BENCHMARK", None);
+
     build.compile("bindings");
 
     #[cfg(all(target_os = "linux", feature = "gpl"))]
@@ -150,7 +169,13 @@ fn main() {
             let ffmpeg_pkg_path = ffmpeg_lib_path.join("pkgconfig");
             assert!(ffmpeg_pkg_path.exists());
 
-            let ffmpeg_pkg_path = ffmpeg_pkg_path.to_string_lossy().to_string();
+            // libavcodec links SVT-AV1 statically for libsvtav1
+            let svt_av1_pkg_path = get_linux_svt_av1_path().join("lib/pkgconfig");
+            let ffmpeg_pkg_path = format!(
+                "{}:{}",
+                ffmpeg_pkg_path.to_string_lossy(),
+                svt_av1_pkg_path.to_string_lossy()
+            );
             unsafe {
                 env::set_var(
                     "PKG_CONFIG_PATH",
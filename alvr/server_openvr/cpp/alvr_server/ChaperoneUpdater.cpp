@@ -1,8 +1,21 @@
 #include "ALVR-common/packet_types.h"
 #include "Logger.h"
 #include "bindings.h"
+#include <atomic>
+#include <condition_variable>
 #include <memory>
 #include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #ifndef __APPLE__
 // Workaround symbol clash in openvr.h / openvr_driver.h
@@ -12,9 +25,22 @@ namespace alvr_chaperone {
 using namespace alvr_chaperone;
 #endif
 
+// Held for every call to the OpenVR client
 std::mutex chaperone_mutex;
 
-bool isOpenvrInit = false;
+std::atomic<bool> isOpenvrInit = false;
+
+#ifndef __APPLE__
+// Play areas are applied by a low priority worker so that the caller never waits on the OpenVR
+// client. Requests are coalesced, only the latest one is applied and only if it differs from the
+// one already committed
+static std::mutex chaperoneQueueMutex;
+static std::condition_variable chaperoneQueueCv;
+static std::optional<std::pair<float, float>> pendingArea;
+static std::optional<std::pair<float, float>> appliedArea;
+static bool stopChaperoneWorker = false;
+static std::thread chaperoneWorker;
+#endif
 
 void InitOpenvrClient() {
     Debug("InitOpenvrClient");
@@ -34,7 +60,13 @@ void InitOpenvrClient() {
         Warn("Failed to init OpenVR client! Error: %d", error);
         return;
     }
-    isOpenvrInit = true;
+    {
+        // The live chaperone may not be ours anymore, and a request may be waiting for the client
+        std::unique_lock<std::mutex> queueLock(chaperoneQueueMutex);
+        appliedArea.reset();
+        isOpenvrInit = true;
+    }
+    chaperoneQueueCv.notify_one();
 #endif
 }
 
@@ -42,6 +74,20 @@ void ShutdownOpenvrClient() {
     Debug("ShutdownOpenvrClient");
 
 #ifndef __APPLE__
+    {
+        std::unique_lock<std::mutex> queueLock(chaperoneQueueMutex);
+        stopChaperoneWorker = true;
+    }
+    chaperoneQueueCv.notify_one();
+    if (chaperoneWorker.joinable()) {
+        chaperoneWorker.join();
+    }
+    {
+        std::unique_lock<std::mutex> queueLock(chaperoneQueueMutex);
+        stopChaperoneWorker = false;
+        pendingArea.reset();
+    }
+
     std::unique_lock<std::mutex> lock(chaperone_mutex);
 
     if (!isOpenvrInit) {
@@ -55,10 +101,10 @@ void ShutdownOpenvrClient() {
 
 bool IsOpenvrClientReady() { return isOpenvrInit; }
 
-void _SetChaperoneArea(float areaWidth, float areaHeight) {
-    Debug("SetChaperoneArea");
-
 #ifndef __APPLE__
+static void ApplyChaperoneArea(float areaWidth, float areaHeight) {
+    Debug("ApplyChaperoneArea");
+
     std::unique_lock<std::mutex> lock(chaperone_mutex);
 
     const vr::HmdMatrix34_t MATRIX_IDENTITY
@@ -95,7 +141,52 @@ void _SetChaperoneArea(float areaWidth, float areaHeight) {
             vr::k_pch_CollisionBounds_Section, vr::k_pch_CollisionBounds_FadeDistance_Float, 0.0f
         );
     }
+}
+
+static void ChaperoneWorkerLoop() {
+#ifdef _WIN32
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+#elif defined(__linux__)
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+#endif
+
+    std::unique_lock<std::mutex> lock(chaperoneQueueMutex);
+    while (true) {
+        // Requests made before the client is ready stay pending until InitOpenvrClient()
+        chaperoneQueueCv.wait(lock, [] {
+            return stopChaperoneWorker || (pendingArea.has_value() && isOpenvrInit);
+        });
+        if (stopChaperoneWorker) {
+            return;
+        }
+
+        auto area = *pendingArea;
+        pendingArea.reset();
+        if (area == appliedArea) {
+            continue;
+        }
+
+        lock.unlock();
+        ApplyChaperoneArea(area.first, area.second);
+        lock.lock();
+
+        appliedArea = area;
+    }
+}
+#endif
+
+void _SetChaperoneArea(float areaWidth, float areaHeight) {
+    Debug("SetChaperoneArea");
 
+#ifndef __APPLE__
+    {
+        std::unique_lock<std::mutex> lock(chaperoneQueueMutex);
+        pendingArea = { areaWidth, areaHeight };
+        if (!chaperoneWorker.joinable()) {
+            chaperoneWorker = std::thread(ChaperoneWorkerLoop);
+        }
+    }
+    chaperoneQueueCv.notify_one();
 #endif
 }
 
@@ -0,0 +1,65 @@
+#include "ClockCalibration.h"
+
+#include "Logger.h"
+#include <cmath>
+
+bool ClockCalibration::NeedsSample(uint64_t hostNs) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_anchorHostNs == 0 || hostNs - m_anchorHostNs >= CALIBRATION_INTERVAL_NS;
+}
+
+void ClockCalibration::AddSample(uint64_t deviceNs, uint64_t hostNs, uint64_t deviationNs) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_anchorHostNs == 0) {
+        m_anchorDeviceNs = deviceNs;
+        m_anchorHostNs = hostNs;
+        m_anchorDeviationNs = deviationNs;
+        return;
+    }
+    if (hostNs <= m_anchorHostNs || deviceNs <= m_anchorDeviceNs) {
+        return;
+    }
+    // A pair much less precise than the anchor would add more error than the drift it corrects,
+    // until the anchor is old enough for the drift to dominate
+    const uint64_t elapsedNs = hostNs - m_anchorHostNs;
+    if (deviationNs > 2 * m_anchorDeviationNs + DEVIATION_SLACK_NS
+        && elapsedNs < 10 * CALIBRATION_INTERVAL_NS) {
+        return;
+    }
+
+    const double predictedNs
+        = (double)m_anchorHostNs + (double)(deviceNs - m_anchorDeviceNs) * m_rate;
+    const double rate = (double)elapsedNs / (double)(deviceNs - m_anchorDeviceNs);
+    if (std::abs(rate - 1.0) > MAX_DRIFT) {
+        Warn(
+            "ClockCalibration: the device clock jumped by %.3f ms, calibrating again\n",
+            ((double)hostNs - predictedNs) / 1e6
+        );
+        m_rate = 1.0;
+    } else {
+        m_rate += (rate - m_rate) * DRIFT_SMOOTHING;
+        Debug(
+            "ClockCalibration: drift %.2f ppm, error %.1f us\n",
+            (m_rate - 1.0) * 1e6,
+            ((double)hostNs - predictedNs) / 1e3
+        );
+    }
+    m_anchorDeviceNs = deviceNs;
+    m_anchorHostNs = hostNs;
+    m_anchorDeviationNs = deviationNs;
+}
+
+bool ClockCalibration::IsCalibrated() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_anchorHostNs != 0;
+}
+
+uint64_t ClockCalibration::ToHost(uint64_t deviceNs) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_anchorHostNs == 0) {
+        return 0;
+    }
+    // The device timestamps converted are usually a bit older than the anchor
+    const double offsetNs = ((double)deviceNs - (double)m_anchorDeviceNs) * m_rate;
+    return (uint64_t)((double)m_anchorHostNs + offsetNs);
+}
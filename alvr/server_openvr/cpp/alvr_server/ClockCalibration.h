@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+
+// Maps the timestamps of a device clock, like the one of the GPU, to FrameTrace::Now(), the clock
+// the layer, the compositor and the encoders all report in. Pairs of timestamps sampled together
+// are fed again every CALIBRATION_INTERVAL_NS, so that the drift of the device clock is measured
+// and corrected for rather than assuming both advance at the same rate from a single offset.
+class ClockCalibration {
+public:
+    static const uint64_t CALIBRATION_INTERVAL_NS = 1000000000;
+
+    // Whether a new pair is due
+    bool NeedsSample(uint64_t hostNs) const;
+    // A pair of timestamps of the same instant, known within deviationNs. Pairs less precise than
+    // the current calibration are ignored unless it is stale
+    void AddSample(uint64_t deviceNs, uint64_t hostNs, uint64_t deviationNs);
+
+    bool IsCalibrated() const;
+    // In the FrameTrace::Now() domain, 0 before the first pair
+    uint64_t ToHost(uint64_t deviceNs) const;
+
+private:
+    // Drift above which the clocks are assumed to have been reset rather than drifting
+    static constexpr double MAX_DRIFT = 1e-3;
+    // A pair up to twice as imprecise as the anchor plus this is still taken
+    static const uint64_t DEVIATION_SLACK_NS = 10000;
+    // Weight of a new drift measure, it is noisy over a single interval
+    static constexpr double DRIFT_SMOOTHING = 0.25;
+
+    mutable std::mutex m_mutex;
+    uint64_t m_anchorDeviceNs = 0;
+    uint64_t m_anchorHostNs = 0;
+    uint64_t m_anchorDeviationNs = 0;
+    // Host ns elapsed per device ns
+    double m_rate = 1.0;
+};
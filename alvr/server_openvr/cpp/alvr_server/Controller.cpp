@@ -8,12 +8,28 @@
 #include <cstring>
 #include <string_view>
 
+// The joints are already in OpenVR bone order, only the layout of the rotations and positions
+// differs. Written as a single pass over the joints so that it compiles to plain shuffles
+void Controller::HandSkeletonToBones(
+    const FfiHandSkeleton& skeleton, vr::VRBoneTransform_t bones[]
+) {
+    for (int j = 0; j < SKELETON_BONE_COUNT; j++) {
+        const FfiQuat& r = skeleton.jointRotations[j];
+        const float* p = skeleton.jointPositions[j];
+        bones[j] = { { p[0], p[1], p[2], 1.f }, { r.w, r.x, r.y, r.z } };
+    }
+
+    // The root bone is the origin of the skeleton, its pose is the one of the device
+    bones[0] = { { 0.f, 0.f, 0.f, 1.f }, { 1.f, 0.f, 0.f, 0.f } };
+}
+
 Controller::Controller(uint64_t deviceID, vr::EVRSkeletalTrackingLevel skeletonLevel)
     : TrackedDevice(
           deviceID,
           Settings::Instance().m_controllerIsTracker ? vr::TrackedDeviceClass_GenericTracker
                                                      : vr::TrackedDeviceClass_Controller
       )
+    , m_componentHandles(BUTTON_COMPONENT_COUNT, vr::k_ulInvalidInputComponentHandle)
     , m_skeletonLevel(skeletonLevel) {
     Debug("Controller::constructor deviceID=%llu", deviceID);
 }
@@ -32,28 +48,28 @@ bool Controller::activate() {
     vr_driver_input->CreateScalarComponent(
         this->prop_container,
         "/input/finger/index",
-        &m_buttonHandles[ALVR_INPUT_FINGER_INDEX],
+        &m_compFingerIndex,
         vr::VRScalarType_Absolute,
         vr::VRScalarUnits_NormalizedOneSided
     );
     vr_driver_input->CreateScalarComponent(
         this->prop_container,
         "/input/finger/middle",
-        &m_buttonHandles[ALVR_INPUT_FINGER_MIDDLE],
+        &m_compFingerMiddle,
         vr::VRScalarType_Absolute,
         vr::VRScalarUnits_NormalizedOneSided
     );
     vr_driver_input->CreateScalarComponent(
         this->prop_container,
         "/input/finger/ring",
-        &m_buttonHandles[ALVR_INPUT_FINGER_RING],
+        &m_compFingerRing,
         vr::VRScalarType_Absolute,
         vr::VRScalarUnits_NormalizedOneSided
     );
     vr_driver_input->CreateScalarComponent(
         this->prop_container,
         "/input/finger/pinky",
-        &m_buttonHandles[ALVR_INPUT_FINGER_PINKY],
+        &m_compFingerPinky,
         vr::VRScalarType_Absolute,
         vr::VRScalarUnits_NormalizedOneSided
     );
@@ -109,66 +125,69 @@ vr::VRInputComponentHandle_t Controller::getHapticComponent() { return m_compHap
 void Controller::RegisterButton(uint64_t id) {
     Debug("Controller::RegisterButton deviceID=%llu", this->device_id);
 
-    ButtonInfo buttonInfo;
-    if (device_id == HAND_LEFT_ID) {
-        buttonInfo = LEFT_CONTROLLER_BUTTON_MAPPING[id];
-    } else {
-        buttonInfo = RIGHT_CONTROLLER_BUTTON_MAPPING[id];
+    const ButtonDispatch* button = FindButtonDispatch(id);
+    if (button == nullptr) {
+        return;
     }
 
-    if (buttonInfo.type == ButtonType::Binary) {
-        for (auto path : buttonInfo.steamvr_paths) {
-            vr::VRDriverInput()->CreateBooleanComponent(
-                this->prop_container, path, &m_buttonHandles[PathStringToHash(path)]
-            );
+    const auto& mapping
+        = button->isLeft ? LEFT_CONTROLLER_BUTTON_MAPPING : RIGHT_CONTROLLER_BUTTON_MAPPING;
+    const ButtonInfo& buttonInfo = mapping.at(id);
+
+    for (uint32_t i = 0; i < button->componentCount; i++) {
+        auto path = buttonInfo.steamvr_paths[i];
+        auto handle = &m_componentHandles[BUTTON_COMPONENTS[button->firstComponent + i]];
+        // Already created for another button with the same path
+        if (*handle != vr::k_ulInvalidInputComponentHandle) {
+            continue;
         }
-    } else {
-        auto scalarType = buttonInfo.type == ButtonType::ScalarOneSided
-            ? vr::VRScalarUnits_NormalizedOneSided
-            : vr::VRScalarUnits_NormalizedTwoSided;
 
-        for (auto path : buttonInfo.steamvr_paths) {
+        if (button->type == ButtonType::Binary) {
+            vr::VRDriverInput()->CreateBooleanComponent(this->prop_container, path, handle);
+        } else {
+            auto scalarType = button->type == ButtonType::ScalarOneSided
+                ? vr::VRScalarUnits_NormalizedOneSided
+                : vr::VRScalarUnits_NormalizedTwoSided;
+
             vr::VRDriverInput()->CreateScalarComponent(
-                this->prop_container,
-                path,
-                &m_buttonHandles[PathStringToHash(path)],
-                vr::VRScalarType_Absolute,
-                scalarType
+                this->prop_container, path, handle, vr::VRScalarType_Absolute, scalarType
             );
         }
     }
 }
 
-void Controller::SetButton(uint64_t id, FfiButtonValue value) {
-    Debug("Controller::SetButton deviceID=%llu buttonID=%llu", this->device_id, id);
+void Controller::SetButton(const ButtonDispatch& button, FfiButtonValue value) {
+    Debug("Controller::SetButton deviceID=%llu buttonID=%llu", this->device_id, button.id);
 
     if (!this->last_pose.poseIsValid) {
         return;
     }
 
-    for (auto id : ALVR_TO_STEAMVR_PATH_IDS[id]) {
+    for (uint32_t i = 0; i < button.componentCount; i++) {
+        auto handle = m_componentHandles[BUTTON_COMPONENTS[button.firstComponent + i]];
         if (value.type == BUTTON_TYPE_BINARY) {
-            vr::VRDriverInput()->UpdateBooleanComponent(
-                m_buttonHandles[id], (bool)value.binary, 0.0
-            );
+            vr::VRDriverInput()->UpdateBooleanComponent(handle, (bool)value.binary, 0.0);
         } else {
-            vr::VRDriverInput()->UpdateScalarComponent(m_buttonHandles[id], value.scalar, 0.0);
+            vr::VRDriverInput()->UpdateScalarComponent(handle, value.scalar, 0.0);
         }
     }
 
     // todo: remove when moving inferred controller hand skeleton to rust
-    if (id == LEFT_A_TOUCH_ID || id == LEFT_B_TOUCH_ID || id == LEFT_X_TOUCH_ID
-        || id == LEFT_Y_TOUCH_ID || id == LEFT_TRACKPAD_TOUCH_ID || id == LEFT_THUMBSTICK_TOUCH_ID
-        || id == LEFT_THUMBREST_TOUCH_ID || id == RIGHT_A_TOUCH_ID || id == RIGHT_B_TOUCH_ID
-        || id == RIGHT_TRACKPAD_TOUCH_ID || id == RIGHT_THUMBSTICK_TOUCH_ID
-        || id == RIGHT_THUMBREST_TOUCH_ID) {
+    switch (button.gesture) {
+    case ButtonGesture::ThumbTouch:
         m_currentThumbTouch = value.binary;
-    } else if (id == LEFT_TRIGGER_TOUCH_ID || id == RIGHT_TRIGGER_TOUCH_ID) {
+        break;
+    case ButtonGesture::TriggerTouch:
         m_currentTriggerTouch = value.binary;
-    } else if (id == LEFT_TRIGGER_VALUE_ID || id == RIGHT_TRIGGER_VALUE_ID) {
+        break;
+    case ButtonGesture::TriggerValue:
         m_triggerValue = value.scalar;
-    } else if (id == LEFT_SQUEEZE_VALUE_ID || id == RIGHT_SQUEEZE_VALUE_ID) {
+        break;
+    case ButtonGesture::GripValue:
         m_gripValue = value.scalar;
+        break;
+    case ButtonGesture::None:
+        break;
     }
 }
 
@@ -187,16 +206,6 @@ bool Controller::OnPoseUpdate(uint64_t targetTimestampNs, float predictionS, Ffi
     bool enabled = (controllerMotion != nullptr || handSkeleton != nullptr)
         && (enabledAsHandTracker || enabledAsController);
 
-    Debug(
-        "%s %s: enabled: %d, ctrl: %d, hand: %d",
-        (device_id == HAND_TRACKER_LEFT_ID || device_id == HAND_TRACKER_RIGHT_ID) ? "hand tracker"
-                                                                                  : "controller",
-        (device_id == HAND_TRACKER_LEFT_ID || device_id == HAND_LEFT_ID) ? "left" : "right",
-        enabled,
-        handData.controllerMotion != nullptr,
-        handData.handSkeleton != nullptr
-    );
-
     auto vr_driver_input = vr::VRDriverInput();
 
     auto pose = vr::DriverPose_t {};
@@ -273,28 +282,8 @@ bool Controller::OnPoseUpdate(uint64_t targetTimestampNs, float predictionS, Ffi
     if (!enabled) {
         return false;
     } else if (handSkeleton != nullptr) {
-        vr::VRBoneTransform_t boneTransform[SKELETON_BONE_COUNT] = {};
-
-        boneTransform[0].orientation.w = 1.0;
-        boneTransform[0].orientation.x = 0.0;
-        boneTransform[0].orientation.y = 0.0;
-        boneTransform[0].orientation.z = 0.0;
-        boneTransform[0].position.v[0] = 0.0;
-        boneTransform[0].position.v[1] = 0.0;
-        boneTransform[0].position.v[2] = 0.0;
-        boneTransform[0].position.v[3] = 1.0;
-
-        // NB: start from index 1 to skip the root bone
-        for (int j = 1; j < 31; j++) {
-            boneTransform[j].orientation.w = handSkeleton->jointRotations[j].w;
-            boneTransform[j].orientation.x = handSkeleton->jointRotations[j].x;
-            boneTransform[j].orientation.y = handSkeleton->jointRotations[j].y;
-            boneTransform[j].orientation.z = handSkeleton->jointRotations[j].z;
-            boneTransform[j].position.v[0] = handSkeleton->jointPositions[j][0];
-            boneTransform[j].position.v[1] = handSkeleton->jointPositions[j][1];
-            boneTransform[j].position.v[2] = handSkeleton->jointPositions[j][2];
-            boneTransform[j].position.v[3] = 1.0;
-        }
+        vr::VRBoneTransform_t boneTransform[SKELETON_BONE_COUNT];
+        HandSkeletonToBones(*handSkeleton, boneTransform);
 
         vr_driver_input->UpdateSkeletonComponent(
             m_compSkeleton,
@@ -326,18 +315,10 @@ bool Controller::OnPoseUpdate(uint64_t targetTimestampNs, float predictionS, Ffi
                           + handSkeleton->jointRotations[24].z)
             * 0.67f;
 
-        vr_driver_input->UpdateScalarComponent(
-            m_buttonHandles[ALVR_INPUT_FINGER_INDEX], rotIndex, 0.0
-        );
-        vr_driver_input->UpdateScalarComponent(
-            m_buttonHandles[ALVR_INPUT_FINGER_MIDDLE], rotMiddle, 0.0
-        );
-        vr_driver_input->UpdateScalarComponent(
-            m_buttonHandles[ALVR_INPUT_FINGER_RING], rotRing, 0.0
-        );
-        vr_driver_input->UpdateScalarComponent(
-            m_buttonHandles[ALVR_INPUT_FINGER_PINKY], rotPinky, 0.0
-        );
+        vr_driver_input->UpdateScalarComponent(m_compFingerIndex, rotIndex, 0.0);
+        vr_driver_input->UpdateScalarComponent(m_compFingerMiddle, rotMiddle, 0.0);
+        vr_driver_input->UpdateScalarComponent(m_compFingerRing, rotRing, 0.0);
+        vr_driver_input->UpdateScalarComponent(m_compFingerPinky, rotPinky, 0.0);
     } else if (controllerMotion != nullptr) {
         if (m_lastThumbTouch != m_currentThumbTouch) {
             m_thumbTouchAnimationProgress += 1.f / ANIMATION_FRAME_COUNT;
@@ -367,27 +348,17 @@ bool Controller::OnPoseUpdate(uint64_t targetTimestampNs, float predictionS, Ffi
         } else {
             indexCurl = 0.5 - m_indexTouchAnimationProgress * 0.5;
         }
-        vr_driver_input->UpdateScalarComponent(
-            m_buttonHandles[ALVR_INPUT_FINGER_INDEX], indexCurl, 0.0
-        );
+        vr_driver_input->UpdateScalarComponent(m_compFingerIndex, indexCurl, 0.0);
 
-        vr_driver_input->UpdateScalarComponent(
-            m_buttonHandles[ALVR_INPUT_FINGER_MIDDLE], m_gripValue, 0.0
-        );
+        vr_driver_input->UpdateScalarComponent(m_compFingerMiddle, m_gripValue, 0.0);
 
         // Ring and pinky fingers are not tracked. Infer a more natural pose.
         if (m_currentThumbTouch) {
-            vr_driver_input->UpdateScalarComponent(m_buttonHandles[ALVR_INPUT_FINGER_RING], 1, 0.0);
-            vr_driver_input->UpdateScalarComponent(
-                m_buttonHandles[ALVR_INPUT_FINGER_PINKY], 1, 0.0
-            );
+            vr_driver_input->UpdateScalarComponent(m_compFingerRing, 1, 0.0);
+            vr_driver_input->UpdateScalarComponent(m_compFingerPinky, 1, 0.0);
         } else {
-            vr_driver_input->UpdateScalarComponent(
-                m_buttonHandles[ALVR_INPUT_FINGER_RING], m_gripValue, 0.0
-            );
-            vr_driver_input->UpdateScalarComponent(
-                m_buttonHandles[ALVR_INPUT_FINGER_PINKY], m_gripValue, 0.0
-            );
+            vr_driver_input->UpdateScalarComponent(m_compFingerRing, m_gripValue, 0.0);
+            vr_driver_input->UpdateScalarComponent(m_compFingerPinky, m_gripValue, 0.0);
         }
 
         vr::VRBoneTransform_t boneTransforms[SKELETON_BONE_COUNT];
@@ -1187,11 +1158,76 @@ void GetGripClickBoneTransform(
     }
 }
 
+struct Controller::BonePoseTables {
+    // Indexed by [withController][isLeftHand] and then the touch state
+    vr::VRBoneTransform_t thumb[2][2][2][SKELETON_BONE_COUNT] = {};
+    vr::VRBoneTransform_t trigger[2][2][2][SKELETON_BONE_COUNT] = {};
+    vr::VRBoneTransform_t triggerClick[2][2][SKELETON_BONE_COUNT] = {};
+    vr::VRBoneTransform_t gripClick[2][2][SKELETON_BONE_COUNT] = {};
+
+    BonePoseTables() {
+        for (int withController = 0; withController < 2; withController++) {
+            for (int isLeftHand = 0; isLeftHand < 2; isLeftHand++) {
+                for (int touch = 0; touch < 2; touch++) {
+                    GetThumbBoneTransform(
+                        withController, isLeftHand, touch, thumb[withController][isLeftHand][touch]
+                    );
+                    GetTriggerBoneTransform(
+                        withController,
+                        isLeftHand,
+                        touch,
+                        false,
+                        trigger[withController][isLeftHand][touch]
+                    );
+                }
+                GetTriggerBoneTransform(
+                    withController, isLeftHand, true, true, triggerClick[withController][isLeftHand]
+                );
+                GetGripClickBoneTransform(
+                    withController, isLeftHand, gripClick[withController][isLeftHand]
+                );
+            }
+        }
+    }
+};
+
+const Controller::BonePoseTables& Controller::GetBonePoseTables() {
+    static const BonePoseTables tables;
+    return tables;
+}
+
+namespace {
+// Blend the bones in [begin, end) to out, which may be the same as from. Most of the time the
+// animations are settled at either end and the bones are copied
+void BlendBones(
+    const vr::VRBoneTransform_t from[],
+    const vr::VRBoneTransform_t to[],
+    float progress,
+    int begin,
+    int end,
+    vr::VRBoneTransform_t out[]
+) {
+    if (progress <= 0) {
+        if (from != out) {
+            std::copy(from + begin, from + end, out + begin);
+        }
+        return;
+    }
+    if (progress >= 1) {
+        std::copy(to + begin, to + end, out + begin);
+        return;
+    }
+    for (int boneIdx = begin; boneIdx < end; boneIdx++) {
+        out[boneIdx].position = Lerp(from[boneIdx].position, to[boneIdx].position, progress);
+        out[boneIdx].orientation
+            = Slerp(from[boneIdx].orientation, to[boneIdx].orientation, progress);
+    }
+}
+}
+
 void Controller::GetBoneTransform(bool withController, vr::VRBoneTransform_t outBoneTransform[]) {
     auto isLeftHand = device_id == HAND_LEFT_ID;
-
-    vr::VRBoneTransform_t boneTransform1[SKELETON_BONE_COUNT];
-    vr::VRBoneTransform_t boneTransform2[SKELETON_BONE_COUNT];
+    const BonePoseTables& tables = GetBonePoseTables();
 
     // root and wrist
     outBoneTransform[0] = { { 0.000000f, 0.000000f, 0.000000f, 1 },
@@ -1205,78 +1241,44 @@ void Controller::GetBoneTransform(bool withController, vr::VRBoneTransform_t out
     }
 
     // thumb
-    GetThumbBoneTransform(withController, isLeftHand, m_lastThumbTouch, boneTransform1);
-    GetThumbBoneTransform(withController, isLeftHand, m_currentThumbTouch, boneTransform2);
-    for (int boneIdx = 2; boneIdx < 6; boneIdx++) {
-        outBoneTransform[boneIdx].position = Lerp(
-            boneTransform1[boneIdx].position,
-            boneTransform2[boneIdx].position,
-            m_thumbTouchAnimationProgress
-        );
-        outBoneTransform[boneIdx].orientation = Slerp(
-            boneTransform1[boneIdx].orientation,
-            boneTransform2[boneIdx].orientation,
-            m_thumbTouchAnimationProgress
-        );
-    }
+    const auto& thumb = tables.thumb[withController][isLeftHand];
+    BlendBones(
+        thumb[m_lastThumbTouch],
+        thumb[m_currentThumbTouch],
+        m_thumbTouchAnimationProgress,
+        2,
+        6,
+        outBoneTransform
+    );
 
     // trigger (index to pinky)
+    const auto& trigger = tables.trigger[withController][isLeftHand];
     if (m_triggerValue > 0) {
-        GetTriggerBoneTransform(withController, isLeftHand, true, false, boneTransform1);
-        GetTriggerBoneTransform(withController, isLeftHand, true, true, boneTransform2);
-        for (int boneIdx = 6; boneIdx < SKELETON_BONE_COUNT; boneIdx++) {
-            outBoneTransform[boneIdx].position = Lerp(
-                boneTransform1[boneIdx].position, boneTransform2[boneIdx].position, m_triggerValue
-            );
-            outBoneTransform[boneIdx].orientation = Slerp(
-                boneTransform1[boneIdx].orientation,
-                boneTransform2[boneIdx].orientation,
-                m_triggerValue
-            );
-        }
-    } else {
-        GetTriggerBoneTransform(
-            withController, isLeftHand, m_lastTriggerTouch, false, boneTransform1
+        BlendBones(
+            trigger[true],
+            tables.triggerClick[withController][isLeftHand],
+            m_triggerValue,
+            6,
+            SKELETON_BONE_COUNT,
+            outBoneTransform
         );
-        GetTriggerBoneTransform(
-            withController, isLeftHand, m_currentTriggerTouch, false, boneTransform2
+    } else {
+        BlendBones(
+            trigger[m_lastTriggerTouch],
+            trigger[m_currentTriggerTouch],
+            m_indexTouchAnimationProgress,
+            6,
+            SKELETON_BONE_COUNT,
+            outBoneTransform
         );
-        for (int boneIdx = 6; boneIdx < SKELETON_BONE_COUNT; boneIdx++) {
-            outBoneTransform[boneIdx].position = Lerp(
-                boneTransform1[boneIdx].position,
-                boneTransform2[boneIdx].position,
-                m_indexTouchAnimationProgress
-            );
-            outBoneTransform[boneIdx].orientation = Slerp(
-                boneTransform1[boneIdx].orientation,
-                boneTransform2[boneIdx].orientation,
-                m_indexTouchAnimationProgress
-            );
-        }
     }
 
     // grip (middle to pinky)
     if (m_gripValue > 0) {
-        GetGripClickBoneTransform(withController, isLeftHand, boneTransform2);
-        for (int boneIdx = 11; boneIdx < 26; boneIdx++) {
-            outBoneTransform[boneIdx].position = Lerp(
-                outBoneTransform[boneIdx].position, boneTransform2[boneIdx].position, m_gripValue
-            );
-            outBoneTransform[boneIdx].orientation = Slerp(
-                outBoneTransform[boneIdx].orientation,
-                boneTransform2[boneIdx].orientation,
-                m_gripValue
-            );
-        }
-        for (int boneIdx = 28; boneIdx < SKELETON_BONE_COUNT; boneIdx++) {
-            outBoneTransform[boneIdx].position = Lerp(
-                outBoneTransform[boneIdx].position, boneTransform2[boneIdx].position, m_gripValue
-            );
-            outBoneTransform[boneIdx].orientation = Slerp(
-                outBoneTransform[boneIdx].orientation,
-                boneTransform2[boneIdx].orientation,
-                m_gripValue
-            );
-        }
+        const auto& gripClick = tables.gripClick[withController][isLeftHand];
+        BlendBones(outBoneTransform, gripClick, m_gripValue, 11, 26, outBoneTransform);
+        BlendBones(
+            outBoneTransform, gripClick, m_gripValue, 28, SKELETON_BONE_COUNT, outBoneTransform
+        );
     }
 }
@@ -1,25 +1,33 @@
 #pragma once
 
 #include "ALVR-common/packet_types.h"
+#include "Paths.h"
 #include "TrackedDevice.h"
 #include "openvr_driver_wrap.h"
-#include <map>
+#include <vector>
 
 class Controller : public TrackedDevice {
 public:
     Controller(uint64_t deviceID, vr::EVRSkeletalTrackingLevel skeletonLevel);
     virtual ~Controller() {};
     void RegisterButton(uint64_t id);
-    void SetButton(uint64_t id, FfiButtonValue value);
+    void SetButton(const ButtonDispatch& button, FfiButtonValue value);
     bool OnPoseUpdate(uint64_t targetTimestampNs, float predictionS, FfiHandData handData);
 
 private:
+    friend class DriverBenchmark;
+
     static const int SKELETON_BONE_COUNT = 31;
     static const int ANIMATION_FRAME_COUNT = 15;
 
-    std::map<uint64_t, vr::VRInputComponentHandle_t> m_buttonHandles;
+    // SteamVR components of the registered buttons, indexed by BUTTON_COMPONENTS
+    std::vector<vr::VRInputComponentHandle_t> m_componentHandles;
 
     vr::VRInputComponentHandle_t m_compHaptic;
+    vr::VRInputComponentHandle_t m_compFingerIndex;
+    vr::VRInputComponentHandle_t m_compFingerMiddle;
+    vr::VRInputComponentHandle_t m_compFingerRing;
+    vr::VRInputComponentHandle_t m_compFingerPinky;
     vr::VRInputComponentHandle_t m_compSkeleton = vr::k_ulInvalidInputComponentHandle;
     vr::EVRSkeletalTrackingLevel m_skeletonLevel;
 
@@ -36,8 +44,14 @@ private:
     float m_triggerValue = 0;
     float m_gripValue = 0;
 
+    // Poses the skeleton is blended between, expanded once for each hand and button state
+    struct BonePoseTables;
+    static const BonePoseTables& GetBonePoseTables();
+
     vr::VRInputComponentHandle_t getHapticComponent();
     void GetBoneTransform(bool withController, vr::VRBoneTransform_t outBoneTransform[]);
+    // The tracked skeleton of the hand as SKELETON_BONE_COUNT bones
+    static void HandSkeletonToBones(const FfiHandSkeleton& skeleton, vr::VRBoneTransform_t bones[]);
 
     // TrackedDevice
     bool activate() final;
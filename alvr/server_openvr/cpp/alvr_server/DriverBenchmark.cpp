@@ -0,0 +1,578 @@
+#include "Controller.h"
+#include "EncodeBenchmark.h"
+#include "FakeViveTracker.h"
+#include "Logger.h"
+#include "NalParsing.h"
+#include "Paths.h"
+#include "PoseBatch.h"
+#include "PoseHistory.h"
+#include "Settings.h"
+#include "bindings.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace {
+std::atomic<uint64_t> g_allocations { 0 };
+std::atomic<uint64_t> g_allocatedBytes { 0 };
+
+#ifdef ALVR_DRIVER_BENCHMARK
+void* CountedAlloc(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    g_allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    return malloc(size != 0 ? size : 1);
+}
+#endif
+}
+
+#ifdef ALVR_DRIVER_BENCHMARK
+// Counts the allocations of the C++ code, only in builds with the driver-benchmark feature. The
+// aligned overloads are left to the standard library
+void* operator new(size_t size) {
+    void* ptr = CountedAlloc(size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return CountedAlloc(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return CountedAlloc(size); }
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { free(ptr); }
+#endif
+
+// Reaches into the devices for the parts of their per tick work that don't call into SteamVR
+class DriverBenchmark {
+public:
+    static void GetBoneTransform(Controller& controller, bool withController, uint64_t tick) {
+        // Goes through the touch animations and the trigger and grip blends
+        controller.m_currentThumbTouch = (tick / 30) % 2;
+        controller.m_currentTriggerTouch = (tick / 45) % 2;
+        controller.m_thumbTouchAnimationProgress = (tick % 15) / 15.f;
+        controller.m_indexTouchAnimationProgress = (tick % 15) / 15.f;
+        controller.m_triggerValue = (tick % 90) < 30 ? (tick % 30) / 30.f : 0.f;
+        controller.m_gripValue = (tick % 120) < 60 ? (tick % 60) / 60.f : 0.f;
+
+        vr::VRBoneTransform_t bones[Controller::SKELETON_BONE_COUNT];
+        controller.GetBoneTransform(withController, bones);
+    }
+
+    // Changed properties are then not followed by a SteamVR event
+    static void SetActivating(TrackedDevice& device, bool activating) {
+        device.activating = activating;
+    }
+};
+
+namespace {
+// The property store of SteamVR, the only interface the primitives can't do without. The server
+// driver host and the driver input are left out: the calls into them are the part of the cost the
+// driver doesn't control, and their use is checked to be null
+class BenchmarkProperties : public vr::IVRProperties {
+public:
+    vr::ETrackedPropertyError ReadPropertyBatch(
+        vr::PropertyContainerHandle_t, vr::PropertyRead_t* batch, uint32_t count
+    ) override {
+        for (uint32_t i = 0; i < count; i++) {
+            batch[i].eError = vr::TrackedProp_ValueNotProvidedByDevice;
+        }
+        return vr::TrackedProp_Success;
+    }
+
+    vr::ETrackedPropertyError WritePropertyBatch(
+        vr::PropertyContainerHandle_t, vr::PropertyWrite_t* batch, uint32_t count
+    ) override {
+        for (uint32_t i = 0; i < count; i++) {
+            batch[i].eError = vr::TrackedProp_Success;
+        }
+        return vr::TrackedProp_Success;
+    }
+
+    const char* GetPropErrorNameFromEnum(vr::ETrackedPropertyError) override {
+        return "benchmark";
+    }
+
+    vr::PropertyContainerHandle_t
+    TrackedDeviceToPropertyContainer(vr::TrackedDeviceIndex_t device) override {
+        return device + 1;
+    }
+};
+
+class BenchmarkDriverContext : public vr::IVRDriverContext {
+public:
+    void* GetGenericInterface(const char* version, vr::EVRInitError* error) override {
+        if (strcmp(version, vr::IVRProperties_Version) == 0) {
+            if (error) {
+                *error = vr::VRInitError_None;
+            }
+            return &m_properties;
+        }
+        if (error) {
+            *error = vr::VRInitError_Init_InterfaceNotFound;
+        }
+        return nullptr;
+    }
+
+    vr::DriverHandle_t GetDriverHandle() override { return 1; }
+
+private:
+    BenchmarkProperties m_properties;
+};
+
+struct BenchmarkFrame {
+    std::vector<unsigned char> data;
+    bool isIdr;
+};
+
+// Bytes of a slice payload, never 0 so that they can't form a start code
+void AppendPayload(std::vector<unsigned char>& out, size_t size, uint32_t& seed) {
+    for (size_t i = 0; i < size; i++) {
+        seed = seed * 1664525 + 1013904223;
+        out.push_back((unsigned char)(seed >> 24) | 1);
+    }
+}
+
+void AppendNal(
+    std::vector<unsigned char>& out,
+    std::initializer_list<unsigned char> header,
+    size_t payloadSize,
+    uint32_t& seed
+) {
+    out.insert(out.end(), { 0, 0, 0, 1 });
+    out.insert(out.end(), header);
+    AppendPayload(out, payloadSize, seed);
+}
+
+void AppendObu(std::vector<unsigned char>& out, unsigned char type, size_t size, uint32_t& seed) {
+    out.push_back((unsigned char)(type << 3 | 1 << 1));
+    size_t leb = size;
+    do {
+        unsigned char byte = leb & 0x7F;
+        leb >>= 7;
+        out.push_back(byte | (leb != 0 ? 0x80 : 0));
+    } while (leb != 0);
+    AppendPayload(out, size, seed);
+}
+
+// An IDR followed by P frames, at the sizes of 30 Mbps at 72 fps
+std::vector<BenchmarkFrame> SyntheticFrames(int codec) {
+    const size_t IDR_SIZE = 200'000;
+    const size_t P_SIZE = 52'000;
+    const int FRAME_COUNT = 72;
+
+    uint32_t seed = 1;
+    std::vector<BenchmarkFrame> frames(FRAME_COUNT);
+    for (int i = 0; i < FRAME_COUNT; i++) {
+        auto& out = frames[i].data;
+        bool idr = i == 0;
+        frames[i].isIdr = idr;
+
+        size_t size = idr ? IDR_SIZE : P_SIZE;
+        if (codec == ALVR_CODEC_H264) {
+            if (idr) {
+                AppendNal(out, { 0x67, 0x64, 0x00, 0x28 }, 12, seed);
+                AppendNal(out, { 0x68 }, 4, seed);
+            }
+            // The top bit of the payload is first_mb_in_slice == 0
+            AppendNal(out, { (unsigned char)(idr ? 0x65 : 0x41), 0x88 }, size, seed);
+        } else if (codec == ALVR_CODEC_HEVC) {
+            if (idr) {
+                AppendNal(out, { 0x40, 0x01 }, 20, seed);
+                AppendNal(out, { 0x42, 0x01 }, 36, seed);
+                AppendNal(out, { 0x44, 0x01 }, 6, seed);
+            }
+            AppendNal(out, { (unsigned char)(idr ? 0x26 : 0x02), 0x01, 0xAF }, size, seed);
+        } else {
+            // Temporal delimiter, sequence header and frame
+            AppendObu(out, 2, 0, seed);
+            if (idr) {
+                AppendObu(out, 1, 12, seed);
+            }
+            AppendObu(out, 6, size, seed);
+        }
+    }
+    return frames;
+}
+
+// Splits a bitstream written by alvr_encode_benchmark --output into frames: a frame ends before
+// the first non VCL NAL or first slice after a VCL NAL, or before an AV1 temporal delimiter
+std::vector<BenchmarkFrame> RecordedFrames(int codec, const char* path) {
+    std::ifstream file(path, std::ios::binary);
+    std::vector<unsigned char> data(
+        (std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>()
+    );
+
+    std::vector<BenchmarkFrame> frames;
+    std::vector<std::pair<int, int>> bounds;
+    std::vector<bool> idr;
+    auto split = [&](int offset, bool startsFrame, bool isIdr) {
+        if (startsFrame || bounds.empty()) {
+            if (!bounds.empty()) {
+                bounds.back().second = offset;
+            }
+            bounds.push_back({ offset, (int)data.size() });
+            idr.push_back(false);
+        }
+        if (isIdr) {
+            idr.back() = true;
+        }
+    };
+
+    if (codec == ALVR_CODEC_AV1) {
+        std::vector<Av1Obu> obus;
+        FindAv1Obus(data.data(), (int)data.size(), obus);
+        for (auto& obu : obus) {
+            // A sequence header is repeated before every key frame
+            split(obu.offset, obu.type == 2, obu.type == 1);
+        }
+    } else {
+        bool hevc = codec == ALVR_CODEC_HEVC;
+        std::vector<NalUnit> units;
+        FindNalUnits(codec, data.data(), (int)data.size(), units);
+        bool frameHasVcl = false;
+        for (auto& unit : units) {
+            int payload = unit.offset + unit.prefixSize + (hevc ? 2 : 1);
+            bool vcl = hevc ? unit.type < 32 : unit.type >= 1 && unit.type <= 5;
+            bool firstSlice = vcl && payload < (int)data.size() && (data[payload] & 0x80);
+            bool isIdr = hevc ? unit.type >= 16 && unit.type <= 21 : unit.type == 5;
+
+            bool startsFrame = frameHasVcl && (!vcl || firstSlice);
+            split(unit.offset, startsFrame, isIdr);
+            frameHasVcl = (frameHasVcl && !startsFrame) || vcl;
+        }
+    }
+
+    for (size_t i = 0; i < bounds.size(); i++) {
+        frames.push_back({ std::vector<unsigned char>(
+                               data.begin() + bounds[i].first, data.begin() + bounds[i].second
+                           ),
+                           idr[i] });
+    }
+    return frames;
+}
+
+const char* CodecName(int codec) {
+    switch (codec) {
+    case ALVR_CODEC_H264:
+        return "H.264";
+    case ALVR_CODEC_HEVC:
+        return "HEVC";
+    default:
+        return "AV1";
+    }
+}
+
+class Runner {
+public:
+    explicit Runner(uint32_t iterations)
+        : m_iterations(std::max<uint32_t>(iterations, BATCH_COUNT)) { }
+
+    // op is called with a tick that increases across the calls, after a warmup that is left out
+    // of the results. Allocations are expected to be gone by then
+    template <typename F> void Run(const std::string& name, F op) {
+        uint64_t tick = 0;
+        for (uint32_t i = 0; i < WARMUP_ITERATIONS; i++) {
+            op(tick++);
+        }
+
+        const uint32_t batchSize = m_iterations / BATCH_COUNT;
+        std::array<double, BATCH_COUNT> batchNs;
+
+        uint64_t allocations = g_allocations.load(std::memory_order_relaxed);
+        uint64_t bytes = g_allocatedBytes.load(std::memory_order_relaxed);
+        for (size_t b = 0; b < BATCH_COUNT; b++) {
+            auto start = std::chrono::steady_clock::now();
+            for (uint32_t i = 0; i < batchSize; i++) {
+                op(tick++);
+            }
+            auto end = std::chrono::steady_clock::now();
+            batchNs[b] = std::chrono::duration<double, std::nano>(end - start).count() / batchSize;
+        }
+        allocations = g_allocations.load(std::memory_order_relaxed) - allocations;
+        bytes = g_allocatedBytes.load(std::memory_order_relaxed) - bytes;
+
+        std::sort(batchNs.begin(), batchNs.end());
+        const double ops = (double)batchSize * BATCH_COUNT;
+        Info(
+            "%-48s %10.1f ns %10.1f ns %9.3f %11.1f\n",
+            name.c_str(),
+            batchNs[BATCH_COUNT / 2],
+            batchNs[0],
+            allocations / ops,
+            bytes / ops
+        );
+
+        if (allocations != 0) {
+            m_allocating.push_back(name);
+        }
+    }
+
+    void PrintHeader() {
+        Info(
+            "%-48s %13s %13s %9s %11s\n", "primitive", "median", "fastest", "allocs", "alloc bytes"
+        );
+    }
+
+    // The primitives that allocated after their warmup
+    const std::vector<std::string>& GetAllocating() const { return m_allocating; }
+
+private:
+    static const uint32_t WARMUP_ITERATIONS = 1000;
+    static const size_t BATCH_COUNT = 15;
+
+    uint32_t m_iterations;
+    std::vector<std::string> m_allocating;
+};
+
+void BenchmarkPoseHistory(Runner& runner) {
+    // At 90 Hz the history is full, the lookups go through all of it
+    const uint64_t tickNs = 11'111'111;
+    auto history = std::make_unique<PoseHistory>();
+    uint64_t pushed = 0;
+    for (; pushed < 360; pushed++) {
+        FfiDeviceMotion motion = BenchmarkHeadMotion(pushed);
+        history->OnPoseUpdated((pushed + 1) * tickNs, motion);
+    }
+
+    runner.Run("PoseHistory::OnPoseUpdated", [&](uint64_t) {
+        history->OnPoseUpdated((pushed + 1) * tickNs, BenchmarkHeadMotion(pushed));
+        pushed++;
+    });
+
+    // Frames are presented a few ticks after their pose was pushed
+    std::array<vr::HmdMatrix34_t, 64> presented;
+    std::array<uint64_t, 64> presentedNs;
+    for (size_t i = 0; i < presented.size(); i++) {
+        uint64_t index = pushed - 1 - (i % 8);
+        presentedNs[i] = (index + 1) * tickNs;
+        presented[i] = history->GetPoseAt(presentedNs[i])->rotationMatrix;
+    }
+    // A pose that is far from all of the history, which is then scanned to the end
+    vr::HmdMatrix34_t unknown = {};
+    unknown.m[0][0] = -1;
+    unknown.m[1][1] = -1;
+    unknown.m[2][2] = 1;
+
+    runner.Run("PoseHistory::GetBestPoseMatch (hit)", [&](uint64_t tick) {
+        auto match = history->GetBestPoseMatch(presented[tick % presented.size()]);
+        (void)match;
+    });
+    runner.Run("PoseHistory::GetBestPoseMatch (miss)", [&](uint64_t) {
+        auto match = history->GetBestPoseMatch(unknown);
+        (void)match;
+    });
+    runner.Run("PoseHistory::GetPoseMatchUpTo", [&](uint64_t tick) {
+        size_t i = tick % presented.size();
+        auto match = history->GetPoseMatchUpTo(presented[i], presentedNs[i]);
+        (void)match;
+    });
+    runner.Run("PoseHistory::GetPoseAt", [&](uint64_t tick) {
+        auto pose = history->GetPoseAt(presentedNs[tick % presentedNs.size()] + tickNs / 2);
+        (void)pose;
+    });
+}
+
+bool BenchmarkNalParsing(Runner& runner, const FfiDriverBenchmarkConfig& config) {
+    for (int codec : { ALVR_CODEC_H264, ALVR_CODEC_HEVC, ALVR_CODEC_AV1 }) {
+        bool recorded = config.bitstreamPath != nullptr && config.bitstreamCodec == codec;
+        std::vector<BenchmarkFrame> frames
+            = recorded ? RecordedFrames(codec, config.bitstreamPath) : SyntheticFrames(codec);
+        if (frames.empty()) {
+            Error("No %s frame found in %s\n", CodecName(codec), config.bitstreamPath);
+            return false;
+        }
+
+        size_t bytes = 0;
+        for (auto& frame : frames) {
+            bytes += frame.data.size();
+        }
+        std::string name = std::string("ParseFrameNals ") + CodecName(codec) + ", "
+            + std::to_string(bytes / frames.size() / 1000) + " kB "
+            + (recorded ? "recorded" : "synthetic");
+
+        runner.Run(name, [&](uint64_t tick) {
+            BenchmarkFrame& frame = frames[tick % frames.size()];
+            ParseFrameNals(
+                codec, frame.data.data(), (int)frame.data.size(), (tick + 1) * 1000, frame.isIdr
+            );
+        });
+    }
+    return true;
+}
+
+void BenchmarkController(Runner& runner) {
+    Controller controller(HAND_LEFT_ID, vr::VRSkeletalTracking_Partial);
+
+    runner.Run("Controller::GetBoneTransform (with controller)", [&](uint64_t tick) {
+        DriverBenchmark::GetBoneTransform(controller, true, tick);
+    });
+    runner.Run("Controller::GetBoneTransform (without)", [&](uint64_t tick) {
+        DriverBenchmark::GetBoneTransform(controller, false, tick);
+    });
+
+    // The lookups of SetButtons for a tick with every button of both hands changing
+    std::vector<uint64_t> ids;
+    for (auto& button : BUTTON_DISPATCH_TABLE) {
+        ids.push_back(button.id);
+    }
+    std::string name = "SetButtons dispatch (" + std::to_string(ids.size()) + " buttons)";
+    runner.Run(name, [&](uint64_t) {
+        for (uint64_t id : ids) {
+            const ButtonDispatch* button = FindButtonDispatch(id);
+            (void)button;
+        }
+    });
+}
+
+void BenchmarkTrackers(Runner& runner, uint32_t trackerCount) {
+    const uint64_t bodyIds[] = {
+        BODY_CHEST_ID,     BODY_HIPS_ID,      BODY_LEFT_ELBOW_ID, BODY_RIGHT_ELBOW_ID,
+        BODY_LEFT_KNEE_ID, BODY_LEFT_FOOT_ID, BODY_RIGHT_KNEE_ID, BODY_RIGHT_FOOT_ID,
+    };
+
+    std::vector<std::unique_ptr<FakeViveTracker>> trackers;
+    std::vector<FfiDeviceMotion> motions;
+    for (uint32_t i = 0; i < trackerCount; i++) {
+        uint64_t id
+            = i < std::size(bodyIds) ? bodyIds[i] : PathStringToHash("/user/body/extra") + i;
+        trackers.push_back(std::make_unique<FakeViveTracker>(id));
+        // Past the HMD and the hands
+        trackers.back()->object_id = i + 5;
+
+        FfiDeviceMotion motion = BenchmarkHeadMotion(i);
+        motion.deviceID = id;
+        motions.push_back(motion);
+    }
+
+    // Up to the poses handed to SteamVR, the batch is dropped instead of submitted
+    std::string name = "SetTracking body trackers (" + std::to_string(trackerCount) + ")";
+    runner.Run(name, [&](uint64_t tick) {
+        PoseBatch::Instance().Begin();
+        for (auto& tracker : trackers) {
+            tracker->OnPoseUpdated((tick + 1) * 1000, motions.data(), (int)motions.size());
+        }
+    });
+    PoseBatch::Instance().Begin();
+    PoseBatch::Instance().Submit();
+
+    FakeViveTracker& device = *trackers.front();
+    device.prop_container = vr::VRProperties()->TrackedDeviceToPropertyContainer(device.object_id);
+
+    // A few properties of each type, as the dashboard sends them
+    std::vector<FfiOpenvrProperty> props;
+    for (uint32_t i = 0; i < 8; i++) {
+        FfiOpenvrProperty prop = {};
+        prop.key = vr::Prop_ManufacturerName_String + i;
+        if (i % 4 == 0) {
+            prop.type = FfiOpenvrPropertyType::String;
+            snprintf(prop.value.string, sizeof(prop.value.string), "ALVR benchmark property %u", i);
+        } else if (i % 4 == 1) {
+            prop.type = FfiOpenvrPropertyType::Float;
+            prop.value.float_ = i * 0.5f;
+        } else if (i % 4 == 2) {
+            prop.type = FfiOpenvrPropertyType::Bool;
+            prop.value.bool_ = true;
+        } else {
+            prop.type = FfiOpenvrPropertyType::Uint64;
+            prop.value.uint64 = i;
+        }
+        props.push_back(prop);
+    }
+
+    DriverBenchmark::SetActivating(device, true);
+    runner.Run("TrackedDevice::set_prop (changed)", [&](uint64_t tick) {
+        FfiOpenvrProperty prop = props[tick % props.size()];
+        if (prop.type == FfiOpenvrPropertyType::Float) {
+            prop.value.float_ += tick;
+        } else if (prop.type == FfiOpenvrPropertyType::Uint64) {
+            prop.value.uint64 += tick;
+        } else if (prop.type == FfiOpenvrPropertyType::Bool) {
+            prop.value.bool_ = tick % 2;
+        } else {
+            prop.value.string[0] = 'A' + tick % 26;
+        }
+        device.set_prop(prop);
+    });
+    device.set_props(props.data(), props.size());
+    DriverBenchmark::SetActivating(device, false);
+
+    runner.Run("TrackedDevice::set_prop (unchanged)", [&](uint64_t tick) {
+        device.set_prop(props[tick % props.size()]);
+    });
+}
+
+void SendVideo(
+    unsigned long long,
+    const FfiNalRange*,
+    int,
+    bool,
+    bool,
+    int,
+    void (*release)(void* context),
+    void* releaseContext
+) {
+    if (release) {
+        release(releaseContext);
+    }
+}
+}
+
+bool RunDriverBenchmark(const FfiDriverBenchmarkConfig* benchmarkConfig) {
+    const FfiDriverBenchmarkConfig& config = *benchmarkConfig;
+    if (config.bitstreamPath != nullptr
+        && (config.bitstreamCodec < ALVR_CODEC_H264 || config.bitstreamCodec > ALVR_CODEC_AV1)) {
+        Error("Invalid driver benchmark config\n");
+        return false;
+    }
+
+    Settings& settings = Settings::Instance();
+    settings.Load();
+    if (!settings.IsLoaded()) {
+        Error("The driver settings are read from the session, which failed to load\n");
+        return false;
+    }
+
+    init_paths();
+    BenchmarkDriverContext context;
+    vr::InitServerDriverContext(&context);
+    SetVideoConfigNals = [](const unsigned char*, int, int) { };
+    VideoSendV = SendVideo;
+
+    Runner runner(config.iterations);
+    runner.PrintHeader();
+    BenchmarkPoseHistory(runner);
+    bool ok = BenchmarkNalParsing(runner, config);
+    if (ok) {
+        BenchmarkController(runner);
+        BenchmarkTrackers(runner, config.bodyTrackerCount);
+    }
+
+    SetVideoConfigNals = nullptr;
+    VideoSendV = nullptr;
+    vr::CleanupDriverContext();
+
+#ifdef ALVR_DRIVER_BENCHMARK
+    for (auto& name : runner.GetAllocating()) {
+        Error("%s allocates after its warmup\n", name.c_str());
+    }
+    return ok && runner.GetAllocating().empty();
+#else
+    Warn("Allocations are only counted in builds with the driver-benchmark feature\n");
+    return ok;
+#endif
+}
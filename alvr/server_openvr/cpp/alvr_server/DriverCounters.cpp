@@ -0,0 +1,9 @@
+#include "DriverCounters.h"
+
+DriverCounters::Counter DriverCounters::m_counters[DRIVER_COUNTER_COUNT];
+
+void DriverCounters::Get(unsigned long long counters[DRIVER_COUNTER_COUNT]) {
+    for (int i = 0; i < DRIVER_COUNTER_COUNT; i++) {
+        counters[i] = m_counters[i].value.load(std::memory_order_relaxed);
+    }
+}
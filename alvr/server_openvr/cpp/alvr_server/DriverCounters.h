@@ -0,0 +1,25 @@
+#pragma once
+
+#include "bindings.h"
+#include <atomic>
+#include <stdint.h>
+
+// Event totals of the driver hot paths, each update is a single relaxed add. The Rust statistics
+// sample them through GetDriverCounters() and turn them into rates, so nothing is formatted or
+// sent from the counting threads
+class DriverCounters {
+public:
+    static void Add(FfiDriverCounter counter, uint64_t value = 1) {
+        m_counters[counter].value.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    static void Get(unsigned long long counters[DRIVER_COUNTER_COUNT]);
+
+private:
+    // Counters bumped by different threads don't share a cache line
+    struct alignas(64) Counter {
+        std::atomic<uint64_t> value { 0 };
+    };
+
+    static Counter m_counters[DRIVER_COUNTER_COUNT];
+};
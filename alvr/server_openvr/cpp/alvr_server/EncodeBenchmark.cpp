@@ -0,0 +1,938 @@
+#include "EncodeBenchmark.h"
+
+#include "ALVR-common/packet_types.h"
+#include "EncoderProbe.h"
+#include "FrameRecording.h"
+#include "FrameTrace.h"
+#include "Logger.h"
+#include "PipelineTimings.h"
+#include "Settings.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// The quality metrics decode the bitstream with FFmpeg, which Windows only links with ALVR_GPL
+#if defined(__linux__) || defined(ALVR_GPL)
+#define ENCODE_BENCHMARK_DECODER
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+#endif
+
+namespace {
+// An encoder that takes longer than this for a single frame has stalled
+const auto FRAME_TIMEOUT = std::chrono::seconds(5);
+
+const char* CODEC_NAMES[] = { "H.264", "HEVC", "AV1" };
+
+// CPU time of all the threads of the process
+double ProcessCpuSeconds() {
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) {
+        return 0;
+    }
+    auto seconds = [](const FILETIME& time) {
+        return (((uint64_t)time.dwHighDateTime << 32) | time.dwLowDateTime) / 1e7;
+    };
+    return seconds(kernel) + seconds(user);
+#else
+    timespec time;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+#endif
+}
+
+// Frames read from a raw RGBA file, or generated if there is none
+class FrameSource {
+public:
+    FrameSource(uint32_t width, uint32_t height, const char* path)
+        : m_width(width)
+        , m_height(height)
+        , m_frame((size_t)width * height * 4) {
+        if (!path) {
+            return;
+        }
+        m_file.open(path, std::ios::binary | std::ios::ate);
+        if (m_file) {
+            m_fileFrames = (uint64_t)m_file.tellg() / m_frame.size();
+        }
+    }
+
+    // False if the input file can't be read or is shorter than a frame
+    bool IsValid() const { return !m_file.is_open() || m_fileFrames > 0; }
+
+    const std::vector<uint8_t>& Get(uint32_t index) {
+        if (m_file.is_open()) {
+            m_file.seekg((std::streamoff)((index % m_fileFrames) * m_frame.size()));
+            m_file.read((char*)m_frame.data(), m_frame.size());
+        } else {
+            synthesize(index);
+        }
+        return m_frame;
+    }
+
+private:
+    // Scrolling gradients under a moving checkerboard, with a little noise so that the encoder
+    // has both motion and texture to deal with
+    void synthesize(uint32_t index) {
+        const uint32_t seed = index * 2654435761u;
+        for (uint32_t y = 0; y < m_height; y++) {
+            uint8_t* row = &m_frame[(size_t)y * m_width * 4];
+            for (uint32_t x = 0; x < m_width; x++) {
+                uint32_t noise = (x * 73856093u) ^ (y * 19349663u) ^ seed;
+                noise = ((noise ^ (noise >> 13)) * 1274126177u) >> 28;
+                bool checker = (((x + index * 8) / 64) + y / 64) & 1;
+
+                uint8_t* pixel = row + x * 4;
+                pixel[0] = (uint8_t)std::min(255u, ((x + index * 4) & 0xef) + noise);
+                pixel[1] = (uint8_t)std::min(255u, ((y + index * 2) & 0xef) + noise);
+                pixel[2] = (uint8_t)((checker ? 200 : 40) + noise);
+                pixel[3] = 255;
+            }
+        }
+    }
+
+    uint32_t m_width;
+    uint32_t m_height;
+    std::vector<uint8_t> m_frame;
+    std::ifstream m_file;
+    uint64_t m_fileFrames = 0;
+};
+
+struct Quality {
+    double psnr;
+    double ssim;
+};
+
+#ifdef ENCODE_BENCHMARK_DECODER
+// Luma of the input as the encoders' color conversion computes it, in 8 bit full range
+void ReferenceLuma(
+    const uint8_t* rgba,
+    uint32_t stride,
+    uint32_t width,
+    uint32_t height,
+    bool bt601,
+    std::vector<float>& luma
+) {
+    const float kr = bt601 ? 0.299f : 0.2126f;
+    const float kb = bt601 ? 0.114f : 0.0722f;
+    const float kg = 1.f - kr - kb;
+
+    luma.resize((size_t)width * height);
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t* row = rgba + (size_t)y * stride;
+        for (uint32_t x = 0; x < width; x++) {
+            const uint8_t* pixel = row + x * 4;
+            luma[(size_t)y * width + x] = kr * pixel[0] + kg * pixel[1] + kb * pixel[2];
+        }
+    }
+}
+
+// Luma of a decoded frame, in 8 bit full range. False for the formats the decoders don't
+// normally output
+bool DecodedLuma(const AVFrame* frame, uint32_t width, uint32_t height, std::vector<float>& luma) {
+    bool wide;
+    int shift = 0;
+    switch (frame->format) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+    case AV_PIX_FMT_NV12:
+        wide = false;
+        break;
+    case AV_PIX_FMT_YUV420P10LE:
+        wide = true;
+        break;
+    case AV_PIX_FMT_P010LE:
+        wide = true;
+        shift = 6;
+        break;
+    default:
+        return false;
+    }
+
+    const bool limited
+        = frame->color_range != AVCOL_RANGE_JPEG && frame->format != AV_PIX_FMT_YUVJ420P;
+
+    luma.resize((size_t)width * height);
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t* row = frame->data[0] + (size_t)y * frame->linesize[0];
+        for (uint32_t x = 0; x < width; x++) {
+            float value = wide ? (((const uint16_t*)row)[x] >> shift) / 4.f : row[x];
+            if (limited) {
+                value = (value - 16.f) * 255.f / 219.f;
+            }
+            luma[(size_t)y * width + x] = value;
+        }
+    }
+
+    return true;
+}
+
+double Psnr(const std::vector<float>& a, const std::vector<float>& b) {
+    double squaredError = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        double diff = a[i] - b[i];
+        squaredError += diff * diff;
+    }
+    double mse = squaredError / a.size();
+    // Identical frames, reported as a high but finite value so that the mean stays meaningful
+    return mse > 0 ? 10. * std::log10(255. * 255. / mse) : 100.;
+}
+
+// Mean SSIM over 8x8 windows with a stride of 4
+double Ssim(
+    const std::vector<float>& a, const std::vector<float>& b, uint32_t width, uint32_t height
+) {
+    const double c1 = (0.01 * 255) * (0.01 * 255);
+    const double c2 = (0.03 * 255) * (0.03 * 255);
+
+    double total = 0;
+    uint64_t windows = 0;
+    for (uint32_t y = 0; y + 8 <= height; y += 4) {
+        for (uint32_t x = 0; x + 8 <= width; x += 4) {
+            double sumA = 0, sumB = 0, sumAA = 0, sumBB = 0, sumAB = 0;
+            for (uint32_t wy = 0; wy < 8; wy++) {
+                size_t offset = (size_t)(y + wy) * width + x;
+                for (uint32_t wx = 0; wx < 8; wx++) {
+                    double va = a[offset + wx];
+                    double vb = b[offset + wx];
+                    sumA += va;
+                    sumB += vb;
+                    sumAA += va * va;
+                    sumBB += vb * vb;
+                    sumAB += va * vb;
+                }
+            }
+
+            double meanA = sumA / 64, meanB = sumB / 64;
+            double varA = sumAA / 64 - meanA * meanA;
+            double varB = sumBB / 64 - meanB * meanB;
+            double cov = sumAB / 64 - meanA * meanB;
+            total += ((2 * meanA * meanB + c1) * (2 * cov + c2))
+                / ((meanA * meanA + meanB * meanB + c1) * (varA + varB + c2));
+            windows++;
+        }
+    }
+
+    return windows > 0 ? total / windows : 0;
+}
+
+// Decodes the bitstream in software and compares each frame to its input
+class QualityMeter {
+public:
+    QualityMeter(int codec, uint32_t width, uint32_t height)
+        : m_width(width)
+        , m_height(height) {
+        AVCodecID id = codec == ALVR_CODEC_H264 ? AV_CODEC_ID_H264
+            : codec == ALVR_CODEC_HEVC         ? AV_CODEC_ID_HEVC
+                                               : AV_CODEC_ID_AV1;
+        const AVCodec* decoder = avcodec_find_decoder(id);
+        if (!decoder) {
+            Warn(
+                "No %s decoder in this FFmpeg build, quality is not measured\n", CODEC_NAMES[codec]
+            );
+            return;
+        }
+
+        m_ctx = avcodec_alloc_context3(decoder);
+        m_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        // Frame threads would hold frames back
+        m_ctx->thread_type = FF_THREAD_SLICE;
+        m_ctx->thread_count = 0;
+        if (avcodec_open2(m_ctx, decoder, nullptr) < 0) {
+            Warn("Failed to open the %s decoder, quality is not measured\n", CODEC_NAMES[codec]);
+            avcodec_free_context(&m_ctx);
+            return;
+        }
+
+        m_packet = av_packet_alloc();
+        m_frame = av_frame_alloc();
+    }
+
+    ~QualityMeter() {
+        av_frame_free(&m_frame);
+        av_packet_free(&m_packet);
+        avcodec_free_context(&m_ctx);
+    }
+
+    // The results of the frames decoded so far are added to results. Decoding stops at the first
+    // error
+    void Push(
+        uint64_t targetTimestampNs,
+        const std::vector<uint8_t>& config,
+        const std::vector<uint8_t>& bitstream,
+        bool isIdr,
+        const std::vector<uint8_t>& rgba,
+        std::map<uint64_t, Quality>& results
+    ) {
+        if (!m_ctx) {
+            return;
+        }
+
+        size_t configSize = isIdr ? config.size() : 0;
+        if (av_new_packet(m_packet, (int)(configSize + bitstream.size())) < 0) {
+            return;
+        }
+        std::copy_n(config.data(), configSize, m_packet->data);
+        std::copy(bitstream.begin(), bitstream.end(), m_packet->data + configSize);
+        m_packet->pts = (int64_t)targetTimestampNs;
+
+        m_pending.push_back({ targetTimestampNs, rgba });
+
+        int err = avcodec_send_packet(m_ctx, m_packet);
+        av_packet_unref(m_packet);
+        if (err < 0) {
+            fail("Failed to decode the bitstream (%d), quality is not measured further\n", err);
+            return;
+        }
+
+        while ((err = avcodec_receive_frame(m_ctx, m_frame)) == 0) {
+            if (m_pending.empty()) {
+                av_frame_unref(m_frame);
+                continue;
+            }
+            Pending reference = std::move(m_pending.front());
+            m_pending.pop_front();
+
+            uint32_t width = std::min(m_width, (uint32_t)m_frame->width);
+            uint32_t height = std::min(m_height, (uint32_t)m_frame->height);
+            bool bt601 = m_frame->colorspace == AVCOL_SPC_BT470BG
+                || m_frame->colorspace == AVCOL_SPC_SMPTE170M;
+
+            if (!DecodedLuma(m_frame, width, height, m_decoded)) {
+                fail("Unsupported decoded format %d, quality is not measured\n", m_frame->format);
+                return;
+            }
+            ReferenceLuma(reference.rgba.data(), m_width * 4, width, height, bt601, m_reference);
+            av_frame_unref(m_frame);
+
+            results[reference.targetTimestampNs]
+                = { Psnr(m_reference, m_decoded), Ssim(m_reference, m_decoded, width, height) };
+        }
+        if (err != AVERROR(EAGAIN)) {
+            fail("Failed to decode the bitstream (%d), quality is not measured further\n", err);
+        }
+    }
+
+private:
+    struct Pending {
+        uint64_t targetTimestampNs;
+        std::vector<uint8_t> rgba;
+    };
+
+    template <typename... Args> void fail(const char* format, Args... args) {
+        Warn(format, args...);
+        avcodec_free_context(&m_ctx);
+        m_pending.clear();
+    }
+
+    uint32_t m_width;
+    uint32_t m_height;
+    AVCodecContext* m_ctx = nullptr;
+    AVPacket* m_packet = nullptr;
+    AVFrame* m_frame = nullptr;
+    // Inputs of the frames sent to the decoder and not received yet, in order
+    std::deque<Pending> m_pending;
+    std::vector<float> m_reference;
+    std::vector<float> m_decoded;
+};
+#endif
+
+double Percentile(std::vector<double>& values, double percentile) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t index = (size_t)std::ceil(percentile / 100. * values.size());
+    return values[std::clamp<size_t>(index, 1, values.size()) - 1];
+}
+
+void LogLatency(const char* name, std::vector<double> valuesMs) {
+    if (valuesMs.empty()) {
+        Info("%-22s n/a\n", name);
+        return;
+    }
+    Info(
+        "%-22s p50 %6.2f ms  p90 %6.2f ms  p99 %6.2f ms  max %6.2f ms\n",
+        name,
+        Percentile(valuesMs, 50),
+        Percentile(valuesMs, 90),
+        Percentile(valuesMs, 99),
+        Percentile(valuesMs, 100)
+    );
+}
+
+// Takes the place of the streamer for the video callbacks while it runs. Frames are encoded one
+// at a time: each one is collected before the next is submitted
+class EncodeBenchmark {
+public:
+    EncodeBenchmark(const FfiEncodeBenchmarkConfig& config, FrameRecordingReader* replay)
+        : m_config(config)
+        , m_source(config.width, config.height, config.inputPath)
+        , m_replay(replay)
+        , m_bitrateBps(config.bitrateBps)
+        , m_framerate(config.framerate) { }
+
+    bool Run() {
+        if (!m_source.IsValid()) {
+            Error(
+                "Can't read frames of %ux%u from %s\n",
+                m_config.width,
+                m_config.height,
+                m_config.inputPath
+            );
+            return false;
+        }
+
+        std::ofstream output;
+        if (m_config.outputPath) {
+            output.open(m_config.outputPath, std::ios::binary);
+            if (!output) {
+                Error("Can't write the bitstream to %s\n", m_config.outputPath);
+                return false;
+            }
+        }
+
+        std::unique_ptr<EncodeBenchmarkTarget> target;
+        try {
+            target = m_config.driverPath
+                ? EncodeBenchmarkTarget::CreateDriverPath(m_config.backend)
+                : EncodeBenchmarkTarget::Create(m_config.backend);
+            m_adapterId = target->GetAdapterId();
+        } catch (std::exception& e) {
+            Error("Failed to create the encoder: %s\n", e.what());
+            return false;
+        }
+
+#ifdef ENCODE_BENCHMARK_DECODER
+        std::unique_ptr<QualityMeter> quality;
+        if (m_config.measureQuality && m_config.driverPath) {
+            Warn("The driver's passes change the frames, quality is not measured\n");
+        } else if (m_config.measureQuality) {
+            quality
+                = std::make_unique<QualityMeter>(m_config.codec, m_config.width, m_config.height);
+        }
+#else
+        if (m_config.measureQuality) {
+            Warn("Quality is only measured in builds with FFmpeg\n");
+        }
+#endif
+
+        const uint64_t frameIntervalNs = (uint64_t)(1e9 / m_config.framerate);
+        const uint32_t totalFrames = m_config.warmupFrames + m_config.frameCount;
+        // The driver's first frame is always an IDR
+        bool idr = true;
+        std::chrono::steady_clock::time_point measureStart;
+
+        for (uint32_t i = 0; i < totalFrames; i++) {
+            if (i == m_config.warmupFrames) {
+                measureStart = std::chrono::steady_clock::now();
+            }
+
+            const uint64_t targetTimestampNs = (i + 1) * frameIntervalNs;
+            const std::vector<uint8_t>& rgba = m_replay ? replayFrame(idr) : m_source.Get(i);
+
+            // From the submit to the last NAL, the frame generation and the quality are left out
+            const double cpuBegin = ProcessCpuSeconds();
+            FrameTrace::Instance().Record(targetTimestampNs, FRAME_TRACE_PRESENT);
+            try {
+                target->EncodeFrame(rgba.data(), targetTimestampNs, idr);
+            } catch (std::exception& e) {
+                Error("Failed to encode frame %u: %s\n", i, e.what());
+                return false;
+            }
+            idr = false;
+
+            EncodedFrame frame;
+            if (!waitFrame(targetTimestampNs, frame)) {
+                Error("Timed out waiting for frame %u\n", i);
+                return false;
+            }
+            const double cpuMs = (ProcessCpuSeconds() - cpuBegin) * 1e3;
+            collectTraces();
+
+            if (output.is_open()) {
+                if (frame.isIdr) {
+                    output.write((const char*)m_configNals.data(), m_configNals.size());
+                }
+                output.write((const char*)frame.data.data(), frame.data.size());
+            }
+
+            if (i < m_config.warmupFrames) {
+                continue;
+            }
+
+            m_results[targetTimestampNs] = { frame.data.size(), frame.isIdr, cpuMs };
+#ifdef ENCODE_BENCHMARK_DECODER
+            if (quality) {
+                quality->Push(
+                    targetTimestampNs, m_configNals, frame.data, frame.isIdr, rgba, m_quality
+                );
+            }
+#endif
+        }
+
+        auto elapsed = std::chrono::steady_clock::now() - measureStart;
+        report(std::chrono::duration<double>(elapsed).count());
+
+        return true;
+    }
+
+    static void SetConfigNals(const unsigned char* buf, int len, int codec) {
+        std::lock_guard<std::mutex> lock(m_instance->m_mutex);
+        m_instance->m_configNals.assign(buf, buf + len);
+    }
+
+    static void Send(
+        unsigned long long targetTimestampNs,
+        const FfiNalRange* ranges,
+        int rangeCount,
+        bool isIdr,
+        bool isLastSlice,
+        int temporalId,
+        void (*release)(void* context),
+        void* releaseContext
+    ) {
+        {
+            std::lock_guard<std::mutex> lock(m_instance->m_mutex);
+            EncodedFrame& frame = m_instance->m_frames[targetTimestampNs];
+            for (int i = 0; i < rangeCount; i++) {
+                const FfiNalRange& range = ranges[i];
+                frame.data.insert(frame.data.end(), range.data, range.data + range.len);
+            }
+            frame.isIdr = frame.isIdr || isIdr;
+            frame.complete = frame.complete || isLastSlice;
+            m_instance->m_slices = m_instance->m_slices || !isLastSlice;
+        }
+        if (release) {
+            release(releaseContext);
+        }
+        if (isLastSlice) {
+            m_instance->m_frameCv.notify_all();
+        }
+    }
+
+    static void ReportStats(FfiEncoderStats stats) {
+        std::lock_guard<std::mutex> lock(m_instance->m_mutex);
+        m_instance->m_encoderStats++;
+        m_instance->m_qpSum += stats.averageQp;
+        m_instance->m_vbvOverflows += stats.vbvOverflow ? 1 : 0;
+    }
+
+    static FfiDynamicEncoderParams GetParams() {
+        // Sent once, the bitrate is fixed for the whole run unless the replay changes it
+        std::lock_guard<std::mutex> lock(m_instance->m_mutex);
+        FfiDynamicEncoderParams params = {};
+        if (!m_instance->m_paramsSent) {
+            m_instance->m_paramsSent = true;
+            params.updated = 1;
+            params.bitrate_bps = m_instance->m_bitrateBps;
+            params.framerate = m_instance->m_framerate;
+        }
+        return params;
+    }
+
+    // Filled by Run, the backend is left to the caller
+    const EncoderProbeResult& GetProbeResult() const { return m_probeResult; }
+    const std::string& GetAdapterId() const { return m_adapterId; }
+
+    static EncodeBenchmark* m_instance;
+
+private:
+    struct EncodedFrame {
+        std::vector<uint8_t> data;
+        bool isIdr = false;
+        bool complete = false;
+    };
+
+    struct Result {
+        size_t size;
+        bool isIdr;
+        // Of all the threads while the frame was in flight
+        double cpuMs;
+        FfiFrameTrace trace = {};
+    };
+
+    // The next recorded frame, with the IDR and encoder params it had in the session
+    const std::vector<uint8_t>& replayFrame(bool& idr) {
+        FrameRecordingFrame recorded;
+        const std::vector<uint8_t>& rgba = m_replay->Next(recorded);
+        idr = idr || recorded.idr;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (recorded.bitrateBps != 0
+            && (recorded.bitrateBps != m_bitrateBps || recorded.framerate != m_framerate)) {
+            m_bitrateBps = recorded.bitrateBps;
+            m_framerate = recorded.framerate;
+            m_paramsSent = false;
+        }
+        return rgba;
+    }
+
+    bool waitFrame(uint64_t targetTimestampNs, EncodedFrame& frame) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        bool complete = m_frameCv.wait_for(lock, FRAME_TIMEOUT, [&] {
+            auto it = m_frames.find(targetTimestampNs);
+            return it != m_frames.end() && it->second.complete;
+        });
+        if (!complete) {
+            return false;
+        }
+
+        frame = std::move(m_frames[targetTimestampNs]);
+        m_frames.erase(targetTimestampNs);
+        return true;
+    }
+
+    // The traces are read back a few frames late, see FrameTrace
+    void collectTraces() {
+        FfiFrameTrace traces[16];
+        unsigned int count;
+        while ((count = FrameTrace::Instance().Pop(traces, 16)) > 0) {
+            for (unsigned int i = 0; i < count; i++) {
+                auto it = m_results.find(traces[i].targetTimestampNs);
+                if (it != m_results.end()) {
+                    it->second.trace = traces[i];
+                }
+            }
+        }
+    }
+
+    void report(double seconds) {
+        std::vector<double> frameMs, compositeMs, encodeMs, cpuMs;
+        size_t totalBytes = 0;
+        uint32_t idrCount = 0;
+
+        auto stageMs = [](const FfiFrameTrace& trace,
+                          FfiFrameTraceStage begin,
+                          FfiFrameTraceStage end,
+                          std::vector<double>& out) {
+            uint64_t beginNs = trace.stageTimestampsNs[begin];
+            uint64_t endNs = trace.stageTimestampsNs[end];
+            if (beginNs != 0 && endNs >= beginNs) {
+                out.push_back((endNs - beginNs) / 1e6);
+            }
+        };
+
+        for (auto& [timestamp, result] : m_results) {
+            totalBytes += result.size;
+            idrCount += result.isIdr ? 1 : 0;
+            cpuMs.push_back(result.cpuMs);
+            stageMs(result.trace, FRAME_TRACE_PRESENT, FRAME_TRACE_LAST_NAL_SENT, frameMs);
+            stageMs(
+                result.trace, FRAME_TRACE_COMPOSITE_BEGIN, FRAME_TRACE_COMPOSITE_END, compositeMs
+            );
+            stageMs(
+                result.trace, FRAME_TRACE_ENCODE_SUBMIT, FRAME_TRACE_ENCODE_COMPLETE, encodeMs
+            );
+        }
+
+        const uint32_t frames = (uint32_t)m_results.size();
+        Info(
+            "Encode benchmark: %s %ux%u%s, %.1f Mbps at %.0f fps, %u frames%s\n",
+            CODEC_NAMES[m_config.codec],
+            m_config.width,
+            m_config.height,
+            m_config.use10bit ? " 10 bit" : "",
+            m_config.bitrateBps / 1e6,
+            m_config.framerate,
+            frames,
+            m_config.driverPath ? " through the driver's present path" : ""
+        );
+        // The last frames are still in the trace ring when the run ends, so there are a few less
+        // latency samples than frames
+        LogLatency("Frame (submit to NAL)", frameMs);
+        LogLatency("Composite (GPU)", compositeMs);
+        FfiRenderPipelineStats passes[16];
+        unsigned int passCount = PipelineTimings::Instance().Get(passes, 16);
+        for (unsigned int i = 0; i < passCount; i++) {
+            Info(
+                "  %-20s avg %6.2f ms  p95 %6.2f ms  max %6.2f ms (last %u frames)\n",
+                passes[i].name,
+                passes[i].averageMs,
+                passes[i].p95Ms,
+                passes[i].maxMs,
+                passes[i].frameCount
+            );
+        }
+        LogLatency("Encode", encodeMs);
+        LogLatency("CPU time (all threads)", cpuMs);
+        if (m_encoderStats > 0) {
+            Info(
+                "%-22s average QP %.1f, %u VBV overflows\n",
+                "Encoder",
+                m_qpSum / m_encoderStats,
+                m_vbvOverflows
+            );
+        }
+
+        // Frames are generated and submitted one at a time, the throughput below would
+        // understate what the backend sustains in the driver
+        m_probeResult.available = frames > 0;
+        m_probeResult.realtime = Percentile(frameMs, 90) <= 1000. / m_config.framerate;
+        m_probeResult.slices = m_slices;
+        m_probeResult.encodeMs = Percentile(encodeMs, 50);
+
+        Info("%-22s %.1f fps\n", "Throughput", seconds > 0 ? frames / seconds : 0.);
+        Info(
+            "%-22s %.2f MB, %.1f KB per frame, %.2f Mbps at %.0f fps, %u IDR\n",
+            "Bitstream",
+            totalBytes / 1e6,
+            frames > 0 ? totalBytes / 1e3 / frames : 0.,
+            frames > 0 ? totalBytes * 8. * m_config.framerate / frames / 1e6 : 0.,
+            m_config.framerate,
+            idrCount
+        );
+
+        if (!m_quality.empty()) {
+            double psnrSum = 0, ssimSum = 0;
+            double psnrMin = 1e9, ssimMin = 1e9;
+            for (auto& [timestamp, quality] : m_quality) {
+                psnrSum += quality.psnr;
+                ssimSum += quality.ssim;
+                psnrMin = std::min(psnrMin, quality.psnr);
+                ssimMin = std::min(ssimMin, quality.ssim);
+            }
+            Info(
+                "%-22s PSNR %.2f dB (min %.2f), SSIM %.4f (min %.4f) over %zu frames\n",
+                "Luma quality",
+                psnrSum / m_quality.size(),
+                psnrMin,
+                ssimSum / m_quality.size(),
+                ssimMin,
+                m_quality.size()
+            );
+        }
+    }
+
+    FfiEncodeBenchmarkConfig m_config;
+    FrameSource m_source;
+    FrameRecordingReader* m_replay;
+
+    std::mutex m_mutex;
+    std::condition_variable m_frameCv;
+    // Frames being received, by target timestamp
+    std::map<uint64_t, EncodedFrame> m_frames;
+    std::vector<uint8_t> m_configNals;
+    uint64_t m_bitrateBps;
+    float m_framerate;
+    bool m_paramsSent = false;
+    bool m_slices = false;
+    uint32_t m_encoderStats = 0;
+    double m_qpSum = 0;
+    uint32_t m_vbvOverflows = 0;
+
+    std::map<uint64_t, Result> m_results;
+    std::map<uint64_t, Quality> m_quality;
+
+    std::string m_adapterId;
+    EncoderProbeResult m_probeResult = {};
+};
+
+EncodeBenchmark* EncodeBenchmark::m_instance = nullptr;
+
+// Settings must be loaded, they are overridden with the config for the run
+bool Benchmark(
+    const FfiEncodeBenchmarkConfig& config,
+    FrameRecordingReader* replay,
+    EncoderProbeResult* probeResult = nullptr,
+    std::string* adapterId = nullptr
+) {
+    Settings& settings = Settings::Instance();
+    settings.m_renderWidth = config.width;
+    settings.m_renderHeight = config.height;
+    settings.m_refreshRate = (int)std::round(config.framerate);
+    settings.m_codec = config.codec;
+    settings.m_use10bitEncoder = config.use10bit;
+    settings.m_force_sw_encoding = config.backend == ENCODE_BENCHMARK_BACKEND_SOFTWARE;
+    // The frames are encoded as they come in, without the passes that would change them. The
+    // driver path measures the whole cost of a frame, the session's passes stay
+    if (!config.driverPath) {
+        settings.m_enableFoveatedEncoding = false;
+        settings.m_enableColorCorrection = false;
+        settings.m_enableHdr = false;
+    }
+
+    EncodeBenchmark benchmark(config, replay);
+    EncodeBenchmark::m_instance = &benchmark;
+    SetVideoConfigNals = EncodeBenchmark::SetConfigNals;
+    VideoSendV = EncodeBenchmark::Send;
+    GetDynamicEncoderParams = EncodeBenchmark::GetParams;
+    ReportEncoderStats = EncodeBenchmark::ReportStats;
+    // The rest of what the driver calls back. There is no client: every frame is encoded, the
+    // latency target is never exceeded and the stages come from FrameTrace
+    ReportPresent = [](unsigned long long, unsigned long long) { };
+    ReportComposed = [](unsigned long long, unsigned long long) { };
+    ReportMissedVsyncs = [](unsigned long long) { };
+    ShouldEncodeFrame = [] { return true; };
+    WaitForVSync = [] { };
+    GetVsyncTiming = [] { return FfiVsyncTiming {}; };
+    GetClientPipelineTiming = [] { return FfiClientPipelineTiming {}; };
+
+    bool ok = benchmark.Run();
+
+    // The encoder has been destroyed by now, nothing calls back anymore
+    SetVideoConfigNals = nullptr;
+    VideoSendV = nullptr;
+    GetDynamicEncoderParams = nullptr;
+    ReportEncoderStats = nullptr;
+    ReportPresent = nullptr;
+    ReportComposed = nullptr;
+    ReportMissedVsyncs = nullptr;
+    ShouldEncodeFrame = nullptr;
+    WaitForVSync = nullptr;
+    GetVsyncTiming = nullptr;
+    GetClientPipelineTiming = nullptr;
+    EncodeBenchmark::m_instance = nullptr;
+
+    if (probeResult) {
+        *probeResult = benchmark.GetProbeResult();
+        probeResult->backend = config.backend;
+        probeResult->available = ok && probeResult->available;
+    }
+    if (adapterId && !benchmark.GetAdapterId().empty()) {
+        *adapterId = benchmark.GetAdapterId();
+    }
+    return ok;
+}
+}
+
+FfiDeviceMotion BenchmarkHeadMotion(uint64_t frameIndex) {
+    // Back to the start before a full turn, a pose never comes back while it's in the history
+    const double yaw = (frameIndex % 600) * 0.01;
+    FfiDeviceMotion motion = {};
+    motion.pose.orientation.y = (float)std::sin(yaw / 2);
+    motion.pose.orientation.w = (float)std::cos(yaw / 2);
+    return motion;
+}
+
+bool RunEncodeBenchmark(const FfiEncodeBenchmarkConfig* benchmarkConfig) {
+    FfiEncodeBenchmarkConfig config = *benchmarkConfig;
+    std::unique_ptr<FrameRecordingReader> replay;
+    if (config.replayPath) {
+        replay = std::make_unique<FrameRecordingReader>(config.replayPath);
+        if (!replay->IsValid()) {
+            Error("Can't read the frame recording %s\n", config.replayPath);
+            return false;
+        }
+
+        FrameRecordingFrame first;
+        replay->Next(first);
+        replay->Rewind();
+        config.width = replay->GetWidth();
+        config.height = replay->GetHeight();
+        if (first.bitrateBps != 0 && first.framerate > 0) {
+            config.bitrateBps = first.bitrateBps;
+            config.framerate = first.framerate;
+        }
+        config.inputPath = nullptr;
+        Info(
+            "Replaying %u frames of %ux%u from %s\n",
+            replay->GetFrameCount(),
+            config.width,
+            config.height,
+            config.replayPath
+        );
+    }
+
+    if (config.codec < ALVR_CODEC_H264 || config.codec > ALVR_CODEC_AV1 || config.width == 0
+        || config.height == 0 || config.framerate <= 0 || config.frameCount == 0) {
+        Error("Invalid encode benchmark config\n");
+        return false;
+    }
+
+    Settings& settings = Settings::Instance();
+    settings.Load();
+    if (!settings.IsLoaded()) {
+        Error("The encoder settings are read from the session, which failed to load\n");
+        return false;
+    }
+
+    return Benchmark(config, replay.get());
+}
+
+bool RunEncoderProbe(const FfiEncodeBenchmarkConfig* benchmarkConfig) {
+    Settings& settings = Settings::Instance();
+    settings.Load();
+    if (!settings.IsLoaded()) {
+        Error("The encoder settings are read from the session, which failed to load\n");
+        return false;
+    }
+
+    // Probed at the settings the driver will run with, the key of the results
+    FfiEncodeBenchmarkConfig config = *benchmarkConfig;
+    config.codec = settings.m_codec;
+    config.use10bit = settings.m_use10bitEncoder;
+    config.width = settings.m_renderWidth;
+    config.height = settings.m_renderHeight;
+    config.framerate = (float)settings.m_refreshRate;
+    config.inputPath = nullptr;
+    config.replayPath = nullptr;
+    config.outputPath = nullptr;
+    config.measureQuality = false;
+    config.driverPath = false;
+    if (config.width == 0 || config.height == 0 || config.framerate <= 0
+        || config.frameCount == 0) {
+        Error("Invalid encoder probe config\n");
+        return false;
+    }
+
+    const FfiEncodeBenchmarkBackend backends[] = {
+        ENCODE_BENCHMARK_BACKEND_NVENC,
+        ENCODE_BENCHMARK_BACKEND_AMF,
+        ENCODE_BENCHMARK_BACKEND_QSV,
+        ENCODE_BENCHMARK_BACKEND_VAAPI,
+        ENCODE_BENCHMARK_BACKEND_SOFTWARE,
+    };
+    std::vector<EncoderProbeResult> results;
+    std::string adapterId;
+    for (FfiEncodeBenchmarkBackend backend : backends) {
+        Info("Probing the %s encoder\n", EncoderProbe::BackendName(backend));
+        // Each run overrides some settings, the key is computed from the session ones
+        settings.Load();
+        config.backend = backend;
+        EncoderProbeResult result = {};
+        Benchmark(config, nullptr, &result, &adapterId);
+        results.push_back(result);
+    }
+
+    settings.Load();
+    if (adapterId.empty()) {
+        Error("No encoder could be opened, nothing to save\n");
+        return false;
+    }
+
+    Info(
+        "Encoder probe of %s, %s decoder tiles:\n",
+        adapterId.c_str(),
+        EncoderProbe::TileLayout().c_str()
+    );
+    for (auto& result : results) {
+        if (result.available) {
+            Info(
+                "  %-8s encode p50 %6.2f ms%s%s\n",
+                EncoderProbe::BackendName(result.backend),
+                result.encodeMs,
+                result.realtime ? "" : ", too slow for the framerate",
+                result.slices ? ", sliced output" : ""
+            );
+        } else {
+            Info("  %-8s unavailable\n", EncoderProbe::BackendName(result.backend));
+        }
+    }
+    EncoderProbe::Store(adapterId, results);
+
+    return true;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "bindings.h"
+#include <memory>
+#include <stdint.h>
+#include <string>
+
+// The compositor and encoder of one platform, driven by RunEncodeBenchmark instead of SteamVR.
+// Implemented in platform/*/EncodeBenchmark.cpp
+class EncodeBenchmarkTarget {
+public:
+    virtual ~EncodeBenchmarkTarget() = default;
+
+    // Settings have been overridden with the benchmark config by then. Throws if the backend
+    // isn't available on this platform or fails to open
+    static std::unique_ptr<EncodeBenchmarkTarget> Create(FfiEncodeBenchmarkBackend backend);
+    // Same, but the frames are presented to the driver's own CEncoder, which composites and
+    // encodes them on its threads as it does for SteamVR. Each frame is submitted with a pose of
+    // its own pushed to the pose history, so that the driver matches it to its timestamp
+    static std::unique_ptr<EncodeBenchmarkTarget>
+    CreateDriverPath(FfiEncodeBenchmarkBackend backend);
+
+    // Composites and encodes a RGBA frame of the render size. The bitstream goes through
+    // ParseFrameNalRanges as in the driver, possibly after returning. The composite and encode
+    // submit stages must be recorded to FrameTrace
+    virtual void EncodeFrame(const uint8_t* rgba, uint64_t targetTimestampNs, bool idr) = 0;
+
+    // Name and driver version of the GPU, as the driver's encoder reports it to EncoderProbe
+    virtual std::string GetAdapterId() = 0;
+};
+
+// Head motion of the nth frame of a driver path run. A slow turn, so that the poses the pose
+// history holds are all distinct and each submitted frame matches its own
+FfiDeviceMotion BenchmarkHeadMotion(uint64_t frameIndex);
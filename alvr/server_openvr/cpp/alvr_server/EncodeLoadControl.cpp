@@ -0,0 +1,54 @@
+#include "EncodeLoadControl.h"
+
+#include "Logger.h"
+#include "Settings.h"
+#include <algorithm>
+
+EncodeLoadControl::EncodeLoadControl(int levelCount)
+    : m_levelCount(levelCount) {
+    m_samplesNs.reserve(WINDOW_FRAMES);
+}
+
+bool EncodeLoadControl::IsEnabled() { return Settings::Instance().m_encoderLoadBudgetPercent > 0; }
+
+bool EncodeLoadControl::AddFrame(uint64_t encodeNs) {
+    m_samplesNs.push_back(encodeNs);
+    if (m_samplesNs.size() < WINDOW_FRAMES) {
+        return false;
+    }
+
+    // The slowest tenth of the frames is what misses the deadline, the average hides it
+    auto p90 = m_samplesNs.begin() + WINDOW_FRAMES * 9 / 10;
+    std::nth_element(m_samplesNs.begin(), p90, m_samplesNs.end());
+    uint64_t slowNs = *p90;
+    m_samplesNs.clear();
+
+    uint64_t budgetNs = 1000000000ull * Settings::Instance().m_encoderLoadBudgetPercent / 100
+        / std::max(Settings::Instance().m_refreshRate, 1);
+    if (slowNs > budgetNs) {
+        m_headroomWindows = 0;
+        if (m_level + 1 < m_levelCount) {
+            m_level++;
+            Info(
+                "EncodeLoadControl: encodes take %.2fms, stepping down to level %d\n",
+                slowNs / 1e6,
+                m_level
+            );
+            return true;
+        }
+    } else if (slowNs < budgetNs * 6 / 10 && m_level > 0) {
+        if (++m_headroomWindows == HEADROOM_WINDOWS) {
+            m_headroomWindows = 0;
+            m_level--;
+            Info(
+                "EncodeLoadControl: encodes take %.2fms, stepping up to level %d\n",
+                slowNs / 1e6,
+                m_level
+            );
+            return true;
+        }
+    } else {
+        m_headroomWindows = 0;
+    }
+    return false;
+}
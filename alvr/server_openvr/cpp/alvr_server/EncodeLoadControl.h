@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Closed loop on the encode time of the frames. While the encodes exceed their share of the frame
+// interval the encoder steps to cheaper settings, one level per window of frames, and back up to
+// the configured ones once they have had headroom for a while. Level 0 is the configured quality,
+// the encoder decides what each higher level turns off.
+class EncodeLoadControl {
+public:
+    // levelCount includes level 0
+    explicit EncodeLoadControl(int levelCount);
+
+    // Off without a budget in the settings
+    static bool IsEnabled();
+
+    // Time from the submission of a frame to its output. Returns true when the level changes
+    bool AddFrame(uint64_t encodeNs);
+    int GetLevel() const { return m_level; }
+
+private:
+    static const size_t WINDOW_FRAMES = 30;
+    // Windows with headroom in a row before going up a level. The cheaper level encodes faster
+    // than the one above would, so it takes a clear margin for a while
+    static const int HEADROOM_WINDOWS = 8;
+
+    int m_levelCount;
+    std::vector<uint64_t> m_samplesNs;
+    int m_level = 0;
+    int m_headroomWindows = 0;
+};
@@ -0,0 +1,139 @@
+#include "EncoderProbe.h"
+#include "Logger.h"
+#include "Settings.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+#define PICOJSON_USE_INT64
+#include "include/picojson.h"
+
+namespace {
+picojson::object Load(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) {
+        return {};
+    }
+    std::string json((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    picojson::value v;
+    std::string err = picojson::parse(v, json);
+    if (!err.empty() || !v.is<picojson::object>()) {
+        Warn("EncoderProbe: Ignoring %s: %s\n", path.c_str(), err.c_str());
+        return {};
+    }
+    return v.get<picojson::object>();
+}
+}
+
+const char* EncoderProbe::BackendName(FfiEncodeBenchmarkBackend backend) {
+    switch (backend) {
+    case ENCODE_BENCHMARK_BACKEND_SOFTWARE:
+        return "software";
+    case ENCODE_BENCHMARK_BACKEND_AMF:
+        return "AMF";
+    case ENCODE_BENCHMARK_BACKEND_NVENC:
+        return "NVENC";
+    case ENCODE_BENCHMARK_BACKEND_VAAPI:
+        return "VAAPI";
+    case ENCODE_BENCHMARK_BACKEND_QSV:
+        return "QSV";
+    default:
+        return "auto";
+    }
+}
+
+std::vector<FfiEncodeBenchmarkBackend>
+EncoderProbe::RankedBackends(const std::string& adapterId) {
+    picojson::object probes = Load(Path());
+    auto it = probes.find(Key(adapterId));
+    if (it == probes.end() || !it->second.is<picojson::array>()) {
+        return {};
+    }
+
+    std::vector<EncoderProbeResult> results;
+    for (auto& entry : it->second.get<picojson::array>()) {
+        if (!entry.is<picojson::object>()) {
+            continue;
+        }
+        EncoderProbeResult result;
+        try {
+            result.backend = (FfiEncodeBenchmarkBackend)entry.get("backend").get<int64_t>();
+            result.available = entry.get("available").get<bool>();
+            result.realtime = entry.get("realtime").get<bool>();
+            result.encodeMs = entry.get("encode_ms").get<double>();
+        } catch (std::exception&) {
+            continue;
+        }
+        if (result.available && result.realtime) {
+            results.push_back(result);
+        }
+    }
+    std::stable_sort(results.begin(), results.end(), [](auto& a, auto& b) {
+        return a.encodeMs < b.encodeMs;
+    });
+
+    std::vector<FfiEncodeBenchmarkBackend> backends;
+    for (auto& result : results) {
+        backends.push_back(result.backend);
+    }
+    return backends;
+}
+
+void EncoderProbe::Store(
+    const std::string& adapterId, const std::vector<EncoderProbeResult>& results
+) {
+    std::string path = Path();
+    picojson::object probes = Load(path);
+
+    picojson::array entries;
+    for (auto& result : results) {
+        picojson::object entry;
+        entry["backend"] = picojson::value((int64_t)result.backend);
+        entry["name"] = picojson::value(BackendName(result.backend));
+        entry["available"] = picojson::value(result.available);
+        entry["realtime"] = picojson::value(result.realtime);
+        entry["slices"] = picojson::value(result.slices);
+        entry["tiles"] = picojson::value(TileLayout());
+        entry["encode_ms"] = picojson::value(result.encodeMs);
+        entries.push_back(picojson::value(entry));
+    }
+    probes[Key(adapterId)] = picojson::value(entries);
+
+    // Written aside then renamed, so that the driver never reads a truncated file
+    std::string tempPath = path + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::trunc);
+        file << picojson::value(probes).serialize(true);
+        if (!file) {
+            Warn("EncoderProbe: Failed to write %s\n", tempPath.c_str());
+            return;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tempPath, path, ec);
+    if (ec) {
+        Warn("EncoderProbe: Failed to replace %s: %s\n", path.c_str(), ec.message().c_str());
+        return;
+    }
+    Info("EncoderProbe: Results saved to %s\n", path.c_str());
+}
+
+std::string EncoderProbe::Key(const std::string& adapterId) {
+    const Settings& settings = Settings::Instance();
+    return adapterId + "|codec " + std::to_string(settings.m_codec)
+        + (settings.m_use10bitEncoder ? " 10 bit|" : "|") + std::to_string(settings.m_renderWidth)
+        + "x" + std::to_string(settings.m_renderHeight) + "|"
+        + std::to_string(settings.m_refreshRate) + " fps|" + TileLayout() + " tiles";
+}
+
+std::string EncoderProbe::TileLayout() {
+    const Settings& settings = Settings::Instance();
+    return std::to_string(settings.m_encoderTileColumns) + "x"
+        + std::to_string(settings.m_encoderTileRows);
+}
+
+std::string EncoderProbe::Path() {
+    return std::filesystem::path(g_sessionPath).replace_filename("encoder_probe.json").string();
+}
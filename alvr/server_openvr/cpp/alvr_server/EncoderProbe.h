@@ -0,0 +1,43 @@
+#pragma once
+
+#include "bindings.h"
+#include <string>
+#include <vector>
+
+// What one backend did when RunEncoderProbe encoded with it at the session's codec, bit depth,
+// resolution and framerate
+struct EncoderProbeResult {
+    FfiEncodeBenchmarkBackend backend;
+    // Opened and encoded every frame
+    bool available = false;
+    // The p90 frame latency fits in a frame interval
+    bool realtime = false;
+    // Frames came out in several slices, see VideoSendV
+    bool slices = false;
+    // p50 from the encode submit to its completion
+    double encodeMs = 0;
+};
+
+// Results of alvr_encode_benchmark --probe, kept next to the session file per GPU, driver,
+// encoder settings and decoder tile layout. The driver starts the backend that was measured
+// fastest there instead of the first one that opens, and falls back to its fixed order for
+// anything that wasn't probed.
+class EncoderProbe {
+public:
+    static const char* BackendName(FfiEncodeBenchmarkBackend backend);
+
+    // Backends that were available and realtime for this GPU and driver with the current
+    // settings, fastest first. Empty if they weren't probed
+    static std::vector<FfiEncodeBenchmarkBackend> RankedBackends(const std::string& adapterId);
+
+    // Replaces the results of this GPU, driver and settings
+    static void Store(const std::string& adapterId, const std::vector<EncoderProbeResult>& results);
+
+    // Columns x rows of the decoder tiles the backends were configured for
+    static std::string TileLayout();
+
+private:
+    // The adapter and the settings that decide whether a backend works and how fast
+    static std::string Key(const std::string& adapterId);
+    static std::string Path();
+};
@@ -0,0 +1,20 @@
+#include "EncoderWarmup.h"
+
+EncoderWarmup EncoderWarmup::m_instance;
+
+bool EncoderWarmup::WaitFrames(uint32_t count, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_frameDone.wait_for(lock, timeout, [&] { return m_frames >= count; });
+}
+
+bool EncoderWarmup::Discard(uint64_t targetTimestampNs, bool isLastSlice) {
+    if (targetTimestampNs > MAX_FRAMES) {
+        return false;
+    }
+    if (isLastSlice) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_frames++;
+        m_frameDone.notify_all();
+    }
+    return true;
+}
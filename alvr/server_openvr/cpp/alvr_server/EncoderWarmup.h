@@ -0,0 +1,33 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+// Drops the output of the frames encoded before the stream, which only make the driver and the
+// encoder do their lazy setup (first draws, session buffers, rate control) ahead of the first
+// frame of the client. They are told apart by their timestamps, far below those of real frames,
+// so that one coming out late is dropped too. ParseFrameNalRanges checks it before sending.
+class EncoderWarmup {
+public:
+    static const uint32_t MAX_FRAMES = 16;
+
+    static EncoderWarmup& Instance() { return m_instance; }
+
+    // Target timestamp of the warm-up frame, below MAX_FRAMES
+    static uint64_t Timestamp(uint32_t frame) { return frame + 1; }
+
+    // Waits for the last slice of count warm-up frames to come out, false on timeout
+    bool WaitFrames(uint32_t count, std::chrono::milliseconds timeout);
+
+    // Whether the output is of a warm-up frame, counting it when isLastSlice
+    bool Discard(uint64_t targetTimestampNs, bool isLastSlice);
+
+private:
+    static EncoderWarmup m_instance;
+
+    std::mutex m_mutex;
+    std::condition_variable m_frameDone;
+    uint32_t m_frames = 0;
+};
@@ -0,0 +1,41 @@
+#include "EncoderWatchdog.h"
+
+#include "FlightRecorder.h"
+#include "FrameTrace.h"
+#include "Logger.h"
+#include "Settings.h"
+#include <algorithm>
+
+EncoderWatchdog::EncoderWatchdog() { }
+
+void EncoderWatchdog::BeginFrame() { m_frameBeginNs = FrameTrace::Now(); }
+
+EncoderWatchdog::Action EncoderWatchdog::EndFrame() {
+    uint64_t elapsedNs = FrameTrace::Now() - m_frameBeginNs;
+    uint64_t deadlineNs
+        = DEADLINE_FRAMES * 1000000000 / std::max(Settings::Instance().m_refreshRate, 1);
+    if (m_frames++ >= WARMUP_FRAMES && elapsedNs > deadlineNs) {
+        Warn("EncoderWatchdog: a frame took %llu ms to encode\n", elapsedNs / 1000000);
+        FlightRecorder::Instance().Record(FlightRecorder::EVENT_ENCODER_STALL, 0, elapsedNs);
+        FlightRecorder::Instance().DumpToLogDir("encoder_stall");
+        return Fail();
+    }
+    return Action::None;
+}
+
+EncoderWatchdog::Action EncoderWatchdog::OnFailure(const char* reason) {
+    Warn("EncoderWatchdog: the encode failed: %s\n", reason);
+    FlightRecorder::Instance().RecordError(reason);
+    FlightRecorder::Instance().DumpToLogDir("encoder_error");
+    return Fail();
+}
+
+void EncoderWatchdog::OnRecovered() {
+    FlightRecorder::Instance().Record(FlightRecorder::EVENT_ENCODER_RECREATED);
+    m_recovered = true;
+    m_frames = 0;
+}
+
+EncoderWatchdog::Action EncoderWatchdog::Fail() {
+    return m_recovered && m_frames < STABLE_FRAMES ? Action::Fallback : Action::Rebuild;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+// Watches the encodes of the encoder thread and decides how the encoder recovers when one throws
+// or stalls, without ending the stream. The encoder is rebuilt first, and replaced by the next
+// backend if the rebuilt one fails again before it encoded for a while.
+class EncoderWatchdog {
+public:
+    enum class Action {
+        None,
+        // Recreate the encoder with the same backend
+        Rebuild,
+        // Recreate the encoder with the next backend that works
+        Fallback,
+    };
+
+    EncoderWatchdog();
+
+    // Called around the encode of each frame. A frame that took longer than the deadline counts
+    // as a failure, it is only noticed once the encoder returns
+    void BeginFrame();
+    Action EndFrame();
+    // The encode of the frame threw
+    Action OnFailure(const char* reason);
+    // The encoder was recreated, it warms up again
+    void OnRecovered();
+
+private:
+    Action Fail();
+
+    // Frame intervals an encode may take. Late encodes are handled by the frame pacing, this only
+    // catches an encoder that is stuck
+    static const uint64_t DEADLINE_FRAMES = 10;
+    // Frames after the encoder is created that aren't held to the deadline
+    static const uint32_t WARMUP_FRAMES = 5;
+    // Frames a recreated encoder must encode before a failure rebuilds it again
+    static const uint32_t STABLE_FRAMES = 300;
+
+    uint64_t m_frameBeginNs = 0;
+    uint32_t m_frames = 0;
+    bool m_recovered = false;
+};
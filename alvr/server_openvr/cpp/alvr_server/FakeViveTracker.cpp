@@ -8,7 +8,14 @@
 #include <cassert>
 
 FakeViveTracker::FakeViveTracker(uint64_t deviceID)
-    : TrackedDevice(deviceID, vr::TrackedDeviceClass_GenericTracker) { }
+    : TrackedDevice(deviceID, vr::TrackedDeviceClass_GenericTracker) {
+    auto& settings = Settings::Instance();
+    if (settings.m_poseFilterTrackers) {
+        m_poseFilter.emplace(PoseFilter::Params { settings.m_poseFilterMinCutoffHz,
+                                                  settings.m_poseFilterBeta,
+                                                  settings.m_poseFilterTrackerPredictionS });
+    }
+}
 
 bool FakeViveTracker::activate() {
     Debug("FakeViveTracker::Activate");
@@ -203,6 +210,19 @@ bool FakeViveTracker::activate() {
     return true;
 }
 
+void FakeViveTracker::OnPoseUpdated(
+    uint64_t targetTimestampNs, const FfiDeviceMotion* motions, int motionCount
+) {
+    const FfiDeviceMotion* motion = nullptr;
+    for (int i = 0; i < motionCount; i++) {
+        if (motions[i].deviceID == this->device_id) {
+            motion = &motions[i];
+            break;
+        }
+    }
+    OnPoseUpdated(targetTimestampNs, motion);
+}
+
 void FakeViveTracker::OnPoseUpdated(uint64_t targetTimestampNs, const FfiDeviceMotion* motion) {
     if (this->object_id == vr::k_unTrackedDeviceIndexInvalid) {
         return;
@@ -210,6 +230,16 @@ void FakeViveTracker::OnPoseUpdated(uint64_t targetTimestampNs, const FfiDeviceM
 
     bool tracked = motion != nullptr;
 
+    FfiDeviceMotion filtered;
+    if (m_poseFilter) {
+        if (tracked) {
+            filtered = m_poseFilter->Filter(targetTimestampNs, *motion);
+            motion = &filtered;
+        } else {
+            m_poseFilter->Reset();
+        }
+    }
+
     auto pose = vr::DriverPose_t {};
     pose.poseIsValid = tracked;
     pose.deviceIsConnected = tracked;
@@ -1,15 +1,21 @@
 #pragma once
 
+#include "PoseFilter.h"
 #include "TrackedDevice.h"
 #include "bindings.h"
 #include "openvr_driver_wrap.h"
+#include <optional>
 
 class FakeViveTracker : public TrackedDevice {
 public:
     FakeViveTracker(uint64_t deviceID);
     void OnPoseUpdated(uint64_t targetTimestampNs, const FfiDeviceMotion* motion);
+    // Pick the motion of this tracker out of a batch, it is untracked if the batch has none
+    void OnPoseUpdated(uint64_t targetTimestampNs, const FfiDeviceMotion* motions, int motionCount);
 
 private:
+    std::optional<PoseFilter> m_poseFilter;
+
     // TrackedDevice
     bool activate() final;
     void* get_component(const char*) final { return nullptr; }
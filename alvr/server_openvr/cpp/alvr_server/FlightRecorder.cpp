@@ -0,0 +1,213 @@
+#include "FlightRecorder.h"
+
+#include "FrameTrace.h"
+#include "Logger.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace {
+const char* STAGE_NAMES[FRAME_TRACE_STAGE_COUNT] = {
+    "present",         "pose matched",    "composite begin", "composite end",
+    "encode submit",   "encode complete", "first NAL sent",  "last NAL sent",
+};
+
+const char* EventName(FlightRecorder::EventType type) {
+    switch (type) {
+    case FlightRecorder::EVENT_STAGE:
+        return "stage";
+    case FlightRecorder::EVENT_IDR:
+        return "IDR";
+    case FlightRecorder::EVENT_FRAMES_LOST:
+        return "frames lost";
+    case FlightRecorder::EVENT_REFERENCES_INVALIDATED:
+        return "references invalidated";
+    case FlightRecorder::EVENT_ENCODER_STALL:
+        return "encoder stall";
+    case FlightRecorder::EVENT_ENCODER_ERROR:
+        return "encoder error";
+    case FlightRecorder::EVENT_ENCODER_RECREATED:
+        return "encoder recreated";
+    default:
+        return "unknown";
+    }
+}
+}
+
+FlightRecorder FlightRecorder::m_instance;
+
+void FlightRecorder::RecordStage(
+    uint64_t targetTimestampNs, FfiFrameTraceStage stage, uint64_t timeNs
+) {
+    uint64_t index;
+    Event& event = Begin(index);
+    event.timeNs = timeNs;
+    event.targetTimestampNs = targetTimestampNs;
+    event.value = 0;
+    event.type = EVENT_STAGE;
+    event.stage = stage;
+    event.text[0] = '\0';
+    Commit(index);
+}
+
+void FlightRecorder::Record(EventType type, uint64_t targetTimestampNs, uint64_t value) {
+    uint64_t index;
+    Event& event = Begin(index);
+    event.timeNs = FrameTrace::Now();
+    event.targetTimestampNs = targetTimestampNs;
+    event.value = value;
+    event.type = type;
+    event.stage = 0;
+    event.text[0] = '\0';
+    Commit(index);
+}
+
+void FlightRecorder::RecordError(const char* text) {
+    uint64_t index;
+    Event& event = Begin(index);
+    event.timeNs = FrameTrace::Now();
+    event.targetTimestampNs = 0;
+    event.value = 0;
+    event.type = EVENT_ENCODER_ERROR;
+    event.stage = 0;
+    snprintf(event.text, TEXT_SIZE, "%s", text);
+    Commit(index);
+}
+
+FlightRecorder::Event& FlightRecorder::Begin(uint64_t& index) {
+    index = m_events.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = m_slots[index % RING_SIZE];
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    return slot.event;
+}
+
+void FlightRecorder::Commit(uint64_t index) {
+    m_slots[index % RING_SIZE].sequence.store(index + 1, std::memory_order_release);
+}
+
+size_t FlightRecorder::Snapshot(Event* events, size_t maxCount) const {
+    uint64_t end = m_events.load(std::memory_order_acquire);
+    uint64_t begin = end - std::min<uint64_t>({ end, RING_SIZE, (uint64_t)maxCount });
+
+    size_t count = 0;
+    for (uint64_t index = begin; index < end; index++) {
+        const Slot& slot = m_slots[index % RING_SIZE];
+        // Events still being written, or already overwritten by newer ones, are skipped
+        if (slot.sequence.load(std::memory_order_acquire) != index + 1) {
+            continue;
+        }
+        events[count] = slot.event;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) == index + 1) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+void FlightRecorder::Dump(const char* path) {
+    auto events = std::make_unique<Event[]>(RING_SIZE);
+    size_t count = Snapshot(events.get(), RING_SIZE);
+    uint64_t nowNs = FrameTrace::Now();
+
+    std::thread(
+        [path = std::string(path), events = std::move(events), count, nowNs] {
+            if (Write(path.c_str(), events.get(), count, nowNs)) {
+                Info("Flight recorder written to %s\n", path.c_str());
+            } else {
+                Error("Failed to write the flight recorder to %s\n", path.c_str());
+            }
+        }
+    ).detach();
+}
+
+void FlightRecorder::DumpToLogDir(const char* reason) {
+    uint64_t nowNs = FrameTrace::Now();
+    uint64_t lastNs = m_lastAutoDumpNs.load(std::memory_order_relaxed);
+    if (lastNs != 0 && nowNs - lastNs < MIN_AUTO_DUMP_INTERVAL_NS) {
+        return;
+    }
+    if (!m_lastAutoDumpNs.compare_exchange_strong(lastNs, nowNs, std::memory_order_relaxed)) {
+        return;
+    }
+
+    char path[1024];
+    FilePath(path, sizeof(path), reason);
+    Dump(path);
+}
+
+void FlightRecorder::DumpOnCrash() {
+    // The heap may be what crashed, the snapshot goes to static storage
+    static Event events[RING_SIZE];
+    size_t count = Snapshot(events, RING_SIZE);
+
+    char path[1024];
+    FilePath(path, sizeof(path), "crash");
+    Write(path, events, count, FrameTrace::Now());
+}
+
+bool FlightRecorder::Write(const char* path, const Event* events, size_t count, uint64_t nowNs) {
+    FILE* file = fopen(path, "w");
+    if (file == nullptr) {
+        return false;
+    }
+
+    fprintf(file, "# ALVR flight recorder, %zu events\n", count);
+    fprintf(file, "# time_ms is relative to the dump, frame is the target timestamp in ns\n");
+    fprintf(file, "%12s  %-24s  %20s  %s\n", "time_ms", "event", "frame", "detail");
+    for (size_t i = 0; i < count; i++) {
+        const Event& event = events[i];
+        double timeMs = ((double)event.timeNs - (double)nowNs) / 1e6;
+        const char* name = event.type == EVENT_STAGE && event.stage < FRAME_TRACE_STAGE_COUNT
+            ? STAGE_NAMES[event.stage]
+            : EventName(event.type);
+        fprintf(
+            file,
+            "%12.3f  %-24s  %20llu  ",
+            timeMs,
+            name,
+            (unsigned long long)event.targetTimestampNs
+        );
+        switch (event.type) {
+        case EVENT_REFERENCES_INVALIDATED:
+            fprintf(file, "reference %llu\n", (unsigned long long)event.value);
+            break;
+        case EVENT_ENCODER_STALL:
+            fprintf(file, "%llu ms\n", (unsigned long long)(event.value / 1000000));
+            break;
+        default:
+            fprintf(file, "%s\n", event.text);
+            break;
+        }
+    }
+
+    bool ok = ferror(file) == 0;
+    return fclose(file) == 0 && ok;
+}
+
+void FlightRecorder::FilePath(char* path, size_t size, const char* reason) {
+    time_t now = time(nullptr);
+    struct tm local = {};
+#ifdef _WIN32
+    localtime_s(&local, &now);
+#else
+    localtime_r(&now, &local);
+#endif
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%d.%H-%M-%S", &local);
+
+    snprintf(
+        path,
+        size,
+        "%s/flight_recorder.%s.%s.txt",
+        g_logDir != nullptr ? g_logDir : ".",
+        reason,
+        date
+    );
+}
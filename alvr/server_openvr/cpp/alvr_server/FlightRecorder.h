@@ -0,0 +1,76 @@
+#pragma once
+
+#include "bindings.h"
+#include <array>
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Always on record of the last seconds of the driver: the stage timestamps of each frame, the IDR
+// and loss repair decisions and the encoder errors. It's written to a text file when the driver
+// crashes, when the encoder fails or stalls, and on demand from the dashboard, to see what led to
+// a hitch that can't be reproduced. Recording takes no lock and doesn't allocate.
+class FlightRecorder {
+public:
+    enum EventType : uint32_t {
+        EVENT_STAGE,
+        EVENT_IDR,
+        EVENT_FRAMES_LOST,
+        EVENT_REFERENCES_INVALIDATED,
+        EVENT_ENCODER_STALL,
+        EVENT_ENCODER_ERROR,
+        EVENT_ENCODER_RECREATED,
+    };
+
+    static FlightRecorder& Instance() { return m_instance; }
+
+    // All times are on the FrameTrace::Now() clock
+    void RecordStage(uint64_t targetTimestampNs, FfiFrameTraceStage stage, uint64_t timeNs);
+    // targetTimestampNs is the last received frame for a loss. value depends on the event: the
+    // reference of an invalidation, the duration of a stall
+    void Record(EventType type, uint64_t targetTimestampNs = 0, uint64_t value = 0);
+    // text is truncated to fit in the event
+    void RecordError(const char* text);
+
+    // Writes the events from a thread of its own, the snapshot is taken before returning
+    void Dump(const char* path);
+    // Writes the events to a file of the log directory named after reason. Dumps closer than
+    // MIN_AUTO_DUMP_INTERVAL_NS to the previous one are skipped, for failures that repeat
+    void DumpToLogDir(const char* reason);
+    // Writes the events on the calling thread, for the crash handler. Only uses the C stdio
+    void DumpOnCrash();
+
+private:
+    static FlightRecorder m_instance;
+
+    // A few seconds of stages at 120 fps, with room for the other events
+    static const uint64_t RING_SIZE = 8192;
+    static const uint64_t MIN_AUTO_DUMP_INTERVAL_NS = 10'000'000'000;
+    static const size_t TEXT_SIZE = 64;
+
+    struct Event {
+        uint64_t timeNs;
+        uint64_t targetTimestampNs;
+        uint64_t value;
+        EventType type;
+        uint32_t stage;
+        char text[TEXT_SIZE];
+    };
+
+    struct Slot {
+        // Index + 1 of the event in the slot, 0 while it's written
+        std::atomic<uint64_t> sequence { 0 };
+        Event event;
+    };
+
+    Event& Begin(uint64_t& index);
+    void Commit(uint64_t index);
+    // Copies the events that weren't overwritten while reading them, oldest first
+    size_t Snapshot(Event* events, size_t maxCount) const;
+    static bool Write(const char* path, const Event* events, size_t count, uint64_t nowNs);
+    static void FilePath(char* path, size_t size, const char* reason);
+
+    std::array<Slot, RING_SIZE> m_slots;
+    std::atomic<uint64_t> m_events { 0 };
+    std::atomic<uint64_t> m_lastAutoDumpNs { 0 };
+};
@@ -0,0 +1,61 @@
+#include "FoveatedAxis.h"
+#include "Settings.h"
+#include <algorithm>
+
+FoveatedAxis FoveatedAxis::X() {
+    auto& settings = Settings::Instance();
+    return { settings.m_foveationCenterSizeX,
+             settings.m_foveationCenterShiftX,
+             settings.m_enableFoveatedEncoding ? std::max(settings.m_foveationEdgeRatioX, 1.f)
+                                               : 1.f };
+}
+
+FoveatedAxis FoveatedAxis::Y() {
+    auto& settings = Settings::Instance();
+    return { settings.m_foveationCenterSizeY,
+             settings.m_foveationCenterShiftY,
+             settings.m_enableFoveatedEncoding ? std::max(settings.m_foveationEdgeRatioY, 1.f)
+                                               : 1.f };
+}
+
+float FoveatedAxis::Decompress(float x) const {
+    if (edgeRatio <= 1.f) {
+        return x;
+    }
+
+    float c0 = (1.f - size) * .5f;
+    float c1 = (edgeRatio - 1.f) * c0 * (shift + 1.f) / edgeRatio;
+    float c2 = (edgeRatio - 1.f) * size + 1.f;
+    float lo = c0 * (shift + 1.f) / c2;
+    float hi = c0 * (shift - 1.f) / c2 + 1.f;
+
+    float center = x * c2 / edgeRatio + c1;
+    if (x < lo) {
+        float g1 = x / lo;
+        return g1 * center + (1.f - g1) * x * c2;
+    }
+    if (x > hi) {
+        float g2 = (1.f - x) / (1.f - hi);
+        return g2 * center + (1.f - g2) * ((x - 1.f) * c2 + 1.f);
+    }
+    return center;
+}
+
+float FoveatedAxis::Compress(float x) const {
+    if (edgeRatio <= 1.f) {
+        return x;
+    }
+
+    // Decompress is monotonic, and has no closed form inverse on the blended edges
+    float lo = 0.f;
+    float hi = 1.f;
+    for (int i = 0; i < 24; i++) {
+        float mid = (lo + hi) * .5f;
+        if (Decompress(mid) < x) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo + hi) * .5f;
+}
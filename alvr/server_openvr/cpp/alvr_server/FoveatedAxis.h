@@ -0,0 +1,22 @@
+#pragma once
+
+// One axis of the compression of foveated encoding, between the rendered eye and the encoded eye.
+// Coordinates are the UV of the eye measured from its outer edge, which is how the shift of the
+// center region is applied to both eyes.
+struct FoveatedAxis {
+    float size;
+    float shift;
+    // 1 leaves the axis uncompressed
+    float edgeRatio;
+
+    // From the foveation settings, uncompressed when foveated encoding is disabled
+    static FoveatedAxis X();
+    static FoveatedAxis Y();
+
+    // From the encoded eye to the rendered eye, the mapping of ffr.comp and
+    // CompressAxisAlignedPixelShader.hlsl. The padding added to align the compressed eye to 32
+    // pixels is ignored, it is smaller than an encoder block.
+    float Decompress(float x) const;
+    // Inverse of Decompress
+    float Compress(float x) const;
+};
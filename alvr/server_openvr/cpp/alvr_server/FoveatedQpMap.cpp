@@ -0,0 +1,150 @@
+#include "FoveatedQpMap.h"
+#include "FoveatedAxis.h"
+#include "FoveationCenter.h"
+#include "OverlayQpMask.h"
+#include "Settings.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+// Bounds of the fovea along one axis of the encoded eye. center is the gaze in the rendered eye,
+// or negative for the center of the foveation settings
+void FoveaBounds(float center, const FoveatedAxis& axis, float& lo, float& hi) {
+    float c0 = (1.f - axis.size) * .5f;
+    float renderedLo = center < 0.f ? c0 * (axis.shift + 1.f)
+                                    : std::clamp(center - axis.size * .5f, 0.f, 1.f - axis.size);
+
+    lo = axis.Compress(renderedLo);
+    hi = axis.Compress(renderedLo + axis.size);
+    lo = std::clamp(lo, 0.f, 1.f);
+    hi = std::clamp(hi, lo, 1.f);
+}
+
+// 0 inside [lo, hi], growing to 1 at the borders of the eye
+float AxisFalloff(float x, float lo, float hi) {
+    if (x < lo) {
+        return (lo - x) / lo;
+    }
+    if (x > hi) {
+        return (x - hi) / (1.f - hi);
+    }
+    return 0.f;
+}
+}
+
+bool FoveatedQpMap::IsEnabled() {
+    return Settings::Instance().m_foveatedQpMaxDelta > 0 || OverlayQpMask::IsEnabled();
+}
+
+uint32_t FoveatedQpMap::GetVersion() {
+    // Both only grow
+    return FoveationCenter::Instance().GetVersion() + OverlayQpMask::Instance().GetVersion();
+}
+
+FoveatedQpMap::FoveatedQpMap(uint32_t frameWidth, uint32_t frameHeight)
+    : m_frameWidth(frameWidth)
+    , m_frameHeight(frameHeight)
+    , m_maxDelta(Settings::Instance().m_foveatedQpMaxDelta)
+    // Without the compression pass the center region keeps its size in the frame
+    , m_axisX(FoveatedAxis::X())
+    , m_axisY(FoveatedAxis::Y())
+    , m_overlayDelta(-(int)Settings::Instance().m_encoderOverlayQpReduction) {
+    if (OverlayQpMask::IsEnabled()) {
+        m_overlayCells = OverlayQpMask::Instance().GetCoverage();
+    }
+
+    float gazeU[2] = { -1.f, -1.f };
+    float gazeV[2] = { -1.f, -1.f };
+    FoveationCenter::Instance().GetGaze(gazeU, gazeV);
+
+    for (int eye = 0; eye < 2; eye++) {
+        FoveaBounds(gazeU[eye], m_axisX, m_loX[eye], m_hiX[eye]);
+        FoveaBounds(gazeV[eye], m_axisY, m_loY[eye], m_hiY[eye]);
+    }
+}
+
+float FoveatedQpMap::Falloff(float u, float v) const {
+    int eye = u > .5f ? 1 : 0;
+    float eyeU = eye == 1 ? (1.f - u) * 2.f : u * 2.f;
+
+    return std::max(
+        AxisFalloff(eyeU, m_loX[eye], m_hiX[eye]), AxisFalloff(v, m_loY[eye], m_hiY[eye])
+    );
+}
+
+bool FoveatedQpMap::Overlay(float u, float v) const {
+    int eye = u > .5f ? 1 : 0;
+    float eyeU = m_axisX.Decompress(eye == 1 ? (1.f - u) * 2.f : u * 2.f);
+    // The mask isn't mirrored for the right eye
+    return OverlayQpMask::Covers(
+        m_overlayCells, eye, eye == 1 ? 1.f - eyeU : eyeU, m_axisY.Decompress(v)
+    );
+}
+
+std::vector<int8_t> FoveatedQpMap::BuildDeltaMap(uint32_t blockSize) const {
+    uint32_t blocksX = (m_frameWidth + blockSize - 1) / blockSize;
+    uint32_t blocksY = (m_frameHeight + blockSize - 1) / blockSize;
+
+    std::vector<int8_t> deltas(blocksX * blocksY);
+    for (uint32_t y = 0; y < blocksY; y++) {
+        float v = std::min((y + .5f) * blockSize, (float)m_frameHeight) / m_frameHeight;
+        for (uint32_t x = 0; x < blocksX; x++) {
+            float u = std::min((x + .5f) * blockSize, (float)m_frameWidth) / m_frameWidth;
+            deltas[y * blocksX + x] = (int8_t)std::lround(Falloff(u, v) * m_maxDelta);
+        }
+    }
+
+    if (!m_overlayCells.empty()) {
+        // A block partly covered by an overlay may hold the edge of its text, the corners are
+        // tested too
+        for (uint32_t y = 0; y < blocksY; y++) {
+            float top = (float)(y * blockSize) / m_frameHeight;
+            float bottom = std::min((float)((y + 1) * blockSize - 1) / m_frameHeight, 1.f);
+            for (uint32_t x = 0; x < blocksX; x++) {
+                float left = (float)(x * blockSize) / m_frameWidth;
+                float right = std::min((float)((x + 1) * blockSize - 1) / m_frameWidth, 1.f);
+                if (Overlay((left + right) * .5f, (top + bottom) * .5f) || Overlay(left, top)
+                    || Overlay(right, top) || Overlay(left, bottom) || Overlay(right, bottom)) {
+                    deltas[y * blocksX + x] = (int8_t)m_overlayDelta;
+                }
+            }
+        }
+    }
+
+    return deltas;
+}
+
+std::vector<FoveatedQpMap::Region> FoveatedQpMap::BuildRegions(uint32_t steps) const {
+    uint32_t halfWidth = m_frameWidth / 2;
+
+    std::vector<Region> regions;
+    for (uint32_t i = 0; i <= steps; i++) {
+        // The set of points with a falloff up to t is a rectangle in each eye
+        float t = (float)i / steps;
+        int qpDelta = (int)std::lround(t * m_maxDelta);
+
+        for (int eye = 0; eye < 2; eye++) {
+            float eyeLoU = m_loX[eye] * (1.f - t);
+            float eyeHiU = m_hiX[eye] + (1.f - m_hiX[eye]) * t;
+            uint32_t top = (uint32_t)(m_loY[eye] * (1.f - t) * m_frameHeight);
+            uint32_t bottom
+                = (uint32_t)std::ceil((m_hiY[eye] + (1.f - m_hiY[eye]) * t) * m_frameHeight);
+
+            if (eye == 0) {
+                regions.push_back({ (uint32_t)(eyeLoU * halfWidth),
+                                    top,
+                                    (uint32_t)std::ceil(eyeHiU * halfWidth),
+                                    bottom,
+                                    qpDelta });
+            } else {
+                regions.push_back({ m_frameWidth - (uint32_t)std::ceil(eyeHiU * halfWidth),
+                                    top,
+                                    m_frameWidth - (uint32_t)(eyeLoU * halfWidth),
+                                    bottom,
+                                    qpDelta });
+            }
+        }
+    }
+
+    return regions;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "FoveatedAxis.h"
+#include <cstdint>
+#include <vector>
+
+// Quality falloff of foveated encoding, expressed as QP offsets for the encoder instead of (or on
+// top of) the resampling of the frame. The fovea has the size of the center region of the
+// foveation settings and is placed by FoveationCenter, then found in the encoded frame through the
+// compression pass when the frame is compressed. The offset grows linearly from 0 at the border of
+// the fovea to the maximum at the edges of each eye. Where OverlayQpMask has overlays, the offset
+// is the negated overlay QP reduction instead.
+class FoveatedQpMap {
+public:
+    struct Region {
+        uint32_t left;
+        uint32_t top;
+        uint32_t right;
+        uint32_t bottom;
+        int qpDelta;
+    };
+
+    // With the falloff or the overlay QP reduction
+    static bool IsEnabled();
+    // Changes whenever the map would change, with the foveation center or the overlay coverage
+    static uint32_t GetVersion();
+
+    FoveatedQpMap(uint32_t frameWidth, uint32_t frameHeight);
+
+    // One offset per block of blockSize pixels, in raster order, the last row and column covering
+    // the rest of the frame
+    std::vector<int8_t> BuildDeltaMap(uint32_t blockSize) const;
+
+    // Nested rectangles for encoders that take regions of interest, from the fovea of each eye
+    // outwards. Each region applies to the pixels not covered by the previous ones, which is the
+    // precedence of AVRegionOfInterest. The overlays aren't part of them.
+    std::vector<Region> BuildRegions(uint32_t steps) const;
+
+    int GetMaxDelta() const { return m_maxDelta; }
+
+private:
+    // 0 in the fovea, 1 at the edges of the eye, for a point of the frame in UV
+    float Falloff(float u, float v) const;
+    // Whether an overlay covers a point of the frame in UV
+    bool Overlay(float u, float v) const;
+
+    uint32_t m_frameWidth;
+    uint32_t m_frameHeight;
+    int m_maxDelta;
+    FoveatedAxis m_axisX;
+    FoveatedAxis m_axisY;
+    // From OverlayQpMask, empty without overlays
+    std::vector<uint8_t> m_overlayCells;
+    int m_overlayDelta;
+    // Fovea bounds of each eye in the UV of the encoded eye, the right eye being mirrored in the
+    // frame
+    float m_loX[2];
+    float m_hiX[2];
+    float m_loY[2];
+    float m_hiY[2];
+};
@@ -0,0 +1,87 @@
+#include "FoveationCenter.h"
+#include "Settings.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+// The gaze moves a little on every tracking sample. Snapping it keeps the maps from being rebuilt
+// for movements smaller than a block.
+const float GAZE_STEP = 1.f / 64.f;
+
+float Snap(float x) { return std::round(std::clamp(x, 0.f, 1.f) / GAZE_STEP) * GAZE_STEP; }
+}
+
+FoveationCenter FoveationCenter::m_instance;
+
+void FoveationCenter::SetViews(const FfiViewParams views[2]) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_fov[0] = views[0].fov;
+    m_fov[1] = views[1].fov;
+    m_hasViews = true;
+    m_viewsVersion.fetch_add(1, std::memory_order_release);
+}
+
+void FoveationCenter::SetGaze(const FfiEyeGaze* gaze) {
+    if (!Settings::Instance().m_foveatedQpFollowGaze) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    bool tracked = gaze != nullptr && m_hasViews;
+    float u[2] = {};
+    float v[2] = {};
+    if (tracked) {
+        // The gaze comes from between the eyes, the parallax to each eye is neglected
+        for (int eye = 0; eye < 2; eye++) {
+            float left = tanf(m_fov[eye].left);
+            float right = tanf(m_fov[eye].right);
+            float up = tanf(m_fov[eye].up);
+            float down = tanf(m_fov[eye].down);
+
+            float x = Snap((gaze->tangentX - left) / (right - left));
+            // The right eye is mirrored in the frame, its UV starts from the right edge
+            u[eye] = eye == 1 ? 1.f - x : x;
+            v[eye] = Snap((up - gaze->tangentY) / (up - down));
+        }
+    }
+
+    bool moved = !std::equal(u, u + 2, m_u) || !std::equal(v, v + 2, m_v);
+    if (tracked == m_tracked && (!tracked || !moved)) {
+        return;
+    }
+    m_tracked = tracked;
+    std::copy(u, u + 2, m_u);
+    std::copy(v, v + 2, m_v);
+    m_version.fetch_add(1, std::memory_order_release);
+}
+
+bool FoveationCenter::GetGaze(float u[2], float v[2]) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_tracked) {
+        return false;
+    }
+    std::copy(m_u, m_u + 2, u);
+    std::copy(m_v, m_v + 2, v);
+    return true;
+}
+
+void FoveationCenter::GetLensCenter(float u[2], float v[2]) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (int eye = 0; eye < 2; eye++) {
+        if (!m_hasViews) {
+            u[eye] = 0.5f;
+            v[eye] = 0.5f;
+            continue;
+        }
+
+        float left = tanf(m_fov[eye].left);
+        float right = tanf(m_fov[eye].right);
+        float up = tanf(m_fov[eye].up);
+        float down = tanf(m_fov[eye].down);
+
+        float x = -left / (right - left);
+        u[eye] = eye == 1 ? 1.f - x : x;
+        v[eye] = up / (up - down);
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "bindings.h"
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+// Where the encoder quality falloff is centered. It follows the eye gaze reported with the
+// tracking when enabled, otherwise the foveation settings place it.
+// Written by the tracking thread, read by the encoder thread.
+class FoveationCenter {
+public:
+    static FoveationCenter& Instance() { return m_instance; }
+
+    void SetViews(const FfiViewParams views[2]);
+    // Null when the gaze isn't tracked
+    void SetGaze(const FfiEyeGaze* gaze);
+
+    // Changes whenever the center moves, so that the encoders know when to rebuild their maps
+    uint32_t GetVersion() const { return m_version.load(std::memory_order_acquire); }
+    // Gaze point in the UV of each eye, measured from the outer edge of the eye like the foveation
+    // settings. False when the settings place the center.
+    bool GetGaze(float u[2], float v[2]);
+
+    // Changes whenever the client reports new views
+    uint32_t GetViewsVersion() const { return m_viewsVersion.load(std::memory_order_acquire); }
+    // Where the view direction is straight ahead, in the same UV as the gaze. The radial foveated
+    // encoding is centered there. The center of each eye until the views are known.
+    void GetLensCenter(float u[2], float v[2]);
+
+private:
+    static FoveationCenter m_instance;
+
+    std::mutex m_mutex;
+    FfiFov m_fov[2] = {};
+    bool m_hasViews = false;
+    bool m_tracked = false;
+    float m_u[2] = {};
+    float m_v[2] = {};
+    std::atomic<uint32_t> m_version = 0;
+    std::atomic<uint32_t> m_viewsVersion = 0;
+};
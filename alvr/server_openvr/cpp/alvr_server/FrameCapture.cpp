@@ -0,0 +1,212 @@
+#include "FrameCapture.h"
+
+#include "Logger.h"
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <vector>
+
+namespace {
+// Largest stored deflate block
+const size_t MAX_STORED_BLOCK = 65535;
+
+const std::array<uint32_t, 256> CRC_TABLE = [] {
+    std::array<uint32_t, 256> table = {};
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        table[n] = c;
+    }
+    return table;
+}();
+
+// Writes the chunks of a PNG, keeping the CRC of the current one
+class PngStream {
+public:
+    explicit PngStream(std::ofstream& file)
+        : m_file(file) { }
+
+    void BeginChunk(const char* type, uint32_t length) {
+        WriteBigEndian(length, false);
+        m_crc = 0xffffffffu;
+        Write((const uint8_t*)type, 4);
+    }
+
+    void EndChunk() { WriteBigEndian(m_crc ^ 0xffffffffu, false); }
+
+    void Write(const uint8_t* data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            m_crc = CRC_TABLE[(m_crc ^ data[i]) & 0xff] ^ (m_crc >> 8);
+        }
+        m_file.write((const char*)data, size);
+    }
+
+    void WriteBigEndian(uint32_t value, bool crc = true) {
+        const uint8_t bytes[4] = {
+            (uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value
+        };
+        if (crc) {
+            Write(bytes, 4);
+        } else {
+            m_file.write((const char*)bytes, 4);
+        }
+    }
+
+private:
+    std::ofstream& m_file;
+    uint32_t m_crc = 0;
+};
+
+// Truecolor without compression: the deflate stream is made of stored blocks, which keeps the
+// writer fast and free of dependencies at the cost of the file size
+bool WritePng(
+    const std::string& path,
+    uint32_t width,
+    uint32_t height,
+    uint32_t rowPitch,
+    bool bgra,
+    const uint8_t* data
+) {
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    file.write((const char*)signature, sizeof(signature));
+    PngStream png(file);
+
+    png.BeginChunk("IHDR", 13);
+    png.WriteBigEndian(width);
+    png.WriteBigEndian(height);
+    // 8 bit RGB, deflate, adaptive filtering, no interlace
+    const uint8_t header[] = { 8, 2, 0, 0, 0 };
+    png.Write(header, sizeof(header));
+    png.EndChunk();
+
+    // Each row is preceded by its filter type, none
+    const size_t rowSize = 1 + (size_t)width * 3;
+    const size_t rawSize = rowSize * height;
+    const size_t blockCount = (rawSize + MAX_STORED_BLOCK - 1) / MAX_STORED_BLOCK;
+    const size_t idatSize = 2 + rawSize + blockCount * 5 + 4;
+    if (idatSize > 0x7fffffffu) {
+        return false;
+    }
+
+    png.BeginChunk("IDAT", (uint32_t)idatSize);
+    const uint8_t zlibHeader[] = { 0x78, 0x01 };
+    png.Write(zlibHeader, sizeof(zlibHeader));
+
+    uint32_t adlerA = 1, adlerB = 0;
+    std::vector<uint8_t> row(rowSize, 0);
+    size_t blockLeft = 0;
+    size_t written = 0;
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t* source = data + (size_t)y * rowPitch;
+        for (uint32_t x = 0; x < width; x++) {
+            const uint8_t* pixel = source + x * 4;
+            row[1 + x * 3] = pixel[bgra ? 2 : 0];
+            row[1 + x * 3 + 1] = pixel[1];
+            row[1 + x * 3 + 2] = pixel[bgra ? 0 : 2];
+        }
+
+        size_t offset = 0;
+        while (offset < rowSize) {
+            if (blockLeft == 0) {
+                blockLeft = std::min(MAX_STORED_BLOCK, rawSize - written);
+                const bool last = written + blockLeft == rawSize;
+                const uint8_t blockHeader[] = { (uint8_t)(last ? 1 : 0),
+                                                (uint8_t)blockLeft,
+                                                (uint8_t)(blockLeft >> 8),
+                                                (uint8_t)~blockLeft,
+                                                (uint8_t)(~blockLeft >> 8) };
+                png.Write(blockHeader, sizeof(blockHeader));
+            }
+            const size_t size = std::min(blockLeft, rowSize - offset);
+            png.Write(&row[offset], size);
+            for (size_t i = offset; i < offset + size; i++) {
+                adlerA = (adlerA + row[i]) % 65521;
+                adlerB = (adlerB + adlerA) % 65521;
+            }
+            offset += size;
+            blockLeft -= size;
+            written += size;
+        }
+    }
+    png.WriteBigEndian((adlerB << 16) | adlerA);
+    png.EndChunk();
+
+    png.BeginChunk("IEND", 0);
+    png.EndChunk();
+
+    file.close();
+    return !file.fail();
+}
+}
+
+FrameCaptureWriter::FrameCaptureWriter() { m_thread = std::thread(&FrameCaptureWriter::run, this); }
+
+FrameCaptureWriter::~FrameCaptureWriter() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_exiting = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+}
+
+size_t FrameCaptureWriter::GetPendingCount() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_pending.size() + (m_writing ? 1 : 0);
+}
+
+void FrameCaptureWriter::Add(
+    const std::string& path,
+    uint32_t width,
+    uint32_t height,
+    uint32_t rowPitch,
+    bool bgra,
+    const uint8_t* data,
+    std::function<void()> release
+) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.push_back({ path, width, height, rowPitch, bgra, data, std::move(release) });
+    }
+    m_cv.notify_all();
+}
+
+void FrameCaptureWriter::run() {
+    while (true) {
+        Pending pending;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_writing = false;
+            m_cv.wait(lock, [&] { return m_exiting || !m_pending.empty(); });
+            if (m_pending.empty()) {
+                return;
+            }
+            pending = std::move(m_pending.front());
+            m_pending.pop_front();
+            m_writing = true;
+        }
+
+        if (WritePng(
+                pending.path,
+                pending.width,
+                pending.height,
+                pending.rowPitch,
+                pending.bgra,
+                pending.data
+            )) {
+            Info("Frame saved to %s\n", pending.path.c_str());
+        } else {
+            Error("Failed to write the frame to %s\n", pending.path.c_str());
+        }
+        if (pending.release) {
+            pending.release();
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+
+// Writes the frames saved by Capture frame as PNG from a thread of its own, so that the render
+// loop only has to queue a copy of the frame to host memory. The alpha channel is dropped, the
+// composited frames don't have a meaningful one.
+class FrameCaptureWriter {
+public:
+    // Frames copied or being written, past which the next ones of a burst are skipped rather
+    // than holding the render loop back
+    static constexpr size_t MaxPendingFrames = 8;
+
+    FrameCaptureWriter();
+    // Writes the frames still queued
+    ~FrameCaptureWriter();
+
+    size_t GetPendingCount();
+
+    // data holds height rows of rowPitch bytes of 8 bit RGBA, or BGRA if bgra is set. It must stay
+    // valid until release is called on the writer thread, once the file is written
+    void Add(
+        const std::string& path,
+        uint32_t width,
+        uint32_t height,
+        uint32_t rowPitch,
+        bool bgra,
+        const uint8_t* data,
+        std::function<void()> release
+    );
+
+private:
+    struct Pending {
+        std::string path;
+        uint32_t width;
+        uint32_t height;
+        uint32_t rowPitch;
+        bool bgra;
+        const uint8_t* data;
+        std::function<void()> release;
+    };
+
+    void run();
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Pending> m_pending;
+    bool m_writing = false;
+    bool m_exiting = false;
+    std::thread m_thread;
+};
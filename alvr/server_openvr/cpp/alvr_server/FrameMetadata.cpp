@@ -0,0 +1,145 @@
+#include "FrameMetadata.h"
+#include "Settings.h"
+#include "bindings.h"
+#include <string.h>
+
+FrameMetadata FrameMetadata::m_instance;
+
+namespace {
+// Generated once, tells the payload apart from the SEI messages of the encoders
+const unsigned char METADATA_UUID[16] = { 0xa1, 0x7f, 0x3c, 0x52, 0x9e, 0x0b, 0x4d, 0x8a,
+                                          0xb6, 0x21, 0x5c, 0xe4, 0x93, 0x07, 0xf8, 0x1d };
+
+const unsigned char H264_NAL_TYPE_SEI = 6;
+const unsigned char HEVC_NAL_TYPE_PREFIX_SEI = 39;
+const unsigned char SEI_TYPE_USER_DATA_UNREGISTERED = 5;
+
+const unsigned char AV1_OBU_TYPE_METADATA = 5;
+// The first of the unregistered user private metadata types
+const unsigned char AV1_METADATA_TYPE_USER_PRIVATE = 6;
+
+void putBigEndian(std::vector<unsigned char>& out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        out.push_back((unsigned char)(value >> (8 * i)));
+    }
+}
+
+void putFloat(std::vector<unsigned char>& out, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    putBigEndian(out, bits, 4);
+}
+
+void putLeb128(std::vector<unsigned char>& out, size_t value) {
+    do {
+        unsigned char byte = value & 0x7F;
+        value >>= 7;
+        out.push_back(value != 0 ? byte | 0x80 : byte);
+    } while (value != 0);
+}
+
+// Inserts the emulation prevention bytes, so that the payload can't contain a start code
+void putEscaped(std::vector<unsigned char>& out, const std::vector<unsigned char>& rbsp) {
+    int zeros = 0;
+    for (unsigned char byte : rbsp) {
+        if (zeros >= 2 && byte <= 3) {
+            out.push_back(3);
+            zeros = 0;
+        }
+        out.push_back(byte);
+        zeros = byte == 0 ? zeros + 1 : 0;
+    }
+}
+}
+
+bool FrameMetadata::IsEnabled() { return Settings::Instance().m_encoderFrameMetadata; }
+
+void FrameMetadata::SetFlags(uint64_t targetTimestampNs, uint8_t flags) {
+    if (!IsEnabled()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_flags[m_nextFlags] = { targetTimestampNs, flags };
+    m_nextFlags = (m_nextFlags + 1) % FLAGS_COUNT;
+}
+
+void FrameMetadata::Build(
+    int codec,
+    uint64_t targetTimestampNs,
+    bool isIdr,
+    int temporalId,
+    std::vector<unsigned char>& out
+) {
+    const Settings& settings = Settings::Instance();
+
+    uint8_t flags = isIdr ? FLAG_IDR : 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& frame : m_flags) {
+            if (frame.targetTimestampNs == targetTimestampNs) {
+                flags |= frame.flags;
+            }
+        }
+    }
+    if (isIdr) {
+        flags |= FLAG_STREAM_PARAMS;
+        if (settings.m_enableFoveatedEncoding) {
+            flags |= FLAG_FOVEATED;
+            if (settings.m_enableRadialFoveation) {
+                flags |= FLAG_RADIAL_FOVEATION;
+            }
+        }
+    }
+
+    thread_local std::vector<unsigned char> payload;
+    payload.assign(METADATA_UUID, METADATA_UUID + sizeof(METADATA_UUID));
+    payload.push_back(VERSION);
+    payload.push_back(flags);
+    payload.push_back((unsigned char)temporalId);
+    payload.push_back(0);
+    putBigEndian(payload, targetTimestampNs, 8);
+    if (flags & FLAG_STREAM_PARAMS) {
+        payload.push_back((unsigned char)settings.m_encoderTileColumns);
+        payload.push_back((unsigned char)settings.m_encoderTileRows);
+        putBigEndian(payload, 0, 2);
+        bool foveated = flags & FLAG_FOVEATED;
+        for (float value : { settings.m_foveationCenterSizeX,
+                             settings.m_foveationCenterSizeY,
+                             settings.m_foveationCenterShiftX,
+                             settings.m_foveationCenterShiftY,
+                             settings.m_foveationEdgeRatioX,
+                             settings.m_foveationEdgeRatioY }) {
+            putFloat(payload, foveated ? value : 0.f);
+        }
+    }
+
+    out.clear();
+    if (codec == ALVR_CODEC_AV1) {
+        // With the size field and without the extension, the metadata applies to all the layers
+        out.push_back(AV1_OBU_TYPE_METADATA << 3 | 0x02);
+        putLeb128(out, 1 + payload.size() + 1);
+        out.push_back(AV1_METADATA_TYPE_USER_PRIVATE);
+        out.insert(out.end(), payload.begin(), payload.end());
+        // trailing_bits
+        out.push_back(0x80);
+        return;
+    }
+
+    // The payload is under 255 bytes, its size is a single byte
+    thread_local std::vector<unsigned char> rbsp;
+    rbsp.assign(1, SEI_TYPE_USER_DATA_UNREGISTERED);
+    rbsp.push_back((unsigned char)payload.size());
+    rbsp.insert(rbsp.end(), payload.begin(), payload.end());
+    // rbsp_trailing_bits
+    rbsp.push_back(0x80);
+
+    out.assign({ 0, 0, 0, 1 });
+    if (codec == ALVR_CODEC_HEVC) {
+        out.push_back(HEVC_NAL_TYPE_PREFIX_SEI << 1);
+        // The temporal id of a prefix SEI can't be below the one of its access unit
+        out.push_back((unsigned char)(temporalId + 1));
+    } else {
+        out.push_back(H264_NAL_TYPE_SEI);
+    }
+    putEscaped(out, rbsp);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Per-frame information for the client, carried in the stream in front of the first slice of each
+// frame: a user data unregistered SEI message for H.264 and HEVC, an unregistered user private
+// metadata OBU for AV1. The decoders skip it, the client finds it by UUID. The payload after the
+// UUID, big endian:
+//   version u8, flags u8, temporal id u8, reserved u8, target timestamp in ns u64
+// then with FLAG_STREAM_PARAMS:
+//   tile columns u8, tile rows u8, reserved u16, and the foveation center size x and y, center
+//   shift x and y, edge ratio x and y as floats, zero without foveated encoding
+class FrameMetadata {
+public:
+    static const uint8_t VERSION = 1;
+
+    enum Flags : uint8_t {
+        FLAG_IDR = 1 << 0,
+        // Turned to a newer head orientation than the one the game rendered it with
+        FLAG_REPROJECTED = 1 << 1,
+        // Made from a previous frame of the game, which missed this one
+        FLAG_SYNTHESIZED = 1 << 2,
+        // The stream parameters follow. With the IDR frames, they only change on restart
+        FLAG_STREAM_PARAMS = 1 << 3,
+        FLAG_FOVEATED = 1 << 4,
+        FLAG_RADIAL_FOVEATION = 1 << 5,
+    };
+
+    static FrameMetadata& Instance() { return m_instance; }
+
+    static bool IsEnabled();
+
+    // Flags the compositor knows about a frame, before it's encoded
+    void SetFlags(uint64_t targetTimestampNs, uint8_t flags);
+
+    // The SEI NAL with its start code, or the metadata OBU, of the frame
+    void Build(
+        int codec,
+        uint64_t targetTimestampNs,
+        bool isIdr,
+        int temporalId,
+        std::vector<unsigned char>& out
+    );
+
+private:
+    static FrameMetadata m_instance;
+
+    // More than the frames between the compositor and the encoder output
+    static const int FLAGS_COUNT = 16;
+
+    struct FrameFlags {
+        uint64_t targetTimestampNs;
+        uint8_t flags;
+    };
+
+    std::mutex m_mutex;
+    FrameFlags m_flags[FLAGS_COUNT] = {};
+    int m_nextFlags = 0;
+};
@@ -0,0 +1,208 @@
+#include "FrameRecording.h"
+
+#include "Logger.h"
+#include <cstring>
+
+namespace {
+const char MAGIC[8] = "ALVRREC";
+const uint32_t VERSION = 1;
+
+// Frames waiting to be written before Add() blocks
+const size_t MAX_PENDING_FRAMES = 4;
+
+// Unchanged pixels that end a run of changed ones. Shorter gaps are cheaper to store as is
+const size_t MIN_SKIPPED_PIXELS = 4;
+
+void AppendWord(std::vector<uint8_t>& out, uint32_t word) {
+    const uint8_t* bytes = (const uint8_t*)&word;
+    out.insert(out.end(), bytes, bytes + sizeof(word));
+}
+
+// The image is a sequence of (skipped pixels, changed pixels, XOR of each changed pixel) words
+void EncodeImage(
+    const uint32_t* previous, const uint32_t* current, size_t count, std::vector<uint8_t>& out
+) {
+    out.clear();
+    size_t i = 0;
+    while (i < count) {
+        const size_t skipBegin = i;
+        while (i < count && current[i] == previous[i]) {
+            i++;
+        }
+
+        const size_t changedBegin = i;
+        size_t changedEnd = i;
+        while (i < count && i - changedEnd < MIN_SKIPPED_PIXELS) {
+            if (current[i] != previous[i]) {
+                changedEnd = i + 1;
+            }
+            i++;
+        }
+        i = changedEnd;
+
+        AppendWord(out, (uint32_t)(changedBegin - skipBegin));
+        AppendWord(out, (uint32_t)(changedEnd - changedBegin));
+        for (size_t j = changedBegin; j < changedEnd; j++) {
+            AppendWord(out, current[j] ^ previous[j]);
+        }
+    }
+}
+
+// False if the data doesn't fit the image
+bool DecodeImage(const std::vector<uint8_t>& data, uint32_t* image, size_t count) {
+    const uint32_t* words = (const uint32_t*)data.data();
+    const size_t wordCount = data.size() / sizeof(uint32_t);
+    size_t pixel = 0;
+    size_t w = 0;
+    while (w + 2 <= wordCount) {
+        const size_t skipped = words[w++];
+        const size_t changed = words[w++];
+        if (pixel + skipped + changed > count || w + changed > wordCount) {
+            return false;
+        }
+        pixel += skipped;
+        for (size_t i = 0; i < changed; i++) {
+            image[pixel++] ^= words[w++];
+        }
+    }
+    return w == wordCount;
+}
+}
+
+FrameRecorder::FrameRecorder(
+    const std::string& path, uint32_t width, uint32_t height, uint32_t frameCount
+)
+    : m_path(path)
+    , m_width(width)
+    , m_height(height)
+    , m_frameCount(frameCount)
+    , m_previous((size_t)width * height * 4, 0) {
+    m_file.open(path, std::ios::binary);
+    if (!m_file) {
+        Error("Can't write the frame recording to %s\n", path.c_str());
+        return;
+    }
+
+    FrameRecordingHeader header = {};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.width = width;
+    header.height = height;
+    m_file.write((const char*)&header, sizeof(header));
+
+    m_valid = true;
+    m_thread = std::thread(&FrameRecorder::run, this);
+    Info("Recording %u frames of %ux%u to %s\n", frameCount, width, height, path.c_str());
+}
+
+FrameRecorder::~FrameRecorder() {
+    if (!m_valid) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_exiting = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+
+    m_file.close();
+    if (m_file.fail()) {
+        Error("Failed to write the frame recording to %s\n", m_path.c_str());
+    } else {
+        Info("Recorded %u frames to %s\n", m_added, m_path.c_str());
+    }
+}
+
+void FrameRecorder::Add(const FrameRecordingFrame& frame, std::vector<uint8_t> rgba) {
+    if (!m_valid || IsComplete() || rgba.size() != m_previous.size()) {
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [&] { return m_pending.size() < MAX_PENDING_FRAMES; });
+        m_pending.push_back({ frame, std::move(rgba) });
+    }
+    m_cv.notify_all();
+    m_added++;
+}
+
+void FrameRecorder::run() {
+    while (true) {
+        Pending pending;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [&] { return m_exiting || !m_pending.empty(); });
+            if (m_pending.empty()) {
+                return;
+            }
+            pending = std::move(m_pending.front());
+            m_pending.pop_front();
+        }
+        m_cv.notify_all();
+
+        EncodeImage(
+            (const uint32_t*)m_previous.data(),
+            (const uint32_t*)pending.rgba.data(),
+            m_previous.size() / 4,
+            m_encoded
+        );
+        pending.frame.imageSize = (uint32_t)m_encoded.size();
+        m_file.write((const char*)&pending.frame, sizeof(pending.frame));
+        m_file.write((const char*)m_encoded.data(), m_encoded.size());
+        m_previous = std::move(pending.rgba);
+    }
+}
+
+FrameRecordingReader::FrameRecordingReader(const char* path)
+    : m_file(path, std::ios::binary) {
+    m_file.read((char*)&m_header, sizeof(m_header));
+    if (!m_file || memcmp(m_header.magic, MAGIC, sizeof(MAGIC)) != 0
+        || m_header.version != VERSION || m_header.width == 0 || m_header.height == 0) {
+        return;
+    }
+
+    // Count the complete frames
+    m_file.seekg(0, std::ios::end);
+    const std::streamoff fileSize = m_file.tellg();
+    std::streamoff offset = sizeof(m_header);
+    while (true) {
+        FrameRecordingFrame frame;
+        m_file.seekg(offset);
+        if (!m_file.read((char*)&frame, sizeof(frame))) {
+            break;
+        }
+        offset += sizeof(frame) + frame.imageSize;
+        if (offset > fileSize) {
+            break;
+        }
+        m_frameCount++;
+    }
+
+    Rewind();
+}
+
+const std::vector<uint8_t>& FrameRecordingReader::Next(FrameRecordingFrame& frame) {
+    if (m_index == m_frameCount) {
+        Rewind();
+    }
+    m_index++;
+
+    m_file.read((char*)&frame, sizeof(frame));
+    m_encoded.resize(frame.imageSize);
+    m_file.read((char*)m_encoded.data(), m_encoded.size());
+    if (!m_file || !DecodeImage(m_encoded, (uint32_t*)m_image.data(), m_image.size() / 4)) {
+        Warn("Frame %u of the recording is corrupted\n", m_index - 1);
+    }
+
+    return m_image;
+}
+
+void FrameRecordingReader::Rewind() {
+    m_file.clear();
+    m_file.seekg(sizeof(m_header));
+    m_image.assign((size_t)m_header.width * m_header.height * 4, 0);
+    m_index = 0;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Recordings of what the compositor is fed during a session, replayed by the encode benchmark to
+// compare changes to the composite and encode paths frame for frame. A file is a
+// FrameRecordingHeader followed by, for each frame, a FrameRecordingFrame and its image. Images
+// are RGBA as the compositor samples them, stored as the XOR with the previous frame where the
+// runs of unchanged pixels are skipped
+
+struct FrameRecordingHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t reserved;
+};
+
+struct FrameRecordingFrame {
+    uint64_t targetTimestampNs;
+    // Since the first frame of the recording was presented
+    uint64_t presentTimeNs;
+    float pose[3][4];
+    // Encoder params in use for this frame
+    uint64_t bitrateBps;
+    float framerate;
+    // Index of the image in the layer's swapchain
+    uint32_t image;
+    uint32_t idr;
+    // Bytes of image data that follow
+    uint32_t imageSize;
+};
+
+// Compresses and writes the frames from a thread of its own. Add() only blocks if the writer falls
+// more than a few frames behind, so that none is lost
+class FrameRecorder {
+public:
+    FrameRecorder(const std::string& path, uint32_t width, uint32_t height, uint32_t frameCount);
+    // Writes the frames still queued
+    ~FrameRecorder();
+
+    bool IsValid() const { return m_valid; }
+    bool IsComplete() const { return m_added >= m_frameCount; }
+
+    void Add(const FrameRecordingFrame& frame, std::vector<uint8_t> rgba);
+
+private:
+    struct Pending {
+        FrameRecordingFrame frame;
+        std::vector<uint8_t> rgba;
+    };
+
+    void run();
+
+    std::string m_path;
+    uint32_t m_width;
+    uint32_t m_height;
+    uint32_t m_frameCount;
+    uint32_t m_added = 0;
+    bool m_valid = false;
+
+    std::ofstream m_file;
+    std::vector<uint8_t> m_previous;
+    std::vector<uint8_t> m_encoded;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Pending> m_pending;
+    bool m_exiting = false;
+    std::thread m_thread;
+};
+
+// Reads a recording sequentially, starting over after the last frame. A recording that was cut
+// short by a crash is read up to its last complete frame
+class FrameRecordingReader {
+public:
+    explicit FrameRecordingReader(const char* path);
+
+    // False if the file can't be read or has no frame
+    bool IsValid() const { return m_frameCount > 0; }
+    uint32_t GetWidth() const { return m_header.width; }
+    uint32_t GetHeight() const { return m_header.height; }
+    uint32_t GetFrameCount() const { return m_frameCount; }
+
+    const std::vector<uint8_t>& Next(FrameRecordingFrame& frame);
+    void Rewind();
+
+private:
+    std::ifstream m_file;
+    FrameRecordingHeader m_header = {};
+    uint32_t m_frameCount = 0;
+    uint32_t m_index = 0;
+    std::vector<uint8_t> m_image;
+    std::vector<uint8_t> m_encoded;
+};
@@ -0,0 +1,92 @@
+#include "FrameTrace.h"
+
+#include "FlightRecorder.h"
+#include <algorithm>
+#include <chrono>
+
+FrameTrace FrameTrace::m_instance;
+
+uint64_t FrameTrace::Now() {
+    auto duration = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+}
+
+void FrameTrace::Record(uint64_t targetTimestampNs, FfiFrameTraceStage stage, uint64_t timeNs) {
+    if (auto stageNs = Find(targetTimestampNs, stage)) {
+        stageNs->store(timeNs, std::memory_order_relaxed);
+        FlightRecorder::Instance().RecordStage(targetTimestampNs, stage, timeNs);
+    }
+}
+
+void FrameTrace::RecordFirst(
+    uint64_t targetTimestampNs, FfiFrameTraceStage stage, uint64_t timeNs
+) {
+    if (auto stageNs = Find(targetTimestampNs, stage)) {
+        uint64_t unset = 0;
+        if (stageNs->compare_exchange_strong(unset, timeNs, std::memory_order_relaxed)) {
+            FlightRecorder::Instance().RecordStage(targetTimestampNs, stage, timeNs);
+        }
+    }
+}
+
+std::atomic<uint64_t>* FrameTrace::Find(uint64_t targetTimestampNs, FfiFrameTraceStage stage) {
+    if (targetTimestampNs == 0) {
+        return nullptr;
+    }
+
+    // Newest first, the frame is normally one of the last few
+    uint64_t frames = m_frames.load(std::memory_order_acquire);
+    for (uint64_t index = frames; index > 0 && frames - index < RING_SIZE; index--) {
+        Slot& slot = m_slots[(index - 1) % RING_SIZE];
+        if (slot.frame.load(std::memory_order_acquire) == index
+            && slot.targetTimestampNs.load(std::memory_order_relaxed) == targetTimestampNs) {
+            return &slot.stagesNs[stage];
+        }
+    }
+
+    if (stage != FRAME_TRACE_PRESENT && stage != FRAME_TRACE_POSE_MATCHED) {
+        return nullptr;
+    }
+
+    // Only one thread starts frames, so the slot isn't claimed concurrently. The reader discards
+    // it if it reads it while it's reset
+    Slot& slot = m_slots[frames % RING_SIZE];
+    slot.frame.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (auto& stageNs : slot.stagesNs) {
+        stageNs.store(0, std::memory_order_relaxed);
+    }
+    slot.targetTimestampNs.store(targetTimestampNs, std::memory_order_relaxed);
+    slot.frame.store(frames + 1, std::memory_order_release);
+    m_frames.store(frames + 1, std::memory_order_release);
+
+    return &slot.stagesNs[stage];
+}
+
+unsigned int FrameTrace::Pop(FfiFrameTrace* traces, unsigned int maxCount) {
+    uint64_t frames = m_frames.load(std::memory_order_acquire);
+    // Frames that were overwritten before they were read are lost
+    m_readFrames = std::max(m_readFrames, frames > RING_SIZE ? frames - RING_SIZE : 0);
+
+    unsigned int count = 0;
+    while (count < maxCount && m_readFrames + READ_DELAY_FRAMES < frames) {
+        uint64_t index = ++m_readFrames;
+        const Slot& slot = m_slots[(index - 1) % RING_SIZE];
+        if (slot.frame.load(std::memory_order_acquire) != index) {
+            continue;
+        }
+
+        FfiFrameTrace& trace = traces[count];
+        trace.targetTimestampNs = slot.targetTimestampNs.load(std::memory_order_relaxed);
+        for (int stage = 0; stage < FRAME_TRACE_STAGE_COUNT; stage++) {
+            trace.stageTimestampsNs[stage] = slot.stagesNs[stage].load(std::memory_order_relaxed);
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.frame.load(std::memory_order_relaxed) == index) {
+            count++;
+        }
+    }
+
+    return count;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "bindings.h"
+#include <array>
+#include <atomic>
+#include <stdint.h>
+
+// Timestamps of the stages each frame goes through in the driver, for the per-stage latency
+// statistics. The threads handling the stages write them to a ring and PopFrameTraces reads them
+// back through a seqlock, neither side takes a lock.
+class FrameTrace {
+public:
+    static FrameTrace& Instance() { return m_instance; }
+
+    // Steady clock, the time base of all the stages
+    static uint64_t Now();
+
+    // Present and pose matching start the frame if it isn't in the ring yet, they must come from
+    // one thread at a time. Other stages of unknown frames are dropped. timeNs may be in the past,
+    // for stages measured on the GPU.
+    void Record(uint64_t targetTimestampNs, FfiFrameTraceStage stage, uint64_t timeNs = Now());
+    // Same as Record, but keeps the time of an earlier call for the same stage
+    void RecordFirst(uint64_t targetTimestampNs, FfiFrameTraceStage stage, uint64_t timeNs = Now());
+
+    unsigned int Pop(FfiFrameTrace* traces, unsigned int maxCount);
+
+private:
+    static FrameTrace m_instance;
+
+    static const uint64_t RING_SIZE = 64;
+    // Frames are only read once this many newer ones were started, so that the stages recorded
+    // late, like the GPU timestamps read back a few frames later, are included
+    static const uint64_t READ_DELAY_FRAMES = 8;
+
+    struct Slot {
+        // Index + 1 of the frame in the slot, 0 while the slot is being reset
+        std::atomic<uint64_t> frame { 0 };
+        std::atomic<uint64_t> targetTimestampNs { 0 };
+        std::array<std::atomic<uint64_t>, FRAME_TRACE_STAGE_COUNT> stagesNs {};
+    };
+
+    std::atomic<uint64_t>* Find(uint64_t targetTimestampNs, FfiFrameTraceStage stage);
+
+    std::array<Slot, RING_SIZE> m_slots;
+    // Frames started so far
+    std::atomic<uint64_t> m_frames { 0 };
+    // Only accessed by the reader
+    uint64_t m_readFrames = 0;
+};
@@ -0,0 +1,248 @@
+#include "GpuUtilization.h"
+
+#include "FrameTrace.h"
+#include "Logger.h"
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fstream>
+#endif
+
+GpuUtilization GpuUtilization::m_instance;
+
+namespace {
+// The values a source doesn't have are left negative
+class Source {
+public:
+    virtual ~Source() = default;
+    virtual const char* Name() const = 0;
+    // False once the GPU can't be sampled anymore
+    virtual bool Sample(FfiGpuUtilization& sample) = 0;
+};
+
+// The NVML library of the driver, loaded at runtime. Only the calls used here are declared
+class NvmlSource : public Source {
+public:
+    static std::unique_ptr<NvmlSource> Open() {
+#ifdef _WIN32
+        HMODULE library = LoadLibraryA("nvml.dll");
+        auto load = [&](const char* name) { return (void*)GetProcAddress(library, name); };
+#else
+        void* library = dlopen("libnvidia-ml.so.1", RTLD_LAZY);
+        auto load = [&](const char* name) { return dlsym(library, name); };
+#endif
+        if (!library) {
+            return nullptr;
+        }
+
+        auto source = std::make_unique<NvmlSource>();
+        source->m_init = (NvmlReturn(*)())load("nvmlInit_v2");
+        source->m_getHandleByIndex
+            = (NvmlReturn(*)(unsigned int, NvmlDevice*))load("nvmlDeviceGetHandleByIndex_v2");
+        source->m_getUtilizationRates
+            = (NvmlReturn(*)(NvmlDevice, NvmlUtilization*))load("nvmlDeviceGetUtilizationRates");
+        source->m_getEncoderUtilization = (NvmlReturn(*)(NvmlDevice, unsigned int*, unsigned int*)
+        )load("nvmlDeviceGetEncoderUtilization");
+        source->m_getPcieThroughput
+            = (NvmlReturn(*)(NvmlDevice, int, unsigned int*))load("nvmlDeviceGetPcieThroughput");
+        if (!source->m_init || !source->m_getHandleByIndex || !source->m_getUtilizationRates
+            || !source->m_getEncoderUtilization || !source->m_getPcieThroughput) {
+            return nullptr;
+        }
+        // The first GPU, the one SteamVR renders on in nearly all setups with an NVIDIA GPU
+        if (source->m_init() != NVML_SUCCESS
+            || source->m_getHandleByIndex(0, &source->m_device) != NVML_SUCCESS) {
+            return nullptr;
+        }
+        return source;
+    }
+
+    const char* Name() const override { return "NVML"; }
+
+    bool Sample(FfiGpuUtilization& sample) override {
+        NvmlUtilization utilization;
+        if (m_getUtilizationRates(m_device, &utilization) != NVML_SUCCESS) {
+            return false;
+        }
+        sample.graphicsPercent = (float)utilization.gpu;
+
+        unsigned int encoder, periodUs;
+        if (m_getEncoderUtilization(m_device, &encoder, &periodUs) == NVML_SUCCESS) {
+            sample.encoderPercent = (float)encoder;
+        }
+        // In KB/s over the last 20 ms
+        unsigned int kbps;
+        if (m_getPcieThroughput(m_device, NVML_PCIE_UTIL_RX_BYTES, &kbps) == NVML_SUCCESS) {
+            sample.pcieRxMBps = kbps / 1000.f;
+        }
+        if (m_getPcieThroughput(m_device, NVML_PCIE_UTIL_TX_BYTES, &kbps) == NVML_SUCCESS) {
+            sample.pcieTxMBps = kbps / 1000.f;
+        }
+        return true;
+    }
+
+private:
+    typedef int NvmlReturn;
+    typedef struct NvmlDeviceOpaque* NvmlDevice;
+    struct NvmlUtilization {
+        unsigned int gpu;
+        unsigned int memory;
+    };
+    static const NvmlReturn NVML_SUCCESS = 0;
+    static const int NVML_PCIE_UTIL_TX_BYTES = 0;
+    static const int NVML_PCIE_UTIL_RX_BYTES = 1;
+
+    NvmlReturn (*m_init)() = nullptr;
+    NvmlReturn (*m_getHandleByIndex)(unsigned int, NvmlDevice*) = nullptr;
+    NvmlReturn (*m_getUtilizationRates)(NvmlDevice, NvmlUtilization*) = nullptr;
+    NvmlReturn (*m_getEncoderUtilization)(NvmlDevice, unsigned int*, unsigned int*) = nullptr;
+    NvmlReturn (*m_getPcieThroughput)(NvmlDevice, int, unsigned int*) = nullptr;
+    NvmlDevice m_device = nullptr;
+};
+
+#ifndef _WIN32
+// The gpu_metrics table of amdgpu, which has the average activity of the graphics and multimedia
+// (VCN) engines. Only the layouts where they are at known offsets are read
+class AmdgpuSource : public Source {
+public:
+    static std::unique_ptr<AmdgpuSource> Open() {
+        DIR* dir = opendir("/sys/class/drm");
+        if (!dir) {
+            return nullptr;
+        }
+        std::unique_ptr<AmdgpuSource> source;
+        while (dirent* entry = readdir(dir)) {
+            // cardN, not its connectors cardN-DP-1
+            if (strncmp(entry->d_name, "card", 4) != 0 || strchr(entry->d_name, '-')) {
+                continue;
+            }
+            std::string path = std::string("/sys/class/drm/") + entry->d_name + "/device/";
+            std::ifstream driver(path + "uevent");
+            std::string line;
+            bool amdgpu = false;
+            while (std::getline(driver, line)) {
+                amdgpu = amdgpu || line == "DRIVER=amdgpu";
+            }
+            if (!amdgpu) {
+                continue;
+            }
+            auto candidate = std::make_unique<AmdgpuSource>();
+            candidate->m_metricsPath = path + "gpu_metrics";
+            FfiGpuUtilization sample = {};
+            if (candidate->Sample(sample)) {
+                source = std::move(candidate);
+                break;
+            }
+        }
+        closedir(dir);
+        return source;
+    }
+
+    const char* Name() const override { return "amdgpu gpu_metrics"; }
+
+    bool Sample(FfiGpuUtilization& sample) override {
+        std::ifstream file(m_metricsPath, std::ios::binary);
+        uint8_t table[64] = {};
+        if (!file.read((char*)table, sizeof(table)) && file.gcount() < 32) {
+            return false;
+        }
+        // metrics_table_header: structure_size (16 bits), format_revision, content_revision
+        uint8_t format = table[2];
+        uint8_t content = table[3];
+        size_t graphicsOffset, multimediaOffset;
+        if (format == 1 && content <= 3) {
+            // Discrete GPUs, after 6 temperatures
+            graphicsOffset = 16;
+            multimediaOffset = 20;
+        } else if (format == 2 && content <= 3) {
+            // APUs, after 12 temperatures
+            graphicsOffset = 28;
+            multimediaOffset = 30;
+        } else {
+            return false;
+        }
+        uint16_t graphics, multimedia;
+        memcpy(&graphics, table + graphicsOffset, sizeof(graphics));
+        memcpy(&multimedia, table + multimediaOffset, sizeof(multimedia));
+        // 0xFFFF when the firmware doesn't report it
+        if (graphics != 0xFFFF) {
+            sample.graphicsPercent = graphics;
+        }
+        if (multimedia != 0xFFFF) {
+            sample.encoderPercent = multimedia;
+        }
+        return true;
+    }
+
+private:
+    std::string m_metricsPath;
+};
+#endif
+}
+
+unsigned int GpuUtilization::Pop(FfiGpuUtilization* samples, unsigned int maxCount) {
+    if (!m_started.exchange(true)) {
+        m_thread = std::thread(&GpuUtilization::Run, this);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    unsigned int count = 0;
+    while (count < maxCount && !m_samples.empty()) {
+        samples[count++] = m_samples.front();
+        m_samples.pop_front();
+    }
+    return count;
+}
+
+void GpuUtilization::Shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_stop.notify_all();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+void GpuUtilization::Run() {
+    std::unique_ptr<Source> source = NvmlSource::Open();
+#ifndef _WIN32
+    if (!source) {
+        source = AmdgpuSource::Open();
+    }
+#endif
+    if (!source) {
+        Info("GpuUtilization: no supported GPU, the engine utilization isn't sampled\n");
+        return;
+    }
+    Info("GpuUtilization: sampling the engine utilization through %s\n", source->Name());
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stopping) {
+        lock.unlock();
+        FfiGpuUtilization sample = { FrameTrace::Now(), -1.f, -1.f, -1.f, -1.f };
+        bool sampled = source->Sample(sample);
+        lock.lock();
+
+        if (!sampled) {
+            Warn("GpuUtilization: %s stopped working\n", source->Name());
+            return;
+        }
+        m_samples.push_back(sample);
+        if (m_samples.size() > MAX_SAMPLES) {
+            m_samples.pop_front();
+        }
+
+        m_stop.wait_for(lock, std::chrono::milliseconds(SAMPLE_INTERVAL_MS), [this] {
+            return m_stopping;
+        });
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "bindings.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// Samples how busy the GPU engines are a few times per second, on its own thread, so that late
+// frames can be put next to a saturated 3D engine, video engine or PCIe link. The samples are
+// timestamped with FrameTrace::Now(), the clock of the frame traces. NVML for NVIDIA GPUs on both
+// platforms, and the amdgpu sysfs metrics on Linux. Nothing is sampled on other GPUs.
+class GpuUtilization {
+public:
+    static GpuUtilization& Instance() { return m_instance; }
+
+    // The sampler starts with the first call, made when a client is streaming. Must always be
+    // called from the same thread
+    unsigned int Pop(FfiGpuUtilization* samples, unsigned int maxCount);
+    void Shutdown();
+
+private:
+    static GpuUtilization m_instance;
+
+    static const int SAMPLE_INTERVAL_MS = 100;
+    // Two seconds of samples, older ones are dropped if nobody reads them
+    static const size_t MAX_SAMPLES = 20;
+
+    void Run();
+
+    std::mutex m_mutex;
+    std::condition_variable m_stop;
+    std::deque<FfiGpuUtilization> m_samples;
+    std::atomic<bool> m_started = false;
+    bool m_stopping = false;
+    std::thread m_thread;
+};
@@ -5,9 +5,12 @@
 #include "Paths.h"
 #include "PoseHistory.h"
 #include "Settings.h"
+#include "StartupProfiler.h"
 #include "Utils.h"
+#include "VideoSendQueue.h"
 #include "ViveTrackerProxy.h"
 #include "bindings.h"
+#include <cstdlib>
 
 #ifdef _WIN32
 #include "platform/win32/CEncoder.h"
@@ -36,6 +39,20 @@ Hmd::Hmd()
 
     m_poseHistory = std::make_shared<PoseHistory>();
 
+#if !defined(_WIN32) && !defined(__APPLE__)
+    // Under Wayland the DRM lease shim gives vrcompositor a mode at the refresh rate of the stream,
+    // it doesn't need to be set again once connected
+    m_refreshRateSet = getenv("WAYLAND_DISPLAY") != nullptr;
+#endif
+
+    // The client already predicts the head pose to the target timestamp
+    auto& settings = Settings::Instance();
+    if (settings.m_poseFilterHead) {
+        m_poseFilter.emplace(
+            PoseFilter::Params { settings.m_poseFilterMinCutoffHz, settings.m_poseFilterBeta, 0.f }
+        );
+    }
+
     if (Settings::Instance().m_enableViveTrackerProxy) {
         m_viveTrackerProxy = std::make_unique<ViveTrackerProxy>(*this);
         if (!vr::VRServerDriverHost()->TrackedDeviceAdded(
@@ -51,6 +68,12 @@ Hmd::Hmd()
 Hmd::~Hmd() {
     Debug("Hmd::destructor");
 
+#ifdef _WIN32
+    if (m_encoderInitialization.valid()) {
+        m_encoderInitialization.wait();
+    }
+#endif
+
     if (m_encoder) {
         Debug("Hmd::~Hmd(): Stopping encoder...\n");
         m_encoder->Stop();
@@ -176,11 +199,16 @@ void* Hmd::get_component(const char* component_name_and_version) {
 }
 
 void Hmd::OnPoseUpdated(uint64_t targetTimestampNs, FfiDeviceMotion motion) {
-    Debug("Hmd::OnPoseUpdated");
-
     if (this->object_id == vr::k_unTrackedDeviceIndexInvalid) {
         return;
     }
+
+    // Filtered before it goes to the pose history too, so that the frames rendered with it are
+    // still matched to their timestamp
+    if (m_poseFilter) {
+        motion = m_poseFilter->Filter(targetTimestampNs, motion);
+    }
+
     auto pose = vr::DriverPose_t {};
     pose.poseIsValid = true;
     pose.result = vr::TrackingResult_Running_OK;
@@ -200,6 +228,12 @@ void Hmd::OnPoseUpdated(uint64_t targetTimestampNs, FfiDeviceMotion motion) {
     pose.vecPosition[1] = motion.pose.position[1];
     pose.vecPosition[2] = motion.pose.position[2];
 
+#if !defined(_WIN32) && !defined(__APPLE__)
+    if (m_encoder) {
+        m_encoder->OnPoseSubmitted(targetTimestampNs);
+    }
+#endif
+
     this->submit_pose(pose);
 
     m_poseHistory->OnPoseUpdated(targetTimestampNs, motion);
@@ -221,21 +255,60 @@ void Hmd::OnPoseUpdated(uint64_t targetTimestampNs, FfiDeviceMotion motion) {
 #endif
 }
 
+void Hmd::PrepareStreaming() {
+#ifdef _WIN32
+    if (this->device_class != vr::TrackedDeviceClass_HMD || m_encoder) {
+        return;
+    }
+    // Creating the encoder sessions and compiling the shaders takes a while. The settings are
+    // final by now, those that would change them restart SteamVR
+    m_encoder = std::make_shared<CEncoder>(m_poseHistory);
+    m_encoderInitialization = std::async(std::launch::async, [this] {
+        // The D3D device is created on activation
+        if (!wait_activation()) {
+            throw MakeException("The HMD was not activated");
+        }
+        StartupStep step("encoder initialization");
+        m_encoder->Initialize(m_D3DRender);
+    });
+#elif !defined(__APPLE__)
+    if (this->device_class != vr::TrackedDeviceClass_HMD || m_encoder) {
+        return;
+    }
+    // Listening already lets vrcompositor connect, and the compositor and the encoder be created on
+    // the encoder thread, while the other devices are registered and activated
+    m_encoder = std::make_shared<CEncoder>(m_poseHistory);
+    m_encoder->Start();
+#endif
+}
+
 void Hmd::StartStreaming() {
     Debug("Hmd::StartStreaming");
+    StreamStart::Mark(StreamStart::STREAMING_START);
 
     vr::VRDriverInput()->UpdateBooleanComponent(m_proximity, true, 0.0);
 
+    // Before the encoder starts, so that its frames all go through the queue
+    VideoSendQueue::Instance().Start();
+
+    // The encoder and the renderer stay up while the driver runs, the settings that would change
+    // them restart SteamVR. A reconnecting client only needs the encoder state of a new stream
     if (m_streamComponentsInitialized) {
+        if (m_encoder) {
+            Info("Reusing the encoder for the new stream\n");
+            m_encoder->OnStreamStart();
+        }
         return;
     }
 
     // Spin up a separate thread to handle the overlapped encoding/transmit step.
     if (this->device_class == vr::TrackedDeviceClass_HMD) {
 #ifdef _WIN32
-        m_encoder = std::make_shared<CEncoder>();
+        if (!m_encoderInitialization.valid()) {
+            PrepareStreaming();
+        }
         try {
-            m_encoder->Initialize(m_D3DRender);
+            m_encoderInitialization.get();
         } catch (Exception e) {
             Error(
                 "Your GPU does not meet the requirements for video encoding. %s %s\n%s %s\n",
@@ -247,13 +320,14 @@ void Hmd::StartStreaming() {
         }
         m_encoder->Start();
 
-        m_directModeComponent->SetEncoder(m_encoder);
+        if (m_directModeComponent) {
+            m_directModeComponent->SetEncoder(m_encoder);
+        }
 
 #elif __APPLE__
         m_encoder = std::make_shared<CEncoder>();
 #else
-        m_encoder = std::make_shared<CEncoder>(m_poseHistory);
-        m_encoder->Start();
+        PrepareStreaming();
 #endif
         m_encoder->OnStreamStart();
     }
@@ -1,9 +1,12 @@
 #pragma once
 
 #include "ALVR-common/packet_types.h"
+#include "PoseFilter.h"
 #include "TrackedDevice.h"
 #include "openvr_driver_wrap.h"
+#include <future>
 #include <memory>
+#include <optional>
 #ifdef _WIN32
 #include "platform/win32/OvrDirectModeComponent.h"
 #endif
@@ -26,6 +29,10 @@ public:
     Hmd();
     virtual ~Hmd();
     void OnPoseUpdated(uint64_t targetTimestampNs, FfiDeviceMotion motion);
+    // Starts creating what the stream needs on a worker thread, so that it overlaps with the
+    // registration of the other devices. On Windows it waits for the HMD activation, and
+    // StartStreaming waits for it. On Linux the encoder thread starts listening for vrcompositor
+    void PrepareStreaming();
     void StartStreaming();
     void StopStreaming();
     void SetViewParams(const FfiViewParams params[2]);
@@ -48,6 +55,8 @@ private:
 
 #ifdef _WIN32
     std::shared_ptr<CD3DRender> m_D3DRender;
+    // Initialization of m_encoder, throws what CEncoder::Initialize threw
+    std::future<void> m_encoderInitialization;
 #endif
 
 #ifdef _WIN32
@@ -56,6 +65,8 @@ private:
 
     std::shared_ptr<ViveTrackerProxy> m_viveTrackerProxy;
 
+    std::optional<PoseFilter> m_poseFilter;
+
 #ifndef _WIN32
     bool m_refreshRateSet = false;
 #endif
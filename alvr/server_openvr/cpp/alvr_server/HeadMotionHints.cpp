@@ -0,0 +1,173 @@
+#include "HeadMotionHints.h"
+#include "Settings.h"
+#include "Utils.h"
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+namespace {
+// Samples of the compression lookup, over the UV of the eye
+const int COMPRESS_SAMPLES = 1024;
+
+std::mutex g_viewsMutex;
+FfiViewParams g_views[2];
+// 0 until the views are known
+uint32_t g_viewsVersion = 0;
+
+// a * b for the rotation part of the matrices
+vr::HmdMatrix34_t Mul33(const vr::HmdMatrix34_t& a, const vr::HmdMatrix34_t& b) {
+    vr::HmdMatrix34_t result = {};
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            for (int k = 0; k < 3; k++) {
+                result.m[i][j] += a.m[i][k] * b.m[k][j];
+            }
+        }
+    }
+    return result;
+}
+
+vr::HmdMatrix34_t Transpose33(const vr::HmdMatrix34_t& a) {
+    vr::HmdMatrix34_t result = {};
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            result.m[i][j] = a.m[j][i];
+        }
+    }
+    return result;
+}
+
+std::vector<float> SampleCompress(const FoveatedAxis& axis) {
+    std::vector<float> samples(COMPRESS_SAMPLES + 1);
+    for (int i = 0; i <= COMPRESS_SAMPLES; i++) {
+        samples[i] = axis.Compress((float)i / COMPRESS_SAMPLES);
+    }
+    return samples;
+}
+
+// Linear interpolation of the samples, clamped to the eye
+float Lookup(const std::vector<float>& samples, float x) {
+    float position = std::clamp(x, 0.f, 1.f) * COMPRESS_SAMPLES;
+    int index = std::min((int)position, COMPRESS_SAMPLES - 1);
+    float t = position - index;
+    return samples[index] * (1.f - t) + samples[index + 1] * t;
+}
+}
+
+bool HeadMotionHints::IsEnabled() {
+    // The hints are moved to the encoded frame per axis, which the radial foveation isn't
+    return Settings::Instance().m_nvencHeadMotionHints
+        && !Settings::Instance().m_enableRadialFoveation;
+}
+
+void HeadMotionHints::SetViews(const FfiViewParams views[2]) {
+    std::lock_guard<std::mutex> lock(g_viewsMutex);
+    g_views[0] = views[0];
+    g_views[1] = views[1];
+    g_viewsVersion++;
+}
+
+HeadMotionHints::HeadMotionHints(uint32_t frameWidth, uint32_t frameHeight, uint32_t blockSize)
+    : m_frameWidth(frameWidth)
+    , m_frameHeight(frameHeight)
+    , m_blockSize(blockSize)
+    , m_blocksX((frameWidth + blockSize - 1) / blockSize)
+    , m_blocksY((frameHeight + blockSize - 1) / blockSize)
+    , m_axisX(FoveatedAxis::X())
+    , m_axisY(FoveatedAxis::Y())
+    , m_compressX(SampleCompress(m_axisX))
+    , m_compressY(SampleCompress(m_axisY)) { }
+
+float HeadMotionHints::CompressX(float u, int eye) const {
+    // The foveation shift is mirrored for the right eye
+    if (eye == 1) {
+        return 1.f - Lookup(m_compressX, 1.f - u);
+    }
+    return Lookup(m_compressX, u);
+}
+
+float HeadMotionHints::CompressY(float v) const { return Lookup(m_compressY, v); }
+
+void HeadMotionHints::SetupViews(const FfiViewParams views[2]) {
+    for (int eye = 0; eye < 2; eye++) {
+        m_tangents[eye][0] = tanf(views[eye].fov.left);
+        m_tangents[eye][1] = tanf(views[eye].fov.right);
+        m_tangents[eye][2] = tanf(views[eye].fov.up);
+        m_tangents[eye][3] = tanf(views[eye].fov.down);
+        m_eyeToHead[eye] = pose_to_mat(views[eye].pose);
+    }
+
+    uint32_t eyeWidth = m_frameWidth / 2;
+    m_directions.resize(m_blocksX * m_blocksY);
+    for (uint32_t y = 0; y < m_blocksY; y++) {
+        float centerY = std::min((y + .5f) * m_blockSize, (float)m_frameHeight);
+        float v = m_axisY.Decompress(centerY / m_frameHeight);
+        for (uint32_t x = 0; x < m_blocksX; x++) {
+            float centerX = std::min((x + .5f) * m_blockSize, (float)m_frameWidth);
+            int eye = centerX < eyeWidth ? 0 : 1;
+            float u = (centerX - eye * eyeWidth) / eyeWidth;
+            u = eye == 1 ? 1.f - m_axisX.Decompress(1.f - u) : m_axisX.Decompress(u);
+
+            const float* t = m_tangents[eye];
+            m_directions[y * m_blocksX + x]
+                = { t[0] + u * (t[1] - t[0]), t[2] + v * (t[3] - t[2]) };
+        }
+    }
+}
+
+bool HeadMotionHints::Build(
+    const vr::HmdMatrix34_t& previous,
+    const vr::HmdMatrix34_t& current,
+    std::vector<Vector>& vectors
+) {
+    {
+        std::lock_guard<std::mutex> lock(g_viewsMutex);
+        if (g_viewsVersion == 0) {
+            return false;
+        }
+        if (g_viewsVersion != m_viewsVersion) {
+            m_viewsVersion = g_viewsVersion;
+            SetupViews(g_views);
+        }
+    }
+
+    // Per eye, from the eye of the current frame to the eye of the previous one
+    vr::HmdMatrix34_t headDelta = Mul33(Transpose33(previous), current);
+    vr::HmdMatrix34_t eyeDelta[2];
+    for (int eye = 0; eye < 2; eye++) {
+        eyeDelta[eye]
+            = Mul33(Transpose33(m_eyeToHead[eye]), Mul33(headDelta, m_eyeToHead[eye]));
+    }
+
+    uint32_t eyeWidth = m_frameWidth / 2;
+    vectors.resize(m_blocksX * m_blocksY);
+    for (uint32_t y = 0; y < m_blocksY; y++) {
+        float centerY = std::min((y + .5f) * m_blockSize, (float)m_frameHeight);
+        for (uint32_t x = 0; x < m_blocksX; x++) {
+            float centerX = std::min((x + .5f) * m_blockSize, (float)m_frameWidth);
+            int eye = centerX < eyeWidth ? 0 : 1;
+            const auto& r = eyeDelta[eye].m;
+            const auto& d = m_directions[y * m_blocksX + x].v;
+
+            float px = r[0][0] * d[0] + r[0][1] * d[1] - r[0][2];
+            float py = r[1][0] * d[0] + r[1][1] * d[1] - r[1][2];
+            float pz = r[2][0] * d[0] + r[2][1] * d[1] - r[2][2];
+            Vector& vector = vectors[y * m_blocksX + x];
+            if (pz > -.1f) {
+                // Was behind or at the side of the previous view, nothing to match against
+                vector = {};
+                continue;
+            }
+
+            const float* t = m_tangents[eye];
+            float u = (px / -pz - t[0]) / (t[1] - t[0]);
+            float v = (py / -pz - t[2]) / (t[3] - t[2]);
+            float previousX = eye * eyeWidth + CompressX(u, eye) * eyeWidth;
+            float previousY = CompressY(v) * m_frameHeight;
+            vector = { (int32_t)std::lround(previousX - centerX),
+                       (int32_t)std::lround(previousY - centerY) };
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "FoveatedAxis.h"
+#include "bindings.h"
+#include "openvr_driver_wrap.h"
+
+#include <cstdint>
+#include <vector>
+
+// Motion of the frame content caused by the rotation of the head between two frames, given to the
+// encoders as motion estimation hints so that fast head turns are found without a wide search.
+// The translation of the head and the motion within the scene are left to the encoder's search.
+class HeadMotionHints {
+public:
+    struct Vector {
+        int32_t x;
+        int32_t y;
+    };
+
+    static bool IsEnabled();
+    // The views of the headset, shared by all the encoders
+    static void SetViews(const FfiViewParams views[2]);
+
+    HeadMotionHints(uint32_t frameWidth, uint32_t frameHeight, uint32_t blockSize);
+
+    // One vector per block in raster order, the last row and column covering the rest of the frame.
+    // Each goes from the block in the current frame to where its content was in the previous one,
+    // in pixels. The rotations are the head orientations the frames were rendered with. False
+    // before the views are known.
+    bool Build(
+        const vr::HmdMatrix34_t& previous,
+        const vr::HmdMatrix34_t& current,
+        std::vector<Vector>& vectors
+    );
+
+private:
+    // Recomputes what only depends on the views
+    void SetupViews(const FfiViewParams views[2]);
+    // From the rendered eye to the encoded eye, through the foveated compression
+    float CompressX(float u, int eye) const;
+    float CompressY(float v) const;
+
+    uint32_t m_frameWidth;
+    uint32_t m_frameHeight;
+    uint32_t m_blockSize;
+    uint32_t m_blocksX;
+    uint32_t m_blocksY;
+    FoveatedAxis m_axisX;
+    FoveatedAxis m_axisY;
+    // Sampled FoveatedAxis::Compress, the bisection is too slow for every block of every frame
+    std::vector<float> m_compressX;
+    std::vector<float> m_compressY;
+
+    uint32_t m_viewsVersion = 0;
+    // Per eye, tangents of the left, right, up and down edges
+    float m_tangents[2][4];
+    // Per eye, rotation from the eye to the head
+    vr::HmdMatrix34_t m_eyeToHead[2];
+    // Direction in eye space of the center of each block, at z = -1
+    std::vector<vr::HmdVector2_t> m_directions;
+};
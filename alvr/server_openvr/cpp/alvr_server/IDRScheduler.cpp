@@ -1,6 +1,10 @@
 #include "IDRScheduler.h"
 
+#include "DriverCounters.h"
+#include "FlightRecorder.h"
+#include "Logger.h"
 #include "Utils.h"
+#include <algorithm>
 #include <mutex>
 
 IDRScheduler::IDRScheduler() { }
@@ -9,7 +13,11 @@ IDRScheduler::~IDRScheduler() { }
 
 void IDRScheduler::OnStreamStart() {
     m_minIDRFrameInterval = Settings::Instance().m_minimumIdrIntervalMs * 1000;
-    m_scheduled = false;
+    {
+        std::unique_lock lock(m_mutex);
+        m_scheduled = false;
+        m_lossReported = false;
+    }
     InsertIDR();
 }
 
@@ -18,16 +26,121 @@ void IDRScheduler::InsertIDR() {
 
     m_insertIDRTime = GetTimestampUs() - MIN_IDR_FRAME_INTERVAL * 2;
     m_scheduled = true;
+    m_pending = true;
 }
 
-bool IDRScheduler::CheckIDRInsertion() {
+void IDRScheduler::OnFramesLost(uint64_t lastReceivedTimestampNs) {
+    FlightRecorder::Instance().Record(FlightRecorder::EVENT_FRAMES_LOST, lastReceivedTimestampNs);
+
+    if (!Settings::Instance().m_referenceFrameInvalidation) {
+        InsertIDR();
+        return;
+    }
+
     std::unique_lock lock(m_mutex);
 
-    if (m_scheduled) {
-        if (m_insertIDRTime <= GetTimestampUs()) {
+    // Reports that arrive before the encoder handles them are covered by the oldest one
+    if (!m_lossReported || lastReceivedTimestampNs < m_lastReceivedTimestampNs) {
+        m_lastReceivedTimestampNs = lastReceivedTimestampNs;
+    }
+    m_lossReported = true;
+    m_pending = true;
+}
+
+bool IDRScheduler::CheckIDRInsertion(
+    uint64_t targetTimestampNs, const ReferenceInvalidator& invalidate
+) {
+    bool insertIDR = false;
+    bool lossReported = false;
+    uint64_t lastReceivedTimestampNs = 0;
+    if (m_pending.load(std::memory_order_acquire)) {
+        std::unique_lock lock(m_mutex);
+
+        if (m_scheduled && m_insertIDRTime <= GetTimestampUs()) {
             m_scheduled = false;
-            return true;
+            insertIDR = true;
+        }
+        lossReported = m_lossReported;
+        lastReceivedTimestampNs = m_lastReceivedTimestampNs;
+        m_lossReported = false;
+        m_pending = m_scheduled;
+    }
+
+    // An IDR also repairs the loss. The encoder is called without the lock, so that loss reports
+    // don't wait for it
+    if (lossReported && !insertIDR && !Recover(lastReceivedTimestampNs, invalidate)) {
+        insertIDR = true;
+    }
+
+    if (insertIDR) {
+        DriverCounters::Add(DRIVER_COUNTER_IDRS_INSERTED);
+        FlightRecorder::Instance().Record(FlightRecorder::EVENT_IDR, targetTimestampNs);
+        m_history.clear();
+        m_historyTruncated = false;
+    }
+    m_history.push_back({ targetTimestampNs, true });
+    if (m_history.size() > MAX_REFERENCE_HISTORY) {
+        m_history.pop_front();
+        m_historyTruncated = true;
+    }
+
+    return insertIDR;
+}
+
+bool IDRScheduler::Recover(
+    uint64_t lastReceivedTimestampNs, const ReferenceInvalidator& invalidate
+) {
+    if (!invalidate) {
+        return false;
+    }
+
+    // The last received frame may itself reference a frame lost earlier, the reference is the
+    // newest one that doesn't
+    auto reference = std::find_if(
+        m_history.rbegin(),
+        m_history.rend(),
+        [&](const EncodedFrame& frame) {
+            return frame.valid && frame.timestampNs <= lastReceivedTimestampNs;
+        }
+    );
+    uint64_t referenceTimestampNs;
+    if (reference != m_history.rend()) {
+        referenceTimestampNs = reference->timestampNs;
+    } else if (m_historyTruncated && lastReceivedTimestampNs != 0) {
+        // The client received a frame older than the history, encoders that kept a long term
+        // reference from before it recover from that instead of an IDR
+        referenceTimestampNs = lastReceivedTimestampNs;
+    } else {
+        return false;
+    }
+
+    std::vector<uint64_t> lostTimestampsNs;
+    for (auto& frame : m_history) {
+        if (frame.valid && frame.timestampNs > lastReceivedTimestampNs) {
+            lostTimestampsNs.push_back(frame.timestampNs);
+        }
+    }
+    if (lostTimestampsNs.empty()) {
+        // Already repaired for an earlier report
+        return true;
+    }
+
+    if (!invalidate(lostTimestampsNs, referenceTimestampNs)) {
+        return false;
+    }
+    FlightRecorder::Instance().Record(
+        FlightRecorder::EVENT_REFERENCES_INVALIDATED, lostTimestampsNs.front(), referenceTimestampNs
+    );
+    Debug(
+        "IDRScheduler: invalidated %d lost frames, referencing %llu\n",
+        (int)lostTimestampsNs.size(),
+        referenceTimestampNs
+    );
+
+    for (auto& frame : m_history) {
+        if (frame.timestampNs > lastReceivedTimestampNs) {
+            frame.valid = false;
         }
     }
-    return false;
+    return true;
 }
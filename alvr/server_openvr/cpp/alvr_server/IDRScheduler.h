@@ -1,23 +1,60 @@
 #pragma once
 
 #include "Settings.h"
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <mutex>
 #include <stdint.h>
+#include <vector>
 
+// Requests and loss reports arrive on other threads and only raise a flag, the encoder thread
+// handles them when it checks the next frame, so the common case doesn't take the mutex.
 class IDRScheduler {
 public:
+    // Makes the encoder stop referencing the lost frames, so that the next frame only references
+    // referenceTimestampNs or older ones. Returns false if the encoder can't, an IDR is inserted
+    // instead. The reference may be older than all the frames still tracked, only a long term
+    // reference the encoder kept can then be used.
+    typedef std::function<
+        bool(const std::vector<uint64_t>& lostTimestampsNs, uint64_t referenceTimestampNs)>
+        ReferenceInvalidator;
+
     IDRScheduler();
     ~IDRScheduler();
 
     void OnStreamStart();
     void InsertIDR();
+    // The client didn't receive all the frames after lastReceivedTimestampNs
+    void OnFramesLost(uint64_t lastReceivedTimestampNs);
 
-    bool CheckIDRInsertion();
+    // Called once per frame before it's encoded. Encoders without reference invalidation pass no
+    // invalidator, losses are then repaired with an IDR.
+    bool
+    CheckIDRInsertion(uint64_t targetTimestampNs, const ReferenceInvalidator& invalidate = nullptr);
 
 private:
+    struct EncodedFrame {
+        uint64_t timestampNs;
+        // False once invalidated, the frame then isn't used as reference anymore
+        bool valid;
+    };
+    // Frames older than this are assumed to be no longer available as references
+    static const size_t MAX_REFERENCE_HISTORY = 16;
+
+    bool Recover(uint64_t lastReceivedTimestampNs, const ReferenceInvalidator& invalidate);
+
     static const int MIN_IDR_FRAME_INTERVAL = 100 * 1000; // 100-milliseconds
     uint64_t m_insertIDRTime = 0;
     bool m_scheduled = false;
+    bool m_lossReported = false;
+    uint64_t m_lastReceivedTimestampNs = 0;
+    std::atomic<bool> m_pending = false;
     std::mutex m_mutex;
     uint64_t m_minIDRFrameInterval = MIN_IDR_FRAME_INTERVAL;
+
+    // Frames since the last IDR, only accessed by the encoder thread
+    std::deque<EncodedFrame> m_history;
+    // Older frames since the last IDR were dropped from m_history
+    bool m_historyTruncated = false;
 };
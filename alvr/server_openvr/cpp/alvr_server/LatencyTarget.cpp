@@ -0,0 +1,33 @@
+#include "LatencyTarget.h"
+
+#include "Logger.h"
+#include "Settings.h"
+#include "bindings.h"
+#include <atomic>
+
+namespace {
+std::atomic<bool> g_exceeded = false;
+}
+
+bool LatencyTarget::Exceeded() {
+    uint64_t targetNs = Settings::Instance().m_encoderTargetLatencyMs * 1000000ull;
+    if (targetNs == 0) {
+        return false;
+    }
+
+    // Only back under a bit below the target, so that a latency around it doesn't flip every frame
+    FfiClientPipelineTiming timing = GetClientPipelineTiming();
+    bool wasExceeded = g_exceeded.load(std::memory_order_relaxed);
+    bool exceeded = timing.totalLatencyNs > (wasExceeded ? targetNs * 9 / 10 : targetNs);
+    if (exceeded != wasExceeded) {
+        g_exceeded = exceeded;
+        Info(
+            "LatencyTarget: %s the target at %.1f ms (network %.1f ms, client %.1f ms)\n",
+            exceeded ? "above" : "back under",
+            timing.totalLatencyNs / 1e6,
+            timing.networkLatencyNs / 1e6,
+            timing.clientLatencyNs / 1e6
+        );
+    }
+    return exceeded;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+// Compares the motion-to-photon latency reported by the client with the target of the settings,
+// for the encoders to favor latency over smoothness while it is exceeded.
+class LatencyTarget {
+public:
+    // False without a target or before the client reported any frame
+    static bool Exceeded();
+};
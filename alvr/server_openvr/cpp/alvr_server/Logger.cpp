@@ -1,17 +1,177 @@
 #include "Logger.h"
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdarg>
+#include <cstdint>
+#include <mutex>
+#include <thread>
 
 #include "bindings.h"
 #include "driverlog.h"
 
-void _log(const char* format, va_list args, void (*logFn)(const char*), bool driverLog = false) {
-    char buf[1024];
+namespace {
+void FormatLog(char (&buf)[1024], const char* format, va_list args) {
     int count = vsnprintf(buf, sizeof(buf), format, args);
     if (count > (int)sizeof(buf))
         count = (int)sizeof(buf);
     if (count > 0 && buf[count - 1] == '\n')
         buf[count - 1] = '\0';
+}
+
+// Info and Debug messages are formatted in place into a slot of a bounded lock-free queue, and a
+// background thread hands them to the Rust logger. The logging thread then never waits on the
+// logger locks or on its output. When the queue is full, or after ShutdownLogger(), messages are
+// logged synchronously instead of being dropped.
+// Errors and warnings are always synchronous, they must not be lost if the driver goes down.
+class LogQueue {
+public:
+    enum Level : uint8_t {
+        LEVEL_INFO,
+        LEVEL_DEBUG,
+    };
+
+    LogQueue() {
+        for (size_t i = 0; i < SIZE; i++) {
+            m_slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Also stops the thread if ShutdownLogger() was never called, as in the benchmark binaries
+    ~LogQueue() { Shutdown(); }
+
+    bool TryPush(Level level, const char* format, va_list args) {
+        if (m_state.load(std::memory_order_relaxed) == STATE_STOPPED) {
+            return false;
+        }
+
+        // Multi producer slot reservation, each slot sequence tells whether it is free for the
+        // position being written
+        size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &m_slots[pos % SIZE];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0) {
+                if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        FormatLog(slot->text, format, args);
+        slot->level = level;
+        slot->sequence.store(pos + 1, std::memory_order_release);
+
+        // Pairs with the fence in Run(): either the thread sees this message before it waits, or
+        // it is seen waiting here. The mutex is only taken when it actually sleeps
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_waiting.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(m_wakeMutex);
+            m_wake.notify_one();
+        }
+
+        // Under the lock so that Shutdown() can't run between the state change and the thread
+        // being assigned, and miss the thread to join
+        if (m_state.load(std::memory_order_relaxed) == STATE_IDLE) {
+            std::lock_guard<std::mutex> lock(m_threadMutex);
+            if (m_state.load(std::memory_order_relaxed) == STATE_IDLE) {
+                m_state.store(STATE_RUNNING);
+                m_thread = std::thread([this] { Run(); });
+            }
+        }
+
+        return true;
+    }
+
+    void Shutdown() {
+        std::thread thread;
+        {
+            std::lock_guard<std::mutex> lock(m_threadMutex);
+            m_state.store(STATE_STOPPED);
+            thread = std::move(m_thread);
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_wakeMutex);
+            m_wake.notify_one();
+        }
+        if (thread.joinable()) {
+            thread.join();
+        }
+        Drain();
+    }
+
+private:
+    static const size_t SIZE = 128;
+
+    enum State : int {
+        STATE_IDLE,
+        STATE_RUNNING,
+        STATE_STOPPED,
+    };
+
+    struct Slot {
+        std::atomic<size_t> sequence;
+        Level level;
+        char text[1024];
+    };
+
+    void Run() {
+        std::unique_lock<std::mutex> lock(m_wakeMutex);
+        while (m_state.load(std::memory_order_relaxed) == STATE_RUNNING) {
+            lock.unlock();
+            Drain();
+            lock.lock();
+
+            m_waiting.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!HasPending() && m_state.load(std::memory_order_relaxed) == STATE_RUNNING) {
+                m_wake.wait(lock);
+            }
+            m_waiting.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    bool HasPending() {
+        return m_slots[m_dequeuePos % SIZE].sequence.load(std::memory_order_acquire)
+            == m_dequeuePos + 1;
+    }
+
+    // Only called from one thread at a time
+    void Drain() {
+        while (HasPending()) {
+            Slot& slot = m_slots[m_dequeuePos % SIZE];
+
+            (slot.level == LEVEL_INFO ? LogInfo : LogDebug)(slot.text);
+
+            slot.sequence.store(m_dequeuePos + SIZE, std::memory_order_release);
+            m_dequeuePos++;
+        }
+    }
+
+    Slot m_slots[SIZE];
+    std::atomic<size_t> m_enqueuePos { 0 };
+    size_t m_dequeuePos = 0;
+    std::atomic<int> m_state { STATE_IDLE };
+    std::mutex m_threadMutex;
+    std::thread m_thread;
+    // The thread sleeps on m_wake while the queue is empty
+    std::mutex m_wakeMutex;
+    std::condition_variable m_wake;
+    std::atomic<bool> m_waiting { false };
+};
+
+LogQueue g_logQueue;
+}
+
+void _log(const char* format, va_list args, void (*logFn)(const char*), bool driverLog = false) {
+    char buf[1024];
+    FormatLog(buf, format, args);
 
     logFn(buf);
 
@@ -19,6 +179,18 @@ void _log(const char* format, va_list args, void (*logFn)(const char*), bool dri
         DriverLog(buf);
 }
 
+// va_list can only be walked once, the synchronous fallback needs its own copy
+void _logDeferred(LogQueue::Level level, const char* format, va_list args) {
+    va_list argsCopy;
+    va_copy(argsCopy, args);
+    if (!g_logQueue.TryPush(level, format, argsCopy)) {
+        _log(format, args, level == LogQueue::LEVEL_INFO ? LogInfo : LogDebug);
+    }
+    va_end(argsCopy);
+}
+
+void ShutdownLogger() { g_logQueue.Shutdown(); }
+
 Exception MakeException(const char* format, ...) {
     va_list args;
     va_start(args, format);
@@ -46,7 +218,7 @@ void Info(const char* format, ...) {
     va_list args;
     va_start(args, format);
     // Don't log to SteamVR/writing to file for info level, this is mostly statistics info
-    _log(format, args, LogInfo);
+    _logDeferred(LogQueue::LEVEL_INFO, format, args);
     va_end(args);
 }
 
@@ -54,7 +226,7 @@ void Debug(const char* format, ...) {
 #ifdef ALVR_DEBUG_LOG
     va_list args;
     va_start(args, format);
-    _log(format, args, LogDebug);
+    _logDeferred(LogQueue::LEVEL_DEBUG, format, args);
     va_end(args);
 #else
     (void)format;
@@ -66,11 +238,7 @@ void LogPeriod(const char* tag, const char* format, ...) {
     va_start(args, format);
 
     char buf[1024];
-    int count = vsnprintf(buf, sizeof(buf), format, args);
-    if (count > (int)sizeof(buf))
-        count = (int)sizeof(buf);
-    if (count > 0 && buf[count - 1] == '\n')
-        buf[count - 1] = '\0';
+    FormatLog(buf, format, args);
 
     LogPeriodically(tag, buf);
 
@@ -9,3 +9,5 @@ void Warn(const char* format, ...);
 void Info(const char* format, ...);
 void Debug(const char* format, ...);
 void LogPeriod(const char* tag, const char* format, ...);
+// Hand the queued Info/Debug messages to the logger and log synchronously from then on
+void ShutdownLogger();
@@ -0,0 +1,481 @@
+#include "LowLatencyHeaders.h"
+
+#include "ALVR-common/packet_types.h"
+#include "NalParsing.h"
+#include <stddef.h>
+#include <stdint.h>
+
+static const unsigned char H264_NAL_TYPE_SPS = 7;
+static const unsigned char HEVC_NAL_TYPE_VPS = 32;
+static const unsigned char HEVC_NAL_TYPE_SPS = 33;
+
+static const uint32_t SEI_PAYLOAD_RECOVERY_POINT = 6;
+
+// Removes the emulation prevention bytes, 00 00 03 becomes 00 00
+static void unescape(const unsigned char* buf, int len, std::vector<unsigned char>& rbsp) {
+    rbsp.clear();
+    int zeros = 0;
+    for (int i = 0; i < len; i++) {
+        if (zeros >= 2 && buf[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        zeros = buf[i] == 0 ? zeros + 1 : 0;
+        rbsp.push_back(buf[i]);
+    }
+}
+
+static void escape(const std::vector<unsigned char>& rbsp, std::vector<unsigned char>& out) {
+    int zeros = 0;
+    for (unsigned char byte : rbsp) {
+        if (zeros >= 2 && byte <= 3) {
+            out.push_back(3);
+            zeros = 0;
+        }
+        zeros = byte == 0 ? zeros + 1 : 0;
+        out.push_back(byte);
+    }
+}
+
+namespace {
+class BitReader {
+public:
+    explicit BitReader(const std::vector<unsigned char>& data)
+        : m_data(data) { }
+
+    uint32_t Read(int bits) {
+        uint32_t value = 0;
+        for (int i = 0; i < bits; i++) {
+            if (m_pos >= m_data.size() * 8) {
+                m_ok = false;
+                return 0;
+            }
+            value = (value << 1) | ((m_data[m_pos / 8] >> (7 - m_pos % 8)) & 1);
+            m_pos++;
+        }
+        return value;
+    }
+
+    uint32_t ReadUe() {
+        int zeros = 0;
+        while (Read(1) == 0 && m_ok) {
+            if (++zeros > 31) {
+                m_ok = false;
+                return 0;
+            }
+        }
+        return (uint32_t)((1ull << zeros) - 1 + Read(zeros));
+    }
+
+    size_t Position() const { return m_pos; }
+    bool Ok() const { return m_ok; }
+
+    // Position of the rbsp_stop_one_bit, the last bit set
+    size_t StopBit() const {
+        for (size_t byte = m_data.size(); byte > 0; byte--) {
+            unsigned char value = m_data[byte - 1];
+            for (int bit = 0; value != 0 && bit < 8; bit++) {
+                if ((value >> bit) & 1) {
+                    return byte * 8 - 1 - bit;
+                }
+            }
+        }
+        return 0;
+    }
+
+private:
+    const std::vector<unsigned char>& m_data;
+    size_t m_pos = 0;
+    bool m_ok = true;
+};
+
+class BitWriter {
+public:
+    void Write(uint32_t value, int bits) {
+        for (int i = bits - 1; i >= 0; i--) {
+            if (m_bits % 8 == 0) {
+                m_data.push_back(0);
+            }
+            m_data.back() |= ((value >> i) & 1) << (7 - m_bits % 8);
+            m_bits++;
+        }
+    }
+
+    // Up to 2^32 - 2, the largest value ReadUe() returns
+    void WriteUe(uint32_t value) {
+        uint32_t coded = value + 1;
+        int length = 0;
+        while ((coded >> length) > 1) {
+            length++;
+        }
+        Write(0, length);
+        Write(coded, length + 1);
+    }
+
+    // rbsp_trailing_bits
+    void Finish() {
+        Write(1, 1);
+        while (m_bits % 8 != 0) {
+            Write(0, 1);
+        }
+    }
+
+    const std::vector<unsigned char>& Data() const { return m_data; }
+
+private:
+    std::vector<unsigned char> m_data;
+    size_t m_bits = 0;
+};
+
+// Reads the parameter set and writes it again, changing only what the copy skips
+class Rewriter {
+public:
+    explicit Rewriter(const std::vector<unsigned char>& rbsp)
+        : in(rbsp) { }
+
+    uint32_t Copy(int bits) {
+        uint32_t value = in.Read(bits);
+        out.Write(value, bits);
+        return value;
+    }
+
+    uint32_t CopyUe() {
+        uint32_t value = in.ReadUe();
+        out.WriteUe(value);
+        return value;
+    }
+
+    // Signed Exp-Golomb has the same code length, only the mapping differs
+    int32_t CopySe() {
+        uint32_t value = CopyUe();
+        return value & 1 ? (int32_t)((value + 1) / 2) : -(int32_t)(value / 2);
+    }
+
+    // Up to the rbsp_stop_one_bit, then the trailing bits again for the new alignment
+    bool Finish() {
+        size_t stop = in.StopBit();
+        if (!in.Ok() || stop < in.Position()) {
+            return false;
+        }
+        while (in.Position() < stop) {
+            Copy(1);
+        }
+        out.Finish();
+        return in.Ok();
+    }
+
+    BitReader in;
+    BitWriter out;
+};
+}
+
+static void copyH264ScalingList(Rewriter& r, int size) {
+    int last = 8;
+    int next = 8;
+    for (int i = 0; i < size; i++) {
+        if (next != 0) {
+            next = (last + r.CopySe() + 256) % 256;
+        }
+        last = next == 0 ? last : next;
+    }
+}
+
+static bool copyH264Hrd(Rewriter& r) {
+    uint32_t cpbCount = r.CopyUe() + 1;
+    if (cpbCount > 32) {
+        return false;
+    }
+    // bit_rate_scale, cpb_size_scale
+    r.Copy(8);
+    for (uint32_t i = 0; i < cpbCount; i++) {
+        r.CopyUe();
+        r.CopyUe();
+        r.Copy(1);
+    }
+    // The lengths of the delay and time offset fields
+    r.Copy(20);
+    return true;
+}
+
+static bool rewriteH264Sps(Rewriter& r) {
+    uint32_t profile = r.Copy(8);
+    // Constraint flags and level_idc
+    r.Copy(16);
+    r.CopyUe();
+    if (profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44
+        || profile == 83 || profile == 86 || profile == 118 || profile == 128 || profile == 138
+        || profile == 139 || profile == 134 || profile == 135) {
+        uint32_t chromaFormat = r.CopyUe();
+        if (chromaFormat == 3) {
+            r.Copy(1);
+        }
+        r.CopyUe();
+        r.CopyUe();
+        r.Copy(1);
+        if (r.Copy(1)) {
+            int listCount = chromaFormat != 3 ? 8 : 12;
+            for (int i = 0; i < listCount; i++) {
+                if (r.Copy(1)) {
+                    copyH264ScalingList(r, i < 6 ? 16 : 64);
+                }
+            }
+        }
+    }
+    r.CopyUe();
+    uint32_t pocType = r.CopyUe();
+    if (pocType == 0) {
+        r.CopyUe();
+    } else if (pocType == 1) {
+        r.Copy(1);
+        r.CopySe();
+        r.CopySe();
+        uint32_t cycle = r.CopyUe();
+        if (cycle > 255) {
+            return false;
+        }
+        for (uint32_t i = 0; i < cycle; i++) {
+            r.CopySe();
+        }
+    }
+    uint32_t maxRefFrames = r.CopyUe();
+    r.Copy(1);
+    // Size in macroblocks
+    r.CopyUe();
+    r.CopyUe();
+    if (!r.Copy(1)) {
+        r.Copy(1);
+    }
+    r.Copy(1);
+    if (r.Copy(1)) {
+        for (int i = 0; i < 4; i++) {
+            r.CopyUe();
+        }
+    }
+
+    bool hasVui = r.in.Read(1);
+    r.out.Write(1, 1);
+    bool hasRestriction = false;
+    if (hasVui) {
+        // Aspect ratio, with the SAR when extended
+        if (r.Copy(1) && r.Copy(8) == 255) {
+            r.Copy(32);
+        }
+        if (r.Copy(1)) {
+            r.Copy(1);
+        }
+        // Video signal type and colour description
+        if (r.Copy(1)) {
+            r.Copy(4);
+            if (r.Copy(1)) {
+                r.Copy(24);
+            }
+        }
+        if (r.Copy(1)) {
+            r.CopyUe();
+            r.CopyUe();
+        }
+        if (r.Copy(1)) {
+            r.Copy(32);
+            r.Copy(32);
+            r.Copy(1);
+        }
+        bool nalHrd = r.Copy(1);
+        if (nalHrd && !copyH264Hrd(r)) {
+            return false;
+        }
+        bool vclHrd = r.Copy(1);
+        if (vclHrd && !copyH264Hrd(r)) {
+            return false;
+        }
+        if (nalHrd || vclHrd) {
+            r.Copy(1);
+        }
+        r.Copy(1);
+        hasRestriction = r.in.Read(1);
+    } else {
+        // Everything else absent, the decoders use their defaults
+        r.out.Write(0, 8);
+    }
+
+    r.out.Write(1, 1);
+    if (hasRestriction) {
+        r.Copy(1);
+        for (int i = 0; i < 4; i++) {
+            r.CopyUe();
+        }
+        r.in.ReadUe();
+        r.in.ReadUe();
+    } else {
+        // The values inferred when absent
+        r.out.Write(1, 1);
+        r.out.WriteUe(2);
+        r.out.WriteUe(1);
+        r.out.WriteUe(15);
+        r.out.WriteUe(15);
+    }
+    // max_num_reorder_frames, max_dec_frame_buffering
+    r.out.WriteUe(0);
+    r.out.WriteUe(maxRefFrames);
+
+    // Only the trailing bits are left after the VUI
+    while (r.in.Position() < r.in.StopBit()) {
+        r.in.Read(1);
+    }
+    return r.Finish();
+}
+
+static void copyHevcProfileTierLevel(Rewriter& r, uint32_t maxSubLayersMinus1) {
+    // General profile space, tier, idc, compatibility and constraint flags, level
+    r.Copy(32);
+    r.Copy(32);
+    r.Copy(32);
+
+    bool profilePresent[8] = {};
+    bool levelPresent[8] = {};
+    for (uint32_t i = 0; i < maxSubLayersMinus1; i++) {
+        profilePresent[i] = r.Copy(1);
+        levelPresent[i] = r.Copy(1);
+    }
+    if (maxSubLayersMinus1 > 0) {
+        for (uint32_t i = maxSubLayersMinus1; i < 8; i++) {
+            r.Copy(2);
+        }
+    }
+    for (uint32_t i = 0; i < maxSubLayersMinus1; i++) {
+        if (profilePresent[i]) {
+            r.Copy(32);
+            r.Copy(32);
+            r.Copy(24);
+        }
+        if (levelPresent[i]) {
+            r.Copy(8);
+        }
+    }
+}
+
+static void rewriteHevcOrderingInfo(Rewriter& r, uint32_t maxSubLayersMinus1) {
+    bool allSubLayers = r.Copy(1);
+    for (uint32_t i = allSubLayers ? 0 : maxSubLayersMinus1; i <= maxSubLayersMinus1; i++) {
+        r.CopyUe();
+        // max_num_reorder_pics, the latency increase can stay
+        r.in.ReadUe();
+        r.out.WriteUe(0);
+        r.CopyUe();
+    }
+}
+
+static bool rewriteHevcVps(Rewriter& r) {
+    // Id, base layer flags, max layers
+    r.Copy(12);
+    uint32_t maxSubLayersMinus1 = r.Copy(3);
+    r.Copy(17);
+    copyHevcProfileTierLevel(r, maxSubLayersMinus1);
+    rewriteHevcOrderingInfo(r, maxSubLayersMinus1);
+    return r.Finish();
+}
+
+static bool rewriteHevcSps(Rewriter& r) {
+    r.Copy(4);
+    uint32_t maxSubLayersMinus1 = r.Copy(3);
+    r.Copy(1);
+    copyHevcProfileTierLevel(r, maxSubLayersMinus1);
+    r.CopyUe();
+    if (r.CopyUe() == 3) {
+        r.Copy(1);
+    }
+    r.CopyUe();
+    r.CopyUe();
+    if (r.Copy(1)) {
+        for (int i = 0; i < 4; i++) {
+            r.CopyUe();
+        }
+    }
+    // Bit depths, log2_max_pic_order_cnt_lsb_minus4
+    r.CopyUe();
+    r.CopyUe();
+    r.CopyUe();
+    rewriteHevcOrderingInfo(r, maxSubLayersMinus1);
+    return r.Finish();
+}
+
+bool RewriteLowLatencyHeaders(
+    int codec, const unsigned char* buf, int len, std::vector<unsigned char>& out
+) {
+    bool hevc = codec == ALVR_CODEC_HEVC;
+    int headerSize = hevc ? 2 : 1;
+
+    thread_local std::vector<NalUnit> units;
+    thread_local std::vector<unsigned char> rbsp;
+    FindNalUnits(codec, buf, len, units);
+
+    out.clear();
+    out.insert(out.end(), buf, buf + (units.empty() ? len : units[0].offset));
+    for (auto& unit : units) {
+        const unsigned char* nal = buf + unit.offset;
+        int payload = unit.prefixSize + headerSize;
+        bool rewritten = hevc
+            ? unit.type == HEVC_NAL_TYPE_VPS || unit.type == HEVC_NAL_TYPE_SPS
+            : unit.type == H264_NAL_TYPE_SPS;
+        if (!rewritten || unit.size <= payload) {
+            out.insert(out.end(), nal, nal + unit.size);
+            continue;
+        }
+
+        unescape(nal + payload, unit.size - payload, rbsp);
+        Rewriter rewriter(rbsp);
+        bool ok;
+        if (!hevc) {
+            ok = rewriteH264Sps(rewriter);
+        } else if (unit.type == HEVC_NAL_TYPE_VPS) {
+            ok = rewriteHevcVps(rewriter);
+        } else {
+            ok = rewriteHevcSps(rewriter);
+        }
+        if (!ok) {
+            return false;
+        }
+        out.insert(out.end(), nal, nal + payload);
+        escape(rewriter.out.Data(), out);
+    }
+    return true;
+}
+
+bool HasRecoveryPointSei(int codec, const unsigned char* nal, int len) {
+    int payload = 3 + (codec == ALVR_CODEC_HEVC ? 2 : 1);
+    if (len > 3 && nal[2] == 0) {
+        // 4 bytes start code
+        payload++;
+    }
+    if (len <= payload) {
+        return false;
+    }
+
+    thread_local std::vector<unsigned char> rbsp;
+    unescape(nal + payload, len - payload, rbsp);
+    size_t pos = 0;
+    // Each message is its type and size, both coded as a run of 255 and a last byte
+    while (pos < rbsp.size() && rbsp[pos] != 0x80) {
+        uint32_t type = 0;
+        while (pos < rbsp.size() && rbsp[pos] == 0xFF) {
+            type += rbsp[pos++];
+        }
+        if (pos >= rbsp.size()) {
+            return false;
+        }
+        type += rbsp[pos++];
+        if (type == SEI_PAYLOAD_RECOVERY_POINT) {
+            return true;
+        }
+
+        size_t size = 0;
+        while (pos < rbsp.size() && rbsp[pos] == 0xFF) {
+            size += rbsp[pos++];
+        }
+        if (pos >= rbsp.size()) {
+            return false;
+        }
+        size += rbsp[pos++];
+        pos += size;
+    }
+    return false;
+}
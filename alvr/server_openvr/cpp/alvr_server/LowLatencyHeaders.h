@@ -0,0 +1,17 @@
+#pragma once
+
+#include <vector>
+
+// Rewrites the parameter sets of an H.264 or HEVC stream so that no frame is signaled as
+// reordered. Some decoders otherwise hold the decoded frames in their buffer, about a frame of
+// latency, when the encoder doesn't say. H.264 gets a VUI bitstream_restriction with
+// max_num_reorder_frames 0 and max_dec_frame_buffering set to max_num_ref_frames, HEVC gets
+// max_num_reorder_pics 0 in its VPS and SPS. The other NALs of buf, Annex-B with start codes, are
+// copied as they are. Returns false if a parameter set can't be parsed, out is then undefined.
+bool RewriteLowLatencyHeaders(
+    int codec, const unsigned char* buf, int len, std::vector<unsigned char>& out
+);
+
+// Whether an SEI NAL, with its start code, carries a recovery point. The decoders of the clients
+// need it to start from the frames of the gradual intra refresh, the other SEI messages can go
+bool HasRecoveryPointSei(int codec, const unsigned char* nal, int len);
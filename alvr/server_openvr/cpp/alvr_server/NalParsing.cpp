@@ -1,13 +1,32 @@
 
+#include "NalParsing.h"
+#include "DriverCounters.h"
+#include "EncoderWarmup.h"
+#include "FrameMetadata.h"
+#include "FrameTrace.h"
+#include "LowLatencyHeaders.h"
 #include "Logger.h"
 #include "Settings.h"
+#include "StartupProfiler.h"
+#include "TraceCapture.h"
 #include "Utils.h"
+#include "VideoSendQueue.h"
 #include "bindings.h"
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <mutex>
 #include <string.h>
 
-static const char NAL_PREFIX_3B[] = { 0x00, 0x00, 0x01 };
-static const char NAL_PREFIX_4B[] = { 0x00, 0x00, 0x00, 0x01 };
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 static const unsigned char H264_NAL_TYPE_SPS = 7;
 static const unsigned char HEVC_NAL_TYPE_VPS = 32;
@@ -15,104 +34,678 @@ static const unsigned char HEVC_NAL_TYPE_VPS = 32;
 static const unsigned char H264_NAL_TYPE_AUD = 9;
 static const unsigned char HEVC_NAL_TYPE_AUD = 35;
 
-int8_t getNalPrefixSize(unsigned char* buf) {
-    if (memcmp(buf, NAL_PREFIX_3B, sizeof(NAL_PREFIX_3B)) == 0) {
-        return sizeof(NAL_PREFIX_3B);
-    } else if (memcmp(buf, NAL_PREFIX_4B, sizeof(NAL_PREFIX_4B)) == 0) {
-        return sizeof(NAL_PREFIX_4B);
-    } else {
-        return -1;
+static const unsigned char H264_NAL_TYPE_SEI = 6;
+static const unsigned char HEVC_NAL_TYPE_PREFIX_SEI = 39;
+
+static const unsigned char H264_NAL_TYPE_FILLER = 12;
+static const unsigned char HEVC_NAL_TYPE_FILLER = 38;
+
+static const unsigned char H264_NAL_TYPE_PREFIX = 14;
+
+static const unsigned char H264_NAL_TYPE_SLICE = 1;
+static const unsigned char H264_NAL_TYPE_IDR_SLICE = 5;
+
+static const unsigned char AV1_OBU_TYPE_SEQUENCE_HEADER = 1;
+static const unsigned char AV1_OBU_TYPE_FRAME_HEADER = 3;
+static const unsigned char AV1_OBU_TYPE_TILE_GROUP = 4;
+static const unsigned char AV1_OBU_TYPE_FRAME = 6;
+
+static int countTrailingZeros(uint64_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return index;
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+// Returns the position of the next 00 00 01 sequence, or len if there is none
+static int findStartCode(const unsigned char* buf, int from, int len) {
+    int i = from;
+    // Compare 16 positions at once, each load is shifted by one byte for the 3 bytes of the code
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    for (; i + 18 <= len; i += 16) {
+        __m128i b0 = _mm_loadu_si128((const __m128i*)(buf + i));
+        __m128i b1 = _mm_loadu_si128((const __m128i*)(buf + i + 1));
+        __m128i b2 = _mm_loadu_si128((const __m128i*)(buf + i + 2));
+        __m128i match = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+            _mm_cmpeq_epi8(b2, one)
+        );
+        int mask = _mm_movemask_epi8(match);
+        if (mask != 0) {
+            return i + countTrailingZeros(mask);
+        }
     }
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    const uint8x16_t one = vdupq_n_u8(1);
+    for (; i + 18 <= len; i += 16) {
+        uint8x16_t b0 = vld1q_u8(buf + i);
+        uint8x16_t b1 = vld1q_u8(buf + i + 1);
+        uint8x16_t b2 = vld1q_u8(buf + i + 2);
+        uint8x16_t match = vandq_u8(vandq_u8(vceqzq_u8(b0), vceqzq_u8(b1)), vceqq_u8(b2, one));
+        // Narrow to 4 bits per byte, there is no movemask on NEON
+        uint64_t mask = vget_lane_u64(
+            vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(match), 4)), 0
+        );
+        if (mask != 0) {
+            return i + countTrailingZeros(mask) / 4;
+        }
+    }
+#endif
+    for (; i + 3 <= len; i++) {
+        if (buf[i] == 0 && buf[i + 1] == 0 && buf[i + 2] == 1) {
+            return i;
+        }
+    }
+    return len;
+}
+
+void FindNalUnits(
+    int codec, const unsigned char* buf, int len, std::vector<NalUnit>& units, int maxUnits
+) {
+    units.clear();
+
+    int pos = findStartCode(buf, 0, len);
+    while (pos < len) {
+        NalUnit unit = { pos, 3, 0, 0 };
+        if (pos > 0 && buf[pos - 1] == 0) {
+            unit.offset--;
+            unit.prefixSize = 4;
+        }
+
+        if (!units.empty()) {
+            units.back().size = unit.offset - units.back().offset;
+            if ((int)units.size() == maxUnits) {
+                return;
+            }
+        }
+
+        int header = pos + 3;
+        if (header >= len) {
+            break;
+        }
+        if (codec == ALVR_CODEC_HEVC) {
+            unit.type = (buf[header] >> 1) & 0x3F;
+        } else {
+            unit.type = buf[header] & 0x1F;
+        }
+        unit.size = len - unit.offset;
+        units.push_back(unit);
+
+        pos = findStartCode(buf, header, len);
+    }
+}
+
+void FindAv1Obus(const unsigned char* buf, int len, std::vector<Av1Obu>& obus) {
+    obus.clear();
+
+    int pos = 0;
+    while (pos < len) {
+        unsigned char header = buf[pos];
+        bool hasExtension = (header >> 2) & 1;
+        bool hasSizeField = (header >> 1) & 1;
+
+        int payload = pos + 1 + (hasExtension ? 1 : 0);
+        uint64_t payloadSize = 0;
+        if (hasSizeField) {
+            // leb128, at most 8 bytes
+            int i = 0;
+            for (; i < 8 && payload < len; i++) {
+                unsigned char byte = buf[payload++];
+                payloadSize |= uint64_t(byte & 0x7F) << (i * 7);
+                if (!(byte & 0x80)) {
+                    break;
+                }
+            }
+            if (i == 8) {
+                return;
+            }
+        } else {
+            payloadSize = len - std::min(payload, len);
+        }
+        if (payload > len || payloadSize > uint64_t(len - payload)) {
+            return;
+        }
+
+        int end = payload + (int)payloadSize;
+        obus.push_back({ pos, end - pos, (unsigned char)((header >> 3) & 0x0F) });
+        pos = end;
+    }
+}
+
+int FindTemporalId(int codec, const unsigned char* buf, int len) {
+    if (codec == ALVR_CODEC_AV1) {
+        thread_local std::vector<Av1Obu> obus;
+        FindAv1Obus(buf, len, obus);
+        for (auto& obu : obus) {
+            // temporal_id is the top 3 bits of the extension byte after the header
+            if ((buf[obu.offset] >> 2) & 1 && obu.size > 1) {
+                return buf[obu.offset + 1] >> 5;
+            }
+        }
+        return 0;
+    }
+
+    // The prefix or the first slice follows the parameter sets and SEI
+    thread_local std::vector<NalUnit> units;
+    FindNalUnits(codec, buf, len, units, 8);
+    for (auto& unit : units) {
+        int header = unit.offset + unit.prefixSize;
+        // The VCL NAL types of HEVC are the ones below the VPS
+        if (codec == ALVR_CODEC_HEVC && unit.type < HEVC_NAL_TYPE_VPS && header + 1 < len) {
+            // nuh_temporal_id_plus1 is the low 3 bits of the second header byte
+            return std::max((buf[header + 1] & 7) - 1, 0);
+        }
+        if (codec == ALVR_CODEC_H264 && unit.type == H264_NAL_TYPE_PREFIX && header + 3 < len) {
+            // temporal_id is the top 3 bits of the third byte of the SVC extension
+            return buf[header + 3] >> 5;
+        }
+    }
+    return 0;
 }
 
 /*
-Sends the (VPS + )SPS + PPS video configuration headers from H.264 or H.265 stream as a sequence of
-NALs. (VPS + )SPS + PPS have short size (8bytes + 28bytes in some environment), so we can assume
-SPS + PPS is contained in first fragment.
+Sends the sequence header of an AV1 key frame as the video configuration, like the SPS/PPS of
+H.264 and H.265, so that a client recreating its decoder after a loss has it. Unlike the NAL
+headers it's left in the frame too, AV1 decoders expect it in band before a key frame.
 */
-void sendHeaders(int codec, unsigned char*& buf, int& len, int nalNum) {
-    unsigned char* cursor = buf;
-    int headersLen = 0;
-    int foundHeaders = -1; // Offset by 1 header to find the length until the next header
-
-    while (headersLen <= len) {
-        if (headersLen + sizeof(NAL_PREFIX_4B) > (unsigned)len) {
-            cursor++;
-            headersLen++;
-            continue;
-        }
-        int8_t prefixSize = getNalPrefixSize(cursor);
-        if (prefixSize == -1) {
-            cursor++;
-            headersLen++;
-            continue;
-        }
-        foundHeaders++;
-        if (foundHeaders == nalNum) {
-            break;
+void processAv1Obus(const unsigned char* buf, int len, bool isIdr) {
+    static bool av1GotConfig = false;
+
+    if (isIdr) {
+        thread_local std::vector<Av1Obu> obus;
+        FindAv1Obus(buf, len, obus);
+        for (auto& obu : obus) {
+            if (obu.type == AV1_OBU_TYPE_SEQUENCE_HEADER) {
+                av1GotConfig = true;
+                SetVideoConfigNals(buf + obu.offset, obu.size, ALVR_CODEC_AV1);
+                return;
+            }
+        }
+    }
+
+    // Encoders that don't repeat the sequence header still need the config to be set once
+    if (!av1GotConfig) {
+        av1GotConfig = true;
+        SetVideoConfigNals(0, 0, ALVR_CODEC_AV1);
+    }
+}
+
+/*
+Returns true if the headers are the first ones seen. The client creates its decoder with those, so
+headers that differ, after the encoder changed its encode size, have to stay in band.
+*/
+static bool IsFirstConfig(const unsigned char* buf, int len) {
+    static std::mutex mutex;
+    static std::vector<unsigned char> firstConfig;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (firstConfig.empty()) {
+        firstConfig.assign(buf, buf + len);
+        return true;
+    }
+    return firstConfig.size() == (size_t)len && memcmp(firstConfig.data(), buf, len) == 0;
+}
+
+/*
+Returns the headers rewritten so that the decoder outputs the frames without reordering. The
+encoders repeat the same headers at each IDR frame, so the rewritten ones are kept and only parsed
+again when they change. The last few stay allocated, the frames waiting in the send queue may still
+point to them.
+*/
+static const std::vector<unsigned char>& lowLatencyHeaders(
+    int codec, const unsigned char* buf, int len
+) {
+    struct Headers {
+        std::vector<unsigned char> original;
+        std::vector<unsigned char> rewritten;
+    };
+    static std::mutex mutex;
+    static std::deque<std::unique_ptr<Headers>> cache;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& headers : cache) {
+        if (headers->original.size() == (size_t)len
+            && memcmp(headers->original.data(), buf, len) == 0) {
+            return headers->rewritten;
         }
-        headersLen += prefixSize;
-        cursor += prefixSize;
     }
 
-    if (foundHeaders != nalNum) {
+    auto headers = std::make_unique<Headers>();
+    headers->original.assign(buf, buf + len);
+    if (!RewriteLowLatencyHeaders(codec, buf, len, headers->rewritten)) {
+        Warn("Failed to rewrite the video headers for low latency decoding, sending them as is\n");
+        headers->rewritten = headers->original;
+    }
+    cache.push_back(std::move(headers));
+    if (cache.size() > 8) {
+        cache.pop_front();
+    }
+    return cache.back()->rewritten;
+}
+
+/*
+Strips the access unit delimiter and sends the (VPS + )SPS + PPS video configuration headers from
+H.264 or H.265 stream as a sequence of NALs. (VPS + )SPS + PPS have short size (8bytes + 28bytes in
+some environment), so we can assume they are contained in first fragment. The headers are only
+stripped while they match the ones the client decoder was created with.
+
+With the low latency headers, the ones sent are rewritten. Those that have to stay in band are then
+returned in inBandHeaders, to be sent before buf. The SEI NALs in front of the first slice are
+stripped too, except the recovery points.
+*/
+void processNals(int codec, const unsigned char*& buf, int& len, FfiNalRange& inBandHeaders) {
+    bool hevc = codec == ALVR_CODEC_HEVC;
+    int headerCount = hevc ? 3 : 2;
+    bool lowLatency = Settings::Instance().m_encoderLowLatencyHeaders;
+    inBandHeaders = { nullptr, 0 };
+
+    // Only the AUD, the headers and the NALs up to the first slice are needed
+    thread_local std::vector<NalUnit> units;
+    FindNalUnits(codec, buf, len, units, headerCount + (lowLatency ? 6 : 2));
+    if (units.empty()) {
         return;
     }
 
-    SetVideoConfigNals((const unsigned char*)buf, headersLen, codec);
+    size_t first = 0;
+    if (units[0].type == (hevc ? HEVC_NAL_TYPE_AUD : H264_NAL_TYPE_AUD) && units.size() > 1) {
+        first = 1;
+    }
+
+    int skip = units[first].offset;
+    size_t next = first;
+    if (units[first].type == (hevc ? HEVC_NAL_TYPE_VPS : H264_NAL_TYPE_SPS)
+        && units.size() > first + headerCount) {
+        int headersLen = units[first + headerCount].offset - units[first].offset;
+        const unsigned char* headers = buf + units[first].offset;
+        if (lowLatency) {
+            auto& rewritten = lowLatencyHeaders(codec, headers, headersLen);
+            headers = rewritten.data();
+            headersLen = (int)rewritten.size();
+        }
+        SetVideoConfigNals(headers, headersLen, codec);
+        if (IsFirstConfig(headers, headersLen)) {
+            skip = units[first + headerCount].offset;
+        } else if (lowLatency) {
+            inBandHeaders = { headers, (unsigned int)headersLen };
+            skip = units[first + headerCount].offset;
+        }
+        next = first + headerCount;
+    }
 
-    // move the cursor forward excluding config NALs
-    buf = cursor;
-    len -= headersLen;
+    if (lowLatency && skip == units[next].offset) {
+        unsigned char seiType = hevc ? HEVC_NAL_TYPE_PREFIX_SEI : H264_NAL_TYPE_SEI;
+        // The last unit found may not be the last one of the frame, it's left
+        for (; next + 1 < units.size() && units[next].type == seiType; next++) {
+            auto& unit = units[next];
+            if (HasRecoveryPointSei(codec, buf + unit.offset, unit.size)) {
+                break;
+            }
+            skip += unit.size;
+        }
+    }
+
+    buf += skip;
+    len -= skip;
 }
 
-void processH264Nals(unsigned char*& buf, int& len) {
-    unsigned char prefixSize = getNalPrefixSize(buf);
-    unsigned char nalType = buf[prefixSize] & 0x1F;
+// Returns the length of the range without the filler data NALs that end it. Those are 0xFF bytes
+// closed by the RBSP stop bit, so they are recognized from the end without scanning the slices
+static unsigned int stripTrailingFiller(int codec, const unsigned char* buf, unsigned int len) {
+    bool hevc = codec == ALVR_CODEC_HEVC;
+    unsigned int headerSize = hevc ? 2 : 1;
+    while (len >= 3 + headerSize + 1 && buf[len - 1] == 0x80) {
+        unsigned int header = len - 1;
+        while (header > 0 && buf[header - 1] == 0xFF) {
+            header--;
+        }
+        if (header < 3 + headerSize) {
+            break;
+        }
+        header -= headerSize;
+        unsigned char type = hevc ? (buf[header] >> 1) & 0x3F : buf[header] & 0x1F;
+        if (type != (hevc ? HEVC_NAL_TYPE_FILLER : H264_NAL_TYPE_FILLER)
+            || buf[header - 3] != 0 || buf[header - 2] != 0 || buf[header - 1] != 1) {
+            break;
+        }
+        len = header - 3;
+        if (len > 0 && buf[len - 1] == 0) {
+            len--;
+        }
+    }
+    return len;
+}
 
-    if (nalType == H264_NAL_TYPE_AUD && len > prefixSize * 2 + 2) {
-        buf += prefixSize + 2;
-        len -= prefixSize + 2;
-        prefixSize = getNalPrefixSize(buf);
-        nalType = buf[prefixSize] & 0x1F;
+/*
+Returns where the frame metadata goes in the first range of a slice: before the first slice of the
+frame, after the headers and SEI left in band. Returns -1 if the range doesn't start the frame, with
+sub-frame output the metadata only goes with the first slice.
+*/
+static int findMetadataOffset(int codec, const unsigned char* buf, int len) {
+    if (codec == ALVR_CODEC_AV1) {
+        thread_local std::vector<Av1Obu> obus;
+        FindAv1Obus(buf, len, obus);
+        for (auto& obu : obus) {
+            if (obu.type == AV1_OBU_TYPE_FRAME_HEADER || obu.type == AV1_OBU_TYPE_FRAME) {
+                return obu.offset;
+            }
+            if (obu.type == AV1_OBU_TYPE_TILE_GROUP) {
+                return -1;
+            }
+        }
+        return -1;
     }
-    if (nalType == H264_NAL_TYPE_SPS) {
-        sendHeaders(ALVR_CODEC_H264, buf, len, 2); // 2 headers SPS and PPS
+
+    thread_local std::vector<NalUnit> units;
+    FindNalUnits(codec, buf, len, units, 8);
+    int prefix = -1;
+    for (auto& unit : units) {
+        int header = unit.offset + unit.prefixSize;
+        if (codec == ALVR_CODEC_HEVC) {
+            if (unit.type < HEVC_NAL_TYPE_VPS) {
+                // first_slice_segment_in_pic_flag is the top bit after the header
+                return header + 2 < len && (buf[header + 2] & 0x80) ? unit.offset : -1;
+            }
+        } else if (unit.type == H264_NAL_TYPE_PREFIX) {
+            prefix = unit.offset;
+        } else if (unit.type == H264_NAL_TYPE_SLICE || unit.type == H264_NAL_TYPE_IDR_SLICE) {
+            // first_mb_in_slice is 0 when its Exp-Golomb code is the single bit 1. The SVC prefix
+            // stays in front of its slice
+            if (header + 1 < len && (buf[header + 1] & 0x80)) {
+                return prefix >= 0 ? prefix : unit.offset;
+            }
+            return -1;
+        } else {
+            prefix = -1;
+        }
     }
+    return -1;
 }
 
-void processHevcNals(unsigned char*& buf, int& len) {
-    unsigned char prefixSize = getNalPrefixSize(buf);
-    unsigned char nalType = (buf[prefixSize] >> 1) & 0x3F;
+// Owns the frame metadata until the frame it was inserted in is released
+struct MetadataRelease {
+    MetadataRelease(void (*release)(void* context), void* context)
+        : release(release)
+        , context(context) { }
+
+    static void Release(void* owner) {
+        auto self = static_cast<MetadataRelease*>(owner);
+        self->release(self->context);
+        delete self;
+    }
 
-    if (nalType == HEVC_NAL_TYPE_AUD && len > prefixSize * 2 + 3) {
-        buf += prefixSize + 3;
-        len -= prefixSize + 3;
-        prefixSize = getNalPrefixSize(buf);
-        nalType = (buf[prefixSize] >> 1) & 0x3F;
+    std::vector<unsigned char> metadata;
+    void (*release)(void* context);
+    void* context;
+};
+
+// Releases an encoded frame once all the packets it was split in are sent
+struct SharedRelease {
+    SharedRelease(int references, void (*release)(void* context), void* context)
+        : references(references)
+        , release(release)
+        , context(context) { }
+
+    static void Release(void* shared) {
+        auto self = static_cast<SharedRelease*>(shared);
+        if (self->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            self->release(self->context);
+            delete self;
+        }
+    }
+
+    std::atomic<int> references;
+    void (*release)(void* context);
+    void* context;
+};
+
+/*
+Sends the ranges of H.264 or H.265 NALs of a slice as packets that each fit in sliceSize bytes, the
+size the encoder was asked to keep the slices under. The packets start on NAL boundaries so that a
+lost one only takes the slices it carries with it, the small NALs are grouped with the next ones.
+The NALs don't cross the ranges, a packet takes parts of several of them.
+*/
+static void sendSlicePackets(
+    int codec,
+    const FfiNalRange* ranges,
+    int rangeCount,
+    unsigned int sliceSize,
+    unsigned long long targetTimestampNs,
+    bool isIdr,
+    bool isLastSlice,
+    int temporalId,
+    void (*release)(void* context),
+    void* releaseContext
+) {
+    thread_local std::vector<NalUnit> units;
+    thread_local std::vector<FfiNalRange> parts;
+    // The end of each packet in parts
+    thread_local std::vector<size_t> packetEnds;
+    parts.clear();
+    packetEnds.clear();
+
+    unsigned int packetBytes = 0;
+    for (int r = 0; r < rangeCount; r++) {
+        const FfiNalRange& range = ranges[r];
+        FindNalUnits(codec, range.data, (int)range.len, units);
+        unsigned int start = 0;
+        for (auto& unit : units) {
+            unsigned int offset = unit.offset;
+            unsigned int pending = packetBytes + offset - start;
+            if (pending > 0 && pending + unit.size > sliceSize) {
+                if (offset > start) {
+                    parts.push_back({ range.data + start, offset - start });
+                }
+                packetEnds.push_back(parts.size());
+                packetBytes = 0;
+                start = offset;
+            }
+        }
+        if (range.len > start) {
+            parts.push_back({ range.data + start, range.len - start });
+            packetBytes += range.len - start;
+        }
     }
-    if (nalType == HEVC_NAL_TYPE_VPS) {
-        sendHeaders(ALVR_CODEC_HEVC, buf, len, 3); // 3 headers VPS, SPS and PPS
+    if (packetEnds.empty() || packetEnds.back() < parts.size()) {
+        packetEnds.push_back(parts.size());
+    }
+
+    SharedRelease* shared = nullptr;
+    if (release) {
+        shared = new SharedRelease((int)packetEnds.size(), release, releaseContext);
+    }
+    size_t begin = 0;
+    for (size_t i = 0; i < packetEnds.size(); i++) {
+        VideoSendV(
+            targetTimestampNs,
+            parts.data() + begin,
+            (int)(packetEnds[i] - begin),
+            isIdr,
+            isLastSlice && i + 1 == packetEnds.size(),
+            temporalId,
+            shared ? SharedRelease::Release : nullptr,
+            shared
+        );
+        begin = packetEnds[i];
     }
 }
 
 void ParseFrameNals(
     int codec, unsigned char* buf, int len, unsigned long long targetTimestampNs, bool isIdr
 ) {
-    static bool av1GotFrame = false;
+    FfiNalRange range = { buf, (unsigned int)len };
+    ParseFrameNalRanges(codec, &range, 1, targetTimestampNs, isIdr, true, nullptr, nullptr);
+}
 
-    if ((unsigned)len < sizeof(NAL_PREFIX_4B)) {
+void ParseFrameNalRanges(
+    int codec,
+    FfiNalRange* ranges,
+    int rangeCount,
+    unsigned long long targetTimestampNs,
+    bool isIdr,
+    bool isLastSlice,
+    void (*release)(void* context),
+    void* releaseContext
+) {
+    if (EncoderWarmup::Instance().Discard(targetTimestampNs, isLastSlice)) {
+        if (release) {
+            release(releaseContext);
+        }
         return;
     }
 
-    if (codec == ALVR_CODEC_H264) {
-        processH264Nals(buf, len);
-    } else if (codec == ALVR_CODEC_HEVC) {
-        processHevcNals(buf, len);
-    } else if (codec == ALVR_CODEC_AV1 && !av1GotFrame) {
-        av1GotFrame = true;
-        SetVideoConfigNals(0, 0, codec);
+    // Sub-frame output may complete a frame with an empty slice, after all the data was sent
+    bool emptyLastSlice = isLastSlice && rangeCount == 1 && ranges[0].len == 0;
+    if (!emptyLastSlice && (rangeCount < 1 || ranges[0].len < 4)) {
+        if (release) {
+            release(releaseContext);
+        }
+        return;
+    }
+
+    FrameTrace& trace = FrameTrace::Instance();
+    // Sub-frame output hands the slices over while the frame is still being encoded
+    if (isLastSlice) {
+        trace.Record(targetTimestampNs, FRAME_TRACE_ENCODE_COMPLETE);
+    }
+
+    int temporalId = 0;
+    FfiNalRange inBandHeaders = { nullptr, 0 };
+    int metadataOffset = -1;
+    if (!emptyLastSlice) {
+        const unsigned char* buf = ranges[0].data;
+        int len = ranges[0].len;
+        bool nals = codec == ALVR_CODEC_H264 || codec == ALVR_CODEC_HEVC;
+        if (nals) {
+            processNals(codec, buf, len, inBandHeaders);
+        } else if (codec == ALVR_CODEC_AV1) {
+            processAv1Obus(buf, len, isIdr);
+        }
+        ranges[0] = { buf, (unsigned int)len };
+        if (Settings::Instance().m_encoderTemporalLayers > 1) {
+            temporalId = FindTemporalId(codec, buf, len);
+        }
+
+        // The filler data comes after the last slice, for the constant bitrate
+        if (nals && isLastSlice && Settings::Instance().m_encoderLowLatencyHeaders) {
+            FfiNalRange& last = ranges[rangeCount - 1];
+            last.len = stripTrailingFiller(codec, last.data, last.len);
+        }
+
+        if (FrameMetadata::IsEnabled()) {
+            metadataOffset = findMetadataOffset(codec, buf, len);
+        }
+    }
+
+    // The headers that stay in band and the metadata are sent from their own buffers, the
+    // metadata between the headers left in the frame and its first slice
+    if (inBandHeaders.len > 0 || metadataOffset >= 0) {
+        thread_local std::vector<FfiNalRange> withHeaders;
+        withHeaders.clear();
+        if (inBandHeaders.len > 0) {
+            withHeaders.push_back(inBandHeaders);
+        }
+        if (metadataOffset >= 0) {
+            thread_local std::vector<unsigned char> metadataBuffer;
+            std::vector<unsigned char>* metadata = &metadataBuffer;
+            // The send queue copies the frame without a release, else it keeps the pointers
+            if (release) {
+                auto owner = new MetadataRelease(release, releaseContext);
+                metadata = &owner->metadata;
+                release = MetadataRelease::Release;
+                releaseContext = owner;
+            }
+            FrameMetadata::Instance().Build(codec, targetTimestampNs, isIdr, temporalId, *metadata);
+
+            unsigned int offset = metadataOffset;
+            if (offset > 0) {
+                withHeaders.push_back({ ranges[0].data, offset });
+            }
+            withHeaders.push_back({ metadata->data(), (unsigned int)metadata->size() });
+            withHeaders.push_back({ ranges[0].data + offset, ranges[0].len - offset });
+            withHeaders.insert(withHeaders.end(), ranges + 1, ranges + rangeCount);
+        } else {
+            withHeaders.insert(withHeaders.end(), ranges, ranges + rangeCount);
+        }
+        ranges = withHeaders.data();
+        rangeCount = (int)withHeaders.size();
+    }
+
+    uint64_t bytes = 0;
+    for (int i = 0; i < rangeCount; i++) {
+        bytes += ranges[i].len;
     }
+    DriverCounters::Add(DRIVER_COUNTER_NAL_BYTES, bytes);
 
-    VideoSend(targetTimestampNs, buf, len, isIdr);
+    VideoSendQueue::Instance().Send(
+        codec,
+        ranges,
+        rangeCount,
+        targetTimestampNs,
+        isIdr,
+        isLastSlice,
+        temporalId,
+        release,
+        releaseContext
+    );
+}
+
+void SendFrameSlice(
+    int codec,
+    const FfiNalRange* ranges,
+    int rangeCount,
+    unsigned long long targetTimestampNs,
+    bool isIdr,
+    bool isLastSlice,
+    int temporalId,
+    void (*release)(void* context),
+    void* releaseContext
+) {
+    {
+        TraceScope scope("VideoSend", targetTimestampNs);
+        unsigned int sliceSize = Settings::Instance().m_encoderSliceSizeBytes;
+        uint64_t bytes = 0;
+        for (int i = 0; i < rangeCount; i++) {
+            bytes += ranges[i].len;
+        }
+        if (sliceSize > 0 && (codec == ALVR_CODEC_H264 || codec == ALVR_CODEC_HEVC)
+            && bytes > sliceSize) {
+            sendSlicePackets(
+                codec,
+                ranges,
+                rangeCount,
+                sliceSize,
+                targetTimestampNs,
+                isIdr,
+                isLastSlice,
+                temporalId,
+                release,
+                releaseContext
+            );
+        } else {
+            VideoSendV(
+                targetTimestampNs,
+                ranges,
+                rangeCount,
+                isIdr,
+                isLastSlice,
+                temporalId,
+                release,
+                releaseContext
+            );
+        }
+    }
+
+    FrameTrace& trace = FrameTrace::Instance();
+    trace.RecordFirst(targetTimestampNs, FRAME_TRACE_FIRST_NAL_SENT);
+    if (isLastSlice) {
+        trace.Record(targetTimestampNs, FRAME_TRACE_LAST_NAL_SENT);
+        if (isIdr) {
+            StreamStart::Mark(StreamStart::FIRST_IDR_SENT);
+        }
+    }
 }
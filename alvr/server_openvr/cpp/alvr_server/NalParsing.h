@@ -0,0 +1,51 @@
+#pragma once
+
+#include "bindings.h"
+#include <stdint.h>
+#include <vector>
+
+struct NalUnit {
+    // Offset of the start code from the beginning of the buffer
+    int offset;
+    // 3 or 4 bytes start code
+    int prefixSize;
+    // Size including the start code, up to the next start code or the end of the buffer
+    int size;
+    unsigned char type;
+};
+
+// Finds the Annex-B NAL units of an H.264 or HEVC bitstream in a single pass. If maxUnits is set,
+// the scan stops as soon as that many units are complete
+void FindNalUnits(
+    int codec, const unsigned char* buf, int len, std::vector<NalUnit>& units, int maxUnits = -1
+);
+
+struct Av1Obu {
+    // Offset of the OBU header from the beginning of the buffer
+    int offset;
+    // Size including the header and the size field
+    int size;
+    unsigned char type;
+};
+
+// Splits a low overhead AV1 bitstream into its OBUs. OBUs without a size field extend to the end
+// of the buffer. Stops at the first truncated OBU
+void FindAv1Obus(const unsigned char* buf, int len, std::vector<Av1Obu>& obus);
+
+// Temporal layer of the frame, from the first header that has it: the NAL header for HEVC, the SVC
+// prefix NAL for H.264 and the OBU extension for AV1. 0 for streams without temporal layers
+int FindTemporalId(int codec, const unsigned char* buf, int len);
+
+// Sends a slice of ParseFrameNalRanges once its NALs are rewritten, split in packets if the
+// slices are sized to them. Called by VideoSendQueue, from its sender thread when it's enabled
+void SendFrameSlice(
+    int codec,
+    const FfiNalRange* ranges,
+    int rangeCount,
+    unsigned long long targetTimestampNs,
+    bool isIdr,
+    bool isLastSlice,
+    int temporalId,
+    void (*release)(void* context),
+    void* releaseContext
+);
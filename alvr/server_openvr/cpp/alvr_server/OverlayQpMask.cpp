@@ -0,0 +1,30 @@
+#include "OverlayQpMask.h"
+#include "Settings.h"
+#include <algorithm>
+
+OverlayQpMask OverlayQpMask::m_instance;
+
+bool OverlayQpMask::IsEnabled() { return Settings::Instance().m_encoderOverlayQpReduction > 0; }
+
+void OverlayQpMask::SetCoverage(const std::vector<uint8_t>& cells) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (cells == m_cells) {
+        return;
+    }
+    m_cells = cells;
+    m_version.fetch_add(1, std::memory_order_release);
+}
+
+std::vector<uint8_t> OverlayQpMask::GetCoverage() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_cells;
+}
+
+bool OverlayQpMask::Covers(const std::vector<uint8_t>& cells, int eye, float u, float v) {
+    if (cells.empty()) {
+        return false;
+    }
+    uint32_t x = std::min((uint32_t)std::max(u * CELLS_X, 0.f), CELLS_X - 1);
+    uint32_t y = std::min((uint32_t)std::max(v * CELLS_Y, 0.f), CELLS_Y - 1);
+    return cells[(eye * CELLS_Y + y) * CELLS_X + x] != 0;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Where the overlay layers (SteamVR overlays, the dashboard) cover the game in the composited
+// frame, so that the encoders lower the QP of their text. A coarse grid of cells over each eye, in
+// the UV of the rendered eye. Written by the compositor as its coverage pass is read back, read
+// by the encoder thread.
+class OverlayQpMask {
+public:
+    static const uint32_t CELLS_X = 64;
+    static const uint32_t CELLS_Y = 64;
+
+    static OverlayQpMask& Instance() { return m_instance; }
+
+    static bool IsEnabled();
+
+    // CELLS_X * CELLS_Y cells of the left eye then of the right eye, in raster order, non zero
+    // where an overlay is opaque. Empty when no overlay is shown
+    void SetCoverage(const std::vector<uint8_t>& cells);
+
+    // Changes whenever the coverage changes, so that the encoders know when to rebuild their maps
+    uint32_t GetVersion() const { return m_version.load(std::memory_order_acquire); }
+    std::vector<uint8_t> GetCoverage();
+    // Whether an overlay covers the point of the eye in cells from GetCoverage, in the UV of the
+    // rendered eye
+    static bool Covers(const std::vector<uint8_t>& cells, int eye, float u, float v);
+
+private:
+    static OverlayQpMask m_instance;
+
+    std::mutex m_mutex;
+    std::vector<uint8_t> m_cells;
+    std::atomic<uint32_t> m_version = 0;
+};
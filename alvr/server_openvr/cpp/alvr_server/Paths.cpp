@@ -1,5 +1,7 @@
 #include "Paths.h"
 #include "bindings.h"
+#include <algorithm>
+#include <utility>
 
 uint64_t HEAD_ID;
 uint64_t HAND_LEFT_ID;
@@ -37,7 +39,41 @@ uint64_t RIGHT_SQUEEZE_VALUE_ID;
 std::set<uint64_t> BODY_IDS;
 std::map<uint64_t, ButtonInfo> LEFT_CONTROLLER_BUTTON_MAPPING;
 std::map<uint64_t, ButtonInfo> RIGHT_CONTROLLER_BUTTON_MAPPING;
-std::map<uint64_t, std::vector<uint64_t>> ALVR_TO_STEAMVR_PATH_IDS;
+std::vector<ButtonDispatch> BUTTON_DISPATCH_TABLE;
+std::vector<uint32_t> BUTTON_COMPONENTS;
+uint32_t BUTTON_COMPONENT_COUNT;
+
+namespace {
+ButtonGesture GestureOf(uint64_t id) {
+    if (id == LEFT_A_TOUCH_ID || id == LEFT_B_TOUCH_ID || id == LEFT_X_TOUCH_ID
+        || id == LEFT_Y_TOUCH_ID || id == LEFT_TRACKPAD_TOUCH_ID || id == LEFT_THUMBSTICK_TOUCH_ID
+        || id == LEFT_THUMBREST_TOUCH_ID || id == RIGHT_A_TOUCH_ID || id == RIGHT_B_TOUCH_ID
+        || id == RIGHT_TRACKPAD_TOUCH_ID || id == RIGHT_THUMBSTICK_TOUCH_ID
+        || id == RIGHT_THUMBREST_TOUCH_ID) {
+        return ButtonGesture::ThumbTouch;
+    } else if (id == LEFT_TRIGGER_TOUCH_ID || id == RIGHT_TRIGGER_TOUCH_ID) {
+        return ButtonGesture::TriggerTouch;
+    } else if (id == LEFT_TRIGGER_VALUE_ID || id == RIGHT_TRIGGER_VALUE_ID) {
+        return ButtonGesture::TriggerValue;
+    } else if (id == LEFT_SQUEEZE_VALUE_ID || id == RIGHT_SQUEEZE_VALUE_ID) {
+        return ButtonGesture::GripValue;
+    }
+    return ButtonGesture::None;
+}
+}
+
+const ButtonDispatch* FindButtonDispatch(uint64_t id) {
+    auto it = std::lower_bound(
+        BUTTON_DISPATCH_TABLE.begin(),
+        BUTTON_DISPATCH_TABLE.end(),
+        id,
+        [](const ButtonDispatch& entry, uint64_t id) { return entry.id < id; }
+    );
+    if (it == BUTTON_DISPATCH_TABLE.end() || it->id != id) {
+        return nullptr;
+    }
+    return &*it;
+}
 
 void init_paths() {
     HEAD_ID = PathStringToHash("/user/head");
@@ -284,13 +320,28 @@ void init_paths() {
           { { "/input/thumbrest/touch" }, ButtonType::Binary } }
     );
 
-    for (auto hand : { LEFT_CONTROLLER_BUTTON_MAPPING, RIGHT_CONTROLLER_BUTTON_MAPPING }) {
-        for (auto info : hand) {
-            std::vector<uint64_t> ids;
-            for (auto path : info.second.steamvr_paths) {
-                ids.push_back(PathStringToHash(path));
+    // Component of each hand and path hash
+    std::map<std::pair<bool, uint64_t>, uint32_t> components;
+    for (bool isLeft : { true, false }) {
+        const auto& mapping
+            = isLeft ? LEFT_CONTROLLER_BUTTON_MAPPING : RIGHT_CONTROLLER_BUTTON_MAPPING;
+        for (const auto& [id, info] : mapping) {
+            auto firstComponent = (uint32_t)BUTTON_COMPONENTS.size();
+            auto componentCount = (uint32_t)info.steamvr_paths.size();
+            BUTTON_DISPATCH_TABLE.push_back(
+                { id, isLeft, firstComponent, componentCount, info.type, GestureOf(id) }
+            );
+            for (auto path : info.steamvr_paths) {
+                auto key = std::make_pair(isLeft, PathStringToHash(path));
+                auto [it, inserted] = components.insert({ key, (uint32_t)components.size() });
+                BUTTON_COMPONENTS.push_back(it->second);
             }
-            ALVR_TO_STEAMVR_PATH_IDS.insert({ info.first, ids });
         }
     }
+    BUTTON_COMPONENT_COUNT = components.size();
+    std::sort(
+        BUTTON_DISPATCH_TABLE.begin(),
+        BUTTON_DISPATCH_TABLE.end(),
+        [](const ButtonDispatch& a, const ButtonDispatch& b) { return a.id < b.id; }
+    );
 }
@@ -58,6 +58,36 @@ struct ButtonInfo {
 extern std::set<uint64_t> BODY_IDS;
 extern std::map<uint64_t, ButtonInfo> LEFT_CONTROLLER_BUTTON_MAPPING;
 extern std::map<uint64_t, ButtonInfo> RIGHT_CONTROLLER_BUTTON_MAPPING;
-extern std::map<uint64_t, std::vector<uint64_t>> ALVR_TO_STEAMVR_PATH_IDS;
+
+// Part a button plays in the hand skeleton inferred while holding a controller
+enum class ButtonGesture {
+    None,
+    ThumbTouch,
+    TriggerTouch,
+    TriggerValue,
+    GripValue,
+};
+
+struct ButtonDispatch {
+    uint64_t id;
+    bool isLeft;
+    // Range of the button in BUTTON_COMPONENTS
+    uint32_t firstComponent;
+    uint32_t componentCount;
+    ButtonType type;
+    ButtonGesture gesture;
+};
+
+// Buttons of both hands sorted by id, built by init_paths() and left untouched afterwards so that
+// the input events are dispatched without locking or allocating
+extern std::vector<ButtonDispatch> BUTTON_DISPATCH_TABLE;
+// Index in Controller::m_componentHandles of each SteamVR path of the buttons in the table. Buttons
+// of a hand that share a path, like system and menu, share its component
+extern std::vector<uint32_t> BUTTON_COMPONENTS;
+// Number of distinct SteamVR components of the buttons in the table
+extern uint32_t BUTTON_COMPONENT_COUNT;
+
+// nullptr if the id isn't a button of either hand
+const ButtonDispatch* FindButtonDispatch(uint64_t id);
 
 void init_paths();
@@ -0,0 +1,86 @@
+#include "PipelineTimings.h"
+
+#include "Logger.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+PipelineTimings PipelineTimings::m_instance;
+
+void PipelineTimings::Reset(const std::vector<std::string>& names) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_passes.clear();
+    for (const std::string& name : names) {
+        m_passes.push_back({ name, {} });
+    }
+    m_frames = 0;
+}
+
+void PipelineTimings::AddFrame(const std::vector<uint64_t>& durationsNs) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (durationsNs.size() != m_passes.size()) {
+        return;
+    }
+    for (size_t i = 0; i < m_passes.size(); i++) {
+        m_passes[i].samplesMs[m_frames % WINDOW_FRAMES] = durationsNs[i] / 1e6f;
+    }
+    m_frames++;
+}
+
+unsigned int PipelineTimings::Get(FfiRenderPipelineStats* stats, unsigned int maxCount) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const size_t count = std::min<size_t>(WINDOW_FRAMES, m_frames);
+    if (count == 0) {
+        return 0;
+    }
+
+    unsigned int passCount = std::min<size_t>(maxCount, m_passes.size());
+    for (unsigned int i = 0; i < passCount; i++) {
+        std::array<float, WINDOW_FRAMES> samples = m_passes[i].samplesMs;
+        std::sort(samples.begin(), samples.begin() + count);
+
+        float sum = 0;
+        for (size_t j = 0; j < count; j++) {
+            sum += samples[j];
+        }
+
+        FfiRenderPipelineStats& out = stats[i];
+        memset(out.name, 0, sizeof(out.name));
+        strncpy(out.name, m_passes[i].name.c_str(), sizeof(out.name) - 1);
+        out.frameCount = count;
+        out.averageMs = sum / count;
+        out.p95Ms = samples[std::min(count - 1, count * 95 / 100)];
+        out.maxMs = samples[count - 1];
+    }
+    return passCount;
+}
+
+void PipelineTimings::Log() {
+    // Once per window, the stats of the frames in between would overlap
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_frames == 0 || m_frames % WINDOW_FRAMES != 0) {
+            return;
+        }
+    }
+
+    FfiRenderPipelineStats stats[16];
+    unsigned int count = Get(stats, 16);
+
+    char buf[768];
+    int written = 0;
+    for (unsigned int i = 0; i < count && written < (int)sizeof(buf); i++) {
+        written += snprintf(
+            buf + written,
+            sizeof(buf) - written,
+            "%s%s %.2fms (p95 %.2fms)",
+            i > 0 ? ", " : "",
+            stats[i].name,
+            stats[i].averageMs,
+            stats[i].p95Ms
+        );
+    }
+    if (count > 0) {
+        LogPeriod("RenderPipelineTimings", "Renderer: %s", buf);
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "bindings.h"
+#include <array>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Rolling GPU timings of the compositor passes, filled by the renderer once a frame has been
+// composited and read back over FFI by GetRenderPipelineStats, or logged every second
+class PipelineTimings {
+public:
+    static PipelineTimings& Instance() { return m_instance; }
+
+    // Starts over with these passes, in render order
+    void Reset(const std::vector<std::string>& names);
+    // GPU time of each pass for one frame, in the order given to Reset()
+    void AddFrame(const std::vector<uint64_t>& durationsNs);
+
+    unsigned int Get(FfiRenderPipelineStats* stats, unsigned int maxCount);
+    // Through LogPeriod, once the window has been filled with new frames
+    void Log();
+
+private:
+    static PipelineTimings m_instance;
+
+    static constexpr size_t WINDOW_FRAMES = 120;
+
+    struct Pass {
+        std::string name;
+        std::array<float, WINDOW_FRAMES> samplesMs;
+    };
+
+    std::mutex m_mutex;
+    std::vector<Pass> m_passes;
+    // Frames added since Reset()
+    uint64_t m_frames = 0;
+};
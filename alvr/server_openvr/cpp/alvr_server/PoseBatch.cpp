@@ -0,0 +1,48 @@
+#include "PoseBatch.h"
+
+PoseBatch PoseBatch::m_instance;
+
+void PoseBatch::Begin() {
+    m_count = 0;
+    m_open = true;
+}
+
+void PoseBatch::Add(vr::TrackedDeviceIndex_t objectId, const vr::DriverPose_t& pose) {
+    if (!m_open) {
+        vr::VRServerDriverHost()->TrackedDevicePoseUpdated(
+            objectId, pose, sizeof(vr::DriverPose_t)
+        );
+        return;
+    }
+
+    // Devices are mostly added in index order already, so the insertion point is found at the end
+    uint32_t i = m_count;
+    while (i > 0 && m_entries[i - 1].objectId > objectId) {
+        i--;
+    }
+    if (i > 0 && m_entries[i - 1].objectId == objectId) {
+        m_entries[i - 1].pose = pose;
+        return;
+    }
+    if (m_count == m_entries.size()) {
+        return;
+    }
+
+    for (uint32_t j = m_count; j > i; j--) {
+        m_entries[j] = m_entries[j - 1];
+    }
+    m_entries[i] = { objectId, pose };
+    m_count++;
+}
+
+void PoseBatch::Submit() {
+    m_open = false;
+
+    auto host = vr::VRServerDriverHost();
+    for (uint32_t i = 0; i < m_count; i++) {
+        host->TrackedDevicePoseUpdated(
+            m_entries[i].objectId, m_entries[i].pose, sizeof(vr::DriverPose_t)
+        );
+    }
+    m_count = 0;
+}
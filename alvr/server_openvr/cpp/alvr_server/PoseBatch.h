@@ -0,0 +1,33 @@
+#pragma once
+
+#include "openvr_driver_wrap.h"
+
+#include <array>
+#include <cstdint>
+
+// Collects the poses of all the devices updated by one SetTracking call, so that they are handed
+// to SteamVR back to back once every device has been processed, ordered by object index.
+// Outside of Begin()/Submit() poses are passed through right away.
+// Only used from the tracking thread.
+class PoseBatch {
+public:
+    static PoseBatch& Instance() { return m_instance; }
+
+    void Begin();
+    // A device submitting twice in the same batch keeps its last pose
+    void Add(vr::TrackedDeviceIndex_t objectId, const vr::DriverPose_t& pose);
+    void Submit();
+
+private:
+    static PoseBatch m_instance;
+
+    struct Entry {
+        vr::TrackedDeviceIndex_t objectId;
+        vr::DriverPose_t pose;
+    };
+
+    // Sorted by objectId
+    std::array<Entry, vr::k_unMaxTrackedDeviceCount> m_entries;
+    uint32_t m_count = 0;
+    bool m_open = false;
+};
@@ -0,0 +1,85 @@
+#include "PoseFilter.h"
+#include "Utils.h"
+#include <cmath>
+
+namespace {
+// A longer gap is a tracking loss or a reconnection, smoothing towards the old pose would only
+// make the device drift in
+const double MAX_GAP_S = 0.25;
+
+float Length(const float v[3]) { return sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]); }
+
+// Weight of the new sample for an exponential smoothing at the given cutoff frequency
+float SmoothingFactor(float cutoffHz, double dtS) {
+    double tau = 1.0 / (2.0 * M_PI * cutoffHz);
+    return (float)(1.0 / (1.0 + tau / dtS));
+}
+
+// Normalized lerp along the shortest arc, close enough to a slerp for the small steps between
+// two tracking samples
+FfiQuat Nlerp(const FfiQuat& a, const FfiQuat& b, float t) {
+    float sign = (a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w) < 0.f ? -1.f : 1.f;
+    FfiQuat q = { a.x + (sign * b.x - a.x) * t,
+                  a.y + (sign * b.y - a.y) * t,
+                  a.z + (sign * b.z - a.z) * t,
+                  a.w + (sign * b.w - a.w) * t };
+    float norm = sqrtf(q.x * q.x + q.y * q.y + q.z * q.z + q.w * q.w);
+    return { q.x / norm, q.y / norm, q.z / norm, q.w / norm };
+}
+
+// Rotate q by a world space angular velocity applied during dtS
+FfiQuat Integrate(const FfiQuat& q, const float angularVelocity[3], float dtS) {
+    float speed = Length(angularVelocity);
+    if (speed * dtS < 1e-6f) {
+        return q;
+    }
+    float s = sinf(speed * dtS * 0.5f) / speed;
+    FfiQuat d = { angularVelocity[0] * s,
+                  angularVelocity[1] * s,
+                  angularVelocity[2] * s,
+                  cosf(speed * dtS * 0.5f) };
+
+    return { d.w * q.x + d.x * q.w + d.y * q.z - d.z * q.y,
+             d.w * q.y - d.x * q.z + d.y * q.w + d.z * q.x,
+             d.w * q.z + d.x * q.y - d.y * q.x + d.z * q.w,
+             d.w * q.w - d.x * q.x - d.y * q.y - d.z * q.z };
+}
+}
+
+PoseFilter::PoseFilter(Params params)
+    : m_params(params) { }
+
+FfiDeviceMotion PoseFilter::Filter(uint64_t targetTimestampNs, const FfiDeviceMotion& motion) {
+    double dt = ((double)targetTimestampNs - (double)m_lastTimestampNs) / NS_PER_S;
+
+    if (!m_valid || dt < 0.0 || dt > MAX_GAP_S) {
+        m_position[0] = motion.pose.position[0];
+        m_position[1] = motion.pose.position[1];
+        m_position[2] = motion.pose.position[2];
+        m_orientation = motion.pose.orientation;
+        m_valid = true;
+    } else if (dt > 0.0) {
+        // The same timestamp can come again when the client resends a pose, it is not a new sample
+        float alpha = SmoothingFactor(
+            m_params.minCutoffHz + m_params.beta * Length(motion.linearVelocity), dt
+        );
+        m_position[0] += (motion.pose.position[0] - m_position[0]) * alpha;
+        m_position[1] += (motion.pose.position[1] - m_position[1]) * alpha;
+        m_position[2] += (motion.pose.position[2] - m_position[2]) * alpha;
+
+        alpha = SmoothingFactor(
+            m_params.minCutoffHz + m_params.beta * Length(motion.angularVelocity), dt
+        );
+        m_orientation = Nlerp(m_orientation, motion.pose.orientation, alpha);
+    }
+    m_lastTimestampNs = targetTimestampNs;
+
+    FfiDeviceMotion filtered = motion;
+    float predictionS = m_params.predictionS;
+    filtered.pose.position[0] = m_position[0] + motion.linearVelocity[0] * predictionS;
+    filtered.pose.position[1] = m_position[1] + motion.linearVelocity[1] * predictionS;
+    filtered.pose.position[2] = m_position[2] + motion.linearVelocity[2] * predictionS;
+    filtered.pose.orientation = Integrate(m_orientation, motion.angularVelocity, predictionS);
+
+    return filtered;
+}
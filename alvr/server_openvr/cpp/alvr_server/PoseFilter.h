@@ -0,0 +1,33 @@
+#pragma once
+
+#include "bindings.h"
+#include <cstdint>
+
+// One Euro filter over the pose of a single device, followed by a constant velocity prediction.
+// The speed that raises the cutoff comes from the velocities sent with the motion rather than from
+// differentiating the poses, so the only state kept is the last filtered pose.
+// Only used from the tracking thread.
+class PoseFilter {
+public:
+    struct Params {
+        float minCutoffHz;
+        float beta;
+        // Time the output is extrapolated by, along the velocities of the motion
+        float predictionS;
+    };
+
+    explicit PoseFilter(Params params);
+
+    // Velocities are passed through unchanged
+    FfiDeviceMotion Filter(uint64_t targetTimestampNs, const FfiDeviceMotion& motion);
+    // Start over from the next motion, e.g. after the device lost tracking
+    void Reset() { m_valid = false; }
+
+private:
+    Params m_params;
+
+    bool m_valid = false;
+    uint64_t m_lastTimestampNs = 0;
+    float m_position[3] = {};
+    FfiQuat m_orientation = { 0, 0, 0, 1 };
+};
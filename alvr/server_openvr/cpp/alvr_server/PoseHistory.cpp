@@ -1,7 +1,11 @@
 #include "PoseHistory.h"
+#include "DriverCounters.h"
 #include "Logger.h"
+#include "TraceCapture.h"
 #include "Utils.h"
 #include "include/openvr_math.h"
+#include <algorithm>
+#include <cmath>
 #include <mutex>
 #include <optional>
 
@@ -19,69 +23,237 @@ void PoseHistory::OnPoseUpdated(uint64_t targetTimestampNs, FfiDeviceMotion moti
         &history.rotationMatrix
     );
 
-    std::unique_lock<std::mutex> lock(m_mutex);
-    if (!m_transformIdentity) {
-        vr::HmdMatrix34_t rotation = vrmath::matMul33(m_transform, history.rotationMatrix);
-        history.rotationMatrix = rotation;
+    {
+        std::unique_lock<std::mutex> lock(m_transformMutex);
+        if (!m_transformIdentity) {
+            vr::HmdMatrix34_t rotation = vrmath::matMul33(m_transform, history.rotationMatrix);
+            history.rotationMatrix = rotation;
+        }
     }
 
-    if (m_poseBuffer.size() == 0) {
-        m_poseBuffer.push_back(history);
-    } else {
-        if (m_poseBuffer.back().targetTimestampNs != targetTimestampNs) {
-            // New track info
-            m_poseBuffer.push_back(history);
-        }
+    // Only this thread writes, so the buffer can be read here without the seqlock
+    size_t newest = (m_poseBufferHead + MaxFrames - 1) % MaxFrames;
+    if (m_poseBufferSize != 0
+        && m_poseBuffer[newest].frame.targetTimestampNs == targetTimestampNs) {
+        return;
+    }
+
+    uint64_t fingerprint = Fingerprint(history.rotationMatrix);
+
+    uint32_t sequence = m_sequence.load(std::memory_order_relaxed);
+    m_sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    m_poseBuffer[m_poseBufferHead] = { history, fingerprint };
+    m_timestampIndex[targetTimestampNs % IndexSize] = m_poseBufferHead + 1;
+    m_fingerprintIndex[fingerprint % IndexSize] = m_poseBufferHead + 1;
+    m_poseBufferHead = (m_poseBufferHead + 1) % MaxFrames;
+    if (m_poseBufferSize < MaxFrames) {
+        m_poseBufferSize++;
     }
-    // The value should match with the client's MAXIMUM_TRACKING_FRAMES in ovr_context.cpp
-    if (m_poseBuffer.size() > 120 * 3) {
-        m_poseBuffer.pop_front();
+
+    m_sequence.store(sequence + 2, std::memory_order_release);
+    m_writes.fetch_add(1, std::memory_order_relaxed);
+}
+
+template <typename F>
+std::optional<PoseHistory::TrackingHistoryFrame> PoseHistory::Read(F read) const {
+    uint64_t reads = m_reads.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (reads % 10000 == 0) {
+        Stats stats = GetStats();
+        Debug(
+            "PoseHistory: %llu writes, %llu reads, %llu read retries",
+            (unsigned long long)stats.writes,
+            (unsigned long long)stats.reads,
+            (unsigned long long)stats.readRetries
+        );
+    }
+
+    while (true) {
+        uint32_t sequence = m_sequence.load(std::memory_order_acquire);
+        if ((sequence & 1) == 0) {
+            std::optional<TrackingHistoryFrame> result = read();
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (m_sequence.load(std::memory_order_relaxed) == sequence) {
+                return result;
+            }
+        }
+        m_readRetries.fetch_add(1, std::memory_order_relaxed);
     }
 }
 
 std::optional<PoseHistory::TrackingHistoryFrame>
 PoseHistory::GetBestPoseMatch(const vr::HmdMatrix34_t& pose) const {
-    std::unique_lock<std::mutex> lock(m_mutex);
-    float minDiff = 100000;
-    auto minIt = m_poseBuffer.begin();
-    for (auto it = m_poseBuffer.begin(); it != m_poseBuffer.end(); ++it) {
-        float distance = 0;
-        // Rotation matrix composes a part of ViewMatrix of TrackingInfo.
-        // Be carefull of transpose.
-        // And bottom side and right side of matrix should not be compared, because pPose does not
-        // contain that part of matrix.
-        for (int i = 0; i < 3; i++) {
-            for (int j = 0; j < 3; j++) {
-                distance += pow(it->rotationMatrix.m[j][i] - pose.m[j][i], 2);
+    TraceScope scope("PoseHistory::GetBestPoseMatch");
+    uint64_t fingerprint = Fingerprint(pose);
+
+    auto match = Read([&]() -> std::optional<TrackingHistoryFrame> {
+        // Entries are only validated against what they point to, stale slots simply miss
+        size_t slot = m_fingerprintIndex[fingerprint % IndexSize];
+        if (slot != 0 && slot <= MaxFrames) {
+            const Entry& entry = m_poseBuffer[slot - 1];
+            // Guard against hash collisions
+            if (entry.fingerprint == fingerprint
+                && Distance(entry.frame.rotationMatrix, pose) < 1e-6) {
+                return entry.frame;
             }
         }
-        if (minDiff > distance) {
-            minIt = it;
-            minDiff = distance;
+
+        // Slow path, the pose fell on a quantization boundary or went through a transform
+        float minDiff = 100000;
+        const Entry* minEntry = nullptr;
+        size_t size = std::min(m_poseBufferSize, MaxFrames);
+        size_t oldest = (m_poseBufferHead + MaxFrames - size) % MaxFrames;
+        for (size_t i = 0; i < size; ++i) {
+            const Entry& entry = m_poseBuffer[(oldest + i) % MaxFrames];
+            float distance = Distance(entry.frame.rotationMatrix, pose);
+            if (minDiff > distance) {
+                minEntry = &entry;
+                minDiff = distance;
+            }
         }
+        if (minEntry) {
+            return minEntry->frame;
+        }
+        return {};
+    });
+
+    if (match) {
+        scope.SetTargetTimestamp(match->targetTimestampNs);
+    } else {
+        DriverCounters::Add(DRIVER_COUNTER_FRAMES_WITHOUT_POSE);
+        Debug("PoseHistory::GetBestPoseMatch: No pose matched.");
     }
-    if (minIt != m_poseBuffer.end()) {
-        return *minIt;
+    return match;
+}
+
+std::optional<PoseHistory::TrackingHistoryFrame>
+PoseHistory::GetPoseMatchUpTo(const vr::HmdMatrix34_t& pose, uint64_t newestTimestampNs) const {
+    if (newestTimestampNs == 0) {
+        return GetBestPoseMatch(pose);
     }
 
-    Debug("PoseHistory::GetBestPoseMatch: No pose matched.");
-    return {};
+    TraceScope scope("PoseHistory::GetPoseMatchUpTo");
+    auto match = Read([&]() -> std::optional<TrackingHistoryFrame> {
+        size_t size = std::min(m_poseBufferSize, MaxFrames);
+        // Age of the entry for newestTimestampNs, the entries after it are too new
+        size_t start = 1;
+        size_t slot = m_timestampIndex[newestTimestampNs % IndexSize];
+        if (slot != 0 && slot <= MaxFrames
+            && m_poseBuffer[slot - 1].frame.targetTimestampNs == newestTimestampNs) {
+            start = (m_poseBufferHead + MaxFrames - (slot - 1)) % MaxFrames;
+            if (start == 0) {
+                start = MaxFrames;
+            }
+        }
+
+        float minDiff = 100000;
+        const Entry* minEntry = nullptr;
+        for (size_t i = start; i <= size; ++i) {
+            const Entry& entry = m_poseBuffer[(m_poseBufferHead + MaxFrames - i) % MaxFrames];
+            if (entry.frame.targetTimestampNs > newestTimestampNs) {
+                continue;
+            }
+            float distance = Distance(entry.frame.rotationMatrix, pose);
+            // The same pose, the newest one that fits is the one SteamVR handed out
+            if (distance < 1e-6) {
+                return entry.frame;
+            }
+            if (minDiff > distance) {
+                minEntry = &entry;
+                minDiff = distance;
+            }
+        }
+        if (minEntry) {
+            return minEntry->frame;
+        }
+        return {};
+    });
+
+    if (match) {
+        scope.SetTargetTimestamp(match->targetTimestampNs);
+    } else {
+        DriverCounters::Add(DRIVER_COUNTER_FRAMES_WITHOUT_POSE);
+        Debug("PoseHistory::GetPoseMatchUpTo: No pose matched.");
+    }
+    return match;
 }
 
 std::optional<PoseHistory::TrackingHistoryFrame> PoseHistory::GetPoseAt(uint64_t timestampNs
 ) const {
-    std::unique_lock<std::mutex> lock(m_mutex);
-    for (auto it = m_poseBuffer.rbegin(), end = m_poseBuffer.rend(); it != end; ++it) {
-        if (it->targetTimestampNs == timestampNs)
-            return *it;
+    TraceScope scope("PoseHistory::GetPoseAt", timestampNs);
+    auto match = Read([&]() -> std::optional<TrackingHistoryFrame> {
+        size_t slot = m_timestampIndex[timestampNs % IndexSize];
+        if (slot != 0 && slot <= MaxFrames) {
+            const Entry& entry = m_poseBuffer[slot - 1];
+            if (entry.frame.targetTimestampNs == timestampNs) {
+                return entry.frame;
+            }
+        }
+
+        // Index collision, look for it the slow way
+        size_t size = std::min(m_poseBufferSize, MaxFrames);
+        for (size_t i = 1; i <= size; ++i) {
+            const Entry& entry = m_poseBuffer[(m_poseBufferHead + MaxFrames - i) % MaxFrames];
+            if (entry.frame.targetTimestampNs == timestampNs) {
+                return entry.frame;
+            }
+        }
+        return {};
+    });
+
+    if (!match) {
+        Debug("PoseHistory::GetPoseAt: No pose matched.");
     }
+    return match;
+}
+
+std::optional<PoseHistory::TrackingHistoryFrame> PoseHistory::GetLatestPose() const {
+    return Read([&]() -> std::optional<TrackingHistoryFrame> {
+        if (m_poseBufferSize == 0) {
+            return {};
+        }
+        return m_poseBuffer[(m_poseBufferHead + MaxFrames - 1) % MaxFrames].frame;
+    });
+}
+
+PoseHistory::Stats PoseHistory::GetStats() const {
+    return {
+        m_writes.load(std::memory_order_relaxed),
+        m_reads.load(std::memory_order_relaxed),
+        m_readRetries.load(std::memory_order_relaxed),
+    };
+}
 
-    Debug("PoseHistory::GetPoseAt: No pose matched.");
-    return {};
+uint64_t PoseHistory::Fingerprint(const vr::HmdMatrix34_t& rotation) {
+    // FNV-1a over the rotation quantized to ~2.5e-4
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            hash ^= (uint32_t)std::lround(rotation.m[i][j] * 4096.0f);
+            hash *= 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+float PoseHistory::Distance(const vr::HmdMatrix34_t& a, const vr::HmdMatrix34_t& b) {
+    // Rotation matrix composes a part of ViewMatrix of TrackingInfo.
+    // Be carefull of transpose.
+    // And bottom side and right side of matrix should not be compared, because pPose does not
+    // contain that part of matrix.
+    float distance = 0;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            float diff = a.m[j][i] - b.m[j][i];
+            distance += diff * diff;
+        }
+    }
+    return distance;
 }
 
 void PoseHistory::SetTransform(const vr::HmdMatrix34_t& transform) {
-    std::unique_lock<std::mutex> lock(m_mutex);
+    std::unique_lock<std::mutex> lock(m_transformMutex);
     m_transform = transform;
 
     for (int i = 0; i < 3; ++i) {
@@ -3,10 +3,13 @@
 #include "ALVR-common/packet_types.h"
 #include "openvr_driver_wrap.h"
 
-#include <list>
+#include <array>
+#include <atomic>
 #include <mutex>
 #include <optional>
 
+// Written by the tracking thread only, read from the encoder threads. Readers go through a
+// seqlock and retry if a pose was pushed meanwhile, so they never block the writer.
 class PoseHistory {
 public:
     struct TrackingHistoryFrame {
@@ -15,17 +18,64 @@ public:
         vr::HmdMatrix34_t rotationMatrix;
     };
 
+    struct Stats {
+        uint64_t writes;
+        uint64_t reads;
+        // Reads that overlapped with a write and had to be redone
+        uint64_t readRetries;
+    };
+
     void OnPoseUpdated(uint64_t targetTimestampNs, FfiDeviceMotion motion);
 
     std::optional<TrackingHistoryFrame> GetBestPoseMatch(const vr::HmdMatrix34_t& pose) const;
+    // Same for a pose that is known to be no newer than newestTimestampNs, the newest pose given to
+    // SteamVR when the frame was presented. The match is then almost always that entry or the one
+    // before, and an older entry that looks alike can't be picked instead
+    std::optional<TrackingHistoryFrame>
+    GetPoseMatchUpTo(const vr::HmdMatrix34_t& pose, uint64_t newestTimestampNs) const;
     // Return the most recent pose known at the given timestamp
     std::optional<TrackingHistoryFrame> GetPoseAt(uint64_t timestampNs) const;
+    // The pose pushed last, the newest prediction from the client
+    std::optional<TrackingHistoryFrame> GetLatestPose() const;
 
     void SetTransform(const vr::HmdMatrix34_t& transform);
 
+    Stats GetStats() const;
+
 private:
-    mutable std::mutex m_mutex;
-    std::list<TrackingHistoryFrame> m_poseBuffer;
+    // The value should match with the client's MAXIMUM_TRACKING_FRAMES in ovr_context.cpp
+    static constexpr size_t MaxFrames = 120 * 3;
+    // Direct mapped, a collision only loses the fast path
+    static constexpr size_t IndexSize = 1024;
+
+    struct Entry {
+        TrackingHistoryFrame frame;
+        uint64_t fingerprint;
+    };
+
+    // Hash of the quantized rotation, the pose submitted with a frame is the one we gave to
+    // SteamVR so it normally lands on the same value as the history entry
+    static uint64_t Fingerprint(const vr::HmdMatrix34_t& rotation);
+    static float Distance(const vr::HmdMatrix34_t& a, const vr::HmdMatrix34_t& b);
+
+    template <typename F> std::optional<TrackingHistoryFrame> Read(F read) const;
+
+    // Odd while the writer is updating the buffer
+    std::atomic<uint32_t> m_sequence { 0 };
+    // Ring buffer, m_poseBufferHead is the slot the next pose is written to
+    std::array<Entry, MaxFrames> m_poseBuffer;
+    size_t m_poseBufferHead = 0;
+    size_t m_poseBufferSize = 0;
+    // Slot + 1 of the most recent entry for a timestamp and a fingerprint, 0 if none
+    std::array<uint16_t, IndexSize> m_timestampIndex = {};
+    std::array<uint16_t, IndexSize> m_fingerprintIndex = {};
+
+    mutable std::atomic<uint64_t> m_writes { 0 };
+    mutable std::atomic<uint64_t> m_reads { 0 };
+    mutable std::atomic<uint64_t> m_readRetries { 0 };
+
+    // Only shared between the writer and SetTransform
+    std::mutex m_transformMutex;
     vr::HmdMatrix34_t m_transform
         = { { { 1.0, 0.0, 0.0, 0.0 }, { 0.0, 1.0, 0.0, 0.0 }, { 0.0, 0.0, 1.0, 0.0 } } };
     bool m_transformIdentity = true;
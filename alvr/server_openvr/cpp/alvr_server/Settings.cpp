@@ -16,6 +16,16 @@ extern uint64_t g_DriverTestMode;
 
 Settings Settings::m_Instance;
 
+namespace {
+ThreadRoleConfig ReadThreadRole(const picojson::value& config, const std::string& role) {
+    ThreadRoleConfig threadConfig;
+    threadConfig.priority
+        = (ThreadPriority)config.get("thread_" + role + "_priority").get<int64_t>();
+    threadConfig.cpuMask = (uint64_t)config.get("thread_" + role + "_cpu_mask").get<int64_t>();
+    return threadConfig;
+}
+}
+
 Settings::Settings()
     : m_loaded(false) { }
 
@@ -44,7 +54,9 @@ void Settings::Load() {
         m_recommendedTargetWidth = config.get("target_eye_resolution_width").get<int64_t>() * 2;
         m_recommendedTargetHeight = config.get("target_eye_resolution_height").get<int64_t>();
         m_nAdapterIndex = (int32_t)config.get("adapter_index").get<int64_t>();
+        m_encoderAdapterIndex = (int32_t)config.get("encoder_adapter_index").get<int64_t>();
         m_captureFrameDir = config.get("capture_frame_dir").get<std::string>();
+        m_captureFrameCount = (uint32_t)config.get("capture_frame_count").get<int64_t>();
 
         m_enableFoveatedEncoding = config.get("enable_foveated_encoding").get<bool>();
         m_foveationCenterSizeX = (float)config.get("foveation_center_size_x").get<double>();
@@ -53,6 +65,12 @@ void Settings::Load() {
         m_foveationCenterShiftY = (float)config.get("foveation_center_shift_y").get<double>();
         m_foveationEdgeRatioX = (float)config.get("foveation_edge_ratio_x").get<double>();
         m_foveationEdgeRatioY = (float)config.get("foveation_edge_ratio_y").get<double>();
+        m_foveatedQpMaxDelta = (int)config.get("foveated_qp_max_delta").get<int64_t>();
+        m_foveatedQpFollowGaze = config.get("foveated_qp_follow_gaze").get<bool>();
+        m_enableRadialFoveation = config.get("enable_radial_foveation").get<bool>();
+        m_radialFoveationCenterRadius
+            = (float)config.get("radial_foveation_center_radius").get<double>();
+        m_radialFoveationEdgeRatio = (float)config.get("radial_foveation_edge_ratio").get<double>();
 
         m_enableColorCorrection = config.get("enable_color_correction").get<bool>();
         m_brightness = (float)config.get("brightness").get<double>();
@@ -60,12 +78,38 @@ void Settings::Load() {
         m_saturation = (float)config.get("saturation").get<double>();
         m_gamma = (float)config.get("gamma").get<double>();
         m_sharpening = (float)config.get("sharpening").get<double>();
+        m_colorLutPath = config.get("color_lut_path").get<std::string>();
+        m_hiddenAreaMaskRadius = (float)config.get("hidden_area_mask_radius").get<double>();
+        m_edgeAdaptiveUpscaling = config.get("edge_adaptive_upscaling").get<bool>();
 
         m_codec = (int32_t)config.get("codec").get<int64_t>();
         m_h264Profile = (int32_t)config.get("h264_profile").get<int64_t>();
         m_rateControlMode = (uint32_t)config.get("rate_control_mode").get<int64_t>();
         m_fillerData = config.get("filler_data").get<bool>();
         m_entropyCoding = (uint32_t)config.get("entropy_coding").get<int64_t>();
+        m_gradualIntraRefresh = config.get("gradual_intra_refresh").get<bool>();
+        m_gradualIntraRefreshPeriod
+            = (uint32_t)config.get("gradual_intra_refresh_period").get<int64_t>();
+        m_encoderFrameQueueDepth
+            = (uint32_t)config.get("encoder_frame_queue_depth").get<int64_t>();
+        m_encoderTargetLatencyMs
+            = (uint32_t)config.get("encoder_target_latency_ms").get<int64_t>();
+        m_encoderOverlayQpReduction
+            = (uint32_t)config.get("encoder_overlay_qp_reduction").get<int64_t>();
+        m_encoderWarmupFrames = (uint32_t)config.get("encoder_warmup_frames").get<int64_t>();
+        m_encoderTemporalLayers
+            = (uint32_t)config.get("encoder_temporal_layers").get<int64_t>();
+        m_encoderSliceSizeBytes
+            = (uint32_t)config.get("encoder_slice_size_bytes").get<int64_t>();
+        m_encoderSendQueueDepth
+            = (uint32_t)config.get("encoder_send_queue_depth").get<int64_t>();
+        m_encoderSendQueueDropOldest = config.get("encoder_send_queue_drop_oldest").get<bool>();
+        m_encoderLowLatencyHeaders = config.get("encoder_low_latency_headers").get<bool>();
+        m_encoderFrameMetadata = config.get("encoder_frame_metadata").get<bool>();
+        m_encoderLoadBudgetPercent
+            = (uint32_t)config.get("encoder_load_budget_percent").get<int64_t>();
+        m_encoderTileColumns = (uint32_t)config.get("encoder_tile_columns").get<int64_t>();
+        m_encoderTileRows = (uint32_t)config.get("encoder_tile_rows").get<int64_t>();
         m_use10bitEncoder = config.get("use_10bit_encoder").get<bool>();
         m_encodingGamma = config.get("encoding_gamma").get<double>();
         m_enableHdr = config.get("enable_hdr").get<bool>();
@@ -77,11 +121,17 @@ void Settings::Load() {
         m_useAmfPreproc = config.get("use_amf_preproc").get<bool>();
         m_amfPreProcSigma = (uint32_t)config.get("amf_preproc_sigma").get<int64_t>();
         m_amfPreProcTor = (uint32_t)config.get("amf_preproc_tor").get<int64_t>();
+        m_amfDrainThreads = config.get("amf_drain_threads").get<bool>();
+        m_amfQualityProbeInterval
+            = (uint32_t)config.get("amf_quality_probe_interval").get<int64_t>();
         m_encoderQualityPreset = (uint32_t)config.get("encoder_quality_preset").get<int64_t>();
         m_amdBitrateCorruptionFix = (bool)config.get("amd_bitrate_corruption_fix").get<bool>();
         m_nvencQualityPreset = (uint32_t)config.get("nvenc_quality_preset").get<int64_t>();
         m_force_sw_encoding = config.get("force_sw_encoding").get<bool>();
         m_swThreadCount = (int32_t)config.get("sw_thread_count").get<int64_t>();
+        m_swSubFrameOutput = config.get("sw_sub_frame_output").get<bool>();
+        m_swGpuColorConversion = config.get("sw_gpu_color_conversion").get<bool>();
+        m_swArm64FrameSharing = config.get("sw_arm64_frame_sharing").get<bool>();
 
         m_nvencTuningPreset = (uint32_t)config.get("nvenc_tuning_preset").get<int64_t>();
         m_nvencMultiPass = (uint32_t)config.get("nvenc_multi_pass").get<int64_t>();
@@ -102,13 +152,41 @@ void Settings::Load() {
         m_nvencRcAverageBitrate = config.get("rc_average_bitrate").get<int64_t>();
         m_nvencEnableWeightedPrediction
             = config.get("nvenc_enable_weighted_prediction").get<bool>();
+        m_nvencAsyncOutput = config.get("nvenc_async_output").get<bool>();
+        m_nvencHeadMotionHints = config.get("nvenc_head_motion_hints").get<bool>();
+        m_nvencSplitEncode = (uint32_t)config.get("nvenc_split_encode").get<int64_t>();
+        m_nvencSubFrameSlices = (uint32_t)config.get("nvenc_sub_frame_slices").get<int64_t>();
 
         m_minimumIdrIntervalMs = config.get("minimum_idr_interval_ms").get<int64_t>();
+        m_referenceFrameInvalidation = config.get("reference_frame_invalidation").get<bool>();
+        m_skipStaticFrames = config.get("skip_static_frames").get<bool>();
+        m_skipDuplicateFrames = config.get("skip_duplicate_frames").get<bool>();
+        m_lateLatchPose = config.get("late_latch_pose").get<bool>();
+        m_shareDepthSwapTextures = config.get("share_depth_swap_textures").get<bool>();
+        m_dynamicResolutionEnabled = config.get("dynamic_resolution_enabled").get<bool>();
+        m_dynamicResolutionFullMbps
+            = (uint32_t)config.get("dynamic_resolution_full_mbps").get<int64_t>();
+        m_dynamicResolutionMinScale
+            = (float)config.get("dynamic_resolution_min_scale").get<double>();
+        m_spectatorStreamEnabled = config.get("spectator_stream_enabled").get<bool>();
+        m_spectatorWidth = (uint32_t)config.get("spectator_width").get<int64_t>();
+        m_spectatorFramerateDivisor
+            = (uint32_t)config.get("spectator_framerate_divisor").get<int64_t>();
+        m_spectatorBitrateMbps = (uint32_t)config.get("spectator_bitrate_mbps").get<int64_t>();
 
         m_enableViveTrackerProxy = config.get("enable_vive_tracker_proxy").get<bool>();
         m_TrackingRefOnly = config.get("tracking_ref_only").get<bool>();
         m_enableLinuxVulkanAsyncCompute = config.get("linux_async_compute").get<bool>();
         m_enableLinuxAsyncReprojection = config.get("linux_async_reprojection").get<bool>();
+        m_enableLinuxPipelinedEncoding = config.get("linux_pipelined_encoding").get<bool>();
+        m_enableLinuxAsyncOutput = config.get("linux_async_output").get<bool>();
+        m_linuxSingleFrameVbv = config.get("linux_single_frame_vbv").get<bool>();
+        m_linuxEncodeDevice = config.get("linux_encode_device").get<std::string>();
+        m_linuxVaapiColorCorrection = config.get("linux_vaapi_color_correction").get<bool>();
+        m_linuxVaapiAsyncDepth = (uint32_t)config.get("linux_vaapi_async_depth").get<int64_t>();
+        m_linuxVaapiDenoise = (uint32_t)config.get("linux_vaapi_denoise").get<int64_t>();
+        m_linuxVaapiDenoiseMaxBitrateMbps
+            = (uint32_t)config.get("linux_vaapi_denoise_max_bitrate_mbps").get<int64_t>();
 
         m_enableControllers = config.get("controllers_enabled").get<bool>();
         m_controllerIsTracker = config.get("controller_is_tracker").get<bool>();
@@ -116,8 +194,20 @@ void Settings::Load() {
         m_enableBodyTrackingFakeVive = config.get("body_tracking_vive_enabled").get<bool>();
         m_bodyTrackingHasLegs = config.get("body_tracking_has_legs").get<bool>();
 
+        m_poseFilterHead = config.get("pose_filter_head").get<bool>();
+        m_poseFilterTrackers = config.get("pose_filter_trackers").get<bool>();
+        m_poseFilterMinCutoffHz = (float)config.get("pose_filter_min_cutoff_hz").get<double>();
+        m_poseFilterBeta = (float)config.get("pose_filter_beta").get<double>();
+        m_poseFilterTrackerPredictionS
+            = (float)config.get("pose_filter_tracker_prediction_s").get<double>();
+
         m_useSeparateHandTrackers = config.get("use_separate_hand_trackers").get<bool>();
 
+        m_encoderThread = ReadThreadRole(config, "encoder");
+        m_encoderOutputThread = ReadThreadRole(config, "encoder_output");
+        m_trackingThread = ReadThreadRole(config, "tracking");
+        m_gpuPriority = (ThreadPriority)config.get("gpu_priority").get<int64_t>();
+
         Info("Render Target: %d %d\n", m_renderWidth, m_renderHeight);
         Info("Refresh Rate: %d\n", m_refreshRate);
         m_loaded = true;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ALVR-common/packet_types.h"
+#include "ThreadPolicy.h"
 #include <string>
 
 class Settings {
@@ -16,13 +17,22 @@ public:
 
     bool IsLoaded() { return m_loaded; }
 
+    // Derived from the fields below when asked, so that they follow the overrides of the encode
+    // benchmark. H.264 has no 10 bit profile the encoders support, its frames stay 8 bit
+    bool Uses10bitOutput() const {
+        return m_use10bitEncoder && (m_codec == ALVR_CODEC_HEVC || m_codec == ALVR_CODEC_AV1);
+    }
+
     int m_refreshRate;
     uint32_t m_renderWidth;
     uint32_t m_renderHeight;
     int32_t m_recommendedTargetWidth;
     int32_t m_recommendedTargetHeight;
     int32_t m_nAdapterIndex;
+    // -1 to encode on m_nAdapterIndex, or on another adapter if it has no hardware encoder
+    int32_t m_encoderAdapterIndex;
     std::string m_captureFrameDir;
+    uint32_t m_captureFrameCount;
 
     bool m_enableFoveatedEncoding;
     float m_foveationCenterSizeX;
@@ -31,6 +41,13 @@ public:
     float m_foveationCenterShiftY;
     float m_foveationEdgeRatioX;
     float m_foveationEdgeRatioY;
+    // 0 disables the QP map of foveated encoding
+    int m_foveatedQpMaxDelta;
+    bool m_foveatedQpFollowGaze;
+    // Compress around the lens center instead of along each axis
+    bool m_enableRadialFoveation;
+    float m_radialFoveationCenterRadius;
+    float m_radialFoveationEdgeRatio;
 
     bool m_enableColorCorrection;
     float m_brightness;
@@ -38,6 +55,11 @@ public:
     float m_saturation;
     float m_gamma;
     float m_sharpening;
+    // .cube file baked into the color LUT of the post-processing, empty for none
+    std::string m_colorLutPath;
+    // Relative to the field of view of each eye, 0 without the hidden area mask
+    float m_hiddenAreaMaskRadius;
+    bool m_edgeAdaptiveUpscaling;
 
     int m_codec;
     int m_h264Profile;
@@ -52,14 +74,48 @@ public:
     bool m_useAmfPreproc;
     uint32_t m_amfPreProcSigma;
     uint32_t m_amfPreProcTor;
+    bool m_amfDrainThreads;
+    uint32_t m_amfQualityProbeInterval;
     uint32_t m_encoderQualityPreset;
     bool m_amdBitrateCorruptionFix;
     uint32_t m_nvencQualityPreset;
     uint32_t m_rateControlMode;
     bool m_fillerData;
     uint32_t m_entropyCoding;
+    bool m_gradualIntraRefresh;
+    uint32_t m_gradualIntraRefreshPeriod;
+    // Frames that can wait for the encoder on Windows, the oldest being dropped when full
+    uint32_t m_encoderFrameQueueDepth;
+    // Motion-to-photon latency the encoder paces itself for, 0 for none
+    uint32_t m_encoderTargetLatencyMs;
+    // QP offset removed where the overlay layers cover the frame, 0 for none
+    uint32_t m_encoderOverlayQpReduction;
+    // Blank frames encoded and discarded on Windows before the stream, 0 for none
+    uint32_t m_encoderWarmupFrames;
+    // Temporal layers of the stream, 1 for none. The frames above the base layer can be dropped
+    uint32_t m_encoderTemporalLayers;
+    // Budget of each slice and of each packet it's sent in, 0 if the slices aren't sized to them
+    uint32_t m_encoderSliceSizeBytes;
+    // Frames waiting for the sender thread, 0 if they are sent from the encoder threads. When the
+    // queue is full the oldest ones are dropped, or else the new one, see VideoSendQueue
+    uint32_t m_encoderSendQueueDepth;
+    bool m_encoderSendQueueDropOldest;
+    // The parameter sets signal no reordering, the SEI and filler NALs are stripped, see
+    // LowLatencyHeaders.h
+    bool m_encoderLowLatencyHeaders;
+    // FrameMetadata in front of the first slice of each frame
+    bool m_encoderFrameMetadata;
+    // Share of the frame interval the encode may take before EncodeLoadControl steps in, 0 when
+    // disabled
+    uint32_t m_encoderLoadBudgetPercent;
+    // Grid the client decodes in parallel: tiles for AV1, as many slices for H264 and HEVC
+    uint32_t m_encoderTileColumns;
+    uint32_t m_encoderTileRows;
     bool m_force_sw_encoding;
     uint32_t m_swThreadCount;
+    bool m_swSubFrameOutput;
+    bool m_swGpuColorConversion;
+    bool m_swArm64FrameSharing;
 
     uint32_t m_nvencTuningPreset;
     uint32_t m_nvencMultiPass;
@@ -78,17 +134,54 @@ public:
     int64_t m_nvencRcMaxBitrate;
     int64_t m_nvencRcAverageBitrate;
     bool m_nvencEnableWeightedPrediction;
+    bool m_nvencAsyncOutput;
+    bool m_nvencHeadMotionHints;
+    uint32_t m_nvencSplitEncode;
+    uint32_t m_nvencSubFrameSlices;
 
     uint64_t m_minimumIdrIntervalMs;
+    bool m_referenceFrameInvalidation;
+    bool m_skipStaticFrames;
+    bool m_skipDuplicateFrames;
+    bool m_lateLatchPose;
+    bool m_shareDepthSwapTextures;
+    bool m_dynamicResolutionEnabled = false;
+    uint32_t m_dynamicResolutionFullMbps;
+    float m_dynamicResolutionMinScale;
+    bool m_spectatorStreamEnabled = false;
+    uint32_t m_spectatorWidth;
+    uint32_t m_spectatorFramerateDivisor;
+    uint32_t m_spectatorBitrateMbps;
 
     bool m_enableViveTrackerProxy = false;
     bool m_TrackingRefOnly = false;
     bool m_enableLinuxVulkanAsyncCompute;
     bool m_enableLinuxAsyncReprojection;
+    bool m_enableLinuxPipelinedEncoding;
+    bool m_enableLinuxAsyncOutput;
+    bool m_linuxSingleFrameVbv;
+    std::string m_linuxEncodeDevice;
+    bool m_linuxVaapiColorCorrection;
+    uint32_t m_linuxVaapiAsyncDepth;
+    // denoise_vaapi strength, 0 disables it
+    uint32_t m_linuxVaapiDenoise;
+    uint32_t m_linuxVaapiDenoiseMaxBitrateMbps;
 
     bool m_enableControllers;
     int m_controllerIsTracker = false;
     int m_enableBodyTrackingFakeVive = false;
     int m_bodyTrackingHasLegs = false;
+
+    bool m_poseFilterHead = false;
+    bool m_poseFilterTrackers = false;
+    float m_poseFilterMinCutoffHz;
+    float m_poseFilterBeta;
+    float m_poseFilterTrackerPredictionS;
     bool m_useSeparateHandTrackers = false;
+
+    ThreadRoleConfig m_encoderThread;
+    ThreadRoleConfig m_encoderOutputThread;
+    ThreadRoleConfig m_trackingThread;
+    // Windows only, High and Realtime are the D3DKMT scheduling priority classes
+    ThreadPriority m_gpuPriority;
 };
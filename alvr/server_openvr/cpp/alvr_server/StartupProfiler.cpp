@@ -0,0 +1,81 @@
+#include "StartupProfiler.h"
+
+#include "FrameTrace.h"
+#include "Logger.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace {
+std::atomic<uint64_t> g_startupBeginNs = 0;
+
+std::atomic<uint64_t> g_streamBeginNs = 0;
+std::array<std::atomic<uint64_t>, StreamStart::STEP_COUNT> g_streamStepsNs = {};
+
+const char* STREAM_STEP_NAMES[StreamStart::STEP_COUNT] = {
+    "streaming start", "encoder created",  "compositor connected", "compositor fds received",
+    "first present",   "first pose match", "first IDR sent",
+};
+}
+
+StartupStep::StartupStep(std::string name)
+    : m_name(std::move(name))
+    , m_beginNs(FrameTrace::Now()) { }
+
+StartupStep::~StartupStep() {
+    uint64_t endNs = FrameTrace::Now();
+    uint64_t startupBeginNs = g_startupBeginNs.load(std::memory_order_relaxed);
+    Info(
+        "Startup: %s took %.1f ms, done %.1f ms after driver load\n",
+        m_name.c_str(),
+        (endNs - m_beginNs) / 1e6,
+        startupBeginNs != 0 ? (endNs - startupBeginNs) / 1e6 : 0.0
+    );
+}
+
+void StartupStep::Begin() { g_startupBeginNs = FrameTrace::Now(); }
+
+void StreamStart::Begin() {
+    for (auto& stepNs : g_streamStepsNs) {
+        stepNs = 0;
+    }
+    g_streamBeginNs = FrameTrace::Now();
+}
+
+void StreamStart::Mark(Step step) {
+    uint64_t beginNs = g_streamBeginNs.load(std::memory_order_relaxed);
+    if (beginNs == 0 || g_streamStepsNs[step].load(std::memory_order_relaxed) != 0) {
+        return;
+    }
+    uint64_t expected = 0;
+    if (!g_streamStepsNs[step].compare_exchange_strong(expected, FrameTrace::Now())) {
+        return;
+    }
+    if (step != FIRST_IDR_SENT) {
+        return;
+    }
+
+    // In the order they happened. Steps done for an earlier connection, or that the platform
+    // doesn't have, are left out
+    std::vector<std::pair<uint64_t, int>> done;
+    for (int i = 0; i < STEP_COUNT; i++) {
+        uint64_t stepNs = g_streamStepsNs[i].load(std::memory_order_relaxed);
+        if (stepNs != 0) {
+            done.push_back({ stepNs, i });
+        }
+    }
+    std::sort(done.begin(), done.end());
+
+    std::string breakdown;
+    for (auto& [stepNs, i] : done) {
+        char entry[96];
+        snprintf(
+            entry, sizeof(entry), "\n  %s: %.1f ms", STREAM_STEP_NAMES[i], (stepNs - beginNs) / 1e6
+        );
+        breakdown += entry;
+    }
+    Info("Stream start, after the client connected:%s\n", breakdown.c_str());
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+// Logs how long a step of the driver startup took and when it ended, counted from when the driver
+// was loaded, to see what a cold SteamVR start waits for. Steps can overlap and run on any thread.
+class StartupStep {
+public:
+    explicit StartupStep(std::string name);
+    ~StartupStep();
+
+    // Starts the clock the steps are counted from, at driver load
+    static void Begin();
+
+private:
+    std::string m_name;
+    uint64_t m_beginNs;
+};
+
+// Times the steps from a client connection to the first IDR sent, to see what a reconnect waits
+// for. Each step counts once per connection, the breakdown is logged with the first IDR. Steps
+// done for an earlier connection, like the encoder creation, aren't in it.
+class StreamStart {
+public:
+    enum Step {
+        STREAMING_START,
+        ENCODER_CREATED,
+        COMPOSITOR_CONNECTED,
+        COMPOSITOR_FDS_RECEIVED,
+        FIRST_PRESENT,
+        FIRST_POSE_MATCH,
+        FIRST_IDR_SENT,
+        STEP_COUNT,
+    };
+
+    // A client connected, the steps are counted from now
+    static void Begin();
+    // Cheap once the step was marked, it can be called for every frame
+    static void Mark(Step step);
+};
@@ -0,0 +1,75 @@
+#include "SvtAv1Config.h"
+#include "Settings.h"
+#include <algorithm>
+#include <cstdlib>
+#include <thread>
+
+namespace {
+// SVT-AV1 takes up to 16 tile columns and rows, as log2
+const int MAX_TILE_LOG2 = 4;
+// Narrower tiles cost more bits than their threads save
+const uint32_t MIN_TILE_SIZE = 256;
+
+int CeilLog2(uint32_t value) {
+    int log2 = 0;
+    while ((1u << log2) < value) {
+        log2++;
+    }
+    return log2;
+}
+}
+
+bool SvtAv1Config::Enabled() {
+    return Settings::Instance().m_codec == ALVR_CODEC_AV1 && ThreadCount() >= MIN_THREADS;
+}
+
+uint32_t SvtAv1Config::ThreadCount() {
+    uint32_t threads = Settings::Instance().m_swThreadCount;
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    return threads;
+}
+
+int SvtAv1Config::Preset(uint32_t width, uint32_t height, float framerate) {
+    double pixelRate = (double)width * height * framerate / std::max(ThreadCount(), 1u);
+    // 12 and 13 are the realtime presets, the slower ones only when a thread has little to do
+    if (pixelRate < 15e6) {
+        return 10;
+    }
+    if (pixelRate < 30e6) {
+        return 11;
+    }
+    if (pixelRate < 60e6) {
+        return 12;
+    }
+    return 13;
+}
+
+std::string SvtAv1Config::Params(uint32_t width, uint32_t height) {
+    const Settings& settings = Settings::Instance();
+    uint32_t threads = ThreadCount();
+
+    // One tile per two threads, the others encode the superblock rows of the tiles in parallel
+    int columnsLog2 = std::min(CeilLog2(settings.m_encoderTileColumns), MAX_TILE_LOG2);
+    int rowsLog2 = std::min(CeilLog2(settings.m_encoderTileRows), MAX_TILE_LOG2);
+    while ((2u << (columnsLog2 + rowsLog2)) <= threads) {
+        if (columnsLog2 < MAX_TILE_LOG2 && (width >> (columnsLog2 + 1)) >= MIN_TILE_SIZE) {
+            columnsLog2++;
+        } else if (rowsLog2 < MAX_TILE_LOG2 && (height >> (rowsLog2 + 1)) >= MIN_TILE_SIZE) {
+            rowsLog2++;
+        } else {
+            break;
+        }
+    }
+
+    // pred-struct=1 is low delay: no B frames nor lookahead, each frame comes out once encoded.
+    // Scene changes would insert key frames that the rate control can't afford
+    return "pred-struct=1:keyint=-1:scd=0:enable-overlays=0:lp=" + std::to_string(threads)
+        + ":tile-columns=" + std::to_string(columnsLog2)
+        + ":tile-rows=" + std::to_string(rowsLog2);
+}
+
+bool SvtAv1Config::NeedsReopen(int64_t openBitrate, int64_t bitrate) {
+    return std::llabs(bitrate - openBitrate) * 4 > openBitrate;
+}
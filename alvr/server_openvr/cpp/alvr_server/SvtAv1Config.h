@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Realtime configuration of SVT-AV1 for the software encoders of both platforms, used through the
+// libsvtav1 encoder of libavcodec. It gets a better quality per bit than x264 at Wi-Fi bitrates,
+// but only keeps up with the frame interval on enough cores, so below MIN_THREADS the software
+// encoders stay on H.264.
+class SvtAv1Config {
+public:
+    // Hardware threads, or m_swThreadCount, below which SVT-AV1 isn't used
+    static const uint32_t MIN_THREADS = 8;
+
+    // AV1 was asked for and there are enough threads for it
+    static bool Enabled();
+
+    // m_swThreadCount, or one per hardware thread
+    static uint32_t ThreadCount();
+
+    // Fastest presets for the pixel rate each thread has to encode
+    static int Preset(uint32_t width, uint32_t height, float framerate);
+
+    // svtav1-params option: low delay prediction without key frames but the requested ones, and
+    // tiles for the threads that also cover the tiles of the client decoder
+    static std::string Params(uint32_t width, uint32_t height);
+
+    // libavcodec can't change the bitrate of an open SVT-AV1 encoder, it must be reopened, which
+    // starts on a key frame. So only changes of more than a quarter from the bitrate it was opened
+    // with are applied, the rate control absorbs the smaller ones
+    static bool NeedsReopen(int64_t openBitrate, int64_t bitrate);
+};
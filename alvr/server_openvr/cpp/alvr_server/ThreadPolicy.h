@@ -0,0 +1,152 @@
+#pragma once
+
+// Scheduling policy of the latency critical threads of the driver and of the Vulkan layer.
+// Header only, so that the layer can use it without linking the driver.
+
+#include <cstdint>
+#include <string>
+
+#ifdef _WIN32
+#pragma warning(disable : 4005)
+#include <WinSock2.h>
+#pragma warning(default : 4005)
+#include <Windows.h>
+#include <avrt.h>
+#pragma comment(lib, "avrt.lib")
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Must match the order of ThreadPriority in settings.rs
+enum class ThreadPriority : uint32_t {
+    // Leave the thread as the OS or the code creating it set it up
+    Default = 0,
+    High = 1,
+    Realtime = 2,
+};
+
+enum class ThreadRole {
+    Encoder,
+    EncoderOutput,
+    Vsync,
+    Tracking,
+};
+
+struct ThreadRoleConfig {
+    ThreadPriority priority = ThreadPriority::Default;
+    // Bit N allows core N, 0 leaves the affinity alone
+    uint64_t cpuMask = 0;
+};
+
+inline const char* ThreadRoleName(ThreadRole role) {
+    switch (role) {
+    case ThreadRole::Encoder:
+        return "encoder";
+    case ThreadRole::EncoderOutput:
+        return "encoder output";
+    case ThreadRole::Vsync:
+        return "vsync";
+    case ThreadRole::Tracking:
+        return "tracking";
+    }
+    return "unknown";
+}
+
+// Applies the policy to the calling thread as far as the OS allows it. Returns a description of
+// what was actually granted, for the log. A policy that can't be granted never fails the caller.
+inline std::string ApplyThreadRole(ThreadRole role, const ThreadRoleConfig& config) {
+    std::string report = std::string(ThreadRoleName(role)) + " thread:";
+
+    if (config.priority == ThreadPriority::Default) {
+        report += " default priority";
+    }
+#ifdef _WIN32
+    else {
+        // MMCSS boosts the thread into the realtime range while it is registered, without needing
+        // the process to run as admin. The registration lasts until the thread exits.
+        const wchar_t* task = config.priority == ThreadPriority::Realtime ? L"Pro Audio" : L"Games";
+        DWORD taskIndex = 0;
+        HANDLE mmcss = AvSetMmThreadCharacteristicsW(task, &taskIndex);
+        if (mmcss != NULL) {
+            AvSetMmThreadPriority(
+                mmcss,
+                config.priority == ThreadPriority::Realtime ? AVRT_PRIORITY_CRITICAL
+                                                            : AVRT_PRIORITY_HIGH
+            );
+            report += config.priority == ThreadPriority::Realtime ? " MMCSS Pro Audio"
+                                                                   : " MMCSS Games";
+        } else {
+            int priority = config.priority == ThreadPriority::Realtime
+                ? THREAD_PRIORITY_TIME_CRITICAL
+                : THREAD_PRIORITY_HIGHEST;
+            if (SetThreadPriority(GetCurrentThread(), priority)) {
+                report += " MMCSS unavailable, thread priority "
+                    + std::to_string(GetThreadPriority(GetCurrentThread()));
+            } else {
+                report += " priority not granted";
+            }
+        }
+    }
+
+    if (config.cpuMask != 0) {
+        if (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)config.cpuMask) != 0) {
+            report += ", affinity mask " + std::to_string(config.cpuMask);
+        } else {
+            report += ", affinity not granted";
+        }
+    }
+#elif defined(__linux__)
+    else {
+        bool granted = false;
+        if (config.priority == ThreadPriority::Realtime) {
+            // Low realtime levels, so that audio and the compositor still preempt us. The vsync
+            // thread paces the frames, so it goes above the others.
+            int level = role == ThreadRole::Vsync ? 3 : role == ThreadRole::Tracking ? 1 : 2;
+            sched_param param = {};
+            param.sched_priority = level;
+            if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0) {
+                report += " SCHED_FIFO " + std::to_string(level);
+                granted = true;
+            }
+        }
+        if (!granted) {
+            // Needs CAP_SYS_NICE or a RLIMIT_NICE/RLIMIT_RTPRIO allowance, the regular case
+            // without one is to only get the default priority
+            int nice = config.priority == ThreadPriority::Realtime ? -15 : -10;
+            if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), nice) == 0) {
+                report += " nice " + std::to_string(nice);
+            } else {
+                report += " priority not granted (missing CAP_SYS_NICE)";
+            }
+        }
+    }
+
+    if (config.cpuMask != 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        for (int core = 0; core < 64 && core < CPU_SETSIZE; core++) {
+            if (config.cpuMask & (1ull << core)) {
+                CPU_SET(core, &cpuset);
+            }
+        }
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) == 0) {
+            report += ", affinity mask " + std::to_string(config.cpuMask);
+        } else {
+            report += ", affinity not granted";
+        }
+    }
+#else
+    else {
+        report += " priority unsupported on this platform";
+    }
+    if (config.cpuMask != 0) {
+        report += ", affinity unsupported on this platform";
+    }
+#endif
+
+    return report;
+}
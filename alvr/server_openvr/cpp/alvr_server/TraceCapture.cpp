@@ -0,0 +1,137 @@
+#include "TraceCapture.h"
+
+#include "FrameTrace.h"
+#include "Logger.h"
+#include <algorithm>
+#include <fstream>
+
+namespace {
+// Bounds the memory used if the spans are much denser than expected
+const size_t MAX_SPANS = 1 << 20;
+
+const char* GPU_TRACK_NAMES[] = { "", "GPU compositor" };
+}
+
+TraceCapture TraceCapture::m_instance;
+
+void TraceCapture::Start(const char* path, float durationS) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_active.load(std::memory_order_relaxed)) {
+        Warn("A trace capture is already running\n");
+        return;
+    }
+
+    m_path = path;
+    m_endNs = FrameTrace::Now() + (uint64_t)(durationS * 1e9);
+    m_spans.clear();
+    m_threads.clear();
+    m_active.store(true, std::memory_order_relaxed);
+
+    Info("Capturing a trace of %.0fs to %s\n", durationS, path);
+}
+
+void TraceCapture::AddSpan(
+    const char* name, uint64_t beginNs, uint64_t endNs, uint64_t targetTimestampNs
+) {
+    if (IsActive()) {
+        Add({ name, 0, beginNs, endNs, targetTimestampNs });
+    }
+}
+
+void TraceCapture::AddGpuSpan(
+    GpuTrack track, const char* name, uint64_t beginNs, uint64_t endNs, uint64_t targetTimestampNs
+) {
+    if (IsActive()) {
+        Add({ name, track, beginNs, endNs, targetTimestampNs });
+    }
+}
+
+void TraceCapture::Add(const Span& span) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (!m_active.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    if (span.endNs >= m_endNs) {
+        m_active.store(false, std::memory_order_relaxed);
+
+        uint32_t threadCount = (uint32_t)m_threads.size();
+        std::thread(Write, std::move(m_path), std::move(m_spans), threadCount).detach();
+        m_spans = {};
+        return;
+    }
+
+    if (m_spans.size() >= MAX_SPANS) {
+        return;
+    }
+
+    Span& stored = m_spans.emplace_back(span);
+    if (stored.track == 0) {
+        auto thread = m_threads.try_emplace(
+            std::this_thread::get_id(), (uint32_t)(GPU_TRACK_COUNT + m_threads.size())
+        );
+        stored.track = thread.first->second;
+    }
+}
+
+void TraceCapture::Write(std::string path, std::vector<Span> spans, uint32_t threadCount) {
+    std::ofstream file(path);
+    if (!file) {
+        Error("Failed to write the trace to %s\n", path.c_str());
+        return;
+    }
+
+    uint64_t baseNs = UINT64_MAX;
+    for (auto& span : spans) {
+        baseNs = std::min(baseNs, span.beginNs);
+    }
+
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+         << "\"args\":{\"name\":\"ALVR driver\"}}";
+    for (uint32_t track = 1; track < GPU_TRACK_COUNT + threadCount; track++) {
+        std::string name = track < GPU_TRACK_COUNT
+            ? GPU_TRACK_NAMES[track]
+            : "Thread " + std::to_string(track - GPU_TRACK_COUNT);
+        file << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << track
+             << ",\"args\":{\"name\":\"" << name << "\"}}";
+        // Keep the GPU tracks on top
+        file << ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":" << track
+             << ",\"args\":{\"sort_index\":" << track << "}}";
+    }
+
+    file.setf(std::ios::fixed);
+    file.precision(3);
+    for (auto& span : spans) {
+        file << ",\n{\"name\":\"" << span.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << span.track
+             << ",\"ts\":" << (span.beginNs - baseNs) / 1e3
+             << ",\"dur\":" << (std::max(span.endNs, span.beginNs) - span.beginNs) / 1e3;
+        if (span.targetTimestampNs != 0) {
+            file << ",\"args\":{\"frame\":" << span.targetTimestampNs << "}";
+        }
+        file << "}";
+    }
+    file << "\n]}\n";
+
+    if (!file) {
+        Error("Failed to write the trace to %s\n", path.c_str());
+    } else {
+        Info("Trace written to %s (%zu spans)\n", path.c_str(), spans.size());
+    }
+}
+
+TraceScope::TraceScope(const char* name, uint64_t targetTimestampNs)
+    : m_name(name)
+    , m_targetTimestampNs(targetTimestampNs) {
+    if (TraceCapture::Instance().IsActive()) {
+        m_beginNs = FrameTrace::Now();
+    }
+}
+
+TraceScope::~TraceScope() {
+    if (m_beginNs != 0) {
+        TraceCapture::Instance().AddSpan(m_name, m_beginNs, FrameTrace::Now(), m_targetTimestampNs);
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Writes the spans of the driver hot path to a Chrome Trace Event JSON file, which
+// chrome://tracing and ui.perfetto.dev can open. Recording is a single relaxed load while no
+// capture is running. All times are on the FrameTrace::Now() clock.
+class TraceCapture {
+public:
+    // Tracks of the GPU work, shown next to the CPU threads
+    enum GpuTrack : uint32_t {
+        GPU_TRACK_COMPOSITOR = 1,
+        GPU_TRACK_COUNT,
+    };
+
+    static TraceCapture& Instance() { return m_instance; }
+
+    // The file is written once durationS has elapsed, from a thread of its own
+    void Start(const char* path, float durationS);
+
+    bool IsActive() const { return m_active.load(std::memory_order_relaxed); }
+
+    // name must be a string literal, it's stored as is and not escaped. targetTimestampNs is added
+    // to the span arguments if not 0, to find the frame
+    void AddSpan(
+        const char* name, uint64_t beginNs, uint64_t endNs, uint64_t targetTimestampNs = 0
+    );
+    void AddGpuSpan(
+        GpuTrack track,
+        const char* name,
+        uint64_t beginNs,
+        uint64_t endNs,
+        uint64_t targetTimestampNs = 0
+    );
+
+private:
+    static TraceCapture m_instance;
+
+    struct Span {
+        const char* name;
+        uint32_t track;
+        uint64_t beginNs;
+        uint64_t endNs;
+        uint64_t targetTimestampNs;
+    };
+
+    void Add(const Span& span);
+    static void Write(std::string path, std::vector<Span> spans, uint32_t threadCount);
+
+    std::atomic<bool> m_active { false };
+    std::mutex m_mutex;
+    std::string m_path;
+    uint64_t m_endNs = 0;
+    std::vector<Span> m_spans;
+    // CPU threads are numbered after the GPU tracks, in the order they are first seen
+    std::unordered_map<std::thread::id, uint32_t> m_threads;
+};
+
+// Records the lifetime of the scope as a span while a capture is running
+class TraceScope {
+public:
+    explicit TraceScope(const char* name, uint64_t targetTimestampNs = 0);
+    ~TraceScope();
+
+    // For when the frame is only known inside the scope
+    void SetTargetTimestamp(uint64_t targetTimestampNs) { m_targetTimestampNs = targetTimestampNs; }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* m_name;
+    uint64_t m_targetTimestampNs;
+    uint64_t m_beginNs = 0;
+};
@@ -1,9 +1,38 @@
 #include "TrackedDevice.h"
 #include "Logger.h"
+#include "PoseBatch.h"
+#include "StartupProfiler.h"
 #include "Utils.h"
 #include <chrono>
+#include <cstring>
 #include <thread>
 
+namespace {
+// Only the bytes of the member of the type are set
+bool same_prop_value(const FfiOpenvrProperty& a, const FfiOpenvrProperty& b) {
+    if (a.type != b.type) {
+        return false;
+    }
+    switch (a.type) {
+    case FfiOpenvrPropertyType::Bool:
+        return a.value.bool_ == b.value.bool_;
+    case FfiOpenvrPropertyType::Float:
+        return a.value.float_ == b.value.float_;
+    case FfiOpenvrPropertyType::Int32:
+        return a.value.int32 == b.value.int32;
+    case FfiOpenvrPropertyType::Uint64:
+        return a.value.uint64 == b.value.uint64;
+    case FfiOpenvrPropertyType::Vector3:
+        return memcmp(a.value.vector3, b.value.vector3, sizeof(a.value.vector3)) == 0;
+    case FfiOpenvrPropertyType::Double:
+        return a.value.double_ == b.value.double_;
+    case FfiOpenvrPropertyType::String:
+        return strncmp(a.value.string, b.value.string, sizeof(a.value.string)) == 0;
+    }
+    return false;
+}
+}
+
 TrackedDevice::TrackedDevice(uint64_t device_id, vr::ETrackedDeviceClass device_class)
     : device_id(device_id)
     , device_class(device_class) {
@@ -26,61 +55,78 @@ std::string TrackedDevice::get_serial_number() {
     return std::string(&buffer[0]);
 }
 
-void TrackedDevice::set_prop(FfiOpenvrProperty prop) {
+void TrackedDevice::set_prop(FfiOpenvrProperty prop) { this->set_props(&prop, 1); }
+
+void TrackedDevice::set_props(const FfiOpenvrProperty* new_props, size_t count) {
+    auto lock = std::lock_guard<std::mutex>(this->prop_mutex);
+
     if (this->object_id == vr::k_unTrackedDeviceIndexInvalid) {
         return;
     }
 
-    auto key = (vr::ETrackedDeviceProperty)prop.key;
-
     auto props = vr::VRProperties();
 
-    vr::ETrackedPropertyError result;
-
-    if (prop.type == FfiOpenvrPropertyType::Bool) {
-        result = props->SetBoolProperty(this->prop_container, key, prop.value.bool_);
-    } else if (prop.type == FfiOpenvrPropertyType::Float) {
-        result = props->SetFloatProperty(this->prop_container, key, prop.value.float_);
-    } else if (prop.type == FfiOpenvrPropertyType::Int32) {
-        result = props->SetInt32Property(this->prop_container, key, prop.value.int32);
-    } else if (prop.type == FfiOpenvrPropertyType::Uint64) {
-        result = props->SetUint64Property(this->prop_container, key, prop.value.uint64);
-    } else if (prop.type == FfiOpenvrPropertyType::Vector3) {
-        auto vec3 = vr::HmdVector3_t {};
-        vec3.v[0] = prop.value.vector3[0];
-        vec3.v[1] = prop.value.vector3[1];
-        vec3.v[2] = prop.value.vector3[2];
-        result = props->SetVec3Property(this->prop_container, key, vec3);
-    } else if (prop.type == FfiOpenvrPropertyType::Double) {
-        result = props->SetDoubleProperty(this->prop_container, key, prop.value.double_);
-    } else if (prop.type == FfiOpenvrPropertyType::String) {
-        result = props->SetStringProperty(this->prop_container, key, prop.value.string);
-    } else {
-        Error("Unreachable");
-        result = vr::TrackedProp_Success;
-    }
+    for (size_t i = 0; i < count; i++) {
+        const FfiOpenvrProperty& prop = new_props[i];
 
-    if (result != vr::TrackedProp_Success) {
-        Error(
-            "Error setting property %d: %s",
-            key,
-            vr::VRPropertiesRaw()->GetPropErrorNameFromEnum(result)
+        auto cached = this->prop_values.find(prop.key);
+        if (cached != this->prop_values.end() && same_prop_value(cached->second, prop)) {
+            continue;
+        }
+
+        auto key = (vr::ETrackedDeviceProperty)prop.key;
+
+        vr::ETrackedPropertyError result;
+
+        if (prop.type == FfiOpenvrPropertyType::Bool) {
+            result = props->SetBoolProperty(this->prop_container, key, prop.value.bool_);
+        } else if (prop.type == FfiOpenvrPropertyType::Float) {
+            result = props->SetFloatProperty(this->prop_container, key, prop.value.float_);
+        } else if (prop.type == FfiOpenvrPropertyType::Int32) {
+            result = props->SetInt32Property(this->prop_container, key, prop.value.int32);
+        } else if (prop.type == FfiOpenvrPropertyType::Uint64) {
+            result = props->SetUint64Property(this->prop_container, key, prop.value.uint64);
+        } else if (prop.type == FfiOpenvrPropertyType::Vector3) {
+            auto vec3 = vr::HmdVector3_t {};
+            vec3.v[0] = prop.value.vector3[0];
+            vec3.v[1] = prop.value.vector3[1];
+            vec3.v[2] = prop.value.vector3[2];
+            result = props->SetVec3Property(this->prop_container, key, vec3);
+        } else if (prop.type == FfiOpenvrPropertyType::Double) {
+            result = props->SetDoubleProperty(this->prop_container, key, prop.value.double_);
+        } else if (prop.type == FfiOpenvrPropertyType::String) {
+            result = props->SetStringProperty(this->prop_container, key, prop.value.string);
+        } else {
+            Error("Unreachable");
+            result = vr::TrackedProp_Success;
+        }
+
+        if (result != vr::TrackedProp_Success) {
+            Error(
+                "Error setting property %d: %s",
+                key,
+                vr::VRPropertiesRaw()->GetPropErrorNameFromEnum(result)
+            );
+        } else {
+            this->prop_values[prop.key] = prop;
+        }
+
+        // Properties set during activation are read by SteamVR once it is done
+        if (this->activating) {
+            continue;
+        }
+        auto event_data = vr::VREvent_Data_t {};
+        event_data.property.container = this->prop_container;
+        event_data.property.prop = key;
+        vr::VRServerDriverHost()->VendorSpecificEvent(
+            this->object_id, vr::VREvent_PropertyChanged, event_data, 0.
         );
     }
-
-    auto event_data = vr::VREvent_Data_t {};
-    event_data.property.container = this->prop_container;
-    event_data.property.prop = key;
-    vr::VRServerDriverHost()->VendorSpecificEvent(
-        this->object_id, vr::VREvent_PropertyChanged, event_data, 0.
-    );
 }
 
 void TrackedDevice::submit_pose(vr::DriverPose_t pose) {
     this->last_pose = pose;
-    vr::VRServerDriverHost()->TrackedDevicePoseUpdated(
-        this->object_id, pose, sizeof(vr::DriverPose_t)
-    );
+    PoseBatch::Instance().Add(this->object_id, pose);
 }
 
 bool TrackedDevice::register_device(bool await_activation) {
@@ -95,25 +141,43 @@ bool TrackedDevice::register_device(bool await_activation) {
     }
 
     if (await_activation) {
-        auto lock = std::unique_lock<std::mutex>(this->activation_mutex);
-        this->activation_condvar.wait_for(lock, std::chrono::seconds(1), [this] {
-            return this->activation_state != ActivationState::Pending;
-        });
-
-        return this->activation_state == ActivationState::Success;
+        return wait_activation();
     } else {
         return true;
     }
 }
 
+bool TrackedDevice::wait_activation() {
+    auto lock = std::unique_lock<std::mutex>(this->activation_mutex);
+    this->activation_condvar.wait_for(lock, std::chrono::seconds(1), [this] {
+        return this->activation_state != ActivationState::Pending;
+    });
+
+    return this->activation_state == ActivationState::Success;
+}
+
 vr::EVRInitError TrackedDevice::Activate(vr::TrackedDeviceIndex_t object_id) {
     this->object_id = object_id;
     this->prop_container = vr::VRProperties()->TrackedDeviceToPropertyContainer(this->object_id);
+    {
+        auto guard = std::lock_guard<std::mutex>(this->prop_mutex);
+        this->prop_values.clear();
+        this->activating = true;
+    }
 
     {
         auto guard = std::lock_guard<std::mutex>(this->activation_mutex);
 
-        if (this->activate()) {
+        bool activated;
+        {
+            StartupStep step("activation of " + this->get_serial_number());
+            activated = this->activate();
+        }
+        {
+            auto prop_guard = std::lock_guard<std::mutex>(this->prop_mutex);
+            this->activating = false;
+        }
+        if (activated) {
             this->activation_state = ActivationState::Success;
         } else {
             this->activation_state = ActivationState::Failure;
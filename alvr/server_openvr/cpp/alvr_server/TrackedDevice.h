@@ -20,7 +20,11 @@ public:
     vr::DriverPose_t last_pose;
 
     bool register_device(bool await_activation);
+    // Waits up to a second for SteamVR to activate the registered device, true if it succeeded
+    bool wait_activation();
     void set_prop(FfiOpenvrProperty prop);
+    // Sets those of the properties whose value changed since they were last set
+    void set_props(const FfiOpenvrProperty* props, size_t count);
 
 protected:
     uint64_t device_id;
@@ -33,9 +37,16 @@ protected:
     virtual void* get_component(const char*) = 0;
 
 private:
+    friend class DriverBenchmark;
+
     ActivationState activation_state = ActivationState::Pending;
     std::mutex activation_mutex = {};
     std::condition_variable activation_condvar = {};
+    // Last value set of each property of the current container, and whether activate() is
+    // running, SteamVR then reads the properties once it returns without change events
+    std::map<uint32_t, FfiOpenvrProperty> prop_values = {};
+    bool activating = false;
+    std::mutex prop_mutex = {};
 
     // ITrackedDeviceServerDriver
     vr::EVRInitError Activate(vr::TrackedDeviceIndex_t object_id) final;
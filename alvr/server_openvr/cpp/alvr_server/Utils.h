@@ -29,9 +29,9 @@
 const float DEG_TO_RAD = (float)(M_PI / 180.);
 const double NS_PER_S = 1000000000.0;
 
-// Get elapsed time in us from Unix Epoch
+// Steady time in us, the clock of FrameTrace::Now(). Only for intervals, it isn't wall time
 inline uint64_t GetTimestampUs() {
-    auto duration = std::chrono::system_clock::now().time_since_epoch();
+    auto duration = std::chrono::steady_clock::now().time_since_epoch();
     return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
 }
 
@@ -150,7 +150,8 @@ inline vr::HmdQuaternion_t EulerAngleToQuaternion(const double* yaw_pitch_roll)
     return q;
 }
 
-inline vr::HmdVector4_t Lerp(vr::HmdVector4_t& v1, vr::HmdVector4_t& v2, double lambda) {
+inline vr::HmdVector4_t
+Lerp(const vr::HmdVector4_t& v1, const vr::HmdVector4_t& v2, double lambda) {
     vr::HmdVector4_t res;
     res.v[0] = (float)((1 - lambda) * v1.v[0] + lambda * v2.v[0]);
     res.v[1] = (float)((1 - lambda) * v1.v[1] + lambda * v2.v[1]);
@@ -161,7 +162,7 @@ inline vr::HmdVector4_t Lerp(vr::HmdVector4_t& v1, vr::HmdVector4_t& v2, double
 }
 
 inline vr::HmdQuaternionf_t
-Slerp(vr::HmdQuaternionf_t& q1, vr::HmdQuaternionf_t& q2, double lambda) {
+Slerp(const vr::HmdQuaternionf_t& q1, const vr::HmdQuaternionf_t& q2, double lambda) {
     if (q1.w != q2.w || q1.x != q2.x || q1.y != q2.y || q1.z != q2.z) {
         float dotproduct = q1.x * q2.x + q1.y * q2.y + q1.z * q2.z + q1.w * q2.w;
         float theta, st, sut, sout, coeff1, coeff2;
@@ -0,0 +1,254 @@
+#include "VideoSendQueue.h"
+
+#include "DriverCounters.h"
+#include "Logger.h"
+#include "NalParsing.h"
+#include "Settings.h"
+#include <algorithm>
+#include <string.h>
+
+VideoSendQueue VideoSendQueue::m_instance;
+
+void VideoSendQueue::Start() {
+    if (m_running.load(std::memory_order_acquire)) {
+        return;
+    }
+    m_depth = Settings::Instance().m_encoderSendQueueDepth;
+    m_dropOldest = Settings::Instance().m_encoderSendQueueDropOldest;
+    if (m_depth == 0) {
+        return;
+    }
+
+    Info(
+        "Sending the frames from their own thread, up to %u waiting, dropping the %s when full\n",
+        m_depth,
+        m_dropOldest ? "oldest" : "new one"
+    );
+    m_stopping = false;
+    m_thread = std::thread(&VideoSendQueue::Run, this);
+    m_running.store(true, std::memory_order_release);
+}
+
+void VideoSendQueue::Shutdown() {
+    if (!m_running.exchange(false)) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+    m_thread.join();
+}
+
+void VideoSendQueue::Send(
+    int codec,
+    const FfiNalRange* ranges,
+    int rangeCount,
+    unsigned long long targetTimestampNs,
+    bool isIdr,
+    bool isLastSlice,
+    int temporalId,
+    void (*release)(void* context),
+    void* releaseContext
+) {
+    if (!m_running.load(std::memory_order_acquire)) {
+        SendFrameSlice(
+            codec,
+            ranges,
+            rangeCount,
+            targetTimestampNs,
+            isIdr,
+            isLastSlice,
+            temporalId,
+            release,
+            releaseContext
+        );
+        return;
+    }
+
+    if (m_droppingNewFrame) {
+        m_droppingNewFrame = !isLastSlice;
+        if (release) {
+            release(releaseContext);
+        }
+        return;
+    }
+
+    uint32_t tail = m_tail.load(std::memory_order_relaxed);
+    bool firstSlice = !m_pushingFrame;
+    if (firstSlice) {
+        uint32_t queued = m_queuedFrames.load(std::memory_order_acquire);
+        DriverCounters::Add(DRIVER_COUNTER_SEND_QUEUE_FRAMES);
+        DriverCounters::Add(DRIVER_COUNTER_SEND_QUEUE_DEPTH_SUM, queued);
+
+        // When dropping the oldest frames, the sender does it as it gets to them. It can't while
+        // it's stalled, the new frames are then dropped here once twice as many wait
+        uint32_t limit = m_dropOldest ? 2 * m_depth : m_depth;
+        bool full = tail - m_head.load(std::memory_order_acquire) == SLOT_COUNT;
+        if (!isIdr && (queued >= limit || full)) {
+            DriverCounters::Add(DRIVER_COUNTER_SEND_QUEUE_DROPPED_FRAMES);
+            // The sender learns about it with the next frame, which may only come once the
+            // encoder is told to repair the stream
+            if (temporalId == 0 && m_droppedTemporalId != 0) {
+                RequestIDR();
+            }
+            m_droppedTemporalId = m_droppedTemporalId == NO_DROP
+                ? temporalId
+                : std::min(m_droppedTemporalId, temporalId);
+            m_droppingNewFrame = !isLastSlice;
+            if (release) {
+                release(releaseContext);
+            }
+            return;
+        }
+        m_queuedFrames.fetch_add(1, std::memory_order_acq_rel);
+    }
+    m_pushingFrame = !isLastSlice;
+
+    // Only an IDR frame or a frame of more slices than the ring holds gets here without a slot
+    while (tail - m_head.load(std::memory_order_acquire) == SLOT_COUNT) {
+        if (!m_running.load(std::memory_order_acquire)) {
+            if (release) {
+                release(releaseContext);
+            }
+            return;
+        }
+        std::this_thread::yield();
+    }
+
+    Slice& slice = m_slots[tail % SLOT_COUNT];
+    slice.codec = codec;
+    if (release) {
+        slice.ranges.assign(ranges, ranges + rangeCount);
+        slice.release = release;
+        slice.releaseContext = releaseContext;
+    } else {
+        // Copied once, the buffer then goes to VideoSendV with the slice
+        size_t size = 0;
+        for (int i = 0; i < rangeCount; i++) {
+            size += ranges[i].len;
+        }
+        auto buffer = new std::vector<unsigned char>(size);
+        size_t offset = 0;
+        for (int i = 0; i < rangeCount; i++) {
+            memcpy(buffer->data() + offset, ranges[i].data, ranges[i].len);
+            offset += ranges[i].len;
+        }
+        slice.ranges.assign(1, { buffer->data(), (unsigned int)size });
+        slice.release = [](void* context) {
+            delete static_cast<std::vector<unsigned char>*>(context);
+        };
+        slice.releaseContext = buffer;
+    }
+    slice.targetTimestampNs = targetTimestampNs;
+    slice.isIdr = isIdr;
+    slice.isLastSlice = isLastSlice;
+    slice.temporalId = temporalId;
+    slice.droppedTemporalId = NO_DROP;
+    if (firstSlice) {
+        slice.droppedTemporalId = m_droppedTemporalId;
+        m_droppedTemporalId = NO_DROP;
+    }
+
+    // Sequentially consistent with m_sleeping, so that the sender can't miss the slice while it
+    // goes to sleep
+    m_tail.store(tail + 1, std::memory_order_seq_cst);
+    if (m_sleeping.load(std::memory_order_seq_cst)) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_wake.notify_one();
+    }
+}
+
+void VideoSendQueue::Run() {
+    uint32_t head = m_head.load(std::memory_order_relaxed);
+    while (true) {
+        if (m_tail.load(std::memory_order_acquire) == head) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_sleeping.store(true, std::memory_order_seq_cst);
+            m_wake.wait(lock, [&] {
+                return m_stopping || m_tail.load(std::memory_order_seq_cst) != head;
+            });
+            m_sleeping.store(false, std::memory_order_relaxed);
+            if (m_stopping) {
+                break;
+            }
+            continue;
+        }
+
+        Slice& slice = m_slots[head % SLOT_COUNT];
+        if (!m_sendingFrame) {
+            m_droppingFrame = ShouldDrop(slice);
+        }
+        m_sendingFrame = !slice.isLastSlice;
+
+        if (m_droppingFrame) {
+            Release(slice);
+        } else {
+            SendFrameSlice(
+                slice.codec,
+                slice.ranges.data(),
+                (int)slice.ranges.size(),
+                slice.targetTimestampNs,
+                slice.isIdr,
+                slice.isLastSlice,
+                slice.temporalId,
+                slice.release,
+                slice.releaseContext
+            );
+        }
+        if (slice.isLastSlice) {
+            m_queuedFrames.fetch_sub(1, std::memory_order_acq_rel);
+        }
+        m_head.store(++head, std::memory_order_release);
+    }
+
+    // The encoders are stopped, nothing is pushed anymore
+    for (uint32_t tail = m_tail.load(std::memory_order_acquire); head != tail; head++) {
+        Release(m_slots[head % SLOT_COUNT]);
+    }
+    m_head.store(head, std::memory_order_release);
+    m_queuedFrames.store(0, std::memory_order_release);
+    m_sendingFrame = false;
+}
+
+bool VideoSendQueue::ShouldDrop(const Slice& slice) {
+    if (slice.droppedTemporalId != NO_DROP) {
+        // The encoder thread requested the IDR frame already
+        OnDropped(slice.droppedTemporalId);
+    }
+    if (slice.isIdr) {
+        m_waitingForIdr = false;
+        m_dropTemporalId = INT32_MAX;
+        return false;
+    }
+
+    bool drop = m_waitingForIdr || slice.temporalId > m_dropTemporalId
+        || (m_dropOldest && m_queuedFrames.load(std::memory_order_acquire) > m_depth);
+    if (drop) {
+        DriverCounters::Add(DRIVER_COUNTER_SEND_QUEUE_DROPPED_FRAMES);
+        if (OnDropped(slice.temporalId)) {
+            RequestIDR();
+        }
+    } else if (slice.temporalId <= m_dropTemporalId) {
+        m_dropTemporalId = INT32_MAX;
+    }
+    return drop;
+}
+
+bool VideoSendQueue::OnDropped(int temporalId) {
+    // Nothing references the frames of the upper layers from the base layer
+    if (temporalId > 0) {
+        m_dropTemporalId = std::min(m_dropTemporalId, temporalId);
+        return false;
+    }
+    bool request = !m_waitingForIdr;
+    m_waitingForIdr = true;
+    return request;
+}
+
+void VideoSendQueue::Release(Slice& slice) {
+    if (slice.release) {
+        slice.release(slice.releaseContext);
+    }
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "bindings.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+// Hands the encoded slices from the encoder threads to a sender thread, which sends them with
+// SendFrameSlice(), so that a stall of the network side (a full socket, the recording file)
+// doesn't delay the encoding of the next frame. The slices go through a ring without locks,
+// written by one encoder thread at a time and read by the sender.
+//
+// Up to m_encoderSendQueueDepth frames wait in it. When full, whole frames are dropped: the oldest
+// ones waiting, or the new one. An IDR frame is never dropped. The frames after a dropped base
+// layer frame reference it, they are dropped as well until the IDR frame that is requested. The
+// frames of the upper temporal layers are dropped alone, like by the network side in server_core.
+class VideoSendQueue {
+public:
+    static VideoSendQueue& Instance() { return m_instance; }
+
+    // Starts the sender thread when the queue is enabled, called when streaming starts
+    void Start();
+    void Shutdown();
+
+    // With the arguments of ParseFrameNalRanges, once its NALs are rewritten. The ranges are
+    // copied unless release is set. Sends from the calling thread until Start()
+    void Send(
+        int codec,
+        const FfiNalRange* ranges,
+        int rangeCount,
+        unsigned long long targetTimestampNs,
+        bool isIdr,
+        bool isLastSlice,
+        int temporalId,
+        void (*release)(void* context),
+        void* releaseContext
+    );
+
+private:
+    static VideoSendQueue m_instance;
+
+    // Many more than the slices of the deepest queue in practice. A frame of more slices than
+    // free slots waits for the sender
+    static const uint32_t SLOT_COUNT = 1024;
+    static const int NO_DROP = -1;
+
+    struct Slice {
+        int codec;
+        // The capacity is kept for the next slices
+        std::vector<FfiNalRange> ranges;
+        unsigned long long targetTimestampNs;
+        bool isIdr;
+        bool isLastSlice;
+        int temporalId;
+        void (*release)(void* context);
+        void* releaseContext;
+        // Lowest temporal layer of the frames the encoder thread dropped right before this one,
+        // NO_DROP if none. Set on the first slice of a frame
+        int droppedTemporalId;
+    };
+
+    void Run();
+    // At the first slice of a frame, whether the sender drops it
+    bool ShouldDrop(const Slice& slice);
+    // Returns whether an IDR frame must be requested
+    bool OnDropped(int temporalId);
+    static void Release(Slice& slice);
+
+    Slice m_slots[SLOT_COUNT];
+    // Next slot to read, written by the sender thread
+    alignas(64) std::atomic<uint32_t> m_head = 0;
+    // Next slot to write, written by the encoder thread
+    alignas(64) std::atomic<uint32_t> m_tail = 0;
+    // Frames with slices in the ring or being sent
+    alignas(64) std::atomic<uint32_t> m_queuedFrames = 0;
+
+    std::atomic<bool> m_running = false;
+    uint32_t m_depth = 0;
+    bool m_dropOldest = false;
+
+    // Encoder thread
+    bool m_pushingFrame = false;
+    bool m_droppingNewFrame = false;
+    int m_droppedTemporalId = NO_DROP;
+
+    // Sender thread
+    bool m_sendingFrame = false;
+    bool m_droppingFrame = false;
+    // Lowest temporal layer dropped since a frame of that layer or below was sent
+    int m_dropTemporalId = INT32_MAX;
+    // A base layer frame was dropped, the next ones are until an IDR frame
+    bool m_waitingForIdr = false;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::atomic<bool> m_sleeping = false;
+    bool m_stopping = false;
+    std::thread m_thread;
+};
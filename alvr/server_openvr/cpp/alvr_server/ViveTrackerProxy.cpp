@@ -1,5 +1,6 @@
 #include "ViveTrackerProxy.h"
 #include "HMD.h"
+#include "PoseBatch.h"
 #include "Settings.h"
 
 #include <cassert>
@@ -178,8 +179,5 @@ vr::EVRInitError ViveTrackerProxy::Activate(vr::TrackedDeviceIndex_t unObjectId)
 }
 
 void ViveTrackerProxy::update() {
-    auto newPose = GetPose();
-    vr::VRServerDriverHost()->TrackedDevicePoseUpdated(
-        m_unObjectId, newPose, sizeof(vr::DriverPose_t)
-    );
+    PoseBatch::Instance().Add(m_unObjectId, GetPose());
 }
@@ -7,19 +7,31 @@
 #include "platform/linux/CEncoder.h"
 #endif
 #include "Controller.h"
+#include "DriverCounters.h"
 #include "FakeViveTracker.h"
+#include "FlightRecorder.h"
+#include "FoveationCenter.h"
+#include "FrameTrace.h"
+#include "GpuUtilization.h"
 #include "HMD.h"
+#include "HeadMotionHints.h"
 #include "Logger.h"
 #include "Paths.h"
+#include "PipelineTimings.h"
+#include "PoseBatch.h"
 #include "PoseHistory.h"
 #include "Settings.h"
+#include "StartupProfiler.h"
+#include "TraceCapture.h"
 #include "TrackedDevice.h"
+#include "VideoSendQueue.h"
 #include "bindings.h"
 #include "driverlog.h"
 #include "openvr_driver_wrap.h"
 #include <algorithm>
 #include <cmath>
 #include <cstring>
+#include <functional>
 #include <map>
 #include <optional>
 
@@ -117,6 +129,10 @@ public:
         this->hmd.reset();
         // this->generic_trackers.clear();
 
+        // After the encoder, nothing is pushed to the queue anymore
+        VideoSendQueue::Instance().Shutdown();
+        GpuUtilization::Instance().Shutdown();
+        ShutdownLogger();
         CleanupDriverLog();
 
         VR_CLEANUP_SERVER_DRIVER_CONTEXT();
@@ -188,6 +204,18 @@ const unsigned char* COLOR_CORRECTION_CSO_PTR;
 unsigned int COLOR_CORRECTION_CSO_LEN;
 const unsigned char* RGBTOYUV420_CSO_PTR;
 unsigned int RGBTOYUV420_CSO_LEN;
+const unsigned char* FUSED_POST_PROCESS_HLSL_PTR;
+unsigned int FUSED_POST_PROCESS_HLSL_LEN;
+const unsigned char* STATIC_TILES_HLSL_PTR;
+unsigned int STATIC_TILES_HLSL_LEN;
+const unsigned char* OVERLAY_COVERAGE_HLSL_PTR;
+unsigned int OVERLAY_COVERAGE_HLSL_LEN;
+const unsigned char* HIDDEN_AREA_MASK_HLSL_PTR;
+unsigned int HIDDEN_AREA_MASK_HLSL_LEN;
+const unsigned char* FRAME_RENDER_FX_PTR;
+unsigned int FRAME_RENDER_FX_LEN;
+const unsigned char* FRAME_UPSCALE_HLSL_PTR;
+unsigned int FRAME_UPSCALE_HLSL_LEN;
 
 const unsigned char* QUAD_SHADER_COMP_SPV_PTR;
 unsigned int QUAD_SHADER_COMP_SPV_LEN;
@@ -200,6 +228,7 @@ unsigned int RGBTOYUV420_SHADER_COMP_SPV_LEN;
 
 const char* g_sessionPath;
 const char* g_driverRootDir;
+const char* g_logDir;
 
 void (*LogError)(const char* stringPtr);
 void (*LogWarn)(const char* stringPtr);
@@ -209,27 +238,46 @@ void (*LogEncoder)(const char* stringPtr);
 void (*LogPeriodically)(const char* tag, const char* stringPtr);
 void (*DriverReadyIdle)(bool setDefaultChaprone);
 void (*SetVideoConfigNals)(const unsigned char* configBuffer, int len, int codec);
-void (*VideoSend)(unsigned long long targetTimestampNs, unsigned char* buf, int len, bool isIdr);
+void (*VideoSendV)(
+    unsigned long long targetTimestampNs,
+    const FfiNalRange* ranges,
+    int rangeCount,
+    bool isIdr,
+    bool isLastSlice,
+    int temporalId,
+    void (*release)(void* context),
+    void* releaseContext
+);
 void (*HapticsSend)(unsigned long long path, float duration_s, float frequency, float amplitude);
+void (*SpectatorSend)(const unsigned char* buf, int len);
 void (*ShutdownRuntime)();
 unsigned long long (*PathStringToHash)(const char* path);
 void (*ReportPresent)(unsigned long long timestamp_ns, unsigned long long offset_ns);
+bool (*ShouldEncodeFrame)();
 void (*ReportComposed)(unsigned long long timestamp_ns, unsigned long long offset_ns);
+void (*ReportMissedVsyncs)(unsigned long long count);
 FfiDynamicEncoderParams (*GetDynamicEncoderParams)();
+void (*ReportEncoderStats)(FfiEncoderStats stats);
 unsigned long long (*GetSerialNumber)(unsigned long long deviceID, char* outString);
 void (*SetOpenvrProps)(void* instancePtr, unsigned long long deviceID);
 void (*RegisterButtons)(void* instancePtr, unsigned long long deviceID);
 void (*WaitForVSync)();
+FfiVsyncTiming (*GetVsyncTiming)();
+FfiClientPipelineTiming (*GetClientPipelineTiming)();
 
 void CppInit(bool earlyHmdInitialization) {
     g_driver_provider.early_hmd_initialization = earlyHmdInitialization;
+    StartupStep::Begin();
 
     HookCrashHandler();
 
     // Initialize path constants
     init_paths();
 
-    Settings::Instance().Load();
+    {
+        StartupStep step("settings load");
+        Settings::Instance().Load();
+    }
 
     load_debug_privilege();
 }
@@ -245,9 +293,12 @@ void* CppOpenvrEntryPoint(const char* interface_name, int* return_code) {
 }
 
 bool InitializeStreaming() {
+    StreamStart::Begin();
     Settings::Instance().Load();
 
     if (!g_driver_provider.devices_initialized) {
+        StartupStep registrationStep("device registration");
+
         if (!g_driver_provider.early_hmd_initialization) {
             auto hmd = new Hmd();
             if (!hmd->register_device(false)) {
@@ -258,113 +309,93 @@ bool InitializeStreaming() {
             g_driver_provider.tracked_devices.insert({ HEAD_ID, g_driver_provider.hmd.get() });
         }
 
+        // Created while the other devices are registered, StartStreaming waits for it
+        if (g_driver_provider.hmd) {
+            g_driver_provider.hmd->PrepareStreaming();
+        }
+
+        // SteamVR activates the devices on its own thread. They are all added before any is waited
+        // for, so that the activations overlap with the registrations. A device is kept once it
+        // activated
+        std::vector<std::function<void()>> activations;
+        auto add_device = [&](TrackedDevice* device, std::function<void()> keep) {
+            if (device->register_device(false)) {
+                activations.push_back([device, keep] {
+                    if (device->wait_activation()) {
+                        keep();
+                    }
+                });
+            }
+        };
+        auto add_controller = [&](uint64_t id,
+                                  vr::EVRSkeletalTrackingLevel skeletonLevel,
+                                  std::unique_ptr<Controller>& owner) {
+            auto controller = new Controller(id, skeletonLevel);
+            add_device(controller, [id, controller, &owner] {
+                owner = std::unique_ptr<Controller>(controller);
+                g_driver_provider.tracked_devices.insert({ id, controller });
+            });
+        };
+        auto add_tracker = [&](uint64_t id) {
+            auto tracker = new FakeViveTracker(id);
+            add_device(tracker, [id, tracker] {
+                g_driver_provider.tracked_devices.insert({ id, tracker });
+                g_driver_provider.generic_trackers.push_back(
+                    std::unique_ptr<FakeViveTracker>(tracker)
+                );
+            });
+        };
+
         // Note: for controllers, hands and trackers don't bail out if registration fails
         if (Settings::Instance().m_enableControllers) {
             auto controllerSkeletonLevel = Settings::Instance().m_useSeparateHandTrackers
                 ? vr::VRSkeletalTracking_Estimated
                 : vr::VRSkeletalTracking_Partial;
 
-            auto left_controller = new Controller(HAND_LEFT_ID, controllerSkeletonLevel);
-            if (left_controller->register_device(true)) {
-                g_driver_provider.left_controller = std::unique_ptr<Controller>(left_controller);
-                g_driver_provider.tracked_devices.insert(
-                    { HAND_LEFT_ID, g_driver_provider.left_controller.get() }
-                );
-            }
-
-            auto right_controller = new Controller(HAND_RIGHT_ID, controllerSkeletonLevel);
-            if (right_controller->register_device(true)) {
-                g_driver_provider.right_controller = std::unique_ptr<Controller>(right_controller);
-                g_driver_provider.tracked_devices.insert(
-                    { HAND_RIGHT_ID, g_driver_provider.right_controller.get() }
-                );
-            }
+            add_controller(
+                HAND_LEFT_ID, controllerSkeletonLevel, g_driver_provider.left_controller
+            );
+            add_controller(
+                HAND_RIGHT_ID, controllerSkeletonLevel, g_driver_provider.right_controller
+            );
 
             if (Settings::Instance().m_useSeparateHandTrackers) {
-                auto left_hand_tracker
-                    = new Controller(HAND_TRACKER_LEFT_ID, vr::VRSkeletalTracking_Full);
-                if (left_hand_tracker->register_device(true)) {
+                add_controller(
+                    HAND_TRACKER_LEFT_ID,
+                    vr::VRSkeletalTracking_Full,
                     g_driver_provider.left_hand_tracker
-                        = std::unique_ptr<Controller>(left_hand_tracker);
-                    g_driver_provider.tracked_devices.insert(
-                        { HAND_TRACKER_LEFT_ID, g_driver_provider.left_hand_tracker.get() }
-                    );
-                }
-
-                auto right_hand_tracker
-                    = new Controller(HAND_TRACKER_RIGHT_ID, vr::VRSkeletalTracking_Full);
-                if (right_hand_tracker->register_device(true)) {
+                );
+                add_controller(
+                    HAND_TRACKER_RIGHT_ID,
+                    vr::VRSkeletalTracking_Full,
                     g_driver_provider.right_hand_tracker
-                        = std::unique_ptr<Controller>(right_hand_tracker);
-                    g_driver_provider.tracked_devices.insert(
-                        { HAND_TRACKER_RIGHT_ID, g_driver_provider.right_hand_tracker.get() }
-                    );
-                }
+                );
             }
         }
 
         if (Settings::Instance().m_enableBodyTrackingFakeVive) {
-            auto chestTracker = std::make_unique<FakeViveTracker>(BODY_CHEST_ID);
-            if (chestTracker->register_device(true)) {
-                g_driver_provider.tracked_devices.insert({ BODY_CHEST_ID, chestTracker.get() });
-                g_driver_provider.generic_trackers.push_back(std::move(chestTracker));
-            }
-
-            auto waistTracker = std::make_unique<FakeViveTracker>(BODY_HIPS_ID);
-            if (waistTracker->register_device(true)) {
-                g_driver_provider.tracked_devices.insert({ BODY_HIPS_ID, waistTracker.get() });
-                g_driver_provider.generic_trackers.push_back(std::move(waistTracker));
-            }
-
-            auto leftElbowTracker = std::make_unique<FakeViveTracker>(BODY_LEFT_ELBOW_ID);
-            if (leftElbowTracker->register_device(true)) {
-                g_driver_provider.tracked_devices.insert({ BODY_LEFT_ELBOW_ID,
-                                                           leftElbowTracker.get() });
-                g_driver_provider.generic_trackers.push_back(std::move(leftElbowTracker));
-            }
-
-            auto rightElbowTracker = std::make_unique<FakeViveTracker>(BODY_RIGHT_ELBOW_ID);
-            if (rightElbowTracker->register_device(true)) {
-                g_driver_provider.tracked_devices.insert({ BODY_RIGHT_ELBOW_ID,
-                                                           rightElbowTracker.get() });
-                g_driver_provider.generic_trackers.push_back(std::move(rightElbowTracker));
-            }
+            add_tracker(BODY_CHEST_ID);
+            add_tracker(BODY_HIPS_ID);
+            add_tracker(BODY_LEFT_ELBOW_ID);
+            add_tracker(BODY_RIGHT_ELBOW_ID);
 
             if (Settings::Instance().m_bodyTrackingHasLegs) {
-                auto leftKneeTracker = std::make_unique<FakeViveTracker>(BODY_LEFT_KNEE_ID);
-                if (leftKneeTracker->register_device(true)) {
-                    g_driver_provider.tracked_devices.insert({ BODY_LEFT_KNEE_ID,
-                                                               leftKneeTracker.get() });
-                    g_driver_provider.generic_trackers.push_back(std::move(leftKneeTracker));
-                }
-
-                auto leftFootTracker = std::make_unique<FakeViveTracker>(BODY_LEFT_FOOT_ID);
-                if (leftFootTracker->register_device(true)) {
-                    g_driver_provider.tracked_devices.insert({ BODY_LEFT_FOOT_ID,
-                                                               leftFootTracker.get() });
-                    g_driver_provider.generic_trackers.push_back(std::move(leftFootTracker));
-                }
-
-                auto rightKneeTracker = std::make_unique<FakeViveTracker>(BODY_RIGHT_KNEE_ID);
-                if (rightKneeTracker->register_device(true)) {
-                    g_driver_provider.tracked_devices.insert({ BODY_RIGHT_KNEE_ID,
-                                                               rightKneeTracker.get() });
-                    g_driver_provider.generic_trackers.push_back(std::move(rightKneeTracker));
-                }
-
-                auto rightFootTracker = std::make_unique<FakeViveTracker>(BODY_RIGHT_FOOT_ID);
-                if (rightFootTracker->register_device(true)) {
-                    g_driver_provider.tracked_devices.insert({ BODY_RIGHT_FOOT_ID,
-                                                               rightFootTracker.get() });
-                    g_driver_provider.generic_trackers.push_back(std::move(rightFootTracker));
-                }
+                add_tracker(BODY_LEFT_KNEE_ID);
+                add_tracker(BODY_LEFT_FOOT_ID);
+                add_tracker(BODY_RIGHT_KNEE_ID);
+                add_tracker(BODY_RIGHT_FOOT_ID);
             }
         }
 
+        for (auto& activation : activations) {
+            activation();
+        }
+
         g_driver_provider.devices_initialized = true;
     }
 
     if (g_driver_provider.hmd) {
+        StartupStep streamingStep("streaming start");
         g_driver_provider.hmd->StartStreaming();
     }
 
@@ -385,6 +416,33 @@ void RequestIDR() {
     }
 }
 
+void ReportVideoFramesLost(unsigned long long lastReceivedTimestampNs) {
+    if (g_driver_provider.hmd && g_driver_provider.hmd->m_encoder) {
+        g_driver_provider.hmd->m_encoder->OnFramesLost(lastReceivedTimestampNs);
+    }
+}
+
+unsigned int PopFrameTraces(FfiFrameTrace* traces, unsigned int maxCount) {
+    return FrameTrace::Instance().Pop(traces, maxCount);
+}
+
+unsigned int GetRenderPipelineStats(FfiRenderPipelineStats* stats, unsigned int maxCount) {
+    return PipelineTimings::Instance().Get(stats, maxCount);
+}
+
+void GetDriverCounters(unsigned long long* counters) { DriverCounters::Get(counters); }
+
+unsigned int PopGpuUtilization(FfiGpuUtilization* samples, unsigned int maxCount) {
+    return GpuUtilization::Instance().Pop(samples, maxCount);
+}
+
+void ApplyTrackingThreadPolicy() {
+    Info(
+        "%s\n",
+        ApplyThreadRole(ThreadRole::Tracking, Settings::Instance().m_trackingThread).c_str()
+    );
+}
+
 void SetTracking(
     unsigned long long targetTimestampNs,
     float controllerPoseTimeOffsetS,
@@ -392,8 +450,13 @@ void SetTracking(
     FfiHandData leftHandData,
     FfiHandData rightHandData,
     const FfiDeviceMotion* bodyTrackerMotions,
-    int bodyTrackerMotionCount
+    int bodyTrackerMotionCount,
+    const FfiEyeGaze* eyeGaze
 ) {
+    FoveationCenter::Instance().SetGaze(eyeGaze);
+
+    PoseBatch::Instance().Begin();
+
     if (g_driver_provider.hmd) {
         g_driver_provider.hmd->OnPoseUpdated(targetTimestampNs, headMotion);
     }
@@ -423,23 +486,14 @@ void SetTracking(
     }
 
     if (Settings::Instance().m_enableBodyTrackingFakeVive) {
-        std::map<uint64_t, FfiDeviceMotion> motionsMap;
-        for (int i = 0; i < bodyTrackerMotionCount; i++) {
-            auto m = bodyTrackerMotions[i];
-            motionsMap.insert({ m.deviceID, m });
-        }
-
-        for (auto id : BODY_IDS) {
-            auto it = g_driver_provider.tracked_devices.find(id);
-            if (it != g_driver_provider.tracked_devices.end()) {
-                auto* maybeTracker = (FakeViveTracker*)it->second;
-                auto res = motionsMap.find(id);
-                auto* maybeMotion = res != motionsMap.end() ? &res->second : nullptr;
-
-                maybeTracker->OnPoseUpdated(targetTimestampNs, maybeMotion);
-            }
+        // generic_trackers holds exactly the registered body trackers, the batch is small enough
+        // that each tracker can scan it for its own motion
+        for (auto& tracker : g_driver_provider.generic_trackers) {
+            tracker->OnPoseUpdated(targetTimestampNs, bodyTrackerMotions, bodyTrackerMotionCount);
         }
     }
+
+    PoseBatch::Instance().Submit();
 }
 
 void RequestDriverResync() {
@@ -458,8 +512,8 @@ void ShutdownSteamvr() {
     }
 }
 
-void SetOpenvrProperty(void* instancePtr, FfiOpenvrProperty prop) {
-    ((TrackedDevice*)instancePtr)->set_prop(prop);
+void SetOpenvrProperties(void* instancePtr, const FfiOpenvrProperty* props, unsigned int count) {
+    ((TrackedDevice*)instancePtr)->set_props(props, count);
 }
 
 void SetOpenvrPropByDeviceID(unsigned long long deviceID, FfiOpenvrProperty prop) {
@@ -476,6 +530,9 @@ void RegisterButton(void* instancePtr, unsigned long long buttonID) {
 }
 
 void SetLocalViewParams(const FfiViewParams params[2]) {
+    FoveationCenter::Instance().SetViews(params);
+    HeadMotionHints::SetViews(params);
+
     if (g_driver_provider.hmd) {
         g_driver_provider.hmd->SetViewParams(params);
     }
@@ -494,21 +551,22 @@ void SetBattery(unsigned long long deviceID, float gauge_value, bool is_plugged)
     }
 }
 
-void SetButton(unsigned long long buttonID, FfiButtonValue value) {
-    if (LEFT_CONTROLLER_BUTTON_MAPPING.find(buttonID) != LEFT_CONTROLLER_BUTTON_MAPPING.end()) {
-        if (g_driver_provider.left_controller) {
-            g_driver_provider.left_controller->SetButton(buttonID, value);
+void SetButtons(const FfiButtonEvent* events, int count) {
+    for (int i = 0; i < count; i++) {
+        const ButtonDispatch* button = FindButtonDispatch(events[i].buttonID);
+        if (button == nullptr) {
+            continue;
         }
-        if (g_driver_provider.left_hand_tracker) {
-            g_driver_provider.left_hand_tracker->SetButton(buttonID, value);
-        }
-    } else if (RIGHT_CONTROLLER_BUTTON_MAPPING.find(buttonID)
-               != RIGHT_CONTROLLER_BUTTON_MAPPING.end()) {
-        if (g_driver_provider.right_controller) {
-            g_driver_provider.right_controller->SetButton(buttonID, value);
+
+        auto& controller = button->isLeft ? g_driver_provider.left_controller
+                                          : g_driver_provider.right_controller;
+        auto& handTracker = button->isLeft ? g_driver_provider.left_hand_tracker
+                                           : g_driver_provider.right_hand_tracker;
+        if (controller) {
+            controller->SetButton(*button, events[i].value);
         }
-        if (g_driver_provider.right_hand_tracker) {
-            g_driver_provider.right_hand_tracker->SetButton(buttonID, value);
+        if (handTracker) {
+            handTracker->SetButton(*button, events[i].value);
         }
     }
 }
@@ -530,3 +588,19 @@ void CaptureFrame() {
     }
 #endif
 }
+
+void CaptureTrace(const char* path, float durationS) {
+    TraceCapture::Instance().Start(path, durationS);
+}
+
+void DumpFlightRecorder(const char* path) { FlightRecorder::Instance().Dump(path); }
+
+void RecordFrames(const char* path, unsigned int frameCount) {
+#ifdef __linux__
+    if (g_driver_provider.hmd && g_driver_provider.hmd->m_encoder) {
+        g_driver_provider.hmd->m_encoder->RecordFrames(path, frameCount);
+    }
+#else
+    Warn("Frame recording is only available on Linux\n");
+#endif
+}
@@ -31,6 +31,12 @@ struct FfiViewParams {
     FfiFov fov;
 };
 
+// Combined gaze of the eyes in head space, as the tangents of its angles (x right, y up)
+struct FfiEyeGaze {
+    float tangentX;
+    float tangentY;
+};
+
 struct FfiHandSkeleton {
     float jointPositions[31][3];
     FfiQuat jointRotations[31];
@@ -82,10 +88,162 @@ struct FfiButtonValue {
     };
 };
 
+struct FfiButtonEvent {
+    unsigned long long buttonID;
+    FfiButtonValue value;
+};
+
 struct FfiDynamicEncoderParams {
     unsigned int updated;
     unsigned long long bitrate_bps;
     float framerate;
+    // No frame may be larger, 0 if the frame size isn't capped
+    unsigned long long max_frame_bits;
+};
+
+// Rate control statistics of an encoded frame. The QP is in the scale of the codec, the q index for
+// AV1. averageQp and intraRatio are negative when the encoder doesn't report them
+struct FfiEncoderStats {
+    unsigned int isIdr;
+    float averageQp;
+    // Share of the picture coded intra
+    float intraRatio;
+    // The frame alone was larger than the VBV buffer of the rate control
+    unsigned int vbvOverflow;
+    // Of the reconstructed frame against the input, negative on the frames that weren't measured
+    float psnr;
+    float ssim;
+};
+
+// A span of encoded bitstream, in memory owned by the encoder
+struct FfiNalRange {
+    const unsigned char* data;
+    unsigned int len;
+};
+
+// Stages of a frame in the driver, in the order they normally happen. Pose matching comes before
+// the present on Windows and after it on Linux
+enum FfiFrameTraceStage {
+    FRAME_TRACE_PRESENT,
+    FRAME_TRACE_POSE_MATCHED,
+    FRAME_TRACE_COMPOSITE_BEGIN,
+    FRAME_TRACE_COMPOSITE_END,
+    FRAME_TRACE_ENCODE_SUBMIT,
+    FRAME_TRACE_ENCODE_COMPLETE,
+    FRAME_TRACE_FIRST_NAL_SENT,
+    FRAME_TRACE_LAST_NAL_SENT,
+    FRAME_TRACE_STAGE_COUNT,
+};
+
+// Steady clock time of each stage, 0 for the stages the frame didn't go through
+struct FfiFrameTrace {
+    unsigned long long targetTimestampNs;
+    unsigned long long stageTimestampsNs[FRAME_TRACE_STAGE_COUNT];
+};
+
+// GPU time of one compositor pass over the last frames
+struct FfiRenderPipelineStats {
+    // Built-in pass or pre/ and post/ custom shader file
+    char name[64];
+    unsigned int frameCount;
+    float averageMs;
+    float p95Ms;
+    float maxMs;
+};
+
+// How busy the GPU was around timestampNs (FrameTrace clock), see GpuUtilization. Negative when
+// the GPU doesn't report it
+struct FfiGpuUtilization {
+    unsigned long long timestampNs;
+    float graphicsPercent;
+    // NVENC, or the multimedia engine of AMD GPUs
+    float encoderPercent;
+    float pcieRxMBps;
+    float pcieTxMBps;
+};
+
+// Totals since the driver started, see DriverCounters
+enum FfiDriverCounter {
+    // Presented frames whose pose wasn't found in the pose history
+    DRIVER_COUNTER_FRAMES_WITHOUT_POSE,
+    DRIVER_COUNTER_IDRS_INSERTED,
+    // Timeouts and errors waiting for the compositor on the shared texture. Windows only
+    DRIVER_COUNTER_ACQUIRE_SYNC_FAILURES,
+    // Encoded bytes handed to the network, after the NAL rewriting
+    DRIVER_COUNTER_NAL_BYTES,
+    // Frames not encoded because nothing changed since the previous one. Windows only
+    DRIVER_COUNTER_STATIC_FRAMES_SKIPPED,
+    // Presents of a frame already presented, whether skipped or encoded again
+    DRIVER_COUNTER_DUPLICATE_FRAMES,
+    // Frames handed to VideoSendQueue, and the sum of the frames already waiting for each
+    DRIVER_COUNTER_SEND_QUEUE_FRAMES,
+    DRIVER_COUNTER_SEND_QUEUE_DEPTH_SUM,
+    // Frames VideoSendQueue dropped because it was full, or because they referenced such a frame
+    DRIVER_COUNTER_SEND_QUEUE_DROPPED_FRAMES,
+    DRIVER_COUNTER_COUNT,
+};
+
+// Vsync locked to the client display
+struct FfiVsyncTiming {
+    unsigned long long untilNextVsyncNs;
+    // 0 while the client isn't streaming
+    unsigned long long intervalNs;
+};
+
+// Averaged over the last frames the client reported, 0 while it isn't streaming
+struct FfiClientPipelineTiming {
+    // Motion-to-photon
+    unsigned long long totalLatencyNs;
+    unsigned long long networkLatencyNs;
+    // Decode, decoder queue, rendering and vsync queue on the client
+    unsigned long long clientLatencyNs;
+};
+
+enum FfiEncodeBenchmarkBackend {
+    ENCODE_BENCHMARK_BACKEND_AUTO,
+    ENCODE_BENCHMARK_BACKEND_SOFTWARE,
+    ENCODE_BENCHMARK_BACKEND_AMF,
+    ENCODE_BENCHMARK_BACKEND_NVENC,
+    ENCODE_BENCHMARK_BACKEND_VAAPI,
+    ENCODE_BENCHMARK_BACKEND_QSV,
+};
+
+struct FfiEncodeBenchmarkConfig {
+    FfiEncodeBenchmarkBackend backend;
+    // ALVR_CODEC_*
+    int codec;
+    bool use10bit;
+    unsigned int width;
+    unsigned int height;
+    float framerate;
+    unsigned long long bitrateBps;
+    // Encoded but left out of the results
+    unsigned int warmupFrames;
+    unsigned int frameCount;
+    // Raw RGBA frames of width x height, looped over. Synthetic frames are used if null
+    const char* inputPath;
+    // Frame recording to replay instead of inputPath, see RecordFrames. Its size, bitrate,
+    // framerate and IDR frames replace the ones above
+    const char* replayPath;
+    // The bitstream is written there if not null
+    const char* outputPath;
+    // Decode the bitstream to compute PSNR and SSIM against the input
+    bool measureQuality;
+    // Present the frames to the driver as vrcompositor would, through OvrDirectModeComponent on
+    // Windows and the socket of the Vulkan layer on Linux, and let CEncoder composite and encode
+    // them with the session's passes. Only the auto and software backends can be asked for
+    bool driverPath;
+};
+
+struct FfiDriverBenchmarkConfig {
+    // Timed calls of each primitive, after a warmup
+    unsigned int iterations;
+    // Body trackers updated by each SetTracking call
+    unsigned int bodyTrackerCount;
+    // Bitstream of alvr_encode_benchmark --output to parse instead of the synthetic frames of its
+    // codec, ALVR_CODEC_*. Ignored if null
+    const char* bitstreamPath;
+    int bitstreamCodec;
 };
 
 extern "C" const unsigned char* FRAME_RENDER_VS_CSO_PTR;
@@ -100,6 +258,18 @@ extern "C" const unsigned char* COLOR_CORRECTION_CSO_PTR;
 extern "C" unsigned int COLOR_CORRECTION_CSO_LEN;
 extern "C" const unsigned char* RGBTOYUV420_CSO_PTR;
 extern "C" unsigned int RGBTOYUV420_CSO_LEN;
+extern "C" const unsigned char* FUSED_POST_PROCESS_HLSL_PTR;
+extern "C" unsigned int FUSED_POST_PROCESS_HLSL_LEN;
+extern "C" const unsigned char* STATIC_TILES_HLSL_PTR;
+extern "C" unsigned int STATIC_TILES_HLSL_LEN;
+extern "C" const unsigned char* OVERLAY_COVERAGE_HLSL_PTR;
+extern "C" unsigned int OVERLAY_COVERAGE_HLSL_LEN;
+extern "C" const unsigned char* HIDDEN_AREA_MASK_HLSL_PTR;
+extern "C" unsigned int HIDDEN_AREA_MASK_HLSL_LEN;
+extern "C" const unsigned char* FRAME_RENDER_FX_PTR;
+extern "C" unsigned int FRAME_RENDER_FX_LEN;
+extern "C" const unsigned char* FRAME_UPSCALE_HLSL_PTR;
+extern "C" unsigned int FRAME_UPSCALE_HLSL_LEN;
 
 extern "C" const unsigned char* QUAD_SHADER_COMP_SPV_PTR;
 extern "C" unsigned int QUAD_SHADER_COMP_SPV_LEN;
@@ -112,6 +282,7 @@ extern "C" unsigned int RGBTOYUV420_SHADER_COMP_SPV_LEN;
 
 extern "C" const char* g_sessionPath;
 extern "C" const char* g_driverRootDir;
+extern "C" const char* g_logDir;
 
 extern "C" void (*LogError)(const char* stringPtr);
 extern "C" void (*LogWarn)(const char* stringPtr);
@@ -121,21 +292,42 @@ extern "C" void (*LogEncoder)(const char* stringPtr);
 extern "C" void (*LogPeriodically)(const char* tag, const char* stringPtr);
 extern "C" void (*DriverReadyIdle)(bool setDefaultChaprone);
 extern "C" void (*SetVideoConfigNals)(const unsigned char* configBuffer, int len, int codec);
-extern "C" void (*VideoSend)(
-    unsigned long long targetTimestampNs, unsigned char* buf, int len, bool isIdr
+// If release is set, the ranges stay valid until it's called with releaseContext (from any thread).
+// Otherwise they are copied before returning. A frame can be sent as multiple slices with the same
+// timestamp, isLastSlice is set on the one completing it. temporalId is the temporal layer of the
+// frame, the frames above the base layer 0 can be dropped when the stream has several
+extern "C" void (*VideoSendV)(
+    unsigned long long targetTimestampNs,
+    const FfiNalRange* ranges,
+    int rangeCount,
+    bool isIdr,
+    bool isLastSlice,
+    int temporalId,
+    void (*release)(void* context),
+    void* releaseContext
 );
 extern "C" void (*HapticsSend)(
     unsigned long long path, float duration_s, float frequency, float amplitude
 );
+// H.264 of the spectator stream, copied before returning
+extern "C" void (*SpectatorSend)(const unsigned char* buf, int len);
 extern "C" void (*ShutdownRuntime)();
 extern "C" unsigned long long (*PathStringToHash)(const char* path);
 extern "C" void (*ReportPresent)(unsigned long long timestamp_ns, unsigned long long offset_ns);
+// Called for each composited frame before it's encoded. False for the frames skipped by the
+// framerate decimation, the client reprojects the previous one in their place
+extern "C" bool (*ShouldEncodeFrame)();
 extern "C" void (*ReportComposed)(unsigned long long timestamp_ns, unsigned long long offset_ns);
+extern "C" void (*ReportMissedVsyncs)(unsigned long long count);
 extern "C" FfiDynamicEncoderParams (*GetDynamicEncoderParams)();
+// Called from the encoder threads once per frame, after the frame was sent
+extern "C" void (*ReportEncoderStats)(FfiEncoderStats stats);
 extern "C" unsigned long long (*GetSerialNumber)(unsigned long long deviceID, char* outString);
 extern "C" void (*SetOpenvrProps)(void* instancePtr, unsigned long long deviceID);
 extern "C" void (*RegisterButtons)(void* instancePtr, unsigned long long deviceID);
 extern "C" void (*WaitForVSync)();
+extern "C" FfiVsyncTiming (*GetVsyncTiming)();
+extern "C" FfiClientPipelineTiming (*GetClientPipelineTiming)();
 
 extern "C" void CppInit(bool earlyHmdInitialization);
 extern "C" void* CppOpenvrEntryPoint(const char* pInterfaceName, int* pReturnCode);
@@ -143,6 +335,20 @@ extern "C" bool InitializeStreaming();
 extern "C" void DeinitializeStreaming();
 extern "C" void SendVSync();
 extern "C" void RequestIDR();
+extern "C" void ReportVideoFramesLost(unsigned long long lastReceivedTimestampNs);
+// Copies the traces of the frames recorded since the last call, oldest first. Frames are returned
+// a few frames late so that all their stages are in. Must always be called from the same thread
+extern "C" unsigned int PopFrameTraces(FfiFrameTrace* traces, unsigned int maxCount);
+// Compositor passes in render order. Linux only, none are returned on other platforms
+extern "C" unsigned int
+GetRenderPipelineStats(FfiRenderPipelineStats* stats, unsigned int maxCount);
+// Fills DRIVER_COUNTER_COUNT values, indexed by FfiDriverCounter
+extern "C" void GetDriverCounters(unsigned long long* counters);
+// Copies the GPU samples taken since the last call, oldest first. Sampling starts with the first
+// call. Must always be called from the same thread
+extern "C" unsigned int PopGpuUtilization(FfiGpuUtilization* samples, unsigned int maxCount);
+// Called by the thread that dispatches the tracking, once settings are loaded
+extern "C" void ApplyTrackingThreadPolicy();
 extern "C" void SetTracking(
     unsigned long long targetTimestampNs,
     float controllerPoseTimeOffsetS,
@@ -150,17 +356,21 @@ extern "C" void SetTracking(
     FfiHandData leftHandData,
     FfiHandData rightHandData,
     const FfiDeviceMotion* bodyTrackerMotions,
-    int bodyTrackerMotionCount
+    int bodyTrackerMotionCount,
+    // Null when the client doesn't track the eyes
+    const FfiEyeGaze* eyeGaze
 );
 extern "C" void RequestDriverResync();
 extern "C" void ShutdownSteamvr();
 
-extern "C" void SetOpenvrProperty(void* instancePtr, FfiOpenvrProperty prop);
+extern "C" void
+SetOpenvrProperties(void* instancePtr, const FfiOpenvrProperty* props, unsigned int count);
 extern "C" void SetOpenvrPropByDeviceID(unsigned long long deviceID, FfiOpenvrProperty prop);
 extern "C" void RegisterButton(void* instancePtr, unsigned long long buttonID);
 extern "C" void SetLocalViewParams(const FfiViewParams params[2]);
 extern "C" void SetBattery(unsigned long long deviceID, float gauge_value, bool is_plugged);
-extern "C" void SetButton(unsigned long long buttonID, FfiButtonValue value);
+// Applies the changed inputs of a client packet in one call, in order
+extern "C" void SetButtons(const FfiButtonEvent* events, int count);
 extern "C" void SetProximityState(bool headset_is_worn);
 
 extern "C" void InitOpenvrClient();
@@ -168,11 +378,41 @@ extern "C" void ShutdownOpenvrClient();
 extern "C" void SetChaperoneArea(float areaWidth, float areaHeight);
 
 extern "C" void CaptureFrame();
+// Writes a Chrome trace of the driver to path once durationS has elapsed
+extern "C" void CaptureTrace(const char* path, float durationS);
+// Saves the next frameCount frames presented by the Vulkan layer to path, see FrameRecording.h.
+// Linux only
+extern "C" void RecordFrames(const char* path, unsigned int frameCount);
+// Writes the last seconds of frame timings and encoder events to path, see FlightRecorder.h
+extern "C" void DumpFlightRecorder(const char* path);
+
+// EncodeBenchmark.cpp. Composites and encodes frames without SteamVR or a client, then logs the
+// results. Replaces the video callbacks while running
+extern "C" bool RunEncodeBenchmark(const FfiEncodeBenchmarkConfig* config);
+// Same, at the session's codec, bit depth, resolution and framerate with each backend in turn.
+// The results are saved for the driver to pick the fastest backend, see EncoderProbe.h
+extern "C" bool RunEncoderProbe(const FfiEncodeBenchmarkConfig* config);
+// DriverBenchmark.cpp. Times the primitives the driver runs each frame or tracking tick and counts
+// their allocations, which fails the run if any allocates after its warmup. Only the property
+// store of SteamVR is provided, the calls into the rest are left out
+extern "C" bool RunDriverBenchmark(const FfiDriverBenchmarkConfig* config);
 
 // NalParsing.cpp
 void ParseFrameNals(
     int codec, unsigned char* buf, int len, unsigned long long targetTimestampNs, bool isIdr
 );
+// Same as ParseFrameNals but without copying the frame, see VideoSendV. Config NALs are expected
+// in the first range
+void ParseFrameNalRanges(
+    int codec,
+    FfiNalRange* ranges,
+    int rangeCount,
+    unsigned long long targetTimestampNs,
+    bool isIdr,
+    bool isLastSlice,
+    void (*release)(void* context),
+    void* releaseContext
+);
 
 // CrashHandler.cpp
 void HookCrashHandler();
@@ -71,19 +71,12 @@ PS_INPUT VS(VS_INPUT input)
 
 	return output;
 }
-float4 PS(PS_INPUT input) : SV_Target
+// The input color handling of the layer packed in the view: clamping and sRGB correction
+float4 AdjustLayerColor(float4 color, uint view)
 {
-	float4 color = float4(1.0, 0.0, 0.0, 1.0);
-	uint correctionType = (input.View >> 1) & 0xF;
-	uint shouldClamp = (input.View >> 5);
+	uint correctionType = (view >> 1) & 0xF;
+	uint shouldClamp = (view >> 5);
 
-	if ((input.View & 1) == 1) {
-		color = txRight.Sample(samLinear, input.Tex);
-	}
-	else {
-		color = txLeft.Sample(samLinear, input.Tex);
-	}
-	
 	if (shouldClamp == (uint)1) {
 		color = clamp(color, 0.0, 1.0);
 	}
@@ -101,4 +94,18 @@ float4 PS(PS_INPUT input) : SV_Target
 	}
 
 	return color;
+}
+
+float4 PS(PS_INPUT input) : SV_Target
+{
+	float4 color = float4(1.0, 0.0, 0.0, 1.0);
+
+	if ((input.View & 1) == 1) {
+		color = txRight.Sample(samLinear, input.Tex);
+	}
+	else {
+		color = txLeft.Sample(samLinear, input.Tex);
+	}
+
+	return AdjustLayerColor(color, input.View);
 };
\ No newline at end of file
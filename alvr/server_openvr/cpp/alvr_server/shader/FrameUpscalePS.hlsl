@@ -0,0 +1,159 @@
+// Pixel shader of the layers for FrameRender when edge-adaptive upscaling is enabled, in place of
+// the PS of FrameRender.fx. Where a layer is magnified, it is resampled like the EASU pass of
+// FSR 1: the gradients of the 2x2 texels around the pixel give the edge direction and how sharp
+// it is, and 12 texels are filtered with a windowed lobe stretched along the edge and clamped to
+// the nearest 4 to avoid ringing. The sharpening of the color correction then acts as the RCAS
+// pass. Compiled at runtime with FrameRender.fx as include, PSUpscale is the entry point.
+
+#include "FrameRender.fx"
+
+float4 FetchTexel(uint eye, int2 pos, int2 size)
+{
+	int3 texel = int3(clamp(pos, int2(0, 0), size - 1), 0);
+	return eye == 1 ? txRight.Load(texel) : txLeft.Load(texel);
+}
+
+float Luma(float4 color)
+{
+	return color.g + 0.5 * (color.r + color.b);
+}
+
+// Adds the direction and the sharpness of the edge seen at one of the 4 inner texels, weighted
+// by its bilinear weight. a to e are the lumas of the texel (c) and its 4 neighbors, as a cross
+void AddEdge(
+	inout float2 dir,
+	inout float len,
+	float w,
+	float a,
+	float b,
+	float c,
+	float d,
+	float e
+)
+{
+	float dirX = d - b;
+	float lenX = saturate(abs(dirX) / max(max(abs(d - c), abs(c - b)), 1e-5));
+	dir.x += dirX * w;
+	len += lenX * lenX * w;
+
+	float dirY = e - a;
+	float lenY = saturate(abs(dirY) / max(max(abs(e - c), abs(c - a)), 1e-5));
+	dir.y += dirY * w;
+	len += lenY * lenY * w;
+}
+
+void AddTap(
+	inout float4 sum,
+	inout float weightSum,
+	float2 offset,
+	float2 dir,
+	float2 len2,
+	float lob,
+	float clp,
+	float4 color
+)
+{
+	// Rotated to the edge and scaled, the lobe is longer along the edge
+	float2 v = float2(dot(offset, dir), dot(offset, float2(-dir.y, dir.x))) * len2;
+	float d2 = min(dot(v, v), clp);
+	// Lanczos 2 approximated as a polynomial, the base window times the adjustable lobe
+	float wB = 2.0 / 5.0 * d2 - 1.0;
+	float wA = lob * d2 - 1.0;
+	wB *= wB;
+	wA *= wA;
+	wB = 25.0 / 16.0 * wB - (25.0 / 16.0 - 1.0);
+	float w = wB * wA;
+	sum += color * w;
+	weightSum += w;
+}
+
+float4 EdgeAdaptiveSample(uint eye, float2 uv)
+{
+	uint width;
+	uint height;
+	if (eye == 1) {
+		txRight.GetDimensions(width, height);
+	} else {
+		txLeft.GetDimensions(width, height);
+	}
+	int2 size = int2(width, height);
+
+	// Texels per pixel, the layers that aren't magnified are filtered as before. The gradients
+	// are taken outside of the branch
+	float2 dx = ddx(uv);
+	float2 dy = ddy(uv);
+	float2 footprint = (abs(dx) + abs(dy)) * size;
+	if (max(footprint.x, footprint.y) >= 1.0) {
+		return eye == 1 ? txRight.SampleGrad(samLinear, uv, dx, dy)
+		                : txLeft.SampleGrad(samLinear, uv, dx, dy);
+	}
+
+	float2 pp = uv * size - 0.5;
+	int2 fp = (int2)floor(pp);
+	pp -= floor(pp);
+
+	//    b c
+	//  e f g h
+	//  i j k l
+	//    n o
+	float4 b = FetchTexel(eye, fp + int2(0, -1), size);
+	float4 c = FetchTexel(eye, fp + int2(1, -1), size);
+	float4 e = FetchTexel(eye, fp + int2(-1, 0), size);
+	float4 f = FetchTexel(eye, fp + int2(0, 0), size);
+	float4 g = FetchTexel(eye, fp + int2(1, 0), size);
+	float4 h = FetchTexel(eye, fp + int2(2, 0), size);
+	float4 i = FetchTexel(eye, fp + int2(-1, 1), size);
+	float4 j = FetchTexel(eye, fp + int2(0, 1), size);
+	float4 k = FetchTexel(eye, fp + int2(1, 1), size);
+	float4 l = FetchTexel(eye, fp + int2(2, 1), size);
+	float4 n = FetchTexel(eye, fp + int2(0, 2), size);
+	float4 o = FetchTexel(eye, fp + int2(1, 2), size);
+
+	float bL = Luma(b), cL = Luma(c), eL = Luma(e), fL = Luma(f), gL = Luma(g), hL = Luma(h);
+	float iL = Luma(i), jL = Luma(j), kL = Luma(k), lL = Luma(l), nL = Luma(n), oL = Luma(o);
+
+	float2 dir = 0.0;
+	float len = 0.0;
+	AddEdge(dir, len, (1.0 - pp.x) * (1.0 - pp.y), bL, eL, fL, gL, jL);
+	AddEdge(dir, len, pp.x * (1.0 - pp.y), cL, fL, gL, hL, kL);
+	AddEdge(dir, len, (1.0 - pp.x) * pp.y, fL, iL, jL, kL, nL);
+	AddEdge(dir, len, pp.x * pp.y, gL, jL, kL, lL, oL);
+
+	// Without a direction the lobe is round
+	float dirLen2 = dot(dir, dir);
+	dir = dirLen2 < 1.0 / 32768.0 ? float2(1.0, 0.0) : dir * rsqrt(dirLen2);
+
+	len = len * 0.5;
+	len *= len;
+	// Longer along the diagonals, so that they are stretched as much as the axes
+	float stretch = dot(dir, dir) / max(abs(dir.x), abs(dir.y));
+	float2 len2 = float2(1.0 + (stretch - 1.0) * len, 1.0 - 0.5 * len);
+	// Sharper on the edges, softer on the flat areas
+	float lob = 0.5 + ((1.0 / 4.0 - 0.04) - 0.5) * len;
+	float clp = 1.0 / lob;
+
+	float4 sum = 0.0;
+	float weightSum = 0.0;
+	AddTap(sum, weightSum, float2(0.0, -1.0) - pp, dir, len2, lob, clp, b);
+	AddTap(sum, weightSum, float2(1.0, -1.0) - pp, dir, len2, lob, clp, c);
+	AddTap(sum, weightSum, float2(-1.0, 1.0) - pp, dir, len2, lob, clp, i);
+	AddTap(sum, weightSum, float2(0.0, 1.0) - pp, dir, len2, lob, clp, j);
+	AddTap(sum, weightSum, float2(0.0, 0.0) - pp, dir, len2, lob, clp, f);
+	AddTap(sum, weightSum, float2(-1.0, 0.0) - pp, dir, len2, lob, clp, e);
+	AddTap(sum, weightSum, float2(1.0, 1.0) - pp, dir, len2, lob, clp, k);
+	AddTap(sum, weightSum, float2(2.0, 1.0) - pp, dir, len2, lob, clp, l);
+	AddTap(sum, weightSum, float2(2.0, 0.0) - pp, dir, len2, lob, clp, h);
+	AddTap(sum, weightSum, float2(1.0, 0.0) - pp, dir, len2, lob, clp, g);
+	AddTap(sum, weightSum, float2(1.0, 2.0) - pp, dir, len2, lob, clp, o);
+	AddTap(sum, weightSum, float2(0.0, 2.0) - pp, dir, len2, lob, clp, n);
+
+	// The negative lobes would ring past the nearest texels
+	float4 minColor = min(min(f, g), min(j, k));
+	float4 maxColor = max(max(f, g), max(j, k));
+	return clamp(sum / weightSum, minColor, maxColor);
+}
+
+float4 PSUpscale(PS_INPUT input) : SV_Target
+{
+	return AdjustLayerColor(EdgeAdaptiveSample(input.View & 1, input.Tex), input.View);
+}
@@ -0,0 +1,223 @@
+// Foveated compression, color correction and RGB to YUV conversion of the composited frame in a
+// single dispatch. This is compiled at runtime and each feature is enabled by a define:
+// FOVEATION (RADIAL_FOVEATION), COLOR_CORRECTION (SHARPENING), COLOR_LUT, YUV_OUTPUT, SRGB_OUTPUT,
+// HALF_PRECISION
+// The constant buffers have the same layout as the ones of the separate passes.
+
+cbuffer FoveationVars : register(b0) {
+	uint2 targetResolution;
+	uint2 optimizedResolution;
+	float2 eyeSizeRatio;
+	float2 centerSize;
+	float2 centerShift;
+	float2 edgeRatio;
+	float4 lensCenter;
+	float radialScale;
+	float radialCenter;
+	float radialCurve;
+	float _padding2;
+};
+
+cbuffer ColorCorrectionParams : register(b1) {
+	float renderWidth;
+	float renderHeight;
+	float brightness;
+	float contrast;
+	float saturation;
+	float gamma;
+	float sharpening;
+	float _align;
+};
+
+cbuffer YUVParams : register(b2) {
+	float4 offset;
+	float4 yCoeff;
+	float4 uCoeff;
+	float4 vCoeff;
+
+	float yuvWidth;
+	float yuvHeight;
+	float _padding0;
+	float _padding1;
+};
+
+// The colors are at 16 bits where the GPU supports it. The coordinates stay at full precision,
+// half floats can't address the texels of an eye
+#ifdef HALF_PRECISION
+typedef min16float colorf;
+typedef min16float3 color3;
+#else
+typedef float colorf;
+typedef float3 color3;
+#endif
+
+Texture2D<float4> compositionTexture : register(t0);
+SamplerState bilinearSampler : register(s0);
+
+#ifdef COLOR_LUT
+// Built by ColorLut, indexed with the square root of the color. The texel centers are at the
+// ends of the axes
+Texture3D<float4> colorLut : register(t1);
+static const float lutScale = (LUT_SIZE - 1.) / LUT_SIZE;
+static const float lutOffset = 0.5 / LUT_SIZE;
+#endif
+
+#ifdef YUV_OUTPUT
+RWTexture2D<float> planeY : register(u0);
+RWTexture2D<float2> planeUV : register(u1);
+#else
+RWTexture2D<float4> outputTexture : register(u0);
+#endif
+
+color3 SampleComposition(float2 uv) {
+	return (color3)compositionTexture.SampleLevel(bilinearSampler, uv, 0).rgb;
+}
+
+#ifdef FOVEATION
+#ifdef RADIAL_FOVEATION
+// Distances from the lens center are relative to the distance to the edge of the eye on each side.
+// The encoded eye keeps the pixels up to radialCenter, the client undoes this in stream.wgsl
+float2 DecompressUV(float2 uv) {
+	bool isRightEye = uv.x > 0.5;
+	float2 eyeUV = float2((uv.x + float(isRightEye) * (1. - 2. * uv.x)) * 2., uv.y) / eyeSizeRatio;
+
+	float2 center = isRightEye ? lensCenter.zw : lensCenter.xy;
+	float2 extent = eyeUV < center ? center : 1. - center;
+	float2 offset = (eyeUV - center) / extent;
+	float radius = length(offset);
+
+	float renderedRadius = radialScale * radius;
+	if (radius > radialCenter) {
+		renderedRadius += radialCurve * (radius - radialCenter) * (radius - radialCenter);
+	}
+
+	// The corners of the encoded eye land outside of the rendered one
+	float2 renderedUV = saturate(center + offset * (renderedRadius / max(radius, 1e-6)) * extent);
+
+	return float2(renderedUV.x * .5 + float(isRightEye) * (1. - renderedUV.x), renderedUV.y);
+}
+#else
+// Same mapping as CompressAxisAlignedPixelShader.hlsl
+float2 DecompressUV(float2 uv) {
+	bool isRightEye = uv.x > 0.5;
+	float2 eyeUV = float2((uv.x + float(isRightEye) * (1. - 2. * uv.x)) * 2., uv.y) / eyeSizeRatio;
+
+	float2 c0 = (1. - centerSize) / 2.;
+	float2 c1 = (edgeRatio - 1.) * c0 * (centerShift + 1.) / edgeRatio;
+	float2 c2 = (edgeRatio - 1.) * centerSize + 1.;
+
+	float2 loBound = c0 * (centerShift + 1.) / c2;
+	float2 hiBound = c0 * (centerShift - 1.) / c2 + 1.;
+	float2 underBound = float2(eyeUV.x < loBound.x, eyeUV.y < loBound.y);
+	float2 inBound = float2(loBound.x < eyeUV.x && eyeUV.x < hiBound.x,
+							loBound.y < eyeUV.y && eyeUV.y < hiBound.y);
+	float2 overBound = float2(eyeUV.x > hiBound.x, eyeUV.y > hiBound.y);
+
+	float2 center = eyeUV * c2 / edgeRatio + c1;
+	float2 d2 = eyeUV * c2;
+	float2 d3 = (eyeUV - 1.) * c2 + 1.;
+	float2 g1 = eyeUV / loBound;
+	float2 g2 = (1. - eyeUV) / (1. - hiBound);
+
+	float2 leftEdge = g1 * center + (1. - g1) * d2;
+	float2 rightEdge = g2 * center + (1. - g2) * d3;
+
+	float2 compressedUV = underBound * leftEdge + inBound * center + overBound * rightEdge;
+
+	return float2(compressedUV.x * .5 + float(isRightEye) * (1. - compressedUV.x), compressedUV.y);
+}
+#endif
+#endif
+
+#if defined(COLOR_CORRECTION) || defined(COLOR_LUT)
+// Same operations as ColorCorrectionPixelShader.hlsl, those on each pixel alone from the LUT when
+// there is one
+color3 ColorCorrect(float2 uv) {
+#ifdef SHARPENING
+	const float dx = 1. / renderWidth;
+	const float dy = 1. / renderHeight;
+	const colorf neighbourWeight = (colorf)(-sharpening / 8.);
+
+	color3 pixel = SampleComposition(uv) * (colorf)(sharpening + 1.);
+	pixel += SampleComposition(uv + float2(-dx, -dy)) * neighbourWeight;
+	pixel += SampleComposition(uv + float2(0, -dy)) * neighbourWeight;
+	pixel += SampleComposition(uv + float2(+dx, -dy)) * neighbourWeight;
+	pixel += SampleComposition(uv + float2(+dx, 0)) * neighbourWeight;
+	pixel += SampleComposition(uv + float2(+dx, +dy)) * neighbourWeight;
+	pixel += SampleComposition(uv + float2(0, +dy)) * neighbourWeight;
+	pixel += SampleComposition(uv + float2(-dx, +dy)) * neighbourWeight;
+	pixel += SampleComposition(uv + float2(-dx, 0)) * neighbourWeight;
+#else
+	color3 pixel = SampleComposition(uv);
+#endif
+
+#ifdef COLOR_LUT
+	// The LUT covers 0 to 1, the extended range of HDR is clipped like by the color correction
+	const float3 lutUV = sqrt(saturate((float3)pixel)) * lutScale + lutOffset;
+	return (color3)colorLut.SampleLevel(bilinearSampler, lutUV, 0).rgb;
+#else
+	// The parameters are cast, an operation with a float would run at full precision
+	pixel += (colorf)brightness;
+	pixel = (pixel - 0.5) * (colorf)contrast + 0.5;
+	pixel = max(lerp(dot(pixel, color3(0.299, 0.587, 0.114)), pixel, (colorf)saturation), pixel);
+
+	pixel = clamp(pixel, 0, 1);
+	return pow(pixel, (colorf)(1. / gamma));
+#endif
+}
+#endif
+
+color3 ProcessPixel(uint2 pixel, float2 outputSize) {
+	float2 uv = (float2(pixel) + 0.5) / outputSize;
+#ifdef FOVEATION
+	uv = DecompressUV(uv);
+#endif
+#if defined(COLOR_CORRECTION) || defined(COLOR_LUT)
+	return ColorCorrect(uv);
+#else
+	return SampleComposition(uv);
+#endif
+}
+
+color3 LinearToSrgb(color3 color) {
+	return color <= 0.0031308 ? color * 12.92 : 1.055 * pow(color, 1. / 2.4) - 0.055;
+}
+
+[numthreads(8, 8, 1)]
+void main(uint3 id : SV_DispatchThreadID) {
+	uint width, height;
+#ifdef YUV_OUTPUT
+	planeY.GetDimensions(width, height);
+
+	// Each thread writes a 2x2 luma block and the chroma sample it shares
+	uint2 pixel = id.xy * 2;
+	if (pixel.x >= width || pixel.y >= height) {
+		return;
+	}
+
+	color3 chroma = 0;
+	for (uint i = 0; i < 4; i++) {
+		uint2 p = pixel + uint2(i & 1, i >> 1);
+		color3 rgb = ProcessPixel(p, float2(width, height));
+		planeY[p] = dot(rgb, (color3)yCoeff.rgb) + offset.x;
+		chroma += rgb;
+	}
+	chroma /= 4.;
+
+	planeUV[id.xy] = float2(
+		dot(chroma, (color3)uCoeff.rgb) + offset.y, dot(chroma, (color3)vCoeff.rgb) + offset.z
+	);
+#else
+	outputTexture.GetDimensions(width, height);
+	if (id.x >= width || id.y >= height) {
+		return;
+	}
+
+	color3 rgb = ProcessPixel(id.xy, float2(width, height));
+#ifdef SRGB_OUTPUT
+	// UAVs can't have an sRGB format, encode like the render target of the separate passes would
+	rgb = LinearToSrgb(saturate(rgb));
+#endif
+	outputTexture[id.xy] = float4(rgb, 1);
+#endif
+}
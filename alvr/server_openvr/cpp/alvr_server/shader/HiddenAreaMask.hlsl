@@ -0,0 +1,32 @@
+// Marks the pixels of the composition that the lens hides in the stencil buffer, see
+// HiddenAreaMask. A single triangle covers the frame and the visible pixels are discarded.
+// Compiled at runtime, VS and PS are the entry points.
+
+cbuffer MaskParams : register(b0) {
+	// Per eye, tangents of the left, right, up and down edges
+	float4 eyeTangents[2];
+	float2 eyeSize;
+	float radius;
+	float _padding;
+};
+
+float4 VS(uint id : SV_VertexID) : SV_Position {
+	float2 uv = float2((id << 1) & 2, id & 2);
+	return float4(uv * float2(2., -2.) + float2(-1., 1.), 0., 1.);
+}
+
+// Outside of the ellipse inscribed in the field of view of the eye, scaled by radius. Each
+// quadrant is scaled on its own, so that the ellipse is centered on the view direction. Same test
+// as frame.comp of the Linux driver
+void PS(float4 position : SV_Position) {
+	uint eye = position.x >= eyeSize.x ? 1 : 0;
+	float2 eyeUV = (position.xy - float2(eye * eyeSize.x, 0.)) / eyeSize;
+	float4 t = eyeTangents[eye];
+
+	float2 tangent = float2(lerp(t.x, t.y, eyeUV.x), lerp(t.z, t.w, eyeUV.y));
+	float2 extent = abs(float2(tangent.x < 0. ? t.x : t.y, tangent.y > 0. ? t.z : t.w));
+	float2 offset = tangent / max(extent, 1e-4);
+	if (dot(offset, offset) <= radius * radius) {
+		discard;
+	}
+}
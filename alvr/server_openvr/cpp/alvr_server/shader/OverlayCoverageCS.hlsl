@@ -0,0 +1,38 @@
+// Finds where an overlay layer is opaque, for the QP reduction of the overlays. One thread per
+// cell of the grid over the eye, which keeps the highest alpha of 8x8 samples of the layer in the
+// cell. Compiled at runtime, dispatched once per eye of each overlay layer.
+
+Texture2D<float4> layer : register(t0);
+// One uint per cell of both eyes, the alpha scaled to 255. Cleared before the first layer
+RWByteAddressBuffer coverage : register(u0);
+
+cbuffer CoverageParams : register(b0) {
+	// Bounds of the eye in the layer texture
+	float2 uvMin;
+	float2 uvMax;
+	uint2 cells;
+	uint eye;
+	uint padding;
+};
+
+[numthreads(8, 8, 1)]
+void main(uint3 id : SV_DispatchThreadID) {
+	if (id.x >= cells.x || id.y >= cells.y) {
+		return;
+	}
+
+	uint width, height;
+	layer.GetDimensions(width, height);
+
+	float alpha = 0.0;
+	[unroll]
+	for (uint i = 0; i < 64; i++) {
+		float2 cellUv = (float2(id.xy) + (float2(i % 8, i / 8) + 0.5) / 8.0) / float2(cells);
+		float2 uv = lerp(uvMin, uvMax, cellUv);
+		uint2 texel = min(uint2(uv * float2(width, height)), uint2(width - 1, height - 1));
+		alpha = max(alpha, layer[texel].a);
+	}
+
+	uint cell = (eye * cells.y + id.y) * cells.x + id.x;
+	coverage.InterlockedMax(cell * 4, (uint)(saturate(alpha) * 255.0));
+}
@@ -0,0 +1,39 @@
+// Counts the 16x16 tiles that differ between the frame given to the encoder and the previous one.
+// Compiled at runtime. For YUV frames only the luma plane is compared.
+
+Texture2D<float4> currentFrame : register(t0);
+Texture2D<float4> previousFrame : register(t1);
+// Element 0 is the number of changed tiles, cleared before the dispatch
+RWByteAddressBuffer changedTiles : register(u0);
+
+groupshared uint tileChanged;
+
+// One group per tile, each thread compares 2x2 pixels
+[numthreads(8, 8, 1)]
+void main(uint3 groupId : SV_GroupID, uint3 threadId : SV_GroupThreadID, uint threadIndex : SV_GroupIndex) {
+	if (threadIndex == 0) {
+		tileChanged = 0;
+	}
+	GroupMemoryBarrierWithGroupSync();
+
+	uint width, height;
+	currentFrame.GetDimensions(width, height);
+
+	uint2 base = groupId.xy * 16 + threadId.xy * 2;
+	bool changed = false;
+	[unroll]
+	for (uint i = 0; i < 4; i++) {
+		uint2 pos = base + uint2(i % 2, i / 2);
+		if (pos.x < width && pos.y < height && any(currentFrame[pos] != previousFrame[pos])) {
+			changed = true;
+		}
+	}
+	if (changed) {
+		tileChanged = 1;
+	}
+	GroupMemoryBarrierWithGroupSync();
+
+	if (threadIndex == 0 && tileChanged != 0) {
+		changedTiles.InterlockedAdd(0, 1);
+	}
+}
@@ -1,10 +1,20 @@
 #include "CEncoder.h"
 
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <climits>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <exception>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <linux/futex.h>
 #include <memory>
+#include <optional>
 #include <poll.h>
 #include <sstream>
 #include <stdexcept>
@@ -13,15 +23,24 @@
 #include <sys/mman.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/un.h>
+#include <thread>
 #include <unistd.h>
 
 #include "ALVR-common/packet_types.h"
 #include "EncodePipeline.h"
 #include "FrameRender.h"
+#include "alvr_server/DriverCounters.h"
+#include "alvr_server/EncoderWatchdog.h"
+#include "alvr_server/FrameRecording.h"
+#include "alvr_server/FrameTrace.h"
+#include "alvr_server/LatencyTarget.h"
 #include "alvr_server/Logger.h"
 #include "alvr_server/PoseHistory.h"
 #include "alvr_server/Settings.h"
+#include "alvr_server/StartupProfiler.h"
+#include "alvr_server/TraceCapture.h"
 #include "ffmpeg_helper.h"
 #include "protocol.h"
 
@@ -48,22 +67,150 @@ void read_exactly(pollfd pollfds, char* out, size_t size, std::atomic_bool& exit
             if (s == -1) {
                 throw MakeException("read failed: %s", strerror(errno));
             }
+            if (s == 0) {
+                throw MakeException("socket closed");
+            }
             out += s;
             size -= s;
         }
     }
 }
 
-void read_latest(pollfd pollfds, char* out, size_t size, std::atomic_bool& exiting) {
-    read_exactly(pollfds, out, size, exiting);
-    while (not exiting) {
-        int timeout = 0; // poll api fixes the original perfectly(0 microseconds)
-        pollfds.events = POLLIN;
-        int count = poll(&pollfds, 1, timeout);
-        if (count == 0)
+// sync_files of the presents, which the layer sends on the socket ahead of their packets
+class present_sync_fds {
+public:
+    ~present_sync_fds() {
+        for (auto& pending : m_fds) {
+            close(pending.second);
+        }
+    }
+
+    // Reads those waiting on the socket. Throws if the layer closed it
+    void receive(int socket_fd) {
+        while (true) {
+            present_sync_message message;
+            iovec iov = { &message, sizeof(message) };
+            char control[CMSG_SPACE(sizeof(int))];
+            msghdr msg = {};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            ssize_t size = recvmsg(socket_fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+            if (size == 0) {
+                throw MakeException("present socket closed");
+            }
+            if (size < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    return;
+                }
+                throw MakeException("recvmsg failed: %s", strerror(errno));
+            }
+
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            if (cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+            m_fds.emplace_back(message.packet_index, fd);
+            // The packets of the older ones were overwritten, they won't be taken anymore
+            while (m_fds.front().first + present_ring::size < message.packet_index) {
+                close(m_fds.front().second);
+                m_fds.pop_front();
+            }
+        }
+    }
+
+    // The sync_file of the packet, -1 if there is none. Those of the packets skipped before it
+    // are closed
+    int take(int socket_fd, uint64_t packet_index) {
+        receive(socket_fd);
+        while (!m_fds.empty() && m_fds.front().first <= packet_index) {
+            auto pending = m_fds.front();
+            m_fds.pop_front();
+            if (pending.first == packet_index) {
+                return pending.second;
+            }
+            close(pending.second);
+        }
+        return -1;
+    }
+
+private:
+    std::deque<std::pair<uint64_t, int>> m_fds;
+};
+
+bool present_ready(const present_ring& ring, uint64_t read_index) {
+    return ring.write_index.load(std::memory_order_acquire) != read_index;
+}
+
+// Blocks until the layer has pushed a present newer than read_index
+void wait_present(
+    const present_ring& ring,
+    uint64_t read_index,
+    int event_fd,
+    int socket_fd,
+    present_sync_fds& sync_fds,
+    std::atomic_bool& exiting
+) {
+    pollfd pollfds[2] = { { event_fd, POLLIN, 0 }, { socket_fd, POLLIN, 0 } };
+    while (not exiting and not present_ready(ring, read_index)) {
+        int timeout = 15; // the eventfd wakes us up, this only bounds the exit latency
+        int count = poll(pollfds, 2, timeout);
+        if (count < 0 and errno != EINTR) {
+            throw MakeException("poll failed: %s", strerror(errno));
+        }
+        // After the init, the layer only writes the sync_files of the presents on the socket
+        if (pollfds[1].revents & POLLIN) {
+            sync_fds.receive(socket_fd);
+        } else if (pollfds[1].revents) {
+            throw MakeException("present socket closed");
+        }
+        if (pollfds[0].revents & POLLIN) {
+            uint64_t value;
+            if (read(event_fd, &value, sizeof(value)) == -1 and errno != EAGAIN) {
+                throw MakeException("eventfd read failed: %s", strerror(errno));
+            }
+        }
+    }
+}
+
+// Shares the client vsync with the layer, which paces vrcompositor on it
+void publish_vsync(vsync_clock& clock) {
+    FfiVsyncTiming timing = GetVsyncTiming();
+    uint32_t sequence = clock.sequence.load(std::memory_order_relaxed);
+    clock.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    clock.vsync_ns.store(FrameTrace::Now() + timing.untilNextVsyncNs, std::memory_order_relaxed);
+    clock.interval_ns.store(timing.intervalNs, std::memory_order_relaxed);
+    clock.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+// Copies the newest present, older ones are skipped without touching them
+void read_latest(const present_ring& ring, uint64_t& read_index, present_packet& out) {
+    while (true) {
+        uint64_t write_index = ring.write_index.load(std::memory_order_acquire);
+        memcpy(&out, &ring.packets[(write_index - 1) % present_ring::size], sizeof(out));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        // Retry if the layer wrapped around and may have overwritten the slot while we copied it
+        if (ring.write_index.load(std::memory_order_relaxed) - write_index
+            < present_ring::size - 1) {
+            read_index = write_index;
             return;
-        read_exactly(pollfds, out, size, exiting);
+        }
+    }
+}
+
+// Completes the presents up to present_id for vkWaitForPresentKHR in the layer, the older ones
+// having been skipped for it
+void consume_present(present_ring& ring, uint64_t present_id) {
+    if (present_id <= ring.consumed_present_id.load(std::memory_order_relaxed)) {
+        return;
     }
+    ring.consumed_present_id.store(present_id, std::memory_order_release);
+    ring.consumed_sequence.fetch_add(1, std::memory_order_release);
+    syscall(SYS_futex, &ring.consumed_sequence, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
 }
 
 int accept_timeout(pollfd socket, std::atomic_bool& exiting) {
@@ -98,9 +245,89 @@ void av_logfn(void*, int level, const char* data, va_list va) {
         Info("Encoder: %s", buf);
 }
 
+// Collects the encoded frames in order, off the render loop. Post waits while limit frames are
+// outstanding, so that a render output is reused only once the frame before was collected
+class OutputThread {
+public:
+    explicit OutputThread(size_t limit)
+        : limit(limit)
+        , thread(&OutputThread::run, this) { }
+
+    ~OutputThread() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            exiting = true;
+        }
+        cv.notify_all();
+        thread.join();
+    }
+
+    void Post(std::function<void()> task) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return outstanding < limit; });
+            tasks.push_back(std::move(task));
+            outstanding++;
+        }
+        cv.notify_all();
+    }
+
+private:
+    void run() {
+        Info(
+            "%s\n",
+            ApplyThreadRole(ThreadRole::EncoderOutput, Settings::Instance().m_encoderOutputThread)
+                .c_str()
+        );
+
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return exiting || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+
+            try {
+                task();
+            } catch (std::exception& e) {
+                Error("CEncoder: failed to collect a frame: %s\n", e.what());
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                outstanding--;
+            }
+            cv.notify_all();
+        }
+    }
+
+    size_t limit;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> tasks;
+    size_t outstanding = 0;
+    bool exiting = false;
+    // Last, it starts once the rest is initialized
+    std::thread thread;
+};
+
 } // namespace
 
-void CEncoder::GetFds(int client, int (*received_fds)[6]) {
+// Destroyed in reverse order, the encoder first
+struct CEncoder::Pipeline {
+    std::array<uint8_t, VK_UUID_SIZE> device_uuid;
+    std::unique_ptr<alvr::VkContext> context;
+    std::unique_ptr<FrameRender> render;
+    std::vector<std::unique_ptr<alvr::VkFrame>> frames;
+    std::unique_ptr<alvr::EncodePipeline> encoder;
+};
+
+void CEncoder::GetFds(int client, size_t count) {
     struct msghdr msg;
     struct cmsghdr* cmsg;
     union {
@@ -128,7 +355,6 @@ void CEncoder::GetFds(int client, int (*received_fds)[6]) {
 
     for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
         if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
-            memcpy(received_fds, CMSG_DATA(cmsg), sizeof(*received_fds));
             break;
         }
     }
@@ -136,12 +362,23 @@ void CEncoder::GetFds(int client, int (*received_fds)[6]) {
     if (cmsg == NULL) {
         throw MakeException("cmsg is NULL");
     }
+    m_fds.resize((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    memcpy(m_fds.data(), CMSG_DATA(cmsg), m_fds.size() * sizeof(int));
+    if (m_fds.size() != count) {
+        for (int fd : m_fds) {
+            close(fd);
+        }
+        throw MakeException("Expected %zu fds from the layer, got %zu", count, m_fds.size());
+    }
 }
 
 void CEncoder::Run() {
     Info("CEncoder::Run\n");
-    m_socketPath = getenv("XDG_RUNTIME_DIR");
-    m_socketPath += "/alvr-ipc";
+    Info(
+        "%s\n", ApplyThreadRole(ThreadRole::Encoder, Settings::Instance().m_encoderThread).c_str()
+    );
+    m_socketPath = ipc_socket_path();
+    Info("CEncoder: listening on %s\n", m_socketPath.c_str());
 
     int ret;
     // we don't really care about what happends with unlink, it's just incase we crashed before this
@@ -172,13 +409,44 @@ void CEncoder::Run() {
     }
 
     Info("CEncoder Listening\n");
-    struct pollfd client;
-    client.fd = accept_timeout(m_socket, m_exiting);
-    if (m_exiting)
-        return;
+
+    // vrcompositor connects again when SteamVR recovers from a crash or switches apps
+    std::unique_ptr<Pipeline> pipeline;
+    while (not m_exiting) {
+        struct pollfd client;
+        client.fd = accept_timeout(m_socket, m_exiting);
+        if (client.fd == -1) {
+            continue;
+        }
+        try {
+            RunConnection(client, pipeline);
+        } catch (std::exception& e) {
+            Error("CEncoder: the layer disconnected during its init: %s\n", e.what());
+        }
+        m_connected = false;
+        client.events = POLLHUP;
+        close(client.fd);
+    }
+}
+
+void CEncoder::RunConnection(pollfd client, std::unique_ptr<Pipeline>& pipeline) {
+    StreamStart::Mark(StreamStart::COMPOSITOR_CONNECTED);
     init_packet init;
     client.events = POLLIN;
     read_exactly(client, (char*)&init, sizeof(init), m_exiting);
+    if (m_exiting)
+        return;
+    if (init.num_images == 0 || init.num_images > init_packet::max_images) {
+        Error("CEncoder: the layer sent %u images\n", init.num_images);
+        return;
+    }
+    if (init.memory_handle_type != VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT
+        && init.memory_handle_type != VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT) {
+        Error("CEncoder: the layer sent images of handle type %d\n", init.memory_handle_type);
+        return;
+    }
+    std::vector<init_image> images(init.num_images);
+    read_exactly(client, (char*)images.data(), images.size() * sizeof(init_image), m_exiting);
     if (m_exiting)
         return;
 
@@ -193,105 +461,487 @@ void CEncoder::Run() {
     ifscmdl >> ifbuf2;
     Info("CEncoder client connected, pid %d, cmdline %s\n", (int)init.source_pid, ifbuf2);
 
+    present_ring* ring = nullptr;
+    int event_fd = -1;
+    // Until the stream runs, a failure may come from the objects kept from the last connection,
+    // they are then created again for the next one
+    bool rebuild = true;
     try {
-        GetFds(client.fd, &m_fds);
+        GetFds(client.fd, init_fd_count(init.num_images));
+        StreamStart::Mark(StreamStart::COMPOSITOR_FDS_RECEIVED);
+        const size_t ring_fd = init.num_images * 2;
+
+        void* ring_mapping = mmap(
+            nullptr, sizeof(present_ring), PROT_READ | PROT_WRITE, MAP_SHARED, m_fds[ring_fd], 0
+        );
+        close(m_fds[ring_fd]);
+        if (ring_mapping == MAP_FAILED) {
+            throw MakeException("present ring mmap failed: %s", strerror(errno));
+        }
+        ring = static_cast<present_ring*>(ring_mapping);
+        {
+            std::lock_guard<std::mutex> lock(m_ringMutex);
+            m_ring = ring;
+        }
+        event_fd = m_fds[ring_fd + 1];
 
         m_connected = true;
 
-        fprintf(stderr, "\n\nWe are initalizing Vulkan in CEncoder thread\n\n\n");
+        if (pipeline && pipeline->device_uuid == init.device_uuid
+            && pipeline->render->CanReplaceImages(init)) {
+            Info("CEncoder: reusing the encoder of the last connection\n");
+            pipeline->render->ReplaceImages(init, images.data(), m_fds.data());
+            // The encoder may still reference frames the client didn't get
+            m_scheduler.InsertIDR();
+        } else {
+            pipeline.reset();
+            pipeline = std::make_unique<Pipeline>();
+            pipeline->device_uuid = init.device_uuid;
+
+            fprintf(stderr, "\n\nWe are initalizing Vulkan in CEncoder thread\n\n\n");
+
+            av_log_set_callback(av_logfn);
+
+            pipeline->context = std::make_unique<alvr::VkContext>(
+                init.device_uuid.data(), std::vector<const char*>()
+            );
+            alvr::VkContext& vk_ctx = *pipeline->context;
+            alvr::EncodePipeline::SelectDevice(vk_ctx);
+
+            pipeline->render
+                = std::make_unique<FrameRender>(vk_ctx, init, images.data(), m_fds.data());
+            FrameRender& render = *pipeline->render;
+            render.SetCrossDeviceOutput(vk_ctx.encodeDevicePath != vk_ctx.devicePath);
+            render.SetLinearOutput(alvr::EncodePipeline::UsesLinearOutput(vk_ctx));
+            render.CreateOutput();
+
+            for (uint32_t i = 0; i < render.GetOutputCount(); ++i) {
+                auto& output = render.GetOutput(i);
+                pipeline->frames.push_back(std::make_unique<alvr::VkFrame>(
+                    vk_ctx, output.image, output.imageInfo, output.size, output.memory, output.drm
+                ));
+            }
+            pipeline->encoder = alvr::EncodePipeline::Create(
+                &render,
+                vk_ctx,
+                pipeline->frames,
+                render.GetOutput(0).imageInfo,
+                render.GetEncodingWidth(),
+                render.GetEncodingHeight()
+            );
+            StreamStart::Mark(StreamStart::ENCODER_CREATED);
+            Info(
+                "CEncoder: the compositor uses %.1f MB of GPU memory besides the input images\n",
+                render.GetMemoryUsage() / (1024.0 * 1024.0)
+            );
+        }
+        alvr::VkContext& vk_ctx = *pipeline->context;
+        FrameRender& render = *pipeline->render;
+        auto& frames = pipeline->frames;
+        auto& encode_pipeline = pipeline->encoder;
+        rebuild = false;
+
+        std::atomic_bool valid_timestamps = true;
+
+        // A frame that was pushed to the encoder but whose bitstream has not been sent yet
+        struct InFlightFrame {
+            uint64_t targetTimestampNs;
+            uint32_t renderOutput;
+            // Of the present packet, 0 if the layer didn't stamp it
+            uint64_t presentNs;
+            // Renders submitted before this one, its output is rendered to again
+            // Renderer::FramesInFlight renders later
+            uint64_t renderIndex;
+        };
+        std::optional<InFlightFrame> in_flight;
+        std::atomic_uint64_t render_count = 0;
+        // Frames collected before the encoder output them, when it pipelines several frames.
+        // Only used by finish_frame
+        std::deque<InFlightFrame> late_frames;
+
+        const bool pipelined = Settings::Instance().m_enableLinuxPipelinedEncoding;
+        if (pipelined) {
+            Info("CEncoder: pipelined encoding enabled\n");
+        }
+
+        // With the output thread the encoder and the renderer are used from both threads
+        std::mutex encoder_mutex;
+        std::mutex render_mutex;
+
+        EncoderWatchdog watchdog;
+        // Set when getting an encoded frame threw, on either thread
+        std::atomic_bool encode_failed = false;
+        // Rebuilt with the backend Create picks, the render outputs were made for it, so there is
+        // no other one to fall back to. When the rebuilt one fails too, the stream ends and the
+        // pipeline is created again at the next connection of the layer
+        auto recover_encoder = [&](EncoderWatchdog::Action action) {
+            if (action == EncoderWatchdog::Action::Fallback) {
+                rebuild = true;
+                throw std::runtime_error("the encoder keeps failing after being rebuilt");
+            }
+            Warn("CEncoder: rebuilding the encoder\n");
+            std::lock_guard<std::mutex> lock(encoder_mutex);
+            encode_pipeline.reset();
+            encode_pipeline = alvr::EncodePipeline::Create(
+                &render,
+                vk_ctx,
+                frames,
+                render.GetOutput(0).imageInfo,
+                render.GetEncodingWidth(),
+                render.GetEncodingHeight()
+            );
+            // The new encoder has no references, the client can't decode until the next IDR
+            m_scheduler.InsertIDR();
+            watchdog.OnRecovered();
+        };
+
+        auto send_packet = [&](alvr::FramePacket& packet) {
+            FfiNalRange range = { packet.data, (unsigned int)packet.size };
+            ParseFrameNalRanges(
+                encode_pipeline->GetCodec(),
+                &range,
+                1,
+                packet.pts,
+                packet.isIDR,
+                true,
+                packet.release,
+                packet.releaseContext
+            );
 
-        av_log_set_callback(av_logfn);
+            packet.stats.isIdr = packet.isIDR;
+            ReportEncoderStats(packet.stats);
+        };
 
-        alvr::VkContext vk_ctx(init.device_uuid.data(), {});
+        auto report_frame = [&](const InFlightFrame& frame) {
+            if (!valid_timestamps) {
+                return;
+            }
+            Renderer::Timestamps render_timestamps;
+            {
+                std::lock_guard<std::mutex> lock(render_mutex);
+                render_timestamps = render.GetTimestamps(frame.renderOutput);
+            }
+            alvr::EncodePipeline::Timestamp encode_timestamp;
+            {
+                std::lock_guard<std::mutex> lock(encoder_mutex);
+                encode_timestamp = encode_pipeline->GetTimestamp();
+            }
 
-        FrameRender render(vk_ctx, init, m_fds);
-        auto output = render.CreateOutput();
+            // All in the FrameTrace::Now() domain: the layer samples the same steady clock, and
+            // the renderer maps the GPU timestamps to it through its calibration
+            valid_timestamps = render_timestamps.now != 0;
+            if (!valid_timestamps) {
+                return;
+            }
+            uint64_t now_ns = render_timestamps.now;
+
+            // The composite begins some time after vrcompositor presented, the layer knows
+            // when exactly
+            uint64_t present_offset = frame.presentNs != 0
+                ? now_ns - frame.presentNs
+                : now_ns - render_timestamps.renderBegin;
+
+            FrameTrace::Instance().Record(
+                frame.targetTimestampNs,
+                FRAME_TRACE_COMPOSITE_BEGIN,
+                render_timestamps.renderBegin
+            );
+            FrameTrace::Instance().Record(
+                frame.targetTimestampNs,
+                FRAME_TRACE_COMPOSITE_END,
+                render_timestamps.renderComplete
+            );
+            TraceCapture::Instance().AddGpuSpan(
+                TraceCapture::GPU_TRACK_COMPOSITOR,
+                "Compositor",
+                render_timestamps.renderBegin,
+                render_timestamps.renderComplete,
+                frame.targetTimestampNs
+            );
 
-        alvr::VkFrame frame(
-            vk_ctx, output.image, output.imageInfo, output.size, output.memory, output.drm
-        );
-        auto encode_pipeline = alvr::EncodePipeline::Create(
-            &render,
-            vk_ctx,
-            frame,
-            output.imageInfo,
-            render.GetEncodingWidth(),
-            render.GetEncodingHeight()
-        );
+            // From when the encoder got the frame, or when the composite ended for those that
+            // don't say
+            uint64_t composed_offset = encode_timestamp.cpu != 0
+                ? now_ns - encode_timestamp.cpu
+                : now_ns - render_timestamps.renderComplete;
 
-        bool valid_timestamps = true;
+            if (present_offset < composed_offset) {
+                present_offset = composed_offset;
+            }
+
+            ReportPresent(frame.targetTimestampNs, present_offset);
+            ReportComposed(frame.targetTimestampNs, composed_offset);
+        };
+
+        // The frame of a packet that comes out late is reported with it while the timestamps of
+        // its output haven't been replaced by a later render. Otherwise it is sent as is
+        auto send_late_packet = [&](alvr::FramePacket& packet) {
+            while (!late_frames.empty() && late_frames.front().targetTimestampNs < packet.pts) {
+                late_frames.pop_front();
+            }
+            if (!late_frames.empty() && late_frames.front().targetTimestampNs == packet.pts) {
+                if (render_count - late_frames.front().renderIndex <= Renderer::FramesInFlight) {
+                    report_frame(late_frames.front());
+                }
+                late_frames.pop_front();
+            }
+            send_packet(packet);
+        };
+
+        auto finish_frame = [&](const InFlightFrame& frame) {
+            TraceScope scope("CEncoder::FinishFrame", frame.targetTimestampNs);
+            // A frame the encoder was late with comes out first
+            alvr::FramePacket packet;
+            bool encoded = false;
+            while (!encoded) {
+                try {
+                    std::lock_guard<std::mutex> lock(encoder_mutex);
+                    if (!encode_pipeline->GetEncoded(packet)) {
+                        break;
+                    }
+                } catch (std::exception& e) {
+                    Error("CEncoder: failed to get the encoded frame: %s\n", e.what());
+                    encode_failed = true;
+                    return;
+                }
+                encoded = packet.pts == frame.targetTimestampNs;
+                if (!encoded) {
+                    send_late_packet(packet);
+                    packet = {};
+                }
+            }
+            if (!encoded) {
+                Debug("CEncoder: frame not encoded yet, it is sent with the next one\n");
+                late_frames.push_back(frame);
+                return;
+            }
+
+            report_frame(frame);
+            send_packet(packet);
+        };
+
+        IDRScheduler::ReferenceInvalidator invalidate_references
+            = [&](const std::vector<uint64_t>& lostTimestampsNs, uint64_t referenceTimestampNs) {
+                  std::lock_guard<std::mutex> lock(encoder_mutex);
+                  return encode_pipeline->InvalidateReferences(
+                      lostTimestampsNs, referenceTimestampNs
+                  );
+              };
+
+        std::unique_ptr<OutputThread> output_thread;
+        if (Settings::Instance().m_enableLinuxAsyncOutput) {
+            Info("CEncoder: async output enabled\n");
+            output_thread = std::make_unique<OutputThread>(Renderer::FramesInFlight - 1);
+        }
+        auto complete_frame = [&](const InFlightFrame& frame) {
+            if (output_thread) {
+                output_thread->Post([&finish_frame, frame] { finish_frame(frame); });
+            } else {
+                finish_frame(frame);
+            }
+        };
 
         fprintf(stderr, "CEncoder starting to read present packets");
+        std::unique_ptr<FrameRecorder> recorder;
+        uint64_t recording_start_ns = 0;
+        // Last params applied to the encoder, saved along the recorded frames
+        FfiDynamicEncoderParams encoder_params = {};
         present_packet frame_info;
+        uint64_t present_received_ns = 0;
+        uint64_t read_index = 0;
+        present_sync_fds sync_fds;
+        bool have_frame_info = false;
+        uint64_t missed_vsyncs = 0;
+        // Target timestamp of the last frame pushed to the encoder
+        uint64_t last_target_ns = 0;
         while (not m_exiting) {
-            read_latest(client, (char*)&frame_info, sizeof(frame_info), m_exiting);
-
-            encode_pipeline->SetParams(GetDynamicEncoderParams());
+            if (!have_frame_info) {
+                wait_present(*ring, read_index, event_fd, client.fd, sync_fds, m_exiting);
+                if (m_exiting) {
+                    break;
+                }
+                read_latest(*ring, read_index, frame_info);
+                present_received_ns = FrameTrace::Now();
+            }
+            have_frame_info = false;
+            // vrcompositor presents once per vsync, which keeps the clock of the layer up to date
+            publish_vsync(ring->vsync);
+            uint64_t layer_missed_vsyncs = ring->missed_vsyncs.load(std::memory_order_relaxed);
+            if (layer_missed_vsyncs != missed_vsyncs) {
+                ReportMissedVsyncs(layer_missed_vsyncs - missed_vsyncs);
+                missed_vsyncs = layer_missed_vsyncs;
+            }
 
-            auto pose = m_poseHistory->GetBestPoseMatch((const vr::HmdMatrix34_t&)frame_info.pose);
+            auto pose = m_poseHistory->GetPoseMatchUpTo(
+                (const vr::HmdMatrix34_t&)frame_info.pose, frame_info.newest_pose_ns
+            );
             if (!pose) {
+                consume_present(*ring, frame_info.present_id);
+                if (in_flight) {
+                    complete_frame(*in_flight);
+                    in_flight.reset();
+                }
                 continue;
             }
+            // vrcompositor presented the same frame again because the game missed one
+            if (pose->targetTimestampNs == last_target_ns) {
+                DriverCounters::Add(DRIVER_COUNTER_DUPLICATE_FRAMES);
+                if (Settings::Instance().m_skipDuplicateFrames) {
+                    consume_present(*ring, frame_info.present_id);
+                    if (in_flight) {
+                        complete_frame(*in_flight);
+                        in_flight.reset();
+                    }
+                    continue;
+                }
+            }
+            // The client reprojects the previous frame in place of the ones the decimation skips
+            if (!ShouldEncodeFrame()) {
+                consume_present(*ring, frame_info.present_id);
+                if (in_flight) {
+                    complete_frame(*in_flight);
+                    in_flight.reset();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> render_lock(render_mutex);
+            const uint64_t target_ns = pose->targetTimestampNs;
+
+            // From there to the pose match is the handoff from vrcompositor to the encoder
+            const uint64_t present_ns
+                = frame_info.present_ns != 0 ? frame_info.present_ns : present_received_ns;
+            FrameTrace::Instance().Record(target_ns, FRAME_TRACE_PRESENT, present_ns);
+            FrameTrace::Instance().Record(target_ns, FRAME_TRACE_POSE_MATCHED);
+            StreamStart::Mark(StreamStart::FIRST_PRESENT);
+            StreamStart::Mark(StreamStart::FIRST_POSE_MATCH);
+            TraceScope scope("CEncoder::Run", target_ns);
+
+            if (m_captureFrames > 0) {
+                m_captureFrames--;
+                const std::string prefix = Settings::Instance().m_captureFrameDir + "/alvr_frame_"
+                    + std::to_string(target_ns);
+                render.CaptureInputFrame(prefix + "_input.png");
+                render.CaptureOutputFrame(prefix + "_output.png");
+            }
 
-            if (m_captureFrame) {
-                m_captureFrame = false;
-                render.CaptureInputFrame(
-                    Settings::Instance().m_captureFrameDir + "/alvr_frame_input.ppm"
-                );
-                render.CaptureOutputFrame(
-                    Settings::Instance().m_captureFrameDir + "/alvr_frame_output.ppm"
-                );
+            {
+                std::lock_guard<std::mutex> lock(m_recordingMutex);
+                if (!m_recordingPath.empty()) {
+                    recorder = std::make_unique<FrameRecorder>(
+                        m_recordingPath,
+                        init.image_create_info.extent.width,
+                        init.image_create_info.extent.height,
+                        m_recordingFrames
+                    );
+                    recording_start_ns = present_received_ns;
+                    m_recordingPath.clear();
+                }
+            }
+            std::vector<uint8_t> recorded_image;
+            if (recorder) {
+                render.ReadInputImage(frame_info.image, frame_info.semaphore_value, recorded_image);
             }
 
-            render.Render(frame_info.image, frame_info.semaphore_value);
+            // read_index is past the packet of frame_info
+            int sync_fd = frame_info.has_sync_fd ? sync_fds.take(client.fd, read_index - 1) : -1;
+            uint32_t render_output
+                = render.Render(frame_info.image, frame_info.semaphore_value, sync_fd);
+            render_lock.unlock();
+            // The composite reading the image is submitted, vrcompositor can render the next one
+            consume_present(*ring, frame_info.present_id);
+            const uint64_t render_index = render_count++;
+            watchdog.BeginFrame();
+            std::string encode_error;
+            try {
+                std::lock_guard<std::mutex> lock(encoder_mutex);
+                encode_pipeline->PrepareFrame(render_output);
+            } catch (std::exception& e) {
+                encode_error = e.what();
+            }
+
+            // When pipelining, the previous frame is collected only now so that its encode
+            // overlaps with the composite that was just submitted
+            if (in_flight) {
+                complete_frame(*in_flight);
+                in_flight.reset();
+            }
 
             if (!valid_timestamps) {
-                ReportPresent(pose->targetTimestampNs, 0);
-                ReportComposed(pose->targetTimestampNs, 0);
+                ReportPresent(target_ns, FrameTrace::Now() - present_ns);
+                ReportComposed(target_ns, 0);
             }
 
-            encode_pipeline->PushFrame(pose->targetTimestampNs, m_scheduler.CheckIDRInsertion());
+            auto params = GetDynamicEncoderParams();
+            if (params.updated) {
+                encoder_params = params;
+            }
+            const bool idr = m_scheduler.CheckIDRInsertion(
+                target_ns,
+                encode_pipeline->InvalidatesReferences() ? invalidate_references : nullptr
+            );
+            if (encode_error.empty()) {
+                try {
+                    std::lock_guard<std::mutex> lock(encoder_mutex);
+                    encode_pipeline->SetParams(params);
+                    FrameTrace::Instance().Record(target_ns, FRAME_TRACE_ENCODE_SUBMIT);
+                    encode_pipeline->PushFrame(render_output, target_ns, idr);
+                } catch (std::exception& e) {
+                    encode_error = e.what();
+                }
+            }
+            if (encode_failed.exchange(false) && encode_error.empty()) {
+                encode_error = "an encoded frame couldn't be read";
+            }
+            if (!encode_error.empty()) {
+                recover_encoder(watchdog.OnFailure(encode_error.c_str()));
+                continue;
+            }
+            last_target_ns = pose->targetTimestampNs;
+            in_flight = InFlightFrame {
+                target_ns,
+                render_output,
+                frame_info.present_ns,
+                render_index,
+            };
+
+            if (recorder) {
+                FrameRecordingFrame recorded = {};
+                recorded.targetTimestampNs = pose->targetTimestampNs;
+                recorded.presentTimeNs = present_received_ns - recording_start_ns;
+                memcpy(recorded.pose, frame_info.pose, sizeof(recorded.pose));
+                recorded.bitrateBps = encoder_params.bitrate_bps;
+                recorded.framerate = encoder_params.framerate;
+                recorded.image = frame_info.image;
+                recorded.idr = idr;
+                recorder->Add(recorded, std::move(recorded_image));
+                if (recorder->IsComplete()) {
+                    recorder.reset();
+                }
+            }
 
             static_assert(sizeof(frame_info.pose) == sizeof(vr::HmdMatrix34_t&));
 
-            alvr::FramePacket packet;
-            if (!encode_pipeline->GetEncoded(packet)) {
-                Error("Failed to get encoded data!");
+            // Only keep the frame in flight if the next one is already waiting, otherwise it
+            // would be delayed until the next present. Behind the latency target, it is sent
+            // right away
+            if (pipelined && present_ready(*ring, read_index) && !LatencyTarget::Exceeded()) {
+                read_latest(*ring, read_index, frame_info);
+                present_received_ns = FrameTrace::Now();
+                have_frame_info = true;
                 continue;
             }
 
-            if (valid_timestamps) {
-                auto render_timestamps = render.GetTimestamps();
-                auto encode_timestamp = encode_pipeline->GetTimestamp();
+            complete_frame(*in_flight);
+            in_flight.reset();
 
-                uint64_t present_offset = render_timestamps.now - render_timestamps.renderBegin;
-                uint64_t composed_offset = 0;
-
-                valid_timestamps = render_timestamps.now != 0;
-
-                if (encode_timestamp.gpu) {
-                    composed_offset = render_timestamps.now - encode_timestamp.gpu;
-                } else if (encode_timestamp.cpu) {
-                    auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                                   std::chrono::steady_clock::now().time_since_epoch()
-                    )
-                                   .count();
-                    composed_offset = now - encode_timestamp.cpu;
-                } else {
-                    composed_offset = render_timestamps.now - render_timestamps.renderComplete;
-                }
-
-                if (present_offset < composed_offset) {
-                    present_offset = composed_offset;
-                }
-
-                ReportPresent(pose->targetTimestampNs, present_offset);
-                ReportComposed(pose->targetTimestampNs, composed_offset);
+            // With the output thread, the encoder being stuck shows as Post waiting for the frames
+            // before
+            auto action = encode_failed.exchange(false)
+                ? watchdog.OnFailure("an encoded frame couldn't be read")
+                : watchdog.EndFrame();
+            if (action != EncoderWatchdog::Action::None) {
+                recover_encoder(action);
             }
-
-            ParseFrameNals(
-                encode_pipeline->GetCodec(), packet.data, packet.size, packet.pts, packet.isIDR
-            );
         }
     } catch (std::exception& e) {
         std::stringstream err;
@@ -299,8 +949,19 @@ void CEncoder::Run() {
         Error(err.str().c_str());
     }
 
-    client.events = POLLHUP;
-    close(client.fd);
+    if (rebuild) {
+        pipeline.reset();
+    }
+    if (ring) {
+        {
+            std::lock_guard<std::mutex> lock(m_ringMutex);
+            m_ring = nullptr;
+        }
+        munmap(ring, sizeof(present_ring));
+    }
+    if (event_fd != -1) {
+        close(event_fd);
+    }
 }
 
 void CEncoder::Stop() {
@@ -314,4 +975,23 @@ void CEncoder::OnStreamStart() { m_scheduler.OnStreamStart(); }
 
 void CEncoder::InsertIDR() { m_scheduler.InsertIDR(); }
 
-void CEncoder::CaptureFrame() { m_captureFrame = true; }
+void CEncoder::OnFramesLost(uint64_t lastReceivedTimestampNs) {
+    m_scheduler.OnFramesLost(lastReceivedTimestampNs);
+}
+
+void CEncoder::CaptureFrame() {
+    m_captureFrames = std::max(Settings::Instance().m_captureFrameCount, 1u);
+}
+
+void CEncoder::OnPoseSubmitted(uint64_t targetTimestampNs) {
+    std::lock_guard<std::mutex> lock(m_ringMutex);
+    if (m_ring) {
+        m_ring->newest_pose_ns.store(targetTimestampNs, std::memory_order_release);
+    }
+}
+
+void CEncoder::RecordFrames(const char* path, uint32_t frameCount) {
+    std::lock_guard<std::mutex> lock(m_recordingMutex);
+    m_recordingPath = path;
+    m_recordingFrames = frameCount;
+}
@@ -4,10 +4,14 @@
 #include "shared/threadtools.h"
 #include <atomic>
 #include <memory>
+#include <mutex>
 #include <poll.h>
+#include <string>
 #include <sys/types.h>
+#include <vector>
 
 class PoseHistory;
+struct present_ring;
 
 class CEncoder : public CThread {
 public:
@@ -19,17 +23,36 @@ public:
     void Stop();
     void OnStreamStart();
     void InsertIDR();
+    void OnFramesLost(uint64_t lastReceivedTimestampNs);
     bool IsConnected() { return m_connected; }
     void CaptureFrame();
+    // Saves the next frames that the layer presents, see FrameRecording
+    void RecordFrames(const char* path, uint32_t frameCount);
+    // Shares the pose with the layer, to be called before SteamVR gets it. The pose of a frame is
+    // then known to be no newer than the one at the time it's presented
+    void OnPoseSubmitted(uint64_t targetTimestampNs);
 
 private:
-    void GetFds(int client, int (*fds)[6]);
+    // The Vulkan context, the renderer and the encoder, kept across the connections of the layer
+    // when its new images can be rendered by the same passes
+    struct Pipeline;
+
+    // Streams the presents of the layer until it disconnects
+    void RunConnection(pollfd client, std::unique_ptr<Pipeline>& pipeline);
+    void GetFds(int client, size_t count);
     std::shared_ptr<PoseHistory> m_poseHistory;
     std::atomic_bool m_exiting { false };
     IDRScheduler m_scheduler;
     pollfd m_socket;
     std::string m_socketPath;
-    int m_fds[6];
-    bool m_connected = false;
-    std::atomic_bool m_captureFrame = false;
+    std::vector<int> m_fds;
+    std::atomic_bool m_connected = false;
+    // Frames left to save of the burst started by CaptureFrame
+    std::atomic_uint32_t m_captureFrames = 0;
+    std::mutex m_recordingMutex;
+    std::string m_recordingPath;
+    uint32_t m_recordingFrames = 0;
+    // Mapped while a layer is connected
+    std::mutex m_ringMutex;
+    present_ring* m_ring = nullptr;
 };
@@ -0,0 +1,625 @@
+#include "alvr_server/EncodeBenchmark.h"
+
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "CEncoder.h"
+#include "EncodePipeline.h"
+#include "EncodePipelineNvEnc.h"
+#include "EncodePipelineSW.h"
+#include "EncodePipelineVAAPI.h"
+#include "FrameRender.h"
+#include "alvr_server/FrameTrace.h"
+#include "alvr_server/Logger.h"
+#include "alvr_server/PoseHistory.h"
+#include "alvr_server/Settings.h"
+#include "ffmpeg_helper.h"
+#include "protocol.h"
+
+namespace {
+
+// No device UUID is known without the layer, VkContext then takes the first device
+const uint8_t ANY_DEVICE[VK_UUID_SIZE] = {};
+
+// Images of the input, in place of the swapchain images the layer shares with CEncoder
+const uint32_t INPUT_IMAGES = 3;
+
+// Images of the render size that frames are uploaded to, exported with their timeline semaphores
+// as the layer does with the swapchain images
+class InputImages {
+public:
+    // Fills the images of init and their fds, which the caller then owns
+    InputImages(alvr::VkContext& vkCtx, init_packet& init, init_image images[], int fds[])
+        : m_vkCtx(vkCtx)
+        , m_dev(vkCtx.get_vk_device()) {
+        vkGetDeviceQueue(
+            m_dev, m_vkCtx.get_vk_queue_family_index(), m_vkCtx.get_vk_queue_index(), &m_queue
+        );
+        createInputs(init, images, fds);
+    }
+
+    // The device must be idle
+    ~InputImages() {
+        vkDestroyFence(m_dev, m_fence, nullptr);
+        vkDestroyCommandPool(m_dev, m_commandPool, nullptr);
+        vkDestroyBuffer(m_dev, m_stagingBuffer, nullptr);
+        vkFreeMemory(m_dev, m_stagingMemory, nullptr);
+        for (auto& input : m_inputs) {
+            vkDestroySemaphore(m_dev, input.semaphore, nullptr);
+            vkDestroyImage(m_dev, input.image, nullptr);
+            vkFreeMemory(m_dev, input.memory, nullptr);
+        }
+    }
+
+    // Copies the frame to the input image and releases it to the renderer, which acquires it
+    // from the external queue family
+    void Upload(uint32_t index, const uint8_t* rgba, uint64_t semaphoreValue) {
+        // The staging buffer is reused, wait for the previous copy
+        VK_CHECK(vkWaitForFences(m_dev, 1, &m_fence, VK_TRUE, UINT64_MAX));
+        VK_CHECK(vkResetFences(m_dev, 1, &m_fence));
+        memcpy(m_stagingMap, rgba, m_stagingSize);
+
+        Input& input = m_inputs[index];
+        const uint32_t width = Settings::Instance().m_renderWidth;
+        const uint32_t height = Settings::Instance().m_renderHeight;
+
+        VkCommandBufferBeginInfo beginInfo = {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        VK_CHECK(vkBeginCommandBuffer(m_commandBuffer, &beginInfo));
+
+        VkImageMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = input.image;
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.levelCount = 1;
+        barrier.subresourceRange.layerCount = 1;
+        // The whole image is overwritten, its previous content can be discarded
+        barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        vkCmdPipelineBarrier(
+            m_commandBuffer,
+            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            0,
+            0,
+            nullptr,
+            0,
+            nullptr,
+            1,
+            &barrier
+        );
+
+        VkBufferImageCopy region = {};
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.layerCount = 1;
+        region.imageExtent = { width, height, 1 };
+        vkCmdCopyBufferToImage(
+            m_commandBuffer,
+            m_stagingBuffer,
+            input.image,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            1,
+            &region
+        );
+
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = 0;
+        barrier.srcQueueFamilyIndex = m_vkCtx.get_vk_queue_family_index();
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_EXTERNAL;
+        vkCmdPipelineBarrier(
+            m_commandBuffer,
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+            0,
+            0,
+            nullptr,
+            0,
+            nullptr,
+            1,
+            &barrier
+        );
+
+        VK_CHECK(vkEndCommandBuffer(m_commandBuffer));
+
+        VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.signalSemaphoreValueCount = 1;
+        timelineInfo.pSignalSemaphoreValues = &semaphoreValue;
+
+        VkSubmitInfo submitInfo = {};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.pNext = &timelineInfo;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &m_commandBuffer;
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &input.semaphore;
+        VK_CHECK(vkQueueSubmit(m_queue, 1, &submitInfo, m_fence));
+    }
+
+private:
+    struct Input {
+        VkImage image = VK_NULL_HANDLE;
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkSemaphore semaphore = VK_NULL_HANDLE;
+    };
+
+    uint32_t memoryTypeIndex(VkMemoryPropertyFlags properties, uint32_t typeBits) {
+        VkPhysicalDeviceMemoryProperties props;
+        vkGetPhysicalDeviceMemoryProperties(m_vkCtx.get_vk_phys_device(), &props);
+        for (uint32_t i = 0; i < props.memoryTypeCount; i++) {
+            if ((props.memoryTypes[i].propertyFlags & properties) == properties
+                && typeBits & (1 << i)) {
+                return i;
+            }
+        }
+        throw std::runtime_error("No suitable memory type");
+    }
+
+    // Exportable images and timeline semaphores, as the layer creates them
+    void createInputs(init_packet& init, init_image images[], int fds[]) {
+        auto getMemoryFd = reinterpret_cast<PFN_vkGetMemoryFdKHR>(
+            vkGetDeviceProcAddr(m_dev, "vkGetMemoryFdKHR")
+        );
+        auto getSemaphoreFd = reinterpret_cast<PFN_vkGetSemaphoreFdKHR>(
+            vkGetDeviceProcAddr(m_dev, "vkGetSemaphoreFdKHR")
+        );
+        if (!getMemoryFd || !getSemaphoreFd) {
+            throw std::runtime_error("External memory and semaphore fds are not supported");
+        }
+
+        const uint32_t width = Settings::Instance().m_renderWidth;
+        const uint32_t height = Settings::Instance().m_renderHeight;
+
+        init.num_images = INPUT_IMAGES;
+        init.image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        init.image_create_info.imageType = VK_IMAGE_TYPE_2D;
+        init.image_create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+        init.image_create_info.extent = { width, height, 1 };
+        init.image_create_info.mipLevels = 1;
+        init.image_create_info.arrayLayers = 1;
+        init.image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+        init.image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+        init.image_create_info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+        init.image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        init.image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        init.memory_handle_type = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+
+        for (uint32_t i = 0; i < INPUT_IMAGES; i++) {
+            Input& input = m_inputs[i];
+
+            VkExternalMemoryImageCreateInfo externalInfo = {};
+            externalInfo.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
+            externalInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+            VkImageCreateInfo imageInfo = init.image_create_info;
+            imageInfo.pNext = &externalInfo;
+            VK_CHECK(vkCreateImage(m_dev, &imageInfo, nullptr, &input.image));
+
+            VkMemoryRequirements req;
+            vkGetImageMemoryRequirements(m_dev, input.image, &req);
+            images[i].memory_size = req.size;
+            images[i].mem_index
+                = memoryTypeIndex(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, req.memoryTypeBits);
+
+            VkMemoryDedicatedAllocateInfo dedicatedInfo = {};
+            dedicatedInfo.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+            dedicatedInfo.image = input.image;
+            VkExportMemoryAllocateInfo exportInfo = {};
+            exportInfo.sType = VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO;
+            exportInfo.pNext = &dedicatedInfo;
+            exportInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+            VkMemoryAllocateInfo allocInfo = {};
+            allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+            allocInfo.pNext = &exportInfo;
+            allocInfo.allocationSize = req.size;
+            allocInfo.memoryTypeIndex = images[i].mem_index;
+            VK_CHECK(vkAllocateMemory(m_dev, &allocInfo, nullptr, &input.memory));
+            VK_CHECK(vkBindImageMemory(m_dev, input.image, input.memory, 0));
+
+            VkMemoryGetFdInfoKHR memoryFdInfo = {};
+            memoryFdInfo.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR;
+            memoryFdInfo.memory = input.memory;
+            memoryFdInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+            VK_CHECK(getMemoryFd(m_dev, &memoryFdInfo, &fds[2 * i]));
+
+            VkSemaphoreTypeCreateInfo timelineInfo = {};
+            timelineInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+            timelineInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+            VkExportSemaphoreCreateInfo exportSemInfo = {};
+            exportSemInfo.sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO;
+            exportSemInfo.pNext = &timelineInfo;
+            exportSemInfo.handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_FD_BIT;
+            VkSemaphoreCreateInfo semInfo = {};
+            semInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+            semInfo.pNext = &exportSemInfo;
+            VK_CHECK(vkCreateSemaphore(m_dev, &semInfo, nullptr, &input.semaphore));
+
+            VkSemaphoreGetFdInfoKHR semaphoreFdInfo = {};
+            semaphoreFdInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR;
+            semaphoreFdInfo.semaphore = input.semaphore;
+            semaphoreFdInfo.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_FD_BIT;
+            VK_CHECK(getSemaphoreFd(m_dev, &semaphoreFdInfo, &fds[2 * i + 1]));
+        }
+
+        VkBufferCreateInfo bufferInfo = {};
+        bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufferInfo.size = (VkDeviceSize)width * height * 4;
+        bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        VK_CHECK(vkCreateBuffer(m_dev, &bufferInfo, nullptr, &m_stagingBuffer));
+
+        VkMemoryRequirements req;
+        vkGetBufferMemoryRequirements(m_dev, m_stagingBuffer, &req);
+        VkMemoryAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.allocationSize = req.size;
+        allocInfo.memoryTypeIndex = memoryTypeIndex(
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            req.memoryTypeBits
+        );
+        VK_CHECK(vkAllocateMemory(m_dev, &allocInfo, nullptr, &m_stagingMemory));
+        VK_CHECK(vkBindBufferMemory(m_dev, m_stagingBuffer, m_stagingMemory, 0));
+        VK_CHECK(vkMapMemory(m_dev, m_stagingMemory, 0, VK_WHOLE_SIZE, 0, &m_stagingMap));
+        m_stagingSize = bufferInfo.size;
+
+        VkCommandPoolCreateInfo poolInfo = {};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+        poolInfo.queueFamilyIndex = m_vkCtx.get_vk_queue_family_index();
+        VK_CHECK(vkCreateCommandPool(m_dev, &poolInfo, nullptr, &m_commandPool));
+
+        VkCommandBufferAllocateInfo commandBufferInfo = {};
+        commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        commandBufferInfo.commandPool = m_commandPool;
+        commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        commandBufferInfo.commandBufferCount = 1;
+        VK_CHECK(vkAllocateCommandBuffers(m_dev, &commandBufferInfo, &m_commandBuffer));
+
+        VkFenceCreateInfo fenceInfo = {};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+        VK_CHECK(vkCreateFence(m_dev, &fenceInfo, nullptr, &m_fence));
+    }
+
+    alvr::VkContext& m_vkCtx;
+    VkDevice m_dev = VK_NULL_HANDLE;
+    VkQueue m_queue = VK_NULL_HANDLE;
+
+    std::array<Input, INPUT_IMAGES> m_inputs;
+    VkBuffer m_stagingBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory m_stagingMemory = VK_NULL_HANDLE;
+    void* m_stagingMap = nullptr;
+    VkDeviceSize m_stagingSize = 0;
+    VkCommandPool m_commandPool = VK_NULL_HANDLE;
+    VkCommandBuffer m_commandBuffer = VK_NULL_HANDLE;
+    VkFence m_fence = VK_NULL_HANDLE;
+};
+
+// Plays the part of the Vulkan layer: uploads each frame to an input image exported to
+// FrameRender, then runs the same render and encode steps as CEncoder
+class LinuxEncodeBenchmarkTarget : public EncodeBenchmarkTarget {
+public:
+    explicit LinuxEncodeBenchmarkTarget(FfiEncodeBenchmarkBackend backend)
+        : m_vkCtx(ANY_DEVICE, {}) {
+        if (backend == ENCODE_BENCHMARK_BACKEND_AMF) {
+            throw std::runtime_error("AMF is only available on Windows, use VAAPI");
+        }
+        if (backend == ENCODE_BENCHMARK_BACKEND_QSV) {
+            throw std::runtime_error("QSV is only available on Windows, use VAAPI");
+        }
+        if (backend == ENCODE_BENCHMARK_BACKEND_VAAPI && m_vkCtx.nvidia) {
+            throw std::runtime_error("VAAPI needs an AMD or Intel GPU");
+        }
+        if (backend == ENCODE_BENCHMARK_BACKEND_NVENC && !m_vkCtx.nvidia) {
+            throw std::runtime_error("NvEnc needs an NVIDIA GPU");
+        }
+
+        init_packet init = {};
+        init_image images[INPUT_IMAGES];
+        int fds[INPUT_IMAGES * 2];
+        m_inputs = std::make_unique<InputImages>(m_vkCtx, init, images, fds);
+
+        if (backend == ENCODE_BENCHMARK_BACKEND_VAAPI) {
+            alvr::EncodePipelineVAAPI::SelectDevice(m_vkCtx);
+        } else if (backend == ENCODE_BENCHMARK_BACKEND_AUTO) {
+            alvr::EncodePipeline::SelectDevice(m_vkCtx);
+        }
+
+        m_render = std::make_unique<FrameRender>(m_vkCtx, init, images, fds);
+        m_render->SetCrossDeviceOutput(m_vkCtx.encodeDevicePath != m_vkCtx.devicePath);
+        m_render->CreateOutput();
+
+        for (uint32_t i = 0; i < m_render->GetOutputCount(); ++i) {
+            auto& output = m_render->GetOutput(i);
+            m_frames.push_back(std::make_unique<alvr::VkFrame>(
+                m_vkCtx, output.image, output.imageInfo, output.size, output.memory, output.drm
+            ));
+        }
+
+        uint32_t width = m_render->GetEncodingWidth();
+        uint32_t height = m_render->GetEncodingHeight();
+        switch (backend) {
+        case ENCODE_BENCHMARK_BACKEND_NVENC:
+            m_encoder = std::make_unique<alvr::EncodePipelineNvEnc>(
+                m_render.get(), m_vkCtx, m_frames, m_render->GetOutput(0).imageInfo, width, height
+            );
+            break;
+        case ENCODE_BENCHMARK_BACKEND_VAAPI:
+            m_encoder = std::make_unique<alvr::EncodePipelineVAAPI>(
+                m_render.get(), m_vkCtx, m_frames, width, height
+            );
+            break;
+        default:
+            // Settings already force the software encoder if it was asked for
+            m_encoder = alvr::EncodePipeline::Create(
+                m_render.get(), m_vkCtx, m_frames, m_render->GetOutput(0).imageInfo, width, height
+            );
+            break;
+        }
+    }
+
+    ~LinuxEncodeBenchmarkTarget() {
+        vkDeviceWaitIdle(m_vkCtx.get_vk_device());
+
+        // The encoder and renderer hold imports of the outputs and inputs
+        m_encoder.reset();
+        m_frames.clear();
+        m_render.reset();
+        m_inputs.reset();
+    }
+
+    std::string GetAdapterId() override { return m_vkCtx.adapterId; }
+
+    void EncodeFrame(const uint8_t* rgba, uint64_t targetTimestampNs, bool idr) override {
+        const uint32_t index = m_frameCount % INPUT_IMAGES;
+        // The timeline values only have to increase, one per submitted frame
+        const uint64_t semaphoreValue = ++m_frameCount;
+        m_inputs->Upload(index, rgba, semaphoreValue);
+
+        uint32_t renderOutput = m_render->Render(index, semaphoreValue);
+        m_encoder->PrepareFrame(renderOutput);
+        m_encoder->SetParams(GetDynamicEncoderParams());
+        FrameTrace::Instance().Record(targetTimestampNs, FRAME_TRACE_ENCODE_SUBMIT);
+        m_encoder->PushFrame(renderOutput, targetTimestampNs, idr);
+
+        alvr::FramePacket packet;
+        if (!m_encoder->GetEncoded(packet)) {
+            throw std::runtime_error("Failed to get encoded data");
+        }
+
+        auto timestamps = m_render->GetTimestamps(renderOutput);
+        if (timestamps.now != 0) {
+            FrameTrace::Instance().Record(
+                targetTimestampNs, FRAME_TRACE_COMPOSITE_BEGIN, timestamps.renderBegin
+            );
+            FrameTrace::Instance().Record(
+                targetTimestampNs, FRAME_TRACE_COMPOSITE_END, timestamps.renderComplete
+            );
+        }
+
+        FfiNalRange range = { packet.data, (unsigned int)packet.size };
+        ParseFrameNalRanges(
+            m_encoder->GetCodec(),
+            &range,
+            1,
+            packet.pts,
+            packet.isIDR,
+            true,
+            packet.release,
+            packet.releaseContext
+        );
+    }
+
+private:
+    alvr::VkContext m_vkCtx;
+    std::unique_ptr<InputImages> m_inputs;
+    uint64_t m_frameCount = 0;
+
+    std::unique_ptr<FrameRender> m_render;
+    std::vector<std::unique_ptr<alvr::VkFrame>> m_frames;
+    std::unique_ptr<alvr::EncodePipeline> m_encoder;
+};
+
+// Plays the part of the Vulkan layer for the driver's own CEncoder instead: the input images are
+// shared on its socket along with a present ring, and each frame is presented there with the pose
+// of its timestamp. CEncoder composites and encodes it on its thread, as when streaming
+class LinuxDriverPathTarget : public EncodeBenchmarkTarget {
+public:
+    explicit LinuxDriverPathTarget(FfiEncodeBenchmarkBackend backend)
+        : m_vkCtx(ANY_DEVICE, {}) {
+        if (backend != ENCODE_BENCHMARK_BACKEND_AUTO
+            && backend != ENCODE_BENCHMARK_BACKEND_SOFTWARE) {
+            throw std::runtime_error(
+                "The driver picks its encoder as configured, only auto or software can be asked for"
+            );
+        }
+
+        // A socket of its own, a SteamVR running meanwhile keeps its encoder
+        const std::string instance = "benchmark-" + std::to_string(getpid());
+        setenv("ALVR_INSTANCE", instance.c_str(), 1);
+
+        m_poseHistory = std::make_shared<PoseHistory>();
+        m_encoder = std::make_unique<CEncoder>(m_poseHistory);
+        m_encoder->Start();
+        m_encoder->OnStreamStart();
+
+        init_packet init = {};
+        init_image images[INPUT_IMAGES];
+        int fds[init_fd_count(INPUT_IMAGES)];
+        m_inputs = std::make_unique<InputImages>(m_vkCtx, init, images, fds);
+        init.source_pid = getpid();
+        getDeviceUuid(init.device_uuid.data());
+        createRing(fds[INPUT_IMAGES * 2], fds[INPUT_IMAGES * 2 + 1]);
+
+        connectEncoder(init, images, fds);
+    }
+
+    ~LinuxDriverPathTarget() {
+        // CEncoder releases its imports of the images once its thread ends
+        m_encoder.reset();
+        if (m_socket != -1) {
+            close(m_socket);
+        }
+        if (m_eventFd != -1) {
+            close(m_eventFd);
+        }
+        if (m_ring) {
+            munmap(m_ring, sizeof(present_ring));
+        }
+        vkDeviceWaitIdle(m_vkCtx.get_vk_device());
+        m_inputs.reset();
+    }
+
+    std::string GetAdapterId() override { return m_vkCtx.adapterId; }
+
+    void EncodeFrame(const uint8_t* rgba, uint64_t targetTimestampNs, bool idr) override {
+        // The pose is given to the pose history before SteamVR would get it
+        m_poseHistory->OnPoseUpdated(targetTimestampNs, BenchmarkHeadMotion(m_frameCount));
+        auto pose = m_poseHistory->GetLatestPose();
+        m_encoder->OnPoseSubmitted(targetTimestampNs);
+
+        const uint32_t index = m_frameCount % INPUT_IMAGES;
+        const uint64_t semaphoreValue = ++m_frameCount;
+        m_inputs->Upload(index, rgba, semaphoreValue);
+
+        if (idr) {
+            m_encoder->InsertIDR();
+        }
+
+        // Same as the layer's submit_image, without the sync_file
+        uint64_t writeIndex = m_ring->write_index.load(std::memory_order_relaxed);
+        present_packet& packet = m_ring->packets[writeIndex % present_ring::size];
+        packet.image = index;
+        packet.frame = (uint32_t)m_frameCount;
+        packet.semaphore_value = semaphoreValue;
+        memcpy(&packet.pose, &pose->rotationMatrix, sizeof(packet.pose));
+        packet.newest_pose_ns = targetTimestampNs;
+        packet.present_ns = FrameTrace::Now();
+        packet.present_id = m_frameCount;
+        packet.has_sync_fd = 0;
+        m_ring->write_index.store(writeIndex + 1, std::memory_order_release);
+
+        uint64_t signal = 1;
+        if (write(m_eventFd, &signal, sizeof(signal)) == -1 && errno != EAGAIN) {
+            throw MakeException("eventfd write failed: %s", strerror(errno));
+        }
+    }
+
+private:
+    void getDeviceUuid(uint8_t* uuid) {
+        VkPhysicalDeviceIDProperties idProps = {};
+        idProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+        VkPhysicalDeviceProperties2 props = {};
+        props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+        props.pNext = &idProps;
+        vkGetPhysicalDeviceProperties2(m_vkCtx.get_vk_phys_device(), &props);
+        memcpy(uuid, idProps.deviceUUID, VK_UUID_SIZE);
+    }
+
+    // The ring memfd and a dup of the eventfd go in fds, as the layer sends them
+    void createRing(int& ringFd, int& eventFd) {
+        ringFd = memfd_create("alvr-present-ring", MFD_CLOEXEC);
+        if (ringFd == -1 || ftruncate(ringFd, sizeof(present_ring)) == -1) {
+            throw MakeException("memfd_create failed: %s", strerror(errno));
+        }
+        void* ring
+            = mmap(nullptr, sizeof(present_ring), PROT_READ | PROT_WRITE, MAP_SHARED, ringFd, 0);
+        if (ring == MAP_FAILED) {
+            throw MakeException("mmap failed: %s", strerror(errno));
+        }
+        m_ring = new (ring) present_ring {};
+
+        m_eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (m_eventFd == -1) {
+            throw MakeException("eventfd failed: %s", strerror(errno));
+        }
+        eventFd = dup(m_eventFd);
+    }
+
+    // Sends the init packet, the images and then all the fds, which are closed after
+    void connectEncoder(const init_packet& init, const init_image images[], int fds[]) {
+        const size_t fdCount = init_fd_count(INPUT_IMAGES);
+
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, ipc_socket_path().c_str(), sizeof(address.sun_path) - 1);
+        m_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        // CEncoder starts listening on its thread
+        bool connected = false;
+        for (int i = 0; i < 500 && m_socket != -1 && !connected; i++) {
+            connected = connect(m_socket, (const sockaddr*)&address, sizeof(address)) == 0;
+            if (!connected) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+
+        bool sent = connected && write(m_socket, &init, sizeof(init)) == sizeof(init)
+            && write(m_socket, images, INPUT_IMAGES * sizeof(init_image))
+                == INPUT_IMAGES * sizeof(init_image);
+        if (sent) {
+            char data[1] = {};
+            iovec iov = { data, sizeof(data) };
+            char control[CMSG_SPACE(sizeof(int) * init_fd_count(INPUT_IMAGES))] = {};
+            msghdr msg = {};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+            memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fdCount);
+            sent = sendmsg(m_socket, &msg, 0) != -1;
+        }
+
+        for (size_t i = 0; i < fdCount; i++) {
+            close(fds[i]);
+        }
+        if (!sent) {
+            throw MakeException("Failed to connect to the encoder: %s", strerror(errno));
+        }
+    }
+
+    // Only used for the input images, CEncoder opens its own device from the UUID
+    alvr::VkContext m_vkCtx;
+    std::unique_ptr<InputImages> m_inputs;
+    uint64_t m_frameCount = 0;
+
+    std::shared_ptr<PoseHistory> m_poseHistory;
+    std::unique_ptr<CEncoder> m_encoder;
+    int m_socket = -1;
+    present_ring* m_ring = nullptr;
+    int m_eventFd = -1;
+};
+}
+
+std::unique_ptr<EncodeBenchmarkTarget>
+EncodeBenchmarkTarget::Create(FfiEncodeBenchmarkBackend backend) {
+    return std::make_unique<LinuxEncodeBenchmarkTarget>(backend);
+}
+
+std::unique_ptr<EncodeBenchmarkTarget>
+EncodeBenchmarkTarget::CreateDriverPath(FfiEncodeBenchmarkBackend backend) {
+    return std::make_unique<LinuxDriverPathTarget>(backend);
+}
@@ -2,38 +2,173 @@
 
 #include "EncodePipelineNvEnc.h"
 #include "EncodePipelineSW.h"
+#include "EncodePipelineSvtAv1.h"
 #include "EncodePipelineVAAPI.h"
+#include "alvr_server/EncoderProbe.h"
 #include "alvr_server/Logger.h"
 #include "alvr_server/Settings.h"
 #include "ffmpeg_helper.h"
+#include <algorithm>
+#include <mutex>
+#include <vector>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
+#include <libavutil/intreadwrite.h>
 }
 
+namespace {
+
+// The packets handed to the network thread come back here once sent. Unreferencing gives the
+// data back to the encoder, only the packet itself is kept for the next frame
+class PacketPool {
+public:
+    static PacketPool& Instance() {
+        static PacketPool instance;
+        return instance;
+    }
+
+    AVPacket* Get() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!packets.empty()) {
+                AVPacket* packet = packets.back();
+                packets.pop_back();
+                return packet;
+            }
+        }
+        return av_packet_alloc();
+    }
+
+    void Put(AVPacket* packet) {
+        av_packet_unref(packet);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (packets.size() < max_packets) {
+            packets.push_back(packet);
+        } else {
+            av_packet_free(&packet);
+        }
+    }
+
+private:
+    // More than the frames that can be in flight at once
+    static constexpr size_t max_packets = 16;
+
+    std::mutex mutex;
+    std::vector<AVPacket*> packets;
+};
+
+// SVT-AV1 when AV1 was asked for and the CPU has the cores for it, otherwise x264
+std::unique_ptr<alvr::EncodePipeline>
+create_software(Renderer* render, uint32_t width, uint32_t height) {
+    if (alvr::EncodePipelineSvtAv1::Supported()) {
+        try {
+            return std::make_unique<alvr::EncodePipelineSvtAv1>(render, width, height);
+        } catch (std::exception& e) {
+            Error("Failed to create SVT-AV1 encoder, using x264: %s", e.what());
+        }
+    }
+    return std::make_unique<alvr::EncodePipelineSW>(render, width, height);
+}
+
+} // namespace
+
 void alvr::EncodePipeline::SetParams(FfiDynamicEncoderParams params) {
     if (params.updated) {
-        encoder_ctx->bit_rate = params.bitrate_bps / params.framerate * 60.0;
-        encoder_ctx->framerate = AVRational { 60, 1 };
-        encoder_ctx->rc_buffer_size = encoder_ctx->bit_rate / 60.0 * 1.1;
+        // The framerate is fixed once the encoder is open, the bitrate is scaled instead so that
+        // each frame gets the share it has at the actual framerate
+        if (!avcodec_is_open(encoder_ctx)) {
+            encoder_ctx->framerate = AVRational { int(params.framerate * 1000), 1000 };
+        }
+        const double open_framerate = av_q2d(encoder_ctx->framerate);
+        encoder_ctx->bit_rate = params.bitrate_bps / params.framerate * open_framerate;
+        encoder_ctx->rc_buffer_size = VbvBufferBits(params);
         encoder_ctx->rc_max_rate = encoder_ctx->bit_rate;
         encoder_ctx->rc_initial_buffer_occupancy = encoder_ctx->rc_buffer_size / 4 * 3;
     }
 }
 
+int64_t alvr::EncodePipeline::VbvBufferBits(const FfiDynamicEncoderParams& params) {
+    // With one frame no frame takes longer to send than a frame interval, the margin lets the
+    // rate control absorb its overshoot on scene changes with less quality loss
+    const double frames = Settings::Instance().m_linuxSingleFrameVbv ? 1.0 : 1.1;
+    int64_t bits = params.bitrate_bps / std::max((double)params.framerate, 1.0) * frames;
+    // FFmpeg and x264 have no limit on the frame size, the frame that fills the whole buffer is
+    // the largest the rate control lets through
+    if (params.max_frame_bits > 0) {
+        bits = std::min(bits, (int64_t)params.max_frame_bits);
+    }
+    return std::max<int64_t>(bits, 1);
+}
+
+void alvr::EncodePipeline::record_frame_size(int64_t size_bits, int64_t buffer_bits) {
+    if (size_bits <= 0 || buffer_bits <= 0) {
+        return;
+    }
+    frame_size_ratios[frame_size_count % frame_size_window] = (float)size_bits / buffer_bits;
+    frame_size_count++;
+    if (frame_size_count % frame_size_window != 0) {
+        return;
+    }
+
+    std::array<float, frame_size_window> sorted = frame_size_ratios;
+    std::sort(sorted.begin(), sorted.end());
+    float sum = 0;
+    size_t over = 0;
+    for (float ratio : sorted) {
+        sum += ratio;
+        over += ratio > 1.f;
+    }
+    LogPeriod(
+        "EncoderFrameSizes",
+        "Encoder: frame size / VBV buffer average %.2f, p95 %.2f, max %.2f, %zu of %zu frames over",
+        sum / frame_size_window,
+        sorted[frame_size_window * 95 / 100],
+        sorted[frame_size_window - 1],
+        over,
+        frame_size_window
+    );
+}
+
+void alvr::EncodePipeline::SelectDevice(VkContext& vk_ctx) {
+    if (Settings::Instance().m_force_sw_encoding == false && !vk_ctx.nvidia) {
+        EncodePipelineVAAPI::SelectDevice(vk_ctx);
+
+        // Only when Create is going to pick VA-API, the compositor skips the color correction
+        auto ranked = EncoderProbe::RankedBackends(vk_ctx.adapterId);
+        if (ranked.empty() || ranked[0] != ENCODE_BENCHMARK_BACKEND_SOFTWARE) {
+            EncodePipelineVAAPI::SelectColorFilter(vk_ctx);
+        }
+    }
+}
+
+bool alvr::EncodePipeline::UsesLinearOutput(const VkContext& vk_ctx) {
+    return Settings::Instance().m_force_sw_encoding == false && vk_ctx.nvidia
+        && EncodePipelineNvEnc::SupportsCudaInterop();
+}
+
 std::unique_ptr<alvr::EncodePipeline> alvr::EncodePipeline::Create(
     Renderer* render,
     VkContext& vk_ctx,
-    VkFrame& input_frame,
+    std::vector<std::unique_ptr<VkFrame>>& input_frames,
     VkImageCreateInfo& image_create_info,
     uint32_t width,
     uint32_t height
 ) {
     if (Settings::Instance().m_force_sw_encoding == false) {
+        // Each GPU has a single hardware encoder here, the probe decides whether software is
+        // faster. The outputs were already made for the hardware one
+        auto ranked = EncoderProbe::RankedBackends(vk_ctx.adapterId);
+        if (!ranked.empty() && ranked[0] == ENCODE_BENCHMARK_BACKEND_SOFTWARE) {
+            auto sw = create_software(render, width, height);
+            Info("Using SW encoder, measured fastest on this GPU");
+            return sw;
+        }
+
         if (vk_ctx.nvidia) {
             try {
                 auto nvenc = std::make_unique<alvr::EncodePipelineNvEnc>(
-                    render, vk_ctx, input_frame, image_create_info, width, height
+                    render, vk_ctx, input_frames, image_create_info, width, height
                 );
                 Info("Using NvEnc encoder");
                 return nvenc;
@@ -47,7 +182,7 @@ std::unique_ptr<alvr::EncodePipeline> alvr::EncodePipeline::Create(
         } else {
             try {
                 auto vaapi = std::make_unique<alvr::EncodePipelineVAAPI>(
-                    render, vk_ctx, input_frame, width, height
+                    render, vk_ctx, input_frames, width, height
                 );
                 Info("Using VAAPI encoder");
                 return vaapi;
@@ -60,7 +195,10 @@ std::unique_ptr<alvr::EncodePipeline> alvr::EncodePipeline::Create(
             }
         }
     }
-    auto sw = std::make_unique<alvr::EncodePipelineSW>(render, width, height);
+    if (!vk_ctx.colorFilter.empty()) {
+        Warn("The color correction was left to VA-API, the frames are encoded without it");
+    }
+    auto sw = create_software(render, width, height);
     Info("Using SW encoder");
     return sw;
 }
@@ -68,11 +206,10 @@ std::unique_ptr<alvr::EncodePipeline> alvr::EncodePipeline::Create(
 alvr::EncodePipeline::~EncodePipeline() { avcodec_free_context(&encoder_ctx); }
 
 bool alvr::EncodePipeline::GetEncoded(FramePacket& packet) {
-    av_packet_free(&encoder_packet);
-    encoder_packet = av_packet_alloc();
+    AVPacket* encoder_packet = PacketPool::Instance().Get();
     int err = avcodec_receive_packet(encoder_ctx, encoder_packet);
     if (err != 0) {
-        av_packet_free(&encoder_packet);
+        PacketPool::Instance().Put(encoder_packet);
         if (err == AVERROR(EAGAIN)) {
             return false;
         }
@@ -82,6 +219,26 @@ bool alvr::EncodePipeline::GetEncoded(FramePacket& packet) {
     packet.size = encoder_packet->size;
     packet.pts = encoder_packet->pts;
     packet.isIDR = (encoder_packet->flags & AV_PKT_FLAG_KEY) != 0;
+
+    // The encoders only give the QP and picture type, a P frame may still be mostly intra
+    size_t stats_size = 0;
+    const uint8_t* stats = av_packet_get_side_data(
+        encoder_packet, AV_PKT_DATA_QUALITY_STATS, &stats_size
+    );
+    if (stats && stats_size >= 5) {
+        packet.stats.averageQp = (float)AV_RL32(stats) / FF_QP2LAMBDA;
+        if (stats[4] == AV_PICTURE_TYPE_I) {
+            packet.stats.intraRatio = 1.f;
+        }
+    }
+    packet.stats.vbvOverflow = encoder_ctx->rc_buffer_size > 0
+        && (int64_t)encoder_packet->size * 8 > encoder_ctx->rc_buffer_size;
+    record_frame_size((int64_t)encoder_packet->size * 8, encoder_ctx->rc_buffer_size);
+
+    // The packet is refcounted and owned by us, let the receiver give it back when it's done
+    packet.release
+        = [](void* context) { PacketPool::Instance().Put(static_cast<AVPacket*>(context)); };
+    packet.releaseContext = encoder_packet;
     return true;
 }
 
@@ -1,5 +1,6 @@
 #pragma once
 #include "alvr_server/bindings.h"
+#include <array>
 #include <cstdint>
 #include <memory>
 #include <vector>
@@ -21,36 +22,71 @@ struct FramePacket {
     int size;
     uint64_t pts;
     bool isIDR;
+    // When set, data stays valid until release(releaseContext) is called, so it can be handed to
+    // the network thread without copying. Otherwise it is only valid until the next GetEncoded()
+    void (*release)(void* context) = nullptr;
+    void* releaseContext = nullptr;
+    // Unknown values are left negative, isIdr is set by the caller
+    FfiEncoderStats stats = { 0, -1.f, -1.f, 0, -1.f, -1.f };
 };
 
 class EncodePipeline {
 public:
+    // In the FrameTrace::Now() domain
     struct Timestamp {
-        uint64_t gpu = 0;
+        // When the encoder got the frame, 0 if it doesn't say
         uint64_t cpu = 0;
     };
 
     virtual ~EncodePipeline();
 
-    virtual void PushFrame(uint64_t targetTimestampNs, bool idr) = 0;
+    // Called as soon as the render to this output has been submitted, possibly before the
+    // previous frame has been collected with GetEncoded(). PushFrame() follows for the same output
+    virtual void PrepareFrame(uint32_t outputIndex) { }
+    // Encode the renderer output at this index, as returned by Renderer::Render
+    virtual void PushFrame(uint32_t outputIndex, uint64_t targetTimestampNs, bool idr) = 0;
     virtual bool GetEncoded(FramePacket& data);
     virtual Timestamp GetTimestamp() { return timestamp; }
     virtual int GetCodec();
+    // True if losses can be repaired with InvalidateReferences instead of an IDR
+    bool InvalidatesReferences() const { return invalidates_references; }
+    // See IDRScheduler::ReferenceInvalidator
+    virtual bool InvalidateReferences(
+        const std::vector<uint64_t>& lostTimestampsNs, uint64_t referenceTimestampNs
+    ) {
+        return false;
+    }
 
     virtual void SetParams(FfiDynamicEncoderParams params);
+    // Rate control buffer for the bitrate at the framerate of params: one frame in the low latency
+    // mode, otherwise a margin of 10% on top. Never above the frame size cap
+    static int64_t VbvBufferBits(const FfiDynamicEncoderParams& params);
+    // Pick the device the encoder of Create() runs on, before the renderer outputs are created
+    static void SelectDevice(VkContext& vk_ctx);
+    // Whether the renderer outputs of Create() must be linear, decided before they are created
+    static bool UsesLinearOutput(const VkContext& vk_ctx);
     static std::unique_ptr<EncodePipeline> Create(
         Renderer* render,
         VkContext& vk_ctx,
-        VkFrame& input_frame,
+        std::vector<std::unique_ptr<VkFrame>>& input_frames,
         VkImageCreateInfo& image_create_info,
         uint32_t width,
         uint32_t height
     );
 
 protected:
+    // Logs periodically how the frame sizes spread against the rate control buffer, to check its
+    // sizing
+    void record_frame_size(int64_t size_bits, int64_t buffer_bits);
+
     AVCodecContext* encoder_ctx = nullptr; // shall be initialized by child class
-    AVPacket* encoder_packet = NULL;
     Timestamp timestamp = {};
+    bool invalidates_references = false;
+
+private:
+    static constexpr size_t frame_size_window = 120;
+    std::array<float, frame_size_window> frame_size_ratios = {};
+    uint64_t frame_size_count = 0;
 };
 
 }
@@ -1,18 +1,82 @@
 #include "EncodePipelineNvEnc.h"
 #include "ALVR-common/packet_types.h"
+#include "NvEncoderCuda.h"
+#include "alvr_server/FoveatedQpMap.h"
 #include "alvr_server/Logger.h"
 #include "alvr_server/Settings.h"
+#include "cuda_helper.h"
 #include "ffmpeg_helper.h"
+#include "shared/nvenc/NvEncConfig.h"
+#include "shared/nvenc/NvEncReferences.h"
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <memory>
+#include <unistd.h>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavutil/opt.h>
+#ifdef ALVR_CUDA_INTEROP
+#include <libavutil/hwcontext_cuda.h>
+#endif
 }
 
+#ifdef ALVR_CUDA_INTEROP
+struct alvr::EncodePipelineNvEnc::CudaInterop {
+    struct Output {
+        CUexternalMemory memory = nullptr;
+        CUdeviceptr pointer = 0;
+        CUexternalSemaphore semaphore = nullptr;
+        std::unique_ptr<AVFrame, std::function<void(AVFrame*)>> frame;
+    };
+
+    CudaFunctions* cu = nullptr;
+    CUcontext ctx = nullptr;
+    CUstream stream = nullptr;
+    std::vector<Output> outputs;
+};
+
+// NVENC driven through its API, which the libavcodec encoder doesn't give all the features of
+struct alvr::EncodePipelineNvEnc::DirectEncoder {
+    struct Submitted {
+        uint64_t targetTimestampNs;
+        bool idr;
+    };
+
+    std::unique_ptr<NvEncoderCuda> encoder;
+    // Kept from creation, so that bitrate changes only patch the rate control fields
+    NV_ENC_INITIALIZE_PARAMS initialize_params;
+    NV_ENC_CONFIG encode_config;
+    std::unique_ptr<NvEncConfig> config;
+    std::unique_ptr<NvEncReferences> references;
+    FfiDynamicEncoderParams applied = {};
+    // Foveated QP offsets passed with every frame, empty when disabled
+    std::vector<int8_t> qp_delta_map;
+    uint32_t qp_delta_map_version = 0;
+    // In submission order, retrieved by GetEncoded
+    std::deque<Submitted> submitted;
+
+    ~DirectEncoder() {
+        if (encoder) {
+            try {
+                encoder->DestroyEncoder();
+            } catch (NVENCException& e) {
+                Error("NvEnc: failed to destroy the encoder: %s", e.what());
+            }
+        }
+    }
+};
+#else
+struct alvr::EncodePipelineNvEnc::CudaInterop { };
+struct alvr::EncodePipelineNvEnc::DirectEncoder { };
+#endif
+
 namespace {
 
+// The renderer outputs are BGRA, which NVENC calls ARGB after the word order
+const NV_ENC_BUFFER_FORMAT direct_format = NV_ENC_BUFFER_FORMAT_ARGB;
+
 const char* encoder(ALVR_CODEC codec) {
     switch (codec) {
     case ALVR_CODEC_H264:
@@ -63,19 +127,22 @@ void set_hwframe_ctx(AVCodecContext* ctx, AVBufferRef* hw_device_ctx) {
 alvr::EncodePipelineNvEnc::EncodePipelineNvEnc(
     Renderer* render,
     VkContext& vk_ctx,
-    VkFrame& input_frame,
+    std::vector<std::unique_ptr<VkFrame>>& input_frames,
     VkImageCreateInfo& image_create_info,
     uint32_t width,
     uint32_t height
 ) {
     r = render;
+    vk_device = vk_ctx.get_vk_device();
     vk_frame_ctx = std::make_unique<alvr::VkFrameCtx>(vk_ctx, image_create_info);
 
     auto input_frame_ctx = (AVHWFramesContext*)vk_frame_ctx->ctx->data;
     assert(input_frame_ctx->sw_format == AV_PIX_FMT_BGRA);
 
     int err;
-    vk_frame = input_frame.make_av_frame(*vk_frame_ctx);
+    for (auto& input_frame : input_frames) {
+        vk_frames.push_back(input_frame->make_av_frame(*vk_frame_ctx));
+    }
 
     err = av_hwdevice_ctx_create_derived(&hw_ctx, AV_HWDEVICE_TYPE_CUDA, vk_ctx.ctx, 0);
     if (err < 0) {
@@ -160,6 +227,14 @@ alvr::EncodePipelineNvEnc::EncodePipelineNvEnc(
     // work around ffmpeg default not working for older NVIDIA cards
     av_opt_set_int(encoder_ctx->priv_data, "b_ref_mode", 0, 0);
 
+    // Auto is the default of FFmpeg, which knows the option since 7.0
+    if (settings.m_nvencSplitEncode != 0
+        && av_opt_set_int(
+               encoder_ctx->priv_data, "split_encode_mode", settings.m_nvencSplitEncode, 0
+           ) < 0) {
+        Warn("Split frame encoding is supported only for HEVC and AV1 with FFmpeg 7.0 or newer");
+    }
+
     encoder_ctx->pix_fmt = AV_PIX_FMT_CUDA;
     encoder_ctx->width = width;
     encoder_ctx->height = height;
@@ -168,15 +243,38 @@ alvr::EncodePipelineNvEnc::EncodePipelineNvEnc(
     encoder_ctx->sample_aspect_ratio = AVRational { 1, 1 };
     encoder_ctx->max_b_frames = 0;
     encoder_ctx->gop_size = INT16_MAX;
+    if (settings.m_gradualIntraRefresh) {
+        // FFmpeg makes the GOP the refresh period and back to back waves
+        av_opt_set_int(encoder_ctx->priv_data, "intra-refresh", 1, 0);
+        encoder_ctx->gop_size = settings.m_gradualIntraRefreshPeriod;
+    }
     encoder_ctx->color_range = AVCOL_RANGE_JPEG;
     auto params = FfiDynamicEncoderParams {};
     params.updated = true;
     params.bitrate_bps = 30'000'000;
-    params.framerate = 60.0;
+    params.framerate = settings.m_refreshRate;
     SetParams(params);
 
     set_hwframe_ctx(encoder_ctx, hw_ctx);
 
+    // NVENC takes its input stream at open
+    if (r->GetOutput(0).imageInfo.tiling == VK_IMAGE_TILING_LINEAR) {
+        importOutputs(vk_ctx);
+        if (!getenv("ALVR_NVENC_LIBAVCODEC")) {
+            try {
+                openDirect(width, height);
+                // Only the imported frames keep the frame context
+                avcodec_free_context(&encoder_ctx);
+                Info("NvEnc: encoding the renderer outputs in place with the NVENC API");
+                return;
+            } catch (std::exception& e) {
+                direct.reset();
+                Warn("NvEnc: the NVENC API can't be used, using libavcodec: %s", e.what());
+            }
+        }
+        Info("NvEnc: encoding the renderer outputs in place through CUDA");
+    }
+
     err = avcodec_open2(encoder_ctx, codec, NULL);
     if (err < 0) {
         throw alvr::AvException("Cannot open video encoder codec:", err);
@@ -186,11 +284,149 @@ alvr::EncodePipelineNvEnc::EncodePipelineNvEnc(
 }
 
 alvr::EncodePipelineNvEnc::~EncodePipelineNvEnc() {
+#ifdef ALVR_CUDA_INTEROP
+    if (cuda) {
+        // NVENC may still reference the imported outputs and the stream until it is closed
+        direct.reset();
+        avcodec_free_context(&encoder_ctx);
+        CudaFunctions* cu = cuda->cu;
+        {
+            CudaContextScope scope(cu, cuda->ctx);
+            for (auto& output : cuda->outputs) {
+                output.frame.reset();
+                if (output.semaphore) {
+                    cu->cuDestroyExternalSemaphore(output.semaphore);
+                }
+                if (output.pointer) {
+                    cu->cuMemFree(output.pointer);
+                }
+                if (output.memory) {
+                    cu->cuDestroyExternalMemory(output.memory);
+                }
+            }
+            if (cuda->stream) {
+                cu->cuStreamDestroy(cuda->stream);
+            }
+        }
+        cuda_free_functions(&cu);
+    }
+#endif
     av_buffer_unref(&hw_ctx);
     av_frame_free(&hw_frame);
 }
 
-void alvr::EncodePipelineNvEnc::PushFrame(uint64_t targetTimestampNs, bool idr) {
+bool alvr::EncodePipelineNvEnc::SupportsCudaInterop() {
+#ifdef ALVR_CUDA_INTEROP
+    if (getenv("ALVR_NO_CUDA_INTEROP")) {
+        return false;
+    }
+    // The loader fails if the driver lacks any of the functions
+    CudaFunctions* cu = nullptr;
+    if (cuda_load_functions(&cu, nullptr) < 0) {
+        return false;
+    }
+    cuda_free_functions(&cu);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void alvr::EncodePipelineNvEnc::importOutputs(VkContext& vk_ctx) {
+#ifdef ALVR_CUDA_INTEROP
+    cuda = std::make_unique<CudaInterop>();
+    if (cuda_load_functions(&cuda->cu, nullptr) < 0) {
+        throw std::runtime_error("Failed to load the CUDA driver");
+    }
+    CudaFunctions* cu = cuda->cu;
+
+    auto device_ctx = (AVHWDeviceContext*)hw_ctx->data;
+    auto cuda_device = (AVCUDADeviceContext*)device_ctx->hwctx;
+    cuda->ctx = cuda_device->cuda_ctx;
+    CudaContextScope scope(cu, cuda->ctx);
+
+    // The waits on the render are queued on this stream, which NVENC then reads its input after
+    cuda_check(cu, cu->cuStreamCreate(&cuda->stream, 0), "cuStreamCreate");
+    cuda_device->stream = cuda->stream;
+
+    auto getMemoryFd
+        = (PFN_vkGetMemoryFdKHR)vkGetDeviceProcAddr(vk_ctx.device, "vkGetMemoryFdKHR");
+    auto getSemaphoreFd
+        = (PFN_vkGetSemaphoreFdKHR)vkGetDeviceProcAddr(vk_ctx.device, "vkGetSemaphoreFdKHR");
+    if (!getMemoryFd || !getSemaphoreFd) {
+        throw std::runtime_error("Vulkan external memory or semaphore fds are not supported");
+    }
+
+    // CUDA owns the fds once they are imported
+    for (uint32_t i = 0; i < vk_frames.size(); ++i) {
+        Renderer::Output& output = r->GetOutput(i);
+        AVVkFrame* vkf = reinterpret_cast<AVVkFrame*>(vk_frames[i]->data[0]);
+        CudaInterop::Output& imported = cuda->outputs.emplace_back();
+
+        VkMemoryGetFdInfoKHR memoryFdInfo = {};
+        memoryFdInfo.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR;
+        memoryFdInfo.memory = output.memory;
+        memoryFdInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+        int memoryFd = -1;
+        VK_CHECK(getMemoryFd(vk_ctx.device, &memoryFdInfo, &memoryFd));
+
+        CUDA_EXTERNAL_MEMORY_HANDLE_DESC memoryDesc = {};
+        memoryDesc.type = CU_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD;
+        memoryDesc.handle.fd = memoryFd;
+        memoryDesc.size = output.size;
+        memoryDesc.flags = CUDA_EXTERNAL_MEMORY_DEDICATED;
+        CUresult res = cu->cuImportExternalMemory(&imported.memory, &memoryDesc);
+        if (res != CUDA_SUCCESS) {
+            close(memoryFd);
+        }
+        cuda_check(cu, res, "cuImportExternalMemory");
+
+        CUDA_EXTERNAL_MEMORY_BUFFER_DESC bufferDesc = {};
+        bufferDesc.offset = 0;
+        bufferDesc.size = output.size;
+        cuda_check(
+            cu,
+            cu->cuExternalMemoryGetMappedBuffer(&imported.pointer, imported.memory, &bufferDesc),
+            "cuExternalMemoryGetMappedBuffer"
+        );
+
+        VkSemaphoreGetFdInfoKHR semaphoreFdInfo = {};
+        semaphoreFdInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR;
+        semaphoreFdInfo.semaphore = vkf->sem[0];
+        semaphoreFdInfo.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_FD_BIT;
+        int semaphoreFd = -1;
+        VK_CHECK(getSemaphoreFd(vk_ctx.device, &semaphoreFdInfo, &semaphoreFd));
+
+        CUDA_EXTERNAL_SEMAPHORE_HANDLE_DESC semaphoreDesc = {};
+        semaphoreDesc.type = CU_EXTERNAL_SEMAPHORE_HANDLE_TYPE_TIMELINE_SEMAPHORE_FD;
+        semaphoreDesc.handle.fd = semaphoreFd;
+        res = cu->cuImportExternalSemaphore(&imported.semaphore, &semaphoreDesc);
+        if (res != CUDA_SUCCESS) {
+            close(semaphoreFd);
+        }
+        cuda_check(cu, res, "cuImportExternalSemaphore");
+
+        // NVENC registers the pointer the first time it sees it and keeps it registered. The
+        // buffer is only there for the refcounting, the memory belongs to the renderer
+        imported.frame = { av_frame_alloc(), [](AVFrame* p) { av_frame_free(&p); } };
+        AVFrame* frame = imported.frame.get();
+        frame->format = AV_PIX_FMT_CUDA;
+        frame->width = encoder_ctx->width;
+        frame->height = encoder_ctx->height;
+        frame->hw_frames_ctx = av_buffer_ref(encoder_ctx->hw_frames_ctx);
+        frame->data[0] = (uint8_t*)(imported.pointer + output.linearLayout.offset);
+        frame->linesize[0] = output.linearLayout.rowPitch;
+        frame->buf[0] = av_buffer_alloc(1);
+    }
+#else
+    throw std::runtime_error("Built without the CUDA interop");
+#endif
+}
+
+void alvr::EncodePipelineNvEnc::PushFrame(
+    uint32_t outputIndex, uint64_t targetTimestampNs, bool idr
+) {
+    AVFrame* vk_frame = vk_frames[outputIndex].get();
     AVVkFrame* vkf = reinterpret_cast<AVVkFrame*>(vk_frame->data[0]);
     vkf->sem_value[0]++;
 
@@ -205,20 +441,28 @@ void alvr::EncodePipelineNvEnc::PushFrame(uint64_t targetTimestampNs, bool idr)
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
     submitInfo.pNext = &timelineInfo;
     submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = &r->GetOutput().semaphore;
+    submitInfo.pWaitSemaphores = &r->GetOutput(outputIndex).semaphore;
     submitInfo.pWaitDstStageMask = &waitStage;
     submitInfo.signalSemaphoreCount = 1;
     submitInfo.pSignalSemaphores = &vkf->sem[0];
     VK_CHECK(vkQueueSubmit(r->m_queue, 1, &submitInfo, nullptr));
 
+    if (cuda) {
+        pushImportedFrame(outputIndex, targetTimestampNs, idr);
+        return;
+    }
+
     int err = av_hwframe_get_buffer(encoder_ctx->hw_frames_ctx, hw_frame, 0);
     if (err < 0) {
         throw alvr::AvException("Failed to allocate CUDA frame", err);
     }
-    err = av_hwframe_transfer_data(hw_frame, vk_frame.get(), 0);
+    err = av_hwframe_transfer_data(hw_frame, vk_frame, 0);
     if (err < 0) {
         throw alvr::AvException("Failed to transfer Vulkan image to CUDA frame", err);
     }
+    // The transfer signals the next semaphore value once the copy is done, the next render must
+    // not overwrite the output before that
+    r->SetOutputRelease(outputIndex, vkf->sem[0], vkf->sem_value[0]);
 
     hw_frame->pict_type = idr ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
     hw_frame->pts = targetTimestampNs;
@@ -229,3 +473,221 @@ void alvr::EncodePipelineNvEnc::PushFrame(uint64_t targetTimestampNs, bool idr)
 
     av_frame_unref(hw_frame);
 }
+
+void alvr::EncodePipelineNvEnc::pushImportedFrame(
+    uint32_t outputIndex, uint64_t targetTimestampNs, bool idr
+) {
+#ifdef ALVR_CUDA_INTEROP
+    AVVkFrame* vkf = reinterpret_cast<AVVkFrame*>(vk_frames[outputIndex]->data[0]);
+    CudaInterop::Output& imported = cuda->outputs[outputIndex];
+    {
+        CudaContextScope scope(cuda->cu, cuda->ctx);
+        CUDA_EXTERNAL_SEMAPHORE_WAIT_PARAMS waitParams = {};
+        waitParams.params.fence.value = vkf->sem_value[0];
+        cuda_check(
+            cuda->cu,
+            cuda->cu->cuWaitExternalSemaphoresAsync(
+                &imported.semaphore, &waitParams, 1, cuda->stream
+            ),
+            "cuWaitExternalSemaphoresAsync"
+        );
+    }
+
+    if (direct) {
+        submitDirect(outputIndex, targetTimestampNs, idr);
+    } else {
+        AVFrame* frame = imported.frame.get();
+        frame->pict_type = idr ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+        frame->pts = targetTimestampNs;
+        int err = avcodec_send_frame(encoder_ctx, frame);
+        if (err < 0) {
+            throw alvr::AvException("avcodec_send_frame failed:", err);
+        }
+    }
+
+    // Nothing on the GPU tells when NVENC is done, the value is signaled when the packet is out
+    vkf->sem_value[0]++;
+    pending_releases.emplace_back(vkf->sem[0], vkf->sem_value[0]);
+    r->SetOutputRelease(outputIndex, vkf->sem[0], vkf->sem_value[0]);
+#endif
+}
+
+bool alvr::EncodePipelineNvEnc::GetEncoded(FramePacket& packet) {
+    bool encoded = direct ? getDirectPacket(packet) : EncodePipeline::GetEncoded(packet);
+    if (!encoded) {
+        return false;
+    }
+    if (!pending_releases.empty()) {
+        VkSemaphoreSignalInfo signalInfo = {};
+        signalInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SIGNAL_INFO;
+        signalInfo.semaphore = pending_releases.front().first;
+        signalInfo.value = pending_releases.front().second;
+        VK_CHECK(vkSignalSemaphore(vk_device, &signalInfo));
+        pending_releases.pop_front();
+    }
+    return true;
+}
+
+void alvr::EncodePipelineNvEnc::SetParams(FfiDynamicEncoderParams params) {
+    if (!direct) {
+        EncodePipeline::SetParams(params);
+        return;
+    }
+#ifdef ALVR_CUDA_INTEROP
+    DirectEncoder& d = *direct;
+    if (!params.updated || (params.bitrate_bps == d.applied.bitrate_bps
+                            && params.framerate == d.applied.framerate
+                            && params.max_frame_bits == d.applied.max_frame_bits)) {
+        return;
+    }
+    d.applied = params;
+
+    // Only the rate control fields change, the rest of the config is reused as created. Unlike
+    // libavcodec, NVENC takes the new framerate as well
+    int framerate = std::max((int)std::lround(params.framerate), 1);
+    d.config->FillRateControl(
+        d.initialize_params, framerate, params.bitrate_bps, params.max_frame_bits
+    );
+    NV_ENC_RECONFIGURE_PARAMS reconfigure_params = { NV_ENC_RECONFIGURE_PARAMS_VER };
+    reconfigure_params.reInitEncodeParams = d.initialize_params;
+    CudaContextScope scope(cuda->cu, cuda->ctx);
+    d.encoder->Reconfigure(&reconfigure_params);
+#endif
+}
+
+bool alvr::EncodePipelineNvEnc::InvalidateReferences(
+    const std::vector<uint64_t>& lostTimestampsNs, uint64_t referenceTimestampNs
+) {
+#ifdef ALVR_CUDA_INTEROP
+    if (direct) {
+        CudaContextScope scope(cuda->cu, cuda->ctx);
+        return direct->references->Invalidate(
+            *direct->encoder, lostTimestampsNs, referenceTimestampNs
+        );
+    }
+#endif
+    return false;
+}
+
+void alvr::EncodePipelineNvEnc::openDirect(uint32_t width, uint32_t height) {
+#ifdef ALVR_CUDA_INTEROP
+    const auto& settings = Settings::Instance();
+    direct = std::make_unique<DirectEncoder>();
+    DirectEncoder& d = *direct;
+    CudaContextScope scope(cuda->cu, cuda->ctx);
+
+    // A second input buffer, so that the next frame can be submitted before the previous one is
+    // retrieved. The input buffers themselves stay unused, the outputs are registered instead
+    d.encoder = std::make_unique<NvEncoderCuda>(
+        cuda->cu, cuda->ctx, width, height, direct_format, Renderer::FramesInFlight - 1
+    );
+
+    d.initialize_params = { NV_ENC_INITIALIZE_PARAMS_VER };
+    d.encode_config = { NV_ENC_CONFIG_VER };
+    d.initialize_params.encodeConfig = &d.encode_config;
+    // The packets are sent whole and in encode order. The outputs are 8 bit
+    d.config = std::make_unique<NvEncConfig>(settings.m_codec, false, 0, false);
+    d.applied.bitrate_bps = 30'000'000;
+    d.applied.framerate = settings.m_refreshRate;
+    d.config->Fill(
+        *d.encoder,
+        d.initialize_params,
+        settings.m_refreshRate,
+        width,
+        height,
+        d.applied.bitrate_bps
+    );
+    d.encoder->CreateEncoder(&d.initialize_params);
+    // NVENC reads the outputs after the waits on the render
+    d.encoder->SetIOCudaStream(cuda->stream);
+
+    std::vector<CUdeviceptr> buffers;
+    for (uint32_t i = 0; i < cuda->outputs.size(); ++i) {
+        buffers.push_back(cuda->outputs[i].pointer + r->GetOutput(i).linearLayout.offset);
+    }
+    d.encoder->RegisterExternalBuffers(buffers, r->GetOutput(0).linearLayout.rowPitch);
+
+    d.references = std::make_unique<NvEncReferences>(
+        settings.m_codec, d.config->UsesLtr(), *d.encoder, d.initialize_params.encodeGUID
+    );
+    invalidates_references = true;
+#else
+    throw std::runtime_error("Built without the CUDA interop");
+#endif
+}
+
+void alvr::EncodePipelineNvEnc::submitDirect(
+    uint32_t outputIndex, uint64_t targetTimestampNs, bool idr
+) {
+#ifdef ALVR_CUDA_INTEROP
+    DirectEncoder& d = *direct;
+
+    // Identifies the frame for the reference invalidation
+    NV_ENC_PIC_PARAMS pic_params = {};
+    pic_params.inputTimeStamp = targetTimestampNs;
+    if (idr) {
+        pic_params.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR;
+    }
+    if (FoveatedQpMap::IsEnabled()) {
+        // NVENC reads the map while submitting the frame, so it can be replaced between frames
+        uint32_t version = FoveatedQpMap::GetVersion();
+        if (d.qp_delta_map.empty() || version != d.qp_delta_map_version) {
+            d.qp_delta_map_version = version;
+            // One value per macroblock for H.264, per CTB for HEVC and per superblock for AV1
+            uint32_t block_size = 64;
+            if (GetCodec() == ALVR_CODEC_H264) {
+                block_size = 16;
+            } else if (GetCodec() == ALVR_CODEC_HEVC) {
+                block_size = 32;
+            }
+            FoveatedQpMap map(d.initialize_params.encodeWidth, d.initialize_params.encodeHeight);
+            d.qp_delta_map = map.BuildDeltaMap(block_size);
+        }
+        pic_params.qpDeltaMap = d.qp_delta_map.data();
+        pic_params.qpDeltaMapSize = (uint32_t)d.qp_delta_map.size();
+    }
+    d.references->ApplyPicParams(pic_params, targetTimestampNs, idr);
+
+    CudaContextScope scope(cuda->cu, cuda->ctx);
+    d.encoder->SubmitExternalBuffer(outputIndex, &pic_params);
+    d.submitted.push_back({ targetTimestampNs, idr });
+#endif
+}
+
+bool alvr::EncodePipelineNvEnc::getDirectPacket(FramePacket& packet) {
+#ifdef ALVR_CUDA_INTEROP
+    DirectEncoder& d = *direct;
+    if (d.submitted.empty()) {
+        return false;
+    }
+    DirectEncoder::Submitted frame = d.submitted.front();
+    d.submitted.pop_front();
+
+    // Moved to the network thread, which frees it once sent
+    auto data = std::make_unique<std::vector<uint8_t>>();
+    {
+        CudaContextScope scope(cuda->cu, cuda->ctx);
+        d.encoder->GetSubmittedPacket(*data);
+    }
+
+    const NvEncoder::FrameStats& stats = d.encoder->GetLastFrameStats();
+    uint32_t blocks = stats.intraBlocks + stats.interBlocks;
+    int64_t buffer_bits = d.encode_config.rcParams.vbvBufferSize;
+    int64_t size_bits = (int64_t)data->size() * 8;
+
+    packet.data = data->data();
+    packet.size = (int)data->size();
+    packet.pts = frame.targetTimestampNs;
+    packet.isIDR = frame.idr;
+    packet.stats.averageQp = (float)stats.averageQp;
+    packet.stats.intraRatio = blocks > 0 ? (float)stats.intraBlocks / blocks : -1.f;
+    packet.stats.vbvOverflow = buffer_bits > 0 && size_bits > buffer_bits;
+    record_frame_size(size_bits, buffer_bits);
+
+    packet.release = [](void* context) { delete static_cast<std::vector<uint8_t>*>(context); };
+    packet.releaseContext = data.release();
+    return true;
+#else
+    return false;
+#endif
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "EncodePipeline.h"
+#include <deque>
 #include <functional>
 #include <memory>
 
@@ -18,19 +19,46 @@ public:
     EncodePipelineNvEnc(
         Renderer* render,
         VkContext& vk_ctx,
-        VkFrame& input_frame,
+        std::vector<std::unique_ptr<VkFrame>>& input_frames,
         VkImageCreateInfo& image_create_info,
         uint32_t width,
         uint32_t height
     );
 
-    void PushFrame(uint64_t targetTimestampNs, bool idr) override;
+    void PushFrame(uint32_t outputIndex, uint64_t targetTimestampNs, bool idr) override;
+    bool GetEncoded(FramePacket& packet) override;
+    void SetParams(FfiDynamicEncoderParams params) override;
+    bool InvalidateReferences(
+        const std::vector<uint64_t>& lostTimestampsNs, uint64_t referenceTimestampNs
+    ) override;
+
+    // Whether the CUDA driver can import the renderer outputs, which NVENC then reads in place.
+    // The outputs must be linear for that
+    static bool SupportsCudaInterop();
 
 private:
+    struct CudaInterop;
+    struct DirectEncoder;
+
+    void importOutputs(VkContext& vk_ctx);
+    void pushImportedFrame(uint32_t outputIndex, uint64_t targetTimestampNs, bool idr);
+    // Creates the NVENC encoder of the imported outputs, which takes the features of the Windows
+    // encoder: long term references, reference invalidation and the foveated QP map
+    void openDirect(uint32_t width, uint32_t height);
+    void submitDirect(uint32_t outputIndex, uint64_t targetTimestampNs, bool idr);
+    bool getDirectPacket(FramePacket& packet);
+
     Renderer* r = nullptr;
+    VkDevice vk_device = VK_NULL_HANDLE;
     std::unique_ptr<alvr::VkFrameCtx> vk_frame_ctx;
     AVBufferRef* hw_ctx = nullptr;
-    std::unique_ptr<AVFrame, std::function<void(AVFrame*)>> vk_frame;
+    std::vector<std::unique_ptr<AVFrame, std::function<void(AVFrame*)>>> vk_frames;
     AVFrame* hw_frame = nullptr;
+    // Only with linear outputs, otherwise each frame is copied by av_hwframe_transfer_data
+    std::unique_ptr<CudaInterop> cuda;
+    // Values to signal once NVENC is done reading the outputs, in encode order
+    std::deque<std::pair<VkSemaphore, uint64_t>> pending_releases;
+    // With the imported outputs unless ALVR_NVENC_LIBAVCODEC is set, encoder_ctx is freed then
+    std::unique_ptr<DirectEncoder> direct;
 };
 }
@@ -1,8 +1,15 @@
 #include "EncodePipelineSW.h"
 
+#include <algorithm>
 #include <chrono>
+#include <cstring>
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
 
 #include "FormatConverter.h"
+#include "alvr_server/FrameTrace.h"
 #include "alvr_server/Logger.h"
 #include "alvr_server/Settings.h"
 
@@ -29,91 +36,387 @@ void x264_log(void*, int level, const char* fmt, va_list args) {
     }
 }
 
+// Presets tried by the encode time tuning, from the fastest
+const char* const presets[] = { "ultrafast", "superfast", "veryfast", "faster" };
+const int preset_count = sizeof(presets) / sizeof(presets[0]);
+// Frames averaged before the preset is changed
+const int tune_window = 90;
+
+// Parses a sysfs cpu list such as "0-3,8-11"
+std::vector<int> read_cpu_list(const std::string& path) {
+    std::vector<int> cpus;
+    std::ifstream file(path);
+    std::string range;
+    while (std::getline(file, range, ',')) {
+        int first, last;
+        int count = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (count < 1) {
+            continue;
+        }
+        if (count == 1) {
+            last = first;
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+struct EncoderCpus {
+    cpu_set_t mask;
+    int cores = 0;
+};
+
+// Picks the CPUs the x264 threads run on: the performance cores of hybrid CPUs, on the NUMA node
+// the encoder is created on. One physical core is left out on CPUs with enough of them, so that
+// the SteamVR compositor and the driver threads are never starved by the slice threads
+EncoderCpus pick_encoder_cpus() {
+    EncoderCpus result;
+    CPU_ZERO(&result.mask);
+
+    // Only exists on Intel hybrid CPUs
+    std::vector<int> cpus = read_cpu_list("/sys/devices/cpu_core/cpus");
+    if (cpus.empty()) {
+        cpus = read_cpu_list("/sys/devices/system/cpu/online");
+    }
+
+    int current = sched_getcpu();
+    for (int node = 0; current >= 0; ++node) {
+        std::ostringstream path;
+        path << "/sys/devices/system/node/node" << node << "/cpulist";
+        if (!std::ifstream(path.str())) {
+            break;
+        }
+        std::vector<int> nodeCpus = read_cpu_list(path.str());
+        if (std::find(nodeCpus.begin(), nodeCpus.end(), current) == nodeCpus.end()) {
+            continue;
+        }
+        std::vector<int> local;
+        for (int cpu : cpus) {
+            if (std::find(nodeCpus.begin(), nodeCpus.end(), cpu) != nodeCpus.end()) {
+                local.push_back(cpu);
+            }
+        }
+        if (!local.empty()) {
+            cpus = local;
+        }
+        break;
+    }
+
+    // SMT siblings are grouped by the first thread of their core
+    std::map<int, std::vector<int>> cores;
+    for (int cpu : cpus) {
+        std::ostringstream path;
+        path << "/sys/devices/system/cpu/cpu" << cpu << "/topology/thread_siblings_list";
+        std::vector<int> siblings = read_cpu_list(path.str());
+        cores[siblings.empty() ? cpu : siblings[0]].push_back(cpu);
+    }
+    if (cores.size() >= 4) {
+        cores.erase(cores.begin());
+    }
+
+    for (auto& core : cores) {
+        for (int cpu : core.second) {
+            CPU_SET(cpu, &result.mask);
+        }
+    }
+    result.cores = cores.size();
+    return result;
+}
+
 }
 
 alvr::EncodePipelineSW::EncodePipelineSW(Renderer* render, uint32_t width, uint32_t height) {
     const auto& settings = Settings::Instance();
 
-    x264_param_default_preset(&param, "ultrafast", "zerolatency");
+    x264_param_default_preset(&param, presets[preset], "zerolatency");
+
+    EncoderCpus cpus = pick_encoder_cpus();
 
     param.pf_log = x264_log;
     param.i_log_level = X264_LOG_INFO;
 
     param.b_aud = 0;
     param.b_cabac = settings.m_entropyCoding == ALVR_CABAC;
+    // Frame threads would add a frame of latency each, only slice threads are used. Each thread
+    // encodes one slice, SMT siblings don't speed that up so there is one per physical core
     param.b_sliced_threads = true;
     param.i_threads = settings.m_swThreadCount;
+    if (param.i_threads == 0 && cpus.cores > 0) {
+        param.i_threads = cpus.cores;
+    }
+    // At least one slice per tile of the client decoder
+    param.i_slice_count = std::max<int>(
+        param.i_threads, settings.m_encoderTileColumns * settings.m_encoderTileRows
+    );
+    // Further split so that each slice fits in a packet
+    param.i_slice_max_size = settings.m_encoderSliceSizeBytes;
     param.i_width = width;
     param.i_height = height;
     param.rc.i_rc_method = X264_RC_ABR;
 
+    if (settings.m_gradualIntraRefresh) {
+        // The refresh spans keyint frames, IDRs are then only inserted when requested
+        param.b_intra_refresh = 1;
+        param.i_keyint_max = settings.m_gradualIntraRefreshPeriod;
+    }
+
+    sub_frame = settings.m_swSubFrameOutput;
+    if (sub_frame) {
+        param.nalu_process = nalu_process;
+        frame_mbs = ((width + 15) / 16) * ((height + 15) / 16);
+        Info("x264: sub-frame output enabled");
+    }
+
     switch (settings.m_h264Profile) {
     case ALVR_H264_PROFILE_BASELINE:
-        x264_param_apply_profile(&param, "baseline");
+        profile = "baseline";
         break;
     case ALVR_H264_PROFILE_MAIN:
-        x264_param_apply_profile(&param, "main");
+        profile = "main";
         break;
     default:
     case ALVR_H264_PROFILE_HIGH:
-        x264_param_apply_profile(&param, "high");
+        profile = "high";
         break;
     }
+    x264_param_apply_profile(&param, profile);
 
     auto params = FfiDynamicEncoderParams {};
     params.updated = true;
     params.bitrate_bps = 30'000'000;
     params.framerate = Settings::Instance().m_refreshRate;
     SetParams(params);
+    param.rc.f_vbv_buffer_init = 0.75;
+
+    // The x264 threads and the encode thread inherit the affinity of the thread that creates them
+    cpu_set_t previous_mask;
+    bool pinned = cpus.cores > 0
+        && pthread_getaffinity_np(pthread_self(), sizeof(previous_mask), &previous_mask) == 0
+        && pthread_setaffinity_np(pthread_self(), sizeof(cpus.mask), &cpus.mask) == 0;
+    if (pinned) {
+        Info("x264: %d threads on %d cores", param.i_threads, cpus.cores);
+    }
 
     enc = x264_encoder_open(&param);
+    if (enc) {
+        encode_thread = std::thread(&EncodePipelineSW::encode_loop, this);
+    }
+
+    if (pinned) {
+        pthread_setaffinity_np(pthread_self(), sizeof(previous_mask), &previous_mask);
+    }
     if (!enc) {
         throw std::runtime_error("Failed to open encoder");
     }
 
-    x264_picture_init(&picture);
-    picture.img.i_csp = X264_CSP_I420;
-    picture.img.i_plane = 3;
-
     x264_picture_init(&picture_out);
 
+    std::vector<VkImage> images;
+    std::vector<VkSemaphore> semaphores;
+    for (uint32_t i = 0; i < render->GetOutputCount(); ++i) {
+        images.push_back(render->GetOutput(i).image);
+        semaphores.push_back(render->GetOutput(i).semaphore);
+    }
     rgbtoyuv = new RgbToYuv420(
-        render,
-        render->GetOutput().image,
-        render->GetOutput().imageInfo,
-        render->GetOutput().semaphore
+        render, images, render->GetOutput(0).imageInfo, semaphores, Renderer::FramesInFlight
     );
+
+    pictures.resize(rgbtoyuv->GetSlotCount());
+    for (x264_picture_t& picture : pictures) {
+        x264_picture_init(&picture);
+        picture.img.i_csp = X264_CSP_I420;
+        picture.img.i_plane = 3;
+    }
 }
 
 alvr::EncodePipelineSW::~EncodePipelineSW() {
+    {
+        std::lock_guard<std::mutex> lock(encode_mutex);
+        exiting = true;
+    }
+    encode_cv.notify_all();
+    if (encode_thread.joinable()) {
+        encode_thread.join();
+    }
     if (rgbtoyuv) {
         delete rgbtoyuv;
     }
     if (enc) {
         x264_encoder_close(enc);
     }
+    for (auto& slice : slices) {
+        delete slice.second.data;
+    }
+}
+
+// Called from the x264 slice threads, possibly out of order
+void alvr::EncodePipelineSW::nalu_process(x264_t* h, x264_nal_t* nal, void* opaque) {
+    auto self = static_cast<EncodePipelineSW*>(opaque);
+
+    bool is_slice = nal->i_type == NAL_SLICE || nal->i_type == NAL_SLICE_IDR;
+    if (!is_slice) {
+        // The headers are written before the slice threads start
+        size_t offset = self->slice_headers.size();
+        self->slice_headers.resize(offset + nal->i_payload * 3 / 2 + 5 + 64);
+        x264_nal_encode(h, self->slice_headers.data() + offset, nal);
+        self->slice_headers.resize(offset + nal->i_payload);
+        return;
+    }
+
+    // The first slice is sent together with the headers
+    size_t offset = nal->i_first_mb == 0 ? self->slice_headers.size() : 0;
+    auto data = new std::vector<uint8_t>(offset + nal->i_payload * 3 / 2 + 5 + 64);
+    if (offset > 0) {
+        memcpy(data->data(), self->slice_headers.data(), offset);
+    }
+    x264_nal_encode(h, data->data() + offset, nal);
+    data->resize(offset + nal->i_payload);
+
+    std::lock_guard<std::mutex> lock(self->slice_mutex);
+    self->slices[nal->i_first_mb] = { data, nal->i_last_mb };
+
+    while (!self->slices.empty() && self->slices.begin()->first == self->next_mb) {
+        Slice slice = self->slices.begin()->second;
+        self->slices.erase(self->slices.begin());
+        self->next_mb = slice.last_mb + 1;
+
+        FfiNalRange range = { slice.data->data(), (unsigned int)slice.data->size() };
+        ParseFrameNalRanges(
+            ALVR_CODEC_H264,
+            &range,
+            1,
+            self->pts,
+            self->is_idr,
+            self->next_mb >= self->frame_mbs,
+            [](void* context) { delete static_cast<std::vector<uint8_t>*>(context); },
+            slice.data
+        );
+    }
 }
 
-void alvr::EncodePipelineSW::PushFrame(uint64_t targetTimestampNs, bool idr) {
-    rgbtoyuv->Convert(picture.img.plane, picture.img.i_stride);
-    rgbtoyuv->Sync();
-    timestamp.cpu = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                        std::chrono::steady_clock::now().time_since_epoch()
-    )
-                        .count();
+void alvr::EncodePipelineSW::encode_loop() {
+    std::unique_lock<std::mutex> lock(encode_mutex);
+    while (true) {
+        encode_cv.wait(lock, [this] { return exiting || encode_slot.has_value(); });
+        if (exiting) {
+            return;
+        }
+        uint32_t slot = *encode_slot;
+        encode_slot.reset();
+        lock.unlock();
 
+        try {
+            rgbtoyuv->Sync(slot);
+            timestamp.cpu = FrameTrace::Now();
+
+            auto start = std::chrono::steady_clock::now();
+            int nnal = 0;
+            nal_size = x264_encoder_encode(enc, &nal, &nnal, &pictures[slot], &picture_out);
+            if (nal_size < 0) {
+                throw std::runtime_error("x264 encoder_encode failed");
+            }
+            tune_preset(std::chrono::steady_clock::now() - start);
+        } catch (...) {
+            encode_error = std::current_exception();
+        }
+
+        lock.lock();
+        encoding = false;
+        encode_cv.notify_all();
+    }
+}
+
+void alvr::EncodePipelineSW::tune_preset(std::chrono::steady_clock::duration encode_time) {
+    tune_time += encode_time;
+    if (++tune_frames < tune_window) {
+        return;
+    }
+    double average = std::chrono::duration<double>(tune_time).count() / tune_frames;
+    double interval = double(param.i_fps_den) / param.i_fps_num;
+    tune_time = {};
+    tune_frames = 0;
+
+    // Leave headroom for frames that are harder to encode than the average
+    int next = preset;
+    if (average > interval * 0.75 && preset > 0) {
+        next = preset - 1;
+    } else if (average < interval * 0.4 && preset < preset_count - 1) {
+        next = preset + 1;
+    }
+    if (next == preset) {
+        return;
+    }
+    preset = next;
+
+    // Only the analysis settings of a preset can be changed on an open encoder
+    x264_param_t preset_param;
+    x264_param_default_preset(&preset_param, presets[preset], "zerolatency");
+    param.analyse = preset_param.analyse;
+    x264_param_apply_profile(&param, profile);
+    x264_encoder_reconfig(enc, &param);
+
+    Info("x264: average encode time %.1fms, using preset %s", average * 1e3, presets[preset]);
+}
+
+void alvr::EncodePipelineSW::wait_encode() {
+    std::unique_lock<std::mutex> lock(encode_mutex);
+    encode_cv.wait(lock, [this] { return !encoding; });
+    if (encode_error) {
+        std::exception_ptr error = encode_error;
+        encode_error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+void alvr::EncodePipelineSW::PrepareFrame(uint32_t outputIndex) {
+    uint32_t slot = next_slot;
+    next_slot = (next_slot + 1) % pictures.size();
+    rgbtoyuv->Convert(outputIndex, slot, pictures[slot].img.plane, pictures[slot].img.i_stride);
+    prepared = Conversion { outputIndex, slot };
+}
+
+void alvr::EncodePipelineSW::PushFrame(uint32_t outputIndex, uint64_t targetTimestampNs, bool idr) {
+    // Normally already collected by GetEncoded()
+    wait_encode();
+
+    if (!prepared || prepared->output != outputIndex) {
+        PrepareFrame(outputIndex);
+    }
+    uint32_t slot = prepared->slot;
+    prepared.reset();
+
+    x264_picture_t& picture = pictures[slot];
     picture.i_type = idr ? X264_TYPE_IDR : X264_TYPE_AUTO;
+    picture.opaque = this;
     pts = picture.i_pts = targetTimestampNs;
     is_idr = idr;
 
-    int nnal = 0;
-    nal_size = x264_encoder_encode(enc, &nal, &nnal, &picture, &picture_out);
-    if (nal_size < 0) {
-        throw std::runtime_error("x264 encoder_encode failed");
+    if (sub_frame) {
+        std::lock_guard<std::mutex> lock(slice_mutex);
+        slice_headers.clear();
+        next_mb = 0;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(encode_mutex);
+        encode_slot = slot;
+        encoding = true;
     }
+    encode_cv.notify_all();
 }
 
 bool alvr::EncodePipelineSW::GetEncoded(FramePacket& packet) {
+    wait_encode();
+    if (sub_frame) {
+        // The slices were already sent by nalu_process
+        packet.data = nullptr;
+        packet.size = 0;
+        packet.pts = pts;
+        packet.isIDR = is_idr;
+        return true;
+    }
     if (!nal) {
         return false;
     }
@@ -121,6 +424,7 @@ bool alvr::EncodePipelineSW::GetEncoded(FramePacket& packet) {
     packet.data = nal[0].p_payload;
     packet.pts = pts;
     packet.isIDR = is_idr;
+    record_frame_size((int64_t)nal_size * 8, (int64_t)param.rc.i_vbv_buffer_size * 1'000);
     return packet.size > 0;
 }
 
@@ -128,14 +432,16 @@ void alvr::EncodePipelineSW::SetParams(FfiDynamicEncoderParams params) {
     if (!params.updated) {
         return;
     }
-    // x264 doesn't work well with adaptive bitrate/fps
-    param.i_fps_num = Settings::Instance().m_refreshRate;
-    param.i_fps_den = 1;
-    param.rc.i_bitrate
-        = params.bitrate_bps / 1'000 * 1.4; // needs higher value to hit target bitrate
-    param.rc.i_vbv_buffer_size = param.rc.i_bitrate / param.i_fps_num * 1.1;
+    // The encode thread also reconfigures the encoder and reads the framerate
+    if (enc) {
+        wait_encode();
+    }
+    // zerolatency disables VFR input, so the rate control works from the framerate alone
+    param.i_fps_num = std::max(int(params.framerate * 1'000), 1'000);
+    param.i_fps_den = 1'000;
+    param.rc.i_bitrate = params.bitrate_bps / 1'000;
     param.rc.i_vbv_max_bitrate = param.rc.i_bitrate;
-    param.rc.f_vbv_buffer_init = 0.75;
+    param.rc.i_vbv_buffer_size = std::max(int(VbvBufferBits(params) / 1'000), 1);
     if (enc) {
         x264_encoder_reconfig(enc, &param);
     }
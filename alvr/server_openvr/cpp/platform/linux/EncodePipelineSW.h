@@ -2,6 +2,13 @@
 
 #include "EncodePipeline.h"
 
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
 #include <x264.h>
 
 class FormatConverter;
@@ -13,20 +20,65 @@ public:
     ~EncodePipelineSW();
     EncodePipelineSW(Renderer* render, uint32_t width, uint32_t height);
 
-    void PushFrame(uint64_t targetTimestampNs, bool idr) override;
+    void PrepareFrame(uint32_t outputIndex) override;
+    void PushFrame(uint32_t outputIndex, uint64_t targetTimestampNs, bool idr) override;
     bool GetEncoded(FramePacket& packet) override;
     void SetParams(FfiDynamicEncoderParams params) override;
     int GetCodec() override;
 
 private:
+    static void nalu_process(x264_t* h, x264_nal_t* nal, void* opaque);
+    void encode_loop();
+    // Switches to a slower preset when the encode time leaves room for it, or a faster one when
+    // it gets close to the frame interval
+    void tune_preset(std::chrono::steady_clock::duration encode_time);
+    // Wait for the frame handed to the encode thread, rethrowing its error
+    void wait_encode();
+
     x264_t* enc = nullptr;
     x264_param_t param;
-    x264_picture_t picture;
     x264_picture_t picture_out;
     x264_nal_t* nal = nullptr;
     int nal_size = 0;
     int64_t pts = 0;
     bool is_idr = false;
     FormatConverter* rgbtoyuv = nullptr;
+    const char* profile = "high";
+    int preset = 0;
+    std::chrono::steady_clock::duration tune_time = {};
+    int tune_frames = 0;
+
+    // Converted frames are read by x264 straight from the staging images of their slot. The next
+    // frame is converted into another slot while the current one is encoded
+    struct Conversion {
+        uint32_t output;
+        uint32_t slot;
+    };
+    std::vector<x264_picture_t> pictures;
+    std::optional<Conversion> prepared;
+    uint32_t next_slot = 0;
+
+    // x264_encoder_encode runs on its own thread so that the next frame can be composited and
+    // converted meanwhile
+    std::thread encode_thread;
+    std::mutex encode_mutex;
+    std::condition_variable encode_cv;
+    std::optional<uint32_t> encode_slot;
+    bool encoding = false;
+    bool exiting = false;
+    std::exception_ptr encode_error;
+
+    // Sub-frame output, slices are sent from the x264 threads as soon as they are encoded
+    struct Slice {
+        std::vector<uint8_t>* data;
+        int last_mb;
+    };
+    bool sub_frame = false;
+    int frame_mbs = 0;
+    std::mutex slice_mutex;
+    std::vector<uint8_t> slice_headers;
+    // Completed slices by first macroblock, waiting for the previous ones
+    std::map<int, Slice> slices;
+    int next_mb = 0;
 };
 }
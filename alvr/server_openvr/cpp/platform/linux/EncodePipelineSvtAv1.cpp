@@ -0,0 +1,167 @@
+#include "EncodePipelineSvtAv1.h"
+
+#include "FormatConverter.h"
+#include "alvr_server/FrameTrace.h"
+#include "alvr_server/Logger.h"
+#include "alvr_server/Settings.h"
+#include "alvr_server/SvtAv1Config.h"
+#include "ffmpeg_helper.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+}
+
+namespace {
+
+const char* const encoder_name = "libsvtav1";
+
+}
+
+bool alvr::EncodePipelineSvtAv1::Supported() {
+    return SvtAv1Config::Enabled() && avcodec_find_encoder_by_name(encoder_name) != nullptr;
+}
+
+alvr::EncodePipelineSvtAv1::EncodePipelineSvtAv1(Renderer* render, uint32_t width, uint32_t height)
+    : width(width)
+    , height(height) {
+    const auto& settings = Settings::Instance();
+
+    if (settings.m_gradualIntraRefresh) {
+        Warn("SVT-AV1: intra refresh is not supported, recovering with key frames");
+    }
+
+    params.updated = true;
+    params.bitrate_bps = 30'000'000;
+    params.framerate = settings.m_refreshRate;
+    open_encoder();
+
+    std::vector<VkImage> images;
+    std::vector<VkSemaphore> semaphores;
+    for (uint32_t i = 0; i < render->GetOutputCount(); ++i) {
+        images.push_back(render->GetOutput(i).image);
+        semaphores.push_back(render->GetOutput(i).semaphore);
+    }
+    rgbtoyuv = new RgbToYuv420(
+        render, images, render->GetOutput(0).imageInfo, semaphores, Renderer::FramesInFlight
+    );
+
+    // The frames aren't refcounted, libavcodec copies them when they are sent
+    frames.resize(rgbtoyuv->GetSlotCount());
+    for (AVFrame*& frame : frames) {
+        frame = av_frame_alloc();
+        frame->width = width;
+        frame->height = height;
+        frame->format = AV_PIX_FMT_YUV420P;
+    }
+}
+
+alvr::EncodePipelineSvtAv1::~EncodePipelineSvtAv1() {
+    for (AVFrame*& frame : frames) {
+        av_frame_free(&frame);
+    }
+    if (rgbtoyuv) {
+        delete rgbtoyuv;
+    }
+}
+
+void alvr::EncodePipelineSvtAv1::open_encoder() {
+    const AVCodec* codec = avcodec_find_encoder_by_name(encoder_name);
+    if (codec == nullptr) {
+        throw std::runtime_error(std::string("Failed to find encoder ") + encoder_name);
+    }
+
+    avcodec_free_context(&encoder_ctx);
+    pending = 0;
+    encoder_ctx = avcodec_alloc_context3(codec);
+    if (!encoder_ctx) {
+        throw std::runtime_error("failed to allocate SVT-AV1 encoder");
+    }
+
+    encoder_ctx->width = width;
+    encoder_ctx->height = height;
+    encoder_ctx->time_base = { 1, (int)1e9 };
+    encoder_ctx->framerate = AVRational { int(params.framerate * 1000), 1000 };
+    encoder_ctx->sample_aspect_ratio = AVRational { 1, 1 };
+    encoder_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    encoder_ctx->max_b_frames = 0;
+    encoder_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    // The bitrate equal to the maximum selects the CBR rate control of SVT-AV1
+    encoder_ctx->bit_rate = params.bitrate_bps;
+    encoder_ctx->rc_max_rate = encoder_ctx->bit_rate;
+    encoder_ctx->rc_buffer_size = VbvBufferBits(params);
+
+    int preset = SvtAv1Config::Preset(width, height, params.framerate);
+    std::string svt_params = SvtAv1Config::Params(width, height);
+    av_opt_set_int(encoder_ctx->priv_data, "preset", preset, 0);
+    av_opt_set(encoder_ctx->priv_data, "svtav1-params", svt_params.c_str(), 0);
+
+    int err = avcodec_open2(encoder_ctx, codec, NULL);
+    if (err < 0) {
+        throw alvr::AvException("SVT-AV1 encoder open failed", err);
+    }
+    open_bitrate = params.bitrate_bps;
+    reopen = false;
+
+    Info("SVT-AV1: preset %d, %s, %.1f Mbps", preset, svt_params.c_str(), params.bitrate_bps / 1e6);
+}
+
+void alvr::EncodePipelineSvtAv1::PrepareFrame(uint32_t outputIndex) {
+    uint32_t slot = next_slot;
+    next_slot = (next_slot + 1) % frames.size();
+    rgbtoyuv->Convert(outputIndex, slot, frames[slot]->data, frames[slot]->linesize);
+    prepared = Conversion { outputIndex, slot };
+}
+
+void alvr::EncodePipelineSvtAv1::PushFrame(
+    uint32_t outputIndex, uint64_t targetTimestampNs, bool idr
+) {
+    if (!prepared || prepared->output != outputIndex) {
+        PrepareFrame(outputIndex);
+    }
+    uint32_t slot = prepared->slot;
+    prepared.reset();
+
+    if (reopen) {
+        open_encoder();
+        idr = true;
+    }
+
+    rgbtoyuv->Sync(slot);
+    timestamp.cpu = FrameTrace::Now();
+
+    AVFrame* frame = frames[slot];
+    frame->pict_type = idr ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    frame->pts = targetTimestampNs;
+
+    int err = avcodec_send_frame(encoder_ctx, frame);
+    if (err < 0) {
+        throw alvr::AvException("avcodec_send_frame failed: ", err);
+    }
+    pending++;
+}
+
+bool alvr::EncodePipelineSvtAv1::GetEncoded(FramePacket& packet) {
+    // In low delay mode our libsvtav1 patch waits in the receive for the packet of the frame sent,
+    // so it isn't sent a frame late. Only called with a frame in flight, it would wait forever
+    if (pending == 0 || !EncodePipeline::GetEncoded(packet)) {
+        return false;
+    }
+    pending--;
+    return true;
+}
+
+void alvr::EncodePipelineSvtAv1::SetParams(FfiDynamicEncoderParams params) {
+    if (!params.updated) {
+        return;
+    }
+    // The framerate is fixed once open like for the other libavcodec encoders, its share of the
+    // bitrate is kept instead
+    int64_t bitrate = params.bitrate_bps / params.framerate * av_q2d(encoder_ctx->framerate);
+    this->params = params;
+    this->params.bitrate_bps = bitrate;
+    this->params.framerate = av_q2d(encoder_ctx->framerate);
+    if (SvtAv1Config::NeedsReopen(open_bitrate, bitrate)) {
+        reopen = true;
+    }
+}
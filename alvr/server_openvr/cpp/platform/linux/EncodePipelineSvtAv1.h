@@ -0,0 +1,52 @@
+#pragma once
+
+#include "EncodePipeline.h"
+
+#include <optional>
+#include <vector>
+
+extern "C" struct AVFrame;
+
+class FormatConverter;
+
+namespace alvr {
+
+// AV1 software encoding with the libsvtav1 encoder of libavcodec, in the realtime configuration
+// of SvtAv1Config. The frames are converted to YUV on the GPU like for x264
+class EncodePipelineSvtAv1 : public EncodePipeline {
+public:
+    ~EncodePipelineSvtAv1();
+    EncodePipelineSvtAv1(Renderer* render, uint32_t width, uint32_t height);
+
+    // AV1 was asked for, libsvtav1 is in the FFmpeg build and there are enough cores for it
+    static bool Supported();
+
+    void PrepareFrame(uint32_t outputIndex) override;
+    void PushFrame(uint32_t outputIndex, uint64_t targetTimestampNs, bool idr) override;
+    bool GetEncoded(FramePacket& packet) override;
+    void SetParams(FfiDynamicEncoderParams params) override;
+
+private:
+    // (Re)creates encoder_ctx for the bitrate of params. The frames still in the previous encoder
+    // are dropped, the next one is a key frame anyway
+    void open_encoder();
+
+    uint32_t width;
+    uint32_t height;
+    FfiDynamicEncoderParams params = {};
+    int64_t open_bitrate = 0;
+    bool reopen = false;
+    // Frames sent to the encoder that didn't come out yet
+    int pending = 0;
+
+    FormatConverter* rgbtoyuv = nullptr;
+    // One frame per slot of the converter, pointing at its staging images
+    std::vector<AVFrame*> frames;
+    struct Conversion {
+        uint32_t output;
+        uint32_t slot;
+    };
+    std::optional<Conversion> prepared;
+    uint32_t next_slot = 0;
+};
+}
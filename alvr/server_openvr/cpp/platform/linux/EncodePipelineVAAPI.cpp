@@ -1,9 +1,21 @@
 #include "EncodePipelineVAAPI.h"
 #include "ALVR-common/packet_types.h"
+#include "alvr_server/FoveatedQpMap.h"
+#include "alvr_server/FrameTrace.h"
 #include "alvr_server/Logger.h"
 #include "alvr_server/Settings.h"
 #include "ffmpeg_helper.h"
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <unistd.h>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -11,6 +23,7 @@ extern "C" {
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 #include <libavutil/hwcontext.h>
+#include <libavutil/hwcontext_vaapi.h>
 #include <libavutil/opt.h>
 }
 
@@ -28,6 +41,69 @@ const char* encoder(ALVR_CODEC codec) {
     throw std::runtime_error("invalid codec " + std::to_string(codec));
 }
 
+// The regions stay on the frame, which is reused for every encode of its output image, and are
+// copied by the conversion filter. Drivers without ROI support ignore them.
+void attach_foveated_roi(AVFrame* frame, const FoveatedQpMap& qp_map) {
+    // A ring per QP step, up to a few of them
+    auto regions = qp_map.BuildRegions(std::clamp(qp_map.GetMaxDelta(), 1, 8));
+
+    AVFrameSideData* side_data = av_frame_new_side_data(
+        frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, regions.size() * sizeof(AVRegionOfInterest)
+    );
+    if (!side_data) {
+        throw std::runtime_error("failed to allocate the regions of interest");
+    }
+    auto roi = (AVRegionOfInterest*)side_data->data;
+    for (size_t i = 0; i < regions.size(); ++i) {
+        roi[i].self_size = sizeof(AVRegionOfInterest);
+        roi[i].left = regions[i].left;
+        roi[i].top = regions[i].top;
+        roi[i].right = regions[i].right;
+        roi[i].bottom = regions[i].bottom;
+        // A share of the QP range of the codec. For AV1 it scales to the finer quantizer index,
+        // which keeps a similar quality step
+        roi[i].qoffset = AVRational { regions[i].qpDelta, 51 };
+    }
+}
+
+VAProfile va_profile(AVCodecID codec, int profile) {
+    switch (codec) {
+    case AV_CODEC_ID_H264:
+        if (profile == FF_PROFILE_H264_BASELINE) {
+            return VAProfileH264ConstrainedBaseline;
+        }
+        return profile == FF_PROFILE_H264_MAIN ? VAProfileH264Main : VAProfileH264High;
+    case AV_CODEC_ID_HEVC:
+        return profile == FF_PROFILE_HEVC_MAIN_10 ? VAProfileHEVCMain10 : VAProfileHEVCMain;
+    case AV_CODEC_ID_AV1:
+        return VAProfileAV1Profile0;
+    default:
+        return VAProfileNone;
+    }
+}
+
+// The low power entrypoint is VDENC on Intel, lower latency than the one assisted by the shaders
+// and the only one of recent GPUs for some codecs. Mesa only has the other one
+bool has_low_power_entrypoint(AVBufferRef* hw_device, AVCodecID codec, int profile) {
+    if (getenv("ALVR_VAAPI_NO_LOW_POWER")) {
+        return false;
+    }
+    auto device = (AVHWDeviceContext*)hw_device->data;
+    VADisplay display = ((AVVAAPIDeviceContext*)device->hwctx)->display;
+
+    std::vector<VAEntrypoint> entrypoints(vaMaxNumEntrypoints(display));
+    int count = 0;
+    VAStatus status = vaQueryConfigEntrypoints(
+        display, va_profile(codec, profile), entrypoints.data(), &count
+    );
+    if (status != VA_STATUS_SUCCESS) {
+        return false;
+    }
+    entrypoints.resize(count);
+    return std::find(entrypoints.begin(), entrypoints.end(), VAEntrypointEncSliceLP)
+        != entrypoints.end();
+}
+
 void set_hwframe_ctx(AVCodecContext* ctx, AVBufferRef* hw_device_ctx) {
     AVBufferRef* hw_frames_ref;
     AVHWFramesContext* frames_ctx = NULL;
@@ -38,11 +114,8 @@ void set_hwframe_ctx(AVCodecContext* ctx, AVBufferRef* hw_device_ctx) {
     }
     frames_ctx = (AVHWFramesContext*)(hw_frames_ref->data);
     frames_ctx->format = AV_PIX_FMT_VAAPI;
-    frames_ctx->sw_format = (Settings::Instance().m_codec == ALVR_CODEC_HEVC
-                             || Settings::Instance().m_codec == ALVR_CODEC_AV1)
-            && Settings::Instance().m_use10bitEncoder
-        ? AV_PIX_FMT_P010
-        : AV_PIX_FMT_NV12;
+    frames_ctx->sw_format
+        = Settings::Instance().Uses10bitOutput() ? AV_PIX_FMT_P010 : AV_PIX_FMT_NV12;
     frames_ctx->width = ctx->width;
     frames_ctx->height = ctx->height;
     frames_ctx->initial_pool_size = 3;
@@ -57,6 +130,353 @@ void set_hwframe_ctx(AVCodecContext* ctx, AVBufferRef* hw_device_ctx) {
     av_buffer_unref(&hw_frames_ref);
 }
 
+// Whether the encoder can be opened on the VA-API device of this render node
+bool can_encode(const std::string& path, const AVCodec* codec) {
+    AVBufferRef* device = nullptr;
+    if (av_hwdevice_ctx_create(&device, AV_HWDEVICE_TYPE_VAAPI, path.c_str(), NULL, 0) < 0) {
+        return false;
+    }
+
+    AVCodecContext* ctx = avcodec_alloc_context3(codec);
+    ctx->width = 1920;
+    ctx->height = 1080;
+    ctx->time_base = { 1, (int)1e9 };
+    ctx->pix_fmt = AV_PIX_FMT_VAAPI;
+    av_opt_set_int(
+        ctx->priv_data,
+        "low_power",
+        has_low_power_entrypoint(device, codec->id, FF_PROFILE_UNKNOWN),
+        0
+    );
+    bool ok = false;
+    try {
+        set_hwframe_ctx(ctx, device);
+        ok = avcodec_open2(ctx, codec, NULL) == 0;
+    } catch (const std::exception&) {
+    }
+    avcodec_free_context(&ctx);
+    av_buffer_unref(&device);
+
+    return ok;
+}
+
+// Buffer source of frames like frame, the filters and a buffer sink, all on the VA-API device
+void create_filter_graph(
+    AVBufferRef* hw_device,
+    AVFrame* frame,
+    const std::string& filters,
+    AVFilterGraph** filter_graph,
+    AVFilterContext** filter_in,
+    AVFilterContext** filter_out
+) {
+    int err;
+    *filter_graph = avfilter_graph_alloc();
+
+    AVFilterInOut* outputs = avfilter_inout_alloc();
+    AVFilterInOut* inputs = avfilter_inout_alloc();
+
+    // In the nanosecond time base of the encoder
+    std::stringstream buffer_filter_args;
+    buffer_filter_args << "video_size=" << frame->width << "x" << frame->height;
+    buffer_filter_args << ":pix_fmt=" << frame->format;
+    buffer_filter_args << ":time_base=1/" << (int)1e9;
+    if ((err = avfilter_graph_create_filter(
+             filter_in,
+             avfilter_get_by_name("buffer"),
+             "in",
+             buffer_filter_args.str().c_str(),
+             NULL,
+             *filter_graph
+         ))) {
+        throw alvr::AvException("filter_in creation failed:", err);
+    }
+    AVBufferSrcParameters* par = av_buffersrc_parameters_alloc();
+    memset(par, 0, sizeof(*par));
+    par->format = AV_PIX_FMT_NONE;
+    par->hw_frames_ctx = av_buffer_ref(frame->hw_frames_ctx);
+    av_buffersrc_parameters_set(*filter_in, par);
+    av_free(par);
+
+    if ((err = avfilter_graph_create_filter(
+             filter_out, avfilter_get_by_name("buffersink"), "out", NULL, NULL, *filter_graph
+         ))) {
+        throw alvr::AvException("filter_out creation failed:", err);
+    }
+
+    outputs->name = av_strdup("in");
+    outputs->filter_ctx = *filter_in;
+    outputs->pad_idx = 0;
+    outputs->next = NULL;
+
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = *filter_out;
+    inputs->pad_idx = 0;
+    inputs->next = NULL;
+
+    if ((err = avfilter_graph_parse_ptr(*filter_graph, filters.c_str(), &inputs, &outputs, NULL))
+        < 0) {
+        throw alvr::AvException("avfilter_graph_parse_ptr failed:", err);
+    }
+
+    avfilter_inout_free(&outputs);
+    avfilter_inout_free(&inputs);
+
+    for (unsigned i = 0; i < (*filter_graph)->nb_filters; ++i) {
+        (*filter_graph)->filters[i]->hw_device_ctx = av_buffer_ref(hw_device);
+    }
+
+    if ((err = avfilter_graph_config(*filter_graph, NULL))) {
+        throw alvr::AvException("avfilter_graph_config failed:", err);
+    }
+}
+
+// Test frame of the color correction offload, a row of 2x2 blocks of one color each
+const int color_test_width = 256;
+const int color_test_height = 16;
+// Largest difference to the compositor allowed on the test frame, in 8 bit levels
+const int color_tolerance = 2;
+// procamp_vaapi brightness the driver offset is measured with, of -100 to 100
+const double probe_brightness = 50.;
+
+struct Nv12Image {
+    std::vector<uint8_t> luma;
+    std::vector<uint8_t> chroma;
+};
+
+uint8_t quantize(float value) { return (uint8_t)std::lround(std::clamp(value, 0.f, 1.f) * 255.f); }
+
+// BT.709 full range, a color per block
+Nv12Image to_nv12(const std::vector<std::array<float, 3>>& blocks) {
+    Nv12Image image;
+    image.luma.resize(color_test_width * color_test_height);
+    image.chroma.resize(color_test_width * color_test_height / 2);
+    for (int y = 0; y < color_test_height; ++y) {
+        for (int x = 0; x < color_test_width; ++x) {
+            const auto& c = blocks[x / 2];
+            image.luma[y * color_test_width + x]
+                = quantize(0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2]);
+        }
+    }
+    for (int y = 0; y < color_test_height / 2; ++y) {
+        for (int x = 0; x < color_test_width / 2; ++x) {
+            const auto& c = blocks[x];
+            uint8_t* uv = &image.chroma[y * color_test_width + x * 2];
+            uv[0] = quantize(-0.1146f * c[0] - 0.3854f * c[1] + 0.5f * c[2] + 0.5f);
+            uv[1] = quantize(0.5f * c[0] - 0.4542f * c[1] - 0.0458f * c[2] + 0.5f);
+        }
+    }
+    return image;
+}
+
+// Uploads the test frame, runs it through the filters and reads it back
+Nv12Image run_filters(
+    AVBufferRef* hw_device,
+    AVBufferRef* hw_frames_ref,
+    const Nv12Image& image,
+    const std::string& filters
+) {
+    AVFrame* upload = av_frame_alloc();
+    upload->format = AV_PIX_FMT_NV12;
+    upload->width = color_test_width;
+    upload->height = color_test_height;
+    upload->data[0] = const_cast<uint8_t*>(image.luma.data());
+    upload->data[1] = const_cast<uint8_t*>(image.chroma.data());
+    upload->linesize[0] = color_test_width;
+    upload->linesize[1] = color_test_width;
+
+    AVFrame* va_frame = av_frame_alloc();
+    AVFrame* filtered = av_frame_alloc();
+    AVFrame* download = av_frame_alloc();
+    AVFilterGraph* graph = nullptr;
+    auto free_all = [&]() {
+        avfilter_graph_free(&graph);
+        av_frame_free(&download);
+        av_frame_free(&filtered);
+        av_frame_free(&va_frame);
+        av_frame_free(&upload);
+    };
+
+    Nv12Image result;
+    try {
+        int err = av_hwframe_get_buffer(hw_frames_ref, va_frame, 0);
+        if (err < 0) {
+            throw alvr::AvException("Failed to get hwframe buffer:", err);
+        }
+        if ((err = av_hwframe_transfer_data(va_frame, upload, 0)) < 0) {
+            throw alvr::AvException("Failed to upload the test frame:", err);
+        }
+        va_frame->pts = 0;
+
+        AVFilterContext* filter_in = nullptr;
+        AVFilterContext* filter_out = nullptr;
+        create_filter_graph(hw_device, va_frame, filters, &graph, &filter_in, &filter_out);
+        if ((err = av_buffersrc_add_frame_flags(filter_in, va_frame, AV_BUFFERSRC_FLAG_PUSH))
+            != 0) {
+            throw alvr::AvException("av_buffersrc_add_frame failed", err);
+        }
+        if ((err = av_buffersink_get_frame(filter_out, filtered)) != 0) {
+            throw alvr::AvException("av_buffersink_get_frame failed", err);
+        }
+
+        download->format = AV_PIX_FMT_NV12;
+        if ((err = av_hwframe_transfer_data(download, filtered, 0)) < 0) {
+            throw alvr::AvException("Failed to download the test frame:", err);
+        }
+        result.luma.resize(image.luma.size());
+        result.chroma.resize(image.chroma.size());
+        for (int y = 0; y < color_test_height; ++y) {
+            memcpy(
+                &result.luma[y * color_test_width],
+                download->data[0] + y * download->linesize[0],
+                color_test_width
+            );
+        }
+        for (int y = 0; y < color_test_height / 2; ++y) {
+            memcpy(
+                &result.chroma[y * color_test_width],
+                download->data[1] + y * download->linesize[1],
+                color_test_width
+            );
+        }
+    } catch (...) {
+        free_all();
+        throw;
+    }
+    free_all();
+
+    return result;
+}
+
+struct LinearFit {
+    double gain;
+    double offset;
+};
+
+// Least squares fit of after from before, leaving out the samples the filter clipped
+LinearFit fit(const std::vector<uint8_t>& before, const std::vector<uint8_t>& after) {
+    double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (size_t i = 0; i < before.size(); ++i) {
+        if (after[i] == 0 || after[i] == 255) {
+            continue;
+        }
+        n++;
+        sx += before[i];
+        sy += after[i];
+        sxx += (double)before[i] * before[i];
+        sxy += (double)before[i] * after[i];
+    }
+    double det = n * sxx - sx * sx;
+    if (n < 2 || det == 0) {
+        throw std::runtime_error("the test frame is clipped");
+    }
+    double gain = (n * sxy - sx * sy) / det;
+    return { gain, (sy - gain * sx) / n };
+}
+
+int max_difference(const Nv12Image& a, const Nv12Image& b) {
+    int difference = 0;
+    for (size_t i = 0; i < a.luma.size(); ++i) {
+        difference = std::max(difference, std::abs(a.luma[i] - b.luma[i]));
+    }
+    for (size_t i = 0; i < a.chroma.size(); ++i) {
+        difference = std::max(difference, std::abs(a.chroma[i] - b.chroma[i]));
+    }
+    return difference;
+}
+
+std::string procamp_filter(double brightness, double contrast, double saturation) {
+    char filter[128];
+    snprintf(
+        filter,
+        sizeof(filter),
+        "procamp_vaapi=b=%.3f:c=%.4f:s=%.4f",
+        brightness,
+        contrast,
+        saturation
+    );
+    return filter;
+}
+
+// procamp_vaapi options doing the brightness and contrast of color.comp. On RGB they are a gain
+// and an offset per channel, which carry over to YUV as the same gain and offset on luma and the
+// gain alone on chroma. Drivers scale and center the options differently, so their luma gain,
+// brightness step and chroma gain are measured on the test frame first, then the result is
+// compared to color.comp
+std::string calibrate_procamp(
+    AVBufferRef* hw_device, AVBufferRef* hw_frames_ref, float brightness, float contrast
+) {
+    std::vector<std::array<float, 3>> blocks(color_test_width / 2);
+    std::vector<std::array<float, 3>> expected(blocks.size());
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        // A gray ramp with some tint, the chroma gain can't be measured on grays
+        float gray = (float)i / (blocks.size() - 1);
+        float tint = ((float)(i % 4) - 1.5f) * 0.1f;
+        blocks[i] = { std::clamp(gray + tint, 0.f, 1.f), gray, std::clamp(gray - tint, 0.f, 1.f) };
+        for (int c = 0; c < 3; ++c) {
+            expected[i][c] = (blocks[i][c] + brightness - 0.5f) * contrast + 0.5f;
+        }
+    }
+    Nv12Image input = to_nv12(blocks);
+    Nv12Image reference = to_nv12(expected);
+    auto run = [&](const std::string& filter) {
+        return run_filters(hw_device, hw_frames_ref, input, filter);
+    };
+
+    double contrast_option = contrast;
+    double gain = fit(input.luma, run(procamp_filter(0., contrast_option, 1.)).luma).gain;
+    if (gain < 0.01) {
+        throw std::runtime_error("contrast has no effect");
+    }
+    contrast_option *= contrast / gain;
+
+    Nv12Image base = run(procamp_filter(0., contrast_option, 1.));
+    LinearFit base_luma = fit(input.luma, base.luma);
+    LinearFit lifted_luma
+        = fit(input.luma, run(procamp_filter(probe_brightness, contrast_option, 1.)).luma);
+    double brightness_step = (lifted_luma.offset - base_luma.offset) / probe_brightness;
+    if (std::abs(brightness_step) < 1e-3) {
+        throw std::runtime_error("brightness has no effect");
+    }
+    double offset = 255. * (contrast * brightness + 0.5 * (1. - contrast));
+    double brightness_option = (offset - base_luma.offset) / brightness_step;
+
+    double chroma_gain = fit(input.chroma, base.chroma).gain;
+    if (chroma_gain < 0.01) {
+        throw std::runtime_error("saturation has no effect");
+    }
+    double saturation_option = contrast / chroma_gain;
+
+    if (std::abs(brightness_option) > 100. || contrast_option > 10. || saturation_option > 10.) {
+        throw std::runtime_error("the correction is out of the range of procamp_vaapi");
+    }
+
+    std::string filter = procamp_filter(brightness_option, contrast_option, saturation_option);
+    int difference = max_difference(reference, run(filter));
+    if (difference > color_tolerance) {
+        throw std::runtime_error(
+            filter + " differs from the compositor by " + std::to_string(difference) + " levels"
+        );
+    }
+    Info("VAAPI: color correction with %s, within %d levels", filter.c_str(), difference);
+    return filter;
+}
+
+// PCI vendor of the GPU behind a render node, 0 if unknown
+uint32_t pci_vendor(const std::string& path) {
+    char* real = realpath(path.c_str(), nullptr);
+    if (!real) {
+        return 0;
+    }
+    std::string node(real);
+    free(real);
+    node = node.substr(node.find_last_of('/') + 1);
+
+    std::ifstream file("/sys/class/drm/" + node + "/device/vendor");
+    uint32_t vendor = 0;
+    file >> std::hex >> vendor;
+    return vendor;
+}
+
 // Map the vulkan frames to corresponding vaapi frames
 AVFrame*
 map_frame(AVBufferRef* hw_frames_ref, AVBufferRef* drm_device_ctx, alvr::VkFrame& input_frame) {
@@ -64,10 +484,11 @@ map_frame(AVBufferRef* hw_frames_ref, AVBufferRef* drm_device_ctx, alvr::VkFrame
 
     AVFrame* mapped_frame = av_frame_alloc();
     mapped_frame->format = AV_PIX_FMT_VAAPI;
-    mapped_frame->hw_frames_ctx = av_buffer_ref(hw_frames_ref);
+    mapped_frame->hw_frames_ctx = hw_frames_ref;
 
     AVBufferRef* drm_frames_ref = NULL;
     if (!(drm_frames_ref = av_hwframe_ctx_alloc(drm_device_ctx))) {
+        av_frame_free(&mapped_frame);
         throw std::runtime_error("Failed to create vulkan frame context.");
     }
     AVHWFramesContext* drm_frames_ctx = (AVHWFramesContext*)(drm_frames_ref->data);
@@ -79,6 +500,7 @@ map_frame(AVBufferRef* hw_frames_ref, AVBufferRef* drm_device_ctx, alvr::VkFrame
     int err;
     if ((err = av_hwframe_ctx_init(drm_frames_ref)) < 0) {
         av_buffer_unref(&drm_frames_ref);
+        av_frame_free(&mapped_frame);
         throw alvr::AvException("Failed to initialize DRM frame context:", err);
     }
 
@@ -89,19 +511,23 @@ map_frame(AVBufferRef* hw_frames_ref, AVBufferRef* drm_device_ctx, alvr::VkFrame
     vk_frame->data[0] = (uint8_t*)(AVDRMFrameDescriptor*)input_frame;
     vk_frame->format = AV_PIX_FMT_DRM_PRIME;
     vk_frame->buf[0] = av_buffer_alloc(1);
-    av_hwframe_map(mapped_frame, vk_frame, AV_HWFRAME_MAP_READ);
+    err = av_hwframe_map(mapped_frame, vk_frame, AV_HWFRAME_MAP_READ);
     av_frame_free(&vk_frame);
-
-    av_buffer_unref(&hw_frames_ref);
+    if (err < 0) {
+        av_frame_free(&mapped_frame);
+        throw alvr::AvException("Failed to map the output image:", err);
+    }
 
     return mapped_frame;
 }
 
-// Import VA surface
-AVFrame* import_frame(AVBufferRef* hw_frames_ref, DrmImage& drm) {
+// Import VA surface. The DRM mapping is returned in exported, its fd stays in use by the renderer
+// for as long as the surface is
+AVFrame* import_frame(AVBufferRef* hw_frames_ref, DrmImage& drm, AVFrame*& exported) {
     AVFrame* va_frame = av_frame_alloc();
     int err = av_hwframe_get_buffer(hw_frames_ref, va_frame, 0);
     if (err < 0) {
+        av_frame_free(&va_frame);
         throw alvr::AvException("Failed to get hwframe buffer:", err);
     }
 
@@ -109,8 +535,11 @@ AVFrame* import_frame(AVBufferRef* hw_frames_ref, DrmImage& drm) {
     mapped_frame->format = AV_PIX_FMT_DRM_PRIME;
     err = av_hwframe_map(mapped_frame, va_frame, AV_HWFRAME_MAP_WRITE);
     if (err < 0) {
+        av_frame_free(&mapped_frame);
+        av_frame_free(&va_frame);
         throw alvr::AvException("Failed to export va frame:", err);
     }
+    exported = mapped_frame;
 
     auto desc = reinterpret_cast<AVDRMFrameDescriptor*>(mapped_frame->data[0]);
     drm.fd = desc->objects[0].fd;
@@ -118,8 +547,8 @@ AVFrame* import_frame(AVBufferRef* hw_frames_ref, DrmImage& drm) {
     drm.modifier = desc->objects[0].format_modifier;
     drm.planes = desc->layers[0].nb_planes;
     for (uint32_t i = 0; i < drm.planes; ++i) {
-        drm.strides[0] = desc->layers[0].planes[i].pitch;
-        drm.offsets[0] = desc->layers[0].planes[i].offset;
+        drm.strides[i] = desc->layers[0].planes[i].pitch;
+        drm.offsets[i] = desc->layers[0].planes[i].offset;
     }
 
     return va_frame;
@@ -127,8 +556,87 @@ AVFrame* import_frame(AVBufferRef* hw_frames_ref, DrmImage& drm) {
 
 }
 
+void alvr::EncodePipelineVAAPI::SelectDevice(VkContext& vk_ctx) {
+    const std::string& device = Settings::Instance().m_linuxEncodeDevice;
+    if (device.empty()) {
+        return;
+    }
+    if (device != "auto") {
+        vk_ctx.encodeDevicePath = device;
+        Info("VAAPI: encoding on %s", device.c_str());
+        return;
+    }
+
+    const AVCodec* codec
+        = avcodec_find_encoder_by_name(encoder(ALVR_CODEC(Settings::Instance().m_codec)));
+    if (codec == nullptr) {
+        return;
+    }
+    // Offload the encode to the first other GPU that can open the encoder, the rendering GPU is
+    // only kept if none can
+    for (int i = 128; i < 136; ++i) {
+        auto path = "/dev/dri/renderD" + std::to_string(i);
+        if (path == vk_ctx.devicePath || access(path.c_str(), R_OK | W_OK) != 0) {
+            continue;
+        }
+        if (can_encode(path, codec)) {
+            vk_ctx.encodeDevicePath = path;
+            Info("VAAPI: encoding on %s, rendering on %s", path.c_str(), vk_ctx.devicePath.c_str());
+            return;
+        }
+        Info("VAAPI: %s can't encode with %s", path.c_str(), codec->name);
+    }
+    Info("VAAPI: no other GPU can encode with %s", codec->name);
+}
+
+void alvr::EncodePipelineVAAPI::SelectColorFilter(VkContext& vk_ctx) {
+    const auto& settings = Settings::Instance();
+    if (!settings.m_linuxVaapiColorCorrection || !settings.m_enableColorCorrection) {
+        return;
+    }
+    if (settings.m_sharpening != 0.f || settings.m_saturation != 0.f || settings.m_gamma != 1.f) {
+        Info("VAAPI: only brightness and contrast can be left to the video processor");
+        return;
+    }
+
+    AVBufferRef* device = nullptr;
+    AVBufferRef* frames_ref = nullptr;
+    try {
+        int err = av_hwdevice_ctx_create(
+            &device, AV_HWDEVICE_TYPE_VAAPI, vk_ctx.encodeDevicePath.c_str(), NULL, 0
+        );
+        if (err < 0) {
+            throw alvr::AvException("Failed to create a VAAPI device:", err);
+        }
+        if (!(frames_ref = av_hwframe_ctx_alloc(device))) {
+            throw std::runtime_error("Failed to create VAAPI frame context.");
+        }
+        auto frames_ctx = (AVHWFramesContext*)(frames_ref->data);
+        frames_ctx->format = AV_PIX_FMT_VAAPI;
+        frames_ctx->sw_format = AV_PIX_FMT_NV12;
+        frames_ctx->width = color_test_width;
+        frames_ctx->height = color_test_height;
+        frames_ctx->initial_pool_size = 4;
+        if ((err = av_hwframe_ctx_init(frames_ref)) < 0) {
+            throw alvr::AvException("Failed to initialize VAAPI frame context:", err);
+        }
+
+        vk_ctx.colorFilter = calibrate_procamp(
+            device, frames_ref, settings.m_brightness, settings.m_contrast + 1.f
+        );
+    } catch (const std::exception& e) {
+        Info("VAAPI: color correction left to the compositor, %s", e.what());
+    }
+    av_buffer_unref(&frames_ref);
+    av_buffer_unref(&device);
+}
+
 alvr::EncodePipelineVAAPI::EncodePipelineVAAPI(
-    Renderer* render, VkContext& vk_ctx, VkFrame& input_frame, uint32_t width, uint32_t height
+    Renderer* render,
+    VkContext& vk_ctx,
+    std::vector<std::unique_ptr<VkFrame>>& input_frames,
+    uint32_t width,
+    uint32_t height
 )
     : r(render) {
     /* VAAPI Encoding pipeline
@@ -142,7 +650,7 @@ alvr::EncodePipelineVAAPI::EncodePipelineVAAPI(
      * and the encoder that takes the converted frame and produces packets.
      */
     int err = av_hwdevice_ctx_create(
-        &hw_ctx, AV_HWDEVICE_TYPE_VAAPI, vk_ctx.devicePath.c_str(), NULL, 0
+        &hw_ctx, AV_HWDEVICE_TYPE_VAAPI, vk_ctx.encodeDevicePath.c_str(), NULL, 0
     );
     if (err < 0) {
         throw alvr::AvException("Failed to create a VAAPI device:", err);
@@ -159,6 +667,15 @@ alvr::EncodePipelineVAAPI::EncodePipelineVAAPI(
 
     const auto& settings = Settings::Instance();
 
+    // The presets are those of the driver of the encoding GPU
+    bool amd = vk_ctx.amd;
+    bool intel = vk_ctx.intel;
+    if (vk_ctx.encodeDevicePath != vk_ctx.devicePath) {
+        uint32_t vendor = pci_vendor(vk_ctx.encodeDevicePath);
+        amd = vendor == 0x1002;
+        intel = vendor == 0x8086;
+    }
+
     auto codec_id = ALVR_CODEC(settings.m_codec);
     const char* encoder_name = encoder(codec_id);
     const AVCodec* codec = avcodec_find_encoder_by_name(encoder_name);
@@ -220,6 +737,22 @@ alvr::EncodePipelineVAAPI::EncodePipelineVAAPI(
 
     av_opt_set_int(encoder_ctx->priv_data, "filler_data", settings.m_fillerData, 0);
 
+    // Grid the client decodes in parallel. HEVC and AV1 have tiles, H264 as many slices
+    if (settings.m_encoderTileColumns * settings.m_encoderTileRows > 1) {
+        if (codec_id == ALVR_CODEC_H264) {
+            encoder_ctx->slices = settings.m_encoderTileColumns * settings.m_encoderTileRows;
+        } else {
+            std::string tiles = std::to_string(settings.m_encoderTileColumns) + "x"
+                + std::to_string(settings.m_encoderTileRows);
+            av_opt_set(encoder_ctx->priv_data, "tiles", tiles.c_str(), 0);
+        }
+    }
+
+    if (settings.m_gradualIntraRefresh) {
+        // FFmpeg doesn't expose the rolling intra refresh of VA-API
+        Warn("VAAPI: intra refresh is not supported, losses are repaired with IDR frames");
+    }
+
     encoder_ctx->width = width;
     encoder_ctx->height = height;
     encoder_ctx->time_base = { 1, (int)1e9 };
@@ -241,36 +774,49 @@ alvr::EncodePipelineVAAPI::EncodePipelineVAAPI(
                              // quality by allocating more bits to smooth areas
     switch (settings.m_encoderQualityPreset) {
     case ALVR_QUALITY:
-        if (vk_ctx.amd) {
+        if (amd) {
             quality.preset_mode = PRESET_MODE_QUALITY;
             encoder_ctx->compression_level
                 = quality.quality; // (QUALITY preset, no pre-encoding, vbaq)
-        } else if (vk_ctx.intel) {
+        } else if (intel) {
             encoder_ctx->compression_level = 1;
         }
         break;
     case ALVR_BALANCED:
-        if (vk_ctx.amd) {
+        if (amd) {
             quality.preset_mode = PRESET_MODE_BALANCE;
             encoder_ctx->compression_level
                 = quality.quality; // (BALANCE preset, no pre-encoding, vbaq)
-        } else if (vk_ctx.intel) {
+        } else if (intel) {
             encoder_ctx->compression_level = 4;
         }
         break;
     case ALVR_SPEED:
     default:
-        if (vk_ctx.amd) {
+        if (amd) {
             quality.preset_mode = PRESET_MODE_SPEED;
             encoder_ctx->compression_level
                 = quality.quality; // (speed preset, no pre-encoding, vbaq)
-        } else if (vk_ctx.intel) {
+        } else if (intel) {
             encoder_ctx->compression_level = 7;
         }
         break;
     }
 
-    av_opt_set_int(encoder_ctx->priv_data, "async_depth", 1, 0);
+    low_power = has_low_power_entrypoint(hw_ctx, codec->id, encoder_ctx->profile);
+    av_opt_set_int(encoder_ctx->priv_data, "low_power", low_power, 0);
+
+    // The encoder issues the frames as they come and waits for the oldest one once async_depth
+    // are in flight, which it outputs. The renderer outputs it or the conversion reads are
+    // rendered to again FramesInFlight frames later, before then the frame must be done. Pipelined
+    // encoding and the output thread collect a frame after the next render, so they keep one
+    async_depth = std::clamp(settings.m_linuxVaapiAsyncDepth, 1u, Renderer::FramesInFlight);
+    if (async_depth > 1
+        && (settings.m_enableLinuxPipelinedEncoding || settings.m_enableLinuxAsyncOutput)) {
+        Info("VAAPI: async depth 1, the encode already overlaps with the composition");
+        async_depth = 1;
+    }
+    av_opt_set_int(encoder_ctx->priv_data, "async_depth", async_depth, 0);
 
     set_hwframe_ctx(encoder_ctx, hw_ctx);
 
@@ -278,123 +824,169 @@ alvr::EncodePipelineVAAPI::EncodePipelineVAAPI(
     if (err < 0) {
         throw alvr::AvException("Cannot open video encoder codec:", err);
     }
+    Info(
+        "VAAPI: %s entrypoint, async depth %u", low_power ? "low power" : "default", async_depth
+    );
 
     AVBufferRef* hw_frames_ref;
     if (!(hw_frames_ref = av_hwframe_ctx_alloc(hw_ctx))) {
         throw std::runtime_error("Failed to create VAAPI frame context.");
     }
+    // The surfaces keep their own references, this one is dropped on every way out
+    std::unique_ptr<AVBufferRef, std::function<void(AVBufferRef*)>> hw_frames_guard {
+        hw_frames_ref, [](AVBufferRef* ref) { av_buffer_unref(&ref); }
+    };
     auto frames_ctx = (AVHWFramesContext*)(hw_frames_ref->data);
     frames_ctx->format = AV_PIX_FMT_VAAPI;
-    frames_ctx->sw_format = input_frame.avFormat();
-    frames_ctx->width = input_frame.imageInfo().extent.width;
-    frames_ctx->height = input_frame.imageInfo().extent.height;
-    frames_ctx->initial_pool_size = 1;
+    frames_ctx->sw_format = input_frames[0]->avFormat();
+    frames_ctx->width = input_frames[0]->imageInfo().extent.width;
+    frames_ctx->height = input_frames[0]->imageInfo().extent.height;
+    frames_ctx->initial_pool_size = input_frames.size();
     if ((err = av_hwframe_ctx_init(hw_frames_ref)) < 0) {
-        av_buffer_unref(&hw_frames_ref);
         throw alvr::AvException("Failed to initialize VAAPI frame context:", err);
     }
 
     encoder_frame = av_frame_alloc();
-    if (vk_ctx.intel || getenv("ALVR_VAAPI_IMPORT_SURFACE")) {
-        Info("Importing VA surface");
-        DrmImage drm;
-        mapped_frame = import_frame(hw_frames_ref, drm);
-        r->ImportOutput(drm);
-    } else {
-        mapped_frame = map_frame(hw_frames_ref, drm_ctx, input_frame);
-    }
-
-    filter_graph = avfilter_graph_alloc();
-
-    AVFilterInOut* outputs = avfilter_inout_alloc();
-    AVFilterInOut* inputs = avfilter_inout_alloc();
 
-    std::stringstream buffer_filter_args;
-    buffer_filter_args << "video_size=" << mapped_frame->width << "x" << mapped_frame->height;
-    buffer_filter_args << ":pix_fmt=" << mapped_frame->format;
-    buffer_filter_args << ":time_base=" << encoder_ctx->time_base.num << "/"
-                       << encoder_ctx->time_base.den;
-    if ((err = avfilter_graph_create_filter(
-             &filter_in,
-             avfilter_get_by_name("buffer"),
-             "in",
-             buffer_filter_args.str().c_str(),
-             NULL,
-             filter_graph
-         ))) {
-        throw alvr::AvException("filter_in creation failed:", err);
+    // Prefer rendering straight into VA surfaces, allocated and imported once per output. Probe
+    // that the surfaces can be imported before touching the outputs, they are replaced on import
+    std::vector<DrmImage> drm_images(input_frames.size());
+    if (!getenv("ALVR_VAAPI_NO_IMPORT")) {
+        try {
+            for (uint32_t i = 0; i < input_frames.size(); ++i) {
+                AVFrame* exported = nullptr;
+                mapped_frames.push_back(import_frame(hw_frames_ref, drm_images[i], exported));
+                exported_frames.push_back(exported);
+            }
+        } catch (const std::exception& e) {
+            Warn("Failed to export VA surface: %s", e.what());
+        }
+        bool exported = mapped_frames.size() == input_frames.size();
+        if (exported && !r->CanImportOutput(drm_images[0])) {
+            Info("VA surface modifier %" PRIx64 " can't be imported", drm_images[0].modifier);
+            exported = false;
+        }
+        if (!exported) {
+            for (AVFrame* frame : exported_frames) {
+                av_frame_free(&frame);
+            }
+            exported_frames.clear();
+            for (AVFrame* frame : mapped_frames) {
+                av_frame_free(&frame);
+            }
+            mapped_frames.clear();
+        }
     }
-    AVBufferSrcParameters* par = av_buffersrc_parameters_alloc();
-    memset(par, 0, sizeof(*par));
-    par->format = AV_PIX_FMT_NONE;
-    par->hw_frames_ctx = av_buffer_ref(mapped_frame->hw_frames_ctx);
-    av_buffersrc_parameters_set(filter_in, par);
-    av_free(par);
 
-    if ((err = avfilter_graph_create_filter(
-             &filter_out, avfilter_get_by_name("buffersink"), "out", NULL, NULL, filter_graph
-         ))) {
-        throw alvr::AvException("filter_out creation failed:", err);
+    if (!mapped_frames.empty()) {
+        Info("Importing VA surface");
+        for (uint32_t i = 0; i < input_frames.size(); ++i) {
+            r->ImportOutput(i, drm_images[i]);
+        }
+    } else {
+        Info("Mapping output images to VA surfaces");
+        for (auto& input_frame : input_frames) {
+            mapped_frames.push_back(
+                map_frame(av_buffer_ref(hw_frames_ref), drm_ctx, *input_frame)
+            );
+        }
     }
+    AVFrame* mapped_frame = mapped_frames[0];
 
-    outputs->name = av_strdup("in");
-    outputs->filter_ctx = filter_in;
-    outputs->pad_idx = 0;
-    outputs->next = NULL;
-
-    inputs->name = av_strdup("out");
-    inputs->filter_ctx = filter_out;
-    inputs->pad_idx = 0;
-    inputs->next = NULL;
+    if (FoveatedQpMap::IsEnabled()) {
+        FoveatedQpMap qp_map(width, height);
+        for (AVFrame* frame : mapped_frames) {
+            attach_foveated_roi(frame, qp_map);
+        }
+        roi_versions.assign(mapped_frames.size(), FoveatedQpMap::GetVersion());
+    }
 
+    // scale_vaapi converts RGBA outputs, procamp_vaapi does the color correction when the
+    // compositor left it to the encoder
     std::string filters = "scale_vaapi=out_range=full:format=";
-    if ((Settings::Instance().m_codec == ALVR_CODEC_HEVC
-         || Settings::Instance().m_codec == ALVR_CODEC_AV1)
-        && Settings::Instance().m_use10bitEncoder) {
+    if (Settings::Instance().Uses10bitOutput()) {
         filters += "p010";
     } else {
         filters += "nv12";
     }
-    if ((err = avfilter_graph_parse_ptr(filter_graph, filters.c_str(), &inputs, &outputs, NULL))
-        < 0) {
-        throw alvr::AvException("avfilter_graph_parse_ptr failed:", err);
+    std::string denoise_filters;
+    if (Settings::Instance().m_linuxVaapiDenoise > 0) {
+        denoise_filters = filters + ",denoise_vaapi=denoise="
+            + std::to_string(std::min(Settings::Instance().m_linuxVaapiDenoise, 64u));
     }
-
-    avfilter_inout_free(&outputs);
-    avfilter_inout_free(&inputs);
-
-    for (unsigned i = 0; i < filter_graph->nb_filters; ++i) {
-        filter_graph->filters[i]->hw_device_ctx = av_buffer_ref(hw_ctx);
+    if (!vk_ctx.colorFilter.empty()) {
+        filters += "," + vk_ctx.colorFilter;
+        if (!denoise_filters.empty()) {
+            denoise_filters += "," + vk_ctx.colorFilter;
+        }
     }
 
-    if ((err = avfilter_graph_config(filter_graph, NULL))) {
-        throw alvr::AvException("avfilter_graph_config failed:", err);
+    // The video processor of the AMD drivers has no noise reduction, the graph fails to configure
+    if (!denoise_filters.empty()) {
+        try {
+            create_filter_graph(
+                hw_ctx, mapped_frame, denoise_filters, &denoise_graph, &denoise_in, &denoise_out
+            );
+            Info("VAAPI: denoising with %s", denoise_filters.c_str());
+        } catch (const std::exception& e) {
+            Warn("VAAPI: the driver can't denoise, encoding without it: %s", e.what());
+            denoise_graph = nullptr;
+            denoise_in = nullptr;
+            denoise_out = nullptr;
+        }
     }
+
+    create_filter_graph(hw_ctx, mapped_frame, filters, &filter_graph, &filter_in, &filter_out);
 }
 
 alvr::EncodePipelineVAAPI::~EncodePipelineVAAPI() {
     // Commented because freeing it here causes a gpu reset, it should be cleaned up away
     // avcodec_free_context(&encoder_ctx);
     // avfilter_graph_free(&filter_graph);
-    // av_frame_free(&mapped_frame);
+    // for (AVFrame* mapped_frame : mapped_frames) {
+    //     av_frame_free(&mapped_frame);
+    // }
     // av_frame_free(&encoder_frame);
     // av_buffer_unref(&hw_ctx);
     // av_buffer_unref(&drm_ctx);
 }
 
-void alvr::EncodePipelineVAAPI::PushFrame(uint64_t targetTimestampNs, bool idr) {
-    r->Sync();
-    timestamp.cpu = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                        std::chrono::steady_clock::now().time_since_epoch()
-    )
-                        .count();
+void alvr::EncodePipelineVAAPI::PushFrame(
+    uint32_t outputIndex, uint64_t targetTimestampNs, bool idr
+) {
+    // The render fence is attached to the surface so the conversion waits on the GPU
+    if (!r->SyncDmaBuf(outputIndex)) {
+        r->Sync(outputIndex);
+    }
+    timestamp.cpu = FrameTrace::Now();
+    push_times.push_back({ targetTimestampNs, timestamp.cpu });
+
+    if (!roi_versions.empty()) {
+        // The encoder keeps references to the side data of the frames it was sent, so the regions
+        // are replaced instead of written in place
+        uint32_t version = FoveatedQpMap::GetVersion();
+        if (roi_versions[outputIndex] != version) {
+            AVFrame* frame = mapped_frames[outputIndex];
+            av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+            attach_foveated_roi(frame, FoveatedQpMap(frame->width, frame->height));
+            roi_versions[outputIndex] = version;
+        }
+    }
+
+    AVFilterContext* source = filter_in;
+    AVFilterContext* sink = filter_out;
+    if (denoise_graph && denoising) {
+        source = denoise_in;
+        sink = denoise_out;
+    }
+
     int err = av_buffersrc_add_frame_flags(
-        filter_in, mapped_frame, AV_BUFFERSRC_FLAG_PUSH | AV_BUFFERSRC_FLAG_KEEP_REF
+        source, mapped_frames[outputIndex], AV_BUFFERSRC_FLAG_PUSH | AV_BUFFERSRC_FLAG_KEEP_REF
     );
     if (err != 0) {
         throw alvr::AvException("av_buffersrc_add_frame failed", err);
     }
-    err = av_buffersink_get_frame(filter_out, encoder_frame);
+    err = av_buffersink_get_frame(sink, encoder_frame);
     if (err != 0) {
         throw alvr::AvException("av_buffersink_get_frame failed", err);
     }
@@ -408,16 +1000,56 @@ void alvr::EncodePipelineVAAPI::PushFrame(uint64_t targetTimestampNs, bool idr)
     av_frame_unref(encoder_frame);
 }
 
+bool alvr::EncodePipelineVAAPI::GetEncoded(FramePacket& packet) {
+    if (!EncodePipeline::GetEncoded(packet)) {
+        return false;
+    }
+
+    // The frames the encoder dropped never come out
+    while (!push_times.empty() && push_times.front().first < packet.pts) {
+        push_times.pop_front();
+    }
+    if (push_times.empty() || push_times.front().first != packet.pts) {
+        return true;
+    }
+    // Reported from the push of this frame rather than the last one, with async_depth
+    timestamp.cpu = push_times.front().second;
+    push_times.pop_front();
+
+    uint64_t now = FrameTrace::Now();
+    latency_sum_ns += now - timestamp.cpu;
+    latency_count++;
+    if (latency_count == latency_window) {
+        LogPeriod(
+            "VaapiEncodeLatency",
+            "VAAPI: %s entrypoint, async depth %u, %.2fms from push to output",
+            low_power ? "low power" : "default",
+            async_depth,
+            latency_sum_ns / 1e6 / latency_count
+        );
+        latency_sum_ns = 0;
+        latency_count = 0;
+    }
+    return true;
+}
+
 void alvr::EncodePipelineVAAPI::SetParams(FfiDynamicEncoderParams params) {
     if (!params.updated) {
         return;
     }
     encoder_ctx->bit_rate = params.bitrate_bps;
     encoder_ctx->framerate = AVRational { int(params.framerate * 1000), 1000 };
-    encoder_ctx->rc_buffer_size = encoder_ctx->bit_rate / params.framerate;
+    encoder_ctx->rc_buffer_size = VbvBufferBits(params);
     encoder_ctx->rc_max_rate = encoder_ctx->bit_rate;
     encoder_ctx->rc_initial_buffer_occupancy = encoder_ctx->rc_buffer_size;
 
+    // A tenth of hysteresis, so that the noise doesn't come and go with the bitrate adaptation
+    uint64_t max_denoise_bps
+        = Settings::Instance().m_linuxVaapiDenoiseMaxBitrateMbps * 1'000'000ull;
+    if (max_denoise_bps != 0) {
+        denoising = params.bitrate_bps <= (denoising ? max_denoise_bps * 11 / 10 : max_denoise_bps);
+    }
+
     if (Settings::Instance().m_amdBitrateCorruptionFix) {
         RequestIDR();
     }
@@ -2,6 +2,8 @@
 
 #include "EncodePipeline.h"
 
+#include <deque>
+
 extern "C" struct AVBufferRef;
 extern "C" struct AVCodecContext;
 extern "C" struct AVFilterContext;
@@ -22,21 +24,55 @@ class EncodePipelineVAAPI : public EncodePipeline {
 public:
     ~EncodePipelineVAAPI();
     EncodePipelineVAAPI(
-        Renderer* render, VkContext& vk_ctx, VkFrame& input_frame, uint32_t width, uint32_t height
+        Renderer* render,
+        VkContext& vk_ctx,
+        std::vector<std::unique_ptr<VkFrame>>& input_frames,
+        uint32_t width,
+        uint32_t height
     );
 
-    void PushFrame(uint64_t targetTimestampNs, bool idr) override;
+    // Set vk_ctx.encodeDevicePath from the settings, probing the other GPUs when asked to. The
+    // renderer outputs must be linear if it isn't the rendering device
+    static void SelectDevice(VkContext& vk_ctx);
+    // Set vk_ctx.colorFilter when the color correction is asked to run on the video processor of
+    // the encoding GPU and can: only brightness and contrast carry over to YUV unchanged, and the
+    // driver procamp is calibrated and checked against the compositor on a test frame
+    static void SelectColorFilter(VkContext& vk_ctx);
+
+    void PushFrame(uint32_t outputIndex, uint64_t targetTimestampNs, bool idr) override;
+    bool GetEncoded(FramePacket& packet) override;
     void SetParams(FfiDynamicEncoderParams params) override;
 
 private:
+    static constexpr uint32_t latency_window = 120;
+
     Renderer* r = nullptr;
+    bool low_power = false;
+    // Frames the encoder works on at once, each is output async_depth - 1 frames late
+    uint32_t async_depth = 1;
+    // Target timestamp and time of the pushes not output yet
+    std::deque<std::pair<uint64_t, uint64_t>> push_times;
+    uint64_t latency_sum_ns = 0;
+    uint32_t latency_count = 0;
     AVBufferRef* hw_ctx = nullptr;
     AVBufferRef* drm_ctx = nullptr;
-    AVFrame* mapped_frame = nullptr;
+    std::vector<AVFrame*> mapped_frames;
+    // DRM mappings of the imported VA surfaces, empty when the output images are mapped instead
+    std::vector<AVFrame*> exported_frames;
+    // Foveation center version of the regions of interest of each mapped frame, empty when the
+    // foveated QP offsets are disabled
+    std::vector<uint32_t> roi_versions;
     AVFrame* encoder_frame = nullptr;
     AVFilterGraph* filter_graph = nullptr;
     AVFilterContext* filter_in = nullptr;
     AVFilterContext* filter_out = nullptr;
+    // Same filters with denoise_vaapi after the conversion, null when it's disabled or the driver
+    // can't denoise
+    AVFilterGraph* denoise_graph = nullptr;
+    AVFilterContext* denoise_in = nullptr;
+    AVFilterContext* denoise_out = nullptr;
+    // The frames go through the denoise graph while the bitrate is low enough for it to pay off
+    bool denoising = true;
 
     union vlVaQualityBits {
         unsigned int quality;
@@ -1,52 +1,61 @@
 #include "FormatConverter.h"
+#include "alvr_server/Logger.h"
 #include "alvr_server/bindings.h"
 
 FormatConverter::FormatConverter(Renderer* render)
     : r(render) { }
 
 FormatConverter::~FormatConverter() {
-    for (const OutputImage& image : m_images) {
-        vkUnmapMemory(r->m_dev, image.memory);
-        vkDestroyImageView(r->m_dev, image.view, nullptr);
-        vkDestroyImage(r->m_dev, image.image, nullptr);
-        vkFreeMemory(r->m_dev, image.memory, nullptr);
+    for (const Slot& slot : m_slots) {
+        for (const OutputImage& image : slot.images) {
+            vkUnmapMemory(r->m_dev, image.memory);
+            vkDestroyImageView(r->m_dev, image.view, nullptr);
+            vkDestroyImage(r->m_dev, image.image, nullptr);
+            vkFreeMemory(r->m_dev, image.memory, nullptr);
+        }
+        vkDestroyQueryPool(r->m_dev, slot.queryPool, nullptr);
     }
 
     vkDestroySemaphore(r->m_dev, m_output.semaphore, nullptr);
 
-    vkDestroyQueryPool(r->m_dev, m_queryPool, nullptr);
     vkDestroyDescriptorSetLayout(r->m_dev, m_descriptorLayout, nullptr);
-    vkDestroyImageView(r->m_dev, m_view, nullptr);
+    for (VkImageView view : m_views) {
+        vkDestroyImageView(r->m_dev, view, nullptr);
+    }
     vkDestroyShaderModule(r->m_dev, m_shader, nullptr);
     vkDestroyPipeline(r->m_dev, m_pipeline, nullptr);
     vkDestroyPipelineLayout(r->m_dev, m_pipelineLayout, nullptr);
 }
 
 void FormatConverter::init(
-    VkImage image,
+    const std::vector<VkImage>& images,
     VkImageCreateInfo imageCreateInfo,
-    VkSemaphore semaphore,
+    const std::vector<VkSemaphore>& semaphores,
     int count,
+    uint32_t slots,
     const unsigned char* shaderData,
     unsigned shaderLen
 ) {
-    m_images.resize(count);
-    m_semaphore = semaphore;
+    m_slots.resize(slots);
+    m_semaphores = semaphores;
 
-    // Timestamp query
     VkQueryPoolCreateInfo queryPoolInfo = {};
     queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
     queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
     queryPoolInfo.queryCount = 1;
-    VK_CHECK(vkCreateQueryPool(r->m_dev, &queryPoolInfo, nullptr, &m_queryPool));
 
-    // Command buffer
     VkCommandBufferAllocateInfo commandBufferInfo = {};
     commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
     commandBufferInfo.commandPool = r->m_commandPool;
     commandBufferInfo.commandBufferCount = 1;
-    VK_CHECK(vkAllocateCommandBuffers(r->m_dev, &commandBufferInfo, &m_commandBuffer));
+
+    // Timestamp query and command buffer per slot, a slot may be recorded while another one is
+    // still executing
+    for (Slot& slot : m_slots) {
+        VK_CHECK(vkCreateQueryPool(r->m_dev, &queryPoolInfo, nullptr, &slot.queryPool));
+        VK_CHECK(vkAllocateCommandBuffers(r->m_dev, &commandBufferInfo, &slot.commandBuffer));
+    }
 
     // Descriptors
     VkDescriptorSetLayoutBinding descriptorBindings[2];
@@ -70,58 +79,14 @@ void FormatConverter::init(
         r->m_dev, &descriptorSetLayoutInfo, nullptr, &m_descriptorLayout
     ));
 
-    // Input image
-    VkImageViewCreateInfo viewInfo = {};
-    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    viewInfo.format = imageCreateInfo.format;
-    viewInfo.image = image;
-    viewInfo.subresourceRange = {};
-    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    viewInfo.subresourceRange.baseMipLevel = 0;
-    viewInfo.subresourceRange.levelCount = 1;
-    viewInfo.subresourceRange.baseArrayLayer = 0;
-    viewInfo.subresourceRange.layerCount = 1;
-    viewInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
-    viewInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-    viewInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-    viewInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-    VK_CHECK(vkCreateImageView(r->m_dev, &viewInfo, nullptr, &m_view));
-
-    // Output images
-    for (int i = 0; i < count; ++i) {
-        VkImageCreateInfo imageInfo = {};
-        imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-        imageInfo.imageType = VK_IMAGE_TYPE_2D;
-        imageInfo.format = VK_FORMAT_R8_UNORM;
-        imageInfo.extent.width = imageCreateInfo.extent.width;
-        imageInfo.extent.height = imageCreateInfo.extent.height;
-        imageInfo.extent.depth = 1;
-        imageInfo.arrayLayers = 1;
-        imageInfo.mipLevels = 1;
-        imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-        imageInfo.tiling = VK_IMAGE_TILING_LINEAR;
-        imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT;
-        VK_CHECK(vkCreateImage(r->m_dev, &imageInfo, nullptr, &m_images[i].image));
-
-        VkMemoryRequirements memReqs;
-        VkMemoryAllocateInfo memAllocInfo {};
-        memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        vkGetImageMemoryRequirements(r->m_dev, m_images[i].image, &memReqs);
-        memAllocInfo.allocationSize = memReqs.size;
-
-        VkMemoryPropertyFlags memType = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-            | VK_MEMORY_PROPERTY_HOST_CACHED_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-        memAllocInfo.memoryTypeIndex = r->memoryTypeIndex(memType, memReqs.memoryTypeBits);
-        VK_CHECK(vkAllocateMemory(r->m_dev, &memAllocInfo, nullptr, &m_images[i].memory));
-        VK_CHECK(vkBindImageMemory(r->m_dev, m_images[i].image, m_images[i].memory, 0));
-
+    // Input images
+    m_views.resize(images.size());
+    for (size_t i = 0; i < images.size(); ++i) {
         VkImageViewCreateInfo viewInfo = {};
         viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
         viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-        viewInfo.format = imageInfo.format;
-        viewInfo.image = m_images[i].image;
+        viewInfo.format = imageCreateInfo.format;
+        viewInfo.image = images[i];
         viewInfo.subresourceRange = {};
         viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
         viewInfo.subresourceRange.baseMipLevel = 0;
@@ -132,52 +97,106 @@ void FormatConverter::init(
         viewInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
         viewInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
         viewInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-        VK_CHECK(vkCreateImageView(r->m_dev, &viewInfo, nullptr, &m_images[i].view));
-
-        VkImageMemoryBarrier imageBarrier = {};
-        imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        imageBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        imageBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-        imageBarrier.image = m_images[i].image;
-        imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        imageBarrier.subresourceRange.layerCount = 1;
-        imageBarrier.subresourceRange.levelCount = 1;
-        imageBarrier.srcAccessMask = 0;
-        imageBarrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
-
-        r->commandBufferBegin();
-        vkCmdPipelineBarrier(
-            r->m_commandBuffer,
-            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
-            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-            0,
-            0,
-            nullptr,
-            0,
-            nullptr,
-            1,
-            &imageBarrier
-        );
-        r->commandBufferSubmit();
-
-        VkImageSubresource subresource = {};
-        subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        VkSubresourceLayout layout;
-        vkGetImageSubresourceLayout(r->m_dev, m_images[i].image, &subresource, &layout);
-
-        m_images[i].linesize = layout.rowPitch;
-        VK_CHECK(vkMapMemory(
-            r->m_dev,
-            m_images[i].memory,
-            0,
-            VK_WHOLE_SIZE,
-            0,
-            reinterpret_cast<void**>(&m_images[i].mapped)
-        ));
+        VK_CHECK(vkCreateImageView(r->m_dev, &viewInfo, nullptr, &m_views[i]));
+    }
+
+    // Output images
+    for (Slot& slot : m_slots) {
+        std::vector<OutputImage>& images = slot.images;
+        images.resize(count);
+        for (int i = 0; i < count; ++i) {
+            VkImageCreateInfo imageInfo = {};
+            imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+            imageInfo.imageType = VK_IMAGE_TYPE_2D;
+            imageInfo.format = VK_FORMAT_R8_UNORM;
+            imageInfo.extent.width = imageCreateInfo.extent.width;
+            imageInfo.extent.height = imageCreateInfo.extent.height;
+            imageInfo.extent.depth = 1;
+            imageInfo.arrayLayers = 1;
+            imageInfo.mipLevels = 1;
+            imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+            imageInfo.tiling = VK_IMAGE_TILING_LINEAR;
+            imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+            VK_CHECK(vkCreateImage(r->m_dev, &imageInfo, nullptr, &images[i].image));
+
+            VkMemoryRequirements memReqs;
+            VkMemoryAllocateInfo memAllocInfo {};
+            memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+            vkGetImageMemoryRequirements(r->m_dev, images[i].image, &memReqs);
+            memAllocInfo.allocationSize = memReqs.size;
+
+            memAllocInfo.memoryTypeIndex = hostMemoryTypeIndex(memReqs.memoryTypeBits);
+            VK_CHECK(vkAllocateMemory(r->m_dev, &memAllocInfo, nullptr, &images[i].memory));
+            VK_CHECK(vkBindImageMemory(r->m_dev, images[i].image, images[i].memory, 0));
+
+            VkImageViewCreateInfo viewInfo = {};
+            viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+            viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+            viewInfo.format = imageInfo.format;
+            viewInfo.image = images[i].image;
+            viewInfo.subresourceRange = {};
+            viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            viewInfo.subresourceRange.baseMipLevel = 0;
+            viewInfo.subresourceRange.levelCount = 1;
+            viewInfo.subresourceRange.baseArrayLayer = 0;
+            viewInfo.subresourceRange.layerCount = 1;
+            viewInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+            viewInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+            viewInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+            viewInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+            VK_CHECK(vkCreateImageView(r->m_dev, &viewInfo, nullptr, &images[i].view));
+
+            VkImageMemoryBarrier imageBarrier = {};
+            imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            imageBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            imageBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+            imageBarrier.image = images[i].image;
+            imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            imageBarrier.subresourceRange.layerCount = 1;
+            imageBarrier.subresourceRange.levelCount = 1;
+            imageBarrier.srcAccessMask = 0;
+            imageBarrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+
+            r->commandBufferBegin();
+            vkCmdPipelineBarrier(
+                r->m_commandBuffer,
+                VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                0,
+                0,
+                nullptr,
+                0,
+                nullptr,
+                1,
+                &imageBarrier
+            );
+            r->commandBufferSubmit();
+
+            VkImageSubresource subresource = {};
+            subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            VkSubresourceLayout layout;
+            vkGetImageSubresourceLayout(r->m_dev, images[i].image, &subresource, &layout);
+
+            images[i].linesize = layout.rowPitch;
+            VK_CHECK(vkMapMemory(
+                r->m_dev,
+                images[i].memory,
+                0,
+                VK_WHOLE_SIZE,
+                0,
+                reinterpret_cast<void**>(&images[i].mapped)
+            ));
+        }
     }
 
+    VkSemaphoreTypeCreateInfo timelineInfo = {};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    timelineInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+
     VkSemaphoreCreateInfo semInfo = {};
     semInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semInfo.pNext = &timelineInfo;
     VK_CHECK(vkCreateSemaphore(r->m_dev, &semInfo, nullptr, &m_output.semaphore));
 
     // Shader
@@ -204,25 +223,30 @@ void FormatConverter::init(
     pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
     pipelineInfo.layout = m_pipelineLayout;
     pipelineInfo.stage = stageInfo;
-    VK_CHECK(vkCreateComputePipelines(r->m_dev, nullptr, 1, &pipelineInfo, nullptr, &m_pipeline));
+    VK_CHECK(vkCreateComputePipelines(
+        r->m_dev, r->m_pipelineCache->Get(), 1, &pipelineInfo, nullptr, &m_pipeline
+    ));
 
     m_groupCountX = (imageCreateInfo.extent.width + 7) / 8;
     m_groupCountY = (imageCreateInfo.extent.height + 7) / 8;
 }
 
-void FormatConverter::Convert(uint8_t** data, int* linesize) {
+void FormatConverter::Convert(uint32_t input, uint32_t slot, uint8_t** data, int* linesize) {
+    Slot& target = m_slots[slot];
+    VkCommandBuffer commandBuffer = target.commandBuffer;
+
     VkCommandBufferBeginInfo commandBufferBegin = {};
     commandBufferBegin.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    VK_CHECK(vkBeginCommandBuffer(m_commandBuffer, &commandBufferBegin));
+    VK_CHECK(vkBeginCommandBuffer(commandBuffer, &commandBufferBegin));
 
-    vkCmdResetQueryPool(m_commandBuffer, m_queryPool, 0, 1);
+    vkCmdResetQueryPool(commandBuffer, target.queryPool, 0, 1);
 
-    vkCmdBindPipeline(m_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline);
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline);
 
     std::vector<VkWriteDescriptorSet> descriptorWriteSets;
 
     VkDescriptorImageInfo descriptorImageInfoIn = {};
-    descriptorImageInfoIn.imageView = m_view;
+    descriptorImageInfoIn.imageView = m_views[input];
     descriptorImageInfoIn.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
 
     VkWriteDescriptorSet descriptorWriteSet = {};
@@ -234,8 +258,8 @@ void FormatConverter::Convert(uint8_t** data, int* linesize) {
     descriptorWriteSets.push_back(descriptorWriteSet);
 
     VkDescriptorImageInfo descriptorImageInfoOuts[3] = {};
-    for (size_t i = 0; i < m_images.size(); ++i) {
-        descriptorImageInfoOuts[i].imageView = m_images[i].view;
+    for (size_t i = 0; i < target.images.size(); ++i) {
+        descriptorImageInfoOuts[i].imageView = target.images[i].view;
         descriptorImageInfoOuts[i].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
 
         descriptorWriteSet.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
@@ -246,7 +270,7 @@ void FormatConverter::Convert(uint8_t** data, int* linesize) {
     }
 
     r->d.vkCmdPushDescriptorSetKHR(
-        m_commandBuffer,
+        commandBuffer,
         VK_PIPELINE_BIND_POINT_COMPUTE,
         m_pipelineLayout,
         0,
@@ -254,50 +278,89 @@ void FormatConverter::Convert(uint8_t** data, int* linesize) {
         descriptorWriteSets.data()
     );
 
-    vkCmdDispatch(m_commandBuffer, m_groupCountX, m_groupCountY, 1);
+    vkCmdDispatch(commandBuffer, m_groupCountX, m_groupCountY, 1);
+
+    // Make the writes available to the host once the semaphore is waited on
+    VkMemoryBarrier hostBarrier = {};
+    hostBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    hostBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(
+        commandBuffer,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_PIPELINE_STAGE_HOST_BIT,
+        0,
+        1,
+        &hostBarrier,
+        0,
+        nullptr,
+        0,
+        nullptr
+    );
 
-    vkCmdWriteTimestamp(m_commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_queryPool, 0);
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, target.queryPool, 0);
 
-    vkEndCommandBuffer(m_commandBuffer);
+    vkEndCommandBuffer(commandBuffer);
 
     VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
 
+    m_output.value++;
+    target.value = m_output.value;
+    // The wait semaphore is binary, its value is ignored
+    uint64_t waitValue = 0;
+
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.waitSemaphoreValueCount = 1;
+    timelineInfo.pWaitSemaphoreValues = &waitValue;
+    timelineInfo.signalSemaphoreValueCount = 1;
+    timelineInfo.pSignalSemaphoreValues = &m_output.value;
+
     VkSubmitInfo submitInfo = {};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = &timelineInfo;
     submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = &m_semaphore;
+    submitInfo.pWaitSemaphores = &m_semaphores[input];
     submitInfo.pWaitDstStageMask = &waitStage;
     submitInfo.signalSemaphoreCount = 1;
     submitInfo.pSignalSemaphores = &m_output.semaphore;
     submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &m_commandBuffer;
+    submitInfo.pCommandBuffers = &commandBuffer;
     VK_CHECK(vkQueueSubmit(r->m_queue, 1, &submitInfo, nullptr));
 
-    for (size_t i = 0; i < m_images.size(); ++i) {
-        data[i] = m_images[i].mapped;
-        linesize[i] = m_images[i].linesize;
+    for (size_t i = 0; i < target.images.size(); ++i) {
+        data[i] = target.images[i].mapped;
+        linesize[i] = target.images[i].linesize;
     }
 }
 
-void FormatConverter::Sync() {
-    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = &m_output.semaphore;
-    submitInfo.pWaitDstStageMask = &waitStage;
-    VK_CHECK(vkQueueSubmit(r->m_queue, 1, &submitInfo, r->m_fence));
-
-    VK_CHECK(vkWaitForFences(r->m_dev, 1, &r->m_fence, VK_TRUE, UINT64_MAX));
-    VK_CHECK(vkResetFences(r->m_dev, 1, &r->m_fence));
+void FormatConverter::Sync(uint32_t slot) {
+    // Only the staging images are read on the CPU, wait for the conversion writing them
+    VkSemaphoreWaitInfo waitInfo = {};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &m_output.semaphore;
+    waitInfo.pValues = &m_slots[slot].value;
+    VK_CHECK(vkWaitSemaphores(r->m_dev, &waitInfo, UINT64_MAX));
+
+    if (!m_hostCoherent) {
+        std::vector<VkMappedMemoryRange> ranges;
+        for (const OutputImage& image : m_slots[slot].images) {
+            VkMappedMemoryRange range = {};
+            range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+            range.memory = image.memory;
+            range.size = VK_WHOLE_SIZE;
+            ranges.push_back(range);
+        }
+        VK_CHECK(vkInvalidateMappedMemoryRanges(r->m_dev, ranges.size(), ranges.data()));
+    }
 }
 
-uint64_t FormatConverter::GetTimestamp() {
+uint64_t FormatConverter::GetTimestamp(uint32_t slot) {
     uint64_t query;
     VK_CHECK(vkGetQueryPoolResults(
         r->m_dev,
-        m_queryPool,
+        m_slots[slot].queryPool,
         0,
         1,
         sizeof(uint64_t),
@@ -308,15 +371,51 @@ uint64_t FormatConverter::GetTimestamp() {
     return query * r->m_timestampPeriod;
 }
 
+uint32_t FormatConverter::GetSlotCount() const { return m_slots.size(); }
+
+uint32_t FormatConverter::hostMemoryTypeIndex(uint32_t typeBits) {
+    // The staging images are all alike, pick the type once
+    if (m_hostMemoryType != 0xFFFFFFFF && typeBits & (1 << m_hostMemoryType)) {
+        return m_hostMemoryType;
+    }
+
+    // The encoder reads every byte on the CPU, uncached (usually write-combined) memory would
+    // make that a slow PCIe read. Cached memory that isn't coherent is invalidated in Sync
+    const VkMemoryPropertyFlags preferred[] = {
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT
+            | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+    };
+    for (VkMemoryPropertyFlags properties : preferred) {
+        m_hostMemoryType = r->memoryTypeIndex(properties, typeBits);
+        if (m_hostMemoryType != 0xFFFFFFFF) {
+            m_hostCoherent = properties & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+            return m_hostMemoryType;
+        }
+    }
+
+    Warn("FormatConverter: no host cached memory, the encoder will read uncached memory");
+    m_hostCoherent = true;
+    m_hostMemoryType = r->memoryTypeIndex(
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, typeBits
+    );
+    return m_hostMemoryType;
+}
+
 RgbToYuv420::RgbToYuv420(
-    Renderer* render, VkImage image, VkImageCreateInfo imageInfo, VkSemaphore semaphore
+    Renderer* render,
+    const std::vector<VkImage>& images,
+    VkImageCreateInfo imageInfo,
+    const std::vector<VkSemaphore>& semaphores,
+    uint32_t slots
 )
     : FormatConverter(render) {
     init(
-        image,
+        images,
         imageInfo,
-        semaphore,
+        semaphores,
         3,
+        slots,
         RGBTOYUV420_SHADER_COMP_SPV_PTR,
         RGBTOYUV420_SHADER_COMP_SPV_LEN
     );
@@ -5,18 +5,24 @@
 class FormatConverter {
 public:
     struct Output {
-        VkSemaphore semaphore = VK_NULL_HANDLE;
+        VkSemaphore semaphore = VK_NULL_HANDLE; // timeline, signaled to value once converted
+        uint64_t value = 0;
     };
 
     virtual ~FormatConverter();
 
     Output GetOutput();
 
-    void Convert(uint8_t** data, int* linesize);
+    // Convert the input image at this index, as passed at construction, into the staging images
+    // of a slot. The slot must not be converted again before its data has been consumed
+    void Convert(uint32_t input, uint32_t slot, uint8_t** data, int* linesize);
+
+    // Wait until the last conversion into this slot is readable on the CPU
+    void Sync(uint32_t slot);
 
-    void Sync();
+    uint64_t GetTimestamp(uint32_t slot);
 
-    uint64_t GetTimestamp();
+    uint32_t GetSlotCount() const;
 
 protected:
     struct OutputImage {
@@ -28,34 +34,51 @@ protected:
         uint8_t* mapped = nullptr;
     };
 
+    // One set of persistently mapped staging images per slot, so that the CPU can read one slot
+    // while the GPU writes the next
+    struct Slot {
+        std::vector<OutputImage> images;
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        VkQueryPool queryPool = VK_NULL_HANDLE;
+        uint64_t value = 0;
+    };
+
     explicit FormatConverter(Renderer* render);
     void init(
-        VkImage image,
+        const std::vector<VkImage>& images,
         VkImageCreateInfo imageCreateInfo,
-        VkSemaphore semaphore,
+        const std::vector<VkSemaphore>& semaphores,
         int count,
+        uint32_t slots,
         const unsigned char* shaderData,
         unsigned shaderLen
     );
+    // Host visible memory for the staging images, cached when the device has some
+    uint32_t hostMemoryTypeIndex(uint32_t typeBits);
 
     Renderer* r;
-    VkQueryPool m_queryPool = VK_NULL_HANDLE;
-    VkCommandBuffer m_commandBuffer = VK_NULL_HANDLE;
     VkDescriptorSetLayout m_descriptorLayout = VK_NULL_HANDLE;
-    VkImageView m_view = VK_NULL_HANDLE;
-    VkSemaphore m_semaphore = VK_NULL_HANDLE;
+    std::vector<VkImageView> m_views;
+    std::vector<VkSemaphore> m_semaphores;
     VkShaderModule m_shader = VK_NULL_HANDLE;
     VkPipelineLayout m_pipelineLayout = VK_NULL_HANDLE;
     VkPipeline m_pipeline = VK_NULL_HANDLE;
     uint32_t m_groupCountX = 0;
     uint32_t m_groupCountY = 0;
-    std::vector<OutputImage> m_images;
+    std::vector<Slot> m_slots;
     Output m_output;
+    // False if the staging memory must be invalidated before the CPU reads it
+    bool m_hostCoherent = true;
+    uint32_t m_hostMemoryType = 0xFFFFFFFF;
 };
 
 class RgbToYuv420 : public FormatConverter {
 public:
     explicit RgbToYuv420(
-        Renderer* render, VkImage image, VkImageCreateInfo imageInfo, VkSemaphore semaphore
+        Renderer* render,
+        const std::vector<VkImage>& images,
+        VkImageCreateInfo imageInfo,
+        const std::vector<VkSemaphore>& semaphores,
+        uint32_t slots
     );
 };
@@ -3,15 +3,23 @@
 #include "alvr_server/Settings.h"
 #include "alvr_server/bindings.h"
 
+#define PICOJSON_USE_INT64
+#include "alvr_server/include/picojson.h"
+
+#include <algorithm>
+#include <cmath>
 #include <filesystem>
 #include <fstream>
 
-FrameRender::FrameRender(alvr::VkContext& ctx, init_packet& init, int fds[])
+FrameRender::FrameRender(
+    alvr::VkContext& ctx, init_packet& init, const init_image images[], const int fds[]
+)
     : Renderer(
           ctx.get_vk_instance(),
           ctx.get_vk_device(),
           ctx.get_vk_phys_device(),
           ctx.get_vk_queue_family_index(),
+          ctx.get_vk_queue_index(),
           ctx.get_vk_device_extensions()
       ) {
     m_quadShaderSize = QUAD_SHADER_COMP_SPV_LEN;
@@ -23,13 +31,15 @@ FrameRender::FrameRender(alvr::VkContext& ctx, init_packet& init, int fds[])
         init.image_create_info.format
     );
 
-    for (size_t i = 0; i < 3; ++i) {
-        AddImage(init.image_create_info, init.mem_index, fds[2 * i], fds[2 * i + 1]);
-    }
+    m_inputHandleType = init.memory_handle_type;
+    importImages(init, images, fds);
 
     m_width = Settings::Instance().m_renderWidth;
     m_height = Settings::Instance().m_renderHeight;
 
+    // Left to the video processor of the encoder when it was found to match
+    m_colorCorrection = Settings::Instance().m_enableColorCorrection && ctx.colorFilter.empty();
+
     Info("FrameRender: Input size %ux%u", m_width, m_height);
 
     if (Settings::Instance().m_force_sw_encoding) {
@@ -40,9 +50,12 @@ FrameRender::FrameRender(alvr::VkContext& ctx, init_packet& init, int fds[])
         m_handle = ExternalHandle::OpaqueFd;
     }
 
-    setupCustomShaders("pre");
+    auto preShaders = findCustomShaders("pre");
+    auto postShaders = findCustomShaders("post");
+
+    setupCustomShaders("pre", preShaders);
 
-    if (Settings::Instance().m_enableColorCorrection) {
+    if (m_colorCorrection) {
         setupColorCorrection();
     }
 
@@ -50,16 +63,34 @@ FrameRender::FrameRender(alvr::VkContext& ctx, init_packet& init, int fds[])
         setupFoveatedRendering();
     }
 
-    setupCustomShaders("post");
+    setupCustomShaders("post", postShaders);
 
     if (m_pipelines.empty()) {
+        // The compositor image is passed through to the output with a copy on the GPU rather than
+        // sampled, when the outputs can be written by transfers
+        bool copy = m_width == init.image_create_info.extent.width
+            && m_height == init.image_create_info.extent.height;
+        if (copy) {
+            SetTransferDestinationOutput(true);
+            copy = SupportsOutputFormat(m_format, m_handle);
+            SetTransferDestinationOutput(copy);
+        }
+        if (copy) {
+            Info("FrameRender: Passing the compositor image through");
+        }
+
         RenderPipeline* pipeline = new RenderPipeline(this);
         pipeline->SetShader(QUAD_SHADER_COMP_SPV_PTR, QUAD_SHADER_COMP_SPV_LEN);
+        pipeline->SetName(copy ? "copy" : "quad");
+        pipeline->SetCopy(copy);
         m_pipelines.push_back(pipeline);
         AddPipeline(pipeline);
     }
 
     Info("FrameRender: Output size %ux%u", m_width, m_height);
+
+    // Saved now as well, the driver may be killed before the renderer is destroyed
+    m_pipelineCache->Save();
 }
 
 FrameRender::~FrameRender() {
@@ -68,23 +99,66 @@ FrameRender::~FrameRender() {
     }
 }
 
-FrameRender::Output FrameRender::CreateOutput() {
-    Renderer::CreateOutput(m_width, m_height, m_handle);
-    return GetOutput();
+bool FrameRender::CanReplaceImages(const init_packet& init) const {
+    const VkImageCreateInfo& info = init.image_create_info;
+    return info.extent.width == m_imageSize.width && info.extent.height == m_imageSize.height
+        && info.format == m_format && init.memory_handle_type == m_inputHandleType;
+}
+
+void FrameRender::ReplaceImages(init_packet& init, const init_image images[], const int fds[]) {
+    ClearImages();
+    importImages(init, images, fds);
+}
+
+void FrameRender::importImages(init_packet& init, const init_image images[], const int fds[]) {
+    const bool dmaBuf = init.memory_handle_type == VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+    for (size_t i = 0; i < init.num_images; ++i) {
+        DrmImage drm;
+        drm.fd = fds[2 * i];
+        drm.modifier = images[i].drm_modifier;
+        drm.planes = images[i].plane_count;
+        drm.strides = images[i].plane_strides;
+        drm.offsets = images[i].plane_offsets;
+        AddImage(
+            init.image_create_info,
+            images[i].mem_index,
+            images[i].memory_size,
+            fds[2 * i],
+            fds[2 * i + 1],
+            dmaBuf ? &drm : nullptr
+        );
+    }
+    Info(
+        "FrameRender: %u input images, shared as %s",
+        init.num_images,
+        dmaBuf ? "dma-bufs" : "opaque fds"
+    );
+    if (dmaBuf) {
+        Info(
+            "FrameRender: Input modifier 0x%llx, %u planes",
+            (unsigned long long)images[0].drm_modifier,
+            images[0].plane_count
+        );
+    }
+}
+
+void FrameRender::CreateOutput() {
+    Renderer::CreateOutput(m_width, m_height, m_handle, m_format);
 }
 
 uint32_t FrameRender::GetEncodingWidth() const { return m_width; }
 
 uint32_t FrameRender::GetEncodingHeight() const { return m_height; }
 
-void FrameRender::setupColorCorrection() {
+std::vector<VkSpecializationMapEntry>
+FrameRender::colorCorrectionConstants(uint32_t firstId, uint32_t offset) {
     std::vector<VkSpecializationMapEntry> entries;
 
 #define ENTRY(x, v)                                                                                \
     m_colorCorrectionConstants.x = v;                                                              \
-    entries.push_back(                                                                             \
-        { (uint32_t)entries.size(), offsetof(ColorCorrection, x), sizeof(ColorCorrection::x) }     \
-    );
+    entries.push_back({ firstId + (uint32_t)entries.size(),                                        \
+                        offset + (uint32_t)offsetof(ColorCorrection, x),                           \
+                        sizeof(ColorCorrection::x) });
 
     ENTRY(renderWidth, m_width);
     ENTRY(renderHeight, m_height);
@@ -95,14 +169,20 @@ void FrameRender::setupColorCorrection() {
     ENTRY(sharpening, Settings::Instance().m_sharpening);
 #undef ENTRY
 
+    return entries;
+}
+
+void FrameRender::setupColorCorrection() {
     RenderPipeline* pipeline = new RenderPipeline(this);
     pipeline->SetShader(COLOR_SHADER_COMP_SPV_PTR, COLOR_SHADER_COMP_SPV_LEN);
-    pipeline->SetConstants(&m_colorCorrectionConstants, std::move(entries));
+    pipeline->SetName("color");
+    pipeline->SetConstants(&m_colorCorrectionConstants, colorCorrectionConstants(0, 0));
     m_pipelines.push_back(pipeline);
     AddPipeline(pipeline);
 }
 
-void FrameRender::setupFoveatedRendering() {
+std::vector<VkSpecializationMapEntry>
+FrameRender::foveationConstants(uint32_t firstId, uint32_t offset) {
     float targetEyeWidth = (float)m_width / 2;
     float targetEyeHeight = (float)m_height;
 
@@ -149,9 +229,9 @@ void FrameRender::setupFoveatedRendering() {
 
 #define ENTRY(x, v)                                                                                \
     m_foveatedRenderingConstants.x = v;                                                            \
-    entries.push_back(                                                                             \
-        { (uint32_t)entries.size(), offsetof(FoveationVars, x), sizeof(FoveationVars::x) }         \
-    );
+    entries.push_back({ firstId + (uint32_t)entries.size(),                                        \
+                        offset + (uint32_t)offsetof(FoveationVars, x),                             \
+                        sizeof(FoveationVars::x) });
 
     ENTRY(eyeWidthRatio, eyeWidthRatioAligned);
     ENTRY(eyeHeightRatio, eyeHeightRatioAligned);
@@ -163,33 +243,116 @@ void FrameRender::setupFoveatedRendering() {
     ENTRY(edgeRatioY, edgeRatioY);
 #undef ENTRY
 
+    return entries;
+}
+
+void FrameRender::setupFoveatedRendering() {
     RenderPipeline* pipeline = new RenderPipeline(this);
     pipeline->SetShader(FFR_SHADER_COMP_SPV_PTR, FFR_SHADER_COMP_SPV_LEN);
-    pipeline->SetConstants(&m_foveatedRenderingConstants, std::move(entries));
+    pipeline->SetName("ffr");
+    pipeline->SetConstants(&m_foveatedRenderingConstants, foveationConstants(0, 0));
     m_pipelines.push_back(pipeline);
     AddPipeline(pipeline);
 }
 
-void FrameRender::setupCustomShaders(const std::string& stage) {
-    try {
-        const std::filesystem::path shadersDir
-            = std::filesystem::path(g_sessionPath).replace_filename("shaders");
-        for (const auto& entry :
-             std::filesystem::directory_iterator(shadersDir / std::filesystem::path(stage))) {
-            std::ifstream fs(entry.path(), std::ios::binary | std::ios::in);
-            uint32_t magic = 0;
-            fs.read((char*)&magic, sizeof(uint32_t));
-            if (magic != 0x07230203) {
-                Warn("FrameRender: Shader file %s is not a SPIR-V file", entry.path().c_str());
+namespace {
+bool isSpirv(const std::filesystem::path& path) {
+    std::ifstream fs(path, std::ios::binary | std::ios::in);
+    uint32_t magic = 0;
+    fs.read((char*)&magic, sizeof(uint32_t));
+    if (magic != 0x07230203) {
+        Warn("FrameRender: Shader file %s is not a SPIR-V file", path.c_str());
+        return false;
+    }
+    return true;
+}
+}
+
+std::vector<FrameRender::CustomShader> FrameRender::findCustomShaders(const std::string& stage) {
+    std::vector<CustomShader> shaders;
+    const std::filesystem::path stageDir
+        = std::filesystem::path(g_sessionPath).replace_filename("shaders") / stage;
+
+    // [{ "file": "blur.spv", "scale": 0.5, "format": "rgba16f", "in_place": false }, ...]
+    const std::filesystem::path manifestPath = stageDir / "manifest.json";
+    std::ifstream manifestFile(manifestPath);
+    if (manifestFile) {
+        picojson::value manifest;
+        std::string err = picojson::parse(manifest, manifestFile);
+        if (!err.empty() || !manifest.is<picojson::array>()) {
+            Warn("FrameRender: Ignoring %s: %s", manifestPath.c_str(), err.c_str());
+            return {};
+        }
+        for (auto& entry : manifest.get<picojson::array>()) {
+            if (!entry.is<picojson::object>() || !entry.get("file").is<std::string>()) {
+                Warn("FrameRender: %s entry without file", manifestPath.c_str());
                 continue;
             }
-            Info(
-                "FrameRender: Adding [%s] shader %s", stage.c_str(), entry.path().filename().c_str()
-            );
-            RenderPipeline* pipeline = new RenderPipeline(this);
-            pipeline->SetShader(entry.path().c_str());
-            m_pipelines.push_back(pipeline);
-            AddPipeline(pipeline);
+            CustomShader shader;
+            shader.path = stageDir / entry.get("file").get<std::string>();
+            if (entry.get("scale").is<double>()) {
+                shader.scale = std::clamp((float)entry.get("scale").get<double>(), 0.01f, 1.f);
+            }
+            if (entry.get("format").is<std::string>()) {
+                const std::string& format = entry.get("format").get<std::string>();
+                if (format == "rgba8") {
+                    shader.format = VK_FORMAT_R8G8B8A8_UNORM;
+                } else if (format == "rgba16f") {
+                    shader.format = VK_FORMAT_R16G16B16A16_SFLOAT;
+                } else {
+                    Warn(
+                        "FrameRender: Unknown format %s in %s",
+                        format.c_str(),
+                        manifestPath.c_str()
+                    );
+                }
+            }
+            if (entry.get("in_place").is<bool>()) {
+                shader.inPlace = entry.get("in_place").get<bool>();
+            }
+            if (isSpirv(shader.path)) {
+                shaders.push_back(shader);
+            }
+        }
+        return shaders;
+    }
+
+    try {
+        for (const auto& entry : std::filesystem::directory_iterator(stageDir)) {
+            if (isSpirv(entry.path())) {
+                shaders.push_back({ entry.path() });
+            }
         }
     } catch (...) { }
+    return shaders;
+}
+
+void FrameRender::setupCustomShaders(
+    const std::string& stage, const std::vector<CustomShader>& shaders
+) {
+    for (const auto& shader : shaders) {
+        // Nothing but the external input comes before the first pass
+        if (shader.inPlace && m_pipelines.empty()) {
+            Warn(
+                "FrameRender: [%s] shader %s can't run in place as the first pass, skipping it",
+                stage.c_str(),
+                shader.path.filename().c_str()
+            );
+            continue;
+        }
+        Info(
+            "FrameRender: Adding [%s] shader %s%s",
+            stage.c_str(),
+            shader.path.filename().c_str(),
+            shader.inPlace ? " in place" : ""
+        );
+        RenderPipeline* pipeline = new RenderPipeline(this);
+        pipeline->SetShader(shader.path.c_str());
+        pipeline->SetName(stage + "/" + shader.path.filename().string());
+        pipeline->SetOutputScale(shader.scale);
+        pipeline->SetOutputFormat(shader.format);
+        pipeline->SetInPlace(shader.inPlace);
+        m_pipelines.push_back(pipeline);
+        AddPipeline(pipeline);
+    }
 }
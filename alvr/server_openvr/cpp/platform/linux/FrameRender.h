@@ -4,12 +4,21 @@
 #include "ffmpeg_helper.h"
 #include "protocol.h"
 
+#include <filesystem>
+
 class FrameRender : public Renderer {
 public:
-    explicit FrameRender(alvr::VkContext& ctx, init_packet& init, int fds[]);
+    explicit FrameRender(
+        alvr::VkContext& ctx, init_packet& init, const init_image images[], const int fds[]
+    );
     ~FrameRender();
 
-    Output CreateOutput();
+    // Whether the images of a new connection of the layer can replace the current ones, keeping
+    // the passes and the outputs. They must have the same size, format and handle type
+    bool CanReplaceImages(const init_packet& init) const;
+    void ReplaceImages(init_packet& init, const init_image images[], const int fds[]);
+
+    void CreateOutput();
     uint32_t GetEncodingWidth() const;
     uint32_t GetEncodingHeight() const;
 
@@ -35,13 +44,33 @@ private:
         float edgeRatioY;
     };
 
+    // Fill the constants and return their specialization entries, numbered from firstId and
+    // placed at offset in the specialization data
+    std::vector<VkSpecializationMapEntry>
+    colorCorrectionConstants(uint32_t firstId, uint32_t offset);
+    std::vector<VkSpecializationMapEntry> foveationConstants(uint32_t firstId, uint32_t offset);
+
     void setupColorCorrection();
     void setupFoveatedRendering();
-    void setupCustomShaders(const std::string& stage);
+    // A SPIR-V file of shaders/<stage>, with the options of its manifest.json entry
+    struct CustomShader {
+        std::filesystem::path path;
+        float scale = 1.f;
+        VkFormat format = VK_FORMAT_UNDEFINED;
+        bool inPlace = false;
+    };
+
+    // The files listed by the manifest.json of the stage in its order, or all the SPIR-V files
+    // of the stage at full resolution without one
+    std::vector<CustomShader> findCustomShaders(const std::string& stage);
+    void setupCustomShaders(const std::string& stage, const std::vector<CustomShader>& shaders);
+    void importImages(init_packet& init, const init_image images[], const int fds[]);
 
     uint32_t m_width;
     uint32_t m_height;
     ExternalHandle m_handle = ExternalHandle::None;
+    VkExternalMemoryHandleTypeFlagBits m_inputHandleType;
+    bool m_colorCorrection = false;
     ColorCorrection m_colorCorrectionConstants;
     FoveationVars m_foveatedRenderingConstants;
     std::vector<RenderPipeline*> m_pipelines;
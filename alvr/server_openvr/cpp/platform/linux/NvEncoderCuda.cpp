@@ -0,0 +1,161 @@
+/*
+* Copyright 2017-2022 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#include "NvEncoderCuda.h"
+
+#ifdef ALVR_CUDA_INTEROP
+
+NvEncoderCuda::NvEncoderCuda(CudaFunctions *cu, CUcontext cuContext, uint32_t nWidth, uint32_t nHeight, NV_ENC_BUFFER_FORMAT eBufferFormat,
+    uint32_t nExtraOutputDelay, bool bMotionEstimationOnly, bool bOutputInVideoMemory) :
+    NvEncoder(NV_ENC_DEVICE_TYPE_CUDA, cuContext, nWidth, nHeight, eBufferFormat, nExtraOutputDelay, bMotionEstimationOnly, bOutputInVideoMemory, false, false),
+    m_cu(cu),
+    m_cuContext(cuContext)
+{
+    if (!m_cu || !m_cuContext)
+    {
+        NVENC_THROW_ERROR("Invalid CUDA context", NV_ENC_ERR_INVALID_DEVICE);
+    }
+
+    if (!m_hEncoder)
+    {
+        NVENC_THROW_ERROR("Encoder Initialization failed", NV_ENC_ERR_INVALID_DEVICE);
+    }
+}
+
+NvEncoderCuda::~NvEncoderCuda()
+{
+    ReleaseCudaResources();
+}
+
+void NvEncoderCuda::AllocateInputBuffers(int32_t numInputBuffers)
+{
+    if (!IsHWEncoderInitialized())
+    {
+        NVENC_THROW_ERROR("Encoder intialization failed", NV_ENC_ERR_ENCODER_NOT_INITIALIZED);
+    }
+
+    // for MEOnly mode we need to allocate seperate set of buffers for reference frame
+    int numCount = m_bMotionEstimationOnly ? 2 : 1;
+    for (int count = 0; count < numCount; count++)
+    {
+        alvr::CudaContextScope scope(m_cu, m_cuContext);
+        std::vector<void*> inputFrames;
+        for (int i = 0; i < numInputBuffers; i++)
+        {
+            CUdeviceptr pDeviceFrame;
+            uint32_t chromaHeight = GetNumChromaPlanes(GetPixelFormat()) * GetChromaHeight(GetPixelFormat(), GetMaxEncodeHeight());
+            if (m_cu->cuMemAllocPitch(&pDeviceFrame, &m_cudaPitch, GetWidthInBytes(GetPixelFormat(), GetMaxEncodeWidth()),
+                GetMaxEncodeHeight() + chromaHeight, 16) != CUDA_SUCCESS)
+            {
+                NVENC_THROW_ERROR("Failed to allocate CUDA input buffers", NV_ENC_ERR_OUT_OF_MEMORY);
+            }
+            inputFrames.push_back((void*)pDeviceFrame);
+        }
+        RegisterInputResources(inputFrames, NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR,
+            GetMaxEncodeWidth(), GetMaxEncodeHeight(), (int)m_cudaPitch, GetPixelFormat(), count == 1 ? true : false);
+    }
+}
+
+void NvEncoderCuda::SetIOCudaStream(CUstream stream)
+{
+    // NVENC takes a pointer to the stream, which must stay valid
+    m_ioStream = stream;
+    NV_ENC_CUSTREAM_PTR streamPtr = (NV_ENC_CUSTREAM_PTR)&m_ioStream;
+    NVENC_API_CALL(m_nvenc.nvEncSetIOCudaStreams(m_hEncoder, streamPtr, streamPtr));
+}
+
+void NvEncoderCuda::RegisterExternalBuffers(const std::vector<CUdeviceptr> &buffers, uint32_t pitch)
+{
+    if (!IsHWEncoderInitialized())
+    {
+        NVENC_THROW_ERROR("Encoder intialization failed", NV_ENC_ERR_ENCODER_NOT_INITIALIZED);
+    }
+
+    for (CUdeviceptr buffer : buffers)
+    {
+        m_externalResources.push_back(RegisterResource((void*)buffer, NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR,
+            GetMaxEncodeWidth(), GetMaxEncodeHeight(), pitch, GetPixelFormat(), NV_ENC_INPUT_IMAGE));
+    }
+}
+
+void NvEncoderCuda::SubmitExternalBuffer(uint32_t index, NV_ENC_PIC_PARAMS *pPicParams)
+{
+    if (index >= m_externalResources.size())
+    {
+        NVENC_THROW_ERROR("Buffer was not registered", NV_ENC_ERR_INVALID_PARAM);
+    }
+
+    // SubmitFrame() maps the resource registered for the current input buffer, which is unmapped
+    // through its mapped pointer once retrieved. It can be swapped for this frame only
+    int bfrIdx = m_iToSend % m_nEncoderBuffer;
+    NV_ENC_REGISTERED_PTR inputResource = m_vRegisteredResources[bfrIdx];
+    m_vRegisteredResources[bfrIdx] = m_externalResources[index];
+    try
+    {
+        SubmitFrame(pPicParams);
+    }
+    catch (...)
+    {
+        m_vRegisteredResources[bfrIdx] = inputResource;
+        throw;
+    }
+    m_vRegisteredResources[bfrIdx] = inputResource;
+}
+
+void NvEncoderCuda::ReleaseInputBuffers()
+{
+    ReleaseCudaResources();
+}
+
+void NvEncoderCuda::ReleaseCudaResources()
+{
+    if (!m_hEncoder)
+    {
+        return;
+    }
+
+    if (!m_cuContext)
+    {
+        return;
+    }
+
+    for (NV_ENC_REGISTERED_PTR resource : m_externalResources)
+    {
+        m_nvenc.nvEncUnregisterResource(m_hEncoder, resource);
+    }
+    m_externalResources.clear();
+
+    UnregisterInputResources();
+
+    alvr::CudaContextScope scope(m_cu, m_cuContext);
+
+    for (uint32_t i = 0; i < m_vInputFrames.size(); ++i)
+    {
+        if (m_vInputFrames[i].inputPtr)
+        {
+            m_cu->cuMemFree(reinterpret_cast<CUdeviceptr>(m_vInputFrames[i].inputPtr));
+        }
+    }
+    m_vInputFrames.clear();
+
+    for (uint32_t i = 0; i < m_vReferenceFrames.size(); ++i)
+    {
+        if (m_vReferenceFrames[i].inputPtr)
+        {
+            m_cu->cuMemFree(reinterpret_cast<CUdeviceptr>(m_vReferenceFrames[i].inputPtr));
+        }
+    }
+    m_vReferenceFrames.clear();
+
+    m_cuContext = nullptr;
+}
+
+#endif
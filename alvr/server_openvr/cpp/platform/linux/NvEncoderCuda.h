@@ -0,0 +1,83 @@
+/*
+* Copyright 2017-2022 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include "cuda_helper.h"
+
+#ifdef ALVR_CUDA_INTEROP
+
+#include <vector>
+#include <stdint.h>
+#include "shared/nvenc/NvEncoder.h"
+
+/**
+* @brief Encoder for CUDA device memory, with the driver functions of nv-codec-headers.
+*/
+class NvEncoderCuda : public NvEncoder
+{
+public:
+    NvEncoderCuda(CudaFunctions *cu, CUcontext cuContext, uint32_t nWidth, uint32_t nHeight, NV_ENC_BUFFER_FORMAT eBufferFormat,
+        uint32_t nExtraOutputDelay = 3, bool bMotionEstimationOnly = false, bool bOPInVideoMemory = false);
+    virtual ~NvEncoderCuda();
+
+    /**
+    *  @brief This function is used to make NVENC read the input after the work queued on stream.
+    */
+    void SetIOCudaStream(CUstream stream);
+
+    /**
+    *  @brief This function is used to register pitch linear device buffers the application
+    *  renders into, so that SubmitExternalBuffer() can encode them without copying them to an
+    *  input buffer first.
+    */
+    void RegisterExternalBuffers(const std::vector<CUdeviceptr> &buffers, uint32_t pitch);
+
+    /**
+    *  @brief This function is used to submit the buffer at index of RegisterExternalBuffers()
+    *  in place. The application must not write to it until its output is retrieved with
+    *  GetSubmittedPacket().
+    */
+    void SubmitExternalBuffer(uint32_t index, NV_ENC_PIC_PARAMS *pPicParams = nullptr);
+
+protected:
+    /**
+    *  @brief This function is used to release the input buffers allocated for encoding.
+    *  This function is an override of virtual function NvEncoder::ReleaseInputBuffers().
+    */
+    virtual void ReleaseInputBuffers() override;
+
+private:
+    /**
+    *  @brief This function is used to allocate input buffers for encoding.
+    *  This function is an override of virtual function NvEncoder::AllocateInputBuffers().
+    *  This function allocates pitch linear device memory which is used to accept input data.
+    *  To obtain handle to input buffers application must call NvEncoder::GetNextInputFrame()
+    */
+    virtual void AllocateInputBuffers(int32_t numInputBuffers) override;
+
+private:
+    /**
+    *  @brief This is a private function to release the device memory used for encoding.
+    */
+    void ReleaseCudaResources();
+
+protected:
+    CudaFunctions *m_cu = nullptr;
+    CUcontext m_cuContext = nullptr;
+
+private:
+    size_t m_cudaPitch = 0;
+    CUstream m_ioStream = nullptr;
+    std::vector<NV_ENC_REGISTERED_PTR> m_externalResources;
+};
+
+#endif
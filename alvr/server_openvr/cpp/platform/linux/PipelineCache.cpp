@@ -0,0 +1,94 @@
+#include "PipelineCache.h"
+#include "alvr_server/Logger.h"
+#include "alvr_server/bindings.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+namespace {
+const uint32_t MAGIC = 0x43504c41; // "ALPC"
+}
+
+PipelineCache::PipelineCache(VkDevice dev, VkPhysicalDevice physDev)
+    : m_dev(dev) {
+    VkPhysicalDeviceIDProperties idProps = {};
+    idProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+    VkPhysicalDeviceProperties2 props = {};
+    props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    props.pNext = &idProps;
+    vkGetPhysicalDeviceProperties2(physDev, &props);
+
+    m_header.magic = MAGIC;
+    m_header.driverVersion = props.properties.driverVersion;
+    memcpy(m_header.deviceUUID, idProps.deviceUUID, VK_UUID_SIZE);
+
+    m_path = std::filesystem::path(g_sessionPath)
+                 .replace_filename("vulkan_pipeline_cache.bin")
+                 .string();
+
+    std::vector<char> data;
+    std::ifstream file(m_path, std::ios::binary);
+    if (file) {
+        data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    // The driver checks its own header too, but some crash on data of another device
+    bool valid
+        = data.size() > sizeof(Header) && memcmp(data.data(), &m_header, sizeof(Header)) == 0;
+    if (!data.empty() && !valid) {
+        Info("PipelineCache: GPU or driver changed, discarding %s", m_path.c_str());
+    }
+
+    VkPipelineCacheCreateInfo cacheInfo = {};
+    cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    if (valid) {
+        cacheInfo.initialDataSize = data.size() - sizeof(Header);
+        cacheInfo.pInitialData = data.data() + sizeof(Header);
+        m_savedSize = cacheInfo.initialDataSize;
+    }
+    if (vkCreatePipelineCache(m_dev, &cacheInfo, nullptr, &m_cache) != VK_SUCCESS) {
+        // The pipelines are created without cache
+        m_cache = VK_NULL_HANDLE;
+    }
+}
+
+PipelineCache::~PipelineCache() {
+    Save();
+    vkDestroyPipelineCache(m_dev, m_cache, nullptr);
+}
+
+void PipelineCache::Save() {
+    if (!m_cache) {
+        return;
+    }
+
+    size_t size = 0;
+    if (vkGetPipelineCacheData(m_dev, m_cache, &size, nullptr) != VK_SUCCESS
+        || size <= m_savedSize) {
+        return;
+    }
+    std::vector<char> data(size);
+    if (vkGetPipelineCacheData(m_dev, m_cache, &size, data.data()) != VK_SUCCESS) {
+        return;
+    }
+
+    // Written aside then renamed, so that a crash meanwhile doesn't leave a truncated cache
+    std::string tempPath = m_path + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        file.write((const char*)&m_header, sizeof(Header));
+        file.write(data.data(), size);
+        if (!file) {
+            Warn("PipelineCache: Failed to write %s", tempPath.c_str());
+            return;
+        }
+    }
+    if (rename(tempPath.c_str(), m_path.c_str()) != 0) {
+        Warn("PipelineCache: Failed to replace %s", m_path.c_str());
+        return;
+    }
+    m_savedSize = size;
+}
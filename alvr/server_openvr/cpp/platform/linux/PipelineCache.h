@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+// VkPipelineCache kept on disk next to the session file, so that the compute pipelines aren't
+// compiled again by the driver each time the stream starts. The file is dropped when the GPU or
+// its driver version changes.
+class PipelineCache {
+public:
+    PipelineCache(VkDevice dev, VkPhysicalDevice physDev);
+    // Saves the cache if pipelines were added to it
+    ~PipelineCache();
+
+    VkPipelineCache Get() const { return m_cache; }
+
+    // Writes the cache to disk if it grew since it was loaded or last saved
+    void Save();
+
+private:
+    // Precedes the driver data in the file
+    struct Header {
+        uint32_t magic;
+        uint32_t driverVersion;
+        uint8_t deviceUUID[VK_UUID_SIZE];
+    };
+
+    VkDevice m_dev;
+    VkPipelineCache m_cache = VK_NULL_HANDLE;
+    Header m_header = {};
+    std::string m_path;
+    size_t m_savedSize = 0;
+};
@@ -1,11 +1,29 @@
 #include "Renderer.h"
+#include "alvr_server/FrameCapture.h"
+#include "alvr_server/FrameTrace.h"
+#include "alvr_server/Logger.h"
+#include "alvr_server/PipelineTimings.h"
+#include "alvr_server/TraceCapture.h"
 
 #include <algorithm>
 #include <array>
 #include <cassert>
+#include <cmath>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <linux/dma-buf.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#ifndef DMA_BUF_IOCTL_IMPORT_SYNC_FILE
+struct dma_buf_import_sync_file {
+    __u32 flags;
+    __s32 fd;
+};
+#define DMA_BUF_IOCTL_IMPORT_SYNC_FILE _IOW(DMA_BUF_BASE, 3, struct dma_buf_import_sync_file)
+#endif
 
 #ifndef DRM_FORMAT_INVALID
 #define DRM_FORMAT_INVALID 0
@@ -54,13 +72,15 @@ Renderer::Renderer(
     const VkInstance& inst,
     const VkDevice& dev,
     const VkPhysicalDevice& physDev,
+    uint32_t queueFamilyIdx,
     uint32_t queueIdx,
     const std::vector<const char*>& devExtensions
 )
     : m_inst(inst)
     , m_dev(dev)
     , m_physDev(physDev)
-    , m_queueFamilyIndex(queueIdx) {
+    , m_queueFamilyIndex(queueFamilyIdx)
+    , m_queueIndex(queueIdx) {
     auto checkExtension = [devExtensions](const char* name) {
         return std::find_if(
                    devExtensions.begin(),
@@ -80,40 +100,71 @@ Renderer::Renderer(
 
 #define VK_LOAD_PFN(name) d.name = (PFN_##name)vkGetInstanceProcAddr(m_inst, #name)
     VK_LOAD_PFN(vkImportSemaphoreFdKHR);
+    VK_LOAD_PFN(vkGetSemaphoreFdKHR);
     VK_LOAD_PFN(vkGetMemoryFdKHR);
     VK_LOAD_PFN(vkGetMemoryFdPropertiesKHR);
     VK_LOAD_PFN(vkGetImageDrmFormatModifierPropertiesEXT);
     VK_LOAD_PFN(vkGetCalibratedTimestampsEXT);
+    VK_LOAD_PFN(vkGetPhysicalDeviceCalibrateableTimeDomainsEXT);
     VK_LOAD_PFN(vkCmdPushDescriptorSetKHR);
 #undef VK_LOAD_PFN
 
+    VkPhysicalDeviceExternalSemaphoreInfo semInfo = {};
+    semInfo.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_SEMAPHORE_INFO;
+    semInfo.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+    VkExternalSemaphoreProperties semProps = {};
+    semProps.sType = VK_STRUCTURE_TYPE_EXTERNAL_SEMAPHORE_PROPERTIES;
+    vkGetPhysicalDeviceExternalSemaphoreProperties(m_physDev, &semInfo, &semProps);
+    d.haveSyncFd = d.vkGetSemaphoreFdKHR
+        && (semProps.externalSemaphoreFeatures & VK_EXTERNAL_SEMAPHORE_FEATURE_EXPORTABLE_BIT);
+    d.haveSyncFdImport = d.vkImportSemaphoreFdKHR
+        && (semProps.externalSemaphoreFeatures & VK_EXTERNAL_SEMAPHORE_FEATURE_IMPORTABLE_BIT);
+
     VkPhysicalDeviceProperties props = {};
     vkGetPhysicalDeviceProperties(m_physDev, &props);
     m_timestampPeriod = props.limits.timestampPeriod;
+
+    if (d.haveCalibratedTimestamps && d.vkGetPhysicalDeviceCalibrateableTimeDomainsEXT) {
+        uint32_t domainCount = 0;
+        d.vkGetPhysicalDeviceCalibrateableTimeDomainsEXT(m_physDev, &domainCount, nullptr);
+        std::vector<VkTimeDomainEXT> domains(domainCount);
+        d.vkGetPhysicalDeviceCalibrateableTimeDomainsEXT(m_physDev, &domainCount, domains.data());
+        d.haveMonotonicTimeDomain
+            = std::find(domains.begin(), domains.end(), VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT)
+            != domains.end();
+    }
+
+    m_pipelineCache = std::make_unique<PipelineCache>(m_dev, m_physDev);
 }
 
 Renderer::~Renderer() {
     vkDeviceWaitIdle(m_dev);
 
-    for (const InputImage& image : m_images) {
-        vkDestroyImageView(m_dev, image.view, nullptr);
-        vkDestroyImage(m_dev, image.image, nullptr);
-        vkFreeMemory(m_dev, image.memory, nullptr);
-        vkDestroySemaphore(m_dev, image.semaphore, nullptr);
+    // The writer frees the copies it is given, it must be done before the device goes away
+    for (uint32_t i = 0; i < m_captures.size(); ++i) {
+        collectCaptures(i);
     }
-
-    for (const StagingImage& image : m_stagingImages) {
-        vkDestroyImageView(m_dev, image.view, nullptr);
-        vkDestroyImage(m_dev, image.image, nullptr);
-        vkFreeMemory(m_dev, image.memory, nullptr);
+    m_captureWriter.reset();
+    vkDestroyPipeline(m_dev, m_readbackPipeline, nullptr);
+    vkDestroyPipelineLayout(m_dev, m_readbackPipelineLayout, nullptr);
+    vkDestroyShaderModule(m_dev, m_readbackShader, nullptr);
+
+    destroyImages();
+    destroyStagingImages();
+
+    for (const Output& output : m_outputs) {
+        vkDestroyImageView(m_dev, output.view, nullptr);
+        vkDestroyImage(m_dev, output.image, nullptr);
+        vkFreeMemory(m_dev, output.memory, nullptr);
+        vkDestroySemaphore(m_dev, output.semaphore, nullptr);
     }
 
-    vkDestroyImageView(m_dev, m_output.view, nullptr);
-    vkDestroyImage(m_dev, m_output.image, nullptr);
-    vkFreeMemory(m_dev, m_output.memory, nullptr);
-    vkDestroySemaphore(m_dev, m_output.semaphore, nullptr);
+    for (const Frame& frame : m_frames) {
+        vkDestroyQueryPool(m_dev, frame.queryPool, nullptr);
+        vkDestroyQueryPool(m_dev, frame.pipelineQueryPool, nullptr);
+        vkDestroyFence(m_dev, frame.fence, nullptr);
+    }
 
-    vkDestroyQueryPool(m_dev, m_queryPool, nullptr);
     vkDestroyCommandPool(m_dev, m_commandPool, nullptr);
     vkDestroySampler(m_dev, m_sampler, nullptr);
     vkDestroyDescriptorSetLayout(m_dev, m_descriptorLayout, nullptr);
@@ -125,14 +176,7 @@ void Renderer::Startup(uint32_t width, uint32_t height, VkFormat format) {
     m_imageSize.width = width;
     m_imageSize.height = height;
 
-    vkGetDeviceQueue(m_dev, m_queueFamilyIndex, 0, &m_queue);
-
-    // Timestamp query
-    VkQueryPoolCreateInfo queryPoolInfo = {};
-    queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
-    queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
-    queryPoolInfo.queryCount = 2;
-    VK_CHECK(vkCreateQueryPool(m_dev, &queryPoolInfo, nullptr, &m_queryPool));
+    vkGetDeviceQueue(m_dev, m_queueFamilyIndex, m_queueIndex, &m_queue);
 
     // Command buffer
     VkCommandPoolCreateInfo cmdPoolInfo = {};
@@ -148,6 +192,22 @@ void Renderer::Startup(uint32_t width, uint32_t height, VkFormat format) {
     commandBufferInfo.commandBufferCount = 1;
     VK_CHECK(vkAllocateCommandBuffers(m_dev, &commandBufferInfo, &m_commandBuffer));
 
+    // Per frame resources, so that a frame can be recorded while the previous one is in flight
+    VkQueryPoolCreateInfo queryPoolInfo = {};
+    queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolInfo.queryCount = 2;
+
+    VkFenceCreateInfo frameFenceInfo = {};
+    frameFenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    frameFenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+    for (Frame& frame : m_frames) {
+        VK_CHECK(vkAllocateCommandBuffers(m_dev, &commandBufferInfo, &frame.commandBuffer));
+        VK_CHECK(vkCreateQueryPool(m_dev, &queryPoolInfo, nullptr, &frame.queryPool));
+        VK_CHECK(vkCreateFence(m_dev, &frameFenceInfo, nullptr, &frame.fence));
+    }
+
     // Sampler
     VkSamplerCreateInfo samplerInfo = {};
     samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
@@ -190,18 +250,60 @@ void Renderer::Startup(uint32_t width, uint32_t height, VkFormat format) {
 }
 
 void Renderer::AddImage(
-    VkImageCreateInfo imageInfo, size_t memoryIndex, int imageFd, int semaphoreFd
+    VkImageCreateInfo imageInfo,
+    size_t memoryIndex,
+    VkDeviceSize memorySize,
+    int imageFd,
+    int semaphoreFd,
+    const DrmImage* drm
 ) {
+    const VkExternalMemoryHandleTypeFlagBits handleType = drm
+        ? VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT
+        : VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+    if (drm && (!d.haveDmaBuf || !d.haveDrmModifiers)) {
+        throw std::runtime_error("The layer shares dma-bufs, which this device can't import");
+    }
+
     VkExternalMemoryImageCreateInfo extMemImageInfo = {};
     extMemImageInfo.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
-    extMemImageInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+    extMemImageInfo.handleTypes = handleType;
     imageInfo.pNext = &extMemImageInfo;
     imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    VkSubresourceLayout layouts[4] = {};
+    VkImageDrmFormatModifierExplicitCreateInfoEXT modifierInfo = {};
+    if (drm) {
+        for (uint32_t i = 0; i < drm->planes; ++i) {
+            layouts[i].offset = drm->offsets[i];
+            layouts[i].rowPitch = drm->strides[i];
+        }
+        modifierInfo.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_EXPLICIT_CREATE_INFO_EXT;
+        modifierInfo.drmFormatModifier = drm->modifier;
+        modifierInfo.drmFormatModifierPlaneCount = drm->planes;
+        modifierInfo.pPlaneLayouts = layouts;
+        extMemImageInfo.pNext = &modifierInfo;
+    }
+
     VkImage image;
     VK_CHECK(vkCreateImage(m_dev, &imageInfo, nullptr, &image));
 
     VkMemoryRequirements req;
     vkGetImageMemoryRequirements(m_dev, image, &req);
+    if (req.size != memorySize) {
+        std::cerr << "Input image needs " << req.size << " bytes, the layer allocated "
+                  << memorySize << std::endl;
+    }
+
+    // The memory type of the layer's device may not match ours for a dma-buf, it only has to be
+    // one the fd can be imported to
+    if (drm) {
+        VkMemoryFdPropertiesKHR fdProps = {};
+        fdProps.sType = VK_STRUCTURE_TYPE_MEMORY_FD_PROPERTIES_KHR;
+        VK_CHECK(d.vkGetMemoryFdPropertiesKHR(m_dev, handleType, imageFd, &fdProps));
+        memoryIndex = memoryTypeIndex(
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, req.memoryTypeBits & fdProps.memoryTypeBits
+        );
+    }
 
     VkMemoryDedicatedAllocateInfo dedicatedMemInfo = {};
     dedicatedMemInfo.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
@@ -210,13 +312,13 @@ void Renderer::AddImage(
     VkImportMemoryFdInfoKHR importMemInfo = {};
     importMemInfo.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_FD_INFO_KHR;
     importMemInfo.pNext = &dedicatedMemInfo;
-    importMemInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+    importMemInfo.handleType = handleType;
     importMemInfo.fd = imageFd;
 
     VkMemoryAllocateInfo memAllocInfo = {};
     memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
     memAllocInfo.pNext = &importMemInfo;
-    memAllocInfo.allocationSize = req.size;
+    memAllocInfo.allocationSize = memorySize;
     memAllocInfo.memoryTypeIndex = memoryIndex;
 
     VkDeviceMemory mem;
@@ -259,31 +361,163 @@ void Renderer::AddImage(
     VK_CHECK(vkCreateImageView(m_dev, &viewInfo, nullptr, &view));
 
     m_images.push_back({ image, VK_IMAGE_LAYOUT_UNDEFINED, mem, semaphore, view });
+    resetRecordedRenders();
+}
+
+void Renderer::ClearImages() {
+    // Waits for the renders in flight, the recorded ones reference the images
+    resetRecordedRenders();
+    destroyImages();
+    m_images.clear();
+    resetRecordedRenders();
+}
+
+void Renderer::destroyImages() {
+    for (const InputImage& image : m_images) {
+        vkDestroyImageView(m_dev, image.view, nullptr);
+        vkDestroyImage(m_dev, image.image, nullptr);
+        vkFreeMemory(m_dev, image.memory, nullptr);
+        vkDestroySemaphore(m_dev, image.semaphore, nullptr);
+        vkDestroySemaphore(m_dev, image.syncSemaphore, nullptr);
+    }
 }
 
 void Renderer::AddPipeline(RenderPipeline* pipeline) {
     pipeline->Build();
     m_pipelines.push_back(pipeline);
+    // Before the staging images are replaced, no render may still use them
+    resetRecordedRenders();
+    planPasses();
+
+    VkQueryPoolCreateInfo queryPoolInfo = {};
+    queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolInfo.queryCount = m_pipelines.size() + 1;
+    for (Frame& frame : m_frames) {
+        vkDestroyQueryPool(m_dev, frame.pipelineQueryPool, nullptr);
+        VK_CHECK(vkCreateQueryPool(m_dev, &queryPoolInfo, nullptr, &frame.pipelineQueryPool));
+    }
+
+    std::vector<std::string> names;
+    for (size_t i = 0; i < m_pipelines.size(); ++i) {
+        const std::string& name = m_pipelines[i]->m_name;
+        names.push_back(name.empty() ? "pass " + std::to_string(i) : name);
+    }
+    PipelineTimings::Instance().Reset(names);
+}
 
-    if (m_pipelines.size() > 1 && m_stagingImages.size() < 2) {
-        addStagingImage(m_imageSize.width, m_imageSize.height);
+void Renderer::CreateOutput(
+    uint32_t width, uint32_t height, ExternalHandle handle, VkFormat format
+) {
+    for (Output& output : m_outputs) {
+        createOutput(output, width, height, handle, format);
     }
+    resetRecordedRenders();
 }
 
-void Renderer::CreateOutput(uint32_t width, uint32_t height, ExternalHandle handle) {
-    m_output.imageInfo = {};
-    m_output.imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    m_output.imageInfo.imageType = VK_IMAGE_TYPE_2D;
-    m_output.imageInfo.format = m_format;
-    m_output.imageInfo.extent.width = width;
-    m_output.imageInfo.extent.height = height;
-    m_output.imageInfo.extent.depth = 1;
-    m_output.imageInfo.mipLevels = 1;
-    m_output.imageInfo.arrayLayers = 1;
-    m_output.imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-    m_output.imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
-    m_output.imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    m_output.imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+bool Renderer::SupportsOutputFormat(VkFormat format, ExternalHandle handle) {
+    VkImageCreateInfo imageInfo = outputImageInfo(1, 1, format);
+    if (d.haveDrmModifiers && handle == ExternalHandle::DmaBuf) {
+        std::vector<VkDrmFormatModifierPropertiesEXT> modifierProps;
+        imageInfo.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+        return !outputModifiers(imageInfo, modifierProps).empty();
+    }
+
+    VkPhysicalDeviceImageFormatInfo2 formatInfo = {};
+    formatInfo.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
+    formatInfo.format = imageInfo.format;
+    formatInfo.type = imageInfo.imageType;
+    formatInfo.tiling = d.haveDmaBuf && handle == ExternalHandle::DmaBuf
+        ? VK_IMAGE_TILING_LINEAR
+        : VK_IMAGE_TILING_OPTIMAL;
+    formatInfo.usage = imageInfo.usage;
+    formatInfo.flags = imageInfo.flags;
+
+    VkImageFormatProperties2 props = {};
+    props.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
+    return vkGetPhysicalDeviceImageFormatProperties2(m_physDev, &formatInfo, &props) == VK_SUCCESS;
+}
+
+VkImageCreateInfo
+Renderer::outputImageInfo(uint32_t width, uint32_t height, VkFormat format) const {
+    VkImageCreateInfo imageInfo = {};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = format;
+    imageInfo.extent.width = width;
+    imageInfo.extent.height = height;
+    imageInfo.extent.depth = 1;
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    if (m_transferDestinationOutput) {
+        imageInfo.usage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    }
+    return imageInfo;
+}
+
+std::vector<uint64_t> Renderer::outputModifiers(
+    const VkImageCreateInfo& imageInfo, std::vector<VkDrmFormatModifierPropertiesEXT>& modifierProps
+) {
+    VkDrmFormatModifierPropertiesListEXT modifierPropsList = {};
+    modifierPropsList.sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT;
+
+    VkFormatProperties2 formatProps = {};
+    formatProps.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
+    formatProps.pNext = &modifierPropsList;
+    vkGetPhysicalDeviceFormatProperties2(m_physDev, imageInfo.format, &formatProps);
+
+    modifierProps.resize(modifierPropsList.drmFormatModifierCount);
+    modifierPropsList.pDrmFormatModifierProperties = modifierProps.data();
+    vkGetPhysicalDeviceFormatProperties2(m_physDev, imageInfo.format, &formatProps);
+
+    std::vector<uint64_t> imageModifiers;
+    std::cout << "Available modifiers:" << std::endl;
+    for (const VkDrmFormatModifierPropertiesEXT& prop : modifierProps) {
+        std::cout << "modifier: " << prop.drmFormatModifier
+                  << " planes: " << prop.drmFormatModifierPlaneCount << std::endl;
+        if (!filter_modifier(prop.drmFormatModifier)
+            || (m_crossDeviceOutput && prop.drmFormatModifier != DRM_FORMAT_MOD_LINEAR)) {
+            std::cout << " filtered" << std::endl;
+            continue;
+        }
+
+        VkPhysicalDeviceImageDrmFormatModifierInfoEXT modInfo = {};
+        modInfo.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT;
+        modInfo.drmFormatModifier = prop.drmFormatModifier;
+        modInfo.sharingMode = imageInfo.sharingMode;
+        modInfo.queueFamilyIndexCount = imageInfo.queueFamilyIndexCount;
+        modInfo.pQueueFamilyIndices = imageInfo.pQueueFamilyIndices;
+
+        VkPhysicalDeviceImageFormatInfo2 formatInfo = {};
+        formatInfo.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
+        formatInfo.pNext = &modInfo;
+        formatInfo.format = imageInfo.format;
+        formatInfo.type = imageInfo.imageType;
+        formatInfo.tiling = imageInfo.tiling;
+        formatInfo.usage = imageInfo.usage;
+        formatInfo.flags = imageInfo.flags;
+
+        VkImageFormatProperties2 imageFormatProps = {};
+        imageFormatProps.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
+        imageFormatProps.pNext = NULL;
+
+        VkResult r
+            = vkGetPhysicalDeviceImageFormatProperties2(m_physDev, &formatInfo, &imageFormatProps);
+        if (r == VK_SUCCESS) {
+            imageModifiers.push_back(prop.drmFormatModifier);
+        }
+    }
+    return imageModifiers;
+}
+
+void Renderer::createOutput(
+    Output& output, uint32_t width, uint32_t height, ExternalHandle handle, VkFormat format
+) {
+    output.imageInfo = outputImageInfo(width, height, format);
 
     std::vector<VkDrmFormatModifierPropertiesEXT> modifierProps;
 
@@ -294,80 +528,32 @@ void Renderer::CreateOutput(uint32_t width, uint32_t height, ExternalHandle hand
         VkImageDrmFormatModifierListCreateInfoEXT modifierListInfo = {};
         modifierListInfo.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_LIST_CREATE_INFO_EXT;
 
-        m_output.imageInfo.pNext = &modifierListInfo;
-        m_output.imageInfo.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
-
-        VkDrmFormatModifierPropertiesListEXT modifierPropsList = {};
-        modifierPropsList.sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT;
-
-        VkFormatProperties2 formatProps = {};
-        formatProps.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
-        formatProps.pNext = &modifierPropsList;
-        vkGetPhysicalDeviceFormatProperties2(m_physDev, m_output.imageInfo.format, &formatProps);
-
-        modifierProps.resize(modifierPropsList.drmFormatModifierCount);
-        modifierPropsList.pDrmFormatModifierProperties = modifierProps.data();
-        vkGetPhysicalDeviceFormatProperties2(m_physDev, m_output.imageInfo.format, &formatProps);
+        output.imageInfo.pNext = &modifierListInfo;
+        output.imageInfo.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
 
-        std::vector<uint64_t> imageModifiers;
-        std::cout << "Available modifiers:" << std::endl;
-        for (const VkDrmFormatModifierPropertiesEXT& prop : modifierProps) {
-            std::cout << "modifier: " << prop.drmFormatModifier
-                      << " planes: " << prop.drmFormatModifierPlaneCount << std::endl;
-            if (!filter_modifier(prop.drmFormatModifier)) {
-                std::cout << " filtered" << std::endl;
-                continue;
-            }
-
-            VkPhysicalDeviceImageDrmFormatModifierInfoEXT modInfo = {};
-            modInfo.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT;
-            modInfo.drmFormatModifier = prop.drmFormatModifier;
-            modInfo.sharingMode = m_output.imageInfo.sharingMode;
-            modInfo.queueFamilyIndexCount = m_output.imageInfo.queueFamilyIndexCount;
-            modInfo.pQueueFamilyIndices = m_output.imageInfo.pQueueFamilyIndices;
-
-            VkPhysicalDeviceImageFormatInfo2 formatInfo = {};
-            formatInfo.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
-            formatInfo.pNext = &modInfo;
-            formatInfo.format = m_output.imageInfo.format;
-            formatInfo.type = m_output.imageInfo.imageType;
-            formatInfo.tiling = m_output.imageInfo.tiling;
-            formatInfo.usage = m_output.imageInfo.usage;
-            formatInfo.flags = m_output.imageInfo.flags;
-
-            VkImageFormatProperties2 imageFormatProps = {};
-            imageFormatProps.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
-            imageFormatProps.pNext = NULL;
-
-            VkResult r = vkGetPhysicalDeviceImageFormatProperties2(
-                m_physDev, &formatInfo, &imageFormatProps
-            );
-            if (r == VK_SUCCESS) {
-                imageModifiers.push_back(prop.drmFormatModifier);
-            }
-        }
+        std::vector<uint64_t> imageModifiers = outputModifiers(output.imageInfo, modifierProps);
         modifierListInfo.drmFormatModifierCount = imageModifiers.size();
         modifierListInfo.pDrmFormatModifiers = imageModifiers.data();
 
         extMemImageInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
         modifierListInfo.pNext = &extMemImageInfo;
 
-        VK_CHECK(vkCreateImage(m_dev, &m_output.imageInfo, nullptr, &m_output.image));
+        VK_CHECK(vkCreateImage(m_dev, &output.imageInfo, nullptr, &output.image));
     } else if (d.haveDmaBuf && handle == ExternalHandle::DmaBuf) {
         extMemImageInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
-        m_output.imageInfo.pNext = &extMemImageInfo;
+        output.imageInfo.pNext = &extMemImageInfo;
 
-        m_output.imageInfo.tiling = VK_IMAGE_TILING_LINEAR;
-        VK_CHECK(vkCreateImage(m_dev, &m_output.imageInfo, nullptr, &m_output.image));
+        output.imageInfo.tiling = VK_IMAGE_TILING_LINEAR;
+        VK_CHECK(vkCreateImage(m_dev, &output.imageInfo, nullptr, &output.image));
     } else if (handle == ExternalHandle::OpaqueFd) {
         extMemImageInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
-        m_output.imageInfo.pNext = &extMemImageInfo;
+        output.imageInfo.pNext = &extMemImageInfo;
 
-        m_output.imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-        VK_CHECK(vkCreateImage(m_dev, &m_output.imageInfo, nullptr, &m_output.image));
+        output.imageInfo.tiling = m_linearOutput ? VK_IMAGE_TILING_LINEAR : VK_IMAGE_TILING_OPTIMAL;
+        VK_CHECK(vkCreateImage(m_dev, &output.imageInfo, nullptr, &output.image));
     } else {
-        m_output.imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-        VK_CHECK(vkCreateImage(m_dev, &m_output.imageInfo, nullptr, &m_output.image));
+        output.imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        VK_CHECK(vkCreateImage(m_dev, &output.imageInfo, nullptr, &output.image));
     }
 
     VkMemoryDedicatedRequirements mdr = {};
@@ -379,9 +565,9 @@ void Renderer::CreateOutput(uint32_t width, uint32_t height, ExternalHandle hand
 
     VkImageMemoryRequirementsInfo2 memoryReqsInfo = {};
     memoryReqsInfo.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
-    memoryReqsInfo.image = m_output.image;
+    memoryReqsInfo.image = output.image;
     vkGetImageMemoryRequirements2(m_dev, &memoryReqsInfo, &memoryReqs);
-    m_output.size = memoryReqs.memoryRequirements.size;
+    output.size = memoryReqs.memoryRequirements.size;
 
     VkExportMemoryAllocateInfo memory_export_info = {};
     memory_export_info.sType = VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO;
@@ -389,7 +575,7 @@ void Renderer::CreateOutput(uint32_t width, uint32_t height, ExternalHandle hand
 
     VkMemoryDedicatedAllocateInfo memory_dedicated_info = {};
     memory_dedicated_info.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
-    memory_dedicated_info.image = m_output.image;
+    memory_dedicated_info.image = output.image;
     if (handle != ExternalHandle::None) {
         memory_dedicated_info.pNext = &memory_export_info;
     }
@@ -401,46 +587,52 @@ void Renderer::CreateOutput(uint32_t width, uint32_t height, ExternalHandle hand
     memi.memoryTypeIndex = memoryTypeIndex(
         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, memoryReqs.memoryRequirements.memoryTypeBits
     );
-    VK_CHECK(vkAllocateMemory(m_dev, &memi, nullptr, &m_output.memory));
+    VK_CHECK(vkAllocateMemory(m_dev, &memi, nullptr, &output.memory));
 
     VkBindImageMemoryInfo bimi = {};
     bimi.sType = VK_STRUCTURE_TYPE_BIND_IMAGE_MEMORY_INFO;
-    bimi.image = m_output.image;
-    bimi.memory = m_output.memory;
+    bimi.image = output.image;
+    bimi.memory = output.memory;
     bimi.memoryOffset = 0;
     VK_CHECK(vkBindImageMemory2(m_dev, 1, &bimi));
 
+    if (handle == ExternalHandle::OpaqueFd && output.imageInfo.tiling == VK_IMAGE_TILING_LINEAR) {
+        VkImageSubresource subresource = {};
+        subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        vkGetImageSubresourceLayout(m_dev, output.image, &subresource, &output.linearLayout);
+    }
+
     // DRM export
     if (d.haveDmaBuf) {
         VkMemoryGetFdInfoKHR memoryGetFdInfo = {};
         memoryGetFdInfo.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR;
-        memoryGetFdInfo.memory = m_output.memory;
+        memoryGetFdInfo.memory = output.memory;
         memoryGetFdInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
-        VkResult res = d.vkGetMemoryFdKHR(m_dev, &memoryGetFdInfo, &m_output.drm.fd);
+        VkResult res = d.vkGetMemoryFdKHR(m_dev, &memoryGetFdInfo, &output.drm.fd);
         if (res != VK_SUCCESS) {
             std::cout << "vkGetMemoryFdKHR " << result_to_str(res) << std::endl;
         } else {
             if (d.haveDrmModifiers) {
                 VkImageDrmFormatModifierPropertiesEXT imageDrmProps = {};
                 imageDrmProps.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_PROPERTIES_EXT;
-                d.vkGetImageDrmFormatModifierPropertiesEXT(m_dev, m_output.image, &imageDrmProps);
+                d.vkGetImageDrmFormatModifierPropertiesEXT(m_dev, output.image, &imageDrmProps);
                 if (res != VK_SUCCESS) {
                     std::cout << "vkGetImageDrmFormatModifierPropertiesEXT " << result_to_str(res)
                               << std::endl;
                 } else {
-                    m_output.drm.modifier = imageDrmProps.drmFormatModifier;
+                    output.drm.modifier = imageDrmProps.drmFormatModifier;
                     for (VkDrmFormatModifierPropertiesEXT prop : modifierProps) {
-                        if (prop.drmFormatModifier == m_output.drm.modifier) {
-                            m_output.drm.planes = prop.drmFormatModifierPlaneCount;
+                        if (prop.drmFormatModifier == output.drm.modifier) {
+                            output.drm.planes = prop.drmFormatModifierPlaneCount;
                         }
                     }
                 }
             } else {
-                m_output.drm.modifier = DRM_FORMAT_MOD_INVALID;
-                m_output.drm.planes = 1;
+                output.drm.modifier = DRM_FORMAT_MOD_INVALID;
+                output.drm.planes = 1;
             }
 
-            for (uint32_t i = 0; i < m_output.drm.planes; i++) {
+            for (uint32_t i = 0; i < output.drm.planes; i++) {
                 VkImageSubresource subresource = {};
                 if (d.haveDrmModifiers) {
                     subresource.aspectMask = VK_IMAGE_ASPECT_MEMORY_PLANE_0_BIT_EXT << i;
@@ -448,48 +640,86 @@ void Renderer::CreateOutput(uint32_t width, uint32_t height, ExternalHandle hand
                     subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
                 }
                 VkSubresourceLayout layout;
-                vkGetImageSubresourceLayout(m_dev, m_output.image, &subresource, &layout);
-                m_output.drm.strides[i] = layout.rowPitch;
-                m_output.drm.offsets[i] = layout.offset;
+                vkGetImageSubresourceLayout(m_dev, output.image, &subresource, &layout);
+                output.drm.strides[i] = layout.rowPitch;
+                output.drm.offsets[i] = layout.offset;
             }
         }
-        m_output.drm.format = to_drm_format(m_output.imageInfo.format);
+        output.drm.format = to_drm_format(output.imageInfo.format);
     }
 
-    VkImageViewCreateInfo viewInfo = {};
-    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    viewInfo.format = m_output.imageInfo.format;
-    viewInfo.image = m_output.image;
-    viewInfo.subresourceRange = {};
-    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    viewInfo.subresourceRange.baseMipLevel = 0;
-    viewInfo.subresourceRange.levelCount = 1;
-    viewInfo.subresourceRange.baseArrayLayer = 0;
-    viewInfo.subresourceRange.layerCount = 1;
-    viewInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
-    viewInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-    viewInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-    viewInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-    VK_CHECK(vkCreateImageView(m_dev, &viewInfo, nullptr, &m_output.view));
+    createOutputViews(output);
+
+    // Binary semaphore, only those can be exported as a sync_file
+    VkExportSemaphoreCreateInfo exportSemInfo = {};
+    exportSemInfo.sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO;
+    exportSemInfo.handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
 
     VkSemaphoreCreateInfo semInfo = {};
     semInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-    VK_CHECK(vkCreateSemaphore(m_dev, &semInfo, nullptr, &m_output.semaphore));
+    if (d.haveSyncFd) {
+        semInfo.pNext = &exportSemInfo;
+    }
+    VK_CHECK(vkCreateSemaphore(m_dev, &semInfo, nullptr, &output.semaphore));
 }
 
-void Renderer::ImportOutput(const DrmImage& drm) {
-    vkDestroyImageView(m_dev, m_output.view, nullptr);
-    vkDestroyImage(m_dev, m_output.image, nullptr);
-    vkFreeMemory(m_dev, m_output.memory, nullptr);
+bool Renderer::CanImportOutput(const DrmImage& drm) {
+    if (!d.haveDmaBuf || !d.haveDrmModifiers) {
+        return false;
+    }
+    if (m_crossDeviceOutput && drm.modifier != DRM_FORMAT_MOD_LINEAR) {
+        return false;
+    }
 
-    m_output.drm = drm;
-    m_output.imageInfo.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+    VkPhysicalDeviceImageDrmFormatModifierInfoEXT modifierInfo = {};
+    modifierInfo.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT;
+    modifierInfo.drmFormatModifier = drm.modifier;
+    modifierInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VkPhysicalDeviceExternalImageFormatInfo externalInfo = {};
+    externalInfo.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_IMAGE_FORMAT_INFO;
+    externalInfo.pNext = &modifierInfo;
+    externalInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+
+    VkPhysicalDeviceImageFormatInfo2 formatInfo = {};
+    formatInfo.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
+    formatInfo.pNext = &externalInfo;
+    formatInfo.format = m_outputs[0].imageInfo.format;
+    formatInfo.type = VK_IMAGE_TYPE_2D;
+    formatInfo.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+    formatInfo.usage = m_outputs[0].imageInfo.usage;
+    formatInfo.flags = m_outputs[0].imageInfo.flags;
+
+    VkExternalImageFormatProperties externalProps = {};
+    externalProps.sType = VK_STRUCTURE_TYPE_EXTERNAL_IMAGE_FORMAT_PROPERTIES;
+
+    VkImageFormatProperties2 props = {};
+    props.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
+    props.pNext = &externalProps;
+
+    if (vkGetPhysicalDeviceImageFormatProperties2(m_physDev, &formatInfo, &props) != VK_SUCCESS) {
+        return false;
+    }
+    return externalProps.externalMemoryProperties.externalMemoryFeatures
+        & VK_EXTERNAL_MEMORY_FEATURE_IMPORTABLE_BIT;
+}
+
+void Renderer::ImportOutput(uint32_t index, const DrmImage& drm) {
+    // The recorded renders use the image replaced here, they wait for it to be idle
+    resetRecordedRenders();
+    Output& output = m_outputs[index];
+
+    vkDestroyImageView(m_dev, output.view, nullptr);
+    vkDestroyImage(m_dev, output.image, nullptr);
+    vkFreeMemory(m_dev, output.memory, nullptr);
+
+    output.drm = drm;
+    output.imageInfo.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
 
     VkExternalMemoryImageCreateInfo extMemImageInfo = {};
     extMemImageInfo.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
     extMemImageInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
-    m_output.imageInfo.pNext = &extMemImageInfo;
+    output.imageInfo.pNext = &extMemImageInfo;
 
     VkSubresourceLayout layouts[4] = {};
     for (uint32_t i = 0; i < drm.planes; ++i) {
@@ -503,7 +733,7 @@ void Renderer::ImportOutput(const DrmImage& drm) {
     modifierInfo.pPlaneLayouts = layouts;
     extMemImageInfo.pNext = &modifierInfo;
 
-    VK_CHECK(vkCreateImage(m_dev, &m_output.imageInfo, NULL, &m_output.image));
+    VK_CHECK(vkCreateImage(m_dev, &output.imageInfo, NULL, &output.image));
 
     VkMemoryFdPropertiesKHR fdProps = {};
     fdProps.sType = VK_STRUCTURE_TYPE_MEMORY_FD_PROPERTIES_KHR;
@@ -512,7 +742,7 @@ void Renderer::ImportOutput(const DrmImage& drm) {
     ));
 
     VkImageMemoryRequirementsInfo2 memoryReqsInfo = {};
-    memoryReqsInfo.image = m_output.image;
+    memoryReqsInfo.image = output.image;
     memoryReqsInfo.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
 
     VkMemoryRequirements2 memoryReqs = {};
@@ -528,29 +758,34 @@ void Renderer::ImportOutput(const DrmImage& drm) {
 
     VkImportMemoryFdInfoKHR importMemInfo = {};
     importMemInfo.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_FD_INFO_KHR;
-    importMemInfo.fd = drm.fd;
+    // The import takes ownership of the fd, keep ours to attach fences to the buffer
+    importMemInfo.fd = dup(drm.fd);
     importMemInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
     memoryAllocInfo.pNext = &importMemInfo;
 
     VkMemoryDedicatedAllocateInfo dedicatedMemInfo = {};
     dedicatedMemInfo.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
-    dedicatedMemInfo.image = m_output.image;
+    dedicatedMemInfo.image = output.image;
     importMemInfo.pNext = &dedicatedMemInfo;
 
-    VK_CHECK(vkAllocateMemory(m_dev, &memoryAllocInfo, NULL, &m_output.memory));
+    VK_CHECK(vkAllocateMemory(m_dev, &memoryAllocInfo, NULL, &output.memory));
 
     VkBindImageMemoryInfo bindInfo = {};
     bindInfo.sType = VK_STRUCTURE_TYPE_BIND_IMAGE_MEMORY_INFO;
-    bindInfo.image = m_output.image;
-    bindInfo.memory = m_output.memory;
+    bindInfo.image = output.image;
+    bindInfo.memory = output.memory;
     bindInfo.memoryOffset = 0;
     VK_CHECK(vkBindImageMemory2(m_dev, 1, &bindInfo));
 
+    createOutputViews(output);
+}
+
+void Renderer::createOutputViews(Output& output) {
     VkImageViewCreateInfo viewInfo = {};
     viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
     viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    viewInfo.format = m_output.imageInfo.format;
-    viewInfo.image = m_output.image;
+    viewInfo.format = output.imageInfo.format;
+    viewInfo.image = output.image;
     viewInfo.subresourceRange = {};
     viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     viewInfo.subresourceRange.baseMipLevel = 0;
@@ -561,37 +796,98 @@ void Renderer::ImportOutput(const DrmImage& drm) {
     viewInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
     viewInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
     viewInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-    VK_CHECK(vkCreateImageView(m_dev, &viewInfo, nullptr, &m_output.view));
+    VK_CHECK(vkCreateImageView(m_dev, &viewInfo, nullptr, &output.view));
 }
 
-void Renderer::Render(uint32_t index, uint64_t waitValue) {
-    if (!m_inputImageCapture.empty()) {
-        VkSemaphoreWaitInfo waitInfo = {};
-        waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
-        waitInfo.semaphoreCount = 1;
-        waitInfo.pSemaphores = &m_images[index].semaphore;
-        waitInfo.pValues = &waitValue;
-        VK_CHECK(vkWaitSemaphores(m_dev, &waitInfo, UINT64_MAX));
-
-        dumpImage(
-            m_images[index].image,
-            m_images[index].view,
-            m_images[index].layout,
-            m_imageSize.width,
-            m_imageSize.height,
-            m_inputImageCapture
-        );
-        m_inputImageCapture.clear();
+uint32_t Renderer::Render(uint32_t index, uint64_t waitValue, int syncFd) {
+    TraceScope scope("Renderer::Render");
+    const bool waitSyncFd = syncFd >= 0 && importSyncFd(m_images[index], syncFd);
+    const uint32_t frameIndex = m_frameIndex;
+    m_frameIndex = (m_frameIndex + 1) % m_frames.size();
+    Frame& frame = m_frames[frameIndex];
+    Output& output = m_outputs[frameIndex];
+
+    // Normally already signaled, the slot is reused only once its frame has been consumed
+    VK_CHECK(vkWaitForFences(m_dev, 1, &frame.fence, VK_TRUE, UINT64_MAX));
+    collectCaptures(frameIndex);
+    VK_CHECK(vkResetFences(m_dev, 1, &frame.fence));
+
+    // The layouts of the images are the same at every render of an input by a slot but the
+    // first, so the commands recorded at the second one are submitted as is from then on.
+    // Captures need the commands recorded anew
+    const bool capture = !m_inputImageCapture.empty() || !m_outputImageCapture.empty();
+    VkCommandBuffer commandBuffer = frame.commandBuffer;
+    if (!capture) {
+        RecordedRender& recorded = m_recordedRenders[index * m_frames.size() + frameIndex];
+        if (recorded.commandBuffer == VK_NULL_HANDLE && recorded.settled) {
+            VkCommandBufferAllocateInfo commandBufferInfo = {};
+            commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            commandBufferInfo.commandPool = m_commandPool;
+            commandBufferInfo.commandBufferCount = 1;
+            VK_CHECK(vkAllocateCommandBuffers(m_dev, &commandBufferInfo, &recorded.commandBuffer));
+            recordRender(recorded.commandBuffer, index, frameIndex);
+        } else if (recorded.commandBuffer == VK_NULL_HANDLE) {
+            recordRender(frame.commandBuffer, index, frameIndex);
+            recorded.settled = true;
+        }
+        if (recorded.commandBuffer != VK_NULL_HANDLE) {
+            commandBuffer = recorded.commandBuffer;
+        }
+    } else {
+        recordRender(frame.commandBuffer, index, frameIndex);
     }
 
+    std::array<VkSemaphore, 2> waitSemaphores = {
+        waitSyncFd ? m_images[index].syncSemaphore : m_images[index].semaphore,
+        output.releaseSemaphore,
+    };
+    std::array<uint64_t, 2> waitValues = { waitValue, output.releaseValue };
+    // The copy pass reads the input and writes the output in the transfer stage
+    const VkPipelineStageFlags passStages
+        = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+    std::array<VkPipelineStageFlags, 2> waitStages = { passStages, passStages };
+    const uint32_t waitCount = output.releaseSemaphore != VK_NULL_HANDLE ? 2 : 1;
+
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.waitSemaphoreValueCount = waitCount;
+    timelineInfo.pWaitSemaphoreValues = waitValues.data();
+
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = &timelineInfo;
+    submitInfo.waitSemaphoreCount = waitCount;
+    submitInfo.pWaitSemaphores = waitSemaphores.data();
+    submitInfo.pWaitDstStageMask = waitStages.data();
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &output.semaphore;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+    VK_CHECK(vkQueueSubmit(m_queue, 1, &submitInfo, frame.fence));
+
+    return frameIndex;
+}
+
+void Renderer::recordRender(
+    VkCommandBuffer commandBuffer, uint32_t index, uint32_t frameIndex
+) {
+    const Frame& frame = m_frames[frameIndex];
+    Output& output = m_outputs[frameIndex];
+
     VkCommandBufferBeginInfo commandBufferBegin = {};
     commandBufferBegin.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    VK_CHECK(vkBeginCommandBuffer(m_commandBuffer, &commandBufferBegin));
+    VK_CHECK(vkBeginCommandBuffer(commandBuffer, &commandBufferBegin));
 
-    vkCmdResetQueryPool(m_commandBuffer, m_queryPool, 0, 2);
-    vkCmdWriteTimestamp(m_commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_queryPool, 0);
+    vkCmdResetQueryPool(commandBuffer, frame.queryPool, 0, 2);
+    vkCmdResetQueryPool(commandBuffer, frame.pipelineQueryPool, 0, m_pipelines.size() + 1);
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame.queryPool, 0);
 
     for (size_t i = 0; i < m_pipelines.size(); ++i) {
+        const bool inPlace = i > 0 && m_pipelines[i]->m_inPlace;
+        const bool copy = m_pipelines[i]->m_copy;
+        const VkPipelineStageFlags stage
+            = copy ? VK_PIPELINE_STAGE_TRANSFER_BIT : VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
         VkRect2D rect = {};
         VkImage in = VK_NULL_HANDLE;
         VkImageView inView = VK_NULL_HANDLE;
@@ -604,97 +900,204 @@ void Renderer::Render(uint32_t index, uint64_t waitValue) {
             in = img.image;
             inView = img.view;
             inLayout = &img.layout;
+        } else if (m_passTargets[i - 1] == OutputTarget) {
+            in = output.image;
+            inView = output.view;
+            inLayout = &output.layout;
         } else {
-            auto& img = m_stagingImages[(i - 1) % m_stagingImages.size()];
+            auto& img = m_stagingImages[m_passTargets[i - 1]];
             in = img.image;
             inView = img.view;
             inLayout = &img.layout;
         }
-        if (i == m_pipelines.size() - 1) {
-            out = m_output.image;
-            outView = m_output.view;
-            outLayout = &m_output.layout;
-            rect.extent.width = m_output.imageInfo.extent.width;
-            rect.extent.height = m_output.imageInfo.extent.height;
+        if (m_passTargets[i] == OutputTarget) {
+            out = output.image;
+            outView = output.view;
+            outLayout = &output.layout;
+            rect.extent.width = output.imageInfo.extent.width;
+            rect.extent.height = output.imageInfo.extent.height;
         } else {
-            auto& img = m_stagingImages[i % m_stagingImages.size()];
+            auto& img = m_stagingImages[m_passTargets[i]];
             out = img.image;
             outView = img.view;
             outLayout = &img.layout;
-            rect.extent = m_imageSize;
+            rect.extent = img.extent;
         }
         VkImageMemoryBarrier imageBarrier = {};
         imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
         imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
         imageBarrier.subresourceRange.layerCount = 1;
         imageBarrier.subresourceRange.levelCount = 1;
-        std::vector<VkImageMemoryBarrier> imageBarriers;
-        if (*inLayout != VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
+        // All the transitions before a pass go in one barrier. After the first pass it waits on
+        // the compute work before it, which wrote the input and read the images now written
+        std::array<VkImageMemoryBarrier, 2> imageBarriers;
+        uint32_t barrierCount = 0;
+        if (i == 0) {
+            // The input is written by another process, acquire it from the external queue every
+            // frame so that the driver makes its content visible on our queue
             imageBarrier.image = in;
             imageBarrier.oldLayout = *inLayout;
-            *inLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            *inLayout = copy ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                             : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
             imageBarrier.newLayout = *inLayout;
             imageBarrier.srcAccessMask = 0;
+            imageBarrier.dstAccessMask
+                = copy ? VK_ACCESS_TRANSFER_READ_BIT : VK_ACCESS_SHADER_READ_BIT;
+            imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_EXTERNAL;
+            imageBarrier.dstQueueFamilyIndex = m_queueFamilyIndex;
+            imageBarriers[barrierCount++] = imageBarrier;
+            imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        } else if (inPlace) {
+            // Same image, the writes of the previous pass must land before this one reads them
+            imageBarrier.image = in;
+            imageBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+            imageBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+            imageBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            imageBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+            imageBarriers[barrierCount++] = imageBarrier;
+        } else if (*inLayout != VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
+            imageBarrier.image = in;
+            imageBarrier.oldLayout = *inLayout;
+            *inLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            imageBarrier.newLayout = *inLayout;
+            imageBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
             imageBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-            imageBarriers.push_back(imageBarrier);
+            imageBarriers[barrierCount++] = imageBarrier;
         }
-        if (*outLayout != VK_IMAGE_LAYOUT_GENERAL) {
+        if (!inPlace && *outLayout != VK_IMAGE_LAYOUT_GENERAL) {
             imageBarrier.image = out;
             imageBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
             *outLayout = VK_IMAGE_LAYOUT_GENERAL;
             imageBarrier.newLayout = *outLayout;
             imageBarrier.srcAccessMask = 0;
-            imageBarrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
-            imageBarriers.push_back(imageBarrier);
+            imageBarrier.dstAccessMask
+                = copy ? VK_ACCESS_TRANSFER_WRITE_BIT : VK_ACCESS_SHADER_WRITE_BIT;
+            imageBarriers[barrierCount++] = imageBarrier;
         }
-        if (imageBarriers.size()) {
+        // The first pass waits for the passes of the previous frame, which may still be reading
+        // the staging image it writes, or one sharing its memory
+        if (barrierCount != 0) {
             vkCmdPipelineBarrier(
-                m_commandBuffer,
-                VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
-                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                commandBuffer,
+                i == 0 ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT
+                       : VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                stage,
                 0,
                 0,
                 nullptr,
                 0,
                 nullptr,
-                imageBarriers.size(),
+                barrierCount,
                 imageBarriers.data()
             );
         }
-        m_pipelines[i]->Render(inView, outView, rect);
+        // After the barriers of the first pass, so that the wait on the input is left out. The
+        // barriers of the following passes count towards the previous pass
+        if (i == 0) {
+            vkCmdWriteTimestamp(commandBuffer, stage, frame.pipelineQueryPool, 0);
+        }
+        if (copy) {
+            VkImageCopy region = {};
+            region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            region.srcSubresource.layerCount = 1;
+            region.dstSubresource = region.srcSubresource;
+            region.extent = { rect.extent.width, rect.extent.height, 1 };
+            vkCmdCopyImage(commandBuffer, in, *inLayout, out, *outLayout, 1, &region);
+        } else {
+            m_pipelines[i]->Render(
+                commandBuffer,
+                inView,
+                inPlace ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                outView,
+                rect
+            );
+        }
+        vkCmdWriteTimestamp(commandBuffer, stage, frame.pipelineQueryPool, i + 1);
     }
 
-    vkCmdWriteTimestamp(m_commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_queryPool, 1);
+    // Copied once the passes are done with them, the input before it is released
+    if (!m_inputImageCapture.empty()) {
+        captureImage(
+            frameIndex,
+            m_images[index].image,
+            m_images[index].view,
+            m_images[index].layout,
+            m_imageSize.width,
+            m_imageSize.height,
+            m_inputImageCapture
+        );
+        m_inputImageCapture.clear();
+    }
+    if (!m_outputImageCapture.empty()) {
+        captureImage(
+            frameIndex,
+            output.image,
+            output.view,
+            output.layout,
+            output.imageInfo.extent.width,
+            output.imageInfo.extent.height,
+            m_outputImageCapture
+        );
+        m_outputImageCapture.clear();
+    }
 
-    VK_CHECK(vkEndCommandBuffer(m_commandBuffer));
+    // Release the input back to its producer
+    VkImageMemoryBarrier releaseBarrier = {};
+    releaseBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    releaseBarrier.image = m_images[index].image;
+    releaseBarrier.oldLayout = m_images[index].layout;
+    releaseBarrier.newLayout = m_images[index].layout;
+    releaseBarrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+    releaseBarrier.dstAccessMask = 0;
+    releaseBarrier.srcQueueFamilyIndex = m_queueFamilyIndex;
+    releaseBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_EXTERNAL;
+    releaseBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    releaseBarrier.subresourceRange.layerCount = 1;
+    releaseBarrier.subresourceRange.levelCount = 1;
+    vkCmdPipelineBarrier(
+        commandBuffer,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+        0,
+        0,
+        nullptr,
+        0,
+        nullptr,
+        1,
+        &releaseBarrier
+    );
 
-    VkTimelineSemaphoreSubmitInfo timelineInfo = {};
-    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
-    timelineInfo.waitSemaphoreValueCount = 1;
-    timelineInfo.pWaitSemaphoreValues = &waitValue;
+    vkCmdWriteTimestamp(
+        commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame.queryPool, 1
+    );
 
-    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    VK_CHECK(vkEndCommandBuffer(commandBuffer));
+}
 
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.pNext = &timelineInfo;
-    submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = &m_images[index].semaphore;
-    submitInfo.pWaitDstStageMask = &waitStage;
-    submitInfo.signalSemaphoreCount = 1;
-    submitInfo.pSignalSemaphores = &m_output.semaphore;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &m_commandBuffer;
-    VK_CHECK(vkQueueSubmit(m_queue, 1, &submitInfo, nullptr));
+void Renderer::resetRecordedRenders() {
+    for (const Frame& frame : m_frames) {
+        if (frame.fence != VK_NULL_HANDLE) {
+            VK_CHECK(vkWaitForFences(m_dev, 1, &frame.fence, VK_TRUE, UINT64_MAX));
+        }
+    }
+    for (const RecordedRender& recorded : m_recordedRenders) {
+        if (recorded.commandBuffer != VK_NULL_HANDLE) {
+            vkFreeCommandBuffers(m_dev, m_commandPool, 1, &recorded.commandBuffer);
+        }
+    }
+    m_recordedRenders.assign(m_images.size() * m_frames.size(), {});
 }
 
-void Renderer::Sync() {
+void Renderer::Sync(uint32_t output) {
     VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
 
     VkSubmitInfo submitInfo = {};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
     submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = &m_output.semaphore;
+    submitInfo.pWaitSemaphores = &m_outputs[output].semaphore;
     submitInfo.pWaitDstStageMask = &waitStage;
     VK_CHECK(vkQueueSubmit(m_queue, 1, &submitInfo, m_fence));
 
@@ -702,9 +1105,58 @@ void Renderer::Sync() {
     VK_CHECK(vkResetFences(m_dev, 1, &m_fence));
 }
 
-Renderer::Output& Renderer::GetOutput() { return m_output; }
+bool Renderer::SyncDmaBuf(uint32_t index) {
+    Output& output = m_outputs[index];
+    if (!d.haveSyncFd || !d.haveDmaBufSyncFile || output.drm.fd < 0) {
+        return false;
+    }
+
+    VkSemaphoreGetFdInfoKHR getFdInfo = {};
+    getFdInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR;
+    getFdInfo.semaphore = output.semaphore;
+    getFdInfo.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+    int syncFd = -1;
+    VK_CHECK(d.vkGetSemaphoreFdKHR(m_dev, &getFdInfo, &syncFd));
+    // -1 means the render has already completed
+    if (syncFd < 0) {
+        return true;
+    }
+
+    dma_buf_import_sync_file importInfo = {};
+    importInfo.flags = DMA_BUF_SYNC_WRITE;
+    importInfo.fd = syncFd;
+    if (ioctl(output.drm.fd, DMA_BUF_IOCTL_IMPORT_SYNC_FILE, &importInfo) != 0) {
+        // Needs Linux 6.0, the semaphore payload was already exported so wait on it here
+        std::cerr << "DMA_BUF_IOCTL_IMPORT_SYNC_FILE failed, falling back to CPU sync"
+                  << std::endl;
+        d.haveDmaBufSyncFile = false;
+        pollfd pfd = { syncFd, POLLIN, 0 };
+        poll(&pfd, 1, -1);
+    }
+    close(syncFd);
+    return true;
+}
+
+void Renderer::SetOutputRelease(uint32_t output, VkSemaphore semaphore, uint64_t value) {
+    m_outputs[output].releaseSemaphore = semaphore;
+    m_outputs[output].releaseValue = value;
+}
+
+Renderer::Output& Renderer::GetOutput(uint32_t output) { return m_outputs[output]; }
+
+uint32_t Renderer::GetOutputCount() const { return m_outputs.size(); }
+
+VkDeviceSize Renderer::GetMemoryUsage() const {
+    VkDeviceSize size = m_stagingMemorySize;
+    for (const Output& output : m_outputs) {
+        size += output.size;
+    }
+    return size;
+}
+
+Renderer::Timestamps Renderer::GetTimestamps(uint32_t output) {
+    collectPipelineTimings(m_frames[output]);
 
-Renderer::Timestamps Renderer::GetTimestamps() {
     if (!d.haveCalibratedTimestamps) {
         return { 0, 0, 0 };
     }
@@ -712,7 +1164,7 @@ Renderer::Timestamps Renderer::GetTimestamps() {
     uint64_t queries[2];
     VK_CHECK(vkGetQueryPoolResults(
         m_dev,
-        m_queryPool,
+        m_frames[output].queryPool,
         0,
         2,
         2 * sizeof(uint64_t),
@@ -720,34 +1172,64 @@ Renderer::Timestamps Renderer::GetTimestamps() {
         sizeof(uint64_t),
         VK_QUERY_RESULT_64_BIT
     ));
-    queries[0] *= m_timestampPeriod;
-    queries[1] *= m_timestampPeriod;
 
-    VkCalibratedTimestampInfoEXT timestampInfo = {};
-    timestampInfo.sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
-    timestampInfo.timeDomain = VK_TIME_DOMAIN_DEVICE_EXT;
-    uint64_t deviation;
-    uint64_t timestamp;
-    VK_CHECK(d.vkGetCalibratedTimestampsEXT(m_dev, 1, &timestampInfo, &timestamp, &deviation));
-    timestamp *= m_timestampPeriod;
-
-    if (!m_outputImageCapture.empty()) {
-        dumpImage(
-            m_output.image,
-            m_output.view,
-            m_output.layout,
-            m_output.imageInfo.extent.width,
-            m_output.imageInfo.extent.height,
-            m_outputImageCapture
-        );
-        m_outputImageCapture.clear();
+    uint64_t now = FrameTrace::Now();
+    if (m_gpuClock.NeedsSample(now)) {
+        calibrateGpuClock();
     }
+    return { now,
+             m_gpuClock.ToHost(queries[0] * m_timestampPeriod),
+             m_gpuClock.ToHost(queries[1] * m_timestampPeriod) };
+}
 
-    return { timestamp, queries[0], queries[1] };
+void Renderer::calibrateGpuClock() {
+    VkCalibratedTimestampInfoEXT timestampInfos[2] = {};
+    timestampInfos[0].sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
+    timestampInfos[0].timeDomain = VK_TIME_DOMAIN_DEVICE_EXT;
+    timestampInfos[1].sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
+    timestampInfos[1].timeDomain = VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT;
+    const uint32_t domainCount = d.haveMonotonicTimeDomain ? 2 : 1;
+
+    // The call can be preempted between the two samples, the tightest pair is kept
+    uint64_t bestDeviceNs = 0;
+    uint64_t bestHostNs = 0;
+    uint64_t bestDeviationNs = UINT64_MAX;
+    for (int i = 0; i < 3; i++) {
+        uint64_t timestamps[2];
+        uint64_t deviationNs;
+        uint64_t beforeNs = FrameTrace::Now();
+        VK_CHECK(d.vkGetCalibratedTimestampsEXT(
+            m_dev, domainCount, timestampInfos, timestamps, &deviationNs
+        ));
+        uint64_t afterNs = FrameTrace::Now();
+        if (!d.haveMonotonicTimeDomain) {
+            // The host side is only known to be between the two reads
+            timestamps[1] = beforeNs + (afterNs - beforeNs) / 2;
+            deviationNs += (afterNs - beforeNs) / 2;
+        }
+        if (deviationNs < bestDeviationNs) {
+            bestDeviceNs = timestamps[0] * m_timestampPeriod;
+            bestHostNs = timestamps[1];
+            bestDeviationNs = deviationNs;
+        }
+    }
+    m_gpuClock.AddSample(bestDeviceNs, bestHostNs, bestDeviationNs);
 }
 
 void Renderer::CaptureInputFrame(const std::string& filename) { m_inputImageCapture = filename; }
 
+void Renderer::ReadInputImage(uint32_t index, uint64_t waitValue, std::vector<uint8_t>& rgba) {
+    waitInputImage(index, waitValue);
+    readImage(
+        m_images[index].image,
+        m_images[index].view,
+        m_images[index].layout,
+        m_imageSize.width,
+        m_imageSize.height,
+        rgba
+    );
+}
+
 void Renderer::CaptureOutputFrame(const std::string& filename) { m_outputImageCapture = filename; }
 
 std::string Renderer::result_to_str(VkResult result) {
@@ -797,6 +1279,65 @@ void Renderer::commandBufferBegin() {
     VK_CHECK(vkBeginCommandBuffer(m_commandBuffer, &commandBufferBegin));
 }
 
+bool Renderer::importSyncFd(InputImage& image, int syncFd) {
+    if (!d.haveSyncFdImport) {
+        close(syncFd);
+        return false;
+    }
+    if (image.syncSemaphore == VK_NULL_HANDLE) {
+        VkSemaphoreCreateInfo semInfo = {};
+        semInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        VK_CHECK(vkCreateSemaphore(m_dev, &semInfo, nullptr, &image.syncSemaphore));
+    }
+
+    // The wait of the render consumes the temporary payload, the semaphore is free for the next
+    VkImportSemaphoreFdInfoKHR importInfo = {};
+    importInfo.sType = VK_STRUCTURE_TYPE_IMPORT_SEMAPHORE_FD_INFO_KHR;
+    importInfo.semaphore = image.syncSemaphore;
+    importInfo.flags = VK_SEMAPHORE_IMPORT_TEMPORARY_BIT;
+    importInfo.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+    importInfo.fd = syncFd;
+    if (d.vkImportSemaphoreFdKHR(m_dev, &importInfo) != VK_SUCCESS) {
+        close(syncFd);
+        return false;
+    }
+    return true;
+}
+
+void Renderer::waitInputImage(uint32_t index, uint64_t waitValue) {
+    VkSemaphoreWaitInfo waitInfo = {};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &m_images[index].semaphore;
+    waitInfo.pValues = &waitValue;
+    VK_CHECK(vkWaitSemaphores(m_dev, &waitInfo, UINT64_MAX));
+}
+
+void Renderer::collectPipelineTimings(const Frame& frame) {
+    std::vector<uint64_t> queries(m_pipelines.size() + 1);
+    // Not ready until this slot has rendered once
+    VkResult result = vkGetQueryPoolResults(
+        m_dev,
+        frame.pipelineQueryPool,
+        0,
+        queries.size(),
+        queries.size() * sizeof(uint64_t),
+        queries.data(),
+        sizeof(uint64_t),
+        VK_QUERY_RESULT_64_BIT
+    );
+    if (result != VK_SUCCESS) {
+        return;
+    }
+
+    std::vector<uint64_t> durationsNs(m_pipelines.size());
+    for (size_t i = 0; i < durationsNs.size(); ++i) {
+        durationsNs[i] = (queries[i + 1] - queries[i]) * m_timestampPeriod;
+    }
+    PipelineTimings::Instance().AddFrame(durationsNs);
+    PipelineTimings::Instance().Log();
+}
+
 void Renderer::commandBufferSubmit() {
     VK_CHECK(vkEndCommandBuffer(m_commandBuffer));
 
@@ -813,14 +1354,150 @@ void Renderer::commandBufferSubmit() {
     vkDestroyFence(m_dev, fence, nullptr);
 }
 
-void Renderer::addStagingImage(uint32_t width, uint32_t height) {
+void Renderer::planPasses() {
+    destroyStagingImages();
+    m_passTargets.assign(m_pipelines.size(), OutputTarget);
+
+    // The last pass writes the output, and so do the in place passes right before it
+    size_t outputPasses = m_pipelines.size() - 1;
+    while (outputPasses > 0 && m_pipelines[outputPasses]->m_inPlace) {
+        outputPasses--;
+    }
+
+    // The others ping-pong between images of their size and format, so that one pass never
+    // writes the image it reads
+    for (size_t i = 0; i < outputPasses; ++i) {
+        const RenderPipeline* pipeline = m_pipelines[i];
+        if (i > 0 && pipeline->m_inPlace) {
+            m_passTargets[i] = m_passTargets[i - 1];
+            continue;
+        }
+        VkExtent2D extent = {
+            std::max((uint32_t)std::lround(m_imageSize.width * pipeline->m_outputScale), 1u),
+            std::max((uint32_t)std::lround(m_imageSize.height * pipeline->m_outputScale), 1u),
+        };
+        VkFormat format = pipeline->m_outputFormat != VK_FORMAT_UNDEFINED
+            ? pipeline->m_outputFormat
+            : m_format;
+        m_passTargets[i] = stagingImage(extent, format, i > 0 ? m_passTargets[i - 1] : -1);
+    }
+
+    // Each pass reads the image of the pass before and writes its own
+    for (size_t i = 0; i < m_pipelines.size(); ++i) {
+        for (int target : { i > 0 ? m_passTargets[i - 1] : OutputTarget, m_passTargets[i] }) {
+            if (target == OutputTarget) {
+                continue;
+            }
+            StagingImage& image = m_stagingImages[target];
+            image.firstPass = std::min(image.firstPass, i);
+            image.lastPass = i;
+        }
+    }
+
+    bindStagingMemory();
+}
+
+// A staging image is read in the shader read only layout by the pass after the one that writes
+// it, so every frame its writer transitions it from the undefined layout, after the compute work
+// before. Which is all that the images sharing memory need
+void Renderer::bindStagingMemory() {
+    // The largest images first, so that each allocation is sized by its first image
+    std::vector<size_t> order(m_stagingImages.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+        return m_stagingImages[a].memoryReqs.size > m_stagingImages[b].memoryReqs.size;
+    });
+
+    struct Allocation {
+        VkDeviceSize size;
+        VkDeviceSize alignment;
+        uint32_t memoryType;
+        std::vector<size_t> images;
+    };
+    std::vector<Allocation> allocations;
+    for (size_t index : order) {
+        const StagingImage& image = m_stagingImages[index];
+        uint32_t memoryType = memoryTypeIndex(
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image.memoryReqs.memoryTypeBits
+        );
+
+        auto disjoint = [&](size_t other) {
+            const StagingImage& o = m_stagingImages[other];
+            return image.lastPass < o.firstPass || o.lastPass < image.firstPass;
+        };
+        auto allocation
+            = std::find_if(allocations.begin(), allocations.end(), [&](const Allocation& a) {
+                  return a.memoryType == memoryType
+                      && std::all_of(a.images.begin(), a.images.end(), disjoint);
+              });
+        if (allocation == allocations.end()) {
+            allocations.push_back({ 0, 1, memoryType, {} });
+            allocation = allocations.end() - 1;
+        }
+        allocation->size = std::max(allocation->size, image.memoryReqs.size);
+        allocation->alignment = std::max(allocation->alignment, image.memoryReqs.alignment);
+        allocation->images.push_back(index);
+    }
+
+    m_stagingMemorySize = 0;
+    for (const Allocation& allocation : allocations) {
+        VkMemoryAllocateInfo memoryAllocInfo = {};
+        memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        memoryAllocInfo.allocationSize = allocation.size;
+        memoryAllocInfo.memoryTypeIndex = allocation.memoryType;
+        VkDeviceMemory memory;
+        VK_CHECK(vkAllocateMemory(m_dev, &memoryAllocInfo, nullptr, &memory));
+        m_stagingMemory.push_back(memory);
+        m_stagingMemorySize += allocation.size;
+
+        for (size_t index : allocation.images) {
+            StagingImage& image = m_stagingImages[index];
+            VK_CHECK(vkBindImageMemory(m_dev, image.image, memory, 0));
+
+            VkImageViewCreateInfo viewInfo = {};
+            viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+            viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+            viewInfo.format = image.format;
+            viewInfo.image = image.image;
+            viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            viewInfo.subresourceRange.levelCount = 1;
+            viewInfo.subresourceRange.layerCount = 1;
+            VK_CHECK(vkCreateImageView(m_dev, &viewInfo, nullptr, &image.view));
+        }
+    }
+}
+
+void Renderer::destroyStagingImages() {
+    for (const StagingImage& image : m_stagingImages) {
+        vkDestroyImageView(m_dev, image.view, nullptr);
+        vkDestroyImage(m_dev, image.image, nullptr);
+    }
+    for (VkDeviceMemory memory : m_stagingMemory) {
+        vkFreeMemory(m_dev, memory, nullptr);
+    }
+    m_stagingImages.clear();
+    m_stagingMemory.clear();
+    m_stagingMemorySize = 0;
+}
+
+int Renderer::stagingImage(VkExtent2D extent, VkFormat format, int exclude) {
+    for (size_t i = 0; i < m_stagingImages.size(); ++i) {
+        const StagingImage& image = m_stagingImages[i];
+        if ((int)i != exclude && image.extent.width == extent.width
+            && image.extent.height == extent.height && image.format == format) {
+            return i;
+        }
+    }
+
     VkImageCreateInfo imageInfo = {};
     imageInfo = {};
     imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     imageInfo.imageType = VK_IMAGE_TYPE_2D;
-    imageInfo.format = m_format;
-    imageInfo.extent.width = width;
-    imageInfo.extent.height = height;
+    imageInfo.format = format;
+    imageInfo.extent.width = extent.width;
+    imageInfo.extent.height = extent.height;
     imageInfo.extent.depth = 1;
     imageInfo.mipLevels = 1;
     imageInfo.arrayLayers = 1;
@@ -829,42 +1506,46 @@ void Renderer::addStagingImage(uint32_t width, uint32_t height) {
     imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
     imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
     imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    VkImage image;
-    VK_CHECK(vkCreateImage(m_dev, &imageInfo, nullptr, &image));
+    StagingImage staging;
+    VK_CHECK(vkCreateImage(m_dev, &imageInfo, nullptr, &staging.image));
+    vkGetImageMemoryRequirements(m_dev, staging.image, &staging.memoryReqs);
+    staging.extent = extent;
+    staging.format = format;
+
+    m_stagingImages.push_back(staging);
+    return m_stagingImages.size() - 1;
+}
 
-    VkMemoryRequirements memoryReqs;
-    vkGetImageMemoryRequirements(m_dev, image, &memoryReqs);
-    VkMemoryAllocateInfo memoryAllocInfo = {};
-    memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    memoryAllocInfo.allocationSize = memoryReqs.size;
-    memoryAllocInfo.memoryTypeIndex
-        = memoryTypeIndex(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, memoryReqs.memoryTypeBits);
-    VkDeviceMemory memory;
-    VK_CHECK(vkAllocateMemory(m_dev, &memoryAllocInfo, nullptr, &memory));
-    VK_CHECK(vkBindImageMemory(m_dev, image, memory, 0));
+void Renderer::readImage(
+    VkImage image,
+    VkImageView imageView,
+    VkImageLayout imageLayout,
+    uint32_t width,
+    uint32_t height,
+    std::vector<uint8_t>& rgba
+) {
+    commandBufferBegin();
+    Readback readback
+        = recordReadback(m_commandBuffer, image, imageView, imageLayout, width, height);
+    commandBufferSubmit();
 
-    VkImageViewCreateInfo viewInfo = {};
-    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    viewInfo.format = imageInfo.format;
-    viewInfo.image = image;
-    viewInfo.subresourceRange = {};
-    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    viewInfo.subresourceRange.baseMipLevel = 0;
-    viewInfo.subresourceRange.levelCount = 1;
-    viewInfo.subresourceRange.baseArrayLayer = 0;
-    viewInfo.subresourceRange.layerCount = 1;
-    viewInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
-    viewInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-    viewInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-    viewInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-    VkImageView view;
-    VK_CHECK(vkCreateImageView(m_dev, &viewInfo, nullptr, &view));
+    const char* imageData;
+    VK_CHECK(vkMapMemory(m_dev, readback.memory, 0, VK_WHOLE_SIZE, 0, (void**)&imageData));
+    imageData += readback.layout.offset;
+
+    const size_t rowSize = (size_t)width * 4;
+    rgba.resize(rowSize * height);
+    for (uint32_t y = 0; y < height; y++) {
+        memcpy(&rgba[y * rowSize], imageData, rowSize);
+        imageData += readback.layout.rowPitch;
+    }
 
-    m_stagingImages.push_back({ image, VK_IMAGE_LAYOUT_UNDEFINED, memory, view });
+    vkUnmapMemory(m_dev, readback.memory);
+    destroyReadback(m_dev, readback);
 }
 
-void Renderer::dumpImage(
+void Renderer::captureImage(
+    uint32_t frameIndex,
     VkImage image,
     VkImageView imageView,
     VkImageLayout imageLayout,
@@ -872,6 +1553,69 @@ void Renderer::dumpImage(
     uint32_t height,
     const std::string& filename
 ) {
+    if (!m_captureWriter) {
+        m_captureWriter = std::make_unique<FrameCaptureWriter>();
+    }
+    size_t pending = m_captureWriter->GetPendingCount();
+    for (auto& captures : m_captures) {
+        pending += captures.size();
+    }
+    if (pending >= FrameCaptureWriter::MaxPendingFrames) {
+        Warn("Renderer: too many frames being saved, skipping %s\n", filename.c_str());
+        return;
+    }
+
+    Readback readback = recordReadback(
+        m_frames[frameIndex].commandBuffer, image, imageView, imageLayout, width, height
+    );
+    readback.path = filename;
+    m_captures[frameIndex].push_back(readback);
+}
+
+void Renderer::collectCaptures(uint32_t frameIndex) {
+    for (Readback& readback : m_captures[frameIndex]) {
+        const uint8_t* data = nullptr;
+        if (vkMapMemory(m_dev, readback.memory, 0, VK_WHOLE_SIZE, 0, (void**)&data)
+            != VK_SUCCESS) {
+            Error("Renderer: failed to map the capture of %s\n", readback.path.c_str());
+            destroyReadback(m_dev, readback);
+            continue;
+        }
+
+        // The writer thread unmaps and frees the copy once the file is written
+        VkDevice dev = m_dev;
+        m_captureWriter->Add(
+            readback.path,
+            readback.width,
+            readback.height,
+            readback.layout.rowPitch,
+            false,
+            data + readback.layout.offset,
+            [dev, readback] {
+                vkUnmapMemory(dev, readback.memory);
+                destroyReadback(dev, readback);
+            }
+        );
+    }
+    m_captures[frameIndex].clear();
+}
+
+Renderer::Readback Renderer::recordReadback(
+    VkCommandBuffer commandBuffer,
+    VkImage image,
+    VkImageView imageView,
+    VkImageLayout imageLayout,
+    uint32_t width,
+    uint32_t height
+) {
+    if (!m_readbackPipeline) {
+        createReadbackPipeline();
+    }
+
+    Readback readback;
+    readback.width = width;
+    readback.height = height;
+
     VkImageCreateInfo imageInfo = {};
     imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -885,141 +1629,123 @@ void Renderer::dumpImage(
     imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
     imageInfo.tiling = VK_IMAGE_TILING_LINEAR;
     imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT;
-    VkImage dstImage;
-    VK_CHECK(vkCreateImage(m_dev, &imageInfo, nullptr, &dstImage));
+    VK_CHECK(vkCreateImage(m_dev, &imageInfo, nullptr, &readback.image));
 
     VkMemoryRequirements memReqs;
     VkMemoryAllocateInfo memAllocInfo {};
     memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    vkGetImageMemoryRequirements(m_dev, dstImage, &memReqs);
+    vkGetImageMemoryRequirements(m_dev, readback.image, &memReqs);
     memAllocInfo.allocationSize = memReqs.size;
     memAllocInfo.memoryTypeIndex = memoryTypeIndex(
         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT
             | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
         memReqs.memoryTypeBits
     );
-    VkDeviceMemory dstMemory;
-    VK_CHECK(vkAllocateMemory(m_dev, &memAllocInfo, nullptr, &dstMemory));
-    VK_CHECK(vkBindImageMemory(m_dev, dstImage, dstMemory, 0));
+    VK_CHECK(vkAllocateMemory(m_dev, &memAllocInfo, nullptr, &readback.memory));
+    VK_CHECK(vkBindImageMemory(m_dev, readback.image, readback.memory, 0));
+
+    VkImageSubresource subresource = {};
+    subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    vkGetImageSubresourceLayout(m_dev, readback.image, &subresource, &readback.layout);
 
     VkImageViewCreateInfo viewInfo = {};
     viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
     viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
     viewInfo.format = imageInfo.format;
-    viewInfo.image = dstImage;
-    viewInfo.subresourceRange = {};
+    viewInfo.image = readback.image;
     viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    viewInfo.subresourceRange.baseMipLevel = 0;
     viewInfo.subresourceRange.levelCount = 1;
-    viewInfo.subresourceRange.baseArrayLayer = 0;
     viewInfo.subresourceRange.layerCount = 1;
-    viewInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
-    viewInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-    viewInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-    viewInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-    VkImageView dstView;
-    VK_CHECK(vkCreateImageView(m_dev, &viewInfo, nullptr, &dstView));
+    VK_CHECK(vkCreateImageView(m_dev, &viewInfo, nullptr, &readback.view));
+
+    // Outputs are sampled in the general layout they are rendered in, other images are moved to
+    // the read only layout and back. Either way after what wrote them earlier in the queue
+    const VkImageLayout sampleLayout = imageLayout == VK_IMAGE_LAYOUT_GENERAL
+        ? VK_IMAGE_LAYOUT_GENERAL
+        : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    // The layout tells what used the image last: a copy reads it in the transfer source layout,
+    // a pass samples it in the read only one, and images in the general layout are written by
+    // either a pass or a copy
+    VkPipelineStageFlags srcStage;
+    VkAccessFlags srcAccess;
+    switch (imageLayout) {
+    case VK_IMAGE_LAYOUT_UNDEFINED:
+        srcStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+        srcAccess = 0;
+        break;
+    case VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL:
+        srcStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        srcAccess = 0;
+        break;
+    case VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL:
+        srcStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        srcAccess = 0;
+        break;
+    default:
+        srcStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+        srcAccess = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+        break;
+    }
 
-    std::array<VkImageMemoryBarrier, 2> imageBarrierIn;
-    imageBarrierIn[0] = {};
+    std::array<VkImageMemoryBarrier, 2> imageBarrierIn = {};
     imageBarrierIn[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
     imageBarrierIn[0].oldLayout = imageLayout;
-    imageBarrierIn[0].newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    imageBarrierIn[0].newLayout = sampleLayout;
     imageBarrierIn[0].image = image;
     imageBarrierIn[0].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     imageBarrierIn[0].subresourceRange.layerCount = 1;
     imageBarrierIn[0].subresourceRange.levelCount = 1;
-    imageBarrierIn[0].srcAccessMask = 0;
+    imageBarrierIn[0].srcAccessMask = srcAccess;
     imageBarrierIn[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    imageBarrierIn[1] = {};
+    imageBarrierIn[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrierIn[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
     imageBarrierIn[1].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
     imageBarrierIn[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
     imageBarrierIn[1].newLayout = VK_IMAGE_LAYOUT_GENERAL;
-    imageBarrierIn[1].image = dstImage;
+    imageBarrierIn[1].image = readback.image;
     imageBarrierIn[1].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     imageBarrierIn[1].subresourceRange.layerCount = 1;
     imageBarrierIn[1].subresourceRange.levelCount = 1;
     imageBarrierIn[1].srcAccessMask = 0;
     imageBarrierIn[1].dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
-
-    // Shader
-    VkShaderModuleCreateInfo moduleInfo = {};
-    moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    moduleInfo.codeSize = m_quadShaderSize;
-    moduleInfo.pCode = m_quadShaderCode;
-    VkShaderModule shader;
-    VK_CHECK(vkCreateShaderModule(m_dev, &moduleInfo, nullptr, &shader));
-
-    // Pipeline
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
-    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutInfo.setLayoutCount = 1;
-    pipelineLayoutInfo.pSetLayouts = &m_descriptorLayout;
-    VkPipelineLayout pipelineLayout;
-    VK_CHECK(vkCreatePipelineLayout(m_dev, &pipelineLayoutInfo, nullptr, &pipelineLayout));
-
-    VkPipelineShaderStageCreateInfo stageInfo = {};
-    stageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    stageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-    stageInfo.pName = "main";
-    stageInfo.module = shader;
-
-    VkComputePipelineCreateInfo pipelineInfo = {};
-    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
-    pipelineInfo.layout = pipelineLayout;
-    pipelineInfo.stage = stageInfo;
-    VkPipeline pipeline;
-    VK_CHECK(vkCreateComputePipelines(m_dev, nullptr, 1, &pipelineInfo, nullptr, &pipeline));
-
-    std::array<VkImageMemoryBarrier, 2> imageBarrierOut;
-    imageBarrierOut[0] = {};
-    imageBarrierOut[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    imageBarrierOut[0].oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-    imageBarrierOut[0].newLayout = imageLayout;
-    imageBarrierOut[0].image = image;
-    imageBarrierOut[0].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    imageBarrierOut[0].subresourceRange.layerCount = 1;
-    imageBarrierOut[0].subresourceRange.levelCount = 1;
-    imageBarrierOut[0].srcAccessMask = 0;
-    imageBarrierOut[0].dstAccessMask = 0;
-    imageBarrierOut[1] = {};
-    imageBarrierOut[1].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    imageBarrierIn[1].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrierIn[1].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+
+    std::array<VkImageMemoryBarrier, 2> imageBarrierOut = imageBarrierIn;
+    imageBarrierOut[0].oldLayout = sampleLayout;
+    // Nothing was there to keep, the image can stay in the layout it was sampled in
+    imageBarrierOut[0].newLayout
+        = imageLayout == VK_IMAGE_LAYOUT_UNDEFINED ? sampleLayout : imageLayout;
+    imageBarrierOut[0].srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    imageBarrierOut[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
     imageBarrierOut[1].oldLayout = VK_IMAGE_LAYOUT_GENERAL;
     imageBarrierOut[1].newLayout = VK_IMAGE_LAYOUT_GENERAL;
-    imageBarrierOut[1].image = dstImage;
-    imageBarrierOut[1].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    imageBarrierOut[1].subresourceRange.layerCount = 1;
-    imageBarrierOut[1].subresourceRange.levelCount = 1;
-    imageBarrierOut[1].srcAccessMask = 0;
-    imageBarrierOut[1].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-
-    std::vector<VkWriteDescriptorSet> descriptorWriteSets;
+    imageBarrierOut[1].srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    imageBarrierOut[1].dstAccessMask = VK_ACCESS_HOST_READ_BIT;
 
     VkDescriptorImageInfo descriptorImageInfoIn = {};
     descriptorImageInfoIn.imageView = imageView;
-    descriptorImageInfoIn.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    descriptorImageInfoIn.imageLayout = sampleLayout;
 
     VkDescriptorImageInfo descriptorImageInfoOut = {};
-    descriptorImageInfoOut.imageView = dstView;
+    descriptorImageInfoOut.imageView = readback.view;
     descriptorImageInfoOut.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
 
-    VkWriteDescriptorSet descriptorWriteSet = {};
-    descriptorWriteSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descriptorWriteSet.descriptorCount = 1;
-    descriptorWriteSet.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    descriptorWriteSet.pImageInfo = &descriptorImageInfoIn;
-    descriptorWriteSet.dstBinding = 0;
-    descriptorWriteSets.push_back(descriptorWriteSet);
-
-    descriptorWriteSet.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-    descriptorWriteSet.pImageInfo = &descriptorImageInfoOut;
-    descriptorWriteSet.dstBinding = 1;
-    descriptorWriteSets.push_back(descriptorWriteSet);
+    std::array<VkWriteDescriptorSet, 2> descriptorWriteSets = {};
+    descriptorWriteSets[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWriteSets[0].descriptorCount = 1;
+    descriptorWriteSets[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    descriptorWriteSets[0].pImageInfo = &descriptorImageInfoIn;
+    descriptorWriteSets[0].dstBinding = 0;
+    descriptorWriteSets[1] = descriptorWriteSets[0];
+    descriptorWriteSets[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    descriptorWriteSets[1].pImageInfo = &descriptorImageInfoOut;
+    descriptorWriteSets[1].dstBinding = 1;
 
-    commandBufferBegin();
     vkCmdPipelineBarrier(
-        m_commandBuffer,
-        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+        commandBuffer,
+        srcStage,
         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
         0,
         0,
@@ -1029,22 +1755,20 @@ void Renderer::dumpImage(
         imageBarrierIn.size(),
         imageBarrierIn.data()
     );
-    vkCmdBindPipeline(m_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_readbackPipeline);
     d.vkCmdPushDescriptorSetKHR(
-        m_commandBuffer,
+        commandBuffer,
         VK_PIPELINE_BIND_POINT_COMPUTE,
-        pipelineLayout,
+        m_readbackPipelineLayout,
         0,
         descriptorWriteSets.size(),
         descriptorWriteSets.data()
     );
-    vkCmdDispatch(
-        m_commandBuffer, (imageInfo.extent.width + 7) / 8, (imageInfo.extent.height + 7) / 8, 1
-    );
+    vkCmdDispatch(commandBuffer, (width + 7) / 8, (height + 7) / 8, 1);
     vkCmdPipelineBarrier(
-        m_commandBuffer,
-        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+        commandBuffer,
         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_HOST_BIT,
         0,
         0,
         nullptr,
@@ -1053,41 +1777,41 @@ void Renderer::dumpImage(
         imageBarrierOut.size(),
         imageBarrierOut.data()
     );
-    commandBufferSubmit();
-
-    VkImageSubresource subresource = {};
-    subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    VkSubresourceLayout layout;
-    vkGetImageSubresourceLayout(m_dev, dstImage, &subresource, &layout);
-
-    const char* imageData;
-    VK_CHECK(vkMapMemory(m_dev, dstMemory, 0, VK_WHOLE_SIZE, 0, (void**)&imageData));
-    imageData += layout.offset;
 
-    std::ofstream file(filename, std::ios::out | std::ios::binary);
+    return readback;
+}
 
-    // PPM header
-    file << "P6\n" << width << "\n" << height << "\n" << 255 << "\n";
+void Renderer::createReadbackPipeline() {
+    VkShaderModuleCreateInfo moduleInfo = {};
+    moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    moduleInfo.codeSize = m_quadShaderSize;
+    moduleInfo.pCode = m_quadShaderCode;
+    VK_CHECK(vkCreateShaderModule(m_dev, &moduleInfo, nullptr, &m_readbackShader));
 
-    // PPM binary pixel data
-    for (uint32_t y = 0; y < height; y++) {
-        uint32_t* row = (uint32_t*)imageData;
-        for (uint32_t x = 0; x < width; x++) {
-            file.write((char*)row++, 3);
-        }
-        imageData += layout.rowPitch;
-    }
-    file.close();
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &m_descriptorLayout;
+    VK_CHECK(
+        vkCreatePipelineLayout(m_dev, &pipelineLayoutInfo, nullptr, &m_readbackPipelineLayout)
+    );
 
-    std::cout << "Image saved to \"" << filename << "\"" << std::endl;
+    VkComputePipelineCreateInfo pipelineInfo = {};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.layout = m_readbackPipelineLayout;
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.stage.module = m_readbackShader;
+    VK_CHECK(vkCreateComputePipelines(
+        m_dev, m_pipelineCache->Get(), 1, &pipelineInfo, nullptr, &m_readbackPipeline
+    ));
+}
 
-    vkUnmapMemory(m_dev, dstMemory);
-    vkFreeMemory(m_dev, dstMemory, nullptr);
-    vkDestroyImage(m_dev, dstImage, nullptr);
-    vkDestroyImageView(m_dev, dstView, nullptr);
-    vkDestroyShaderModule(m_dev, shader, nullptr);
-    vkDestroyPipeline(m_dev, pipeline, nullptr);
-    vkDestroyPipelineLayout(m_dev, pipelineLayout, nullptr);
+void Renderer::destroyReadback(VkDevice dev, const Readback& readback) {
+    vkDestroyImageView(dev, readback.view, nullptr);
+    vkDestroyImage(dev, readback.image, nullptr);
+    vkFreeMemory(dev, readback.memory, nullptr);
 }
 
 uint32_t Renderer::memoryTypeIndex(VkMemoryPropertyFlags properties, uint32_t typeBits) const {
@@ -1158,15 +1882,23 @@ void RenderPipeline::Build() {
     pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
     pipelineInfo.layout = m_pipelineLayout;
     pipelineInfo.stage = stageInfo;
-    VK_CHECK(vkCreateComputePipelines(r->m_dev, nullptr, 1, &pipelineInfo, nullptr, &m_pipeline));
+    VK_CHECK(vkCreateComputePipelines(
+        r->m_dev, r->m_pipelineCache->Get(), 1, &pipelineInfo, nullptr, &m_pipeline
+    ));
 }
 
-void RenderPipeline::Render(VkImageView in, VkImageView out, VkRect2D outSize) {
-    vkCmdBindPipeline(r->m_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline);
+void RenderPipeline::Render(
+    VkCommandBuffer commandBuffer,
+    VkImageView in,
+    VkImageLayout inLayout,
+    VkImageView out,
+    VkRect2D outSize
+) {
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline);
 
     VkDescriptorImageInfo descriptorImageInfoIn = {};
     descriptorImageInfoIn.imageView = in;
-    descriptorImageInfoIn.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    descriptorImageInfoIn.imageLayout = inLayout;
 
     VkDescriptorImageInfo descriptorImageInfoOut = {};
     descriptorImageInfoOut.imageView = out;
@@ -1184,15 +1916,10 @@ void RenderPipeline::Render(VkImageView in, VkImageView out, VkRect2D outSize) {
     descriptorWriteSets[1].pImageInfo = &descriptorImageInfoOut;
     descriptorWriteSets[1].dstBinding = 1;
     r->d.vkCmdPushDescriptorSetKHR(
-        r->m_commandBuffer,
-        VK_PIPELINE_BIND_POINT_COMPUTE,
-        m_pipelineLayout,
-        0,
-        2,
-        descriptorWriteSets
+        commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineLayout, 0, 2, descriptorWriteSets
     );
 
     vkCmdDispatch(
-        r->m_commandBuffer, (outSize.extent.width + 7) / 8, (outSize.extent.height + 7) / 8, 1
+        commandBuffer, (outSize.extent.width + 7) / 8, (outSize.extent.height + 7) / 8, 1
     );
 }
@@ -1,7 +1,12 @@
 #pragma once
 
+#include "PipelineCache.h"
+#include "alvr_server/ClockCalibration.h"
+
 #include <array>
+#include <cstdint>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 #include <vulkan/vulkan.h>
@@ -28,6 +33,7 @@ struct DrmImage {
     std::array<uint32_t, 4> offsets;
 };
 
+class FrameCaptureWriter;
 class RenderPipeline;
 
 class Renderer {
@@ -45,18 +51,30 @@ public:
         VkImageView view = VK_NULL_HANDLE;
         // ---
         DrmImage drm;
+        // Of the color aspect, only for linear opaque fd outputs
+        VkSubresourceLayout linearLayout = {};
+        // ---
+        VkSemaphore releaseSemaphore = VK_NULL_HANDLE;
+        uint64_t releaseValue = 0;
     };
 
+    // In the FrameTrace::Now() domain, now being when they were read. All 0 without calibrated
+    // timestamps
     struct Timestamps {
         uint64_t now;
         uint64_t renderBegin;
         uint64_t renderComplete;
     };
 
+    // Number of frames that can be composited before the oldest one has been consumed, each one
+    // renders to its own output
+    static constexpr uint32_t FramesInFlight = 2;
+
     explicit Renderer(
         const VkInstance& inst,
         const VkDevice& dev,
         const VkPhysicalDevice& physDev,
+        uint32_t queueFamilyIdx,
         uint32_t queueIdx,
         const std::vector<const char*>& devExtensions
     );
@@ -64,22 +82,67 @@ public:
 
     void Startup(uint32_t width, uint32_t height, VkFormat format);
 
-    void AddImage(VkImageCreateInfo imageInfo, size_t memoryIndex, int imageFd, int semaphoreFd);
+    // memorySize is the size of the exported allocation, an opaque fd is imported with the same.
+    // The image is a dma-buf with this modifier and plane layout if drm isn't null, imageFd is
+    // then drm->fd
+    void AddImage(
+        VkImageCreateInfo imageInfo,
+        size_t memoryIndex,
+        VkDeviceSize memorySize,
+        int imageFd,
+        int semaphoreFd,
+        const DrmImage* drm = nullptr
+    );
+    // Destroys the input images once no render uses them, for those of a new connection of the
+    // layer to be added. The passes and the outputs are kept
+    void ClearImages();
 
     void AddPipeline(RenderPipeline* pipeline);
 
-    void CreateOutput(uint32_t width, uint32_t height, ExternalHandle handle);
-    void ImportOutput(const DrmImage& drm);
+    // The last pipeline must be able to write the format
+    void CreateOutput(uint32_t width, uint32_t height, ExternalHandle handle, VkFormat format);
+    bool SupportsOutputFormat(VkFormat format, ExternalHandle handle);
+    // Restrict the outputs to linear dma-bufs, the only layout a consumer on another GPU is sure to
+    // understand. Must be called before CreateOutput()
+    void SetCrossDeviceOutput(bool crossDevice) { m_crossDeviceOutput = crossDevice; }
+    // Use linear tiling for opaque fd outputs, so that the encoder can read them as a plain buffer.
+    // Must be called before CreateOutput()
+    void SetLinearOutput(bool linear) { m_linearOutput = linear; }
+    // Let a copy pass write the outputs. Must be called before CreateOutput()
+    void SetTransferDestinationOutput(bool transferDestination) {
+        m_transferDestinationOutput = transferDestination;
+    }
+    // Whether an output with the format and usage of ours can be imported from this dma-buf
+    bool CanImportOutput(const DrmImage& drm);
+    void ImportOutput(uint32_t output, const DrmImage& drm);
+
+    // Returns the output that was rendered to, which the encoder should consume. The render waits
+    // for syncFd instead of waitValue if it is given, and takes ownership of it
+    uint32_t Render(uint32_t index, uint64_t waitValue, int syncFd = -1);
 
-    void Render(uint32_t index, uint64_t waitValue);
+    void Sync(uint32_t output);
 
-    void Sync();
+    // Attach the render completion of this output to its dma-buf as an implicit fence, so that
+    // importers of the buffer wait for it on the GPU. Returns false if Sync() must be used instead
+    bool SyncDmaBuf(uint32_t output);
 
-    Output& GetOutput();
-    Timestamps GetTimestamps();
+    // Make the next render to this output wait until its consumer is done reading it
+    void SetOutputRelease(uint32_t output, VkSemaphore semaphore, uint64_t value);
 
+    Output& GetOutput(uint32_t output);
+    uint32_t GetOutputCount() const;
+    Timestamps GetTimestamps(uint32_t output);
+    // Device memory allocated for the staging images and the outputs. The input images are
+    // allocated by the layer
+    VkDeviceSize GetMemoryUsage() const;
+
+    // Save the input and output of the next Render() as PNG. They are copied to host memory by
+    // the frame's own commands, then written by FrameCaptureWriter once the slot is reused
     void CaptureInputFrame(const std::string& filename);
     void CaptureOutputFrame(const std::string& filename);
+    // Waits for the layer to be done with this input image, then reads it back as tightly packed
+    // RGBA, as the compositor samples it
+    void ReadInputImage(uint32_t index, uint64_t waitValue, std::vector<uint8_t>& rgba);
 
     static std::string result_to_str(VkResult result);
 
@@ -90,19 +153,85 @@ public:
         VkDeviceMemory memory = VK_NULL_HANDLE;
         VkSemaphore semaphore = VK_NULL_HANDLE;
         VkImageView view = VK_NULL_HANDLE;
+        // Binary, the sync_file of each present is imported in it temporarily
+        VkSemaphore syncSemaphore = VK_NULL_HANDLE;
     };
 
     struct StagingImage {
         VkImage image = VK_NULL_HANDLE;
         VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+        VkImageView view = VK_NULL_HANDLE;
+        VkExtent2D extent = { 0, 0 };
+        VkFormat format = VK_FORMAT_UNDEFINED;
+        VkMemoryRequirements memoryReqs = {};
+        // First and last pass that read or write it
+        size_t firstPass = SIZE_MAX;
+        size_t lastPass = 0;
+    };
+
+    // Written by the passes that write the output in m_passTargets
+    static constexpr int OutputTarget = -1;
+
+    // Linear RGBA copy of an image in host memory
+    struct Readback {
+        VkImage image = VK_NULL_HANDLE;
         VkDeviceMemory memory = VK_NULL_HANDLE;
         VkImageView view = VK_NULL_HANDLE;
+        VkSubresourceLayout layout = {};
+        uint32_t width = 0;
+        uint32_t height = 0;
+        std::string path;
+    };
+
+    struct Frame {
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        VkQueryPool queryPool = VK_NULL_HANDLE;
+        // The start of the first pass, then the end of each pass
+        VkQueryPool pipelineQueryPool = VK_NULL_HANDLE;
+        VkFence fence = VK_NULL_HANDLE;
+    };
+
+    // Commands of an input rendered by a frame slot, recorded at its second render
+    struct RecordedRender {
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        // Rendered once, the layouts of the images it uses have settled
+        bool settled = false;
     };
 
+    // Records the passes of the input to the output of the slot and the slot's queries
+    void recordRender(VkCommandBuffer commandBuffer, uint32_t index, uint32_t frameIndex);
+    // Frees the recorded renders once idle, called whenever the images or the passes change
+    void resetRecordedRenders();
+    void waitInputImage(uint32_t index, uint64_t waitValue);
+    // Whether the render can wait for the sync_file instead of the timeline value. Takes the fd
+    bool importSyncFd(InputImage& image, int syncFd);
+    void collectPipelineTimings(const Frame& frame);
+    // Feeds m_gpuClock a pair of GPU and host timestamps, the most precise of a few
+    void calibrateGpuClock();
     void commandBufferBegin();
     void commandBufferSubmit();
-    void addStagingImage(uint32_t width, uint32_t height);
-    void dumpImage(
+    void createOutput(
+        Output& output, uint32_t width, uint32_t height, ExternalHandle handle, VkFormat format
+    );
+    VkImageCreateInfo outputImageInfo(uint32_t width, uint32_t height, VkFormat format) const;
+    // Modifiers that an output with this create info can be allocated with
+    std::vector<uint64_t> outputModifiers(
+        const VkImageCreateInfo& imageInfo, std::vector<VkDrmFormatModifierPropertiesEXT>& props
+    );
+    void createOutputViews(Output& output);
+    // Index of a staging image of this size and format other than exclude, added if needed. Its
+    // memory is bound by bindStagingMemory()
+    int stagingImage(VkExtent2D extent, VkFormat format, int exclude);
+    // Picks the image each pass writes, called whenever a pipeline is added
+    void planPasses();
+    // The staging images that no pass uses at the same time share their memory
+    void bindStagingMemory();
+    void destroyStagingImages();
+    void destroyImages();
+    // Records the copy to be saved when the frame of this slot has rendered. Skipped if too many
+    // frames are still being saved
+    void captureImage(
+        uint32_t frameIndex,
         VkImage image,
         VkImageView imageView,
         VkImageLayout imageLayout,
@@ -110,46 +239,100 @@ public:
         uint32_t height,
         const std::string& filename
     );
+    // Hands the copies of this slot to the writer, its fence must have signaled
+    void collectCaptures(uint32_t frameIndex);
+    // Records the conversion of the image to a new readback, which is ready once the commands
+    // have completed. The image is left in imageLayout
+    Readback recordReadback(
+        VkCommandBuffer commandBuffer,
+        VkImage image,
+        VkImageView imageView,
+        VkImageLayout imageLayout,
+        uint32_t width,
+        uint32_t height
+    );
+    void createReadbackPipeline();
+    static void destroyReadback(VkDevice dev, const Readback& readback);
+    // Synchronous readback into tightly packed RGBA
+    void readImage(
+        VkImage image,
+        VkImageView imageView,
+        VkImageLayout imageLayout,
+        uint32_t width,
+        uint32_t height,
+        std::vector<uint8_t>& rgba
+    );
     uint32_t memoryTypeIndex(VkMemoryPropertyFlags properties, uint32_t typeBits) const;
 
     struct {
         PFN_vkImportSemaphoreFdKHR vkImportSemaphoreFdKHR = nullptr;
+        PFN_vkGetSemaphoreFdKHR vkGetSemaphoreFdKHR = nullptr;
         PFN_vkGetMemoryFdKHR vkGetMemoryFdKHR = nullptr;
         PFN_vkGetMemoryFdPropertiesKHR vkGetMemoryFdPropertiesKHR = nullptr;
         PFN_vkGetImageDrmFormatModifierPropertiesEXT vkGetImageDrmFormatModifierPropertiesEXT
             = nullptr;
         PFN_vkGetCalibratedTimestampsEXT vkGetCalibratedTimestampsEXT = nullptr;
+        PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsEXT
+            vkGetPhysicalDeviceCalibrateableTimeDomainsEXT
+            = nullptr;
         PFN_vkCmdPushDescriptorSetKHR vkCmdPushDescriptorSetKHR = nullptr;
         bool haveDmaBuf = false;
         bool haveDrmModifiers = false;
         bool haveCalibratedTimestamps = false;
+        // The GPU clock can be sampled together with CLOCK_MONOTONIC, the one of the steady clock
+        bool haveMonotonicTimeDomain = false;
+        bool haveSyncFd = false;
+        bool haveSyncFdImport = false;
+        bool haveDmaBufSyncFile = true;
     } d;
 
-    Output m_output;
+    std::array<Output, FramesInFlight> m_outputs;
     std::vector<InputImage> m_images;
     std::vector<StagingImage> m_stagingImages;
+    // Bound to the staging images, one per set of images with disjoint passes
+    std::vector<VkDeviceMemory> m_stagingMemory;
+    VkDeviceSize m_stagingMemorySize = 0;
     std::vector<RenderPipeline*> m_pipelines;
+    // Per pipeline, the staging image it writes or OutputTarget. In place passes write the same
+    // image as the pass before them
+    std::vector<int> m_passTargets;
+    std::array<Frame, FramesInFlight> m_frames;
+    uint32_t m_frameIndex = 0;
+    // By input image, then by frame slot
+    std::vector<RecordedRender> m_recordedRenders;
 
     VkInstance m_inst = VK_NULL_HANDLE;
     VkDevice m_dev = VK_NULL_HANDLE;
     VkPhysicalDevice m_physDev = VK_NULL_HANDLE;
     VkQueue m_queue = VK_NULL_HANDLE;
     uint32_t m_queueFamilyIndex = 0;
+    uint32_t m_queueIndex = 0;
     VkFormat m_format = VK_FORMAT_UNDEFINED;
     VkExtent2D m_imageSize = { 0, 0 };
-    VkQueryPool m_queryPool = VK_NULL_HANDLE;
     VkCommandPool m_commandPool = VK_NULL_HANDLE;
     VkSampler m_sampler = VK_NULL_HANDLE;
     VkDescriptorSetLayout m_descriptorLayout = VK_NULL_HANDLE;
     VkCommandBuffer m_commandBuffer = VK_NULL_HANDLE;
     VkFence m_fence = VK_NULL_HANDLE;
     double m_timestampPeriod = 0;
+    ClockCalibration m_gpuClock;
+    bool m_crossDeviceOutput = false;
+    bool m_linearOutput = false;
+    bool m_transferDestinationOutput = false;
+    // Used for all the compute pipelines of the renderer and of the format converters
+    std::unique_ptr<PipelineCache> m_pipelineCache;
 
     size_t m_quadShaderSize = 0;
     const uint32_t* m_quadShaderCode = nullptr;
 
     std::string m_inputImageCapture;
     std::string m_outputImageCapture;
+    // Copies recorded in the commands of each frame slot
+    std::array<std::vector<Readback>, FramesInFlight> m_captures;
+    std::unique_ptr<FrameCaptureWriter> m_captureWriter;
+    VkShaderModule m_readbackShader = VK_NULL_HANDLE;
+    VkPipelineLayout m_readbackPipelineLayout = VK_NULL_HANDLE;
+    VkPipeline m_readbackPipeline = VK_NULL_HANDLE;
 };
 
 class RenderPipeline {
@@ -159,6 +342,8 @@ public:
 
     void SetShader(const char* filename);
     void SetShader(const unsigned char* data, unsigned len);
+    // Shown in the GPU timings of the passes
+    void SetName(const std::string& name) { m_name = name; }
 
     template <typename T>
     void SetConstants(const T* data, std::vector<VkSpecializationMapEntry>&& entries) {
@@ -167,15 +352,38 @@ public:
         m_constantEntries = std::move(entries);
     }
 
+    // Size and format of the image the pass writes when it isn't the last one, relative to the
+    // frame size. VK_FORMAT_UNDEFINED keeps the input format
+    void SetOutputScale(float scale) { m_outputScale = scale; }
+    void SetOutputFormat(VkFormat format) { m_outputFormat = format; }
+    // The pass reads and writes its own pixels of the image at binding 1, which holds the result
+    // of the previous pass, so no image and round trip are added for it. Binding 0 is the same
+    // image in the general layout. Not allowed for the first pass
+    void SetInPlace(bool inPlace) { m_inPlace = inPlace; }
+    // The pass would only copy the input to an output of the same size and format, so it is
+    // recorded as a transfer instead of a dispatch of its shader. Only for a pass on its own
+    void SetCopy(bool copy) { m_copy = copy; }
+
 private:
     void Build();
-    void Render(VkImageView in, VkImageView out, VkRect2D outSize);
+    void Render(
+        VkCommandBuffer commandBuffer,
+        VkImageView in,
+        VkImageLayout inLayout,
+        VkImageView out,
+        VkRect2D outSize
+    );
 
     Renderer* r;
+    std::string m_name;
     VkShaderModule m_shader = VK_NULL_HANDLE;
     const void* m_constant = nullptr;
     uint32_t m_constantSize = 0;
     std::vector<VkSpecializationMapEntry> m_constantEntries;
+    float m_outputScale = 1.f;
+    VkFormat m_outputFormat = VK_FORMAT_UNDEFINED;
+    bool m_inPlace = false;
+    bool m_copy = false;
     VkPipeline m_pipeline = VK_NULL_HANDLE;
     VkPipelineLayout m_pipelineLayout = VK_NULL_HANDLE;
 
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+// The loader of nv-codec-headers, which FFmpeg is built against for NVENC. It must come before
+// hwcontext_cuda.h, which otherwise wants cuda.h
+#if __has_include(<ffnvcodec/dynlink_loader.h>)
+#define ALVR_CUDA_INTEROP
+extern "C" {
+#include <ffnvcodec/dynlink_loader.h>
+}
+#endif
+
+#ifdef ALVR_CUDA_INTEROP
+namespace alvr {
+
+inline void cuda_check(CudaFunctions* cu, CUresult result, const char* what) {
+    if (result != CUDA_SUCCESS) {
+        const char* name = "unknown error";
+        cu->cuGetErrorName(result, &name);
+        throw std::runtime_error(std::string(what) + " failed: " + name);
+    }
+}
+
+class CudaContextScope {
+public:
+    CudaContextScope(CudaFunctions* cu, CUcontext ctx)
+        : cu(cu) {
+        cuda_check(cu, cu->cuCtxPushCurrent(ctx), "cuCtxPushCurrent");
+    }
+    ~CudaContextScope() {
+        CUcontext dummy;
+        cu->cuCtxPopCurrent(&dummy);
+    }
+
+private:
+    CudaFunctions* cu;
+};
+
+}
+#endif
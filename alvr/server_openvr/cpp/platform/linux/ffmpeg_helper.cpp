@@ -1,6 +1,7 @@
 #include "ffmpeg_helper.h"
 
 #include <chrono>
+#include <cstdio>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
@@ -52,6 +53,7 @@ alvr::VkContext::VkContext(
         VK_KHR_SAMPLER_YCBCR_CONVERSION_EXTENSION_NAME,
         VK_EXT_PHYSICAL_DEVICE_DRM_EXTENSION_NAME,
         VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME,
+        VK_EXT_GLOBAL_PRIORITY_EXTENSION_NAME,
     };
     device_extensions.insert(
         device_extensions.end(), requiredDeviceExtensions.begin(), requiredDeviceExtensions.end()
@@ -128,6 +130,17 @@ alvr::VkContext::VkContext(
     intel = deviceProps.properties.vendorID == 0x8086;
     nvidia = deviceProps.properties.vendorID == 0x10de;
     Info("Using Vulkan device %s", deviceProps.properties.deviceName);
+    char id[VK_MAX_PHYSICAL_DEVICE_NAME_SIZE + 64];
+    snprintf(
+        id,
+        sizeof(id),
+        "%s %04x:%04x driver %08x",
+        deviceProps.properties.deviceName,
+        deviceProps.properties.vendorID,
+        deviceProps.properties.deviceID,
+        deviceProps.properties.driverVersion
+    );
+    adapterId = id;
 
     uint32_t deviceExtensionCount = 0;
     VK_CHECK(vkEnumerateDeviceExtensionProperties(
@@ -147,9 +160,6 @@ alvr::VkContext::VkContext(
         }
     }
 
-    float queuePriority = 1.0;
-    std::vector<VkDeviceQueueCreateInfo> queueInfos;
-
     uint32_t queueFamilyCount;
     vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
     std::vector<VkQueueFamilyProperties> queueFamilyProperties(queueFamilyCount);
@@ -162,11 +172,34 @@ alvr::VkContext::VkContext(
         if (compute && (queueFamilyIndex == VK_QUEUE_FAMILY_IGNORED || !graphics)) {
             queueFamilyIndex = i;
         }
+    }
+
+    // The compositor gets its own queue when the family has a second one, ffmpeg uses the first
+    const float queuePriorities[] = { 1.0, 1.0 };
+    if (queueFamilyProperties[queueFamilyIndex].queueCount > 1) {
+        queueIndex = 1;
+    }
+
+    // Let our compute work preempt the rendering of other processes, like the game and
+    // vrcompositor, instead of queuing behind it
+    VkDeviceQueueGlobalPriorityCreateInfoEXT globalPriority = {};
+    globalPriority.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_GLOBAL_PRIORITY_CREATE_INFO_EXT;
+    globalPriority.globalPriority = VK_QUEUE_GLOBAL_PRIORITY_HIGH_EXT;
+    bool highPriority = false;
+    for (const char* ext : deviceExtensions) {
+        highPriority |= strcmp(ext, VK_EXT_GLOBAL_PRIORITY_EXTENSION_NAME) == 0;
+    }
+
+    std::vector<VkDeviceQueueCreateInfo> queueInfos;
+    for (uint32_t i = 0; i < queueFamilyProperties.size(); ++i) {
         VkDeviceQueueCreateInfo queueInfo = {};
         queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
         queueInfo.queueFamilyIndex = i;
-        queueInfo.queueCount = 1;
-        queueInfo.pQueuePriorities = &queuePriority;
+        queueInfo.queueCount = i == queueFamilyIndex ? queueIndex + 1 : 1;
+        queueInfo.pQueuePriorities = queuePriorities;
+        if (i == queueFamilyIndex && highPriority) {
+            queueInfo.pNext = &globalPriority;
+        }
         queueInfos.push_back(queueInfo);
     }
 
@@ -186,7 +219,22 @@ alvr::VkContext::VkContext(
     deviceInfo.pQueueCreateInfos = queueInfos.data();
     deviceInfo.enabledExtensionCount = deviceExtensions.size();
     deviceInfo.ppEnabledExtensionNames = deviceExtensions.data();
-    VK_CHECK(vkCreateDevice(physicalDevice, &deviceInfo, nullptr, &device));
+    VkResult res = vkCreateDevice(physicalDevice, &deviceInfo, nullptr, &device);
+    if (highPriority
+        && (res == VK_ERROR_NOT_PERMITTED_EXT || res == VK_ERROR_INITIALIZATION_FAILED)) {
+        // High priority may require CAP_SYS_NICE
+        Warn("Failed to create high priority queue, using normal priority");
+        highPriority = false;
+        queueInfos[queueFamilyIndex].pNext = nullptr;
+        res = vkCreateDevice(physicalDevice, &deviceInfo, nullptr, &device);
+    }
+    VK_CHECK(res);
+    Info(
+        "Using queue %u of family %u for composition%s",
+        queueIndex,
+        queueFamilyIndex,
+        highPriority ? " with high priority" : ""
+    );
 
     for (int i = 128; i < 136; ++i) {
         auto path = "/dev/dri/renderD" + std::to_string(i);
@@ -211,6 +259,7 @@ alvr::VkContext::VkContext(
         devicePath = "/dev/dri/renderD128";
     }
     Info("Using device path %s", devicePath.c_str());
+    encodeDevicePath = devicePath;
 
     ctx = av_hwdevice_ctx_alloc(AV_HWDEVICE_TYPE_VULKAN);
     AVHWDeviceContext* hwctx = (AVHWDeviceContext*)ctx->data;
@@ -44,6 +44,7 @@ public:
     VkInstance get_vk_instance() const { return instance; }
     VkPhysicalDevice get_vk_phys_device() const { return physicalDevice; }
     uint32_t get_vk_queue_family_index() const { return queueFamilyIndex; }
+    uint32_t get_vk_queue_index() const { return queueIndex; }
     std::vector<const char*> get_vk_instance_extensions() const { return instanceExtensions; }
     std::vector<const char*> get_vk_device_extensions() const { return deviceExtensions; }
 
@@ -52,12 +53,21 @@ public:
     VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
     VkDevice device = VK_NULL_HANDLE;
     uint32_t queueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    // Queue of queueFamilyIndex dedicated to the compositor
+    uint32_t queueIndex = 0;
     std::vector<const char*> instanceExtensions;
     std::vector<const char*> deviceExtensions;
     bool amd = false;
     bool intel = false;
     bool nvidia = false;
+    // Name, PCI ids and driver version, the key of EncoderProbe
+    std::string adapterId;
     std::string devicePath;
+    // Render node VA-API encodes on, devicePath unless another GPU was selected to encode
+    std::string encodeDevicePath;
+    // procamp_vaapi filter applying the color correction on the encoding GPU, empty when the
+    // compositor applies it
+    std::string colorFilter;
 };
 
 class VkFrameCtx {
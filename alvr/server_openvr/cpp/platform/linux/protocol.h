@@ -6,19 +6,106 @@
 #include <cstdint>
 #include <cstdlib>
 #include <mutex>
+#include <string>
 #include <vulkan/vulkan.h>
 
+// Socket the encoder listens on for the layer. Each SteamVR instance on the machine runs its own
+// driver and compositor, which inherit ALVR_INSTANCE from its environment: instances started with
+// different values each get their own socket
+inline std::string ipc_socket_path() {
+    const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+    std::string path = runtime_dir ? runtime_dir : "/tmp";
+    path += "/alvr-ipc";
+    const char* instance = getenv("ALVR_INSTANCE");
+    if (instance && *instance) {
+        path += "-";
+        path += instance;
+    }
+    return path;
+}
+
 struct present_packet {
     uint32_t image;
     uint32_t frame;
     uint64_t semaphore_value;
     float pose[3][4];
+    // present_ring::newest_pose_ns when the pose was read from vrcompositor, 0 if unknown
+    uint64_t newest_pose_ns;
+    // CLOCK_MONOTONIC when vrcompositor called vkQueuePresentKHR, in which the layer submitted
+    // the GPU work that signals semaphore_value
+    uint64_t present_ns;
+    // VkPresentIdKHR of the present, 0 if vrcompositor didn't give one
+    uint64_t present_id;
+    // A sync_file signaled along with semaphore_value was sent on the socket before the packet, in
+    // a present_sync_message
+    uint32_t has_sync_fd;
+};
+
+// Sent on the socket with the sync_file of a present as its only fd, ahead of the packet. Layers
+// whose device can't export sync_files don't send any
+struct present_sync_message {
+    // write_index of the packet of the present
+    uint64_t packet_index;
+};
+
+// Vsync of the client display on CLOCK_MONOTONIC, written by the encoder and read by the vsync
+// thread of the layer. sequence is odd while the encoder is updating the values.
+struct vsync_clock {
+    std::atomic<uint32_t> sequence;
+    // Any vsync, the others are a multiple of the interval away
+    std::atomic<uint64_t> vsync_ns;
+    // 0 while the client isn't streaming
+    std::atomic<uint64_t> interval_ns;
+};
+
+// Single producer ring of present packets shared by the layer and the encoder through a memfd.
+// The layer fills the slot at write_index % size, then increments write_index and signals the
+// eventfd that is sent along with it, the encoder only ever reads the newest packet. The vsync
+// clock, the newest pose and the presents consumed go the other way.
+struct present_ring {
+    static constexpr uint32_t size = 8;
+
+    std::atomic<uint64_t> write_index;
+    std::array<present_packet, size> packets;
+    // Vsyncs the compositor didn't present on since the ring was created
+    std::atomic<uint64_t> missed_vsyncs;
+    // Target timestamp of the newest head pose the encoder gave to SteamVR, stored before SteamVR
+    // gets it
+    std::atomic<uint64_t> newest_pose_ns;
+    vsync_clock vsync;
+    // Newest present_id the encoder is done with, either composited or skipped for a newer one.
+    // vkWaitForPresentKHR returns once it reaches the id waited for
+    std::atomic<uint64_t> consumed_present_id;
+    // Incremented after consumed_present_id changes, the layer waits on it with a futex
+    std::atomic<uint32_t> consumed_sequence;
 };
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t));
 
+// Sent by the layer once connected, followed by an init_image for each image. Then come the fds in
+// a single message: the memory and timeline semaphore of each image, the present ring memfd and
+// its eventfd
 struct init_packet {
+    static constexpr uint32_t max_images = 8;
+
     uint32_t num_images;
     std::array<uint8_t, VK_UUID_SIZE> device_uuid;
+    // The tiling is VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT for dma-bufs
     VkImageCreateInfo image_create_info;
-    size_t mem_index;
+    // Opaque fd, or dma-buf when the layer could create the images with an explicit modifier
+    VkExternalMemoryHandleTypeFlagBits memory_handle_type;
     pid_t source_pid;
 };
+
+// Dedicated allocation of a swapchain image, the import has to use the same size. A dma-buf also
+// comes with the modifier and the layout of its memory planes the image was created with
+struct init_image {
+    VkDeviceSize memory_size;
+    uint32_t mem_index;
+    uint32_t plane_count;
+    uint64_t drm_modifier;
+    std::array<uint32_t, 4> plane_offsets;
+    std::array<uint32_t, 4> plane_strides;
+};
+
+constexpr size_t init_fd_count(uint32_t num_images) { return num_images * 2 + 2; }
@@ -12,4 +12,5 @@ public:
     void Stop() { }
     void OnStreamStart() { }
     void InsertIDR() { }
+    void OnFramesLost(uint64_t lastReceivedTimestampNs) { }
 };
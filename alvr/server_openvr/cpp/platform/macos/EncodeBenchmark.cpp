@@ -0,0 +1,13 @@
+#include "alvr_server/EncodeBenchmark.h"
+
+#include <stdexcept>
+
+std::unique_ptr<EncodeBenchmarkTarget>
+EncodeBenchmarkTarget::Create(FfiEncodeBenchmarkBackend backend) {
+    throw std::runtime_error("There is no encoder on macOS");
+}
+
+std::unique_ptr<EncodeBenchmarkTarget>
+EncodeBenchmarkTarget::CreateDriverPath(FfiEncodeBenchmarkBackend backend) {
+    throw std::runtime_error("There is no encoder on macOS");
+}
@@ -14,10 +14,22 @@ bool EncoderIpcClient::Initialize(uint32_t width, uint32_t height, const std::st
     m_height = height;
     m_codec = codec;
 
-    // 打开或创建共享内存
-    m_sharedMemory = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, SHARED_MEM_NAME);
+    // 打开共享内存. The buffers of an encoder process that is still running were sized for the
+    // resolution it was launched with, and it encodes at that resolution
+    bool connected = Connect();
+    if (connected && (m_ring->width != width || m_ring->height != height)) {
+        Info(
+            "ARM64 encoder runs at %ux%u, restarting it for %ux%u\n",
+            m_ring->width,
+            m_ring->height,
+            width,
+            height
+        );
+        StopEncoderProcess();
+        connected = false;
+    }
 
-    if (m_sharedMemory == nullptr) {
+    if (!connected) {
         // 编码器进程会创建共享内存，我们需要先启动它
         Debug("Shared memory not found, launching encoder process...\n");
         if (!LaunchEncoderProcess()) {
@@ -26,25 +38,39 @@ bool EncoderIpcClient::Initialize(uint32_t width, uint32_t height, const std::st
         }
 
         // 等待编码器创建共享内存
-        for (int i = 0; i < 50; i++) {
+        for (int i = 0; i < 50 && !connected; i++) {
             Sleep(100);
-            m_sharedMemory = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, SHARED_MEM_NAME);
-            if (m_sharedMemory != nullptr)
-                break;
+            connected = Connect();
         }
 
-        if (m_sharedMemory == nullptr) {
-            Error("Failed to open shared memory after launching encoder\n");
+        if (!connected) {
+            Error("Failed to connect to the ARM64 encoder after launching it\n");
             return false;
         }
     }
 
-    m_sharedPtr = (SharedMemoryLayout*)MapViewOfFile(m_sharedMemory, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    // The encoder process may already have been used by a previous connection
+    m_nextFrame = m_ring->frame_read.load(std::memory_order_acquire);
+    m_nextPacket = m_ring->packet_read.load(std::memory_order_acquire);
+
+    m_connected = true;
+    Info(
+        "ARM64 encoder IPC connected, %.1f MB shared\n",
+        SharedMemorySize(*m_ring) / (1024.0 * 1024.0)
+    );
+    return true;
+}
+
+bool EncoderIpcClient::Connect() {
+    m_sharedMemory = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, SHARED_MEM_NAME);
+    if (m_sharedMemory == nullptr) {
+        return false;
+    }
 
-    if (m_sharedPtr == nullptr) {
+    m_ring = (RingHeader*)MapViewOfFile(m_sharedMemory, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (m_ring == nullptr) {
         Error("Failed to map shared memory\n");
-        CloseHandle(m_sharedMemory);
-        m_sharedMemory = nullptr;
+        Disconnect();
         return false;
     }
 
@@ -52,39 +78,65 @@ bool EncoderIpcClient::Initialize(uint32_t width, uint32_t height, const std::st
     m_frameReadyEvent = OpenEventW(EVENT_ALL_ACCESS, FALSE, FRAME_READY_EVENT);
     m_packetReadyEvent = OpenEventW(EVENT_ALL_ACCESS, FALSE, PACKET_READY_EVENT);
     m_encoderReadyEvent = OpenEventW(EVENT_ALL_ACCESS, FALSE, ENCODER_READY_EVENT);
+    m_frameFreeEvent = OpenEventW(EVENT_ALL_ACCESS, FALSE, FRAME_FREE_EVENT);
+    m_packetFreeEvent = OpenEventW(EVENT_ALL_ACCESS, FALSE, PACKET_FREE_EVENT);
 
     if (m_frameReadyEvent == nullptr || m_packetReadyEvent == nullptr
-        || m_encoderReadyEvent == nullptr) {
+        || m_encoderReadyEvent == nullptr || m_frameFreeEvent == nullptr
+        || m_packetFreeEvent == nullptr) {
         Error("Failed to open IPC events\n");
-        Shutdown();
+        Disconnect();
         return false;
     }
 
-    // 等待编码器就绪
+    // 等待编码器就绪, the sizes in the ring header are written by then
     if (!WaitForEncoderReady()) {
         Error("ARM64 encoder did not become ready in time\n");
-        Shutdown();
+        Disconnect();
         return false;
     }
-
-    m_connected = true;
-    Info("ARM64 encoder IPC connected\n");
     return true;
 }
 
+void EncoderIpcClient::StopEncoderProcess() {
+    HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, m_ring->encoder_pid);
+    m_ring->shutdown.store(1, std::memory_order_release);
+    SetEvent(m_frameReadyEvent);
+    Disconnect();
+
+    // The names are only free once the process closed its handles
+    if (process != nullptr) {
+        if (WaitForSingleObject(process, 3000) != WAIT_OBJECT_0) {
+            Warn("ARM64 encoder process did not exit in time\n");
+        }
+        CloseHandle(process);
+    }
+}
+
 void EncoderIpcClient::Shutdown() {
     // 发送关闭信号
-    if (m_sharedPtr != nullptr && m_connected) {
-        m_sharedPtr->frame_header.shutdown = 1;
+    if (m_ring != nullptr && m_connected) {
+        m_ring->shutdown.store(1, std::memory_order_release);
         if (m_frameReadyEvent != nullptr) {
             SetEvent(m_frameReadyEvent);
         }
     }
 
+    Disconnect();
+
+    if (m_encoderProcess != nullptr) {
+        // 等待进程退出
+        WaitForSingleObject(m_encoderProcess, 3000);
+        CloseHandle(m_encoderProcess);
+        m_encoderProcess = nullptr;
+    }
+}
+
+void EncoderIpcClient::Disconnect() {
     // 清理资源
-    if (m_sharedPtr != nullptr) {
-        UnmapViewOfFile(m_sharedPtr);
-        m_sharedPtr = nullptr;
+    if (m_ring != nullptr) {
+        UnmapViewOfFile(m_ring);
+        m_ring = nullptr;
     }
     if (m_sharedMemory != nullptr) {
         CloseHandle(m_sharedMemory);
@@ -102,16 +154,30 @@ void EncoderIpcClient::Shutdown() {
         CloseHandle(m_encoderReadyEvent);
         m_encoderReadyEvent = nullptr;
     }
-    if (m_encoderProcess != nullptr) {
-        // 等待进程退出
-        WaitForSingleObject(m_encoderProcess, 3000);
-        CloseHandle(m_encoderProcess);
-        m_encoderProcess = nullptr;
+    if (m_frameFreeEvent != nullptr) {
+        CloseHandle(m_frameFreeEvent);
+        m_frameFreeEvent = nullptr;
+    }
+    if (m_packetFreeEvent != nullptr) {
+        CloseHandle(m_packetFreeEvent);
+        m_packetFreeEvent = nullptr;
     }
 
     m_connected = false;
 }
 
+FrameSlot& EncoderIpcClient::Frame(uint64_t index) {
+    return *reinterpret_cast<FrameSlot*>(
+        reinterpret_cast<uint8_t*>(m_ring) + FrameSlotOffset(*m_ring, index % FRAME_SLOT_COUNT)
+    );
+}
+
+PacketSlot& EncoderIpcClient::Packet(uint64_t index) {
+    return *reinterpret_cast<PacketSlot*>(
+        reinterpret_cast<uint8_t*>(m_ring) + PacketSlotOffset(*m_ring, index % PACKET_SLOT_COUNT)
+    );
+}
+
 bool EncoderIpcClient::LaunchEncoderProcess() {
     // 查找编码器可执行文件
     wchar_t modulePath[MAX_PATH];
@@ -175,30 +241,139 @@ bool EncoderIpcClient::SendFrame(
     uint32_t row_pitch,
     uint64_t timestamp_ns,
     bool insert_idr,
-    PixelFormat format
+    PixelFormat format,
+    DWORD timeout_ms
 ) {
-    if (!m_connected || m_sharedPtr == nullptr) {
+    if (!m_connected || m_ring == nullptr) {
         return false;
     }
 
     // 检查数据大小
-    if (data_size > FRAME_BUFFER_SIZE) {
-        Error("Frame data too large: %u > %zu\n", data_size, FRAME_BUFFER_SIZE);
+    if (data_size > m_ring->frame_buffer_size) {
+        Error("Frame data too large: %u > %llu\n", data_size, m_ring->frame_buffer_size);
         return false;
     }
 
+    int slotIndex = AcquireFrameSlot(timeout_ms);
+    if (slotIndex < 0) {
+        return false;
+    }
+    FrameSlot& slot = Frame(slotIndex);
+
     // 填充帧头
-    m_sharedPtr->frame_header.width = width;
-    m_sharedPtr->frame_header.height = height;
-    m_sharedPtr->frame_header.timestamp_ns = timestamp_ns;
-    m_sharedPtr->frame_header.insert_idr = insert_idr ? 1 : 0;
-    m_sharedPtr->frame_header.pixel_format = static_cast<uint8_t>(format);
-    m_sharedPtr->frame_header.row_pitch = row_pitch;
-    m_sharedPtr->frame_header.data_size = data_size;
-    m_sharedPtr->frame_header.shutdown = 0;
+    slot.header.width = width;
+    slot.header.height = height;
+    slot.header.timestamp_ns = timestamp_ns;
+    slot.header.insert_idr = insert_idr ? 1 : 0;
+    slot.header.pixel_format = static_cast<uint8_t>(format);
+    slot.header.row_pitch = row_pitch;
+    slot.header.data_size = data_size;
+    slot.header.fence_value = 0;
+    slot.header.shared_texture = 0;
 
     // 复制帧数据
-    memcpy(m_sharedPtr->frame_buffer, data, data_size);
+    memcpy(slot.Data(), data, data_size);
+
+    return PublishFrame(slot);
+}
+
+bool EncoderIpcClient::SetupSharedTextures(
+    const HANDLE (&textures)[FRAME_SLOT_COUNT], HANDLE fence, LUID adapterLuid, DWORD timeout_ms
+) {
+    if (!m_connected || m_ring == nullptr) {
+        return false;
+    }
+    RingHeader& ring = *m_ring;
+
+    // NT 句柄只在本进程有效, 需要复制到编码器进程
+    HANDLE process = OpenProcess(PROCESS_DUP_HANDLE, FALSE, ring.encoder_pid);
+    if (process == nullptr) {
+        Error("Failed to open ARM64 encoder process: %d\n", GetLastError());
+        return false;
+    }
+    auto duplicate = [&](HANDLE handle, uint64_t& remote) {
+        HANDLE remoteHandle = nullptr;
+        if (!DuplicateHandle(
+                GetCurrentProcess(), handle, process, &remoteHandle, 0, FALSE, DUPLICATE_SAME_ACCESS
+            )) {
+            return false;
+        }
+        remote = (uint64_t)(uintptr_t)remoteHandle;
+        return true;
+    };
+    bool duplicated = duplicate(fence, ring.fence_handle);
+    for (uint64_t i = 0; i < FRAME_SLOT_COUNT && duplicated; i++) {
+        duplicated = duplicate(textures[i], ring.texture_handles[i]);
+    }
+    CloseHandle(process);
+    if (!duplicated) {
+        Error("Failed to duplicate shared handles: %d\n", GetLastError());
+        return false;
+    }
+
+    ring.adapter_luid = ((uint64_t)(uint32_t)adapterLuid.HighPart << 32) | adapterLuid.LowPart;
+    ring.shared_texture_state.store(
+        (uint32_t)SharedTextureState::Requested, std::memory_order_release
+    );
+    SetEvent(m_frameReadyEvent);
+
+    // 等待编码器进程应答, it only happens once so it's just polled
+    for (DWORD waited = 0; waited < timeout_ms; waited += 10) {
+        auto state = (SharedTextureState)ring.shared_texture_state.load(std::memory_order_acquire);
+        if (state == SharedTextureState::Accepted) {
+            return true;
+        }
+        if (state == SharedTextureState::Rejected) {
+            return false;
+        }
+        Sleep(10);
+    }
+
+    Error("ARM64 encoder did not answer the shared texture setup\n");
+    return false;
+}
+
+int EncoderIpcClient::AcquireFrameSlot(DWORD timeout_ms) {
+    if (!m_connected || m_ring == nullptr) {
+        return -1;
+    }
+
+    // 等待空闲的帧槽位
+    while (m_nextFrame - m_ring->frame_read.load(std::memory_order_acquire)
+           >= FRAME_SLOT_COUNT) {
+        if (WaitForSingleObject(m_frameFreeEvent, timeout_ms) != WAIT_OBJECT_0) {
+            Error("Timed out waiting for a free frame slot\n");
+            return -1;
+        }
+    }
+
+    return (int)(m_nextFrame % FRAME_SLOT_COUNT);
+}
+
+bool EncoderIpcClient::SendSharedFrame(
+    uint32_t width, uint32_t height, uint64_t fence_value, uint64_t timestamp_ns, bool insert_idr
+) {
+    if (!m_connected || m_ring == nullptr) {
+        return false;
+    }
+
+    FrameSlot& slot = Frame(m_nextFrame);
+    slot.header.width = width;
+    slot.header.height = height;
+    slot.header.timestamp_ns = timestamp_ns;
+    slot.header.fence_value = fence_value;
+    slot.header.insert_idr = insert_idr ? 1 : 0;
+    slot.header.pixel_format = static_cast<uint8_t>(PixelFormat::NV12);
+    slot.header.row_pitch = 0;
+    slot.header.data_size = 0;
+    slot.header.shared_texture = 1;
+
+    return PublishFrame(slot);
+}
+
+bool EncoderIpcClient::PublishFrame(FrameSlot& slot) {
+    m_nextFrame++;
+    slot.sequence.store(m_nextFrame, std::memory_order_release);
 
     // 通知帧就绪
     if (!SetEvent(m_frameReadyEvent)) {
@@ -209,33 +384,49 @@ bool EncoderIpcClient::SendFrame(
     return true;
 }
 
+void EncoderIpcClient::SetEncoderParams(uint64_t bitrate_bps, uint32_t framerate) {
+    if (!m_connected || m_ring == nullptr) {
+        return;
+    }
+
+    RingHeader& ring = *m_ring;
+    ring.bitrate_bps.store(bitrate_bps, std::memory_order_relaxed);
+    ring.framerate.store(framerate, std::memory_order_relaxed);
+    ring.params_sequence.fetch_add(1, std::memory_order_release);
+}
+
 bool EncoderIpcClient::ReceivePacket(
-    std::vector<uint8_t>& packet_data, uint64_t& timestamp_ns, bool& is_idr, DWORD timeout_ms
+    uint8_t*& packet_data, PacketHeader& header, DWORD timeout_ms
 ) {
-    if (!m_connected || m_sharedPtr == nullptr) {
+    if (!m_connected || m_ring == nullptr) {
         return false;
     }
 
     // 等待数据包就绪
-    DWORD result = WaitForSingleObject(m_packetReadyEvent, timeout_ms);
-    if (result != WAIT_OBJECT_0) {
-        return false;
+    PacketSlot& slot = Packet(m_nextPacket);
+    while (slot.sequence.load(std::memory_order_acquire) != m_nextPacket + 1) {
+        if (WaitForSingleObject(m_packetReadyEvent, timeout_ms) != WAIT_OBJECT_0) {
+            return false;
+        }
     }
 
     // 读取数据包
-    uint32_t size = m_sharedPtr->packet_header.size;
-    if (size > PACKET_BUFFER_SIZE) {
-        Error("Packet too large: %u\n", size);
+    header = slot.header;
+    if (header.size > m_ring->packet_buffer_size) {
+        Error("Packet too large: %u\n", header.size);
+        ReleasePacket();
         return false;
     }
 
-    packet_data.resize(size);
-    memcpy(packet_data.data(), m_sharedPtr->packet_buffer, size);
-
-    timestamp_ns = m_sharedPtr->packet_header.timestamp_ns;
-    is_idr = m_sharedPtr->packet_header.is_idr != 0;
+    packet_data = slot.Data();
 
     return true;
 }
 
+void EncoderIpcClient::ReleasePacket() {
+    m_nextPacket++;
+    m_ring->packet_read.store(m_nextPacket, std::memory_order_release);
+    SetEvent(m_packetFreeEvent);
+}
+
 } // namespace Arm64EncoderIpc
@@ -10,6 +10,7 @@ typedef void* HANDLE;
 typedef unsigned long DWORD;
 #endif
 
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <memory>
@@ -23,11 +24,27 @@ constexpr const wchar_t* SHARED_MEM_NAME = L"ALVR_ARM64_ENCODER";
 constexpr const wchar_t* FRAME_READY_EVENT = L"ALVR_ARM64_FRAME_READY";
 constexpr const wchar_t* PACKET_READY_EVENT = L"ALVR_ARM64_PACKET_READY";
 constexpr const wchar_t* ENCODER_READY_EVENT = L"ALVR_ARM64_ENCODER_READY";
+constexpr const wchar_t* FRAME_FREE_EVENT = L"ALVR_ARM64_FRAME_FREE";
+constexpr const wchar_t* PACKET_FREE_EVENT = L"ALVR_ARM64_PACKET_FREE";
 
-// 帧缓冲区大小 (支持 4K RGBA)
-constexpr size_t FRAME_BUFFER_SIZE = 4096 * 2160 * 4;
-// 数据包缓冲区大小
-constexpr size_t PACKET_BUFFER_SIZE = 4 * 1024 * 1024; // 4MB
+// 共享内存布局: the ring header, then the frame slots and the packet slots. The encoder process
+// sizes the slot data for the resolution it was launched with and writes the sizes to the ring
+// header, both sides compute the slot addresses from them
+constexpr size_t SLOT_ALIGNMENT = 4096;
+// The slot header takes a cache line, the data follows it
+constexpr size_t SLOT_HEADER_SIZE = 64;
+// 数据包缓冲区最小大小
+constexpr size_t MIN_PACKET_BUFFER_SIZE = 4 * 1024 * 1024; // 4MB
+
+constexpr size_t AlignUp(size_t size, size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+// 环形缓冲区槽位数量
+// The frame ring matches the staging ring of VideoEncoderSW, so that the driver can copy a frame
+// while the encoder process encodes the previous ones
+constexpr uint64_t FRAME_SLOT_COUNT = 3;
+constexpr uint64_t PACKET_SLOT_COUNT = 4;
 
 // 像素格式
 enum class PixelFormat : uint8_t {
@@ -37,33 +54,117 @@ enum class PixelFormat : uint8_t {
 };
 
 // 帧头信息 (必须与 Rust 端结构体完全一致)
-#pragma pack(push, 1)
+// The fields are ordered so that neither side inserts padding
 struct FrameHeader {
+    uint64_t timestamp_ns;
+    // 共享纹理模式: the texture of the slot holds the frame once the fence reaches this value
+    uint64_t fence_value;
     uint32_t width;
     uint32_t height;
-    uint64_t timestamp_ns;
-    uint8_t insert_idr;
-    uint8_t pixel_format;
     uint32_t row_pitch;
     uint32_t data_size;
-    uint8_t shutdown;
-    uint8_t _padding[3];
+    uint8_t insert_idr;
+    uint8_t pixel_format;
+    // The frame is in the shared texture of the slot instead of the slot data
+    uint8_t shared_texture;
+    uint8_t _padding[5];
 };
 
+// QP of packets whose encoder doesn't report it
+constexpr uint8_t UNKNOWN_QP = 0xFF;
+
 struct PacketHeader {
-    uint32_t size;
     uint64_t timestamp_ns;
+    uint32_t size;
+    // 编码器统计: time from sending the frame to the encoder to receiving this packet
+    uint32_t encode_time_us;
     uint8_t is_idr;
-    uint8_t _padding[3];
+    uint8_t qp;
+    uint8_t _padding[6];
 };
 
-struct SharedMemoryLayout {
-    FrameHeader frame_header;
-    PacketHeader packet_header;
-    uint8_t frame_buffer[FRAME_BUFFER_SIZE];
-    uint8_t packet_buffer[PACKET_BUFFER_SIZE];
+// Frame n goes to slot n % FRAME_SLOT_COUNT. The writer fills the slot and then stores n + 1 in
+// its sequence, so a slot is ready for the reader once its sequence is one past the frame it
+// expects. The reader hands slots back by advancing the read counter of the ring.
+struct FrameSlot {
+    std::atomic<uint64_t> sequence;
+    FrameHeader header;
+
+    uint8_t* Data() { return reinterpret_cast<uint8_t*>(this) + SLOT_HEADER_SIZE; }
+};
+static_assert(sizeof(FrameSlot) <= SLOT_HEADER_SIZE);
+
+struct PacketSlot {
+    std::atomic<uint64_t> sequence;
+    PacketHeader header;
+
+    uint8_t* Data() { return reinterpret_cast<uint8_t*>(this) + SLOT_HEADER_SIZE; }
+};
+static_assert(sizeof(PacketSlot) <= SLOT_HEADER_SIZE);
+
+// 共享纹理设置状态
+enum class SharedTextureState : uint32_t {
+    None = 0,
+    Requested = 1,
+    Accepted = 2,
+    Rejected = 3,
 };
-#pragma pack(pop)
+
+struct RingHeader {
+    // Frames released by the encoder process
+    std::atomic<uint64_t> frame_read;
+    // Packets released by the driver
+    std::atomic<uint64_t> packet_read;
+    std::atomic<uint32_t> shutdown;
+    // 编码器进程 ID, written by the encoder process so that handles can be duplicated into it
+    uint32_t encoder_pid;
+
+    // Shared texture setup. The driver writes the handles, already duplicated into the encoder
+    // process, and then sets the state to Requested; the encoder process answers between frames
+    std::atomic<uint32_t> shared_texture_state;
+    uint32_t _padding;
+    uint64_t adapter_luid;
+    uint64_t fence_handle;
+    uint64_t texture_handles[FRAME_SLOT_COUNT];
+
+    // 编码参数. The driver writes the parameters and then bumps params_sequence, the encoder
+    // process applies the latest ones before encoding the next frame
+    std::atomic<uint64_t> bitrate_bps;
+    std::atomic<uint32_t> framerate;
+    std::atomic<uint32_t> params_sequence;
+
+    // Written by the encoder process before it signals that it's ready. The frames it encodes
+    // must have this size
+    uint32_t width;
+    uint32_t height;
+    uint64_t frame_buffer_size;
+    uint64_t packet_buffer_size;
+};
+
+// Largest frame of the size in any pixel format, RGBA with the row pitch of a staging texture
+inline size_t FrameBufferSize(uint32_t width, uint32_t height) {
+    return AlignUp((size_t)width * 4, 256) * height;
+}
+
+inline size_t PacketBufferSize(size_t frameBufferSize) {
+    return frameBufferSize / 8 > MIN_PACKET_BUFFER_SIZE ? frameBufferSize / 8
+                                                        : MIN_PACKET_BUFFER_SIZE;
+}
+
+inline size_t FrameSlotOffset(const RingHeader& ring, uint64_t slot) {
+    return AlignUp(sizeof(RingHeader), SLOT_ALIGNMENT)
+        + slot * AlignUp(SLOT_HEADER_SIZE + ring.frame_buffer_size, SLOT_ALIGNMENT);
+}
+
+inline size_t PacketSlotOffset(const RingHeader& ring, uint64_t slot) {
+    return FrameSlotOffset(ring, FRAME_SLOT_COUNT)
+        + slot * AlignUp(SLOT_HEADER_SIZE + ring.packet_buffer_size, SLOT_ALIGNMENT);
+}
+
+// Size of the whole mapping
+inline size_t SharedMemorySize(const RingHeader& ring) {
+    return PacketSlotOffset(ring, PACKET_SLOT_COUNT);
+}
 
 // IPC 客户端 (x64 驱动端使用)
 class EncoderIpcClient {
@@ -72,7 +173,7 @@ public:
     ~EncoderIpcClient();
 
     // 初始化 IPC 连接
-    // codec: "h264" 或 "hevc"
+    // codec: "h264" 或 "hevc". An encoder process left running for another size is restarted
     bool Initialize(uint32_t width, uint32_t height, const std::string& codec = "h264");
 
     // 关闭 IPC 连接
@@ -84,7 +185,31 @@ public:
     // 等待编码器就绪
     bool WaitForEncoderReady(DWORD timeout_ms = 5000);
 
+    // 设置共享纹理
+    // Hands the textures and the fence to the encoder process, which then encodes frame n from
+    // textures[n % FRAME_SLOT_COUNT] on the GPU instead of from a copy of its pixels. Returns false
+    // if the encoder process can't use them, the frames must then be sent with SendFrame.
+    bool SetupSharedTextures(
+        const HANDLE (&textures)[FRAME_SLOT_COUNT],
+        HANDLE fence,
+        LUID adapterLuid,
+        DWORD timeout_ms = 3000
+    );
+
+    // 等待空闲的帧槽位, 返回槽位索引, 超时返回 -1
+    int AcquireFrameSlot(DWORD timeout_ms = 1000);
+
+    // Publishes the frame written to the texture of the slot returned by AcquireFrameSlot
+    bool SendSharedFrame(
+        uint32_t width,
+        uint32_t height,
+        uint64_t fence_value,
+        uint64_t timestamp_ns,
+        bool insert_idr
+    );
+
     // 发送帧给编码器
+    // Copies the frame into the next slot of the frame ring, waiting for one to be free
     bool SendFrame(
         const uint8_t* data,
         uint32_t data_size,
@@ -93,28 +218,48 @@ public:
         uint32_t row_pitch,
         uint64_t timestamp_ns,
         bool insert_idr,
-        PixelFormat format
+        PixelFormat format,
+        DWORD timeout_ms = 1000
     );
 
+    // 更新编码参数 (码率/帧率), applied from the next frame the encoder process reads
+    void SetEncoderParams(uint64_t bitrate_bps, uint32_t framerate);
+
     // 接收编码后的数据包 (阻塞)
-    bool ReceivePacket(
-        std::vector<uint8_t>& packet_data,
-        uint64_t& timestamp_ns,
-        bool& is_idr,
-        DWORD timeout_ms = 1000
-    );
+    // The packet is read in place in the packet ring, and stays valid until ReleasePacket
+    bool ReceivePacket(uint8_t*& packet_data, PacketHeader& header, DWORD timeout_ms = 1000);
+    void ReleasePacket();
 
     // 检查是否连接
     bool IsConnected() const { return m_connected; }
 
 private:
+    // Opens the shared memory and the events of the running encoder process
+    bool Connect();
+    // Closes the handles without signaling the encoder process
+    void Disconnect();
+    // Asks the connected encoder process to exit and waits for it
+    void StopEncoderProcess();
+    // Publishes the slot of m_nextFrame
+    bool PublishFrame(FrameSlot& slot);
+    FrameSlot& Frame(uint64_t index);
+    PacketSlot& Packet(uint64_t index);
+
     HANDLE m_sharedMemory = nullptr;
-    SharedMemoryLayout* m_sharedPtr = nullptr;
+    // Start of the mapping, see FrameSlotOffset for the slots
+    RingHeader* m_ring = nullptr;
     HANDLE m_frameReadyEvent = nullptr;
     HANDLE m_packetReadyEvent = nullptr;
     HANDLE m_encoderReadyEvent = nullptr;
+    HANDLE m_frameFreeEvent = nullptr;
+    HANDLE m_packetFreeEvent = nullptr;
     HANDLE m_encoderProcess = nullptr;
 
+    // SendFrame and ReceivePacket can be called from different threads, each only uses its own
+    // sequence
+    uint64_t m_nextFrame = 0;
+    uint64_t m_nextPacket = 0;
+
     uint32_t m_width = 0;
     uint32_t m_height = 0;
     std::string m_codec = "h264";
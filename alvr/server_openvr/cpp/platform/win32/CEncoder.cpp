@@ -1,11 +1,33 @@
 #include "CEncoder.h"
+#include "alvr_server/DriverCounters.h"
+#include "alvr_server/EncoderProbe.h"
+#include "alvr_server/EncoderWarmup.h"
+#include "alvr_server/LatencyTarget.h"
+#include "alvr_server/OverlayQpMask.h"
+#include "alvr_server/StartupProfiler.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
 
-CEncoder::CEncoder()
-    : m_bExiting(false)
-    , m_targetTimestampNs(0) {
-    m_encodeFinished.Set();
+namespace {
+// Head-locked content looks the same at any pose, it must still be sent with the new one
+bool SamePose(const vr::HmdMatrix34_t& a, const vr::HmdMatrix34_t& b) {
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            if (fabsf(a.m[i][j] - b.m[i][j]) > 1e-4f) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
 }
 
+CEncoder::CEncoder(std::shared_ptr<PoseHistory> poseHistory)
+    : m_bExiting(false)
+    , m_poseHistory(poseHistory) { }
+
 CEncoder::~CEncoder() {
     if (m_videoEncoder) {
         m_videoEncoder->Shutdown();
@@ -14,67 +36,224 @@ CEncoder::~CEncoder() {
 }
 
 void CEncoder::Initialize(std::shared_ptr<CD3DRender> d3dRender) {
+    m_pD3DRender = d3dRender;
+    // Everything the frames go through is created here once. The settings that would change it
+    // restart SteamVR, so that Present only has to render and copy
     m_FrameRender = std::make_shared<FrameRender>(d3dRender);
-    m_FrameRender->Startup();
+    if (!m_FrameRender->Startup()) {
+        throw MakeException("Failed to create the frame render resources");
+    }
+    m_gpuTimestamps
+        = std::make_unique<GpuTimestamps>(d3dRender->GetDevice(), d3dRender->GetContext());
+    if (OverlayQpMask::IsEnabled()) {
+        try {
+            m_overlayCoverage = std::make_unique<OverlayCoverage>(
+                d3dRender->GetDevice(), d3dRender->GetContext()
+            );
+        } catch (Exception e) {
+            Warn("CEncoder: the overlays keep the QP of the frame: %s\n", e.what());
+        }
+    }
+
+    m_encodeRender = d3dRender;
+    int32_t encoderAdapter = Settings::Instance().m_encoderAdapterIndex;
+    if (encoderAdapter >= 0 && encoderAdapter != Settings::Instance().m_nAdapterIndex) {
+        auto encodeRender = std::make_shared<CD3DRender>();
+        if (encodeRender->Initialize(encoderAdapter)) {
+            m_encodeRender = encodeRender;
+            Info("CEncoder: encoding on adapter %d\n", encoderAdapter);
+        } else {
+            Warn(
+                "CEncoder: failed to open adapter %d, encoding on the compositor one\n",
+                encoderAdapter
+            );
+        }
+    }
+
+    CreateVideoEncoder();
+
+    if (!CreateInputSlots()) {
+        throw MakeException("Failed to create the encoder input slots");
+    }
+
+    WarmUp();
+    StreamStart::Mark(StreamStart::ENCODER_CREATED);
+}
+
+void CEncoder::WarmUp() {
+    const uint32_t frameCount
+        = std::min(Settings::Instance().m_encoderWarmupFrames, EncoderWarmup::MAX_FRAMES);
+    if (frameCount == 0) {
+        return;
+    }
+
+    // Nothing is submitted, the compositor only clears the frame and post-processes it
+    ID3D11ShaderResourceView* views[1][2] = {};
+    vr::VRTextureBounds_t bounds[1][2] = {};
+    vr::HmdMatrix34_t poses[1];
+    HmdMatrix_SetIdentity(&poses[0]);
+
+    auto start = std::chrono::steady_clock::now();
+    InputSlot& input = m_inputSlots[0];
+    try {
+        for (uint32_t frame = 0; frame < frameCount; frame++) {
+            m_FrameRender->RenderFrame(views, bounds, poses, poses[0], 0, false, "", "");
+            // When bridged the encoder reads the slot as it is, its content doesn't matter
+            if (!input.readback) {
+                m_pD3DRender->GetContext()->CopyResource(
+                    input.texture.Get(), m_FrameRender->GetTexture().Get()
+                );
+            }
+            uint64_t timestampNs = EncoderWarmup::Timestamp(frame);
+            m_videoEncoder->Transmit(input.texture.Get(), timestampNs, timestampNs, frame == 0);
+        }
+    } catch (std::exception& e) {
+        // The stream would fail the same way, the watchdog recovers it then
+        Warn("CEncoder: warm-up frame failed: %s\n", e.what());
+        return;
+    }
+
+    // NVENC and the software encoder hand their output over on their own thread, after Transmit
+    if (!EncoderWarmup::Instance().WaitFrames(frameCount, std::chrono::seconds(1))) {
+        Warn("CEncoder: the warm-up frames didn't all come out of the encoder\n");
+    }
+    Info(
+        "CEncoder: encoded %u warm-up frames in %.1f ms\n",
+        frameCount,
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+            .count()
+    );
+}
+
+void CEncoder::CreateVideoEncoder(bool recovering) {
     uint32_t encoderWidth, encoderHeight;
     m_FrameRender->GetEncodingResolution(&encoderWidth, &encoderHeight);
 
-    Exception vceException;
-    Exception nvencException;
-#ifdef ALVR_GPL
-    Exception swException;
+    std::string adapterId = VideoEncoder::GetAdapterId(m_encodeRender->GetDevice());
+    if (!Settings::Instance().m_force_sw_encoding && !adapterId.empty()) {
+        for (FfiEncodeBenchmarkBackend backend : EncoderProbe::RankedBackends(adapterId)) {
+            std::string error;
+            if (TryBackend(backend, encoderWidth, encoderHeight, error)) {
+                Info(
+                    "Using the %s encoder, measured fastest on this GPU\n",
+                    EncoderProbe::BackendName(backend)
+                );
+                return;
+            }
+            if (!error.empty()) {
+                Warn("Probed encoder failed, trying the others:%s\n", error.c_str());
+            }
+        }
+    }
+
+    // Without the gpl feature there is neither the QSV nor the software encoder
+    std::vector<FfiEncodeBenchmarkBackend> backends = { ENCODE_BENCHMARK_BACKEND_AMF,
+                                                        ENCODE_BENCHMARK_BACKEND_NVENC,
+                                                        ENCODE_BENCHMARK_BACKEND_QSV };
     if (Settings::Instance().m_force_sw_encoding) {
-        try {
-            Debug("Try to use VideoEncoderSW.\n");
-            m_videoEncoder
-                = std::make_shared<VideoEncoderSW>(d3dRender, encoderWidth, encoderHeight);
-            m_videoEncoder->Initialize();
+        backends.insert(backends.begin(), ENCODE_BENCHMARK_BACKEND_SOFTWARE);
+    }
+    std::string errors;
+    for (FfiEncodeBenchmarkBackend backend : backends) {
+        if (TryBackend(backend, encoderWidth, encoderHeight, errors)) {
             return;
-        } catch (Exception e) {
-            swException = e;
         }
     }
-#endif
-
-    try {
-        Debug("Try to use VideoEncoderAMF.\n");
-        m_videoEncoder = std::make_shared<VideoEncoderAMF>(d3dRender, encoderWidth, encoderHeight);
-        m_videoEncoder->Initialize();
+    // The input slots are already on the encoder adapter when recovering
+    if (!recovering && Settings::Instance().m_encoderAdapterIndex < 0
+        && CreateEncoderOnOtherAdapter(encoderWidth, encoderHeight)) {
         return;
-    } catch (Exception e) {
-        vceException = e;
     }
-    try {
-        Debug("Try to use VideoEncoderNVENC.\n");
-        m_videoEncoder
-            = std::make_shared<VideoEncoderNVENC>(d3dRender, encoderWidth, encoderHeight);
-        m_videoEncoder->Initialize();
+    if (!Settings::Instance().m_force_sw_encoding
+        && TryBackend(ENCODE_BENCHMARK_BACKEND_SOFTWARE, encoderWidth, encoderHeight, errors)) {
         return;
-    } catch (Exception e) {
-        nvencException = e;
     }
-#ifdef ALVR_GPL
+    throw MakeException("All VideoEncoder are not available.%s", errors.c_str());
+}
+
+bool CEncoder::TryBackend(
+    FfiEncodeBenchmarkBackend backend, uint32_t width, uint32_t height, std::string& errors
+) {
+    if (std::find(m_failedBackends.begin(), m_failedBackends.end(), backend)
+        != m_failedBackends.end()) {
+        return false;
+    }
     try {
-        Debug("Try to use VideoEncoderSW.\n");
-        m_videoEncoder = std::make_shared<VideoEncoderSW>(d3dRender, encoderWidth, encoderHeight);
-        m_videoEncoder->Initialize();
-        return;
+        auto encoder = CreateBackend(backend, width, height);
+        if (!encoder) {
+            return false;
+        }
+        Debug("Try to use the %s encoder.\n", EncoderProbe::BackendName(backend));
+        encoder->Initialize();
+        m_videoEncoder = encoder;
+        m_backend = backend;
+        return true;
     } catch (Exception e) {
-        swException = e;
+        errors += std::string(" ") + EncoderProbe::BackendName(backend) + ": " + e.what();
+        return false;
     }
-    throw MakeException(
-        "All VideoEncoder are not available. VCE: %s, NVENC: %s, SW: %s",
-        vceException.what(),
-        nvencException.what(),
-        swException.what()
-    );
-#else
-    throw MakeException(
-        "All VideoEncoder are not available. VCE: %s, NVENC: %s",
-        vceException.what(),
-        nvencException.what()
-    );
+}
+
+std::shared_ptr<VideoEncoder>
+CEncoder::CreateBackend(FfiEncodeBenchmarkBackend backend, uint32_t width, uint32_t height) {
+    switch (backend) {
+    case ENCODE_BENCHMARK_BACKEND_AMF:
+        return std::make_shared<VideoEncoderAMF>(m_encodeRender, width, height);
+    case ENCODE_BENCHMARK_BACKEND_NVENC:
+        return std::make_shared<VideoEncoderNVENC>(m_encodeRender, width, height, m_poseHistory);
+#ifdef ALVR_GPL
+    case ENCODE_BENCHMARK_BACKEND_QSV:
+        return std::make_shared<VideoEncoderQSV>(m_encodeRender, width, height);
+    case ENCODE_BENCHMARK_BACKEND_SOFTWARE:
+        return std::make_shared<VideoEncoderSW>(m_encodeRender, width, height);
 #endif
+    default:
+        return nullptr;
+    }
+}
+
+bool CEncoder::CreateEncoderOnOtherAdapter(uint32_t width, uint32_t height) {
+    // Enumerated until the index is past the last adapter
+    for (uint32_t index = 0;; index++) {
+        if ((int32_t)index == Settings::Instance().m_nAdapterIndex) {
+            continue;
+        }
+        auto encodeRender = std::make_shared<CD3DRender>();
+        if (!encodeRender->Initialize(index)) {
+            return false;
+        }
+
+        m_encodeRender = encodeRender;
+        for (FfiEncodeBenchmarkBackend backend : { ENCODE_BENCHMARK_BACKEND_AMF,
+                                                   ENCODE_BENCHMARK_BACKEND_NVENC,
+                                                   ENCODE_BENCHMARK_BACKEND_QSV }) {
+            try {
+                // Null for QSV without the gpl feature
+                m_videoEncoder = CreateBackend(backend, width, height);
+                if (!m_videoEncoder) {
+                    continue;
+                }
+                m_videoEncoder->Initialize();
+                m_backend = backend;
+                Info(
+                    "CEncoder: no hardware encoder on the compositor adapter, using %s on adapter "
+                    "%d\n",
+                    EncoderProbe::BackendName(backend),
+                    index
+                );
+                return true;
+            } catch (Exception e) {
+                Debug(
+                    "CEncoder: %s on adapter %d failed: %s\n",
+                    EncoderProbe::BackendName(backend),
+                    index,
+                    e.what()
+                );
+            }
+        }
+        m_videoEncoder.reset();
+        m_encodeRender = m_pD3DRender;
+    }
 }
 
 void CEncoder::SetViewParams(
@@ -87,9 +266,10 @@ void CEncoder::SetViewParams(
 }
 
 bool CEncoder::CopyToStaging(
-    ID3D11Texture2D* pTexture[][2],
+    ID3D11ShaderResourceView* pViews[][2],
     vr::VRTextureBounds_t bounds[][2],
     vr::HmdMatrix34_t poses[],
+    const vr::HmdMatrix34_t& targetPose,
     int layerCount,
     bool recentering,
     uint64_t presentationTime,
@@ -97,54 +277,421 @@ bool CEncoder::CopyToStaging(
     const std::string& message,
     const std::string& debugText
 ) {
-    m_presentationTime = presentationTime;
-    m_targetTimestampNs = targetTimestampNs;
-    m_FrameRender->Startup();
+    TraceScope scope("CEncoder::CopyToStaging", targetTimestampNs);
+    // Initialize failed, there is nothing to encode with
+    if (m_inputSlots.empty()) {
+        return false;
+    }
 
-    m_FrameRender->RenderFrame(
-        pTexture, bounds, poses, layerCount, recentering, message, debugText
-    );
+    CollectCaptures();
+
+    if (m_overlayCoverage) {
+        m_overlayCoverage->Update(pViews, bounds, layerCount);
+    }
+
+    // A layer that compositing would only copy goes to the slot as it is. Captures read the
+    // composition texture
+    FrameRender::Passthrough passthrough;
+    const bool passingThrough = m_captureFrames == 0
+        && m_FrameRender->GetPassthrough(
+            pViews, bounds, poses, targetPose, layerCount, recentering, passthrough
+        );
+
+    if (!passingThrough) {
+        m_gpuTimestamps->Begin(targetTimestampNs);
+        m_FrameRender->RenderFrame(
+            pViews, bounds, poses, targetPose, layerCount, recentering, message, debugText
+        );
+        m_gpuTimestamps->End();
+    }
+
+    if (m_captureFrames > 0) {
+        m_captureFrames--;
+        QueueCapture(targetTimestampNs);
+    }
+
+    std::lock_guard<std::mutex> lock(m_slotMutex);
+
+    // Take a slot that is neither queued nor being read. When the queue is full, the oldest frame
+    // is dropped for this one, so that with a single queued frame the latest one is encoded
+    int slot = -1;
+    for (int i = 0; i < (int)m_inputSlots.size() && slot == -1; i++) {
+        if (i != m_lastSlot
+            && std::find(m_readySlots.begin(), m_readySlots.end(), i) == m_readySlots.end()) {
+            slot = i;
+        }
+    }
+    if (slot == -1) {
+        slot = m_readySlots.front();
+        m_readySlots.pop_front();
+        Debug("CEncoder: dropping frame %llu\n", m_inputSlots[slot].targetTimestampNs);
+        // It was compared with the dropped frame, which the client won't show
+        if (!m_readySlots.empty()) {
+            m_inputSlots[m_readySlots.front()].comparable = false;
+        }
+    }
+
+    InputSlot& input = m_inputSlots[slot];
+    // Queued on the same immediate context as the encoder's own copy or mapping of the slot, so
+    // that those are ordered after. When bridged, the encoder thread maps the readback instead
+    ID3D11Texture2D* target = input.readback ? input.readback.Get() : input.texture.Get();
+    if (passingThrough) {
+        const UINT eyeWidth = Settings::Instance().m_renderWidth / 2;
+        for (int eye = 0; eye < 2; eye++) {
+            m_pD3DRender->GetContext()->CopySubresourceRegion(
+                target,
+                0,
+                eye * eyeWidth,
+                0,
+                0,
+                passthrough.textures[eye].Get(),
+                0,
+                &passthrough.boxes[eye]
+            );
+        }
+    } else {
+        m_pD3DRender->GetContext()->CopyResource(target, m_FrameRender->GetTexture().Get());
+    }
+    if (input.readback) {
+        m_pD3DRender->GetContext()->Flush();
+    }
+    input.presentationTime = presentationTime;
+    input.targetTimestampNs = targetTimestampNs;
+    input.pose = targetPose;
+    // The frame is compared with the one encoded before it, the last queued or else the last
+    // picked up by the encoder, which is what the client shows if this one is skipped
+    int referenceSlot = m_readySlots.empty() ? m_lastSlot : m_readySlots.back();
+    input.comparable = m_staticFrameDetector && referenceSlot != -1
+        && SamePose(input.pose, m_inputSlots[referenceSlot].pose);
+    if (input.comparable) {
+        m_staticFrameDetector->Compare(slot, referenceSlot);
+    }
+    m_readySlots.push_back(slot);
+
+    return true;
+}
+
+bool CEncoder::CreateInputSlots() {
+    D3D11_TEXTURE2D_DESC desc;
+    m_FrameRender->GetTexture()->GetDesc(&desc);
+    // The encoders read the raw values, and can't register sRGB textures. Copies between the two
+    // are allowed
+    if (desc.Format == DXGI_FORMAT_R8G8B8A8_UNORM_SRGB) {
+        desc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+    }
+    // Read by the static frame detector and the video processor
+    auto& settings = Settings::Instance();
+    if (settings.m_skipStaticFrames || settings.m_spectatorStreamEnabled
+        || settings.m_dynamicResolutionEnabled) {
+        desc.BindFlags |= D3D11_BIND_SHADER_RESOURCE;
+    }
+
+    // The slots are on the encoder adapter. The frames get there through a staging texture on the
+    // compositor adapter, which the encoder thread maps and uploads
+    const bool bridged = m_encodeRender != m_pD3DRender;
+    D3D11_TEXTURE2D_DESC readbackDesc = desc;
+    readbackDesc.Usage = D3D11_USAGE_STAGING;
+    readbackDesc.BindFlags = 0;
+    readbackDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    readbackDesc.MiscFlags = 0;
+
+    m_inputSlots.resize(std::max(Settings::Instance().m_encoderFrameQueueDepth, 1u) + 1);
+    std::vector<ID3D11Texture2D*> textures;
+    for (InputSlot& input : m_inputSlots) {
+        HRESULT hr = m_encodeRender->GetDevice()->CreateTexture2D(&desc, NULL, &input.texture);
+        if (SUCCEEDED(hr) && bridged) {
+            hr = m_pD3DRender->GetDevice()->CreateTexture2D(&readbackDesc, NULL, &input.readback);
+        }
+        if (FAILED(hr)) {
+            Error("CEncoder: CreateTexture2D failed %p %ls\n", hr, GetErrorStr(hr).c_str());
+            m_inputSlots.clear();
+            return false;
+        }
+        textures.push_back(input.texture.Get());
+    }
+
+    // The encoder thread isn't started yet, so it can't be using the encoder
+    RegisterInputSlots();
+
+    // It compares the slots on the present thread, before a bridged frame is uploaded
+    if (Settings::Instance().m_skipStaticFrames && bridged) {
+        Warn("CEncoder: static frames are encoded when encoding on another adapter\n");
+    } else if (Settings::Instance().m_skipStaticFrames) {
+        try {
+            auto detector = std::make_unique<StaticFrameDetector>(m_pD3DRender->GetDevice());
+            detector->Initialize(textures);
+            m_staticFrameDetector = std::move(detector);
+        } catch (Exception e) {
+            Warn("CEncoder: static frames will be encoded: %s\n", e.what());
+        }
+    }
+
+    // It reads the slots on the encoder thread, after the main encoder got them
+    if (Settings::Instance().m_spectatorStreamEnabled) {
+        try {
+            m_spectatorEncoder
+                = std::make_unique<SpectatorEncoder>(m_encodeRender, desc.Width, desc.Height);
+        } catch (Exception e) {
+            Warn("CEncoder: the spectator stream is disabled: %s\n", e.what());
+        }
+    }
+    return true;
+}
+
+void CEncoder::RegisterInputSlots() {
+    std::vector<ID3D11Texture2D*> textures;
+    for (InputSlot& input : m_inputSlots) {
+        textures.push_back(input.texture.Get());
+    }
+    if (m_videoEncoder->RegisterInputTextures(textures)) {
+        Info("CEncoder: encoding the input slots in place\n");
+    }
+}
+
+bool CEncoder::RecoverEncoder(EncoderWatchdog::Action action) {
+    if (action == EncoderWatchdog::Action::Fallback) {
+        Warn(
+            "CEncoder: the %s encoder keeps failing, trying the next one\n",
+            EncoderProbe::BackendName(m_backend)
+        );
+        m_failedBackends.push_back(m_backend);
+    } else {
+        Warn("CEncoder: rebuilding the %s encoder\n", EncoderProbe::BackendName(m_backend));
+    }
+
+    try {
+        m_videoEncoder->Shutdown();
+    } catch (std::exception& e) {
+        Warn("CEncoder: the failed encoder didn't shut down cleanly: %s\n", e.what());
+    }
+    m_videoEncoder.reset();
+
+    try {
+        CreateVideoEncoder(true);
+    } catch (Exception e) {
+        Error("CEncoder: no encoder left to recover with: %s\n", e.what());
+        return false;
+    }
+    RegisterInputSlots();
+    // The new encoder has no references, the client can't decode until the next IDR
+    m_scheduler.InsertIDR();
+    m_watchdog.OnRecovered();
     return true;
 }
 
 void CEncoder::Run() {
     Debug("CEncoder: Start thread. Id=%d\n", GetCurrentThreadId());
     SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_MOST_URGENT);
+    Info(
+        "%s\n", ApplyThreadRole(ThreadRole::Encoder, Settings::Instance().m_encoderThread).c_str()
+    );
+    if (!m_videoEncoder) {
+        // Initialize failed, CopyToStaging drops the frames
+        return;
+    }
 
     while (!m_bExiting) {
         m_newFrameReady.Wait();
         if (m_bExiting)
             break;
 
-        if (m_FrameRender->GetTexture()) {
+        const bool overLatencyTarget = LatencyTarget::Exceeded();
+        InputSlot input;
+        {
+            std::lock_guard<std::mutex> lock(m_slotMutex);
+            if (m_readySlots.empty()) {
+                continue;
+            }
+            // Behind the latency target, the frames queued before the latest one are skipped
+            if (overLatencyTarget && m_readySlots.size() > 1) {
+                while (m_readySlots.size() > 1) {
+                    Debug(
+                        "CEncoder: skipping frame %llu\n",
+                        m_inputSlots[m_readySlots.front()].targetTimestampNs
+                    );
+                    m_readySlots.pop_front();
+                }
+                // It was compared with a skipped frame
+                m_inputSlots[m_readySlots.front()].comparable = false;
+            }
+            m_lastSlot = m_readySlots.front();
+            m_readySlots.pop_front();
+            input = m_inputSlots[m_lastSlot];
+            // The next queued frame is picked up without waiting
+            if (!m_readySlots.empty()) {
+                m_newFrameReady.Set();
+            }
+        }
+
+        TraceScope scope("CEncoder::Run", input.targetTimestampNs);
+        bool insertIDR = m_scheduler.CheckIDRInsertion(
+            input.targetTimestampNs,
+            [this](const std::vector<uint64_t>& lostTimestampsNs, uint64_t referenceTimestampNs) {
+                return m_videoEncoder->InvalidateReferences(lostTimestampsNs, referenceTimestampNs);
+            }
+        );
+        // The skipped frame becomes the reference of the next comparison, its content being the
+        // one the client shows
+        if (!insertIDR && input.comparable && m_staticFrameDetector->IsUnchanged(m_lastSlot)) {
+            DriverCounters::Add(DRIVER_COUNTER_STATIC_FRAMES_SKIPPED);
+            continue;
+        }
+
+        if (input.readback && !UploadBridgedSlot(input)) {
+            continue;
+        }
+
+        FrameTrace::Instance().Record(input.targetTimestampNs, FRAME_TRACE_ENCODE_SUBMIT);
+        EncoderWatchdog::Action action;
+        m_watchdog.BeginFrame();
+        try {
             m_videoEncoder->Transmit(
-                m_FrameRender->GetTexture().Get(),
-                m_presentationTime,
-                m_targetTimestampNs,
-                m_scheduler.CheckIDRInsertion()
+                input.texture.Get(), input.presentationTime, input.targetTimestampNs, insertIDR
             );
+            action = m_watchdog.EndFrame();
+        } catch (std::exception& e) {
+            action = m_watchdog.OnFailure(e.what());
+        }
+        if (action != EncoderWatchdog::Action::None) {
+            if (!RecoverEncoder(action)) {
+                // CopyToStaging keeps filling the slots, nothing reads them anymore
+                break;
+            }
+            continue;
         }
 
-        m_encodeFinished.Set();
+        // Encoded after the main stream, so that it doesn't delay it. The static frames skipped
+        // above aren't counted
+        if (m_spectatorEncoder
+            && m_spectatorFrameCount++ % Settings::Instance().m_spectatorFramerateDivisor == 0) {
+            m_spectatorEncoder->Encode(input.texture.Get());
+        }
+    }
+}
+
+bool CEncoder::UploadBridgedSlot(InputSlot& input) {
+    TraceScope scope("CEncoder::UploadBridgedSlot", input.targetTimestampNs);
+    auto context = m_pD3DRender->GetContext();
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    HRESULT hr;
+    // A blocking Map would hold the lock of the multithread protected device, and with it the
+    // present thread, until the copy is done
+    while ((hr = context->Map(
+                input.readback.Get(), 0, D3D11_MAP_READ, D3D11_MAP_FLAG_DO_NOT_WAIT, &mapped
+            ))
+           == DXGI_ERROR_WAS_STILL_DRAWING) {
+        std::this_thread::yield();
+    }
+    if (FAILED(hr)) {
+        Warn("CEncoder: bridged Map failed %p %ls\n", hr, GetErrorStr(hr).c_str());
+        return false;
     }
+    m_encodeRender->GetContext()->UpdateSubresource(
+        input.texture.Get(), 0, NULL, mapped.pData, mapped.RowPitch, 0
+    );
+    context->Unmap(input.readback.Get(), 0);
+    return true;
 }
 
 void CEncoder::Stop() {
     m_bExiting = true;
     m_newFrameReady.Set();
     Join();
+    m_spectatorEncoder.reset();
     m_FrameRender.reset();
 }
 
-void CEncoder::NewFrameReady() {
-    m_encodeFinished.Reset();
-    m_newFrameReady.Set();
-}
-
-void CEncoder::WaitForEncode() { m_encodeFinished.Wait(); }
+void CEncoder::NewFrameReady() { m_newFrameReady.Set(); }
 
 void CEncoder::OnStreamStart() { m_scheduler.OnStreamStart(); }
 
 void CEncoder::InsertIDR() { m_scheduler.InsertIDR(); }
 
-void CEncoder::CaptureFrame() { }
+void CEncoder::OnFramesLost(uint64_t lastReceivedTimestampNs) {
+    m_scheduler.OnFramesLost(lastReceivedTimestampNs);
+}
+
+void CEncoder::CaptureFrame() {
+    m_captureFrames = std::max(Settings::Instance().m_captureFrameCount, 1u);
+}
+
+void CEncoder::QueueCapture(uint64_t targetTimestampNs) {
+    D3D11_TEXTURE2D_DESC desc;
+    m_FrameRender->GetTexture()->GetDesc(&desc);
+    const bool bgra = desc.Format == DXGI_FORMAT_B8G8R8A8_UNORM
+        || desc.Format == DXGI_FORMAT_B8G8R8A8_UNORM_SRGB;
+    if (!bgra && desc.Format != DXGI_FORMAT_R8G8B8A8_UNORM
+        && desc.Format != DXGI_FORMAT_R8G8B8A8_UNORM_SRGB) {
+        Warn("CEncoder: only 8 bit frames can be captured, the format is %d\n", desc.Format);
+        m_captureFrames = 0;
+        return;
+    }
+
+    if (!m_captureWriter) {
+        m_captureWriter = std::make_unique<FrameCaptureWriter>();
+    }
+    if (m_pendingCaptures.size() + m_captureWriter->GetPendingCount()
+        >= FrameCaptureWriter::MaxPendingFrames) {
+        Warn("CEncoder: too many frames being saved, skipping frame %llu\n", targetTimestampNs);
+        return;
+    }
+
+    desc.Usage = D3D11_USAGE_STAGING;
+    desc.BindFlags = 0;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    desc.MiscFlags = 0;
+    PendingCapture capture;
+    HRESULT hr = m_pD3DRender->GetDevice()->CreateTexture2D(&desc, NULL, &capture.staging);
+    if (FAILED(hr)) {
+        Warn("CEncoder: capture CreateTexture2D failed %p %ls\n", hr, GetErrorStr(hr).c_str());
+        return;
+    }
+    m_pD3DRender->GetContext()->CopyResource(
+        capture.staging.Get(), m_FrameRender->GetTexture().Get()
+    );
+
+    char name[64];
+    snprintf(name, sizeof(name), "/alvr_frame_%llu.png", targetTimestampNs);
+    capture.path = Settings::Instance().m_captureFrameDir + name;
+    capture.bgra = bgra;
+    m_pendingCaptures.push_back(std::move(capture));
+}
+
+void CEncoder::CollectCaptures() {
+    auto context = m_pD3DRender->GetContext();
+    while (!m_pendingCaptures.empty()) {
+        PendingCapture& capture = m_pendingCaptures.front();
+        D3D11_MAPPED_SUBRESOURCE mapped;
+        HRESULT hr = context->Map(
+            capture.staging.Get(), 0, D3D11_MAP_READ, D3D11_MAP_FLAG_DO_NOT_WAIT, &mapped
+        );
+        // The copies complete in order, the next ones aren't ready either
+        if (hr == DXGI_ERROR_WAS_STILL_DRAWING) {
+            return;
+        }
+
+        if (SUCCEEDED(hr)) {
+            D3D11_TEXTURE2D_DESC desc;
+            capture.staging->GetDesc(&desc);
+            // The mapping can't outlive this thread's use of the context, the writer gets a copy
+            auto pixels = std::make_shared<std::vector<uint8_t>>(
+                (size_t)mapped.RowPitch * desc.Height
+            );
+            memcpy(pixels->data(), mapped.pData, pixels->size());
+            context->Unmap(capture.staging.Get(), 0);
+
+            m_captureWriter->Add(
+                capture.path,
+                desc.Width,
+                desc.Height,
+                mapped.RowPitch,
+                capture.bgra,
+                pixels->data(),
+                [pixels] {}
+            );
+        } else {
+            Warn("CEncoder: capture Map failed %p %ls\n", hr, GetErrorStr(hr).c_str());
+        }
+        m_pendingCaptures.pop_front();
+    }
+}
@@ -4,19 +4,32 @@
 #include "shared/threadtools.h"
 
 #include "FrameRender.h"
+#include "GpuTimestamps.h"
+#include "OverlayCoverage.h"
+#include "SpectatorEncoder.h"
+#include "StaticFrameDetector.h"
 #include "VideoEncoder.h"
 #include "VideoEncoderAMF.h"
 #include "VideoEncoderNVENC.h"
 #include "alvr_server/Utils.h"
 #include <d3d11.h>
+#include <atomic>
 #include <d3d11_1.h>
+#include <deque>
 #include <map>
+#include <mutex>
+#include <vector>
 #include <wincodec.h>
 #include <wincodecsdk.h>
 #include <wrl.h>
 #ifdef ALVR_GPL
+#include "VideoEncoderQSV.h"
 #include "VideoEncoderSW.h"
 #endif
+#include "alvr_server/EncoderWatchdog.h"
+#include "alvr_server/FrameCapture.h"
+#include "alvr_server/FrameTrace.h"
+#include "alvr_server/TraceCapture.h"
 #include "alvr_server/IDRScheduler.h"
 
 using Microsoft::WRL::ComPtr;
@@ -28,7 +41,7 @@ using Microsoft::WRL::ComPtr;
 //----------------------------------------------------------------------------
 class CEncoder : public CThread {
 public:
-    CEncoder();
+    CEncoder(std::shared_ptr<PoseHistory> poseHistory);
     ~CEncoder();
 
     void Initialize(std::shared_ptr<CD3DRender> d3dRender);
@@ -41,9 +54,10 @@ public:
     );
 
     bool CopyToStaging(
-        ID3D11Texture2D* pTexture[][2],
+        ID3D11ShaderResourceView* pViews[][2],
         vr::VRTextureBounds_t bounds[][2],
         vr::HmdMatrix34_t poses[],
+        const vr::HmdMatrix34_t& targetPose,
         int layerCount,
         bool recentering,
         uint64_t presentationTime,
@@ -58,22 +72,98 @@ public:
 
     void NewFrameReady();
 
-    void WaitForEncode();
-
     void OnStreamStart();
 
     void InsertIDR();
 
+    void OnFramesLost(uint64_t lastReceivedTimestampNs);
+
     void CaptureFrame();
 
 private:
-    CThreadEvent m_newFrameReady, m_encodeFinished;
+    // Tries the backends EncoderProbe ranked for this GPU, then the available encoders in order,
+    // skipping the ones that failed while streaming. Throws if none can be used
+    void CreateVideoEncoder(bool recovering = false);
+    // Composites and encodes the warm-up frames, before the encoder thread starts
+    void WarmUp();
+    // Initializes the backend as the encoder, errors are appended to errors
+    bool TryBackend(
+        FfiEncodeBenchmarkBackend backend, uint32_t width, uint32_t height, std::string& errors
+    );
+    // Opens a hardware encoder on the first other adapter where one works, for when the compositor
+    // adapter has neither. The frames are then bridged through system memory
+    bool CreateEncoderOnOtherAdapter(uint32_t width, uint32_t height);
+    // Null for the backends that aren't in this build
+    std::shared_ptr<VideoEncoder>
+    CreateBackend(FfiEncodeBenchmarkBackend backend, uint32_t width, uint32_t height);
+    // Creates the input slot textures and lets the encoder register them
+    bool CreateInputSlots();
+    void RegisterInputSlots();
+    // Replaces the encoder after it failed or stalled, on the encoder thread. The adapter and the
+    // input slots stay, the stream goes on with an IDR. False if no encoder is left
+    bool RecoverEncoder(EncoderWatchdog::Action action);
+    // Copies the composited frame to a staging texture, read back by a later CollectCaptures
+    void QueueCapture(uint64_t targetTimestampNs);
+    // Hands the copies the GPU is done with to the writer, without waiting for the others
+    void CollectCaptures();
+
+    // The composited frame is copied to one of these, so that the next ones can be composited while
+    // the encoder is still reading the previous one. Encoders that register them read them in
+    // place, without another copy to their own input buffer. There is one per frame that can be
+    // queued, plus the one the encoder reads
+    struct InputSlot {
+        ComPtr<ID3D11Texture2D> texture;
+        // Staging copy of the frame on the compositor adapter, when encoding on another one
+        ComPtr<ID3D11Texture2D> readback;
+        uint64_t presentationTime = 0;
+        uint64_t targetTimestampNs = 0;
+        vr::HmdMatrix34_t pose = {};
+        // The frame was compared with the previous one and has the same head pose
+        bool comparable = false;
+    };
+
+    // Uploads the readback of a bridged slot to its texture on the encoder adapter
+    bool UploadBridgedSlot(InputSlot& input);
+
+    CThreadEvent m_newFrameReady;
     std::shared_ptr<VideoEncoder> m_videoEncoder;
+    FfiEncodeBenchmarkBackend m_backend = ENCODE_BENCHMARK_BACKEND_AUTO;
+    // Backends that kept failing while streaming, not used again
+    std::vector<FfiEncodeBenchmarkBackend> m_failedBackends;
+    EncoderWatchdog m_watchdog;
     bool m_bExiting;
-    uint64_t m_presentationTime;
-    uint64_t m_targetTimestampNs;
 
+    std::shared_ptr<CD3DRender> m_pD3DRender;
+    // The same as m_pD3DRender unless the encoders run on another adapter. Its context is only
+    // used by the encoder thread then
+    std::shared_ptr<CD3DRender> m_encodeRender;
+    std::shared_ptr<PoseHistory> m_poseHistory;
     std::shared_ptr<FrameRender> m_FrameRender;
+    std::unique_ptr<GpuTimestamps> m_gpuTimestamps;
+    // Null when the overlay QP reduction is disabled
+    std::unique_ptr<OverlayCoverage> m_overlayCoverage;
+    std::unique_ptr<StaticFrameDetector> m_staticFrameDetector;
+    // Null when the spectator stream is disabled or NVENC can't be used for it
+    std::unique_ptr<SpectatorEncoder> m_spectatorEncoder;
+    uint32_t m_spectatorFrameCount = 0;
+
+    std::mutex m_slotMutex;
+    std::vector<InputSlot> m_inputSlots;
+    // Frames not picked up by the encoder yet, oldest first, and the last one it picked up, which
+    // it may still be reading
+    std::deque<int> m_readySlots;
+    int m_lastSlot = -1;
 
     IDRScheduler m_scheduler;
+
+    struct PendingCapture {
+        ComPtr<ID3D11Texture2D> staging;
+        std::string path;
+        bool bgra = false;
+    };
+    // Frames left to save of the burst started by CaptureFrame
+    std::atomic<uint32_t> m_captureFrames = 0;
+    // Only touched on the present thread, which owns the immediate context
+    std::deque<PendingCapture> m_pendingCaptures;
+    std::unique_ptr<FrameCaptureWriter> m_captureWriter;
 };
@@ -0,0 +1,189 @@
+#include "ColorLut.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include "alvr_server/Settings.h"
+
+namespace {
+
+typedef std::array<float, 3> Color;
+
+// Same operations as ColorCorrectionPixelShader.hlsl, but the sharpening
+Color ColorCorrect(Color pixel) {
+    const Settings& settings = Settings::Instance();
+    const float contrast = settings.m_contrast + 1.f;
+    const float saturation = settings.m_saturation + 1.f;
+
+    for (float& c : pixel) {
+        c = (c + settings.m_brightness - 0.5f) * contrast + 0.5f;
+    }
+    float luma = pixel[0] * 0.299f + pixel[1] * 0.587f + pixel[2] * 0.114f;
+    for (float& c : pixel) {
+        // Saturation, lighten only
+        c = std::max(luma + (c - luma) * saturation, c);
+        c = std::pow(std::clamp(c, 0.f, 1.f), 1.f / settings.m_gamma);
+    }
+    return pixel;
+}
+
+float LinearToSrgb(float c) {
+    return c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.f / 2.4f) - 0.055f;
+}
+
+float SrgbToLinear(float c) {
+    return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+}
+
+bool ColorLut::IsEnabled() {
+    return Settings::Instance().m_enableColorCorrection
+        || !Settings::Instance().m_colorLutPath.empty();
+}
+
+ColorLut::ColorLut(ID3D11Device* device, bool linearLight) {
+    const Settings& settings = Settings::Instance();
+    if (!settings.m_colorLutPath.empty()) {
+        LoadCube(settings.m_colorLutPath);
+    }
+
+    std::vector<uint16_t> texels(SIZE * SIZE * SIZE * 4);
+    uint16_t* texel = texels.data();
+    for (uint32_t b = 0; b < SIZE; b++) {
+        for (uint32_t g = 0; g < SIZE; g++) {
+            for (uint32_t r = 0; r < SIZE; r++) {
+                Color color;
+                const uint32_t index[] = { r, g, b };
+                for (int c = 0; c < 3; c++) {
+                    float coordinate = (float)index[c] / (SIZE - 1);
+                    color[c] = coordinate * coordinate;
+                }
+
+                if (settings.m_enableColorCorrection) {
+                    color = ColorCorrect(color);
+                }
+                if (!mCube.empty()) {
+                    if (linearLight) {
+                        for (float& c : color) {
+                            c = LinearToSrgb(std::clamp(c, 0.f, 1.f));
+                        }
+                    }
+                    color = ApplyCube(color);
+                    if (linearLight) {
+                        for (float& c : color) {
+                            c = SrgbToLinear(std::clamp(c, 0.f, 1.f));
+                        }
+                    }
+                }
+
+                for (float c : color) {
+                    *texel++ = (uint16_t)std::lround(std::clamp(c, 0.f, 1.f) * 65535.f);
+                }
+                *texel++ = 65535;
+            }
+        }
+    }
+
+    D3D11_TEXTURE3D_DESC desc = {};
+    desc.Width = SIZE;
+    desc.Height = SIZE;
+    desc.Depth = SIZE;
+    desc.MipLevels = 1;
+    desc.Format = DXGI_FORMAT_R16G16B16A16_UNORM;
+    desc.Usage = D3D11_USAGE_IMMUTABLE;
+    desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+
+    D3D11_SUBRESOURCE_DATA data = {};
+    data.pSysMem = texels.data();
+    data.SysMemPitch = SIZE * 4 * sizeof(uint16_t);
+    data.SysMemSlicePitch = SIZE * SIZE * 4 * sizeof(uint16_t);
+    OK_OR_THROW(
+        device->CreateTexture3D(&desc, &data, &mTexture), "Failed to create color LUT texture."
+    );
+    OK_OR_THROW(
+        device->CreateShaderResourceView(mTexture.Get(), nullptr, &mView),
+        "Failed to create color LUT resource view."
+    );
+}
+
+ColorLut::Color ColorLut::ApplyCube(const Color& color) const {
+    uint32_t base[3];
+    float fraction[3];
+    for (int c = 0; c < 3; c++) {
+        float position = (color[c] - mDomainMin[c]) / (mDomainMax[c] - mDomainMin[c]);
+        position = std::clamp(position, 0.f, 1.f) * (mCubeSize - 1);
+        base[c] = std::min((uint32_t)position, mCubeSize - 2);
+        fraction[c] = position - base[c];
+    }
+
+    Color result = { 0.f, 0.f, 0.f };
+    for (uint32_t corner = 0; corner < 8; corner++) {
+        float weight = 1.f;
+        uint32_t index[3];
+        for (int c = 0; c < 3; c++) {
+            uint32_t upper = (corner >> c) & 1;
+            index[c] = base[c] + upper;
+            weight *= upper ? fraction[c] : 1.f - fraction[c];
+        }
+        const Color& entry = mCube[(index[2] * mCubeSize + index[1]) * mCubeSize + index[0]];
+        for (int c = 0; c < 3; c++) {
+            result[c] += entry[c] * weight;
+        }
+    }
+    return result;
+}
+
+// Adobe / Resolve .cube format: keywords, then the entries one per line
+void ColorLut::LoadCube(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) {
+        throw MakeException("Failed to open %s", path.c_str());
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream stream(line);
+        std::string keyword;
+        if (!(stream >> keyword) || keyword[0] == '#') {
+            continue;
+        }
+
+        if (keyword == "LUT_3D_SIZE") {
+            stream >> mCubeSize;
+        } else if (keyword == "LUT_1D_SIZE") {
+            throw MakeException("%s: 1D LUTs aren't supported", path.c_str());
+        } else if (keyword == "DOMAIN_MIN") {
+            stream >> mDomainMin[0] >> mDomainMin[1] >> mDomainMin[2];
+        } else if (keyword == "DOMAIN_MAX") {
+            stream >> mDomainMax[0] >> mDomainMax[1] >> mDomainMax[2];
+        } else {
+            // An entry, or a keyword this doesn't use like TITLE
+            char* end = nullptr;
+            Color entry;
+            entry[0] = std::strtof(keyword.c_str(), &end);
+            if (end == keyword.c_str()) {
+                continue;
+            }
+            if (!(stream >> entry[1] >> entry[2])) {
+                throw MakeException("%s: invalid entry \"%s\"", path.c_str(), line.c_str());
+            }
+            mCube.push_back(entry);
+        }
+    }
+
+    if (mCubeSize < 2 || mCube.size() != (size_t)mCubeSize * mCubeSize * mCubeSize) {
+        throw MakeException(
+            "%s: %zu entries for a size of %u", path.c_str(), mCube.size(), mCubeSize
+        );
+    }
+    for (int c = 0; c < 3; c++) {
+        if (mDomainMax[c] <= mDomainMin[c]) {
+            throw MakeException("%s: empty domain", path.c_str());
+        }
+    }
+    Info("Loaded color LUT %s, %u points per axis\n", path.c_str(), mCubeSize);
+}
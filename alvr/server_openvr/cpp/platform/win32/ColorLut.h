@@ -0,0 +1,42 @@
+#pragma once
+
+#include "d3d-render-utils/RenderUtils.h"
+
+#include <array>
+
+// The per-pixel color transform of the post-processing as a 3D LUT, sampled once per pixel by the
+// fused pass instead of evaluating each adjustment. It bakes the brightness, contrast, saturation
+// and gamma of the color correction, then the .cube file of m_colorLutPath. Sharpening reads the
+// neighbors, it stays in the shader before the lookup.
+class ColorLut {
+public:
+    // Points per axis, .cube files of another size are resampled
+    static const uint32_t SIZE = 33;
+
+    // Whether the settings have anything to bake
+    static bool IsEnabled();
+
+    // linearLight is set when the pass samples an sRGB composition texture as linear values, the
+    // .cube file is then applied to sRGB encoded ones. Throws if the file can't be loaded
+    ColorLut(ID3D11Device* device, bool linearLight);
+
+    // RGBA 16 bit 3D texture, indexed with the square root of the color to have more points in
+    // the dark, where gamma curves are steep
+    ID3D11ShaderResourceView* GetView() { return mView.Get(); }
+
+private:
+    typedef std::array<float, 3> Color;
+
+    // Trilinear lookup in the .cube file
+    Color ApplyCube(const Color& color) const;
+    void LoadCube(const std::string& path);
+
+    uint32_t mCubeSize = 0;
+    Color mDomainMin = { 0.f, 0.f, 0.f };
+    Color mDomainMax = { 1.f, 1.f, 1.f };
+    // Red changes fastest, like in the file
+    std::vector<Color> mCube;
+
+    Microsoft::WRL::ComPtr<ID3D11Texture3D> mTexture;
+    Microsoft::WRL::ComPtr<ID3D11ShaderResourceView> mView;
+};
@@ -1,5 +1,6 @@
 #include "../../alvr_server/bindings.h"
 
+#include "../../alvr_server/FlightRecorder.h"
 #include "../../alvr_server/Logger.h"
 #include "../../shared/backward.hpp"
 #include <Windows.h>
@@ -15,6 +16,8 @@ static LONG WINAPI handler(PEXCEPTION_POINTERS ptrs) {
     std::string str = stream.str();
     Error("Unhandled exception: %X\n%s", ptrs->ExceptionRecord->ExceptionCode, str.c_str());
 
+    FlightRecorder::Instance().DumpOnCrash();
+
     Sleep(2000);
 
     return EXCEPTION_EXECUTE_HANDLER;
@@ -0,0 +1,326 @@
+#include "alvr_server/EncodeBenchmark.h"
+
+#include "CEncoder.h"
+#include "FrameRender.h"
+#include "GpuTimestamps.h"
+#include "OvrDirectModeComponent.h"
+#include "VideoEncoder.h"
+#include "VideoEncoderAMF.h"
+#include "VideoEncoderNVENC.h"
+#include "alvr_server/FrameTrace.h"
+#include "alvr_server/Logger.h"
+#include "alvr_server/PoseHistory.h"
+#include "alvr_server/Settings.h"
+#include "alvr_server/Utils.h"
+#include <stdexcept>
+#ifdef ALVR_GPL
+#include "VideoEncoderQSV.h"
+#include "VideoEncoderSW.h"
+#endif
+
+namespace {
+
+// Plays the part of vrcompositor: each frame is uploaded to a layer texture and submitted with
+// identity poses, then composited, copied and encoded as in OvrDirectModeComponent and CEncoder
+class Win32EncodeBenchmarkTarget : public EncodeBenchmarkTarget {
+public:
+    explicit Win32EncodeBenchmarkTarget(FfiEncodeBenchmarkBackend backend) {
+        if (backend == ENCODE_BENCHMARK_BACKEND_VAAPI) {
+            throw std::runtime_error("VAAPI is only available on Linux, use AMF");
+        }
+
+        mD3DRender = std::make_shared<CD3DRender>();
+        if (!mD3DRender->Initialize(Settings::Instance().m_nAdapterIndex)) {
+            throw MakeException(
+                "Could not create graphics device for adapter %d",
+                Settings::Instance().m_nAdapterIndex
+            );
+        }
+
+        mFrameRender = std::make_shared<FrameRender>(mD3DRender);
+        if (!mFrameRender->Startup()) {
+            throw std::runtime_error("Failed to start the compositor");
+        }
+        mGpuTimestamps
+            = std::make_unique<GpuTimestamps>(mD3DRender->GetDevice(), mD3DRender->GetContext());
+
+        createLayer();
+
+        uint32_t width, height;
+        mFrameRender->GetEncodingResolution(&width, &height);
+        mVideoEncoder = createEncoder(backend, width, height);
+
+        D3D11_TEXTURE2D_DESC desc;
+        mFrameRender->GetTexture()->GetDesc(&desc);
+        // Same as CEncoder, the encoders read the raw values of the copy
+        if (desc.Format == DXGI_FORMAT_R8G8B8A8_UNORM_SRGB) {
+            desc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+        }
+        HRESULT hr = mD3DRender->GetDevice()->CreateTexture2D(&desc, NULL, &mInputTexture);
+        if (FAILED(hr)) {
+            throw MakeException("CreateTexture2D failed %p %ls", hr, GetErrorStr(hr).c_str());
+        }
+        // Frames are encoded one at a time, a single slot is enough
+        ID3D11Texture2D* texture = mInputTexture.Get();
+        mVideoEncoder->RegisterInputTextures({ texture });
+    }
+
+    ~Win32EncodeBenchmarkTarget() {
+        if (mVideoEncoder) {
+            mVideoEncoder->Shutdown();
+        }
+    }
+
+    void EncodeFrame(const uint8_t* rgba, uint64_t targetTimestampNs, bool idr) override {
+        auto context = mD3DRender->GetContext();
+        context->UpdateSubresource(
+            mLayerTexture.Get(), 0, nullptr, rgba, Settings::Instance().m_renderWidth * 4, 0
+        );
+
+        // Side by side eyes, as SteamVR submits them
+        ID3D11ShaderResourceView* views[1][2] = { { mLayerView.Get(), mLayerView.Get() } };
+        vr::VRTextureBounds_t bounds[1][2]
+            = { { { 0.f, 0.f, 0.5f, 1.f }, { 0.5f, 0.f, 1.f, 1.f } } };
+        vr::HmdMatrix34_t poses[1];
+        HmdMatrix_SetIdentity(&poses[0]);
+
+        mGpuTimestamps->Begin(targetTimestampNs);
+        mFrameRender->RenderFrame(views, bounds, poses, poses[0], 1, false, "", "");
+        mGpuTimestamps->End();
+        context->CopyResource(mInputTexture.Get(), mFrameRender->GetTexture().Get());
+
+        FrameTrace::Instance().Record(targetTimestampNs, FRAME_TRACE_ENCODE_SUBMIT);
+        mVideoEncoder->Transmit(mInputTexture.Get(), targetTimestampNs, targetTimestampNs, idr);
+    }
+
+    std::string GetAdapterId() override {
+        return VideoEncoder::GetAdapterId(mD3DRender->GetDevice());
+    }
+
+private:
+    void createLayer() {
+        D3D11_TEXTURE2D_DESC desc = {};
+        desc.Width = Settings::Instance().m_renderWidth;
+        desc.Height = Settings::Instance().m_renderHeight;
+        // sRGB like the usual swapchains, so that the compositor doesn't adjust the colors
+        desc.Format = DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.SampleDesc.Count = 1;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+
+        HRESULT hr = mD3DRender->GetDevice()->CreateTexture2D(&desc, NULL, &mLayerTexture);
+        if (FAILED(hr)) {
+            throw MakeException("CreateTexture2D failed %p %ls", hr, GetErrorStr(hr).c_str());
+        }
+        hr = mD3DRender->GetDevice()->CreateShaderResourceView(
+            mLayerTexture.Get(), NULL, &mLayerView
+        );
+        if (FAILED(hr)) {
+            throw MakeException(
+                "CreateShaderResourceView failed %p %ls", hr, GetErrorStr(hr).c_str()
+            );
+        }
+    }
+
+    // Same order as CEncoder::Initialize for the automatic choice
+    std::shared_ptr<VideoEncoder>
+    createEncoder(FfiEncodeBenchmarkBackend backend, uint32_t width, uint32_t height) {
+        std::shared_ptr<VideoEncoder> encoder;
+        switch (backend) {
+        case ENCODE_BENCHMARK_BACKEND_AMF:
+            encoder = std::make_shared<VideoEncoderAMF>(mD3DRender, width, height);
+            break;
+        case ENCODE_BENCHMARK_BACKEND_NVENC:
+            encoder = std::make_shared<VideoEncoderNVENC>(mD3DRender, width, height);
+            break;
+        case ENCODE_BENCHMARK_BACKEND_QSV:
+#ifdef ALVR_GPL
+            encoder = std::make_shared<VideoEncoderQSV>(mD3DRender, width, height);
+            break;
+#else
+            throw std::runtime_error("The QSV encoder needs a build with the gpl feature");
+#endif
+        case ENCODE_BENCHMARK_BACKEND_SOFTWARE:
+#ifdef ALVR_GPL
+            encoder = std::make_shared<VideoEncoderSW>(mD3DRender, width, height);
+            break;
+#else
+            throw std::runtime_error("The software encoder needs a build with the gpl feature");
+#endif
+        default:
+            return createAutoEncoder(width, height);
+        }
+
+        encoder->Initialize();
+        return encoder;
+    }
+
+    std::shared_ptr<VideoEncoder> createAutoEncoder(uint32_t width, uint32_t height) {
+        Exception vceException;
+        Exception nvencException;
+        try {
+            auto encoder = std::make_shared<VideoEncoderAMF>(mD3DRender, width, height);
+            encoder->Initialize();
+            Info("Using AMF encoder\n");
+            return encoder;
+        } catch (Exception e) {
+            vceException = e;
+        }
+        try {
+            auto encoder = std::make_shared<VideoEncoderNVENC>(mD3DRender, width, height);
+            encoder->Initialize();
+            Info("Using NVENC encoder\n");
+            return encoder;
+        } catch (Exception e) {
+            nvencException = e;
+        }
+#ifdef ALVR_GPL
+        Exception qsvException;
+        try {
+            auto encoder = std::make_shared<VideoEncoderQSV>(mD3DRender, width, height);
+            encoder->Initialize();
+            Info("Using QSV encoder\n");
+            return encoder;
+        } catch (Exception e) {
+            qsvException = e;
+        }
+        try {
+            auto encoder = std::make_shared<VideoEncoderSW>(mD3DRender, width, height);
+            encoder->Initialize();
+            Info("Using SW encoder\n");
+            return encoder;
+        } catch (Exception e) {
+            throw MakeException(
+                "All VideoEncoder are not available. VCE: %s, NVENC: %s, QSV: %s, SW: %s",
+                vceException.what(),
+                nvencException.what(),
+                qsvException.what(),
+                e.what()
+            );
+        }
+#else
+        throw MakeException(
+            "All VideoEncoder are not available. VCE: %s, NVENC: %s",
+            vceException.what(),
+            nvencException.what()
+        );
+#endif
+    }
+
+    std::shared_ptr<CD3DRender> mD3DRender;
+    std::shared_ptr<FrameRender> mFrameRender;
+    std::unique_ptr<GpuTimestamps> mGpuTimestamps;
+    std::shared_ptr<VideoEncoder> mVideoEncoder;
+    ComPtr<ID3D11Texture2D> mLayerTexture;
+    ComPtr<ID3D11ShaderResourceView> mLayerView;
+    ComPtr<ID3D11Texture2D> mInputTexture;
+};
+
+// Plays the part of SteamVR instead: the frames are uploaded to a swap texture set of
+// OvrDirectModeComponent, then submitted and presented with the pose of their timestamp. CEncoder
+// composites and encodes them on its thread, as when streaming
+class Win32DriverPathTarget : public EncodeBenchmarkTarget {
+public:
+    explicit Win32DriverPathTarget(FfiEncodeBenchmarkBackend backend) {
+        if (backend != ENCODE_BENCHMARK_BACKEND_AUTO
+            && backend != ENCODE_BENCHMARK_BACKEND_SOFTWARE) {
+            throw std::runtime_error(
+                "The driver picks its encoder as configured, only auto or software can be asked for"
+            );
+        }
+
+        mD3DRender = std::make_shared<CD3DRender>();
+        if (!mD3DRender->Initialize(Settings::Instance().m_nAdapterIndex)) {
+            throw MakeException(
+                "Could not create graphics device for adapter %d",
+                Settings::Instance().m_nAdapterIndex
+            );
+        }
+
+        mPoseHistory = std::make_shared<PoseHistory>();
+        mEncoder = std::make_shared<CEncoder>(mPoseHistory);
+        mEncoder->Initialize(mD3DRender);
+        mEncoder->Start();
+        mEncoder->OnStreamStart();
+
+        mDirectMode = std::make_shared<OvrDirectModeComponent>(mD3DRender, mPoseHistory);
+        mDirectMode->SetEncoder(mEncoder);
+
+        // Side by side eyes in a single texture, as in Win32EncodeBenchmarkTarget
+        vr::IVRDriverDirectModeComponent::SwapTextureSetDesc_t desc = {};
+        desc.nWidth = Settings::Instance().m_renderWidth;
+        desc.nHeight = Settings::Instance().m_renderHeight;
+        desc.nFormat = DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
+        desc.nSampleCount = 1;
+        mDirectMode->CreateSwapTextureSet(GetCurrentProcessId(), &desc, &mSwapTextureSet);
+        for (int i = 0; i < 3; i++) {
+            // Opened on the same device, the way vrcompositor opens them on its own
+            mTextures[i] = mD3DRender->GetSharedTexture(
+                (HANDLE)mSwapTextureSet.rSharedTextureHandles[i]
+            );
+            if (!mTextures[i]) {
+                throw std::runtime_error("Failed to create the swap texture set");
+            }
+        }
+    }
+
+    ~Win32DriverPathTarget() {
+        if (mEncoder) {
+            mEncoder->Stop();
+        }
+        if (mDirectMode) {
+            mDirectMode->DestroyAllSwapTextureSets(GetCurrentProcessId());
+        }
+    }
+
+    void EncodeFrame(const uint8_t* rgba, uint64_t targetTimestampNs, bool idr) override {
+        // The pose is given to the pose history before SteamVR would get it
+        mPoseHistory->OnPoseUpdated(targetTimestampNs, BenchmarkHeadMotion(mFrameCount));
+        auto pose = mPoseHistory->GetLatestPose();
+        const int index = (int)(mFrameCount++ % 3);
+
+        mD3DRender->GetContext()->UpdateSubresource(
+            mTextures[index], 0, nullptr, rgba, Settings::Instance().m_renderWidth * 4, 0
+        );
+
+        if (idr) {
+            mEncoder->InsertIDR();
+        }
+
+        vr::IVRDriverDirectModeComponent::SubmitLayerPerEye_t perEye[2] = {};
+        for (int eye = 0; eye < 2; eye++) {
+            perEye[eye].hTexture = mSwapTextureSet.rSharedTextureHandles[index];
+            perEye[eye].bounds = { eye * 0.5f, 0.f, eye * 0.5f + 0.5f, 1.f };
+            perEye[eye].mHmdPose = pose->rotationMatrix;
+        }
+        mDirectMode->SubmitLayer(perEye);
+        mDirectMode->Present(mSwapTextureSet.rSharedTextureHandles[index]);
+    }
+
+    std::string GetAdapterId() override {
+        return VideoEncoder::GetAdapterId(mD3DRender->GetDevice());
+    }
+
+private:
+    std::shared_ptr<CD3DRender> mD3DRender;
+    std::shared_ptr<PoseHistory> mPoseHistory;
+    std::shared_ptr<CEncoder> mEncoder;
+    std::shared_ptr<OvrDirectModeComponent> mDirectMode;
+    vr::IVRDriverDirectModeComponent::SwapTextureSet_t mSwapTextureSet = {};
+    // Owned by the shared texture cache of mD3DRender
+    ID3D11Texture2D* mTextures[3] = {};
+    uint64_t mFrameCount = 0;
+};
+}
+
+std::unique_ptr<EncodeBenchmarkTarget>
+EncodeBenchmarkTarget::Create(FfiEncodeBenchmarkBackend backend) {
+    return std::make_unique<Win32EncodeBenchmarkTarget>(backend);
+}
+
+std::unique_ptr<EncodeBenchmarkTarget>
+EncodeBenchmarkTarget::CreateDriverPath(FfiEncodeBenchmarkBackend backend) {
+    return std::make_unique<Win32DriverPathTarget>(backend);
+}
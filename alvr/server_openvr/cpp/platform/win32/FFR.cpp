@@ -1,35 +1,62 @@
 #include "FFR.h"
 
+#include "alvr_server/FoveationCenter.h"
 #include "alvr_server/Settings.h"
 #include "alvr_server/Utils.h"
 #include "alvr_server/bindings.h"
+#include <algorithm>
 
 using Microsoft::WRL::ComPtr;
 using namespace d3d_render_utils;
 
 namespace {
+// Same as radial_foveation_params() of the client. Distances are relative to the distance from
+// the lens center to the edge of the eye along each axis: up to radialCenter in the encoded eye
+// the pixels are kept, after it the compression grows linearly to the edge ratio at the edges of
+// the eye, and more in the corners.
+FoveationVars CalculateRadialFoveationVars(float targetEyeWidth, float targetEyeHeight) {
+    float centerRadius = std::clamp(Settings::Instance().m_radialFoveationCenterRadius, 0.f, 0.9f);
+    float edgeRatio = std::max(Settings::Instance().m_radialFoveationEdgeRatio, 1.f);
+
+    float scale = (2.f + (edgeRatio - 1.f) * centerRadius) / (edgeRatio + 1.f);
+    float center = centerRadius / scale;
+    float curve = (1.f - scale) / ((1.f - center) * (1.f - center));
+
+    float optimizedEyeWidth = scale * targetEyeWidth;
+    float optimizedEyeHeight = scale * targetEyeHeight;
+    auto optimizedEyeWidthAligned = (uint32_t)ceil(optimizedEyeWidth / 32.f) * 32;
+    auto optimizedEyeHeightAligned = (uint32_t)ceil(optimizedEyeHeight / 32.f) * 32;
 
-struct FoveationVars {
-    uint32_t targetEyeWidth;
-    uint32_t targetEyeHeight;
-    uint32_t optimizedEyeWidth;
-    uint32_t optimizedEyeHeight;
-
-    float eyeWidthRatio;
-    float eyeHeightRatio;
-
-    float centerSizeX;
-    float centerSizeY;
-    float centerShiftX;
-    float centerShiftY;
-    float edgeRatioX;
-    float edgeRatioY;
-};
+    float lensU[2];
+    float lensV[2];
+    FoveationCenter::Instance().GetLensCenter(lensU, lensV);
+
+    FoveationVars vars = {};
+    vars.targetEyeWidth = (uint32_t)targetEyeWidth;
+    vars.targetEyeHeight = (uint32_t)targetEyeHeight;
+    vars.optimizedEyeWidth = optimizedEyeWidthAligned;
+    vars.optimizedEyeHeight = optimizedEyeHeightAligned;
+    vars.eyeWidthRatio = optimizedEyeWidth / optimizedEyeWidthAligned;
+    vars.eyeHeightRatio = optimizedEyeHeight / optimizedEyeHeightAligned;
+    vars.lensCenter[0] = lensU[0];
+    vars.lensCenter[1] = lensV[0];
+    vars.lensCenter[2] = lensU[1];
+    vars.lensCenter[3] = lensV[1];
+    vars.radialScale = scale;
+    vars.radialCenter = center;
+    vars.radialCurve = curve;
+    return vars;
+}
+}
 
 FoveationVars CalculateFoveationVars() {
     float targetEyeWidth = (float)Settings::Instance().m_renderWidth / 2;
     float targetEyeHeight = (float)Settings::Instance().m_renderHeight;
 
+    if (Settings::Instance().m_enableRadialFoveation) {
+        return CalculateRadialFoveationVars(targetEyeWidth, targetEyeHeight);
+    }
+
     float centerSizeX = (float)Settings::Instance().m_foveationCenterSizeX;
     float centerSizeY = (float)Settings::Instance().m_foveationCenterSizeY;
     float centerShiftX = (float)Settings::Instance().m_foveationCenterShiftX;
@@ -77,8 +104,8 @@ FoveationVars CalculateFoveationVars() {
              centerShiftXAligned,
              centerShiftYAligned,
              edgeRatioX,
-             edgeRatioY };
-}
+             edgeRatioY,
+             {} };
 }
 
 void FFR::GetOptimizedResolution(uint32_t* width, uint32_t* height) {
@@ -90,9 +117,23 @@ void FFR::GetOptimizedResolution(uint32_t* width, uint32_t* height) {
 FFR::FFR(ID3D11Device* device)
     : mDevice(device) { }
 
-void FFR::Initialize(ID3D11Texture2D* compositionTexture) {
+void FFR::Initialize(ID3D11Texture2D* compositionTexture, ID3D11Buffer* foveationBuffer) {
     auto fovVars = CalculateFoveationVars();
-    ComPtr<ID3D11Buffer> foveatedRenderingBuffer = CreateBuffer(mDevice.Get(), fovVars);
+
+    if (Settings::Instance().m_enableRadialFoveation) {
+        mRadialPass = std::make_unique<FusedPostProcess>(mDevice.Get());
+        mRadialPass->Initialize(
+            compositionTexture,
+            fovVars.optimizedEyeWidth * 2,
+            fovVars.optimizedEyeHeight,
+            foveationBuffer,
+            nullptr,
+            nullptr,
+            false
+        );
+        mOptimizedTexture = mRadialPass->GetOutputTexture();
+        return;
+    }
 
     std::vector<uint8_t> quadShaderCSO(
         QUAD_SHADER_CSO_PTR, QUAD_SHADER_CSO_PTR + QUAD_SHADER_CSO_LEN
@@ -118,7 +159,7 @@ void FFR::Initialize(ID3D11Texture2D* compositionTexture) {
             mQuadVertexShader.Get(),
             compressAxisAlignedShaderCSO,
             mOptimizedTexture.Get(),
-            foveatedRenderingBuffer.Get()
+            foveationBuffer
         );
 
         mPipelines.push_back(compressAxisAlignedPipeline);
@@ -127,9 +168,12 @@ void FFR::Initialize(ID3D11Texture2D* compositionTexture) {
     }
 }
 
-void FFR::Render() {
+void FFR::Render(ID3D11DeviceContext* otherContext) {
+    if (mRadialPass) {
+        mRadialPass->Render(otherContext);
+    }
     for (auto& p : mPipelines) {
-        p.Render();
+        p.Render(otherContext);
     }
 }
 
@@ -1,13 +1,44 @@
 #pragma once
 
+#include "FusedPostProcess.h"
 #include "d3d-render-utils/RenderPipeline.h"
+#include <memory>
+
+struct FoveationVars {
+    uint32_t targetEyeWidth;
+    uint32_t targetEyeHeight;
+    uint32_t optimizedEyeWidth;
+    uint32_t optimizedEyeHeight;
+
+    float eyeWidthRatio;
+    float eyeHeightRatio;
+
+    float centerSizeX;
+    float centerSizeY;
+    float centerShiftX;
+    float centerShiftY;
+    float edgeRatioX;
+    float edgeRatioY;
+
+    // Radial foveation, in the UV of each eye measured from its outer edge: left eye in xy, right
+    // eye in zw
+    float lensCenter[4];
+    float radialScale;
+    float radialCenter;
+    float radialCurve;
+    float _padding;
+};
+
+// The lens center of the radial foveation follows the views reported by the client, the buffer
+// must be updated when FoveationCenter::GetViewsVersion() changes
+FoveationVars CalculateFoveationVars();
 
 class FFR {
 public:
     FFR(ID3D11Device* device);
-    void Initialize(ID3D11Texture2D* compositionTexture);
-    void Render();
-    void GetOptimizedResolution(uint32_t* width, uint32_t* height);
+    void Initialize(ID3D11Texture2D* compositionTexture, ID3D11Buffer* foveationBuffer);
+    void Render(ID3D11DeviceContext* otherContext = nullptr);
+    static void GetOptimizedResolution(uint32_t* width, uint32_t* height);
     ID3D11Texture2D* GetOutputTexture();
 
 private:
@@ -16,4 +47,6 @@ private:
     Microsoft::WRL::ComPtr<ID3D11VertexShader> mQuadVertexShader;
 
     std::vector<d3d_render_utils::RenderPipeline> mPipelines;
+    // The radial mapping only exists in the shader compiled at runtime
+    std::unique_ptr<FusedPostProcess> mRadialPass;
 };
@@ -1,13 +1,35 @@
 #include "FrameRender.h"
+#include "alvr_server/FoveationCenter.h"
 #include "alvr_server/Logger.h"
 #include "alvr_server/Settings.h"
 #include "alvr_server/Utils.h"
 #include "alvr_server/bindings.h"
+#include <cmath>
+#include <cstring>
 
 extern uint64_t g_DriverTestMode;
 
 using namespace d3d_render_utils;
 
+namespace {
+// Serves FrameRender.fx to the upscaling shader, the only file it includes
+class FrameRenderInclude : public ID3DInclude {
+public:
+    HRESULT __stdcall Open(
+        D3D_INCLUDE_TYPE type, LPCSTR fileName, LPCVOID parentData, LPCVOID* data, UINT* bytes
+    ) override {
+        if (strcmp(fileName, "FrameRender.fx") != 0) {
+            return E_FAIL;
+        }
+        *data = FRAME_RENDER_FX_PTR;
+        *bytes = FRAME_RENDER_FX_LEN;
+        return S_OK;
+    }
+
+    HRESULT __stdcall Close(LPCVOID data) override { return S_OK; }
+};
+}
+
 static const DirectX::XMFLOAT4X4 _identityMat = DirectX::XMFLOAT4X4(
     1.0f, 0.0f, 0.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f
 );
@@ -88,7 +110,26 @@ FrameRender::FrameRender(std::shared_ptr<CD3DRender> pD3DRender)
     m_viewProj[0] = { -1.0f, 1.0f, 1.0f, -1.0f };
     m_viewProj[1] = { -1.0f, 1.0f, 1.0f, -1.0f };
 
-    FrameRender::SetGpuPriority(m_pD3DRender->GetDevice());
+    const Settings& settings = Settings::Instance();
+    for (int srgb = 0; srgb < 2; srgb++) {
+        int inputColorAdjust = 0;
+        if (settings.m_enableHdr) {
+            if (srgb) {
+                inputColorAdjust = 1; // do sRGB manually
+            }
+            if (settings.m_forceHdrSrgbCorrection) {
+                inputColorAdjust = 1;
+            }
+        } else if (!srgb && !settings.m_forceHdrSrgbCorrection) {
+            inputColorAdjust = 2; // undo sRGB?
+        }
+        if (settings.m_clampHdrExtendedRange) {
+            inputColorAdjust |= 0x10; // Clamp values to 0.0 to 1.0
+        }
+        m_inputColorAdjust[srgb] = inputColorAdjust;
+    }
+
+    FrameRender::SetGpuPriority(m_pD3DRender->GetDevice(), settings.m_gpuPriority);
 }
 
 FrameRender::~FrameRender() { }
@@ -155,6 +196,19 @@ bool FrameRender::Startup() {
 
     m_pD3DRender->GetDevice()->CreateDepthStencilState(&depthStencilDesc, &m_depthStencilState);
 
+    if (Settings::Instance().m_hiddenAreaMaskRadius > 0.f) {
+        try {
+            m_hiddenAreaMask = std::make_unique<HiddenAreaMask>(
+                m_pD3DRender->GetDevice(),
+                Settings::Instance().m_renderWidth,
+                Settings::Instance().m_renderHeight,
+                Settings::Instance().m_hiddenAreaMaskRadius
+            );
+        } catch (Exception e) {
+            Warn("Hidden area mask not available: %s\n", e.what());
+        }
+    }
+
     // Left eye viewport
 
     m_viewportL.Width = (float)Settings::Instance().m_renderWidth / 2.0;
@@ -224,6 +278,42 @@ bool FrameRender::Startup() {
         return false;
     }
 
+    // Replaces the bilinear filtering of the layers, which is kept if it can't be built
+    if (Settings::Instance().m_edgeAdaptiveUpscaling) {
+        FrameRenderInclude include;
+        ComPtr<ID3DBlob> upscaleBlob;
+        ComPtr<ID3DBlob> errorBlob;
+        ComPtr<ID3D11PixelShader> upscaleShader;
+        hr = D3DCompile(
+            FRAME_UPSCALE_HLSL_PTR,
+            FRAME_UPSCALE_HLSL_LEN,
+            "FrameUpscalePS.hlsl",
+            nullptr,
+            &include,
+            "PSUpscale",
+            "ps_5_0",
+            D3DCOMPILE_OPTIMIZATION_LEVEL3,
+            0,
+            &upscaleBlob,
+            &errorBlob
+        );
+        if (SUCCEEDED(hr)) {
+            hr = m_pD3DRender->GetDevice()->CreatePixelShader(
+                upscaleBlob->GetBufferPointer(), upscaleBlob->GetBufferSize(), NULL, &upscaleShader
+            );
+        }
+        if (SUCCEEDED(hr)) {
+            m_pPixelShader = upscaleShader;
+            Info("Upscaling the layers along their edges\n");
+        } else {
+            Warn(
+                "Edge-adaptive upscaling not available %p %s\n",
+                hr,
+                errorBlob ? (const char*)errorBlob->GetBufferPointer() : ""
+            );
+        }
+    }
+
     //
     // Create input layout
     //
@@ -272,7 +362,7 @@ bool FrameRender::Startup() {
     D3D11_BUFFER_DESC bd;
     ZeroMemory(&bd, sizeof(bd));
     bd.Usage = D3D11_USAGE_DYNAMIC;
-    bd.ByteWidth = sizeof(SimpleVertex) * 8;
+    bd.ByteWidth = sizeof(SimpleVertex) * 8 * MAX_DRAWN_LAYERS;
     bd.BindFlags = D3D11_BIND_VERTEX_BUFFER;
     bd.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
 
@@ -387,26 +477,14 @@ bool FrameRender::Startup() {
 
     m_pStagingTexture = compositionTexture;
 
-    std::vector<uint8_t> quadShaderCSO(
-        QUAD_SHADER_CSO_PTR, QUAD_SHADER_CSO_PTR + QUAD_SHADER_CSO_LEN
-    );
-    ComPtr<ID3D11VertexShader> quadVertexShader
-        = CreateVertexShader(m_pD3DRender->GetDevice(), quadShaderCSO);
-
     enableColorCorrection = Settings::Instance().m_enableColorCorrection;
-    if (enableColorCorrection) {
-        std::vector<uint8_t> colorCorrectionShaderCSO(
-            COLOR_CORRECTION_CSO_PTR, COLOR_CORRECTION_CSO_PTR + COLOR_CORRECTION_CSO_LEN
-        );
+    enableFFE = Settings::Instance().m_enableFoveatedEncoding;
 
-        ComPtr<ID3D11Texture2D> colorCorrectedTexture = CreateTexture(
-            m_pD3DRender->GetDevice(),
-            Settings::Instance().m_renderWidth,
-            Settings::Instance().m_renderHeight,
-            Settings::Instance().m_enableHdr ? DXGI_FORMAT_R16G16B16A16_FLOAT
-                                             : DXGI_FORMAT_R8G8B8A8_UNORM_SRGB
-        );
+    uint32_t texWidth, texHeight;
+    GetEncodingResolution(&texWidth, &texHeight);
 
+    ComPtr<ID3D11Buffer> colorCorrectionBuffer;
+    if (enableColorCorrection) {
         struct ColorCorrection {
             float renderWidth;
             float renderHeight;
@@ -423,43 +501,11 @@ bool FrameRender::Startup() {
             Settings::Instance().m_saturation + 1.f,   Settings::Instance().m_gamma,
             Settings::Instance().m_sharpening
         };
-        ComPtr<ID3D11Buffer> colorCorrectionBuffer
-            = CreateBuffer(m_pD3DRender->GetDevice(), colorCorrectionStruct);
-
-        m_colorCorrectionPipeline = std::make_unique<RenderPipeline>(m_pD3DRender->GetDevice());
-        m_colorCorrectionPipeline->Initialize(
-            { m_pStagingTexture.Get() },
-            quadVertexShader.Get(),
-            colorCorrectionShaderCSO,
-            colorCorrectedTexture.Get(),
-            colorCorrectionBuffer.Get()
-        );
-
-        m_pStagingTexture = colorCorrectedTexture;
-    }
-
-    enableFFE = Settings::Instance().m_enableFoveatedEncoding;
-    if (enableFFE) {
-        m_ffr = std::make_unique<FFR>(m_pD3DRender->GetDevice());
-        m_ffr->Initialize(m_pStagingTexture.Get());
-
-        m_pStagingTexture = m_ffr->GetOutputTexture();
+        colorCorrectionBuffer = CreateBuffer(m_pD3DRender->GetDevice(), colorCorrectionStruct);
     }
 
+    ComPtr<ID3D11Buffer> yuvBuffer;
     if (Settings::Instance().m_enableHdr) {
-        std::vector<uint8_t> yuv420ShaderCSO(
-            RGBTOYUV420_CSO_PTR, RGBTOYUV420_CSO_PTR + RGBTOYUV420_CSO_LEN
-        );
-        uint32_t texWidth, texHeight;
-        GetEncodingResolution(&texWidth, &texHeight);
-
-        ComPtr<ID3D11Texture2D> yuvTexture = CreateTexture(
-            m_pD3DRender->GetDevice(),
-            texWidth,
-            texHeight,
-            Settings::Instance().m_use10bitEncoder ? DXGI_FORMAT_P010 : DXGI_FORMAT_NV12
-        );
-
         struct YUVParams {
             float offset[4];
             float yCoeff[4];
@@ -522,18 +568,137 @@ bool FrameRender::Startup() {
             paramStruct = paramStruct_bt2020_8bit_full;
         }
 
-        ComPtr<ID3D11Buffer> paramBuffer = CreateBuffer(m_pD3DRender->GetDevice(), paramStruct);
+        yuvBuffer = CreateBuffer(m_pD3DRender->GetDevice(), paramStruct);
+    }
+
+    // The color correction and the loaded LUT as a single lookup of the fused pass
+    ComPtr<ID3D11ShaderResourceView> colorLutView;
+    if (ColorLut::IsEnabled()) {
+        try {
+            D3D11_TEXTURE2D_DESC compositionDesc;
+            compositionTexture->GetDesc(&compositionDesc);
+            ColorLut colorLut(
+                m_pD3DRender->GetDevice(),
+                compositionDesc.Format == DXGI_FORMAT_R8G8B8A8_UNORM_SRGB
+            );
+            colorLutView = colorLut.GetView();
+        } catch (Exception e) {
+            Warn("Color LUT not available: %s\n", e.what());
+        }
+    }
+
+    if (enableColorCorrection || enableFFE || Settings::Instance().m_enableHdr || colorLutView) {
+        if (enableFFE) {
+            m_foveationViewsVersion = FoveationCenter::Instance().GetViewsVersion();
+            m_foveationBuffer = CreateBuffer(
+                m_pD3DRender->GetDevice(), CalculateFoveationVars(), D3D11_USAGE_DEFAULT
+            );
+        }
+
+        try {
+            auto fusedPostProcess = std::make_unique<FusedPostProcess>(m_pD3DRender->GetDevice());
+            fusedPostProcess->Initialize(
+                compositionTexture.Get(),
+                texWidth,
+                texHeight,
+                m_foveationBuffer.Get(),
+                colorCorrectionBuffer.Get(),
+                yuvBuffer.Get(),
+                Settings::Instance().m_use10bitEncoder,
+                colorLutView.Get()
+            );
+            m_fusedPostProcess = std::move(fusedPostProcess);
+            m_pStagingTexture = m_fusedPostProcess->GetOutputTexture();
+
+            Debug("Using fused post-processing pass\n");
+        } catch (Exception e) {
+            Warn("Fused post-processing not available, using separate passes: %s\n", e.what());
+        }
+    }
+
+    if (!m_fusedPostProcess) {
+        if (!Settings::Instance().m_colorLutPath.empty()) {
+            Warn("The color LUT file needs the fused post-processing pass, it isn't applied\n");
+        }
 
-        m_yuvPipeline = std::make_unique<RenderPipelineYUV>(m_pD3DRender->GetDevice());
-        m_yuvPipeline->Initialize(
-            { m_pStagingTexture.Get() },
-            quadVertexShader.Get(),
-            yuv420ShaderCSO,
-            yuvTexture.Get(),
-            paramBuffer.Get()
+        std::vector<uint8_t> quadShaderCSO(
+            QUAD_SHADER_CSO_PTR, QUAD_SHADER_CSO_PTR + QUAD_SHADER_CSO_LEN
         );
+        ComPtr<ID3D11VertexShader> quadVertexShader
+            = CreateVertexShader(m_pD3DRender->GetDevice(), quadShaderCSO);
+
+        if (enableColorCorrection) {
+            std::vector<uint8_t> colorCorrectionShaderCSO(
+                COLOR_CORRECTION_CSO_PTR, COLOR_CORRECTION_CSO_PTR + COLOR_CORRECTION_CSO_LEN
+            );
+
+            ComPtr<ID3D11Texture2D> colorCorrectedTexture = CreateTexture(
+                m_pD3DRender->GetDevice(),
+                Settings::Instance().m_renderWidth,
+                Settings::Instance().m_renderHeight,
+                Settings::Instance().m_enableHdr ? DXGI_FORMAT_R16G16B16A16_FLOAT
+                                                 : DXGI_FORMAT_R8G8B8A8_UNORM_SRGB
+            );
+
+            m_colorCorrectionPipeline
+                = std::make_unique<RenderPipeline>(m_pD3DRender->GetDevice());
+            m_colorCorrectionPipeline->Initialize(
+                { m_pStagingTexture.Get() },
+                quadVertexShader.Get(),
+                colorCorrectionShaderCSO,
+                colorCorrectedTexture.Get(),
+                colorCorrectionBuffer.Get()
+            );
+
+            m_pStagingTexture = colorCorrectedTexture;
+        }
+
+        if (enableFFE) {
+            m_ffr = std::make_unique<FFR>(m_pD3DRender->GetDevice());
+            m_ffr->Initialize(m_pStagingTexture.Get(), m_foveationBuffer.Get());
+
+            m_pStagingTexture = m_ffr->GetOutputTexture();
+        }
 
-        m_pStagingTexture = yuvTexture;
+        if (Settings::Instance().m_enableHdr) {
+            std::vector<uint8_t> yuv420ShaderCSO(
+                RGBTOYUV420_CSO_PTR, RGBTOYUV420_CSO_PTR + RGBTOYUV420_CSO_LEN
+            );
+
+            ComPtr<ID3D11Texture2D> yuvTexture = CreateTexture(
+                m_pD3DRender->GetDevice(),
+                texWidth,
+                texHeight,
+                Settings::Instance().m_use10bitEncoder ? DXGI_FORMAT_P010 : DXGI_FORMAT_NV12
+            );
+
+            m_yuvPipeline = std::make_unique<RenderPipelineYUV>(m_pD3DRender->GetDevice());
+            m_yuvPipeline->Initialize(
+                { m_pStagingTexture.Get() },
+                quadVertexShader.Get(),
+                yuv420ShaderCSO,
+                yuvTexture.Get(),
+                yuvBuffer.Get()
+            );
+
+            m_pStagingTexture = yuvTexture;
+        }
+    }
+
+    if (m_fusedPostProcess || enableColorCorrection || enableFFE
+        || Settings::Instance().m_enableHdr) {
+        ComPtr<ID3D11DeviceContext> deferredContext;
+        HRESULT hr = m_pD3DRender->GetDevice()->CreateDeferredContext(0, &deferredContext);
+        if (SUCCEEDED(hr)) {
+            RenderPostProcess(deferredContext.Get());
+            hr = deferredContext->FinishCommandList(FALSE, &m_postProcessCommandList);
+        }
+        if (FAILED(hr)) {
+            m_postProcessCommandList.Reset();
+            Warn(
+                "Failed to record the post-processing passes %p %ls\n", hr, GetErrorStr(hr).c_str()
+            );
+        }
     }
 
     Debug("Staging Texture created\n");
@@ -551,25 +716,38 @@ void FrameRender::SetViewParams(
     m_eyeToHead[0] = eyeToHeadLeft;
     m_viewProj[1] = projRight;
     m_eyeToHead[1] = eyeToHeadRight;
+
+    if (m_hiddenAreaMask) {
+        m_hiddenAreaMask->SetViews(m_viewProj);
+    }
 }
 
 bool FrameRender::RenderFrame(
-    ID3D11Texture2D* pTexture[][2],
+    ID3D11ShaderResourceView* pViews[][2],
     vr::VRTextureBounds_t bounds[][2],
     vr::HmdMatrix34_t poses[],
+    const vr::HmdMatrix34_t& targetPose,
     int layerCount,
     bool recentering,
     const std::string& message,
     const std::string& debugText
 ) {
-    // Set render target
-    m_pD3DRender->GetContext()->OMSetRenderTargets(1, m_pRenderTargetView.GetAddressOf(), NULL);
+    ContextLock lock(m_pD3DRender->GetContext());
 
-    m_pD3DRender->GetContext()->OMSetDepthStencilState(m_depthStencilState.Get(), 0);
+    // Set render target
+    if (m_hiddenAreaMask) {
+        m_hiddenAreaMask->Begin(m_pD3DRender->GetContext(), m_pRenderTargetView.Get());
+    } else {
+        m_pD3DRender->GetContext()->OMSetRenderTargets(
+            1, m_pRenderTargetView.GetAddressOf(), NULL
+        );
+        m_pD3DRender->GetContext()->OMSetDepthStencilState(m_depthStencilState.Get(), 0);
+    }
 
-    // Clear the back buffer
+    // Clear the back buffer. The layers aren't drawn in the hidden area, it stays black
     m_pD3DRender->GetContext()->ClearRenderTargetView(
-        m_pRenderTargetView.Get(), DirectX::Colors::MidnightBlue
+        m_pRenderTargetView.Get(),
+        m_hiddenAreaMask ? DirectX::Colors::Black : DirectX::Colors::MidnightBlue
     );
 
     // Overlay recentering texture on top of all layers.
@@ -578,6 +756,15 @@ bool FrameRender::RenderFrame(
         recenterLayer = layerCount;
         layerCount++;
     }
+    if (layerCount > MAX_DRAWN_LAYERS) {
+        layerCount = MAX_DRAWN_LAYERS;
+    }
+
+    // The vertices of all layers are uploaded at once, then each layer is drawn with its offset
+    SimpleVertex vertices[MAX_DRAWN_LAYERS][8];
+    ID3D11ShaderResourceView* layerViews[MAX_DRAWN_LAYERS][2];
+    int drawnLayers[MAX_DRAWN_LAYERS];
+    int drawnLayerCount = 0;
 
     // Set up our projection, HMD, and HMD-to-eye transforms once
     const auto nearZ = 0.001f;
@@ -602,28 +789,28 @@ bool FrameRender::RenderFrame(
         = DirectX::XMMatrixInverse(nullptr, HmdMatrix_AsDxMatPosOnly(m_eyeToHead[0]));
     DirectX::XMMATRIX hmdToEyeMatR
         = DirectX::XMMatrixInverse(nullptr, HmdMatrix_AsDxMatPosOnly(m_eyeToHead[1]));
-    DirectX::XMMATRIX hmdPoseForTargetTs
-        = HmdMatrix_AsDxMatOrientOnly(poses[0]); // Set to HmdMatrix_AsDxMat to debug the rendering
+    // Set to HmdMatrix_AsDxMat to debug the rendering
+    DirectX::XMMATRIX hmdPoseForTargetTs = HmdMatrix_AsDxMatOrientOnly(targetPose);
 
     // I think the negative Y basis is a handedness thing?
     DirectX::XMMATRIX identityMat = DirectX::XMLoadFloat4x4(&_identityMat);
 
     for (int i = 0; i < layerCount; i++) {
-        ID3D11Texture2D* textures[2];
+        ID3D11ShaderResourceView* views[2];
         vr::VRTextureBounds_t bound[2];
 
         if (i == recenterLayer) {
-            textures[0] = (ID3D11Texture2D*)m_recenterTexture.Get();
-            textures[1] = (ID3D11Texture2D*)m_recenterTexture.Get();
+            views[0] = m_recenterResourceView.Get();
+            views[1] = m_recenterResourceView.Get();
             bound[0].uMin = bound[0].vMin = bound[1].uMin = bound[1].vMin = 0.0f;
             bound[0].uMax = bound[0].vMax = bound[1].uMax = bound[1].vMax = 1.0f;
         } else {
-            textures[0] = pTexture[i][0];
-            textures[1] = pTexture[i][1];
+            views[0] = pViews[i][0];
+            views[1] = pViews[i][1];
             bound[0] = bounds[i][0];
             bound[1] = bounds[i][1];
         }
-        if (textures[0] == NULL || textures[1] == NULL) {
+        if (views[0] == NULL || views[1] == NULL) {
             Debug(
                 "Ignore NULL layer. layer=%d/%d%s%s\n",
                 i,
@@ -634,66 +821,14 @@ bool FrameRender::RenderFrame(
             continue;
         }
 
-        D3D11_TEXTURE2D_DESC srcDesc;
-        textures[0]->GetDesc(&srcDesc);
+        // The views are created along with the swap textures, only their format is needed here
+        D3D11_SHADER_RESOURCE_VIEW_DESC SRVDesc;
+        views[0]->GetDesc(&SRVDesc);
 
-        D3D11_SHADER_RESOURCE_VIEW_DESC SRVDesc = {};
-        SRVDesc.Format = srcDesc.Format;
-        SRVDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
-        SRVDesc.Texture2D.MostDetailedMip = 0;
-        SRVDesc.Texture2D.MipLevels = 1;
-
-        ComPtr<ID3D11ShaderResourceView> pShaderResourceView[2];
-
-        HRESULT hr = m_pD3DRender->GetDevice()->CreateShaderResourceView(
-            textures[0], &SRVDesc, pShaderResourceView[0].ReleaseAndGetAddressOf()
-        );
-        if (FAILED(hr)) {
-            Error("CreateShaderResourceView %p %ls\n", hr, GetErrorStr(hr).c_str());
-            return false;
-        }
-        hr = m_pD3DRender->GetDevice()->CreateShaderResourceView(
-            textures[1], &SRVDesc, pShaderResourceView[1].ReleaseAndGetAddressOf()
-        );
-        if (FAILED(hr)) {
-            Error("CreateShaderResourceView %p %ls\n", hr, GetErrorStr(hr).c_str());
-            return false;
-        }
-
-        if (i == 0) {
-            m_pD3DRender->GetContext()->OMSetBlendState(m_pBlendStateFirst.Get(), NULL, 0xffffffff);
-        } else {
-            m_pD3DRender->GetContext()->OMSetBlendState(m_pBlendState.Get(), NULL, 0xffffffff);
-        }
-
-        int inputColorAdjust = 0;
-        if (Settings::Instance().m_enableHdr) {
-            if (SRVDesc.Format == DXGI_FORMAT_R8G8B8A8_UNORM_SRGB
-                || SRVDesc.Format == DXGI_FORMAT_B8G8R8A8_UNORM_SRGB
-                || SRVDesc.Format == DXGI_FORMAT_B8G8R8X8_UNORM_SRGB) {
-                inputColorAdjust = 1; // do sRGB manually
-            }
-            if (Settings::Instance().m_forceHdrSrgbCorrection) {
-                inputColorAdjust = 1;
-            }
-            if (Settings::Instance().m_clampHdrExtendedRange) {
-                inputColorAdjust |= 0x10; // Clamp values to 0.0 to 1.0
-            }
-        } else {
-            if (SRVDesc.Format != DXGI_FORMAT_R8G8B8A8_UNORM_SRGB
-                && SRVDesc.Format != DXGI_FORMAT_B8G8R8A8_UNORM_SRGB
-                && SRVDesc.Format != DXGI_FORMAT_B8G8R8X8_UNORM_SRGB) {
-                inputColorAdjust = 2; // undo sRGB?
-
-                if (Settings::Instance().m_forceHdrSrgbCorrection) {
-                    inputColorAdjust = 0;
-                }
-            }
-
-            if (Settings::Instance().m_clampHdrExtendedRange) {
-                inputColorAdjust |= 0x10; // Clamp values to 0.0 to 1.0
-            }
-        }
+        const bool srgb = SRVDesc.Format == DXGI_FORMAT_R8G8B8A8_UNORM_SRGB
+            || SRVDesc.Format == DXGI_FORMAT_B8G8R8A8_UNORM_SRGB
+            || SRVDesc.Format == DXGI_FORMAT_B8G8R8X8_UNORM_SRGB;
+        const int inputColorAdjust = m_inputColorAdjust[srgb];
 
         //
         // Update uv-coordinates in vertex buffer according to bounds.
@@ -771,7 +906,7 @@ bool FrameRender::RenderFrame(
 
         // We discard the z value because we never want any clipping,
         // but we do want the w value for perspective correction.
-        SimpleVertex vertices[] = {
+        SimpleVertex layerVertices[] = {
             // Left View
             { DirectX::XMFLOAT4(vertsL[0].x, vertsL[0].y, 0.5, vertsL[0].w),
               DirectX::XMFLOAT2(bound[0].uMin, bound[0].vMax),
@@ -800,25 +935,32 @@ bool FrameRender::RenderFrame(
               1 + (inputColorAdjust * 2) },
         };
 
+        memcpy(vertices[drawnLayerCount], layerVertices, sizeof(layerVertices));
+        layerViews[drawnLayerCount][0] = views[0];
+        layerViews[drawnLayerCount][1] = views[1];
+        drawnLayers[drawnLayerCount] = i;
+        drawnLayerCount++;
+    }
+
+    if (drawnLayerCount > 0) {
         D3D11_MAPPED_SUBRESOURCE mapped = { 0 };
-        hr = m_pD3DRender->GetContext()->Map(
+        HRESULT hr = m_pD3DRender->GetContext()->Map(
             m_pVertexBuffer.Get(), 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped
         );
         if (FAILED(hr)) {
             Error("Map %p %ls\n", hr, GetErrorStr(hr).c_str());
             return false;
         }
-        memcpy(mapped.pData, vertices, sizeof(vertices));
+        memcpy(mapped.pData, vertices, sizeof(vertices[0]) * drawnLayerCount);
 
         m_pD3DRender->GetContext()->Unmap(m_pVertexBuffer.Get(), 0);
 
-        // Set the input layout
-        m_pD3DRender->GetContext()->IASetInputLayout(m_pVertexLayout.Get());
-
         //
-        // Set buffers
+        // Set buffers and shaders once for all layers
         //
 
+        m_pD3DRender->GetContext()->IASetInputLayout(m_pVertexLayout.Get());
+
         UINT stride = sizeof(SimpleVertex);
         UINT offset = 0;
         m_pD3DRender->GetContext()->IASetVertexBuffers(
@@ -831,50 +973,56 @@ bool FrameRender::RenderFrame(
             0, 1, m_pFrameRenderCBuffer.GetAddressOf()
         );
 
-        //
-        // Set shaders
-        //
-
         m_pD3DRender->GetContext()->VSSetShader(m_pVertexShader.Get(), nullptr, 0);
         m_pD3DRender->GetContext()->PSSetShader(m_pPixelShader.Get(), nullptr, 0);
 
-        ID3D11ShaderResourceView* shaderResourceView[2]
-            = { pShaderResourceView[0].Get(), pShaderResourceView[1].Get() };
-        m_pD3DRender->GetContext()->PSSetShaderResources(0, 2, shaderResourceView);
-
         m_pD3DRender->GetContext()->PSSetSamplers(0, 1, m_pSamplerLinear.GetAddressOf());
+    }
 
-        //
-        // Draw
-        //
+    //
+    // Draw
+    //
 
-        // Left eye
-        m_pD3DRender->GetContext()->RSSetViewports(1, &m_viewportL);
-        m_pD3DRender->GetContext()->RSSetScissorRects(1, &m_scissorL);
-        m_pD3DRender->GetContext()->DrawIndexed(VERTEX_INDEX_COUNT / 2, 0, 0);
+    // The eyes don't overlap, so each one gets all of its layers in order with its viewport set
+    // once, rather than switching viewports for every layer
+    for (int eye = 0; eye < 2; eye++) {
+        m_pD3DRender->GetContext()->RSSetViewports(1, eye == 0 ? &m_viewportL : &m_viewportR);
+        m_pD3DRender->GetContext()->RSSetScissorRects(1, eye == 0 ? &m_scissorL : &m_scissorR);
+
+        for (int l = 0; l < drawnLayerCount; l++) {
+            if (l == 0 || drawnLayers[l - 1] == 0) {
+                ID3D11BlendState* blendState
+                    = drawnLayers[l] == 0 ? m_pBlendStateFirst.Get() : m_pBlendState.Get();
+                m_pD3DRender->GetContext()->OMSetBlendState(blendState, NULL, 0xffffffff);
+            }
 
-        // Right eye
-        m_pD3DRender->GetContext()->RSSetViewports(1, &m_viewportR);
-        m_pD3DRender->GetContext()->RSSetScissorRects(1, &m_scissorR);
-        m_pD3DRender->GetContext()->DrawIndexed(
-            VERTEX_INDEX_COUNT / 2, (VERTEX_INDEX_COUNT / 2), 0
-        );
+            m_pD3DRender->GetContext()->PSSetShaderResources(0, 2, layerViews[l]);
+            m_pD3DRender->GetContext()->DrawIndexed(
+                VERTEX_INDEX_COUNT / 2, eye * (VERTEX_INDEX_COUNT / 2), l * 8
+            );
+        }
     }
 
     // Restore full viewport/scissor rect for the rest
     m_pD3DRender->GetContext()->RSSetViewports(1, &m_viewport);
     m_pD3DRender->GetContext()->RSSetScissorRects(1, &m_scissor);
 
-    if (enableColorCorrection) {
-        m_colorCorrectionPipeline->Render();
-    }
-
-    if (enableFFE) {
-        m_ffr->Render();
+    if (Settings::Instance().m_enableRadialFoveation && m_foveationBuffer) {
+        uint32_t viewsVersion = FoveationCenter::Instance().GetViewsVersion();
+        if (viewsVersion != m_foveationViewsVersion) {
+            // The client undoes the compression around the lens center of the views it reported
+            m_foveationViewsVersion = viewsVersion;
+            auto foveationVars = CalculateFoveationVars();
+            UpdateBuffer(m_pD3DRender->GetContext(), m_foveationBuffer.Get(), &foveationVars);
+        }
     }
 
-    if (Settings::Instance().m_enableHdr) {
-        m_yuvPipeline->Render();
+    if (m_postProcessCommandList) {
+        // The composition sets all of its state at the start of each frame, so there is no need to
+        // save and restore the context state around the list
+        m_pD3DRender->GetContext()->ExecuteCommandList(m_postProcessCommandList.Get(), FALSE);
+    } else {
+        RenderPostProcess(m_pD3DRender->GetContext());
     }
 
     m_pD3DRender->GetContext()->Flush();
@@ -882,11 +1030,118 @@ bool FrameRender::RenderFrame(
     return true;
 }
 
+void FrameRender::RenderPostProcess(ID3D11DeviceContext* context) {
+    if (m_fusedPostProcess) {
+        m_fusedPostProcess->Render(context);
+    } else {
+        if (enableColorCorrection) {
+            m_colorCorrectionPipeline->Render(context);
+        }
+
+        if (enableFFE) {
+            m_ffr->Render(context);
+        }
+
+        if (Settings::Instance().m_enableHdr) {
+            m_yuvPipeline->Render(context);
+        }
+    }
+}
+
+bool FrameRender::GetPassthrough(
+    ID3D11ShaderResourceView* pViews[][2],
+    vr::VRTextureBounds_t bounds[][2],
+    vr::HmdMatrix34_t poses[],
+    const vr::HmdMatrix34_t& targetPose,
+    int layerCount,
+    bool recentering,
+    Passthrough& passthrough
+) {
+    auto check = [&]() {
+        // The post-processing passes and the HDR conversion read the composition texture, the
+        // hidden area is masked while compositing
+        if (layerCount != 1 || recentering || m_fusedPostProcess || enableColorCorrection
+            || enableFFE || Settings::Instance().m_enableHdr || m_hiddenAreaMask) {
+            return false;
+        }
+        // Otherwise the layer is turned to the newer pose
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                if (poses[0].m[i][j] != targetPose.m[i][j]) {
+                    return false;
+                }
+            }
+        }
+
+        const UINT eyeWidth = Settings::Instance().m_renderWidth / 2;
+        const UINT eyeHeight = Settings::Instance().m_renderHeight;
+        for (int eye = 0; eye < 2; eye++) {
+            ID3D11ShaderResourceView* view = pViews[0][eye];
+            if (view == NULL) {
+                return false;
+            }
+            // Sampled as sRGB and written to the sRGB composition texture, the values are kept.
+            // The layers read as linear or in BGRA order are converted
+            D3D11_SHADER_RESOURCE_VIEW_DESC viewDesc;
+            view->GetDesc(&viewDesc);
+            if (viewDesc.Format != DXGI_FORMAT_R8G8B8A8_UNORM_SRGB
+                || viewDesc.ViewDimension != D3D11_SRV_DIMENSION_TEXTURE2D
+                || (m_inputColorAdjust[1] & ~0x10) != 0) {
+                return false;
+            }
+
+            ComPtr<ID3D11Resource> resource;
+            view->GetResource(&resource);
+            if (FAILED(resource.As(&passthrough.textures[eye]))) {
+                return false;
+            }
+            D3D11_TEXTURE2D_DESC desc;
+            passthrough.textures[eye]->GetDesc(&desc);
+            if (desc.SampleDesc.Count != 1) {
+                return false;
+            }
+
+            // The region must be whole texels of the size of the eye, flipped or offset bounds
+            // are resampled
+            const vr::VRTextureBounds_t& bound = bounds[0][eye];
+            const float left = bound.uMin * desc.Width;
+            const float top = bound.vMin * desc.Height;
+            D3D11_BOX& box = passthrough.boxes[eye];
+            box.left = (UINT)std::lround(left);
+            box.top = (UINT)std::lround(top);
+            box.right = (UINT)std::lround(bound.uMax * desc.Width);
+            box.bottom = (UINT)std::lround(bound.vMax * desc.Height);
+            box.front = 0;
+            box.back = 1;
+            if (left < 0.0f || top < 0.0f || std::abs(left - box.left) > 0.01f
+                || std::abs(top - box.top) > 0.01f || box.right != box.left + eyeWidth
+                || box.bottom != box.top + eyeHeight || box.right > desc.Width
+                || box.bottom > desc.Height) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    const bool passingThrough = check();
+    if (passingThrough != m_passingThrough) {
+        m_passingThrough = passingThrough;
+        Info(
+            passingThrough ? "FrameRender: Passing the game layer through to the encoder\n"
+                           : "FrameRender: Compositing the layers\n"
+        );
+    }
+    if (!passingThrough) {
+        passthrough = {};
+    }
+    return passingThrough;
+}
+
 ComPtr<ID3D11Texture2D> FrameRender::GetTexture() { return m_pStagingTexture; }
 
 void FrameRender::GetEncodingResolution(uint32_t* width, uint32_t* height) {
     if (enableFFE) {
-        m_ffr->GetOptimizedResolution(width, height);
+        FFR::GetOptimizedResolution(width, height);
     } else {
         *width = Settings::Instance().m_renderWidth;
         *height = Settings::Instance().m_renderHeight;
@@ -15,7 +15,11 @@
 #include <unknwn.h>
 #include <windows.h>
 
+#include "ColorLut.h"
 #include "FFR.h"
+#include "FusedPostProcess.h"
+#include "HiddenAreaMask.h"
+#include "alvr_server/ThreadPolicy.h"
 #include "alvr_server/openvr_driver_wrap.h"
 #include "d3d-render-utils/RenderPipelineYUV.h"
 #include "shared/d3drender.h"
@@ -51,15 +55,37 @@ public:
         vr::HmdRect2_t projRight,
         vr::HmdMatrix34_t eyeToHeadRight
     );
+    // The layers are drawn as seen from targetPose, which is poses[0] unless the frame is turned to
+    // a newer head orientation
     bool RenderFrame(
-        ID3D11Texture2D* pTexture[][2],
+        ID3D11ShaderResourceView* pViews[][2],
         vr::VRTextureBounds_t bounds[][2],
         vr::HmdMatrix34_t poses[],
+        const vr::HmdMatrix34_t& targetPose,
         int layerCount,
         bool recentering,
         const std::string& message,
         const std::string& debugText
     );
+    // The eye regions of the game textures that make up the frame when compositing would only copy
+    // them
+    struct Passthrough {
+        ComPtr<ID3D11Texture2D> textures[2];
+        D3D11_BOX boxes[2];
+    };
+    // Whether the frame is the single layer as the game submitted it: seen from the pose it was
+    // rendered with, each eye at the resolution of its half of the frame, in the sRGB RGBA format
+    // of the composition texture and without post-processing. RenderFrame can then be skipped and
+    // the regions copied to the encoder input, at the left and right half
+    bool GetPassthrough(
+        ID3D11ShaderResourceView* pViews[][2],
+        vr::VRTextureBounds_t bounds[][2],
+        vr::HmdMatrix34_t poses[],
+        const vr::HmdMatrix34_t& targetPose,
+        int layerCount,
+        bool recentering,
+        Passthrough& passthrough
+    );
     void GetEncodingResolution(uint32_t* width, uint32_t* height);
 
     ComPtr<ID3D11Texture2D> GetTexture();
@@ -95,6 +121,10 @@ private:
     vr::HmdRect2_t m_viewProj[2];
     vr::HmdMatrix34_t m_eyeToHead[2];
 
+    // Shader color adjustment of the layers, indexed by whether their format is sRGB. The
+    // settings it depends on only change on restart
+    int m_inputColorAdjust[2];
+
     struct SimpleVertex {
         DirectX::XMFLOAT4 Pos;
         DirectX::XMFLOAT2 Tex;
@@ -102,16 +132,38 @@ private:
     };
     // Parameter for Draw method. 2-triangles for both eyes.
     static const int VERTEX_INDEX_COUNT = 12;
+    // Submitted layers plus the recentering overlay
+    static const int MAX_DRAWN_LAYERS = 16;
 
     std::unique_ptr<d3d_render_utils::RenderPipeline> m_colorCorrectionPipeline;
     bool enableColorCorrection;
 
     std::unique_ptr<FFR> m_ffr;
     bool enableFFE;
+    ComPtr<ID3D11Buffer> m_foveationBuffer;
+    // Views of FoveationCenter the radial foveation of the buffer is centered for
+    uint32_t m_foveationViewsVersion = 0;
+
+    // Null without the hidden area mask
+    std::unique_ptr<HiddenAreaMask> m_hiddenAreaMask;
+
+    // Only logged when it changes, games switch between passthrough and overlays often
+    bool m_passingThrough = false;
 
     std::unique_ptr<d3d_render_utils::RenderPipelineYUV> m_yuvPipeline;
 
-    static bool SetGpuPriority(ID3D11Device* device) {
+    // Replaces the three pipelines above when the GPU supports it
+    std::unique_ptr<FusedPostProcess> m_fusedPostProcess;
+
+    // The post-processing passes recorded once, since their inputs, outputs and constant buffers
+    // don't change after Startup, only the contents of the foveation one. Null if recording
+    // failed, the passes are then issued each frame
+    ComPtr<ID3D11CommandList> m_postProcessCommandList;
+
+    void RenderPostProcess(ID3D11DeviceContext* context);
+
+    // Realtime falls back to the high class when the process isn't elevated
+    static bool SetGpuPriority(ID3D11Device* device, ThreadPriority priority) {
         typedef enum _D3DKMT_SCHEDULINGPRIORITYCLASS {
             D3DKMT_SCHEDULINGPRIORITYCLASS_IDLE,
             D3DKMT_SCHEDULINGPRIORITYCLASS_BELOW_NORMAL,
@@ -121,6 +173,10 @@ private:
             D3DKMT_SCHEDULINGPRIORITYCLASS_REALTIME
         } D3DKMT_SCHEDULINGPRIORITYCLASS;
 
+        if (priority == ThreadPriority::Default) {
+            return false;
+        }
+
         ComQIPtr<IDXGIDevice> dxgiDevice(device);
         if (!dxgiDevice) {
             Info("[GPU PRIO FIX] Failed to get IDXGIDevice\n");
@@ -141,17 +197,20 @@ private:
             return false;
         }
 
-        NTSTATUS status
-            = d3dkmt_spspc(GetCurrentProcess(), D3DKMT_SCHEDULINGPRIORITYCLASS_REALTIME);
-        if (status
-            == 0xc0000022) { // STATUS_ACCESS_DENIED, see http://deusexmachina.uk/ntstatus.html
+        D3DKMT_SCHEDULINGPRIORITYCLASS priorityClass = priority == ThreadPriority::Realtime
+            ? D3DKMT_SCHEDULINGPRIORITYCLASS_REALTIME
+            : D3DKMT_SCHEDULINGPRIORITYCLASS_HIGH;
+        NTSTATUS status = d3dkmt_spspc(GetCurrentProcess(), priorityClass);
+        if (status == 0xc0000022 // STATUS_ACCESS_DENIED, see http://deusexmachina.uk/ntstatus.html
+            && priorityClass == D3DKMT_SCHEDULINGPRIORITYCLASS_REALTIME) {
             Info(
-                "[GPU PRIO FIX] Failed to set process (%d) priority class, please run ALVR as "
-                "Administrator.\n",
-                GetCurrentProcess()
+                "[GPU PRIO FIX] Realtime priority class needs ALVR to run as Administrator, "
+                "using high.\n"
             );
-            return false;
-        } else if (status != 0) {
+            priorityClass = D3DKMT_SCHEDULINGPRIORITYCLASS_HIGH;
+            status = d3dkmt_spspc(GetCurrentProcess(), priorityClass);
+        }
+        if (status != 0) {
             Info(
                 "[GPU PRIO FIX] Failed to set process (%d) priority class: %u\n",
                 GetCurrentProcess(),
@@ -166,7 +225,7 @@ private:
             return false;
         }
 
-        Debug("[GPU PRIO FIX] D3D11 GPU priority setup success\n");
+        Info("[GPU PRIO FIX] D3D11 GPU priority class %d set\n", priorityClass);
         return true;
     }
 };
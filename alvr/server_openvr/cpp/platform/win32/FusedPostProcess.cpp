@@ -0,0 +1,202 @@
+#include "FusedPostProcess.h"
+
+#include <d3dcompiler.h>
+
+#include "ColorLut.h"
+
+#include "alvr_server/Settings.h"
+#include "alvr_server/bindings.h"
+
+#pragma comment(lib, "d3dcompiler.lib")
+
+using Microsoft::WRL::ComPtr;
+
+FusedPostProcess::FusedPostProcess(ID3D11Device* device)
+    : mDevice(device) {
+    mDevice->GetImmediateContext(&mImmediateContext);
+}
+
+void FusedPostProcess::Initialize(
+    ID3D11Texture2D* compositionTexture,
+    uint32_t width,
+    uint32_t height,
+    ID3D11Buffer* foveationBuffer,
+    ID3D11Buffer* colorCorrectionBuffer,
+    ID3D11Buffer* yuvBuffer,
+    bool use10bit,
+    ID3D11ShaderResourceView* colorLut
+) {
+    bool yuvOutput = yuvBuffer != nullptr;
+
+    D3D11_TEXTURE2D_DESC compositionDesc;
+    compositionTexture->GetDesc(&compositionDesc);
+
+    // Without the YUV conversion a pass may still follow, which keeps the HDR range
+    DXGI_FORMAT outputFormat = compositionDesc.Format == DXGI_FORMAT_R16G16B16A16_FLOAT
+        ? DXGI_FORMAT_R16G16B16A16_FLOAT
+        : DXGI_FORMAT_R8G8B8A8_UNORM;
+    if (yuvOutput) {
+        outputFormat = use10bit ? DXGI_FORMAT_P010 : DXGI_FORMAT_NV12;
+    }
+
+    UINT formatSupport = 0;
+    if (FAILED(mDevice->CheckFormatSupport(outputFormat, &formatSupport))
+        || !(formatSupport & D3D11_FORMAT_SUPPORT_TYPED_UNORDERED_ACCESS_VIEW)) {
+        throw MakeException("Format %d doesn't support typed UAVs", outputFormat);
+    }
+
+    std::vector<D3D_SHADER_MACRO> defines;
+    if (foveationBuffer) {
+        defines.push_back({ "FOVEATION", "1" });
+        if (Settings::Instance().m_enableRadialFoveation) {
+            defines.push_back({ "RADIAL_FOVEATION", "1" });
+        }
+    }
+    if (colorCorrectionBuffer) {
+        defines.push_back({ "COLOR_CORRECTION", "1" });
+        if (Settings::Instance().m_sharpening != 0.f) {
+            defines.push_back({ "SHARPENING", "1" });
+        }
+    }
+    const std::string lutSize = std::to_string(ColorLut::SIZE);
+    if (colorLut) {
+        defines.push_back({ "COLOR_LUT", "1" });
+        defines.push_back({ "LUT_SIZE", lutSize.c_str() });
+    }
+    if (yuvOutput) {
+        defines.push_back({ "YUV_OUTPUT", "1" });
+    } else if (compositionDesc.Format == DXGI_FORMAT_R8G8B8A8_UNORM_SRGB) {
+        defines.push_back({ "SRGB_OUTPUT", "1" });
+    }
+    // The colors at 16 bits, which the GPUs with double rate half floats run as packed math. The
+    // driver may still run them at full precision, the results are the same up to rounding
+    D3D11_FEATURE_DATA_SHADER_MIN_PRECISION_SUPPORT minPrecision = {};
+    if (SUCCEEDED(mDevice->CheckFeatureSupport(
+            D3D11_FEATURE_SHADER_MIN_PRECISION_SUPPORT, &minPrecision, sizeof(minPrecision)
+        ))
+        && (minPrecision.AllOtherShaderStagesMinPrecision & D3D11_SHADER_MIN_PRECISION_16_BIT)) {
+        defines.push_back({ "HALF_PRECISION", "1" });
+    }
+    defines.push_back({ nullptr, nullptr });
+
+    ComPtr<ID3DBlob> shaderBlob;
+    ComPtr<ID3DBlob> errorBlob;
+    HRESULT hr = D3DCompile(
+        FUSED_POST_PROCESS_HLSL_PTR,
+        FUSED_POST_PROCESS_HLSL_LEN,
+        "FusedPostProcessCS.hlsl",
+        defines.data(),
+        nullptr,
+        "main",
+        "cs_5_0",
+        D3DCOMPILE_OPTIMIZATION_LEVEL3,
+        0,
+        &shaderBlob,
+        &errorBlob
+    );
+    if (FAILED(hr)) {
+        throw MakeException(
+            "Failed to compile the post-processing shader: %s",
+            errorBlob ? (const char*)errorBlob->GetBufferPointer() : ""
+        );
+    }
+    OK_OR_THROW(
+        mDevice->CreateComputeShader(
+            shaderBlob->GetBufferPointer(), shaderBlob->GetBufferSize(), nullptr, &mComputeShader
+        ),
+        "Failed to create post-processing compute shader."
+    );
+
+    D3D11_SAMPLER_DESC samplerDesc = {};
+    samplerDesc.Filter = D3D11_FILTER_MIN_MAG_LINEAR_MIP_POINT;
+    samplerDesc.AddressU = D3D11_TEXTURE_ADDRESS_CLAMP;
+    samplerDesc.AddressV = D3D11_TEXTURE_ADDRESS_CLAMP;
+    samplerDesc.AddressW = D3D11_TEXTURE_ADDRESS_CLAMP;
+    samplerDesc.ComparisonFunc = D3D11_COMPARISON_NEVER;
+    samplerDesc.MaxLOD = D3D11_FLOAT32_MAX;
+    OK_OR_THROW(
+        mDevice->CreateSamplerState(&samplerDesc, &mSampler), "Failed to create sampler state."
+    );
+
+    OK_OR_THROW(
+        mDevice->CreateShaderResourceView(compositionTexture, nullptr, &mInputViews[0]),
+        "Failed to create input texture resosurce view."
+    );
+
+    D3D11_TEXTURE2D_DESC outputDesc = {};
+    outputDesc.Width = width;
+    outputDesc.Height = height;
+    outputDesc.Format = outputFormat;
+    outputDesc.MipLevels = 1;
+    outputDesc.ArraySize = 1;
+    outputDesc.SampleDesc.Count = 1;
+    outputDesc.Usage = D3D11_USAGE_DEFAULT;
+    outputDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_UNORDERED_ACCESS;
+    OK_OR_THROW(
+        mDevice->CreateTexture2D(&outputDesc, nullptr, &mOutputTexture),
+        "Failed to create post-processing output texture."
+    );
+
+    if (yuvOutput) {
+        // Like for render target views, the plane is selected by the view format
+        D3D11_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
+        uavDesc.ViewDimension = D3D11_UAV_DIMENSION_TEXTURE2D;
+
+        uavDesc.Format = use10bit ? DXGI_FORMAT_R16_UNORM : DXGI_FORMAT_R8_UNORM;
+        OK_OR_THROW(
+            mDevice->CreateUnorderedAccessView(mOutputTexture.Get(), &uavDesc, &mOutputViews[0]),
+            "Failed to create luminance UAV."
+        );
+
+        uavDesc.Format = use10bit ? DXGI_FORMAT_R16G16_UNORM : DXGI_FORMAT_R8G8_UNORM;
+        OK_OR_THROW(
+            mDevice->CreateUnorderedAccessView(mOutputTexture.Get(), &uavDesc, &mOutputViews[1]),
+            "Failed to create chrominance UAV."
+        );
+
+        // One thread per chroma sample
+        mGroupsX = (width / 2 + 7) / 8;
+        mGroupsY = (height / 2 + 7) / 8;
+    } else {
+        OK_OR_THROW(
+            mDevice->CreateUnorderedAccessView(mOutputTexture.Get(), nullptr, &mOutputViews[0]),
+            "Failed to create output UAV."
+        );
+
+        mGroupsX = (width + 7) / 8;
+        mGroupsY = (height + 7) / 8;
+    }
+
+    mInputViews[1] = colorLut;
+    mBuffers[0] = foveationBuffer;
+    mBuffers[1] = colorCorrectionBuffer;
+    mBuffers[2] = yuvBuffer;
+}
+
+void FusedPostProcess::Render(ID3D11DeviceContext* otherContext) {
+    ID3D11DeviceContext* context = otherContext != nullptr ? otherContext : mImmediateContext.Get();
+
+    // The composition texture is still bound as render target
+    context->OMSetRenderTargets(0, nullptr, nullptr);
+
+    ID3D11Buffer* buffers[] = { mBuffers[0].Get(), mBuffers[1].Get(), mBuffers[2].Get() };
+    ID3D11ShaderResourceView* views[] = { mInputViews[0].Get(), mInputViews[1].Get() };
+    ID3D11UnorderedAccessView* uavs[] = { mOutputViews[0].Get(), mOutputViews[1].Get() };
+
+    context->CSSetShader(mComputeShader.Get(), nullptr, 0);
+    context->CSSetConstantBuffers(0, 3, buffers);
+    context->CSSetShaderResources(0, 2, views);
+    context->CSSetSamplers(0, 1, mSampler.GetAddressOf());
+    context->CSSetUnorderedAccessViews(0, 2, uavs, nullptr);
+
+    context->Dispatch(mGroupsX, mGroupsY, 1);
+
+    // Unbind so that the next frame can render to the composition texture and the encoder can
+    // read the output
+    ID3D11ShaderResourceView* nullViews[] = { nullptr, nullptr };
+    ID3D11UnorderedAccessView* nullUavs[] = { nullptr, nullptr };
+    context->CSSetShaderResources(0, 2, nullViews);
+    context->CSSetUnorderedAccessViews(0, 2, nullUavs, nullptr);
+}
+
+ID3D11Texture2D* FusedPostProcess::GetOutputTexture() { return mOutputTexture.Get(); }
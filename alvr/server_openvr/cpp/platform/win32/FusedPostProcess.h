@@ -0,0 +1,43 @@
+#pragma once
+
+#include "d3d-render-utils/RenderUtils.h"
+
+// Runs foveated compression, color correction and the RGB to YUV conversion of the composited
+// frame as a single compute dispatch, instead of one full-frame pass per feature. The shader is
+// specialized for the features whose constant buffer is set. With a ColorLut view, the per-pixel
+// color operations are a single lookup in it.
+class FusedPostProcess {
+public:
+    FusedPostProcess(ID3D11Device* device);
+
+    // Throws if the shader can't be compiled or the GPU can't write the output format from a
+    // compute shader. In that case the separate passes must be used.
+    void Initialize(
+        ID3D11Texture2D* compositionTexture,
+        uint32_t width,
+        uint32_t height,
+        ID3D11Buffer* foveationBuffer,
+        ID3D11Buffer* colorCorrectionBuffer,
+        ID3D11Buffer* yuvBuffer,
+        bool use10bit,
+        ID3D11ShaderResourceView* colorLut = nullptr
+    );
+    void Render(ID3D11DeviceContext* otherContext = nullptr);
+
+    ID3D11Texture2D* GetOutputTexture();
+
+private:
+    Microsoft::WRL::ComPtr<ID3D11Device> mDevice;
+    Microsoft::WRL::ComPtr<ID3D11DeviceContext> mImmediateContext;
+    Microsoft::WRL::ComPtr<ID3D11ComputeShader> mComputeShader;
+    Microsoft::WRL::ComPtr<ID3D11SamplerState> mSampler;
+    // The composition texture and the color LUT
+    Microsoft::WRL::ComPtr<ID3D11ShaderResourceView> mInputViews[2];
+    Microsoft::WRL::ComPtr<ID3D11Texture2D> mOutputTexture;
+    // Either the RGB output or the Y and UV planes
+    Microsoft::WRL::ComPtr<ID3D11UnorderedAccessView> mOutputViews[2];
+    Microsoft::WRL::ComPtr<ID3D11Buffer> mBuffers[3];
+
+    uint32_t mGroupsX = 0;
+    uint32_t mGroupsY = 0;
+};
@@ -0,0 +1,159 @@
+#include "GpuTimestamps.h"
+
+#include "alvr_server/FrameTrace.h"
+#include "alvr_server/Logger.h"
+#include "alvr_server/TraceCapture.h"
+
+GpuTimestamps::GpuTimestamps(ID3D11Device* device, ID3D11DeviceContext* context)
+    : mDevice(device)
+    , mContext(context) {
+    D3D11_QUERY_DESC disjointDesc = { D3D11_QUERY_TIMESTAMP_DISJOINT, 0 };
+    D3D11_QUERY_DESC timestampDesc = { D3D11_QUERY_TIMESTAMP, 0 };
+
+    for (QuerySet& set : mQuerySets) {
+        if (FAILED(mDevice->CreateQuery(&disjointDesc, &set.disjoint))
+            || FAILED(mDevice->CreateQuery(&timestampDesc, &set.begin))
+            || FAILED(mDevice->CreateQuery(&timestampDesc, &set.end))) {
+            Warn("GpuTimestamps: failed to create the queries, the composition isn't timed\n");
+            return;
+        }
+    }
+    if (FAILED(mDevice->CreateQuery(&disjointDesc, &mCalibrationDisjoint))
+        || FAILED(mDevice->CreateQuery(&timestampDesc, &mCalibrationQuery))) {
+        Warn("GpuTimestamps: failed to create the queries, the composition isn't timed\n");
+        return;
+    }
+
+    mEnabled = true;
+}
+
+void GpuTimestamps::Begin(uint64_t targetTimestampNs) {
+    if (!mEnabled) {
+        return;
+    }
+
+    Collect();
+    Calibrate();
+
+    QuerySet& set = mQuerySets[mNext];
+    if (set.pending) {
+        // The GPU is more than QUERY_SETS frames behind, this frame isn't timed
+        return;
+    }
+
+    mContext->Begin(set.disjoint.Get());
+    mContext->End(set.begin.Get());
+    set.targetTimestampNs = targetTimestampNs;
+    mCurrent = &set;
+}
+
+void GpuTimestamps::End() {
+    if (!mCurrent) {
+        return;
+    }
+
+    mContext->End(mCurrent->end.Get());
+    mContext->End(mCurrent->disjoint.Get());
+    mCurrent->submittedNs = FrameTrace::Now();
+    mCurrent->pending = true;
+    mCurrent = nullptr;
+    mNext = (mNext + 1) % QUERY_SETS;
+}
+
+void GpuTimestamps::Collect() {
+    // Oldest first, a set can't be done before the ones submitted earlier
+    for (int i = 0; i < QUERY_SETS; i++) {
+        QuerySet& set = mQuerySets[(mNext + i) % QUERY_SETS];
+        if (!set.pending) {
+            continue;
+        }
+
+        D3D11_QUERY_DATA_TIMESTAMP_DISJOINT disjoint;
+        uint64_t begin;
+        uint64_t end;
+        UINT flags = D3D11_ASYNC_GETDATA_DONOTFLUSH;
+        if (mContext->GetData(set.disjoint.Get(), &disjoint, sizeof(disjoint), flags) != S_OK
+            || mContext->GetData(set.begin.Get(), &begin, sizeof(begin), flags) != S_OK
+            || mContext->GetData(set.end.Get(), &end, sizeof(end), flags) != S_OK) {
+            break;
+        }
+        set.pending = false;
+
+        if (disjoint.Disjoint || disjoint.Frequency != mCalibrationFrequency) {
+            continue;
+        }
+        FrameTrace& trace = FrameTrace::Instance();
+        uint64_t beginNs = ToSteadyClock(begin);
+        uint64_t endNs = ToSteadyClock(end);
+        trace.Record(set.targetTimestampNs, FRAME_TRACE_COMPOSITE_BEGIN, beginNs);
+        trace.Record(set.targetTimestampNs, FRAME_TRACE_COMPOSITE_END, endNs);
+        TraceCapture::Instance().AddGpuSpan(
+            TraceCapture::GPU_TRACK_COMPOSITOR, "Compositor", beginNs, endNs, set.targetTimestampNs
+        );
+        ReportQueueWait(beginNs > set.submittedNs ? beginNs - set.submittedNs : 0);
+    }
+}
+
+void GpuTimestamps::ReportQueueWait(uint64_t waitNs) {
+    mQueueWaitTotalNs += waitNs;
+    if (waitNs > mQueueWaitMaxNs) {
+        mQueueWaitMaxNs = waitNs;
+    }
+    mQueueWaitCount++;
+
+    if (mQueueWaitCount == QUEUE_STATS_INTERVAL) {
+        Debug(
+            "GpuTimestamps: composition queue wait avg=%lluus max=%lluus\n",
+            mQueueWaitTotalNs / mQueueWaitCount / 1000,
+            mQueueWaitMaxNs / 1000
+        );
+        mQueueWaitTotalNs = 0;
+        mQueueWaitMaxNs = 0;
+        mQueueWaitCount = 0;
+    }
+}
+
+void GpuTimestamps::Calibrate() {
+    uint64_t now = FrameTrace::Now();
+    if (now - mLastCalibrationAttemptNs < CALIBRATION_INTERVAL_NS) {
+        return;
+    }
+    mLastCalibrationAttemptNs = now;
+
+    mContext->Begin(mCalibrationDisjoint.Get());
+    mContext->End(mCalibrationQuery.Get());
+    mContext->End(mCalibrationDisjoint.Get());
+    mContext->Flush();
+
+    // The timestamp is taken as soon as the GPU gets to it, so the time it's seen done here is
+    // the matching steady clock time if nothing was queued before it
+    uint64_t ticks;
+    UINT flags = D3D11_ASYNC_GETDATA_DONOTFLUSH;
+    while (mContext->GetData(mCalibrationQuery.Get(), &ticks, sizeof(ticks), flags) != S_OK) {
+        if (FrameTrace::Now() - now > CALIBRATION_MAX_WAIT_NS) {
+            return;
+        }
+    }
+    uint64_t sampleNs = FrameTrace::Now();
+
+    D3D11_QUERY_DATA_TIMESTAMP_DISJOINT disjoint;
+    while (mContext->GetData(mCalibrationDisjoint.Get(), &disjoint, sizeof(disjoint), flags)
+           != S_OK) {
+        if (FrameTrace::Now() - now > CALIBRATION_MAX_WAIT_NS) {
+            return;
+        }
+    }
+    if (disjoint.Disjoint || sampleNs - now > CALIBRATION_MAX_WAIT_NS) {
+        return;
+    }
+
+    mCalibrationTicks = ticks;
+    mCalibrationNs = sampleNs;
+    mCalibrationFrequency = disjoint.Frequency;
+}
+
+uint64_t GpuTimestamps::ToSteadyClock(uint64_t ticks) {
+    // Frames composited before the last calibration are before it
+    int64_t deltaTicks = (int64_t)(ticks - mCalibrationTicks);
+    return mCalibrationNs + (int64_t)((double)deltaTicks * 1e9 / mCalibrationFrequency);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <d3d11.h>
+#include <stdint.h>
+#include <wrl.h>
+
+// Timestamp queries around the composition of each frame, recorded to FrameTrace as composite
+// begin and end. The results are read back a few frames later without waiting for the GPU, and
+// converted to the steady clock with a GPU/CPU clock pair sampled once per second. How long the
+// composition waited for the GPU after End is logged every QUEUE_STATS_INTERVAL frames. All
+// methods are called from the present thread.
+class GpuTimestamps {
+public:
+    GpuTimestamps(ID3D11Device* device, ID3D11DeviceContext* context);
+
+    void Begin(uint64_t targetTimestampNs);
+    void End();
+
+private:
+    static const int QUERY_SETS = 4;
+    static const uint64_t CALIBRATION_INTERVAL_NS = 1'000'000'000;
+    // A sample that took longer than this waited behind other GPU work and would skew the clocks
+    static const uint64_t CALIBRATION_MAX_WAIT_NS = 500'000;
+    static const uint32_t QUEUE_STATS_INTERVAL = 1000;
+
+    struct QuerySet {
+        Microsoft::WRL::ComPtr<ID3D11Query> disjoint;
+        Microsoft::WRL::ComPtr<ID3D11Query> begin;
+        Microsoft::WRL::ComPtr<ID3D11Query> end;
+        uint64_t targetTimestampNs = 0;
+        // Steady clock time of End, the context is flushed right after it
+        uint64_t submittedNs = 0;
+        bool pending = false;
+    };
+
+    // Records the frames whose queries are done
+    void Collect();
+    void Calibrate();
+    void ReportQueueWait(uint64_t waitNs);
+    uint64_t ToSteadyClock(uint64_t ticks);
+
+    Microsoft::WRL::ComPtr<ID3D11Device> mDevice;
+    Microsoft::WRL::ComPtr<ID3D11DeviceContext> mContext;
+    // False if the queries couldn't be created, nothing is timed then
+    bool mEnabled = false;
+    QuerySet mQuerySets[QUERY_SETS];
+    // Next set to use, which is also the oldest one
+    int mNext = 0;
+    // Set between Begin and End, null if the frame isn't timed
+    QuerySet* mCurrent = nullptr;
+
+    Microsoft::WRL::ComPtr<ID3D11Query> mCalibrationDisjoint;
+    Microsoft::WRL::ComPtr<ID3D11Query> mCalibrationQuery;
+    // GPU ticks and steady clock time taken together. The frequency is 0 until the first
+    // calibration, the frames aren't timed until then
+    uint64_t mCalibrationTicks = 0;
+    uint64_t mCalibrationNs = 0;
+    uint64_t mCalibrationFrequency = 0;
+    uint64_t mLastCalibrationAttemptNs = 0;
+
+    uint64_t mQueueWaitTotalNs = 0;
+    uint64_t mQueueWaitMaxNs = 0;
+    uint32_t mQueueWaitCount = 0;
+};
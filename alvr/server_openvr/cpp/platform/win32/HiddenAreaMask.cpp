@@ -0,0 +1,166 @@
+#include "HiddenAreaMask.h"
+
+#include <d3dcompiler.h>
+
+#include "alvr_server/bindings.h"
+
+#pragma comment(lib, "d3dcompiler.lib")
+
+using Microsoft::WRL::ComPtr;
+
+namespace {
+ComPtr<ID3DBlob> CompileMaskShader(const char* entryPoint, const char* target) {
+    ComPtr<ID3DBlob> shaderBlob;
+    ComPtr<ID3DBlob> errorBlob;
+    HRESULT hr = D3DCompile(
+        HIDDEN_AREA_MASK_HLSL_PTR,
+        HIDDEN_AREA_MASK_HLSL_LEN,
+        "HiddenAreaMask.hlsl",
+        nullptr,
+        nullptr,
+        entryPoint,
+        target,
+        D3DCOMPILE_OPTIMIZATION_LEVEL3,
+        0,
+        &shaderBlob,
+        &errorBlob
+    );
+    if (FAILED(hr)) {
+        throw MakeException(
+            "Failed to compile the hidden area mask shader: %s",
+            errorBlob ? (const char*)errorBlob->GetBufferPointer() : ""
+        );
+    }
+    return shaderBlob;
+}
+}
+
+HiddenAreaMask::HiddenAreaMask(ID3D11Device* device, uint32_t width, uint32_t height, float radius)
+    : mDevice(device)
+    , mWidth(width)
+    , mHeight(height)
+    , mRadius(radius) {
+    ComPtr<ID3DBlob> vertexBlob = CompileMaskShader("VS", "vs_5_0");
+    OK_OR_THROW(
+        mDevice->CreateVertexShader(
+            vertexBlob->GetBufferPointer(), vertexBlob->GetBufferSize(), nullptr, &mVertexShader
+        ),
+        "Failed to create hidden area mask vertex shader."
+    );
+    ComPtr<ID3DBlob> pixelBlob = CompileMaskShader("PS", "ps_5_0");
+    OK_OR_THROW(
+        mDevice->CreatePixelShader(
+            pixelBlob->GetBufferPointer(), pixelBlob->GetBufferSize(), nullptr, &mPixelShader
+        ),
+        "Failed to create hidden area mask pixel shader."
+    );
+
+    D3D11_BUFFER_DESC paramsDesc = {};
+    paramsDesc.ByteWidth = sizeof(MaskParams);
+    paramsDesc.Usage = D3D11_USAGE_DEFAULT;
+    paramsDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+    OK_OR_THROW(
+        mDevice->CreateBuffer(&paramsDesc, nullptr, &mParamsBuffer),
+        "Failed to create hidden area mask constant buffer."
+    );
+
+    D3D11_TEXTURE2D_DESC stencilDesc = {};
+    stencilDesc.Width = width;
+    stencilDesc.Height = height;
+    stencilDesc.MipLevels = 1;
+    stencilDesc.ArraySize = 1;
+    stencilDesc.Format = DXGI_FORMAT_D24_UNORM_S8_UINT;
+    stencilDesc.SampleDesc.Count = 1;
+    stencilDesc.Usage = D3D11_USAGE_DEFAULT;
+    stencilDesc.BindFlags = D3D11_BIND_DEPTH_STENCIL;
+    ComPtr<ID3D11Texture2D> stencilTexture;
+    OK_OR_THROW(
+        mDevice->CreateTexture2D(&stencilDesc, nullptr, &stencilTexture),
+        "Failed to create hidden area mask stencil texture."
+    );
+    OK_OR_THROW(
+        mDevice->CreateDepthStencilView(stencilTexture.Get(), nullptr, &mStencilView),
+        "Failed to create hidden area mask stencil view."
+    );
+
+    // The depth isn't used, the hidden area is where the stencil is 1
+    D3D11_DEPTH_STENCIL_DESC stateDesc = {};
+    stateDesc.DepthEnable = FALSE;
+    stateDesc.DepthWriteMask = D3D11_DEPTH_WRITE_MASK_ZERO;
+    stateDesc.DepthFunc = D3D11_COMPARISON_ALWAYS;
+    stateDesc.StencilEnable = TRUE;
+    stateDesc.StencilReadMask = 0xFF;
+    stateDesc.StencilWriteMask = 0xFF;
+    stateDesc.FrontFace.StencilFailOp = D3D11_STENCIL_OP_KEEP;
+    stateDesc.FrontFace.StencilDepthFailOp = D3D11_STENCIL_OP_KEEP;
+    stateDesc.FrontFace.StencilPassOp = D3D11_STENCIL_OP_REPLACE;
+    stateDesc.FrontFace.StencilFunc = D3D11_COMPARISON_ALWAYS;
+    stateDesc.BackFace = stateDesc.FrontFace;
+    OK_OR_THROW(
+        mDevice->CreateDepthStencilState(&stateDesc, &mMarkState),
+        "Failed to create hidden area mask stencil state."
+    );
+
+    stateDesc.StencilWriteMask = 0;
+    stateDesc.FrontFace.StencilPassOp = D3D11_STENCIL_OP_KEEP;
+    stateDesc.FrontFace.StencilFunc = D3D11_COMPARISON_EQUAL;
+    stateDesc.BackFace = stateDesc.FrontFace;
+    OK_OR_THROW(
+        mDevice->CreateDepthStencilState(&stateDesc, &mTestState),
+        "Failed to create hidden area test stencil state."
+    );
+}
+
+void HiddenAreaMask::SetViews(const vr::HmdRect2_t viewProj[2]) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mViewProj[0] = viewProj[0];
+    mViewProj[1] = viewProj[1];
+    mHasViews = true;
+    mDirty = true;
+}
+
+void HiddenAreaMask::Begin(ID3D11DeviceContext* context, ID3D11RenderTargetView* renderTarget) {
+    MaskParams params = {};
+    bool dirty;
+    bool hasViews;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        dirty = mDirty;
+        hasViews = mHasViews;
+        mDirty = false;
+        for (int eye = 0; eye < 2; eye++) {
+            // The top left corner has the tangent of the bottom edge, see fov_to_tangents
+            params.eyeTangents[eye][0] = mViewProj[eye].vTopLeft.v[0];
+            params.eyeTangents[eye][1] = mViewProj[eye].vBottomRight.v[0];
+            params.eyeTangents[eye][2] = mViewProj[eye].vBottomRight.v[1];
+            params.eyeTangents[eye][3] = mViewProj[eye].vTopLeft.v[1];
+        }
+    }
+
+    // The stencil buffer is kept from frame to frame while the views don't change
+    if (dirty) {
+        context->ClearDepthStencilView(mStencilView.Get(), D3D11_CLEAR_STENCIL, 1.f, 0);
+    }
+    if (dirty && hasViews) {
+        params.eyeSize[0] = (float)(mWidth / 2);
+        params.eyeSize[1] = (float)mHeight;
+        params.radius = mRadius;
+        context->UpdateSubresource(mParamsBuffer.Get(), 0, nullptr, &params, 0, 0);
+
+        D3D11_VIEWPORT viewport = { 0.f, 0.f, (float)mWidth, (float)mHeight, 0.f, 1.f };
+        D3D11_RECT scissor = { 0, 0, (LONG)mWidth, (LONG)mHeight };
+        context->OMSetRenderTargets(0, nullptr, mStencilView.Get());
+        context->OMSetDepthStencilState(mMarkState.Get(), 1);
+        context->RSSetViewports(1, &viewport);
+        context->RSSetScissorRects(1, &scissor);
+        context->IASetInputLayout(nullptr);
+        context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+        context->VSSetShader(mVertexShader.Get(), nullptr, 0);
+        context->PSSetShader(mPixelShader.Get(), nullptr, 0);
+        context->PSSetConstantBuffers(0, 1, mParamsBuffer.GetAddressOf());
+        context->Draw(3, 0);
+    }
+
+    context->OMSetRenderTargets(1, &renderTarget, mStencilView.Get());
+    context->OMSetDepthStencilState(mTestState.Get(), 0);
+}
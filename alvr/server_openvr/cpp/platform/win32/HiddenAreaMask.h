@@ -0,0 +1,51 @@
+#pragma once
+
+#include <mutex>
+
+#include "alvr_server/openvr_driver_wrap.h"
+#include "d3d-render-utils/RenderUtils.h"
+
+// Keeps the layers from being drawn where the lens hides the frame, outside of an ellipse
+// inscribed in the field of view of each eye. The area is marked once in a stencil buffer, then
+// the layers are drawn with a stencil test and the GPU rejects their pixels there before shading
+// them. The area keeps the clear color of the composition, which the encoder codes in almost no
+// bits. Nothing is masked until the views are known.
+class HiddenAreaMask {
+public:
+    // Throws if the shaders can't be compiled
+    HiddenAreaMask(ID3D11Device* device, uint32_t width, uint32_t height, float radius);
+
+    // Tangents as given to FrameRender::SetViewParams, the area is marked again on the next
+    // Begin(). Called from the tracking thread
+    void SetViews(const vr::HmdRect2_t viewProj[2]);
+
+    // Binds the stencil buffer along with renderTarget and the stencil test of the layers. The
+    // shaders, the input assembler state and the viewport are to be set again after it
+    void Begin(ID3D11DeviceContext* context, ID3D11RenderTargetView* renderTarget);
+
+private:
+    struct MaskParams {
+        float eyeTangents[2][4];
+        float eyeSize[2];
+        float radius;
+        float padding;
+    };
+
+    Microsoft::WRL::ComPtr<ID3D11Device> mDevice;
+    Microsoft::WRL::ComPtr<ID3D11VertexShader> mVertexShader;
+    Microsoft::WRL::ComPtr<ID3D11PixelShader> mPixelShader;
+    Microsoft::WRL::ComPtr<ID3D11Buffer> mParamsBuffer;
+    Microsoft::WRL::ComPtr<ID3D11DepthStencilView> mStencilView;
+    Microsoft::WRL::ComPtr<ID3D11DepthStencilState> mMarkState;
+    Microsoft::WRL::ComPtr<ID3D11DepthStencilState> mTestState;
+
+    uint32_t mWidth;
+    uint32_t mHeight;
+    float mRadius;
+
+    std::mutex mMutex;
+    vr::HmdRect2_t mViewProj[2] = {};
+    bool mHasViews = false;
+    // The views changed since the area was last marked
+    bool mDirty = true;
+};
@@ -106,6 +106,55 @@ void NvEncoderD3D11::AllocateInputBuffers(int32_t numInputBuffers)
     }
 }
 
+void NvEncoderD3D11::RegisterExternalTextures(const std::vector<ID3D11Texture2D*> &textures)
+{
+    if (!IsHWEncoderInitialized())
+    {
+        NVENC_THROW_ERROR("Encoder intialization failed", NV_ENC_ERR_ENCODER_NOT_INITIALIZED);
+    }
+    if (m_nOutputDelay != 0)
+    {
+        NVENC_THROW_ERROR("External textures need an encoder without output delay", NV_ENC_ERR_INVALID_PARAM);
+    }
+
+    for (ID3D11Texture2D *pTexture : textures)
+    {
+        D3D11_TEXTURE2D_DESC desc;
+        pTexture->GetDesc(&desc);
+        if (desc.Format != GetD3D11Format(GetPixelFormat()) || desc.Width != GetMaxEncodeWidth() || desc.Height != GetMaxEncodeHeight())
+        {
+            NVENC_THROW_ERROR("External texture doesn't match the input buffers", NV_ENC_ERR_INVALID_PARAM);
+        }
+        m_externalResources[pTexture] = RegisterResource(pTexture, NV_ENC_INPUT_RESOURCE_TYPE_DIRECTX,
+            desc.Width, desc.Height, 0, GetPixelFormat(), NV_ENC_INPUT_IMAGE);
+    }
+}
+
+void NvEncoderD3D11::EncodeExternalTexture(ID3D11Texture2D *pTexture, std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_PIC_PARAMS *pPicParams)
+{
+    auto it = m_externalResources.find(pTexture);
+    if (it == m_externalResources.end())
+    {
+        NVENC_THROW_ERROR("Texture was not registered", NV_ENC_ERR_INVALID_PARAM);
+    }
+
+    // EncodeFrame() maps the resource registered for the current input buffer. Without output
+    // delay it's unmapped again before returning, so it can be swapped for this frame only
+    int bfrIdx = m_iToSend % m_nEncoderBuffer;
+    NV_ENC_REGISTERED_PTR inputResource = m_vRegisteredResources[bfrIdx];
+    m_vRegisteredResources[bfrIdx] = it->second;
+    try
+    {
+        EncodeFrame(vPacket, pPicParams);
+    }
+    catch (...)
+    {
+        m_vRegisteredResources[bfrIdx] = inputResource;
+        throw;
+    }
+    m_vRegisteredResources[bfrIdx] = inputResource;
+}
+
 void NvEncoderD3D11::ReleaseInputBuffers()
 {
     ReleaseD3D11Resources();
@@ -118,6 +167,12 @@ void NvEncoderD3D11::ReleaseD3D11Resources()
         return;
     }
 
+    for (auto &resource : m_externalResources)
+    {
+        m_nvenc.nvEncUnregisterResource(m_hEncoder, resource.second);
+    }
+    m_externalResources.clear();
+
     UnregisterInputResources();
 
     for (uint32_t i = 0; i < m_vInputFrames.size(); ++i)
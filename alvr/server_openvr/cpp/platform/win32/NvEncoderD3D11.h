@@ -16,7 +16,7 @@
 #include <mutex>
 #include <unordered_map>
 #include <d3d11.h>
-#include "NvEncoder.h"
+#include "shared/nvenc/NvEncoder.h"
 
 class NvEncoderD3D11 : public NvEncoder
 {
@@ -25,6 +25,19 @@ public:
         uint32_t nExtraOutputDelay = 3, bool bMotionEstimationOnly = false,  bool bOPInVideoMemory = false);
     virtual ~NvEncoderD3D11();
 
+    /**
+    *  @brief This function is used to register textures the application renders into, so that
+    *  EncodeExternalTexture() can encode them without copying them to an input buffer first.
+    *  Only supported without output delay, as the application reuses the textures right after.
+    */
+    void RegisterExternalTextures(const std::vector<ID3D11Texture2D*> &textures);
+
+    /**
+    *  @brief This function is used to encode one of the textures registered with
+    *  RegisterExternalTextures() in place.
+    */
+    void EncodeExternalTexture(ID3D11Texture2D *pTexture, std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_PIC_PARAMS *pPicParams = nullptr);
+
 protected:
     /**
     *  @brief This function is used to release the input buffers allocated for encoding.
@@ -52,4 +65,5 @@ protected:
 
 private:
     ID3D11DeviceContext* m_pD3D11DeviceContext = nullptr;
+    std::unordered_map<ID3D11Texture2D*, NV_ENC_REGISTERED_PTR> m_externalResources;
 };
@@ -0,0 +1,188 @@
+#include "OverlayCoverage.h"
+
+#include <d3dcompiler.h>
+
+#include "alvr_server/OverlayQpMask.h"
+#include "alvr_server/bindings.h"
+
+#pragma comment(lib, "d3dcompiler.lib")
+
+using Microsoft::WRL::ComPtr;
+
+OverlayCoverage::OverlayCoverage(ID3D11Device* device, ID3D11DeviceContext* context)
+    : mDevice(device)
+    , mContext(context) {
+    ComPtr<ID3DBlob> shaderBlob;
+    ComPtr<ID3DBlob> errorBlob;
+    HRESULT hr = D3DCompile(
+        OVERLAY_COVERAGE_HLSL_PTR,
+        OVERLAY_COVERAGE_HLSL_LEN,
+        "OverlayCoverageCS.hlsl",
+        nullptr,
+        nullptr,
+        "main",
+        "cs_5_0",
+        D3DCOMPILE_OPTIMIZATION_LEVEL3,
+        0,
+        &shaderBlob,
+        &errorBlob
+    );
+    if (FAILED(hr)) {
+        throw MakeException(
+            "Failed to compile the overlay coverage shader: %s",
+            errorBlob ? (const char*)errorBlob->GetBufferPointer() : ""
+        );
+    }
+    OK_OR_THROW(
+        mDevice->CreateComputeShader(
+            shaderBlob->GetBufferPointer(), shaderBlob->GetBufferSize(), nullptr, &mComputeShader
+        ),
+        "Failed to create overlay coverage compute shader."
+    );
+
+    D3D11_BUFFER_DESC paramsDesc = {};
+    paramsDesc.ByteWidth = sizeof(CoverageParams);
+    paramsDesc.Usage = D3D11_USAGE_DEFAULT;
+    paramsDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+    OK_OR_THROW(
+        mDevice->CreateBuffer(&paramsDesc, nullptr, &mParamsBuffer),
+        "Failed to create overlay coverage constant buffer."
+    );
+
+    const UINT cellCount = 2 * OverlayQpMask::CELLS_X * OverlayQpMask::CELLS_Y;
+
+    D3D11_BUFFER_DESC coverageDesc = {};
+    coverageDesc.ByteWidth = cellCount * sizeof(uint32_t);
+    coverageDesc.Usage = D3D11_USAGE_DEFAULT;
+    coverageDesc.BindFlags = D3D11_BIND_UNORDERED_ACCESS;
+    coverageDesc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS;
+    OK_OR_THROW(
+        mDevice->CreateBuffer(&coverageDesc, nullptr, &mCoverageBuffer),
+        "Failed to create overlay coverage buffer."
+    );
+
+    D3D11_UNORDERED_ACCESS_VIEW_DESC coverageViewDesc = {};
+    coverageViewDesc.Format = DXGI_FORMAT_R32_TYPELESS;
+    coverageViewDesc.ViewDimension = D3D11_UAV_DIMENSION_BUFFER;
+    coverageViewDesc.Buffer.NumElements = cellCount;
+    coverageViewDesc.Buffer.Flags = D3D11_BUFFER_UAV_FLAG_RAW;
+    OK_OR_THROW(
+        mDevice->CreateUnorderedAccessView(
+            mCoverageBuffer.Get(), &coverageViewDesc, &mCoverageView
+        ),
+        "Failed to create overlay coverage UAV."
+    );
+
+    D3D11_BUFFER_DESC stagingDesc = {};
+    stagingDesc.ByteWidth = coverageDesc.ByteWidth;
+    stagingDesc.Usage = D3D11_USAGE_STAGING;
+    stagingDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    for (Readback& readback : mReadbacks) {
+        OK_OR_THROW(
+            mDevice->CreateBuffer(&stagingDesc, nullptr, &readback.buffer),
+            "Failed to create overlay coverage staging buffer."
+        );
+    }
+}
+
+void OverlayCoverage::Update(
+    ID3D11ShaderResourceView* pViews[][2],
+    const vr::VRTextureBounds_t bounds[][2],
+    int layerCount
+) {
+    Collect();
+
+    if (mFrame++ % MEASURE_INTERVAL != 0) {
+        return;
+    }
+
+    // Without overlays there is nothing to wait for, and the coverage still in flight is outdated
+    if (layerCount <= 1) {
+        for (Readback& readback : mReadbacks) {
+            readback.pending = false;
+        }
+        OverlayQpMask::Instance().SetCoverage({});
+        return;
+    }
+
+    Readback& readback = mReadbacks[mNext];
+    if (readback.pending) {
+        // The GPU is more than READBACK_COUNT measures behind
+        return;
+    }
+
+    d3d_render_utils::ContextLock lock(mContext.Get());
+    const UINT zero[4] = {};
+    mContext->ClearUnorderedAccessViewUint(mCoverageView.Get(), zero);
+
+    mContext->CSSetShader(mComputeShader.Get(), nullptr, 0);
+    mContext->CSSetConstantBuffers(0, 1, mParamsBuffer.GetAddressOf());
+    mContext->CSSetUnorderedAccessViews(0, 1, mCoverageView.GetAddressOf(), nullptr);
+
+    // Layer 0 is the game
+    for (int i = 1; i < layerCount; i++) {
+        for (int eye = 0; eye < 2; eye++) {
+            if (!pViews[i][eye]) {
+                continue;
+            }
+            CoverageParams params = {};
+            params.uvMin[0] = bounds[i][eye].uMin;
+            params.uvMin[1] = bounds[i][eye].vMin;
+            params.uvMax[0] = bounds[i][eye].uMax;
+            params.uvMax[1] = bounds[i][eye].vMax;
+            params.cells[0] = OverlayQpMask::CELLS_X;
+            params.cells[1] = OverlayQpMask::CELLS_Y;
+            params.eye = eye;
+            mContext->UpdateSubresource(mParamsBuffer.Get(), 0, nullptr, &params, 0, 0);
+
+            mContext->CSSetShaderResources(0, 1, &pViews[i][eye]);
+            mContext->Dispatch(
+                (OverlayQpMask::CELLS_X + 7) / 8, (OverlayQpMask::CELLS_Y + 7) / 8, 1
+            );
+        }
+    }
+
+    ID3D11ShaderResourceView* nullView = nullptr;
+    ID3D11UnorderedAccessView* nullUav = nullptr;
+    mContext->CSSetShaderResources(0, 1, &nullView);
+    mContext->CSSetUnorderedAccessViews(0, 1, &nullUav, nullptr);
+
+    mContext->CopyResource(readback.buffer.Get(), mCoverageBuffer.Get());
+    readback.pending = true;
+    mNext = (mNext + 1) % READBACK_COUNT;
+}
+
+void OverlayCoverage::Collect() {
+    // Oldest first, a measure can't be done before the ones submitted earlier
+    for (int i = 0; i < READBACK_COUNT; i++) {
+        Readback& readback = mReadbacks[(mNext + i) % READBACK_COUNT];
+        if (!readback.pending) {
+            continue;
+        }
+
+        std::vector<uint8_t> cells;
+        bool covered = false;
+        {
+            // The encoder thread uses the same context, see ContextLock
+            d3d_render_utils::ContextLock lock(mContext.Get());
+            D3D11_MAPPED_SUBRESOURCE mapped;
+            if (mContext->Map(
+                    readback.buffer.Get(), 0, D3D11_MAP_READ, D3D11_MAP_FLAG_DO_NOT_WAIT, &mapped
+                )
+                != S_OK) {
+                break;
+            }
+            const uint32_t* alphas = (const uint32_t*)mapped.pData;
+            cells.resize(2 * OverlayQpMask::CELLS_X * OverlayQpMask::CELLS_Y);
+            for (size_t cell = 0; cell < cells.size(); cell++) {
+                cells[cell] = alphas[cell] >= COVERED_ALPHA ? 1 : 0;
+                covered = covered || cells[cell] != 0;
+            }
+            mContext->Unmap(readback.buffer.Get(), 0);
+        }
+        readback.pending = false;
+
+        // An overlay may be fully transparent, the frame is then encoded as without it
+        OverlayQpMask::Instance().SetCoverage(covered ? cells : std::vector<uint8_t>());
+    }
+}
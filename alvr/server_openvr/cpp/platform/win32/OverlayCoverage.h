@@ -0,0 +1,52 @@
+#pragma once
+
+#include "alvr_server/openvr_driver_wrap.h"
+#include "d3d-render-utils/RenderUtils.h"
+
+// Measures on the GPU where the overlay layers, the ones submitted after the game, are opaque and
+// hands it to OverlayQpMask. The coverage of a frame now and then is enough, overlays rarely move.
+// It is read back a few frames later without waiting for the GPU. Called from the present thread.
+class OverlayCoverage {
+public:
+    // Throws if the shader can't be compiled
+    OverlayCoverage(ID3D11Device* device, ID3D11DeviceContext* context);
+
+    void Update(
+        ID3D11ShaderResourceView* pViews[][2],
+        const vr::VRTextureBounds_t bounds[][2],
+        int layerCount
+    );
+
+private:
+    static const int READBACK_COUNT = 3;
+    static const uint32_t MEASURE_INTERVAL = 8;
+    // Alpha from which a cell is covered, scaled to 255. The panels of SteamVR overlays are opaque
+    static const uint32_t COVERED_ALPHA = 128;
+
+    struct CoverageParams {
+        float uvMin[2];
+        float uvMax[2];
+        uint32_t cells[2];
+        uint32_t eye;
+        uint32_t padding;
+    };
+
+    // Publishes the oldest coverage that is done
+    void Collect();
+
+    Microsoft::WRL::ComPtr<ID3D11Device> mDevice;
+    Microsoft::WRL::ComPtr<ID3D11DeviceContext> mContext;
+    Microsoft::WRL::ComPtr<ID3D11ComputeShader> mComputeShader;
+    Microsoft::WRL::ComPtr<ID3D11Buffer> mParamsBuffer;
+    Microsoft::WRL::ComPtr<ID3D11Buffer> mCoverageBuffer;
+    Microsoft::WRL::ComPtr<ID3D11UnorderedAccessView> mCoverageView;
+
+    struct Readback {
+        Microsoft::WRL::ComPtr<ID3D11Buffer> buffer;
+        bool pending = false;
+    };
+    Readback mReadbacks[READBACK_COUNT];
+    // Next readback to use, which is also the oldest one
+    int mNext = 0;
+    uint32_t mFrame = 0;
+};
@@ -1,11 +1,16 @@
 #include "OvrDirectModeComponent.h"
+#include "alvr_server/DriverCounters.h"
+#include "alvr_server/FrameMetadata.h"
+#include "alvr_server/StartupProfiler.h"
 
 OvrDirectModeComponent::OvrDirectModeComponent(
     std::shared_ptr<CD3DRender> pD3DRender, std::shared_ptr<PoseHistory> poseHistory
 )
     : m_pD3DRender(pD3DRender)
-    , m_poseHistory(poseHistory)
-    , m_submitLayer(0) { }
+    , m_poseHistory(poseHistory) {
+    // Don't hold Present for longer than a frame
+    m_syncTimeoutMs = (DWORD)ceil(1000.0 / Settings::Instance().m_refreshRate);
+}
 
 void OvrDirectModeComponent::SetEncoder(std::shared_ptr<CEncoder> pEncoder) {
     m_pEncoder = pEncoder;
@@ -32,7 +37,8 @@ void OvrDirectModeComponent::CreateSwapTextureSet(
     D3D11_TEXTURE2D_DESC SharedTextureDesc = {};
     DXGI_FORMAT format = (DXGI_FORMAT)pSwapTextureSetDesc->nFormat;
     SharedTextureDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;
-    if (format == DXGI_FORMAT_R32G8X24_TYPELESS || format == DXGI_FORMAT_R32_TYPELESS) {
+    bool depth = format == DXGI_FORMAT_R32G8X24_TYPELESS || format == DXGI_FORMAT_R32_TYPELESS;
+    if (depth) {
         SharedTextureDesc.BindFlags = D3D11_BIND_DEPTH_STENCIL;
     }
     SharedTextureDesc.ArraySize = 1;
@@ -53,10 +59,29 @@ void OvrDirectModeComponent::CreateSwapTextureSet(
     // D3D11_RESOURCE_MISC_SHARED_NTHANDLE;
     SharedTextureDesc.MiscFlags = D3D11_RESOURCE_MISC_SHARED;
 
+    // The compositor writes the depth of the layers but nothing reads it back, so the content of
+    // the depth textures doesn't matter. They still have to match the requested size, the
+    // compositor copies into them
+    bool sharedDepth = depth && Settings::Instance().m_shareDepthSwapTextures;
+    if (sharedDepth) {
+        std::lock_guard<std::mutex> lock(m_handleMutex);
+        ProcessResource* shared = FindSharedDepth(unPid, SharedTextureDesc);
+        if (shared) {
+            shared->refCount++;
+            for (int i = 0; i < 3; i++) {
+                pOutSwapTextureSet->rSharedTextureHandles[i]
+                    = (vr::SharedTextureHandle_t)shared->sharedHandles[i];
+            }
+            Debug("Reused depth texture %p", shared->sharedHandles[0]);
+            return;
+        }
+    }
+
     ProcessResource* processResource = new ProcessResource();
     processResource->pid = unPid;
+    processResource->sharedDepth = sharedDepth;
 
-    for (int i = 0; i < 3; i++) {
+    for (int i = 0; i < (sharedDepth ? 1 : 3); i++) {
         HRESULT hr = m_pD3DRender->GetDevice()->CreateTexture2D(
             &SharedTextureDesc, NULL, &processResource->textures[i]
         );
@@ -67,6 +92,26 @@ void OvrDirectModeComponent::CreateSwapTextureSet(
             break;
         }
 
+        if (SharedTextureDesc.BindFlags & D3D11_BIND_SHADER_RESOURCE) {
+            D3D11_SHADER_RESOURCE_VIEW_DESC SRVDesc = {};
+            SRVDesc.Format = format;
+            SRVDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+            SRVDesc.Texture2D.MostDetailedMip = 0;
+            SRVDesc.Texture2D.MipLevels = 1;
+            hr = m_pD3DRender->GetDevice()->CreateShaderResourceView(
+                processResource->textures[i].Get(), &SRVDesc, &processResource->views[i]
+            );
+            if (FAILED(hr)) {
+                Error(
+                    "CreateSwapTextureSet CreateShaderResourceView %p %ls",
+                    hr,
+                    GetErrorStr(hr).c_str()
+                );
+                delete processResource;
+                break;
+            }
+        }
+
         IDXGIResource* pResource;
         hr = processResource->textures[i]->QueryInterface(
             __uuidof(IDXGIResource), (void**)&pResource
@@ -88,9 +133,10 @@ void OvrDirectModeComponent::CreateSwapTextureSet(
         // LogDriver("GetSharedHandle %p res:%d %s", processResource->sharedHandles[i], hr,
         // GetDxErrorStr(hr).c_str());
 
-        m_handleMap.insert(
-            std::make_pair(processResource->sharedHandles[i], std::make_pair(processResource, i))
-        );
+        {
+            std::lock_guard<std::mutex> lock(m_handleMutex);
+            m_handleMap.insert({ processResource->sharedHandles[i], { processResource, i } });
+        }
 
         pOutSwapTextureSet->rSharedTextureHandles[i]
             = (vr::SharedTextureHandle_t)processResource->sharedHandles[i];
@@ -98,6 +144,14 @@ void OvrDirectModeComponent::CreateSwapTextureSet(
         pResource->Release();
 
         Debug("Created Texture %d %p", i, processResource->sharedHandles[i]);
+
+        if (sharedDepth) {
+            for (int j = 1; j < 3; j++) {
+                processResource->sharedHandles[j] = processResource->sharedHandles[0];
+                pOutSwapTextureSet->rSharedTextureHandles[j]
+                    = (vr::SharedTextureHandle_t)processResource->sharedHandles[0];
+            }
+        }
     }
     // m_processMap.insert(std::pair<uint32_t, ProcessResource *>(unPid, processResource));
 }
@@ -107,10 +161,14 @@ void OvrDirectModeComponent::CreateSwapTextureSet(
 void OvrDirectModeComponent::DestroySwapTextureSet(vr::SharedTextureHandle_t sharedTextureHandle) {
     Debug("OvrDirectModeComponent::DestroySwapTextureSet %p", sharedTextureHandle);
 
+    std::lock_guard<std::mutex> lock(m_handleMutex);
     auto it = m_handleMap.find((HANDLE)sharedTextureHandle);
     if (it != m_handleMap.end()) {
         // Release all reference (a bit forcible)
         ProcessResource* p = it->second.first;
+        if (--p->refCount > 0) {
+            return;
+        }
         m_handleMap.erase(p->sharedHandles[0]);
         m_handleMap.erase(p->sharedHandles[1]);
         m_handleMap.erase(p->sharedHandles[2]);
@@ -124,6 +182,7 @@ void OvrDirectModeComponent::DestroySwapTextureSet(vr::SharedTextureHandle_t sha
 void OvrDirectModeComponent::DestroyAllSwapTextureSets(uint32_t unPid) {
     Debug("OvrDirectModeComponent::DestroyAllSwapTextureSets pid=%d", unPid);
 
+    std::lock_guard<std::mutex> lock(m_handleMutex);
     for (auto it = m_handleMap.begin(); it != m_handleMap.end();) {
         if (it->second.first->pid == unPid) {
             if (it->second.second == 0) {
@@ -136,6 +195,24 @@ void OvrDirectModeComponent::DestroyAllSwapTextureSets(uint32_t unPid) {
     }
 }
 
+OvrDirectModeComponent::ProcessResource*
+OvrDirectModeComponent::FindSharedDepth(uint32_t pid, const D3D11_TEXTURE2D_DESC& desc) {
+    for (auto& entry : m_handleMap) {
+        ProcessResource* p = entry.second.first;
+        if (!p->sharedDepth || p->pid != pid) {
+            continue;
+        }
+        D3D11_TEXTURE2D_DESC sharedDesc;
+        p->textures[0]->GetDesc(&sharedDesc);
+        if (sharedDesc.Width == desc.Width && sharedDesc.Height == desc.Height
+            && sharedDesc.Format == desc.Format
+            && sharedDesc.SampleDesc.Count == desc.SampleDesc.Count) {
+            return p;
+        }
+    }
+    return nullptr;
+}
+
 /** After Present returns, calls this to get the next index to use for rendering. */
 void OvrDirectModeComponent::GetNextSwapTextureSetIndex(
     vr::SharedTextureHandle_t sharedTextureHandles[2], uint32_t (*pIndices)[2]
@@ -154,13 +231,14 @@ void OvrDirectModeComponent::GetNextSwapTextureSetIndex(
 void OvrDirectModeComponent::SubmitLayer(const SubmitLayerPerEye_t (&perEye)[2]) {
     Debug("OvrDirectModeComponent::SubmitLayer");
 
-    m_presentMutex.lock();
+    std::lock_guard<std::mutex> lock(m_layerMutex);
+    FrameLayers& frame = *m_backFrame;
 
     // mHmdPose is the same pose for both eyes, getting the eye view pose
     //  requires some records keeping, unfortunately (m_eyeToHead)
     auto pPose = &perEye[0].mHmdPose;
 
-    if (m_submitLayer == 0) {
+    if (frame.count == 0) {
         // Detect FrameIndex of submitted frame by pPose.
         // This is important part to achieve smooth headtracking.
         // We search for history of TrackingInfo and find the TrackingInfo which have nearest matrix
@@ -169,8 +247,10 @@ void OvrDirectModeComponent::SubmitLayer(const SubmitLayerPerEye_t (&perEye)[2])
         auto pose = m_poseHistory->GetBestPoseMatch(*pPose);
         if (pose) {
             // found the frameIndex
-            m_prevTargetTimestampNs = m_targetTimestampNs;
-            m_targetTimestampNs = pose->targetTimestampNs;
+            frame.prevTargetTimestampNs = frame.targetTimestampNs;
+            frame.targetTimestampNs = pose->targetTimestampNs;
+            FrameTrace::Instance().Record(frame.targetTimestampNs, FRAME_TRACE_POSE_MATCHED);
+            StreamStart::Mark(StreamStart::FIRST_POSE_MATCH);
 
             m_prevFramePoseRotation = m_framePoseRotation;
             m_framePoseRotation.x = pose->motion.pose.orientation.x;
@@ -178,47 +258,64 @@ void OvrDirectModeComponent::SubmitLayer(const SubmitLayerPerEye_t (&perEye)[2])
             m_framePoseRotation.z = pose->motion.pose.orientation.z;
             m_framePoseRotation.w = pose->motion.pose.orientation.w;
         } else {
-            m_targetTimestampNs = 0;
+            frame.targetTimestampNs = 0;
             m_framePoseRotation = HmdQuaternion_Init(0.0, 0.0, 0.0, 0.0);
         }
     }
-    if (m_submitLayer < MAX_LAYERS) {
-        m_submitLayers[m_submitLayer][0] = perEye[0];
-        m_submitLayers[m_submitLayer][1] = perEye[1];
-        m_submitLayer++;
+    if (frame.count < MAX_LAYERS) {
+        frame.layers[frame.count][0] = perEye[0];
+        frame.layers[frame.count][1] = perEye[1];
+        frame.count++;
     } else {
         Warn("Too many layers submitted!");
     }
-
-    // CopyTexture();
-
-    m_presentMutex.unlock();
 }
 
 /** Submits queued layers for display. */
 void OvrDirectModeComponent::Present(vr::SharedTextureHandle_t syncTexture) {
     Debug("OvrDirectModeComponent::Present");
 
-    m_presentMutex.lock();
+    // Present is called from a single thread, only the layers submitted meanwhile go to the other
+    // frame. The new back frame continues from the timestamps of this one, like when a frame
+    // is presented again without its layers being submitted
+    {
+        std::lock_guard<std::mutex> lock(m_layerMutex);
+        std::swap(m_frontFrame, m_backFrame);
+        m_backFrame->count = 0;
+        m_backFrame->targetTimestampNs = m_frontFrame->targetTimestampNs;
+        m_backFrame->prevTargetTimestampNs = m_frontFrame->prevTargetTimestampNs;
+    }
+    const FrameLayers& frame = *m_frontFrame;
+    uint64_t targetTimestampNs = frame.targetTimestampNs;
+
+    TraceScope scope("OvrDirectModeComponent::Present", targetTimestampNs);
 
-    ReportPresent(m_targetTimestampNs, 0);
+    FrameTrace::Instance().Record(targetTimestampNs, FRAME_TRACE_PRESENT);
+    StreamStart::Mark(StreamStart::FIRST_PRESENT);
+    ReportPresent(targetTimestampNs, 0);
 
     bool useMutex = true;
 
     IDXGIKeyedMutex* pKeyedMutex = NULL;
 
-    uint32_t layerCount = m_submitLayer;
-    m_submitLayer = 0;
+    // The game missed its frame and the compositor presents the same one again. The client is
+    // still showing it, so it doesn't need to be composited and encoded again
+    if (targetTimestampNs != 0 && frame.prevTargetTimestampNs == targetTimestampNs) {
+        DriverCounters::Add(DRIVER_COUNTER_DUPLICATE_FRAMES);
+        if (Settings::Instance().m_skipDuplicateFrames) {
+            Debug("Discard duplicated frame. FrameIndex=%llu", targetTimestampNs);
+            return;
+        }
+    }
 
-    if (m_prevTargetTimestampNs == m_targetTimestampNs) {
-        Debug("Discard duplicated frame. FrameIndex=%llu (Ignoring)", m_targetTimestampNs);
-        // return;
+    // The client reprojects the previous frame in place of the ones the decimation skips
+    if (!ShouldEncodeFrame()) {
+        return;
     }
 
     ID3D11Texture2D* pSyncTexture = m_pD3DRender->GetSharedTexture((HANDLE)syncTexture);
     if (!pSyncTexture) {
         Warn("[VDispDvr] SyncTexture is NULL!");
-        m_presentMutex.unlock();
         return;
     }
 
@@ -228,20 +325,23 @@ void OvrDirectModeComponent::Present(vr::SharedTextureHandle_t syncTexture) {
         // This enforces scheduling of work on the gpu between processes.
         if (SUCCEEDED(pSyncTexture->QueryInterface(__uuidof(IDXGIKeyedMutex), (void**)&pKeyedMutex)
             )) {
-            // TODO: Reasonable timeout and timeout handling
-            HRESULT hr = pKeyedMutex->AcquireSync(0, 10);
+            // The keyed mutex is the protocol of the compositor which owns the sync texture, so
+            // it can't be replaced by a shared fence from our side
+            uint64_t waitBegin = GetTimestampUs();
+            HRESULT hr = pKeyedMutex->AcquireSync(0, m_syncTimeoutMs);
+            ReportSyncWait(GetTimestampUs() - waitBegin, hr == S_OK);
             if (hr != S_OK) {
+                DriverCounters::Add(DRIVER_COUNTER_ACQUIRE_SYNC_FAILURES);
                 Debug(
                     "[VDispDvr] ACQUIRESYNC FAILED!!! hr=%d %p %ls", hr, hr, GetErrorStr(hr).c_str()
                 );
                 pKeyedMutex->Release();
-                m_presentMutex.unlock();
                 return;
             }
         }
     }
 
-    CopyTexture(layerCount);
+    CopyTexture(frame);
 
     if (useMutex) {
         if (pKeyedMutex) {
@@ -250,13 +350,36 @@ void OvrDirectModeComponent::Present(vr::SharedTextureHandle_t syncTexture) {
         }
     }
 
-    ReportComposed(m_targetTimestampNs, 0);
+    // The statistics follow the frame under the timestamp it is sent with
+    ReportComposed(m_sentTimestampNs, 0);
 
     if (m_pEncoder) {
         m_pEncoder->NewFrameReady();
     }
+}
 
-    m_presentMutex.unlock();
+void OvrDirectModeComponent::ReportSyncWait(uint64_t waitUs, bool acquired) {
+    m_syncWaitTotalUs += waitUs;
+    if (waitUs > m_syncWaitMaxUs) {
+        m_syncWaitMaxUs = waitUs;
+    }
+    m_syncWaitCount++;
+    if (!acquired) {
+        m_syncTimeouts++;
+    }
+
+    if (m_syncWaitCount == SYNC_STATS_INTERVAL) {
+        Debug(
+            "OvrDirectModeComponent: sync texture wait avg=%lluus max=%lluus timeouts=%u",
+            m_syncWaitTotalUs / m_syncWaitCount,
+            m_syncWaitMaxUs,
+            m_syncTimeouts
+        );
+        m_syncWaitTotalUs = 0;
+        m_syncWaitMaxUs = 0;
+        m_syncWaitCount = 0;
+        m_syncTimeouts = 0;
+    }
 }
 
 void OvrDirectModeComponent::PostPresent() {
@@ -265,18 +388,22 @@ void OvrDirectModeComponent::PostPresent() {
     WaitForVSync();
 }
 
-void OvrDirectModeComponent::CopyTexture(uint32_t layerCount) {
+void OvrDirectModeComponent::CopyTexture(const FrameLayers& frame) {
+    TraceScope scope("OvrDirectModeComponent::CopyTexture", frame.targetTimestampNs);
 
     uint64_t presentationTime = GetTimestampUs();
 
-    ID3D11Texture2D* pTexture[MAX_LAYERS][2];
-    ComPtr<ID3D11Texture2D> Texture[MAX_LAYERS][2];
+    ID3D11ShaderResourceView* pViews[MAX_LAYERS][2];
+    ComPtr<ID3D11ShaderResourceView> Views[MAX_LAYERS][2];
     vr::VRTextureBounds_t bounds[MAX_LAYERS][2];
     vr::HmdMatrix34_t poses[MAX_LAYERS];
+    uint32_t layerCount = frame.count;
 
+    // The views keep the textures alive if the process destroys them during the copy
+    std::unique_lock<std::mutex> handleLock(m_handleMutex);
     for (uint32_t i = 0; i < layerCount; i++) {
         // Find left eye texture.
-        HANDLE leftEyeTexture = (HANDLE)m_submitLayers[i][0].hTexture;
+        HANDLE leftEyeTexture = (HANDLE)frame.layers[i][0].hTexture;
         auto it = m_handleMap.find(leftEyeTexture);
         if (it == m_handleMap.end()) {
             // Ignore this layer.
@@ -288,12 +415,10 @@ void OvrDirectModeComponent::CopyTexture(uint32_t layerCount) {
                 leftEyeTexture
             );
         } else {
-            Texture[i][0] = it->second.first->textures[it->second.second];
-            D3D11_TEXTURE2D_DESC desc;
-            Texture[i][0]->GetDesc(&desc);
+            Views[i][0] = it->second.first->views[it->second.second];
 
             // Find right eye texture.
-            HANDLE rightEyeTexture = (HANDLE)m_submitLayers[i][1].hTexture;
+            HANDLE rightEyeTexture = (HANDLE)frame.layers[i][1].hTexture;
             it = m_handleMap.find(rightEyeTexture);
             if (it == m_handleMap.end()) {
                 // Ignore this layer
@@ -304,36 +429,51 @@ void OvrDirectModeComponent::CopyTexture(uint32_t layerCount) {
                     layerCount,
                     rightEyeTexture
                 );
-                Texture[i][0].Reset();
+                Views[i][0].Reset();
             } else {
-                Texture[i][1] = it->second.first->textures[it->second.second];
+                Views[i][1] = it->second.first->views[it->second.second];
             }
         }
 
-        pTexture[i][0] = Texture[i][0].Get();
-        pTexture[i][1] = Texture[i][1].Get();
-        bounds[i][0] = m_submitLayers[i][0].bounds;
-        bounds[i][1] = m_submitLayers[i][1].bounds;
-        poses[i] = m_submitLayers[i][0].mHmdPose;
+        pViews[i][0] = Views[i][0].Get();
+        pViews[i][1] = Views[i][1].Get();
+        bounds[i][0] = frame.layers[i][0].bounds;
+        bounds[i][1] = frame.layers[i][1].bounds;
+        poses[i] = frame.layers[i][0].mHmdPose;
     }
-
-    // This can go away, but is useful to see it as a separate packet on the gpu in traces.
-    m_pD3DRender->GetContext()->Flush();
+    handleLock.unlock();
 
     if (m_pEncoder) {
-        // Wait for the encoder to be ready.  This is important because the encoder thread
-        // blocks on transmit which uses our shared d3d context (which is not thread safe).
-        m_pEncoder->WaitForEncode();
-
+        // The encoder reads its own copy of the frame, no need to wait for it to finish the
+        // previous one. The d3d context is multithread protected
         std::string debugText;
 
-        uint64_t submitFrameIndex = m_targetTimestampNs;
+        uint64_t submitFrameIndex = frame.targetTimestampNs;
+        vr::HmdMatrix34_t targetPose = poses[0];
+
+        // The game rendered for the pose it was given a frame ago, a newer one has usually
+        // arrived since. The layers are turned to it, and the frame is sent for its timestamp so
+        // that the client reprojects from there. Never older than the last frame sent, the client
+        // would reproject backwards
+        if (Settings::Instance().m_lateLatchPose && frame.targetTimestampNs != 0) {
+            auto latest = m_poseHistory->GetLatestPose();
+            if (latest && latest->targetTimestampNs > frame.targetTimestampNs
+                && latest->targetTimestampNs > m_sentTimestampNs) {
+                targetPose = latest->rotationMatrix;
+                submitFrameIndex = latest->targetTimestampNs;
+                FrameMetadata::Instance().SetFlags(
+                    submitFrameIndex, FrameMetadata::FLAG_REPROJECTED
+                );
+            }
+        }
+        m_sentTimestampNs = submitFrameIndex;
 
         // Copy entire texture to staging so we can read the pixels to send to remote device.
         m_pEncoder->CopyToStaging(
-            pTexture,
+            pViews,
             bounds,
             poses,
+            targetPose,
             layerCount,
             false,
             presentationTime,
@@ -48,9 +48,21 @@ public:
      * successfully acquired the sync texture in Present.*/
     virtual void PostPresent();
 
-    void CopyTexture(uint32_t layerCount);
-
 private:
+    static const int MAX_LAYERS = 10;
+
+    // The layers of a frame. SubmitLayer fills the back one while Present copies the front one,
+    // they are swapped when Present starts
+    struct FrameLayers {
+        SubmitLayerPerEye_t layers[MAX_LAYERS][2];
+        uint32_t count = 0;
+        uint64_t targetTimestampNs = 0;
+        uint64_t prevTargetTimestampNs = 0;
+    };
+
+    void CopyTexture(const FrameLayers& frame);
+    void ReportSyncWait(uint64_t waitUs, bool acquired);
+
     std::shared_ptr<CD3DRender> m_pD3DRender;
     std::shared_ptr<CEncoder> m_pEncoder;
     std::shared_ptr<PoseHistory> m_poseHistory;
@@ -58,18 +70,40 @@ private:
     // Resource for each process
     struct ProcessResource {
         ComPtr<ID3D11Texture2D> textures[3];
+        // Created once with the textures so that layers can be composited without new views
+        ComPtr<ID3D11ShaderResourceView> views[3];
         HANDLE sharedHandles[3];
         uint32_t pid;
+        // Depth set whose single texture stands for the three, shared by the sets of the process
+        // with the same description. Destroyed with the last of them
+        bool sharedDepth = false;
+        uint32_t refCount = 1;
     };
+    // Called with m_handleMutex held
+    ProcessResource* FindSharedDepth(uint32_t pid, const D3D11_TEXTURE2D_DESC& desc);
     std::map<HANDLE, std::pair<ProcessResource*, int>> m_handleMap;
-
-    static const int MAX_LAYERS = 10;
-    int m_submitLayer;
-    SubmitLayerPerEye_t m_submitLayers[MAX_LAYERS][2];
+    // Guards m_handleMap and the reference counts, only while they are read or changed. The
+    // textures of a frame are held by their views while it's copied
+    std::mutex m_handleMutex;
+
+    FrameLayers m_frames[2];
+    FrameLayers* m_backFrame = &m_frames[0];
+    FrameLayers* m_frontFrame = &m_frames[1];
+    // Held to add a layer to the back frame and to swap the frames, never across the copy, so
+    // that the submit thread doesn't wait for Present
+    std::mutex m_layerMutex;
     vr::HmdQuaternion_t m_prevFramePoseRotation;
     vr::HmdQuaternion_t m_framePoseRotation;
-    uint64_t m_targetTimestampNs;
-    uint64_t m_prevTargetTimestampNs;
-
-    std::mutex m_presentMutex;
+    // Timestamp of the last frame given to the encoder, newer than the target timestamp of the
+    // frame when the pose was late latched. Only used by Present
+    uint64_t m_sentTimestampNs = 0;
+
+    DWORD m_syncTimeoutMs;
+    // How long Present waited for the compositor to release the sync texture, logged every
+    // SYNC_STATS_INTERVAL frames
+    static const uint32_t SYNC_STATS_INTERVAL = 1000;
+    uint64_t m_syncWaitTotalUs = 0;
+    uint64_t m_syncWaitMaxUs = 0;
+    uint32_t m_syncWaitCount = 0;
+    uint32_t m_syncTimeouts = 0;
 };
@@ -0,0 +1,302 @@
+#include "RgbaToYuv420.h"
+
+#include "alvr_server/Logger.h"
+#include "alvr_server/Settings.h"
+#include "alvr_server/ThreadPolicy.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#endif
+
+namespace {
+// BT.709 full range in 8 bit fixed point, the coefficients of the GPU conversion rounded so that
+// white stays 255 and grays have no chroma
+const int Y_R = 54, Y_G = 183, Y_B = 19;
+const int U_R = -29, U_G = -98, U_B = 127;
+const int V_R = 127, V_G = -116, V_B = -11;
+
+inline uint8_t Luma(const uint8_t* pixel) {
+    return (uint8_t)((Y_R * pixel[0] + Y_G * pixel[1] + Y_B * pixel[2] + 128) >> 8);
+}
+
+// From the averages of the 2x2 pixels
+inline void Chroma(int r, int g, int b, uint8_t* u, uint8_t* v) {
+    *u = (uint8_t)(((U_R * r + U_G * g + U_B * b + 128) >> 8) + 128);
+    *v = (uint8_t)(((V_R * r + V_G * g + V_B * b + 128) >> 8) + 128);
+}
+
+// Same as the SIMD kernels, from column x on. A last odd column is paired with itself
+void ConvertRowPairScalar(
+    const uint8_t* row0,
+    const uint8_t* row1,
+    uint32_t x,
+    uint32_t width,
+    uint8_t* y0,
+    uint8_t* y1,
+    uint8_t* u,
+    uint8_t* v
+) {
+    for (; x < width; x += 2) {
+        uint32_t x1 = std::min(x + 1, width - 1);
+        const uint8_t* p[4] = { row0 + x * 4, row0 + x1 * 4, row1 + x * 4, row1 + x1 * 4 };
+
+        y0[x] = Luma(p[0]);
+        y0[x1] = Luma(p[1]);
+        y1[x] = Luma(p[2]);
+        y1[x1] = Luma(p[3]);
+
+        int sum[3];
+        for (int c = 0; c < 3; c++) {
+            sum[c] = (p[0][c] + p[1][c] + p[2][c] + p[3][c] + 2) >> 2;
+        }
+        Chroma(sum[0], sum[1], sum[2], &u[x / 2], &v[x / 2]);
+    }
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+// R, G and B of 8 pixels in 16 bit lanes
+inline void Unpack(const uint8_t* pixels, __m128i& r, __m128i& g, __m128i& b) {
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    __m128i p0 = _mm_loadu_si128((const __m128i*)pixels);
+    __m128i p1 = _mm_loadu_si128((const __m128i*)(pixels + 16));
+    r = _mm_packs_epi32(_mm_and_si128(p0, mask), _mm_and_si128(p1, mask));
+    g = _mm_packs_epi32(
+        _mm_and_si128(_mm_srli_epi32(p0, 8), mask), _mm_and_si128(_mm_srli_epi32(p1, 8), mask)
+    );
+    b = _mm_packs_epi32(
+        _mm_and_si128(_mm_srli_epi32(p0, 16), mask), _mm_and_si128(_mm_srli_epi32(p1, 16), mask)
+    );
+}
+
+// The products fit in unsigned 16 bit, the weights sum to 256
+inline __m128i Luma(__m128i r, __m128i g, __m128i b) {
+    __m128i y = _mm_add_epi16(
+        _mm_add_epi16(
+            _mm_mullo_epi16(r, _mm_set1_epi16(Y_R)), _mm_mullo_epi16(g, _mm_set1_epi16(Y_G))
+        ),
+        _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(Y_B)), _mm_set1_epi16(128))
+    );
+    return _mm_srli_epi16(y, 8);
+}
+
+// Averages of the 2x2 blocks of 8 pixels of two rows, in the 4 low lanes and repeated above
+inline __m128i Average(__m128i row0, __m128i row1) {
+    __m128i pairs = _mm_madd_epi16(_mm_add_epi16(row0, row1), _mm_set1_epi16(1));
+    pairs = _mm_srli_epi32(_mm_add_epi32(pairs, _mm_set1_epi32(2)), 2);
+    return _mm_packs_epi32(pairs, pairs);
+}
+
+inline __m128i Chroma(__m128i r, __m128i g, __m128i b, int kr, int kg, int kb) {
+    __m128i c = _mm_add_epi16(
+        _mm_add_epi16(
+            _mm_mullo_epi16(r, _mm_set1_epi16(kr)), _mm_mullo_epi16(g, _mm_set1_epi16(kg))
+        ),
+        _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(kb)), _mm_set1_epi16(128))
+    );
+    c = _mm_add_epi16(_mm_srai_epi16(c, 8), _mm_set1_epi16(128));
+    return _mm_packus_epi16(c, c);
+}
+
+void ConvertRowPair(
+    const uint8_t* row0,
+    const uint8_t* row1,
+    uint32_t width,
+    uint8_t* y0,
+    uint8_t* y1,
+    uint8_t* u,
+    uint8_t* v
+) {
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i r0, g0, b0, r1, g1, b1;
+        Unpack(row0 + x * 4, r0, g0, b0);
+        Unpack(row1 + x * 4, r1, g1, b1);
+
+        __m128i luma0 = Luma(r0, g0, b0);
+        __m128i luma1 = Luma(r1, g1, b1);
+        _mm_storel_epi64((__m128i*)(y0 + x), _mm_packus_epi16(luma0, luma0));
+        _mm_storel_epi64((__m128i*)(y1 + x), _mm_packus_epi16(luma1, luma1));
+
+        __m128i r = Average(r0, r1);
+        __m128i g = Average(g0, g1);
+        __m128i b = Average(b0, b1);
+        int chromaU = _mm_cvtsi128_si32(Chroma(r, g, b, U_R, U_G, U_B));
+        int chromaV = _mm_cvtsi128_si32(Chroma(r, g, b, V_R, V_G, V_B));
+        memcpy(u + x / 2, &chromaU, 4);
+        memcpy(v + x / 2, &chromaV, 4);
+    }
+    ConvertRowPairScalar(row0, row1, x, width, y0, y1, u, v);
+}
+#elif defined(__aarch64__) || defined(_M_ARM64)
+inline uint8x16_t Luma(const uint8x16x4_t& p) {
+    uint16x8_t low = vmull_u8(vget_low_u8(p.val[0]), vdup_n_u8(Y_R));
+    low = vmlal_u8(low, vget_low_u8(p.val[1]), vdup_n_u8(Y_G));
+    low = vmlal_u8(low, vget_low_u8(p.val[2]), vdup_n_u8(Y_B));
+    uint16x8_t high = vmull_u8(vget_high_u8(p.val[0]), vdup_n_u8(Y_R));
+    high = vmlal_u8(high, vget_high_u8(p.val[1]), vdup_n_u8(Y_G));
+    high = vmlal_u8(high, vget_high_u8(p.val[2]), vdup_n_u8(Y_B));
+    return vcombine_u8(vrshrn_n_u16(low, 8), vrshrn_n_u16(high, 8));
+}
+
+// Averages of the 2x2 blocks of 16 pixels of two rows
+inline int16x8_t Average(uint8x16_t row0, uint8x16_t row1) {
+    return vreinterpretq_s16_u16(vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(row0), row1), 2));
+}
+
+inline uint8x8_t Chroma(int16x8_t r, int16x8_t g, int16x8_t b, int kr, int kg, int kb) {
+    int16x8_t c = vmulq_n_s16(r, kr);
+    c = vmlaq_n_s16(c, g, kg);
+    c = vmlaq_n_s16(c, b, kb);
+    return vqmovun_s16(vaddq_s16(vrshrq_n_s16(c, 8), vdupq_n_s16(128)));
+}
+
+void ConvertRowPair(
+    const uint8_t* row0,
+    const uint8_t* row1,
+    uint32_t width,
+    uint8_t* y0,
+    uint8_t* y1,
+    uint8_t* u,
+    uint8_t* v
+) {
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x4_t p0 = vld4q_u8(row0 + x * 4);
+        uint8x16x4_t p1 = vld4q_u8(row1 + x * 4);
+
+        vst1q_u8(y0 + x, Luma(p0));
+        vst1q_u8(y1 + x, Luma(p1));
+
+        int16x8_t r = Average(p0.val[0], p1.val[0]);
+        int16x8_t g = Average(p0.val[1], p1.val[1]);
+        int16x8_t b = Average(p0.val[2], p1.val[2]);
+        vst1_u8(u + x / 2, Chroma(r, g, b, U_R, U_G, U_B));
+        vst1_u8(v + x / 2, Chroma(r, g, b, V_R, V_G, V_B));
+    }
+    ConvertRowPairScalar(row0, row1, x, width, y0, y1, u, v);
+}
+#else
+void ConvertRowPair(
+    const uint8_t* row0,
+    const uint8_t* row1,
+    uint32_t width,
+    uint8_t* y0,
+    uint8_t* y1,
+    uint8_t* u,
+    uint8_t* v
+) {
+    ConvertRowPairScalar(row0, row1, 0, width, y0, y1, u, v);
+}
+#endif
+}
+
+RgbaToYuv420::RgbaToYuv420(uint32_t threadCount) {
+    if (threadCount == 0) {
+        threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    m_bandCount = std::min(threadCount, MAX_THREADS);
+
+    for (uint32_t band = 1; band < m_bandCount; band++) {
+        m_workers.emplace_back(&RgbaToYuv420::WorkerLoop, this, band);
+    }
+    Debug("RGBA to YUV conversion on %u threads\n", m_bandCount);
+}
+
+RgbaToYuv420::~RgbaToYuv420() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_exiting = true;
+    }
+    m_workCv.notify_all();
+    for (auto& worker : m_workers) {
+        worker.join();
+    }
+}
+
+void RgbaToYuv420::Convert(
+    const uint8_t* rgba,
+    uint32_t rgbaPitch,
+    uint32_t width,
+    uint32_t height,
+    uint8_t* const yuv[3],
+    const int yuvPitch[3]
+) {
+    Job job = { rgba, rgbaPitch, width, height };
+    for (int plane = 0; plane < 3; plane++) {
+        job.yuv[plane] = yuv[plane];
+        job.yuvPitch[plane] = yuvPitch[plane];
+    }
+
+    if (!m_workers.empty()) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_job = job;
+            m_pendingBands = (uint32_t)m_workers.size();
+            m_generation++;
+        }
+        m_workCv.notify_all();
+    }
+
+    // The calling thread takes the first band instead of waiting idle
+    ConvertBand(job, 0);
+
+    if (!m_workers.empty()) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_doneCv.wait(lock, [&] { return m_pendingBands == 0; });
+    }
+}
+
+void RgbaToYuv420::WorkerLoop(uint32_t band) {
+    // The priority of the encoder thread the bands are converted for, without its affinity
+    ThreadRoleConfig config = { Settings::Instance().m_encoderThread.priority, 0 };
+    std::string report = ApplyThreadRole(ThreadRole::Encoder, config);
+    Debug("RGBA to YUV worker %u, %s\n", band, report.c_str());
+
+    uint64_t generation = 0;
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_workCv.wait(lock, [&] { return m_exiting || m_generation != generation; });
+            if (m_exiting) {
+                return;
+            }
+            generation = m_generation;
+            job = m_job;
+        }
+
+        ConvertBand(job, band);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--m_pendingBands == 0) {
+            m_doneCv.notify_one();
+        }
+    }
+}
+
+void RgbaToYuv420::ConvertBand(const Job& job, uint32_t band) {
+    const uint32_t rowPairs = (job.height + 1) / 2;
+    const uint32_t begin = (uint32_t)((uint64_t)rowPairs * band / m_bandCount);
+    const uint32_t end = (uint32_t)((uint64_t)rowPairs * (band + 1) / m_bandCount);
+
+    for (uint32_t pair = begin; pair < end; pair++) {
+        uint32_t y = pair * 2;
+        // A last odd row is paired with itself, and written twice
+        uint32_t y1 = std::min(y + 1, job.height - 1);
+        ConvertRowPair(
+            job.rgba + (size_t)y * job.rgbaPitch,
+            job.rgba + (size_t)y1 * job.rgbaPitch,
+            job.width,
+            job.yuv[0] + (size_t)y * job.yuvPitch[0],
+            job.yuv[0] + (size_t)y1 * job.yuvPitch[0],
+            job.yuv[1] + (size_t)pair * job.yuvPitch[1],
+            job.yuv[2] + (size_t)pair * job.yuvPitch[2]
+        );
+    }
+}
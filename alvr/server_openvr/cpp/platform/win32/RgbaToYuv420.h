@@ -0,0 +1,57 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Converts RGBA frames to 8 bit planar YUV 4:2:0 of the same size, in BT.709 full range like the
+// GPU conversion, for the software encoder. The frame is split in horizontal bands that are
+// converted in parallel by a pool of workers and the calling thread, each with SSE2 or NEON. For
+// frames that also need scaling, or other formats, swscale is used instead.
+class RgbaToYuv420 {
+public:
+    // threadCount includes the calling thread, 0 picks one per core up to MAX_THREADS
+    explicit RgbaToYuv420(uint32_t threadCount = 0);
+    ~RgbaToYuv420();
+
+    // Returns once the whole frame is converted. Odd sizes are allowed, the last chroma sample
+    // then covers the last column or row only
+    void Convert(
+        const uint8_t* rgba,
+        uint32_t rgbaPitch,
+        uint32_t width,
+        uint32_t height,
+        uint8_t* const yuv[3],
+        const int yuvPitch[3]
+    );
+
+private:
+    static constexpr uint32_t MAX_THREADS = 8;
+
+    struct Job {
+        const uint8_t* rgba;
+        uint32_t rgbaPitch;
+        uint32_t width;
+        uint32_t height;
+        uint8_t* yuv[3];
+        int yuvPitch[3];
+    };
+
+    void WorkerLoop(uint32_t band);
+    // Rows are split in pairs, so that each band has whole chroma rows
+    void ConvertBand(const Job& job, uint32_t band);
+
+    uint32_t m_bandCount;
+    std::vector<std::thread> m_workers;
+
+    std::mutex m_mutex;
+    std::condition_variable m_workCv;
+    std::condition_variable m_doneCv;
+    Job m_job = {};
+    // Incremented for each frame, the workers wait for the next value
+    uint64_t m_generation = 0;
+    uint32_t m_pendingBands = 0;
+    bool m_exiting = false;
+};
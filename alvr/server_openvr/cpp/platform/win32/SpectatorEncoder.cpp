@@ -0,0 +1,106 @@
+#include "SpectatorEncoder.h"
+
+#include <algorithm>
+
+#include "alvr_server/Logger.h"
+#include "alvr_server/Settings.h"
+#include "alvr_server/bindings.h"
+
+SpectatorEncoder::SpectatorEncoder(
+    std::shared_ptr<CD3DRender> d3dRender, uint32_t frameWidth, uint32_t frameHeight
+)
+    : mD3DRender(d3dRender) {
+    auto& settings = Settings::Instance();
+
+    // The height follows the aspect ratio of the frame, both are even for 4:2:0
+    mWidth = std::min(settings.m_spectatorWidth, frameWidth) & ~1u;
+    mHeight = (uint32_t)((uint64_t)frameHeight * mWidth / frameWidth) & ~1u;
+    uint32_t divisor = std::max(settings.m_spectatorFramerateDivisor, 1u);
+    uint32_t framerate = std::max((uint32_t)settings.m_refreshRate / divisor, 1u);
+    uint32_t bitrate = settings.m_spectatorBitrateMbps * 1'000'000;
+
+    mScaler = std::make_unique<VideoScaler>(
+        d3dRender->GetDevice(), d3dRender->GetContext(), frameWidth, frameHeight, mWidth, mHeight
+    );
+
+    try {
+        mEncoder = std::make_unique<NvEncoderD3D11>(
+            d3dRender->GetDevice(), mWidth, mHeight, NV_ENC_BUFFER_FORMAT_NV12, 0
+        );
+
+        NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+        NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+        initializeParams.encodeConfig = &encodeConfig;
+        mEncoder->CreateDefaultEncoderParams(
+            &initializeParams,
+            NV_ENC_CODEC_H264_GUID,
+            NV_ENC_PRESET_P1_GUID,
+            NV_ENC_TUNING_INFO_ULTRA_LOW_LATENCY
+        );
+        initializeParams.frameRateNum = framerate;
+        initializeParams.frameRateDen = 1;
+
+        encodeConfig.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR;
+        encodeConfig.rcParams.averageBitRate = bitrate;
+        encodeConfig.rcParams.maxBitRate = bitrate;
+        encodeConfig.rcParams.vbvBufferSize = bitrate / framerate;
+        encodeConfig.rcParams.vbvInitialDelay = bitrate / framerate;
+
+        // Nothing is lost on the websocket, the IDRs are only for the spectators that join late
+        encodeConfig.gopLength = framerate * 2;
+        auto& config = encodeConfig.encodeCodecConfig.h264Config;
+        config.idrPeriod = encodeConfig.gopLength;
+        config.repeatSPSPPS = 1;
+
+        config.h264VUIParameters.videoSignalTypePresentFlag = 1;
+        config.h264VUIParameters.videoFormat = NV_ENC_VUI_VIDEO_FORMAT_UNSPECIFIED;
+        config.h264VUIParameters.videoFullRangeFlag = 1;
+        config.h264VUIParameters.colourDescriptionPresentFlag = 1;
+        config.h264VUIParameters.colourPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT709;
+        config.h264VUIParameters.transferCharacteristics = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
+        config.h264VUIParameters.colourMatrix = NV_ENC_VUI_MATRIX_COEFFS_BT709;
+
+        mEncoder->CreateEncoder(&initializeParams);
+    } catch (NVENCException e) {
+        throw MakeException(
+            "Spectator NvEnc CreateEncoder failed. Code=%d %hs", e.getErrorCode(), e.what()
+        );
+    }
+
+    Info(
+        "SpectatorEncoder: %dx%d at %d fps, %d Mbps\n",
+        mWidth,
+        mHeight,
+        framerate,
+        settings.m_spectatorBitrateMbps
+    );
+}
+
+SpectatorEncoder::~SpectatorEncoder() {
+    if (mEncoder) {
+        std::vector<std::vector<uint8_t>> packets;
+        mEncoder->EndEncode(packets);
+        mEncoder->DestroyEncoder();
+    }
+}
+
+void SpectatorEncoder::Encode(ID3D11Texture2D* frame) {
+    const NvEncInputFrame* encoderInputFrame = mEncoder->GetNextInputFrame();
+    if (!mScaler->Blit(
+            frame, reinterpret_cast<ID3D11Texture2D*>(encoderInputFrame->inputPtr), mWidth, mHeight
+        )) {
+        return;
+    }
+
+    std::vector<std::vector<uint8_t>> packets;
+    try {
+        mEncoder->EncodeFrame(packets);
+    } catch (NVENCException e) {
+        Warn("SpectatorEncoder: EncodeFrame failed. Code=%d %hs\n", e.getErrorCode(), e.what());
+        return;
+    }
+
+    for (std::vector<uint8_t>& packet : packets) {
+        SpectatorSend(packet.data(), (int)packet.size());
+    }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "NvEncoderD3D11.h"
+#include "VideoScaler.h"
+#include "shared/d3drender.h"
+#include <d3d11.h>
+#include <memory>
+
+// Second NVENC session encoding a downscaled H.264 copy of the composited frames, for an observer
+// screen. The frame is scaled and converted to NV12 by the D3D11 video processor straight into the
+// input buffer of the encoder, the main stream is not touched.
+class SpectatorEncoder {
+public:
+    // Throws if NVENC or the video processor can't be used. The frames must have the size given
+    // here and be bindable as shader resources.
+    SpectatorEncoder(
+        std::shared_ptr<CD3DRender> d3dRender, uint32_t frameWidth, uint32_t frameHeight
+    );
+    ~SpectatorEncoder();
+
+    // Encodes synchronously on the calling thread and hands the packet to SpectatorSend. Must be
+    // called from the encoder thread, which owns the immediate context meanwhile
+    void Encode(ID3D11Texture2D* frame);
+
+private:
+    std::shared_ptr<CD3DRender> mD3DRender;
+    std::unique_ptr<VideoScaler> mScaler;
+    std::unique_ptr<NvEncoderD3D11> mEncoder;
+
+    uint32_t mWidth;
+    uint32_t mHeight;
+};
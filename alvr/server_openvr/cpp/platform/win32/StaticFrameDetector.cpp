@@ -0,0 +1,140 @@
+#include "StaticFrameDetector.h"
+
+#include <d3dcompiler.h>
+
+#include "alvr_server/bindings.h"
+
+#pragma comment(lib, "d3dcompiler.lib")
+
+using Microsoft::WRL::ComPtr;
+
+StaticFrameDetector::StaticFrameDetector(ID3D11Device* device)
+    : mDevice(device) {
+    mDevice->GetImmediateContext(&mImmediateContext);
+}
+
+void StaticFrameDetector::Initialize(const std::vector<ID3D11Texture2D*>& slots) {
+    ComPtr<ID3DBlob> shaderBlob;
+    ComPtr<ID3DBlob> errorBlob;
+    HRESULT hr = D3DCompile(
+        STATIC_TILES_HLSL_PTR,
+        STATIC_TILES_HLSL_LEN,
+        "StaticTilesCS.hlsl",
+        nullptr,
+        nullptr,
+        "main",
+        "cs_5_0",
+        D3DCOMPILE_OPTIMIZATION_LEVEL3,
+        0,
+        &shaderBlob,
+        &errorBlob
+    );
+    if (FAILED(hr)) {
+        throw MakeException(
+            "Failed to compile the static tiles shader: %s",
+            errorBlob ? (const char*)errorBlob->GetBufferPointer() : ""
+        );
+    }
+    OK_OR_THROW(
+        mDevice->CreateComputeShader(
+            shaderBlob->GetBufferPointer(), shaderBlob->GetBufferSize(), nullptr, &mComputeShader
+        ),
+        "Failed to create static tiles compute shader."
+    );
+
+    D3D11_TEXTURE2D_DESC slotDesc;
+    slots[0]->GetDesc(&slotDesc);
+
+    // For YUV frames the view selects the luma plane, a change in chroma alone is missed
+    D3D11_SHADER_RESOURCE_VIEW_DESC viewDesc = {};
+    viewDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+    viewDesc.Texture2D.MipLevels = 1;
+    if (slotDesc.Format == DXGI_FORMAT_NV12) {
+        viewDesc.Format = DXGI_FORMAT_R8_UNORM;
+    } else if (slotDesc.Format == DXGI_FORMAT_P010) {
+        viewDesc.Format = DXGI_FORMAT_R16_UNORM;
+    } else {
+        viewDesc.Format = slotDesc.Format;
+    }
+
+    D3D11_BUFFER_DESC countDesc = {};
+    countDesc.ByteWidth = sizeof(uint32_t);
+    countDesc.Usage = D3D11_USAGE_DEFAULT;
+    countDesc.BindFlags = D3D11_BIND_UNORDERED_ACCESS;
+    countDesc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS;
+
+    D3D11_UNORDERED_ACCESS_VIEW_DESC countViewDesc = {};
+    countViewDesc.Format = DXGI_FORMAT_R32_TYPELESS;
+    countViewDesc.ViewDimension = D3D11_UAV_DIMENSION_BUFFER;
+    countViewDesc.Buffer.NumElements = 1;
+    countViewDesc.Buffer.Flags = D3D11_BUFFER_UAV_FLAG_RAW;
+
+    D3D11_BUFFER_DESC stagingDesc = {};
+    stagingDesc.ByteWidth = sizeof(uint32_t);
+    stagingDesc.Usage = D3D11_USAGE_STAGING;
+    stagingDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+
+    mSlots.resize(slots.size());
+    for (size_t i = 0; i < slots.size(); i++) {
+        Slot& slot = mSlots[i];
+        OK_OR_THROW(
+            mDevice->CreateShaderResourceView(slots[i], &viewDesc, &slot.view),
+            "Failed to create input slot resource view."
+        );
+        OK_OR_THROW(
+            mDevice->CreateBuffer(&countDesc, nullptr, &slot.countBuffer),
+            "Failed to create changed tiles buffer."
+        );
+        OK_OR_THROW(
+            mDevice->CreateUnorderedAccessView(
+                slot.countBuffer.Get(), &countViewDesc, &slot.countView
+            ),
+            "Failed to create changed tiles UAV."
+        );
+        OK_OR_THROW(
+            mDevice->CreateBuffer(&stagingDesc, nullptr, &slot.stagingBuffer),
+            "Failed to create changed tiles staging buffer."
+        );
+    }
+
+    mGroupsX = (slotDesc.Width + 15) / 16;
+    mGroupsY = (slotDesc.Height + 15) / 16;
+}
+
+void StaticFrameDetector::Compare(int slot, int referenceSlot) {
+    Slot& current = mSlots[slot];
+
+    d3d_render_utils::ContextLock lock(mImmediateContext.Get());
+    const UINT zero[4] = {};
+    mImmediateContext->ClearUnorderedAccessViewUint(current.countView.Get(), zero);
+
+    ID3D11ShaderResourceView* views[] = { current.view.Get(), mSlots[referenceSlot].view.Get() };
+    mImmediateContext->CSSetShader(mComputeShader.Get(), nullptr, 0);
+    mImmediateContext->CSSetShaderResources(0, 2, views);
+    mImmediateContext->CSSetUnorderedAccessViews(0, 1, current.countView.GetAddressOf(), nullptr);
+
+    mImmediateContext->Dispatch(mGroupsX, mGroupsY, 1);
+
+    ID3D11ShaderResourceView* nullViews[] = { nullptr, nullptr };
+    ID3D11UnorderedAccessView* nullUav = nullptr;
+    mImmediateContext->CSSetShaderResources(0, 2, nullViews);
+    mImmediateContext->CSSetUnorderedAccessViews(0, 1, &nullUav, nullptr);
+
+    mImmediateContext->CopyResource(current.stagingBuffer.Get(), current.countBuffer.Get());
+}
+
+bool StaticFrameDetector::IsUnchanged(int slot) {
+    // The encoders wait for the composition of the frame on the GPU too, this only moves the wait
+    // to the CPU
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    HRESULT hr = mImmediateContext->Map(
+        mSlots[slot].stagingBuffer.Get(), 0, D3D11_MAP_READ, 0, &mapped
+    );
+    if (FAILED(hr)) {
+        return false;
+    }
+    uint32_t changedTiles = *(const uint32_t*)mapped.pData;
+    mImmediateContext->Unmap(mSlots[slot].stagingBuffer.Get(), 0);
+
+    return changedTiles == 0;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "d3d-render-utils/RenderUtils.h"
+
+// Finds the frames that are identical to the previous one, so that they don't need to be encoded.
+// This happens when SteamVR presents the same frame again, for example while a game is loading or
+// misses its frame. The frames are compared on the GPU, tile by tile, as they are copied to the
+// input slots of the encoder.
+class StaticFrameDetector {
+public:
+    StaticFrameDetector(ID3D11Device* device);
+
+    // Throws if the shader can't be compiled. The slot textures must be bindable as shader
+    // resources.
+    void Initialize(const std::vector<ID3D11Texture2D*>& slots);
+
+    // Queues the comparison of the frame just copied to the slot with the one of the reference slot
+    void Compare(int slot, int referenceSlot);
+    // Waits for the comparison queued for the slot, true if no tile changed
+    bool IsUnchanged(int slot);
+
+private:
+    struct Slot {
+        Microsoft::WRL::ComPtr<ID3D11ShaderResourceView> view;
+        Microsoft::WRL::ComPtr<ID3D11Buffer> countBuffer;
+        Microsoft::WRL::ComPtr<ID3D11UnorderedAccessView> countView;
+        Microsoft::WRL::ComPtr<ID3D11Buffer> stagingBuffer;
+    };
+
+    Microsoft::WRL::ComPtr<ID3D11Device> mDevice;
+    Microsoft::WRL::ComPtr<ID3D11DeviceContext> mImmediateContext;
+    Microsoft::WRL::ComPtr<ID3D11ComputeShader> mComputeShader;
+    std::vector<Slot> mSlots;
+
+    uint32_t mGroupsX = 0;
+    uint32_t mGroupsY = 0;
+};
@@ -1 +1,34 @@
 #include "VideoEncoder.h"
+
+#include <cstdio>
+#include <dxgi.h>
+#include <wrl.h>
+
+std::string VideoEncoder::GetAdapterId(ID3D11Device* device) {
+    Microsoft::WRL::ComPtr<IDXGIDevice> dxgiDevice;
+    Microsoft::WRL::ComPtr<IDXGIAdapter> adapter;
+    DXGI_ADAPTER_DESC desc;
+    if (FAILED(device->QueryInterface(IID_PPV_ARGS(&dxgiDevice)))
+        || FAILED(dxgiDevice->GetAdapter(&adapter)) || FAILED(adapter->GetDesc(&desc))) {
+        return "";
+    }
+
+    // The user mode driver version is only reported through this query
+    LARGE_INTEGER version = {};
+    adapter->CheckInterfaceSupport(__uuidof(IDXGIDevice), &version);
+
+    char id[256];
+    snprintf(
+        id,
+        sizeof(id),
+        "%ls %04x:%04x driver %u.%u.%u.%u",
+        desc.Description,
+        desc.VendorId,
+        desc.DeviceId,
+        HIWORD(version.HighPart),
+        LOWORD(version.HighPart),
+        HIWORD(version.LowPart),
+        LOWORD(version.LowPart)
+    );
+    return id;
+}
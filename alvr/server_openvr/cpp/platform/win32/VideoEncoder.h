@@ -4,6 +4,8 @@
 #include "shared/d3drender.h"
 #include <functional>
 #include <memory>
+#include <string>
+#include <vector>
 
 class VideoEncoder {
 public:
@@ -16,4 +18,24 @@ public:
         uint64_t targetTimestampNs,
         bool insertIDR
     ) = 0;
+
+    // Called once with the textures the composited frames are copied to before Transmit. Encoders
+    // that can read them in place register them and return true, instead of copying each frame
+    // to their own input buffer.
+    virtual bool RegisterInputTextures(const std::vector<ID3D11Texture2D*>& textures) {
+        return false;
+    }
+
+    // Called before Transmit after the client lost frames. Encoders that can stop referencing the
+    // lost frames do so and return true, the next frame is then encoded from referenceTimestampNs
+    // or an older frame. Otherwise an IDR is inserted.
+    virtual bool InvalidateReferences(
+        const std::vector<uint64_t>& lostTimestampsNs, uint64_t referenceTimestampNs
+    ) {
+        return false;
+    }
+
+    // Name, PCI ids and driver version of the adapter of device, the key of EncoderProbe. Empty if
+    // they can't be queried
+    static std::string GetAdapterId(ID3D11Device* device);
 };
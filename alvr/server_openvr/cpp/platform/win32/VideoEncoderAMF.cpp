@@ -1,7 +1,12 @@
 #include "VideoEncoderAMF.h"
 
+#include <algorithm>
+#include <chrono>
+
+#include "alvr_server/FoveatedQpMap.h"
 #include "alvr_server/Logger.h"
 #include "alvr_server/Settings.h"
+#include "alvr_server/TraceCapture.h"
 
 #define AMF_THROW_IF(expr)                                                                         \
     {                                                                                              \
@@ -13,10 +18,14 @@
 
 const wchar_t* VideoEncoderAMF::START_TIME_PROPERTY = L"StartTimeProperty";
 const wchar_t* VideoEncoderAMF::FRAME_INDEX_PROPERTY = L"FrameIndexProperty";
+const wchar_t* VideoEncoderAMF::CONVERTER_TIME_PROPERTY = L"ConverterTimeProperty";
+const wchar_t* VideoEncoderAMF::PREPROCESSOR_TIME_PROPERTY = L"PreprocessorTimeProperty";
+const wchar_t* VideoEncoderAMF::ENCODER_TIME_PROPERTY = L"EncoderTimeProperty";
 
-AMFPipe::AMFPipe(amf::AMFComponentPtr src, AMFDataReceiver receiver)
+AMFPipe::AMFPipe(amf::AMFComponentPtr src, AMFDataReceiver receiver, const wchar_t* timeProperty)
     : m_amfComponentSrc(src)
-    , m_receiver(receiver) { }
+    , m_receiver(receiver)
+    , m_timeProperty(timeProperty) { }
 
 AMFPipe::~AMFPipe() {
     Debug("AMFPipe::~AMFPipe()  m_amfComponentSrc->Drain\n");
@@ -28,7 +37,7 @@ void AMFPipe::doPassthrough(bool hasQueryTimeout, uint32_t timerResolution) {
     if (hasQueryTimeout) {
         AMF_RESULT res = m_amfComponentSrc->QueryOutput(&data);
         if (res == AMF_OK && data) {
-            m_receiver(data);
+            Deliver(data);
         } else {
             Debug("Failed to get AMF component data. Last status: %d.\n", res);
         }
@@ -44,15 +53,34 @@ void AMFPipe::doPassthrough(bool hasQueryTimeout, uint32_t timerResolution) {
         timeEndPeriod(timerResolution);
 
         if (data) {
-            m_receiver(data);
+            Deliver(data);
         } else {
             Debug("Failed to get AMF component data. Last status: %d.\n", res);
         }
     }
 }
 
-AMFSolidPipe::AMFSolidPipe(amf::AMFComponentPtr src, amf::AMFComponentPtr dst)
-    : AMFPipe(src, std::bind(&AMFSolidPipe::Passthrough, this, std::placeholders::_1))
+amf::AMFDataPtr AMFPipe::Poll() {
+    amf::AMFDataPtr data = nullptr;
+    AMF_RESULT res = m_amfComponentSrc->QueryOutput(&data);
+    if (res != AMF_OK || !data) {
+        return nullptr;
+    }
+    Deliver(data);
+    return data;
+}
+
+void AMFPipe::Deliver(AMFDataPtr data) {
+    data->SetProperty(m_timeProperty, amf_high_precision_clock());
+    m_receiver(data);
+}
+
+AMFSolidPipe::AMFSolidPipe(
+    amf::AMFComponentPtr src, amf::AMFComponentPtr dst, const wchar_t* timeProperty
+)
+    : AMFPipe(
+          src, std::bind(&AMFSolidPipe::Passthrough, this, std::placeholders::_1), timeProperty
+      )
     , m_amfComponentDst(dst) { }
 
 void AMFSolidPipe::Passthrough(AMFDataPtr data) {
@@ -72,6 +100,8 @@ void AMFSolidPipe::Passthrough(AMFDataPtr data) {
     }
 }
 
+const wchar_t* AMFPipeline::FRAME_NUMBER_PROPERTY = L"PipelineFrameNumberProperty";
+
 AMFPipeline::AMFPipeline()
     : m_pipes() {
     TIMECAPS tc;
@@ -79,6 +109,15 @@ AMFPipeline::AMFPipeline()
 }
 
 AMFPipeline::~AMFPipeline() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_exiting = true;
+    }
+    m_cv.notify_all();
+    for (auto& thread : m_drainThreads) {
+        thread.join();
+    }
+
     for (auto& pipe : m_pipes) {
         delete pipe;
     }
@@ -92,6 +131,80 @@ void AMFPipeline::Run(bool hasQueryTimeout) {
     }
 }
 
+void AMFPipeline::StartDrainThreads(uint32_t depth) {
+    m_depth = depth;
+    // One thread per pipe, so that a component blocking on its query timeout doesn't hold back
+    // the output of the ones before it
+    for (size_t i = 0; i < m_pipes.size(); i++) {
+        m_drainThreads.emplace_back(&AMFPipeline::DrainLoop, this, i);
+    }
+}
+
+void AMFPipeline::BeginFrame(amf::AMFData* data) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // Same limit as the polling in doPassthrough
+    if (!m_cv.wait_for(lock, std::chrono::seconds(1), [this] {
+            return m_nextFrame - m_oldestFrame < m_depth;
+        })) {
+        Warn("AMFPipeline: no output for 1s, dropping a pending frame\n");
+        m_oldestFrame++;
+    }
+    data->SetProperty(FRAME_NUMBER_PROPERTY, (amf_int64)m_nextFrame);
+    m_nextFrame++;
+    m_progress++;
+    m_cv.notify_all();
+}
+
+void AMFPipeline::CancelFrame() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_nextFrame > m_oldestFrame) {
+        m_nextFrame--;
+    }
+    m_cv.notify_all();
+}
+
+void AMFPipeline::DrainLoop(size_t index) {
+    AMFPipePtr pipe = m_pipes[index];
+    bool last = index == m_pipes.size() - 1;
+    Info(
+        "%s\n",
+        ApplyThreadRole(ThreadRole::EncoderOutput, Settings::Instance().m_encoderOutputThread)
+            .c_str()
+    );
+
+    timeBeginPeriod(m_timerResolution);
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_cv.wait(lock, [this] { return m_exiting || m_nextFrame != m_oldestFrame; });
+        if (m_exiting) {
+            break;
+        }
+        uint64_t progress = m_progress;
+
+        lock.unlock();
+        amf::AMFDataPtr data = pipe->Poll();
+        lock.lock();
+
+        if (data) {
+            amf_int64 frame;
+            if (last && data->GetProperty(FRAME_NUMBER_PROPERTY, &frame) == AMF_OK) {
+                // Also retires the frames before it that were lost in the pipeline
+                m_oldestFrame = std::max(m_oldestFrame, (uint64_t)frame + 1);
+            }
+            m_progress++;
+            m_cv.notify_all();
+        } else {
+            // AMF has no event for the outputs. The pipe polls again as soon as a frame begins or
+            // another pipe passes one on, and every millisecond otherwise
+            m_cv.wait_for(lock, std::chrono::milliseconds(1), [&] {
+                return m_exiting || m_progress != progress;
+            });
+        }
+    }
+    lock.unlock();
+    timeEndPeriod(m_timerResolution);
+}
+
 //
 // VideoEncoderAMF
 //
@@ -105,7 +218,10 @@ VideoEncoderAMF::VideoEncoderAMF(std::shared_ptr<CD3DRender> d3dRender, int widt
     , m_bitrateInMBits(30)
     , m_surfaceFormat(amf::AMF_SURFACE_RGBA)
     , m_use10bit(Settings::Instance().m_use10bitEncoder)
-    , m_hasQueryTimeout(false) {
+    , m_hasQueryTimeout(false)
+    , m_drainThreads(Settings::Instance().m_amfDrainThreads)
+    , m_intraRefresh(Settings::Instance().m_gradualIntraRefresh)
+    , m_useLtr(Settings::Instance().m_referenceFrameInvalidation && !m_intraRefresh) {
     if (Settings::Instance().m_enableHdr) {
         // Bypass preprocessor and converters for HDR, since it will already be YUV
         m_surfaceFormat = m_use10bit ? amf::AMF_SURFACE_P010 : amf::AMF_SURFACE_NV12;
@@ -144,6 +260,30 @@ amf::AMFComponentPtr VideoEncoderAMF::MakeEncoder(
         throw MakeException("Unsupported video encoding %d", codec);
     }
 
+    // Blocks refreshed in each frame, so that the whole picture is refreshed once per period
+    const amf_int64 refreshPeriod = Settings::Instance().m_gradualIntraRefreshPeriod;
+    auto refreshBlocksPerFrame = [&](int blockSize) {
+        amf_int64 blocks = (amf_int64)((width + blockSize - 1) / blockSize)
+            * ((height + blockSize - 1) / blockSize);
+        return (blocks + refreshPeriod - 1) / refreshPeriod;
+    };
+
+    // Each layer above the base one references the frames of the layer below, which must be kept
+    const amf_int64 temporalLayers = Settings::Instance().m_encoderTemporalLayers;
+
+    // AMF has no byte budget per slice, the count is the one that fits the average frame in
+    // packet-sized slices. The larger frames, like the IDRs, have slices spanning several packets
+    const amf_int64 sliceSize = Settings::Instance().m_encoderSliceSizeBytes;
+    auto slicesPerFrame = [&](int blockSize) {
+        amf_int64 frameSize = bitRateIn / 8 / frameRateIn;
+        amf_int64 blockRows = (height + blockSize - 1) / blockSize;
+        return std::clamp((frameSize + sliceSize - 1) / sliceSize, (amf_int64)1, blockRows);
+    };
+
+    // Tiles the client decodes in parallel, as many slices for H264 and HEVC
+    const amf_int64 decoderTiles
+        = Settings::Instance().m_encoderTileColumns * Settings::Instance().m_encoderTileRows;
+
     amf::AMFComponentPtr amfEncoder;
     // Create encoder component.
     AMF_THROW_IF(g_AMFFactory.GetFactory()->CreateComponent(m_amfContext, pCodec, &amfEncoder));
@@ -291,6 +431,19 @@ amf::AMFComponentPtr VideoEncoderAMF::MakeEncoder(
         // Turns Off IDR/I Frames
         amfEncoder->SetProperty(AMF_VIDEO_ENCODER_IDR_PERIOD, 0);
 
+        if (m_useLtr) {
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_MAX_LTR_FRAMES, LTR_COUNT);
+            amfEncoder->SetProperty(
+                AMF_VIDEO_ENCODER_LTR_MODE, AMF_VIDEO_ENCODER_LTR_MODE_KEEP_UNUSED
+            );
+        }
+
+        if (m_intraRefresh) {
+            amfEncoder->SetProperty(
+                AMF_VIDEO_ENCODER_INTRA_REFRESH_NUM_MBS_PER_SLOT, refreshBlocksPerFrame(16)
+            );
+        }
+
         // Disable AUD to produce the same stream format as VideoEncoderNVENC.
         // FIXME: This option doesn't work in 22.10.3, but works in versions prior 22.5.1
         amfEncoder->SetProperty(AMF_VIDEO_ENCODER_INSERT_AUD, false);
@@ -299,6 +452,21 @@ amf::AMFComponentPtr VideoEncoderAMF::MakeEncoder(
 
         amfEncoder->SetProperty(AMF_VIDEO_ENCODER_MAX_NUM_REFRAMES, 0);
 
+        if (temporalLayers > 1) {
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_MAX_NUM_TEMPORAL_LAYERS, temporalLayers);
+            amfEncoder->SetProperty(
+                AMF_VIDEO_ENCODER_NUM_TEMPORAL_ENHANCMENT_LAYERS, temporalLayers
+            );
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_MAX_NUM_REFRAMES, temporalLayers - 1);
+        }
+
+        if (sliceSize > 0 || decoderTiles > 1) {
+            amfEncoder->SetProperty(
+                AMF_VIDEO_ENCODER_SLICES_PER_FRAME,
+                std::max(sliceSize > 0 ? slicesPerFrame(16) : 1, decoderTiles)
+            );
+        }
+
         if (m_hasQueryTimeout) {
             amfEncoder->SetProperty(AMF_VIDEO_ENCODER_QUERY_TIMEOUT, 1000); // 1s timeout
         }
@@ -453,6 +621,19 @@ amf::AMFComponentPtr VideoEncoderAMF::MakeEncoder(
         // Set infinite GOP length
         amfEncoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_GOP_SIZE, 0);
 
+        if (m_useLtr) {
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_MAX_LTR_FRAMES, LTR_COUNT);
+            amfEncoder->SetProperty(
+                AMF_VIDEO_ENCODER_HEVC_LTR_MODE, AMF_VIDEO_ENCODER_HEVC_LTR_MODE_KEEP_UNUSED
+            );
+        }
+
+        if (m_intraRefresh) {
+            amfEncoder->SetProperty(
+                AMF_VIDEO_ENCODER_HEVC_INTRA_REFRESH_NUM_CTBS_PER_SLOT, refreshBlocksPerFrame(64)
+            );
+        }
+
         // Disable AUD to produce the same stream format as VideoEncoderNVENC.
         // FIXME: This option doesn't work in 22.10.3, but works in versions prior 22.5.1
         amfEncoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_INSERT_AUD, false);
@@ -463,6 +644,19 @@ amf::AMFComponentPtr VideoEncoderAMF::MakeEncoder(
 
         amfEncoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_MAX_NUM_REFRAMES, 0);
 
+        if (temporalLayers > 1) {
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_MAX_NUM_TEMPORAL_LAYERS, temporalLayers);
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_NUM_TEMPORAL_LAYERS, temporalLayers);
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_MAX_NUM_REFRAMES, temporalLayers - 1);
+        }
+
+        if (sliceSize > 0 || decoderTiles > 1) {
+            amfEncoder->SetProperty(
+                AMF_VIDEO_ENCODER_HEVC_SLICES_PER_FRAME,
+                std::max(sliceSize > 0 ? slicesPerFrame(64) : 1, decoderTiles)
+            );
+        }
+
         if (m_hasQueryTimeout) {
             amfEncoder->SetProperty(AMF_VIDEO_ENCODER_HEVC_QUERY_TIMEOUT, 1000); // 1s timeout
         }
@@ -471,6 +665,11 @@ amf::AMFComponentPtr VideoEncoderAMF::MakeEncoder(
         amfEncoder->SetProperty(
             AMF_VIDEO_ENCODER_AV1_USAGE, AMF_VIDEO_ENCODER_AV1_USAGE_ULTRA_LOW_LATENCY
         );
+        // The sequence header of each key frame is sent as the video config, like the SPS/PPS
+        amfEncoder->SetProperty(
+            AMF_VIDEO_ENCODER_AV1_HEADER_INSERTION_MODE,
+            AMF_VIDEO_ENCODER_AV1_HEADER_INSERTION_MODE_KEY_FRAME_ALIGNED
+        );
         switch (Settings::Instance().m_rateControlMode) {
         case ALVR_CBR:
             amfEncoder->SetProperty(
@@ -575,12 +774,39 @@ amf::AMFComponentPtr VideoEncoderAMF::MakeEncoder(
         // Set infinite GOP length
         amfEncoder->SetProperty(AMF_VIDEO_ENCODER_AV1_GOP_SIZE, 0);
 
+        if (m_useLtr) {
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_AV1_MAX_LTR_FRAMES, LTR_COUNT);
+            amfEncoder->SetProperty(
+                AMF_VIDEO_ENCODER_AV1_LTR_MODE, AMF_VIDEO_ENCODER_AV1_LTR_MODE_KEEP_UNUSED
+            );
+        }
+
+        if (m_intraRefresh) {
+            // One stripe per frame
+            amfEncoder->SetProperty(
+                AMF_VIDEO_ENCODER_AV1_INTRA_REFRESH_MODE,
+                AMF_VIDEO_ENCODER_AV1_INTRA_REFRESH_MODE__CONTINUOUS
+            );
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_AV1_INTRAREFRESH_STRIPES, refreshPeriod);
+        }
+
         amfEncoder->SetProperty(
             AMF_VIDEO_ENCODER_AV1_VBV_BUFFER_SIZE, bitRateIn / frameRateIn * 1.2
         );
 
         amfEncoder->SetProperty(AMF_VIDEO_ENCODER_AV1_MAX_NUM_REFRAMES, 0);
 
+        if (temporalLayers > 1) {
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_AV1_MAX_NUM_TEMPORAL_LAYERS, temporalLayers);
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_AV1_NUM_TEMPORAL_LAYERS, temporalLayers);
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_AV1_MAX_NUM_REFRAMES, temporalLayers - 1);
+        }
+
+        // AMF picks the grid itself
+        if (decoderTiles > 1) {
+            amfEncoder->SetProperty(AMF_VIDEO_ENCODER_AV1_TILES_PER_FRAME, decoderTiles);
+        }
+
         // AV1 assumed always has support for query timeout.
         m_hasQueryTimeout = true;
 
@@ -655,28 +881,44 @@ void VideoEncoderAMF::Initialize() {
         m_amfComponents.emplace_back(
             MakeConverter(m_surfaceFormat, m_renderWidth, m_renderHeight, inFormat)
         );
+        m_stages.push_back({ CONVERTER_TIME_PROPERTY, "converter" });
     } else {
         if (Settings::Instance().m_useAmfPreproc) {
             inFormat = amf::AMF_SURFACE_NV12;
             m_amfComponents.emplace_back(
                 MakeConverter(m_surfaceFormat, m_renderWidth, m_renderHeight, inFormat)
             );
+            m_stages.push_back({ CONVERTER_TIME_PROPERTY, "converter" });
             m_amfComponents.emplace_back(MakePreprocessor(inFormat, m_renderWidth, m_renderHeight));
+            m_stages.push_back({ PREPROCESSOR_TIME_PROPERTY, "preprocessor" });
         }
     }
     m_amfComponents.emplace_back(MakeEncoder(
         inFormat, m_renderWidth, m_renderHeight, m_codec, m_refreshRate, m_bitrateInMBits
     ));
+    m_stages.push_back({ ENCODER_TIME_PROPERTY, "encoder" });
+
+    if (FoveatedQpMap::IsEnabled()) {
+        CreateRoiSurface();
+    }
 
     m_pipeline = new AMFPipeline();
     for (int i = 0; i < m_amfComponents.size() - 1; i++) {
-        m_pipeline->Connect(new AMFSolidPipe(m_amfComponents[i], m_amfComponents[i + 1]));
+        m_pipeline->Connect(
+            new AMFSolidPipe(m_amfComponents[i], m_amfComponents[i + 1], m_stages[i].first)
+        );
     }
 
     m_pipeline->Connect(new AMFPipe(
-        m_amfComponents.back(), std::bind(&VideoEncoderAMF::Receive, this, std::placeholders::_1)
+        m_amfComponents.back(),
+        std::bind(&VideoEncoderAMF::Receive, this, std::placeholders::_1),
+        m_stages.back().first
     ));
 
+    if (m_drainThreads) {
+        m_pipeline->StartDrainThreads(DRAIN_QUEUE_DEPTH);
+    }
+
     Debug("Successfully initialized VideoEncoderAMF.\n");
 }
 
@@ -685,6 +927,9 @@ void VideoEncoderAMF::Shutdown() {
 
     delete m_pipeline;
 
+    m_inputSurfaces.clear();
+    m_roiSurface = NULL;
+
     for (auto& component : m_amfComponents) {
         component->Release();
         delete component;
@@ -701,49 +946,140 @@ void VideoEncoderAMF::Shutdown() {
     Debug("Successfully shutdown VideoEncoderAMF.\n");
 }
 
+bool VideoEncoderAMF::RegisterInputTextures(const std::vector<ID3D11Texture2D*>& textures) {
+    // The input slots are reused as soon as Transmit returns, before AMF read them
+    if (m_drainThreads) {
+        return false;
+    }
+    for (ID3D11Texture2D* texture : textures) {
+        amf::AMFSurfacePtr surface;
+        AMF_RESULT res = m_amfContext->CreateSurfaceFromDX11Native(texture, &surface, nullptr);
+        if (res != AMF_OK || surface->GetFormat() != m_surfaceFormat) {
+            Warn("AMF can't wrap the input textures, copying them. Result: %d\n", res);
+            m_inputSurfaces.clear();
+            return false;
+        }
+        m_inputSurfaces.push_back({ texture, surface });
+    }
+    Debug("VideoEncoderAMF: wrapped %d input textures\n", (int)textures.size());
+    return true;
+}
+
 void VideoEncoderAMF::Transmit(
     ID3D11Texture2D* pTexture, uint64_t presentationTime, uint64_t targetTimestampNs, bool insertIDR
 ) {
+    TraceScope scope("VideoEncoderAMF::Transmit", targetTimestampNs);
     amf::AMFSurfacePtr surface;
-    // Surface is cached by AMF.
 
     auto params = GetDynamicEncoderParams();
     if (params.updated) {
         amf_int64 bitRateIn = params.bitrate_bps / params.framerate * m_refreshRate; // in bits
-        if (m_codec == ALVR_CODEC_H264) {
+        amf_int64 vbvBufferBits = bitRateIn / m_refreshRate * 1.1;
+        // The rate control keeps each access unit under the cap, 0 removes it
+        amf_int64 maxFrameBits = params.max_frame_bits;
+        if (maxFrameBits > 0) {
+            vbvBufferBits = std::min(vbvBufferBits, maxFrameBits);
+        }
+        switch (m_codec) {
+        case ALVR_CODEC_H264:
             m_amfComponents.back()->SetProperty(AMF_VIDEO_ENCODER_TARGET_BITRATE, bitRateIn);
             m_amfComponents.back()->SetProperty(AMF_VIDEO_ENCODER_PEAK_BITRATE, bitRateIn);
-            m_amfComponents.back()->SetProperty(
-                AMF_VIDEO_ENCODER_VBV_BUFFER_SIZE, bitRateIn / m_refreshRate * 1.1
-            );
-        } else {
+            m_amfComponents.back()->SetProperty(AMF_VIDEO_ENCODER_VBV_BUFFER_SIZE, vbvBufferBits);
+            m_amfComponents.back()->SetProperty(AMF_VIDEO_ENCODER_MAX_AU_SIZE, maxFrameBits);
+            break;
+        case ALVR_CODEC_HEVC:
             m_amfComponents.back()->SetProperty(AMF_VIDEO_ENCODER_HEVC_TARGET_BITRATE, bitRateIn);
             m_amfComponents.back()->SetProperty(AMF_VIDEO_ENCODER_HEVC_PEAK_BITRATE, bitRateIn);
             m_amfComponents.back()->SetProperty(
-                AMF_VIDEO_ENCODER_HEVC_VBV_BUFFER_SIZE, bitRateIn / m_refreshRate * 1.1
+                AMF_VIDEO_ENCODER_HEVC_VBV_BUFFER_SIZE, vbvBufferBits
+            );
+            m_amfComponents.back()->SetProperty(AMF_VIDEO_ENCODER_HEVC_MAX_AU_SIZE, maxFrameBits);
+            break;
+        case ALVR_CODEC_AV1:
+            m_amfComponents.back()->SetProperty(AMF_VIDEO_ENCODER_AV1_TARGET_BITRATE, bitRateIn);
+            m_amfComponents.back()->SetProperty(AMF_VIDEO_ENCODER_AV1_PEAK_BITRATE, bitRateIn);
+            m_amfComponents.back()->SetProperty(
+                AMF_VIDEO_ENCODER_AV1_VBV_BUFFER_SIZE, vbvBufferBits
+            );
+            m_amfComponents.back()->SetProperty(
+                AMF_VIDEO_ENCODER_AV1_MAX_COMPRESSED_FRAME_SIZE, maxFrameBits
             );
+            break;
         }
 
+        m_vbvBufferBits = (uint64_t)vbvBufferBits;
+
         if (Settings::Instance().m_amdBitrateCorruptionFix) {
             RequestIDR();
         }
     }
 
-    AMF_THROW_IF(m_amfContext->AllocSurface(
-        amf::AMF_MEMORY_DX11, m_surfaceFormat, m_renderWidth, m_renderHeight, &surface
-    ));
-    ID3D11Texture2D* textureDX11 = (ID3D11Texture2D*)surface->GetPlaneAt(0)->GetNative(
-    ); // no reference counting - do not Release()
-    m_d3dRender->GetContext()->CopyResource(textureDX11, pTexture);
+    for (auto& input : m_inputSurfaces) {
+        if (input.first == pTexture) {
+            surface = input.second;
+            // Drop the properties of the last frame submitted with this surface, like a forced IDR
+            surface->Clear();
+            break;
+        }
+    }
+    if (!surface) {
+        // Surface is cached by AMF.
+        AMF_THROW_IF(m_amfContext->AllocSurface(
+            amf::AMF_MEMORY_DX11, m_surfaceFormat, m_renderWidth, m_renderHeight, &surface
+        ));
+        ID3D11Texture2D* textureDX11 = (ID3D11Texture2D*)surface->GetPlaneAt(0)->GetNative(
+        ); // no reference counting - do not Release()
+        m_d3dRender->GetContext()->CopyResource(textureDX11, pTexture);
+    }
 
     amf_pts start_time = amf_high_precision_clock();
     surface->SetProperty(START_TIME_PROPERTY, start_time);
     surface->SetProperty(FRAME_INDEX_PROPERTY, targetTimestampNs);
 
     ApplyFrameProperties(surface, insertIDR);
+    ApplyReferenceProperties(surface, targetTimestampNs, insertIDR);
+
+    if (m_drainThreads) {
+        m_pipeline->BeginFrame(surface);
+        AMF_RESULT res = m_amfComponents.front()->SubmitInput(surface);
+        if (res != AMF_OK) {
+            Debug("m_amfComponents.front()->SubmitInput returns code %d.\n", res);
+            m_pipeline->CancelFrame();
+        }
+    } else {
+        m_amfComponents.front()->SubmitInput(surface);
+        m_pipeline->Run(m_hasQueryTimeout);
+    }
+}
 
-    m_amfComponents.front()->SubmitInput(surface);
-    m_pipeline->Run(m_hasQueryTimeout);
+bool VideoEncoderAMF::InvalidateReferences(
+    const std::vector<uint64_t>& lostTimestampsNs, uint64_t referenceTimestampNs
+) {
+    if (!m_useLtr) {
+        return false;
+    }
+
+    // Lost long term references can't be used either
+    for (auto& timestampNs : m_ltrTimestamps) {
+        if (std::find(lostTimestampsNs.begin(), lostTimestampsNs.end(), timestampNs)
+            != lostTimestampsNs.end()) {
+            timestampNs = 0;
+        }
+    }
+
+    int best = -1;
+    for (int i = 0; i < LTR_COUNT; i++) {
+        if (m_ltrTimestamps[i] != 0 && m_ltrTimestamps[i] <= referenceTimestampNs
+            && (best == -1 || m_ltrTimestamps[i] > m_ltrTimestamps[best])) {
+            best = i;
+        }
+    }
+    if (best == -1) {
+        return false;
+    }
+
+    m_forcedLtr = best;
+    return true;
 }
 
 void VideoEncoderAMF::Receive(AMFDataPtr data) {
@@ -753,6 +1089,26 @@ void VideoEncoderAMF::Receive(AMFDataPtr data) {
     data->GetProperty(START_TIME_PROPERTY, &start_time);
     data->GetProperty(FRAME_INDEX_PROPERTY, &targetTimestampNs);
 
+    // Time spent from the submission or the previous stage until each component's output was
+    // received
+    char stageLatencies[256] = "";
+    int written = 0;
+    amf_pts stageStart = start_time;
+    for (auto& stage : m_stages) {
+        amf_pts stageEnd = stageStart;
+        data->GetProperty(stage.first, &stageEnd);
+        written += snprintf(
+            stageLatencies + written,
+            sizeof(stageLatencies) - written,
+            "%s%s %.2fms",
+            written > 0 ? ", " : "",
+            stage.second,
+            (stageEnd - stageStart) / double(AMF_MILLISECOND)
+        );
+        stageStart = stageEnd;
+    }
+    LogPeriod("AmfStageLatency", "VideoEncoderAMF: %s", stageLatencies);
+
     amf::AMFBufferPtr buffer(data); // query for buffer interface
 
     char* p = reinterpret_cast<char*>(buffer->GetNative());
@@ -764,22 +1120,131 @@ void VideoEncoderAMF::Receive(AMFDataPtr data) {
 
     uint64_t type;
     bool isIdr;
-    if (m_codec == ALVR_CODEC_H264) {
+    switch (m_codec) {
+    case ALVR_CODEC_H264:
         data->GetProperty(AMF_VIDEO_ENCODER_OUTPUT_DATA_TYPE, &type);
         isIdr = type == AMF_VIDEO_ENCODER_OUTPUT_DATA_TYPE_IDR;
-    } else {
+        break;
+    case ALVR_CODEC_HEVC:
         data->GetProperty(AMF_VIDEO_ENCODER_HEVC_OUTPUT_DATA_TYPE, &type);
         isIdr = type == AMF_VIDEO_ENCODER_HEVC_OUTPUT_DATA_TYPE_IDR;
+        break;
+    case ALVR_CODEC_AV1:
+    default:
+        data->GetProperty(AMF_VIDEO_ENCODER_AV1_OUTPUT_FRAME_TYPE, &type);
+        isIdr = type == AMF_VIDEO_ENCODER_AV1_OUTPUT_FRAME_TYPE_KEY;
+        break;
     }
 
     ParseFrameNals(m_codec, reinterpret_cast<uint8_t*>(p), length, targetTimestampNs, isIdr);
+    ReportStats(data, length, isIdr);
+}
+
+void VideoEncoderAMF::ReportStats(AMFDataPtr data, int size, bool isIdr) {
+    // Left as is if the driver doesn't provide them
+    amf_int64 averageQp = -1;
+    amf_int64 intraPixels = 0;
+    amf_int64 interPixels = 0;
+    amf_int64 skipPixels = 0;
+    // Only on the probed frames
+    double psnr = -1.;
+    double ssim = -1.;
+    switch (m_codec) {
+    case ALVR_CODEC_H264:
+        data->GetProperty(AMF_VIDEO_ENCODER_STATISTIC_AVERAGE_QP, &averageQp);
+        data->GetProperty(AMF_VIDEO_ENCODER_STATISTIC_PIX_NUM_INTRA, &intraPixels);
+        data->GetProperty(AMF_VIDEO_ENCODER_STATISTIC_PIX_NUM_INTER, &interPixels);
+        data->GetProperty(AMF_VIDEO_ENCODER_STATISTIC_PIX_NUM_SKIP, &skipPixels);
+        data->GetProperty(AMF_VIDEO_ENCODER_STATISTIC_PSNR_ALL, &psnr);
+        data->GetProperty(AMF_VIDEO_ENCODER_STATISTIC_SSIM_ALL, &ssim);
+        break;
+    case ALVR_CODEC_HEVC:
+        data->GetProperty(AMF_VIDEO_ENCODER_HEVC_STATISTIC_AVERAGE_QP, &averageQp);
+        data->GetProperty(AMF_VIDEO_ENCODER_HEVC_STATISTIC_PIX_NUM_INTRA, &intraPixels);
+        data->GetProperty(AMF_VIDEO_ENCODER_HEVC_STATISTIC_PIX_NUM_INTER, &interPixels);
+        data->GetProperty(AMF_VIDEO_ENCODER_HEVC_STATISTIC_PIX_NUM_SKIP, &skipPixels);
+        data->GetProperty(AMF_VIDEO_ENCODER_HEVC_STATISTIC_PSNR_ALL, &psnr);
+        data->GetProperty(AMF_VIDEO_ENCODER_HEVC_STATISTIC_SSIM_ALL, &ssim);
+        break;
+    case ALVR_CODEC_AV1:
+        data->GetProperty(AMF_VIDEO_ENCODER_AV1_STATISTIC_AVERAGE_Q_INDEX, &averageQp);
+        data->GetProperty(AMF_VIDEO_ENCODER_AV1_STATISTIC_PIX_NUM_INTRA, &intraPixels);
+        data->GetProperty(AMF_VIDEO_ENCODER_AV1_STATISTIC_PIX_NUM_INTER, &interPixels);
+        data->GetProperty(AMF_VIDEO_ENCODER_AV1_STATISTIC_PIX_NUM_SKIP, &skipPixels);
+        data->GetProperty(AMF_VIDEO_ENCODER_AV1_STATISTIC_PSNR_ALL, &psnr);
+        data->GetProperty(AMF_VIDEO_ENCODER_AV1_STATISTIC_SSIM_ALL, &ssim);
+        break;
+    }
+    amf_int64 pixels = intraPixels + interPixels + skipPixels;
+    uint64_t vbvBufferBits = m_vbvBufferBits;
+
+    FfiEncoderStats stats = {};
+    stats.isIdr = isIdr;
+    stats.averageQp = (float)averageQp;
+    stats.intraRatio = pixels > 0 ? (float)intraPixels / pixels : -1.f;
+    stats.vbvOverflow = vbvBufferBits > 0 && (uint64_t)size * 8 > vbvBufferBits;
+    stats.psnr = (float)psnr;
+    stats.ssim = (float)ssim;
+    ReportEncoderStats(stats);
+}
+
+void VideoEncoderAMF::CreateRoiSurface() {
+    // Always a new surface, the frames in flight keep a reference to the previous one
+    m_roiSurfaceVersion = FoveatedQpMap::GetVersion();
+    // One value per macroblock for H.264 and per 64x64 block for HEVC and AV1
+    int blockSize = m_codec == ALVR_CODEC_H264 ? 16 : 64;
+    int blocksX = (m_renderWidth + blockSize - 1) / blockSize;
+    int blocksY = (m_renderHeight + blockSize - 1) / blockSize;
+    auto deltas = FoveatedQpMap(m_renderWidth, m_renderHeight).BuildDeltaMap(blockSize);
+
+    AMF_THROW_IF(m_amfContext->AllocSurface(
+        amf::AMF_MEMORY_HOST, amf::AMF_SURFACE_GRAY32, blocksX, blocksY, &m_roiSurface
+    ));
+    amf::AMFPlanePtr plane = m_roiSurface->GetPlaneAt(0);
+    auto importance = (amf_uint32*)plane->GetNative();
+    int pitch = plane->GetHPitch() / sizeof(amf_uint32);
+
+    // AMF takes an importance from 0 to 10 instead of a QP offset, the lowest offset gets the
+    // highest one and each step of the offset lowers it by one. That is the fovea, or the
+    // overlays whose offset is negative
+    int minDelta = 0;
+    for (int8_t delta : deltas) {
+        minDelta = std::min(minDelta, (int)delta);
+    }
+    for (int y = 0; y < blocksY; y++) {
+        for (int x = 0; x < blocksX; x++) {
+            importance[y * pitch + x] = std::max(0, 10 - (deltas[y * blocksX + x] - minDelta));
+        }
+    }
 }
 
 void VideoEncoderAMF::ApplyFrameProperties(const amf::AMFSurfacePtr& surface, bool insertIDR) {
+    if (m_roiSurface && FoveatedQpMap::GetVersion() != m_roiSurfaceVersion) {
+        CreateRoiSurface();
+    }
+
+    // Computed by the encoder on its reconstructed frame, which costs a pass over both pictures,
+    // so only on a frame now and then
+    bool probeQuality = false;
+    uint32_t probeInterval = Settings::Instance().m_amfQualityProbeInterval;
+    if (probeInterval > 0) {
+        if (m_framesUntilQualityProbe == 0) {
+            probeQuality = true;
+            m_framesUntilQualityProbe = probeInterval;
+        }
+        m_framesUntilQualityProbe--;
+    }
+
     switch (m_codec) {
     case ALVR_CODEC_H264:
         // FIXME: This option doesn't work in drivers 22.3.1 - 22.5.1, but works in 22.10.3
         surface->SetProperty(AMF_VIDEO_ENCODER_INSERT_AUD, false);
+        surface->SetProperty(AMF_VIDEO_ENCODER_STATISTICS_FEEDBACK, true);
+        surface->SetProperty(AMF_VIDEO_ENCODER_PSNR_FEEDBACK, probeQuality);
+        surface->SetProperty(AMF_VIDEO_ENCODER_SSIM_FEEDBACK, probeQuality);
+        if (m_roiSurface) {
+            surface->SetProperty(AMF_VIDEO_ENCODER_ROI_DATA, m_roiSurface);
+        }
         if (insertIDR) {
             Debug("Inserting IDR frame for H.264.\n");
             surface->SetProperty(AMF_VIDEO_ENCODER_INSERT_SPS, true);
@@ -792,6 +1257,12 @@ void VideoEncoderAMF::ApplyFrameProperties(const amf::AMFSurfacePtr& surface, bo
     case ALVR_CODEC_HEVC:
         // FIXME: This option works with 22.10.3, but may not work with older drivers
         surface->SetProperty(AMF_VIDEO_ENCODER_HEVC_INSERT_AUD, false);
+        surface->SetProperty(AMF_VIDEO_ENCODER_HEVC_STATISTICS_FEEDBACK, true);
+        surface->SetProperty(AMF_VIDEO_ENCODER_HEVC_PSNR_FEEDBACK, probeQuality);
+        surface->SetProperty(AMF_VIDEO_ENCODER_HEVC_SSIM_FEEDBACK, probeQuality);
+        if (m_roiSurface) {
+            surface->SetProperty(AMF_VIDEO_ENCODER_HEVC_ROI_DATA, m_roiSurface);
+        }
         if (insertIDR) {
             Debug("Inserting IDR frame for H.265.\n");
             // Insert VPS,SPS,PPS
@@ -804,6 +1275,12 @@ void VideoEncoderAMF::ApplyFrameProperties(const amf::AMFSurfacePtr& surface, bo
         }
         break;
     case ALVR_CODEC_AV1:
+        surface->SetProperty(AMF_VIDEO_ENCODER_AV1_STATISTICS_FEEDBACK, true);
+        surface->SetProperty(AMF_VIDEO_ENCODER_AV1_PSNR_FEEDBACK, probeQuality);
+        surface->SetProperty(AMF_VIDEO_ENCODER_AV1_SSIM_FEEDBACK, probeQuality);
+        if (m_roiSurface) {
+            surface->SetProperty(AMF_VIDEO_ENCODER_AV1_ROI_DATA, m_roiSurface);
+        }
         if (insertIDR) {
             Debug("Inserting IDR frame for AV1.\n");
             surface->SetProperty(AMF_VIDEO_ENCODER_AV1_FORCE_INSERT_SEQUENCE_HEADER, true);
@@ -816,3 +1293,51 @@ void VideoEncoderAMF::ApplyFrameProperties(const amf::AMFSurfacePtr& surface, bo
         throw MakeException("Invalid video codec");
     }
 }
+
+void VideoEncoderAMF::ApplyReferenceProperties(
+    const amf::AMFSurfacePtr& surface, uint64_t targetTimestampNs, bool insertIDR
+) {
+    if (!m_useLtr) {
+        return;
+    }
+
+    const wchar_t* markProperty;
+    const wchar_t* forceProperty;
+    switch (m_codec) {
+    case ALVR_CODEC_H264:
+        markProperty = AMF_VIDEO_ENCODER_MARK_CURRENT_WITH_LTR_INDEX;
+        forceProperty = AMF_VIDEO_ENCODER_FORCE_LTR_REFERENCE_BITFIELD;
+        break;
+    case ALVR_CODEC_HEVC:
+        markProperty = AMF_VIDEO_ENCODER_HEVC_MARK_CURRENT_WITH_LTR_INDEX;
+        forceProperty = AMF_VIDEO_ENCODER_HEVC_FORCE_LTR_REFERENCE_BITFIELD;
+        break;
+    case ALVR_CODEC_AV1:
+    default:
+        markProperty = AMF_VIDEO_ENCODER_AV1_MARK_CURRENT_WITH_LTR_INDEX;
+        forceProperty = AMF_VIDEO_ENCODER_AV1_FORCE_LTR_REFERENCE_BITFIELD;
+        break;
+    }
+
+    if (insertIDR) {
+        // An IDR drops all references, it becomes the first long term reference
+        for (auto& timestampNs : m_ltrTimestamps) {
+            timestampNs = 0;
+        }
+        m_forcedLtr = -1;
+        m_framesSinceLtr = LTR_INTERVAL;
+    }
+
+    // The frame that recovers from a loss isn't marked, so that it doesn't replace the reference
+    // it's encoded from
+    if (m_forcedLtr != -1) {
+        surface->SetProperty(forceProperty, (amf_int64)1 << m_forcedLtr);
+        m_forcedLtr = -1;
+    } else if (m_framesSinceLtr >= LTR_INTERVAL) {
+        surface->SetProperty(markProperty, (amf_int64)m_nextLtr);
+        m_ltrTimestamps[m_nextLtr] = targetTimestampNs;
+        m_nextLtr = (m_nextLtr + 1) % LTR_COUNT;
+        m_framesSinceLtr = 0;
+    }
+    m_framesSinceLtr++;
+}
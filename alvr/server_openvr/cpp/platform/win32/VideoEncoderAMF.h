@@ -10,6 +10,11 @@
 #include "../../shared/amf/public/include/components/VideoEncoderHEVC.h"
 #include "../../shared/amf/public/include/components/VideoEncoderVCE.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 typedef amf::AMFData* AMFDataPtr;
 typedef std::function<void(AMFDataPtr)> AMFDataReceiver;
 
@@ -17,21 +22,28 @@ class AMFPipeline;
 
 class AMFPipe {
 public:
-    AMFPipe(amf::AMFComponentPtr src, AMFDataReceiver receiver);
+    // timeProperty is set on the data leaving the component, to the time it was received
+    AMFPipe(amf::AMFComponentPtr src, AMFDataReceiver receiver, const wchar_t* timeProperty);
     virtual ~AMFPipe();
 
     void doPassthrough(bool hasQueryTimeout, uint32_t timerResolution);
+    // Passes on the output of the component and returns it if there is one, without waiting for
+    // it unless the component has a query timeout
+    amf::AMFDataPtr Poll();
 
 protected:
+    void Deliver(AMFDataPtr data);
+
     amf::AMFComponentPtr m_amfComponentSrc;
     AMFDataReceiver m_receiver;
+    const wchar_t* m_timeProperty;
 };
 
 typedef AMFPipe* AMFPipePtr;
 
 class AMFSolidPipe : public AMFPipe {
 public:
-    AMFSolidPipe(amf::AMFComponentPtr src, amf::AMFComponentPtr dst);
+    AMFSolidPipe(amf::AMFComponentPtr src, amf::AMFComponentPtr dst, const wchar_t* timeProperty);
 
 protected:
     void Passthrough(AMFDataPtr);
@@ -47,10 +59,34 @@ public:
     void Connect(AMFPipePtr pipe);
     void Run(bool hasQueryTimeout);
 
+    // Drains every pipe on its own thread instead of in Run. Frames are then submitted to the
+    // first component after BeginFrame, with at most depth of them in flight
+    void StartDrainThreads(uint32_t depth);
+    // Waits for a free slot and numbers the frame. After 1s without output the oldest frame in
+    // flight is given up on, its output is then ignored if it still comes
+    void BeginFrame(amf::AMFData* data);
+    // The frame of the last BeginFrame wasn't submitted
+    void CancelFrame();
+
 protected:
+    static const wchar_t* FRAME_NUMBER_PROPERTY;
+
+    void DrainLoop(size_t index);
+
     uint32_t m_timerResolution;
 
     std::vector<AMFPipePtr> m_pipes;
+
+    std::vector<std::thread> m_drainThreads;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    uint32_t m_depth = 0;
+    // Frames [m_oldestFrame, m_nextFrame) are in flight
+    uint64_t m_nextFrame = 0;
+    uint64_t m_oldestFrame = 0;
+    // Counts the frames begun and the outputs of all the pipes, to wake up the pipes after them
+    uint64_t m_progress = 0;
+    bool m_exiting = false;
 };
 
 typedef AMFPipeline* AMFPipelinePtr;
@@ -70,11 +106,23 @@ public:
         uint64_t targetTimestampNs,
         bool insertIDR
     );
+    bool RegisterInputTextures(const std::vector<ID3D11Texture2D*>& textures);
+    bool InvalidateReferences(
+        const std::vector<uint64_t>& lostTimestampsNs, uint64_t referenceTimestampNs
+    );
     void Receive(AMFDataPtr data);
 
 private:
     static const wchar_t* START_TIME_PROPERTY;
     static const wchar_t* FRAME_INDEX_PROPERTY;
+    static const wchar_t* CONVERTER_TIME_PROPERTY;
+    static const wchar_t* PREPROCESSOR_TIME_PROPERTY;
+    static const wchar_t* ENCODER_TIME_PROPERTY;
+    static const uint32_t DRAIN_QUEUE_DEPTH = 2;
+    // Long term references, marked in turn every LTR_INTERVAL frames. After a loss the next frame
+    // references the newest one the client received
+    static const int LTR_COUNT = 2;
+    static const int LTR_INTERVAL = 8;
 
     amf::AMFComponentPtr MakeConverter(
         amf::AMF_SURFACE_FORMAT inputFormat,
@@ -94,7 +142,18 @@ private:
     );
     amf::AMFContextPtr m_amfContext;
     AMFPipelinePtr m_pipeline;
+    // The input slots wrapped once as surfaces, submitted without allocating or copying a surface
+    std::vector<std::pair<ID3D11Texture2D*, amf::AMFSurfacePtr>> m_inputSurfaces;
     std::vector<amf::AMFComponentPtr> m_amfComponents;
+    // Time property set by the pipe after each component and its name, for the stage latencies
+    std::vector<std::pair<const wchar_t*, const char*>> m_stages;
+    bool m_drainThreads;
+    // Foveated importance of each block, attached to every frame. Null when disabled. Recreated
+    // when the foveation center moves.
+    amf::AMFSurfacePtr m_roiSurface;
+    uint32_t m_roiSurfaceVersion = 0;
+    // Frames until the encoder is asked for the PSNR and SSIM of the next one
+    uint32_t m_framesUntilQualityProbe = 0;
 
     std::ofstream fpOut;
 
@@ -108,9 +167,27 @@ private:
     int m_renderWidth;
     int m_renderHeight;
     int m_bitrateInMBits;
+    // Set by the bitrate updates and read by the output thread, 0 until the first one
+    std::atomic<uint64_t> m_vbvBufferBits = 0;
 
     bool m_hasQueryTimeout;
     bool m_hasPreAnalysis;
 
+    void CreateRoiSurface();
+    // Reads the statistics feedback of an encoded frame and hands it to the bitrate controller
+    void ReportStats(AMFDataPtr data, int size, bool isIdr);
     void ApplyFrameProperties(const amf::AMFSurfacePtr& surface, bool insertIDR);
+    void ApplyReferenceProperties(
+        const amf::AMFSurfacePtr& surface, uint64_t targetTimestampNs, bool insertIDR
+    );
+
+    bool m_intraRefresh;
+    // Not used with intra refresh, losses are then repaired with an IDR
+    bool m_useLtr;
+    // Timestamp of the frame held by each long term reference, 0 if unused
+    uint64_t m_ltrTimestamps[LTR_COUNT] = {};
+    int m_nextLtr = 0;
+    int m_framesSinceLtr = LTR_INTERVAL;
+    // Long term reference the next frame must reference, -1 if none
+    int m_forcedLtr = -1;
 };
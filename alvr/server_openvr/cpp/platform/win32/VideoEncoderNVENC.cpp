@@ -1,12 +1,25 @@
 #include "VideoEncoderNVENC.h"
-#include "NvCodecUtils.h"
+#include "shared/nvenc/NvCodecUtils.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include "alvr_server/FoveatedQpMap.h"
+#include "alvr_server/FrameTrace.h"
 #include "alvr_server/Logger.h"
 #include "alvr_server/Settings.h"
+#include "alvr_server/TraceCapture.h"
 #include "alvr_server/Utils.h"
 
-VideoEncoderNVENC::VideoEncoderNVENC(std::shared_ptr<CD3DRender> pD3DRender, int width, int height)
+VideoEncoderNVENC::VideoEncoderNVENC(
+    std::shared_ptr<CD3DRender> pD3DRender,
+    int width,
+    int height,
+    std::shared_ptr<PoseHistory> poseHistory
+)
     : m_pD3DRender(pD3DRender)
+    , m_poseHistory(poseHistory)
     , m_codec(Settings::Instance().m_codec)
     , m_refreshRate(Settings::Instance().m_refreshRate)
     , m_renderWidth(width)
@@ -28,6 +41,25 @@ void VideoEncoderNVENC::Initialize() {
                                                   : NV_ENC_BUFFER_FORMAT_ABGR10;
     }
 
+    // A second input and output buffer, so that the next frame can be submitted while the
+    // previous one is retrieved. Otherwise a single buffer, each frame is retrieved by the call
+    // that encodes it
+    m_asyncOutput = Settings::Instance().m_nvencAsyncOutput;
+    uint32_t extraOutputDelay = m_asyncOutput ? 1 : 0;
+
+    // The slices are polled while the frame encodes, which needs the synchronous mode
+    m_subFrameSlices = 0;
+    uint32_t subFrameSlices = Settings::Instance().m_nvencSubFrameSlices;
+    if (subFrameSlices > 1) {
+        if (m_codec == ALVR_CODEC_AV1) {
+            Warn("NvEnc: sub-frame output isn't supported for AV1, sending whole frames\n");
+        } else if (m_asyncOutput) {
+            Warn("NvEnc: sub-frame output can't be used with async output, sending whole frames\n");
+        } else {
+            m_subFrameSlices = subFrameSlices;
+        }
+    }
+
     Debug(
         "Initializing CNvEncoder. Width=%d Height=%d Format=%d\n",
         m_renderWidth,
@@ -37,7 +69,7 @@ void VideoEncoderNVENC::Initialize() {
 
     try {
         m_NvNecoder = std::make_shared<NvEncoderD3D11>(
-            m_pD3DRender->GetDevice(), m_renderWidth, m_renderHeight, format, 0
+            m_pD3DRender->GetDevice(), m_renderWidth, m_renderHeight, format, extraOutputDelay
         );
     } catch (NVENCException e) {
         throw MakeException(
@@ -45,19 +77,38 @@ void VideoEncoderNVENC::Initialize() {
         );
     }
 
-    NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
-    NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
-    initializeParams.encodeConfig = &encodeConfig;
+    m_initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+    m_encodeConfig = { NV_ENC_CONFIG_VER };
+    m_initializeParams.encodeConfig = &m_encodeConfig;
 
-    FillEncodeConfig(
-        initializeParams,
+    m_config = std::make_unique<NvEncConfig>(
+        m_codec, Settings::Instance().m_use10bitEncoder, m_subFrameSlices, m_asyncOutput
+    );
+    m_config->Fill(
+        *m_NvNecoder,
+        m_initializeParams,
         m_refreshRate,
         m_renderWidth,
         m_renderHeight,
         m_bitrateInMBits * 1'000'000L
     );
+    m_appliedBitrate = m_bitrateInMBits * 1'000'000L;
+    m_appliedFramerate = m_refreshRate;
+    if (EncodeLoadControl::IsEnabled()) {
+        m_loadControl = std::make_unique<EncodeLoadControl>(NvEncConfig::LOAD_LEVELS);
+        m_loadLevel = 0;
+        m_appliedLoadLevel = 0;
+        m_loadLevelFailed = false;
+    }
+
+    // One candidate per macroblock. AV1 takes hints per superblock in another format, left out
+    if (m_poseHistory && HeadMotionHints::IsEnabled() && m_codec != ALVR_CODEC_AV1) {
+        m_motionHints = std::make_unique<HeadMotionHints>(m_renderWidth, m_renderHeight, 16);
+        m_initializeParams.enableExternalMEHints = 1;
+        m_initializeParams.maxMEHintCountsPerBlock[0].numCandsPerBlk16x16 = 1;
+    }
     try {
-        m_NvNecoder->CreateEncoder(&initializeParams);
+        m_NvNecoder->CreateEncoder(&m_initializeParams);
     } catch (NVENCException e) {
         if (e.getErrorCode() == NV_ENC_ERR_INVALID_PARAM) {
             throw MakeException(
@@ -66,11 +117,73 @@ void VideoEncoderNVENC::Initialize() {
         }
         throw MakeException("NvEnc CreateEncoder failed. Code=%d %hs", e.getErrorCode(), e.what());
     }
+    // The ring holds the B frames and the lookahead on top of the extra output delay, a frame
+    // would then be retrieved behind later ones
+    if (!m_asyncOutput && m_NvNecoder->GetEncoderBufferCount() != 1) {
+        Warn(
+            "NvEnc: %d frames are buffered, the output is delayed\n",
+            m_NvNecoder->GetEncoderBufferCount()
+        );
+    }
+
+    if (m_subFrameSlices > 0) {
+        m_NvNecoder->SetSubFrameCallback([this](const uint8_t* data, uint32_t size, bool last) {
+            SendSlices(data, size, last);
+        });
+    }
+
+    if (FoveatedQpMap::IsEnabled()) {
+        BuildQpDeltaMap();
+    }
+
+    // The QP map and the motion hints are laid out for the full size
+    m_encodeWidth = m_renderWidth;
+    m_encodeHeight = m_renderHeight;
+    m_resolutionScale = 1.f;
+    m_dynamicResolution = false;
+    if (Settings::Instance().m_dynamicResolutionEnabled) {
+        if (!m_qpDeltaMap.empty() || m_motionHints) {
+            Warn("NvEnc: dynamic resolution can't be used with the foveated QP map or the head "
+                 "motion hints\n");
+        } else {
+            try {
+                m_scaler = std::make_unique<VideoScaler>(
+                    m_pD3DRender->GetDevice(),
+                    m_pD3DRender->GetContext(),
+                    m_renderWidth,
+                    m_renderHeight,
+                    m_renderWidth,
+                    m_renderHeight
+                );
+                m_dynamicResolution = true;
+            } catch (Exception e) {
+                Warn("NvEnc: dynamic resolution is disabled: %s\n", e.what());
+            }
+        }
+    }
+
+    m_references = std::make_unique<NvEncReferences>(
+        m_codec, m_config->UsesLtr(), *m_NvNecoder, m_initializeParams.encodeGUID
+    );
+
+    if (m_asyncOutput) {
+        m_outputExiting = false;
+        m_outputThread = std::thread(&VideoEncoderNVENC::OutputLoop, this);
+    }
 
     Debug("CNvEncoder is successfully initialized.\n");
 }
 
 void VideoEncoderNVENC::Shutdown() {
+    if (m_outputThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_outputMutex);
+            m_outputExiting = true;
+        }
+        m_outputCv.notify_all();
+        m_outputThread.join();
+    }
+
     std::vector<std::vector<uint8_t>> vPacket;
     if (m_NvNecoder)
         m_NvNecoder->EndEncode(vPacket);
@@ -84,6 +197,8 @@ void VideoEncoderNVENC::Shutdown() {
         m_NvNecoder->DestroyEncoder();
         m_NvNecoder.reset();
     }
+    m_inputTextures.clear();
+    m_scaler.reset();
 
     Debug("CNvEncoder::Shutdown\n");
 
@@ -92,327 +207,437 @@ void VideoEncoderNVENC::Shutdown() {
     }
 }
 
+bool VideoEncoderNVENC::RegisterInputTextures(const std::vector<ID3D11Texture2D*>& textures) {
+    // The input slots are reused as soon as Transmit returns, before NVENC read them
+    if (m_asyncOutput) {
+        return false;
+    }
+    try {
+        m_NvNecoder->RegisterExternalTextures(textures);
+    } catch (NVENCException e) {
+        Warn(
+            "NvEnc can't encode the input textures in place, copying them. Code=%d %hs\n",
+            e.getErrorCode(),
+            e.what()
+        );
+        return false;
+    }
+    m_inputTextures = textures;
+    Debug("NvEnc: registered %d input textures\n", (int)textures.size());
+    return true;
+}
+
 void VideoEncoderNVENC::Transmit(
     ID3D11Texture2D* pTexture, uint64_t presentationTime, uint64_t targetTimestampNs, bool insertIDR
 ) {
+    TraceScope scope("VideoEncoderNVENC::Transmit", targetTimestampNs);
+    // Polled once per frame, so bitrate changes in between are coalesced to the latest one
     auto params = GetDynamicEncoderParams();
     if (params.updated) {
         m_bitrateInMBits = params.bitrate_bps / 1'000'000;
-        NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
-        NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
-        initializeParams.encodeConfig = &encodeConfig;
-        FillEncodeConfig(
-            initializeParams,
-            params.framerate,
-            m_renderWidth,
-            m_renderHeight,
-            m_bitrateInMBits * 1'000'000L
-        );
-        NV_ENC_RECONFIGURE_PARAMS reconfigureParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
-        reconfigureParams.reInitEncodeParams = initializeParams;
-        m_NvNecoder->Reconfigure(&reconfigureParams);
+        UpdateRateControl(m_bitrateInMBits * 1'000'000L, params.framerate, params.max_frame_bits);
+        if (m_dynamicResolution && UpdateResolution(params.bitrate_bps)) {
+            insertIDR = true;
+        }
+    }
+    if (m_loadControl) {
+        UpdateLoadLevel();
     }
-
-    std::vector<std::vector<uint8_t>> vPacket;
-
-    const NvEncInputFrame* encoderInputFrame = m_NvNecoder->GetNextInputFrame();
-
-    ID3D11Texture2D* pInputTexture
-        = reinterpret_cast<ID3D11Texture2D*>(encoderInputFrame->inputPtr);
-    m_pD3DRender->GetContext()->CopyResource(pInputTexture, pTexture);
 
     NV_ENC_PIC_PARAMS picParams = {};
+    picParams.inputTimeStamp = targetTimestampNs;
     if (insertIDR) {
         Debug("Inserting IDR frame.\n");
         picParams.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR;
     }
-    m_NvNecoder->EncodeFrame(vPacket, &picParams);
-
-    for (std::vector<uint8_t>& packet : vPacket) {
-        uint8_t* buf = packet.data();
-        int len = (int)packet.size();
+    if (!m_qpDeltaMap.empty()) {
+        // NVENC reads the map while submitting the frame, so it can be replaced between frames
+        if (FoveatedQpMap::GetVersion() != m_qpDeltaMapVersion) {
+            BuildQpDeltaMap();
+        }
+        picParams.qpDeltaMap = m_qpDeltaMap.data();
+        picParams.qpDeltaMapSize = (uint32_t)m_qpDeltaMap.size();
+    }
+    if (m_motionHints) {
+        AddMotionHints(picParams, targetTimestampNs, insertIDR);
+    }
+    m_references->ApplyPicParams(picParams, targetTimestampNs, insertIDR);
+
+    if (m_asyncOutput) {
+        {
+            // The buffers of the oldest pending frame are reused by the next one
+            std::unique_lock<std::mutex> lock(m_outputMutex);
+            m_outputCv.wait(lock, [this] {
+                return m_pendingFrames.size() < m_NvNecoder->GetEncoderBufferCount();
+            });
+        }
 
-        // NVENC's AV1 encoding includes a bunch of IVF wrapping,
-        // so we need to strip it down to just the OBUs
-        if (m_codec == ALVR_CODEC_AV1) {
-            const uint8_t ivf_magic[4] = { 0x44, 0x4B, 0x49, 0x46 };
-            if (len >= 4 && !memcmp(buf, ivf_magic, 4)) {
-                buf += 32;
-                len -= 32;
-            }
-            if (len <= 12) {
-                continue;
-            }
-            buf += 12; // skip past the IVF packet size header thing
-            len -= 12;
+        const NvEncInputFrame* encoderInputFrame = m_NvNecoder->GetNextInputFrame();
+        if (CopyInput(reinterpret_cast<ID3D11Texture2D*>(encoderInputFrame->inputPtr), pTexture)) {
+            picParams.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR;
+            insertIDR = true;
+            m_references->ApplyPicParams(picParams, targetTimestampNs, insertIDR);
         }
+        uint64_t submitNs = FrameTrace::Now();
+        m_NvNecoder->SubmitFrame(&picParams);
 
-        if (len <= 0) {
-            continue;
+        {
+            std::lock_guard<std::mutex> lock(m_outputMutex);
+            m_pendingFrames.push_back({ targetTimestampNs, insertIDR, submitNs });
         }
+        m_outputCv.notify_all();
+        return;
+    }
 
-        if (fpOut) {
-            fpOut.write(reinterpret_cast<char*>(buf), len);
+    // With sub-frame output the packets are left empty, the slices are sent while encoding
+    m_subFrameTimestampNs = targetTimestampNs;
+
+    std::vector<std::vector<uint8_t>> vPacket;
+    uint64_t submitNs = FrameTrace::Now();
+    // A downscaled frame needs a copy, the input slots have the render size
+    if (m_encodeWidth == m_renderWidth && m_encodeHeight == m_renderHeight
+        && std::find(m_inputTextures.begin(), m_inputTextures.end(), pTexture)
+            != m_inputTextures.end()) {
+        m_subFrameIdr = insertIDR;
+        m_NvNecoder->EncodeExternalTexture(pTexture, vPacket, &picParams);
+    } else {
+        const NvEncInputFrame* encoderInputFrame = m_NvNecoder->GetNextInputFrame();
+
+        ID3D11Texture2D* pInputTexture
+            = reinterpret_cast<ID3D11Texture2D*>(encoderInputFrame->inputPtr);
+        if (CopyInput(pInputTexture, pTexture)) {
+            picParams.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR;
+            insertIDR = true;
+            m_references->ApplyPicParams(picParams, targetTimestampNs, insertIDR);
         }
+        m_subFrameIdr = insertIDR;
 
-        ParseFrameNals(m_codec, buf, len, targetTimestampNs, insertIDR);
+        m_NvNecoder->EncodeFrame(vPacket, &picParams);
     }
+
+    for (std::vector<uint8_t>& packet : vPacket) {
+        SendPacket(packet, targetTimestampNs, insertIDR);
+    }
+    ReportStats(insertIDR, FrameTrace::Now() - submitNs);
 }
 
-void VideoEncoderNVENC::FillEncodeConfig(
-    NV_ENC_INITIALIZE_PARAMS& initializeParams,
-    int refreshRate,
-    int renderWidth,
-    int renderHeight,
-    uint64_t bitrate_bps
+bool VideoEncoderNVENC::InvalidateReferences(
+    const std::vector<uint64_t>& lostTimestampsNs, uint64_t referenceTimestampNs
 ) {
-    auto& encodeConfig = *initializeParams.encodeConfig;
-
-    GUID encoderGUID;
-    switch (m_codec) {
-    case ALVR_CODEC_H264:
-        encoderGUID = NV_ENC_CODEC_H264_GUID;
-        break;
-    case ALVR_CODEC_HEVC:
-        encoderGUID = NV_ENC_CODEC_HEVC_GUID;
-        break;
-    case ALVR_CODEC_AV1:
-        encoderGUID = NV_ENC_CODEC_AV1_GUID;
-        break;
-    }
-
-    GUID qualityPreset;
-    // See recommended NVENC settings for low-latency encoding.
-    // https://docs.nvidia.com/video-technologies/video-codec-sdk/nvenc-video-encoder-api-prog-guide/#recommended-nvenc-settings
-    switch (Settings::Instance().m_nvencQualityPreset) {
-    case 7:
-        qualityPreset = NV_ENC_PRESET_P7_GUID;
-        break;
-    case 6:
-        qualityPreset = NV_ENC_PRESET_P6_GUID;
-        break;
-    case 5:
-        qualityPreset = NV_ENC_PRESET_P5_GUID;
-        break;
-    case 4:
-        qualityPreset = NV_ENC_PRESET_P4_GUID;
-        break;
-    case 3:
-        qualityPreset = NV_ENC_PRESET_P3_GUID;
-        break;
-    case 2:
-        qualityPreset = NV_ENC_PRESET_P2_GUID;
-        break;
-    case 1:
-    default:
-        qualityPreset = NV_ENC_PRESET_P1_GUID;
-        break;
-    }
-
-    NV_ENC_TUNING_INFO tuningPreset
-        = static_cast<NV_ENC_TUNING_INFO>(Settings::Instance().m_nvencTuningPreset);
-
-    m_NvNecoder->CreateDefaultEncoderParams(
-        &initializeParams, encoderGUID, qualityPreset, tuningPreset
-    );
+    return m_references->Invalidate(*m_NvNecoder, lostTimestampsNs, referenceTimestampNs);
+}
 
-    initializeParams.encodeWidth = initializeParams.darWidth = renderWidth;
-    initializeParams.encodeHeight = initializeParams.darHeight = renderHeight;
-    initializeParams.frameRateNum = refreshRate;
-    initializeParams.frameRateDen = 1;
+void VideoEncoderNVENC::UpdateRateControl(
+    uint64_t bitrate_bps, int framerate, uint64_t maxFrameBits
+) {
+    if (bitrate_bps == m_appliedBitrate && framerate == m_appliedFramerate
+        && maxFrameBits == m_maxFrameBits) {
+        return;
+    }
+    m_appliedBitrate = bitrate_bps;
+    m_appliedFramerate = framerate;
+    m_maxFrameBits = maxFrameBits;
+
+    // Only the rate control fields change, the rest of the config is reused as created
+    m_config->FillRateControl(m_initializeParams, framerate, bitrate_bps, m_maxFrameBits);
+
+    NV_ENC_RECONFIGURE_PARAMS reconfigureParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
+    reconfigureParams.reInitEncodeParams = m_initializeParams;
+
+    // The output thread reads the initialize params of the encoder
+    WaitForOutput();
+
+    auto start = std::chrono::steady_clock::now();
+    m_NvNecoder->Reconfigure(&reconfigureParams);
+    double costMs
+        = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+              .count();
+    LogPeriod(
+        "NvEncReconfigure",
+        "VideoEncoderNVENC: rate control update to %llu bps took %.2fms",
+        bitrate_bps,
+        costMs
+    );
+}
 
-    if (Settings::Instance().m_nvencRefreshRate != -1) {
-        initializeParams.frameRateNum = Settings::Instance().m_nvencRefreshRate;
+void VideoEncoderNVENC::UpdateLoadLevel() {
+    int level = m_loadLevel.load(std::memory_order_relaxed);
+    if (level == m_appliedLoadLevel || m_loadLevelFailed) {
+        return;
     }
 
-    initializeParams.enableWeightedPrediction
-        = Settings::Instance().m_nvencEnableWeightedPrediction;
+    m_config->FillLoadLevel(m_initializeParams, level);
+
+    NV_ENC_RECONFIGURE_PARAMS reconfigureParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
+    reconfigureParams.reInitEncodeParams = m_initializeParams;
+
+    // The output thread reads the initialize params of the encoder
+    WaitForOutput();
+
+    try {
+        m_NvNecoder->Reconfigure(&reconfigureParams);
+    } catch (NVENCException e) {
+        Warn(
+            "NvEnc: the rate control can't be changed, adaptive encoder load is disabled. Code=%d "
+            "%hs\n",
+            e.getErrorCode(),
+            e.what()
+        );
+        // The output thread may still be feeding the load control, only its level is ignored
+        m_config->FillLoadLevel(m_initializeParams, m_appliedLoadLevel);
+        m_loadLevelFailed = true;
+        return;
+    }
+    m_appliedLoadLevel = level;
+}
 
-    // 16 is recommended when using reference frame invalidation. But it has caused bad visual
-    // quality. Now, use 0 (use default).
-    uint32_t maxNumRefFrames = 0;
-    uint32_t gopLength = NVENC_INFINITE_GOPLENGTH;
+bool VideoEncoderNVENC::UpdateResolution(uint64_t bitrate_bps) {
+    auto& settings = Settings::Instance();
 
-    if (Settings::Instance().m_nvencMaxNumRefFrames != -1) {
-        maxNumRefFrames = Settings::Instance().m_nvencMaxNumRefFrames;
+    // The pixel count follows the bitrate, in steps of an eighth of the width and height. It only
+    // goes down once well into the lower step, so that the bitrate wobbling around a step doesn't
+    // send an IDR each time
+    const float step = 1.f / 8;
+    float scale = std::sqrt(bitrate_bps / (settings.m_dynamicResolutionFullMbps * 1e6f));
+    float target = std::clamp(
+        std::floor(scale / step) * step, std::min(settings.m_dynamicResolutionMinScale, 1.f), 1.f
+    );
+    bool lower = target < m_resolutionScale && scale < m_resolutionScale - step / 2;
+    if (target <= m_resolutionScale && !lower) {
+        return false;
+    }
+    m_resolutionScale = target;
+
+    // Aligned to macroblocks, some decoders mishandle the cropping of odd sizes
+    int width = std::max((int)(m_renderWidth * target) & ~15, 16);
+    int height = std::max((int)(m_renderHeight * target) & ~15, 16);
+    if (target == 1.f) {
+        width = m_renderWidth;
+        height = m_renderHeight;
     }
-    if (Settings::Instance().m_nvencGopLength != -1) {
-        gopLength = Settings::Instance().m_nvencGopLength;
+    if (width == m_encodeWidth && height == m_encodeHeight) {
+        return false;
     }
+    return Resize(width, height);
+}
 
-    switch (m_codec) {
-    case ALVR_CODEC_H264: {
-        auto& config = encodeConfig.encodeCodecConfig.h264Config;
-        config.repeatSPSPPS = 1;
-        config.enableIntraRefresh = Settings::Instance().m_nvencEnableIntraRefresh;
+bool VideoEncoderNVENC::Resize(int width, int height) {
+    m_initializeParams.encodeWidth = width;
+    m_initializeParams.encodeHeight = height;
+    m_initializeParams.darWidth = width;
+    m_initializeParams.darHeight = height;
 
-        if (Settings::Instance().m_nvencIntraRefreshPeriod != -1) {
-            config.intraRefreshPeriod = Settings::Instance().m_nvencIntraRefreshPeriod;
-        }
-        if (Settings::Instance().m_nvencIntraRefreshCount != -1) {
-            config.intraRefreshCnt = Settings::Instance().m_nvencIntraRefreshCount;
-        }
+    NV_ENC_RECONFIGURE_PARAMS reconfigureParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
+    reconfigureParams.reInitEncodeParams = m_initializeParams;
+    // The new size comes with a new sequence header, which decoders only take at an IDR
+    reconfigureParams.resetEncoder = 1;
+    reconfigureParams.forceIDR = 1;
 
-        switch (Settings::Instance().m_entropyCoding) {
-        case ALVR_CABAC:
-            config.entropyCodingMode = NV_ENC_H264_ENTROPY_CODING_MODE_CABAC;
-            break;
-        case ALVR_CAVLC:
-            config.entropyCodingMode = NV_ENC_H264_ENTROPY_CODING_MODE_CAVLC;
-            break;
-        }
+    // The output thread reads the initialize params of the encoder
+    WaitForOutput();
 
-        config.maxNumRefFrames = maxNumRefFrames;
-        config.idrPeriod = gopLength;
+    try {
+        m_NvNecoder->Reconfigure(&reconfigureParams);
+    } catch (NVENCException e) {
+        Warn(
+            "NvEnc: the encode size can't be changed, dynamic resolution is disabled. Code=%d "
+            "%hs\n",
+            e.getErrorCode(),
+            e.what()
+        );
+        m_dynamicResolution = false;
+        m_initializeParams.encodeWidth = m_initializeParams.darWidth = m_encodeWidth;
+        m_initializeParams.encodeHeight = m_initializeParams.darHeight = m_encodeHeight;
+        return false;
+    }
 
-        if (Settings::Instance().m_fillerData) {
-            config.enableFillerDataInsertion = Settings::Instance().m_rateControlMode == ALVR_CBR;
-        }
+    m_encodeWidth = width;
+    m_encodeHeight = height;
+    Info("NvEnc: encoding at %dx%d for %d Mbps\n", width, height, m_bitrateInMBits);
+    return true;
+}
 
-        config.h264VUIParameters.videoSignalTypePresentFlag = 1;
-        config.h264VUIParameters.videoFormat = NV_ENC_VUI_VIDEO_FORMAT_UNSPECIFIED;
-        config.h264VUIParameters.videoFullRangeFlag = 1;
-        config.h264VUIParameters.colourDescriptionPresentFlag = 1;
-        if (Settings::Instance().m_enableHdr) {
-            config.h264VUIParameters.colourPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT2020;
-            config.h264VUIParameters.transferCharacteristics
-                = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
-            config.h264VUIParameters.colourMatrix = NV_ENC_VUI_MATRIX_COEFFS_BT2020_NCL;
-        } else {
-            config.h264VUIParameters.colourPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT709;
-            config.h264VUIParameters.transferCharacteristics
-                = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
-            config.h264VUIParameters.colourMatrix = NV_ENC_VUI_MATRIX_COEFFS_BT709;
-        }
-    } break;
-    case ALVR_CODEC_HEVC: {
-        auto& config = encodeConfig.encodeCodecConfig.hevcConfig;
-        config.repeatSPSPPS = 1;
-        config.enableIntraRefresh = Settings::Instance().m_nvencEnableIntraRefresh;
-
-        if (Settings::Instance().m_nvencIntraRefreshPeriod != -1) {
-            config.intraRefreshPeriod = Settings::Instance().m_nvencIntraRefreshPeriod;
+bool VideoEncoderNVENC::CopyInput(ID3D11Texture2D* input, ID3D11Texture2D* frame) {
+    if (m_encodeWidth == m_renderWidth && m_encodeHeight == m_renderHeight) {
+        m_pD3DRender->GetContext()->CopyResource(input, frame);
+        return false;
+    }
+    if (m_scaler->Blit(frame, input, m_encodeWidth, m_encodeHeight)) {
+        return false;
+    }
+
+    Warn("NvEnc: the frames can't be downscaled, dynamic resolution is disabled\n");
+    m_dynamicResolution = false;
+    m_resolutionScale = 1.f;
+    m_pD3DRender->GetContext()->CopyResource(input, frame);
+    return Resize(m_renderWidth, m_renderHeight);
+}
+
+void VideoEncoderNVENC::SendPacket(
+    std::vector<uint8_t>& packet, uint64_t targetTimestampNs, bool insertIDR
+) {
+    uint8_t* buf = packet.data();
+    int len = (int)packet.size();
+
+    // NVENC's AV1 encoding includes a bunch of IVF wrapping,
+    // so we need to strip it down to just the OBUs
+    if (m_codec == ALVR_CODEC_AV1) {
+        const uint8_t ivf_magic[4] = { 0x44, 0x4B, 0x49, 0x46 };
+        if (len >= 4 && !memcmp(buf, ivf_magic, 4)) {
+            buf += 32;
+            len -= 32;
         }
-        if (Settings::Instance().m_nvencIntraRefreshCount != -1) {
-            config.intraRefreshCnt = Settings::Instance().m_nvencIntraRefreshCount;
+        if (len <= 12) {
+            return;
         }
+        buf += 12; // skip past the IVF packet size header thing
+        len -= 12;
+    }
 
-        config.maxNumRefFramesInDPB = maxNumRefFrames;
-        config.idrPeriod = gopLength;
+    if (len <= 0) {
+        return;
+    }
 
-        if (Settings::Instance().m_use10bitEncoder) {
-            encodeConfig.encodeCodecConfig.hevcConfig.pixelBitDepthMinus8 = 2;
-        }
+    if (fpOut) {
+        fpOut.write(reinterpret_cast<char*>(buf), len);
+    }
 
-        if (Settings::Instance().m_fillerData) {
-            config.enableFillerDataInsertion = Settings::Instance().m_rateControlMode == ALVR_CBR;
-        }
+    // Moving the packet keeps its buffer, which is then freed by the network thread once sent
+    auto owned = new std::vector<uint8_t>(std::move(packet));
+    FfiNalRange range = { buf, (unsigned int)len };
+    ParseFrameNalRanges(
+        m_codec,
+        &range,
+        1,
+        targetTimestampNs,
+        insertIDR,
+        true,
+        [](void* context) { delete static_cast<std::vector<uint8_t>*>(context); },
+        owned
+    );
+}
 
-        config.hevcVUIParameters.videoSignalTypePresentFlag = 1;
-        config.hevcVUIParameters.videoFormat = NV_ENC_VUI_VIDEO_FORMAT_UNSPECIFIED;
-        config.hevcVUIParameters.videoFullRangeFlag = 1;
-        config.hevcVUIParameters.colourDescriptionPresentFlag = 1;
-        if (Settings::Instance().m_enableHdr) {
-            config.hevcVUIParameters.colourPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT2020;
-            config.hevcVUIParameters.transferCharacteristics
-                = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
-            config.hevcVUIParameters.colourMatrix = NV_ENC_VUI_MATRIX_COEFFS_BT2020_NCL;
-        } else {
-            config.hevcVUIParameters.colourPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT709;
-            config.hevcVUIParameters.transferCharacteristics
-                = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
-            config.hevcVUIParameters.colourMatrix = NV_ENC_VUI_MATRIX_COEFFS_BT709;
-        }
-    } break;
-    case ALVR_CODEC_AV1: {
-        auto& config = encodeConfig.encodeCodecConfig.av1Config;
-        config.repeatSeqHdr = 1;
-        config.enableIntraRefresh = Settings::Instance().m_nvencEnableIntraRefresh;
-
-        if (Settings::Instance().m_nvencIntraRefreshPeriod != -1) {
-            config.intraRefreshPeriod = Settings::Instance().m_nvencIntraRefreshPeriod;
-        }
-        if (Settings::Instance().m_nvencIntraRefreshCount != -1) {
-            config.intraRefreshCnt = Settings::Instance().m_nvencIntraRefreshCount;
-        }
+void VideoEncoderNVENC::SendSlices(const uint8_t* data, uint32_t size, bool last) {
+    if (fpOut) {
+        fpOut.write(reinterpret_cast<const char*>(data), size);
+    }
+
+    // The bitstream buffer is locked only during the callback
+    auto owned = new std::vector<uint8_t>(data, data + size);
+    FfiNalRange range = { owned->data(), (unsigned int)owned->size() };
+    ParseFrameNalRanges(
+        m_codec,
+        &range,
+        1,
+        m_subFrameTimestampNs,
+        m_subFrameIdr,
+        last,
+        [](void* context) { delete static_cast<std::vector<uint8_t>*>(context); },
+        owned
+    );
+}
 
-        config.maxNumRefFramesInDPB = maxNumRefFrames;
-        config.idrPeriod = gopLength;
+void VideoEncoderNVENC::OutputLoop() {
+    Debug("VideoEncoderNVENC: Start output thread. Id=%d\n", GetCurrentThreadId());
+    Info(
+        "%s\n",
+        ApplyThreadRole(ThreadRole::EncoderOutput, Settings::Instance().m_encoderOutputThread)
+            .c_str()
+    );
 
-        if (Settings::Instance().m_use10bitEncoder) {
-            config.pixelBitDepthMinus8 = 2;
+    while (true) {
+        PendingFrame frame;
+        {
+            std::unique_lock<std::mutex> lock(m_outputMutex);
+            m_outputCv.wait(lock, [this] { return m_outputExiting || !m_pendingFrames.empty(); });
+            if (m_pendingFrames.empty()) {
+                return;
+            }
+            frame = m_pendingFrames.front();
         }
 
-        if (Settings::Instance().m_fillerData) {
-            config.enableBitstreamPadding = Settings::Instance().m_rateControlMode == ALVR_CBR;
+        try {
+            // Locked straight into the buffer that is handed to the network thread
+            std::vector<uint8_t> packet;
+            m_NvNecoder->GetSubmittedPacket(packet);
+            SendPacket(packet, frame.targetTimestampNs, frame.insertIDR);
+            ReportStats(frame.insertIDR, FrameTrace::Now() - frame.submitNs);
+        } catch (NVENCException e) {
+            Error(
+                "VideoEncoderNVENC: failed to retrieve frame. Code=%d %hs\n",
+                e.getErrorCode(),
+                e.what()
+            );
         }
 
-        config.chromaFormatIDC = 1; // 4:2:0, 4:4:4 currently not supported
-        config.colorRange = 1;
-        if (Settings::Instance().m_enableHdr) {
-            config.colorPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT2020;
-            config.transferCharacteristics = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
-            config.matrixCoefficients = NV_ENC_VUI_MATRIX_COEFFS_BT2020_NCL;
-        } else {
-            config.colorPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT709;
-            config.transferCharacteristics = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
-            config.matrixCoefficients = NV_ENC_VUI_MATRIX_COEFFS_BT709;
+        {
+            std::lock_guard<std::mutex> lock(m_outputMutex);
+            m_pendingFrames.pop_front();
         }
-    } break;
+        m_outputCv.notify_all();
     }
+}
 
-    // Disable automatic IDR insertion by NVENC. We need to manually insert IDR when packet is
-    // dropped if don't use reference frame invalidation.
-    encodeConfig.gopLength = gopLength;
-    encodeConfig.frameIntervalP = 1;
-
-    if (Settings::Instance().m_nvencPFrameStrategy != -1) {
-        encodeConfig.frameIntervalP = Settings::Instance().m_nvencPFrameStrategy;
+void VideoEncoderNVENC::ReportStats(bool isIdr, uint64_t encodeNs) {
+    if (m_loadControl && m_loadControl->AddFrame(encodeNs)) {
+        m_loadLevel.store(m_loadControl->GetLevel(), std::memory_order_relaxed);
     }
 
-    switch (Settings::Instance().m_rateControlMode) {
-    case ALVR_CBR:
-        encodeConfig.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR;
-        break;
-    case ALVR_VBR:
-        encodeConfig.rcParams.rateControlMode = NV_ENC_PARAMS_RC_VBR;
-        break;
-    }
-    encodeConfig.rcParams.multiPass
-        = static_cast<NV_ENC_MULTI_PASS>(Settings::Instance().m_nvencMultiPass);
-    encodeConfig.rcParams.lowDelayKeyFrameScale = 1;
+    const NvEncoder::FrameStats& stats = m_NvNecoder->GetLastFrameStats();
+    uint32_t blocks = stats.intraBlocks + stats.interBlocks;
+    uint32_t vbvBufferBits = m_encodeConfig.rcParams.vbvBufferSize;
+
+    FfiEncoderStats encoderStats = {};
+    encoderStats.isIdr = isIdr;
+    encoderStats.averageQp = (float)stats.averageQp;
+    encoderStats.intraRatio = blocks > 0 ? (float)stats.intraBlocks / blocks : -1.f;
+    encoderStats.vbvOverflow
+        = vbvBufferBits > 0 && (uint64_t)stats.sizeInBytes * 8 > vbvBufferBits;
+    // NVENC doesn't output the reconstructed frame
+    encoderStats.psnr = -1.f;
+    encoderStats.ssim = -1.f;
+    ReportEncoderStats(encoderStats);
+}
 
-    if (Settings::Instance().m_nvencLowDelayKeyFrameScale != -1) {
-        encodeConfig.rcParams.lowDelayKeyFrameScale
-            = Settings::Instance().m_nvencLowDelayKeyFrameScale;
-    }
+void VideoEncoderNVENC::WaitForOutput() {
+    std::unique_lock<std::mutex> lock(m_outputMutex);
+    m_outputCv.wait(lock, [this] { return m_pendingFrames.empty(); });
+}
 
-    uint32_t maxFrameSize = static_cast<uint32_t>(bitrate_bps / refreshRate);
-    Debug("VideoEncoderNVENC: maxFrameSize=%d bits\n", maxFrameSize);
-    encodeConfig.rcParams.vbvBufferSize = maxFrameSize * 1.1;
-    encodeConfig.rcParams.vbvInitialDelay = maxFrameSize * 1.1;
-    encodeConfig.rcParams.maxBitRate = static_cast<uint32_t>(bitrate_bps);
-    encodeConfig.rcParams.averageBitRate = static_cast<uint32_t>(bitrate_bps);
-    if (Settings::Instance().m_nvencAdaptiveQuantizationMode == SpatialAQ) {
-        encodeConfig.rcParams.enableAQ = 1;
-    } else if (Settings::Instance().m_nvencAdaptiveQuantizationMode == TemporalAQ) {
-        encodeConfig.rcParams.enableTemporalAQ = 1;
-    }
+void VideoEncoderNVENC::BuildQpDeltaMap() {
+    m_qpDeltaMapVersion = FoveatedQpMap::GetVersion();
+    // One value per macroblock for H.264, per CTB for HEVC and per superblock for AV1
+    uint32_t blockSize = m_codec == ALVR_CODEC_H264 ? 16 : m_codec == ALVR_CODEC_HEVC ? 32 : 64;
+    m_qpDeltaMap = FoveatedQpMap(m_renderWidth, m_renderHeight).BuildDeltaMap(blockSize);
+}
 
-    if (Settings::Instance().m_nvencRateControlMode != -1) {
-        encodeConfig.rcParams.rateControlMode
-            = (NV_ENC_PARAMS_RC_MODE)Settings::Instance().m_nvencRateControlMode;
-    }
-    if (Settings::Instance().m_nvencRcBufferSize != -1) {
-        encodeConfig.rcParams.vbvBufferSize = Settings::Instance().m_nvencRcBufferSize;
-    }
-    if (Settings::Instance().m_nvencRcInitialDelay != -1) {
-        encodeConfig.rcParams.vbvInitialDelay = Settings::Instance().m_nvencRcInitialDelay;
+void VideoEncoderNVENC::AddMotionHints(
+    NV_ENC_PIC_PARAMS& picParams, uint64_t targetTimestampNs, bool insertIDR
+) {
+    auto pose = m_poseHistory->GetPoseAt(targetTimestampNs);
+    // The hints point into the previous frame, which is the reference unless it was invalidated.
+    // The encoder still searches around them, so a stale reference only makes them less useful
+    bool hinted = !insertIDR && pose && m_previousRotation
+        && m_motionHints->Build(*m_previousRotation, pose->rotationMatrix, m_motionVectors);
+    if (pose) {
+        m_previousRotation = pose->rotationMatrix;
+    } else {
+        m_previousRotation.reset();
     }
-    if (Settings::Instance().m_nvencRcMaxBitrate != -1) {
-        encodeConfig.rcParams.maxBitRate = Settings::Instance().m_nvencRcMaxBitrate;
+    if (!hinted) {
+        return;
     }
-    if (Settings::Instance().m_nvencRcAverageBitrate != -1) {
-        encodeConfig.rcParams.averageBitRate = Settings::Instance().m_nvencRcAverageBitrate;
+
+    m_meHints.resize(m_motionVectors.size());
+    for (size_t i = 0; i < m_motionVectors.size(); i++) {
+        NVENC_EXTERNAL_ME_HINT& hint = m_meHints[i];
+        hint = {};
+        // Integer pixels, within the range of the fields
+        hint.mvx = std::clamp(m_motionVectors[i].x, -2048, 2047);
+        hint.mvy = std::clamp(m_motionVectors[i].y, -512, 511);
+        hint.lastofPart = 1;
+        hint.lastOfMB = 1;
     }
+    picParams.meHintCountsPerBlock[0].numCandsPerBlk16x16 = 1;
+    picParams.meExternalHints = m_meHints.data();
 }
@@ -2,15 +2,32 @@
 
 #include "NvEncoderD3D11.h"
 #include "VideoEncoder.h"
+#include "VideoScaler.h"
+#include "alvr_server/EncodeLoadControl.h"
+#include "alvr_server/HeadMotionHints.h"
+#include "alvr_server/PoseHistory.h"
 #include "shared/d3drender.h"
+#include "shared/nvenc/NvEncConfig.h"
+#include "shared/nvenc/NvEncReferences.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <memory>
-
-enum AdaptiveQuantizationMode { SpatialAQ = 1, TemporalAQ = 2 };
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
 
 // Video encoder for NVIDIA NvEnc.
 class VideoEncoderNVENC : public VideoEncoder {
 public:
-    VideoEncoderNVENC(std::shared_ptr<CD3DRender> pD3DRender, int width, int height);
+    // Without a pose history no motion hints are given
+    VideoEncoderNVENC(
+        std::shared_ptr<CD3DRender> pD3DRender,
+        int width,
+        int height,
+        std::shared_ptr<PoseHistory> poseHistory = nullptr
+    );
     ~VideoEncoderNVENC();
 
     void Initialize();
@@ -23,19 +40,103 @@ public:
         bool insertIDR
     );
 
-private:
-    void FillEncodeConfig(
-        NV_ENC_INITIALIZE_PARAMS& initializeParams,
-        int refreshRate,
-        int renderWidth,
-        int renderHeight,
-        uint64_t bitrate_bps
+    bool RegisterInputTextures(const std::vector<ID3D11Texture2D*>& textures);
+
+    bool InvalidateReferences(
+        const std::vector<uint64_t>& lostTimestampsNs, uint64_t referenceTimestampNs
     );
 
+private:
+    // Writes a packet to the capture file and hands it to the network thread
+    void SendPacket(std::vector<uint8_t>& packet, uint64_t targetTimestampNs, bool insertIDR);
+    // Sub-frame callback of the encoder, for the frame being encoded by Transmit
+    void SendSlices(const uint8_t* data, uint32_t size, bool last);
+    void OutputLoop();
+    // Hands the rate control statistics of the frame retrieved last to the bitrate controller, and
+    // its encode time to the load control
+    void ReportStats(bool isIdr, uint64_t encodeNs);
+    // Waits until the output thread retrieved all submitted frames
+    void WaitForOutput();
+
+    // Patches the rate control fields of m_initializeParams and reconfigures the encoder with them.
+    // Does nothing if they are unchanged
+    void UpdateRateControl(uint64_t bitrate_bps, int framerate, uint64_t maxFrameBits);
+    // Picks the encode size for the bitrate and reconfigures the encoder if it changes. Returns
+    // true if it did, the next frame must then be an IDR
+    bool UpdateResolution(uint64_t bitrate_bps);
+    // Reconfigures the rate control for the level the load control asks for, if it changed
+    void UpdateLoadLevel();
+    // Reconfigures the encode size, with a new sequence header and an IDR. Returns false and
+    // disables the dynamic resolution if the GPU can't change it
+    bool Resize(int width, int height);
+    // Copies the frame into an input buffer of the encoder, downscaled if the encode size is
+    // smaller. Returns true if it had to go back to the full size, which needs an IDR
+    bool CopyInput(ID3D11Texture2D* input, ID3D11Texture2D* frame);
+
+    void BuildQpDeltaMap();
+    // Hints from the head rotation since the previous frame
+    void AddMotionHints(NV_ENC_PIC_PARAMS& picParams, uint64_t targetTimestampNs, bool insertIDR);
+
     std::ofstream fpOut;
-    std::shared_ptr<NvEncoder> m_NvNecoder;
+    std::shared_ptr<NvEncoderD3D11> m_NvNecoder;
+    // Kept from creation, so that bitrate changes only patch the rate control fields
+    NV_ENC_INITIALIZE_PARAMS m_initializeParams;
+    NV_ENC_CONFIG m_encodeConfig;
+    uint64_t m_appliedBitrate = 0;
+    int m_appliedFramerate = 0;
+    // Frame size cap the VBV buffer is bounded by, 0 for none
+    uint64_t m_maxFrameBits = 0;
+    // Encoded in place by Transmit, without the copy to the encoder's input buffer
+    std::vector<ID3D11Texture2D*> m_inputTextures;
+    // Created by Initialize
+    std::unique_ptr<NvEncConfig> m_config;
+    std::unique_ptr<NvEncReferences> m_references;
+    // Foveated QP offsets passed with every frame, empty when disabled. Rebuilt when the
+    // foveation center moves.
+    std::vector<int8_t> m_qpDeltaMap;
+    uint32_t m_qpDeltaMapVersion = 0;
+    // Null when the motion hints are disabled
+    std::unique_ptr<HeadMotionHints> m_motionHints;
+    std::vector<HeadMotionHints::Vector> m_motionVectors;
+    std::vector<NVENC_EXTERNAL_ME_HINT> m_meHints;
+    std::optional<vr::HmdMatrix34_t> m_previousRotation;
+
+    // The frames are downscaled into the top left of the input buffers, which keep the render
+    // size, when the bitrate drops. Null when the dynamic resolution is disabled
+    std::unique_ptr<VideoScaler> m_scaler;
+    bool m_dynamicResolution = false;
+    float m_resolutionScale = 1.f;
+    int m_encodeWidth;
+    int m_encodeHeight;
+
+    // With async output Transmit only submits the frame, its bitstream is retrieved by the output
+    // thread once NVENC signals its completion event
+    struct PendingFrame {
+        uint64_t targetTimestampNs;
+        bool insertIDR;
+        uint64_t submitNs;
+    };
+    bool m_asyncOutput = false;
+    std::thread m_outputThread;
+    std::mutex m_outputMutex;
+    std::condition_variable m_outputCv;
+    std::deque<PendingFrame> m_pendingFrames;
+    bool m_outputExiting = false;
+
+    // Slices per frame with sub-frame output, 0 when the frames are sent whole
+    uint32_t m_subFrameSlices = 0;
+    uint64_t m_subFrameTimestampNs = 0;
+    bool m_subFrameIdr = false;
+
+    // Null when disabled. Fed by the thread that retrieves the frames, the level is applied by
+    // Transmit
+    std::unique_ptr<EncodeLoadControl> m_loadControl;
+    std::atomic<int> m_loadLevel { 0 };
+    int m_appliedLoadLevel = 0;
+    bool m_loadLevelFailed = false;
 
     std::shared_ptr<CD3DRender> m_pD3DRender;
+    std::shared_ptr<PoseHistory> m_poseHistory;
 
     int m_codec;
     int m_refreshRate;
@@ -0,0 +1,314 @@
+#ifdef ALVR_GPL
+
+#include "VideoEncoderQSV.h"
+
+#include "alvr_server/Logger.h"
+#include "alvr_server/Settings.h"
+#include "alvr_server/TraceCapture.h"
+#include "alvr_server/Utils.h"
+#include "alvr_server/bindings.h"
+
+#include <algorithm>
+#include <climits>
+
+extern "C" {
+#include <libavutil/hwcontext_d3d11va.h>
+#include <libavutil/opt.h>
+}
+
+namespace {
+const char* EncoderName(ALVR_CODEC codec) {
+    switch (codec) {
+    case ALVR_CODEC_H264:
+        return "h264_qsv";
+    case ALVR_CODEC_HEVC:
+        return "hevc_qsv";
+    case ALVR_CODEC_AV1:
+        return "av1_qsv";
+    default:
+        return nullptr;
+    }
+}
+
+// Codec-specific options that older FFmpeg or driver versions may not have
+void SetOptionalOption(AVCodecContext* context, const char* name, int64_t value) {
+    if (av_opt_set_int(context->priv_data, name, value, 0) < 0) {
+        Debug("VideoEncoderQSV: option %s is not supported\n", name);
+    }
+}
+}
+
+VideoEncoderQSV::VideoEncoderQSV(std::shared_ptr<CD3DRender> d3dRender, int width, int height)
+    : m_d3dRender(d3dRender)
+    , m_codec((ALVR_CODEC)Settings::Instance().m_codec)
+    , m_renderWidth(width)
+    , m_renderHeight(height) { }
+
+VideoEncoderQSV::~VideoEncoderQSV() { Shutdown(); }
+
+void VideoEncoderQSV::Initialize() {
+    Debug("Initializing VideoEncoderQSV.\n");
+    const auto& settings = Settings::Instance();
+
+    const char* encoderName = EncoderName(m_codec);
+    const AVCodec* codec = encoderName ? avcodec_find_encoder_by_name(encoderName) : nullptr;
+    if (!codec) {
+        throw MakeException("QSV encoder not found for codec %d", m_codec);
+    }
+
+    // FFmpeg releases the device with the context
+    m_hwDevice = av_hwdevice_ctx_alloc(AV_HWDEVICE_TYPE_D3D11VA);
+    if (!m_hwDevice) {
+        throw MakeException("Failed to allocate the D3D11 device context");
+    }
+    auto deviceContext = (AVD3D11VADeviceContext*)((AVHWDeviceContext*)m_hwDevice->data)->hwctx;
+    deviceContext->device = m_d3dRender->GetDevice();
+    deviceContext->device->AddRef();
+    int err = av_hwdevice_ctx_init(m_hwDevice);
+    if (err < 0) {
+        Shutdown();
+        throw MakeException("Failed to initialize the D3D11 device context: %d", err);
+    }
+
+    // No initial pool, so that each frame is a texture of its own the video processor can write
+    m_hwFrames = av_hwframe_ctx_alloc(m_hwDevice);
+    if (!m_hwFrames) {
+        Shutdown();
+        throw MakeException("Failed to allocate the D3D11 frames context");
+    }
+    auto framesContext = (AVHWFramesContext*)m_hwFrames->data;
+    framesContext->format = AV_PIX_FMT_D3D11;
+    framesContext->sw_format = settings.m_use10bitEncoder ? AV_PIX_FMT_P010 : AV_PIX_FMT_NV12;
+    framesContext->width = m_renderWidth;
+    framesContext->height = m_renderHeight;
+    ((AVD3D11VAFramesContext*)framesContext->hwctx)->BindFlags = D3D11_BIND_RENDER_TARGET;
+    if ((err = av_hwframe_ctx_init(m_hwFrames)) < 0) {
+        Shutdown();
+        throw MakeException("Failed to initialize the D3D11 frames context: %d", err);
+    }
+
+    m_codecContext = avcodec_alloc_context3(codec);
+    if (!m_codecContext) {
+        Shutdown();
+        throw MakeException("Failed to allocate the QSV encoder");
+    }
+    m_codecContext->width = m_renderWidth;
+    m_codecContext->height = m_renderHeight;
+    m_codecContext->time_base = AVRational { 1, (int)1e9 };
+    m_codecContext->sample_aspect_ratio = AVRational { 1, 1 };
+    m_codecContext->pix_fmt = AV_PIX_FMT_D3D11;
+    m_codecContext->hw_frames_ctx = av_buffer_ref(m_hwFrames);
+    m_codecContext->max_b_frames = 0;
+    // IDRs are only inserted on request
+    m_codecContext->gop_size = INT16_MAX;
+    m_codecContext->color_range = AVCOL_RANGE_JPEG;
+    if (settings.m_enableHdr) {
+        m_codecContext->color_primaries = AVCOL_PRI_BT2020;
+        m_codecContext->color_trc = AVCOL_TRC_GAMMA22;
+        m_codecContext->colorspace = AVCOL_SPC_BT2020_NCL;
+    } else {
+        m_codecContext->color_primaries = AVCOL_PRI_BT709;
+        m_codecContext->color_trc = AVCOL_TRC_GAMMA22;
+        m_codecContext->colorspace = AVCOL_SPC_BT709;
+    }
+
+    switch (m_codec) {
+    case ALVR_CODEC_H264:
+        switch (settings.m_h264Profile) {
+        case ALVR_H264_PROFILE_BASELINE:
+            m_codecContext->profile = FF_PROFILE_H264_BASELINE;
+            break;
+        case ALVR_H264_PROFILE_MAIN:
+            m_codecContext->profile = FF_PROFILE_H264_MAIN;
+            break;
+        default:
+        case ALVR_H264_PROFILE_HIGH:
+            m_codecContext->profile = FF_PROFILE_H264_HIGH;
+            break;
+        }
+        SetOptionalOption(m_codecContext, "cavlc", settings.m_entropyCoding == ALVR_CAVLC);
+        break;
+    case ALVR_CODEC_HEVC:
+        m_codecContext->profile
+            = settings.m_use10bitEncoder ? FF_PROFILE_HEVC_MAIN_10 : FF_PROFILE_HEVC_MAIN;
+        break;
+    case ALVR_CODEC_AV1:
+        m_codecContext->profile = FF_PROFILE_AV1_MAIN;
+        break;
+    }
+
+    switch (settings.m_encoderQualityPreset) {
+    case ALVR_QUALITY:
+        av_opt_set(m_codecContext->priv_data, "preset", "medium", 0);
+        break;
+    case ALVR_BALANCED:
+        av_opt_set(m_codecContext->priv_data, "preset", "faster", 0);
+        break;
+    case ALVR_SPEED:
+    default:
+        av_opt_set(m_codecContext->priv_data, "preset", "veryfast", 0);
+        break;
+    }
+    // One frame in flight and no lookahead, each packet is out before Transmit returns. The
+    // requested I frames are IDRs, and the rate control may drop below the target in one frame
+    SetOptionalOption(m_codecContext, "async_depth", 1);
+    SetOptionalOption(m_codecContext, "forced_idr", 1);
+    SetOptionalOption(m_codecContext, "low_delay_brc", 1);
+
+    if (settings.m_gradualIntraRefresh) {
+        if (m_codec == ALVR_CODEC_AV1) {
+            Warn("VideoEncoderQSV: intra refresh is not supported with AV1\n");
+        } else {
+            // Vertical columns, each frame refreshes its share of the picture
+            SetOptionalOption(m_codecContext, "int_ref_type", 1);
+            SetOptionalOption(
+                m_codecContext, "int_ref_cycle_size", settings.m_gradualIntraRefreshPeriod
+            );
+        }
+    }
+
+    FfiDynamicEncoderParams params = {};
+    params.updated = true;
+    params.bitrate_bps = 30'000'000;
+    params.framerate = (float)settings.m_refreshRate;
+    SetParams(params);
+
+    if ((err = avcodec_open2(m_codecContext, codec, nullptr)) < 0) {
+        Shutdown();
+        throw MakeException("Cannot open the QSV encoder: %d", err);
+    }
+
+    m_frame = av_frame_alloc();
+    m_packet = av_packet_alloc();
+
+    Info("VideoEncoderQSV: using %s\n", encoderName);
+}
+
+void VideoEncoderQSV::Shutdown() {
+    if (m_codecContext) {
+        // Drains the frames still in the encoder
+        avcodec_send_frame(m_codecContext, nullptr);
+        if (m_packet) {
+            while (avcodec_receive_packet(m_codecContext, m_packet) == 0) {
+                av_packet_unref(m_packet);
+            }
+        }
+        avcodec_free_context(&m_codecContext);
+    }
+    av_packet_free(&m_packet);
+    av_frame_free(&m_frame);
+    m_scaler.reset();
+    av_buffer_unref(&m_hwFrames);
+    av_buffer_unref(&m_hwDevice);
+}
+
+void VideoEncoderQSV::Transmit(
+    ID3D11Texture2D* pTexture, uint64_t presentationTime, uint64_t targetTimestampNs, bool insertIDR
+) {
+    TraceScope scope("VideoEncoderQSV::Transmit", targetTimestampNs);
+
+    // The encoder picks the changes up on the next frame and reconfigures itself
+    SetParams(GetDynamicEncoderParams());
+
+    int err = av_hwframe_get_buffer(m_hwFrames, m_frame, 0);
+    if (err < 0) {
+        Error("VideoEncoderQSV: av_hwframe_get_buffer failed: %d\n", err);
+        return;
+    }
+    if (!Upload(pTexture, m_frame)) {
+        av_frame_unref(m_frame);
+        return;
+    }
+
+    m_frame->pict_type = insertIDR ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    m_frame->pts = targetTimestampNs;
+    err = avcodec_send_frame(m_codecContext, m_frame);
+    av_frame_unref(m_frame);
+    if (err < 0) {
+        Error("VideoEncoderQSV: avcodec_send_frame failed: %d\n", err);
+        return;
+    }
+
+    ReceivePackets();
+}
+
+bool VideoEncoderQSV::Upload(ID3D11Texture2D* pTexture, AVFrame* frame) {
+    auto texture = (ID3D11Texture2D*)frame->data[0];
+    auto index = (UINT)(intptr_t)frame->data[1];
+
+    D3D11_TEXTURE2D_DESC desc;
+    pTexture->GetDesc(&desc);
+    // HDR frames are already converted by FrameRender
+    if (desc.Format == DXGI_FORMAT_NV12 || desc.Format == DXGI_FORMAT_P010) {
+        m_d3dRender->GetContext()->CopySubresourceRegion(
+            texture, index, 0, 0, 0, pTexture, 0, NULL
+        );
+        return true;
+    }
+
+    if (!m_scaler) {
+        try {
+            m_scaler = std::make_unique<VideoScaler>(
+                m_d3dRender->GetDevice(),
+                m_d3dRender->GetContext(),
+                desc.Width,
+                desc.Height,
+                m_renderWidth,
+                m_renderHeight
+            );
+        } catch (Exception e) {
+            Error("VideoEncoderQSV: the video processor can't be used: %s\n", e.what());
+            return false;
+        }
+    }
+    return m_scaler->Blit(pTexture, texture, m_renderWidth, m_renderHeight);
+}
+
+void VideoEncoderQSV::ReceivePackets() {
+    while (true) {
+        int err = avcodec_receive_packet(m_codecContext, m_packet);
+        if (err == AVERROR(EAGAIN) || err == AVERROR_EOF) {
+            return;
+        }
+        if (err < 0) {
+            Error("VideoEncoderQSV: avcodec_receive_packet failed: %d\n", err);
+            return;
+        }
+
+        bool isIdr = (m_packet->flags & AV_PKT_FLAG_KEY) != 0;
+        ParseFrameNals(m_codec, m_packet->data, m_packet->size, m_packet->pts, isIdr);
+
+        // QSV doesn't report the QP or the intra share through FFmpeg
+        FfiEncoderStats stats = {};
+        stats.isIdr = isIdr;
+        stats.averageQp = -1.f;
+        stats.intraRatio = -1.f;
+        stats.vbvOverflow = m_codecContext->rc_buffer_size > 0
+            && (int64_t)m_packet->size * 8 > m_codecContext->rc_buffer_size;
+        stats.psnr = -1.f;
+        stats.ssim = -1.f;
+        ReportEncoderStats(stats);
+
+        av_packet_unref(m_packet);
+    }
+}
+
+void VideoEncoderQSV::SetParams(const FfiDynamicEncoderParams& params) {
+    if (!params.updated) {
+        return;
+    }
+    m_codecContext->bit_rate = params.bitrate_bps;
+    m_codecContext->framerate = AVRational { int(params.framerate * 1000), 1000 };
+    m_codecContext->rc_buffer_size = (int)(params.bitrate_bps / params.framerate * 1.1);
+    // A frame can't be larger than the VBV buffer
+    if (params.max_frame_bits > 0) {
+        m_codecContext->rc_buffer_size
+            = std::min<int64_t>(m_codecContext->rc_buffer_size, params.max_frame_bits);
+    }
+    m_codecContext->rc_initial_buffer_occupancy = m_codecContext->rc_buffer_size;
+    // QSV runs CBR when the maximum rate is the target, and VBR when there is none
+    m_codecContext->rc_max_rate
+        = Settings::Instance().m_rateControlMode == ALVR_CBR ? m_codecContext->bit_rate : 0;
+}
+
+#endif // ALVR_GPL
@@ -0,0 +1,56 @@
+#ifdef ALVR_GPL
+
+#pragma once
+
+#include <memory>
+
+#include "ALVR-common/packet_types.h"
+#include "VideoEncoder.h"
+#include "VideoScaler.h"
+#include "shared/d3drender.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/hwcontext.h>
+}
+
+// Video encoder for Intel Quick Sync, through the QSV encoders of FFmpeg. The frames stay on the
+// GPU: they are converted to NV12 or P010 by the video processor into D3D11 textures of FFmpeg's
+// pool, which the encoder imports.
+class VideoEncoderQSV : public VideoEncoder {
+public:
+    VideoEncoderQSV(std::shared_ptr<CD3DRender> d3dRender, int width, int height);
+    ~VideoEncoderQSV();
+
+    void Initialize();
+    void Shutdown();
+
+    void Transmit(
+        ID3D11Texture2D* pTexture,
+        uint64_t presentationTime,
+        uint64_t targetTimestampNs,
+        bool insertIDR
+    );
+
+private:
+    // Fills the encoder frame with pTexture, converted to the encoder format if needed
+    bool Upload(ID3D11Texture2D* pTexture, AVFrame* frame);
+    void ReceivePackets();
+    void SetParams(const FfiDynamicEncoderParams& params);
+
+    std::shared_ptr<CD3DRender> m_d3dRender;
+
+    AVBufferRef* m_hwDevice = nullptr;
+    AVBufferRef* m_hwFrames = nullptr;
+    AVCodecContext* m_codecContext = nullptr;
+    AVFrame* m_frame = nullptr;
+    AVPacket* m_packet = nullptr;
+    // Created for the first RGB frame, the frames composited in YUV are only copied
+    std::unique_ptr<VideoScaler> m_scaler;
+
+    ALVR_CODEC m_codec;
+    int m_renderWidth;
+    int m_renderHeight;
+};
+
+#endif // ALVR_GPL
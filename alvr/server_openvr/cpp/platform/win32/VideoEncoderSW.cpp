@@ -4,13 +4,19 @@
 
 #include "alvr_server/Logger.h"
 #include "alvr_server/Settings.h"
+#include "alvr_server/SvtAv1Config.h"
+#include "alvr_server/TraceCapture.h"
 #include "alvr_server/Utils.h"
+#include "alvr_server/bindings.h"
 
 #include <algorithm>
 #include <array>
+#include <chrono>
 #include <iostream>
 #include <string>
 
+using namespace d3d_render_utils;
+
 VideoEncoderSW::VideoEncoderSW(std::shared_ptr<CD3DRender> d3dRender, int width, int height)
     : m_d3dRender(d3dRender)
     , m_codec(ALVR_CODEC_H264)
@@ -38,52 +44,77 @@ void VideoEncoderSW::Initialize() {
     int err;
     Debug("Initializing VideoEncoderSW.\n");
 
+    const auto& settings = Settings::Instance();
+
+    // HDR frames are already converted to YUV by FrameRender
+    m_gpuColorConversion = settings.m_swGpuColorConversion && !settings.m_enableHdr;
+
     // 尝试使用 ARM64 编码器（仅在 Windows on ARM 上）
     if (TryInitArm64Encoder()) {
         // ARM64 编码器初始化成功，不需要初始化内置 FFmpeg
+        // The shared textures are encoded by the hardware encoder, which takes NV12
+        if (settings.m_swArm64FrameSharing && !settings.m_enableHdr) {
+            m_arm64FrameSharing = true;
+            m_gpuColorConversion = true;
+        }
         return;
     }
 
-    const auto& settings = Settings::Instance();
+    // AV1 is encoded by SVT-AV1 when the CPU has the cores for it, anything else by x264
+    const AVCodec* codec = NULL;
+    if (SvtAv1Config::Enabled()) {
+        codec = avcodec_find_encoder_by_name("libsvtav1");
+        if (codec) {
+            m_codec = ALVR_CODEC_AV1;
+        } else {
+            Warn("libsvtav1 is missing from FFmpeg, using H.264\n");
+        }
+    }
 
     // Query codec
-    AVCodecID codecId = ToFFMPEGCodec(m_codec);
-    if (!codecId)
-        throw MakeException("Invalid requested codec %d", m_codec);
-
-    const AVCodec* codec = avcodec_find_encoder(codecId);
-    if (codec == NULL)
-        throw MakeException("Could not find codec id %d", codecId);
+    if (!codec) {
+        AVCodecID codecId = ToFFMPEGCodec(m_codec);
+        if (!codecId)
+            throw MakeException("Invalid requested codec %d", m_codec);
+
+        codec = avcodec_find_encoder(codecId);
+        if (codec == NULL)
+            throw MakeException("Could not find codec id %d", codecId);
+    }
 
     // Initialize CodecContext
     m_codecContext = avcodec_alloc_context3(codec);
     if (m_codecContext == NULL)
-        throw MakeException("Failed to allocate encoder id %d", codecId);
+        throw MakeException("Failed to allocate encoder %s", codec->name);
 
     // Set codec settings
     AVDictionary* opt = NULL;
-    av_dict_set(&opt, "preset", "ultrafast", 0);
-    av_dict_set(&opt, "tune", "zerolatency", 0);
+    if (m_codec == ALVR_CODEC_AV1) {
+        opt = SvtAv1Options();
+    } else {
+        av_dict_set(&opt, "preset", "ultrafast", 0);
+        av_dict_set(&opt, "tune", "zerolatency", 0);
 
-    switch (settings.m_h264Profile) {
-    case ALVR_H264_PROFILE_BASELINE:
-        m_codecContext->profile = FF_PROFILE_H264_BASELINE;
-        break;
-    case ALVR_H264_PROFILE_MAIN:
-        m_codecContext->profile = FF_PROFILE_H264_MAIN;
-        break;
-    default:
-    case ALVR_H264_PROFILE_HIGH:
-        m_codecContext->profile = FF_PROFILE_H264_HIGH;
-        break;
-    }
-    switch (settings.m_entropyCoding) {
-    case ALVR_CABAC:
-        av_dict_set(&opt, "coder", "ac", 0);
-        break;
-    case ALVR_CAVLC:
-        av_dict_set(&opt, "coder", "vlc", 0);
-        break;
+        switch (settings.m_h264Profile) {
+        case ALVR_H264_PROFILE_BASELINE:
+            m_codecContext->profile = FF_PROFILE_H264_BASELINE;
+            break;
+        case ALVR_H264_PROFILE_MAIN:
+            m_codecContext->profile = FF_PROFILE_H264_MAIN;
+            break;
+        default:
+        case ALVR_H264_PROFILE_HIGH:
+            m_codecContext->profile = FF_PROFILE_H264_HIGH;
+            break;
+        }
+        switch (settings.m_entropyCoding) {
+        case ALVR_CABAC:
+            av_dict_set(&opt, "coder", "ac", 0);
+            break;
+        case ALVR_CAVLC:
+            av_dict_set(&opt, "coder", "vlc", 0);
+            break;
+        }
     }
 
     m_codecContext->width = m_renderWidth;
@@ -93,6 +124,16 @@ void VideoEncoderSW::Initialize() {
     m_codecContext->sample_aspect_ratio = AVRational { 1, 1 };
     m_codecContext->pix_fmt
         = settings.m_use10bitEncoder ? AV_PIX_FMT_YUV420P10 : AV_PIX_FMT_YUV420P;
+    // If the encoder takes NV12, the converted frames can be passed without going through the
+    // scaler
+    if (m_gpuColorConversion && !settings.m_use10bitEncoder) {
+        for (const AVPixelFormat* fmt = codec->pix_fmts; fmt && *fmt != AV_PIX_FMT_NONE; fmt++) {
+            if (*fmt == AV_PIX_FMT_NV12) {
+                m_codecContext->pix_fmt = AV_PIX_FMT_NV12;
+                break;
+            }
+        }
+    }
     m_codecContext->color_range = AVCOL_RANGE_JPEG;
     if (settings.m_enableHdr) {
         m_codecContext->color_primaries = AVCOL_PRI_BT2020;
@@ -105,23 +146,48 @@ void VideoEncoderSW::Initialize() {
     }
     m_codecContext->max_b_frames = 0;
     m_codecContext->gop_size = 0;
+    if (settings.m_gradualIntraRefresh) {
+        if (std::string(codec->name) == "libx264") {
+            // x264 spreads the refresh over one GOP and doesn't insert IDRs by itself anymore
+            av_dict_set(&opt, "intra-refresh", "1", 0);
+            m_codecContext->gop_size = settings.m_gradualIntraRefreshPeriod;
+        } else {
+            Warn("Intra refresh is not supported by %s\n", codec->name);
+        }
+    }
     m_codecContext->bit_rate = m_bitrateInMBits * 1'000'000L;
     m_codecContext->rc_buffer_size = m_codecContext->bit_rate / settings.m_refreshRate * 1.1;
-    switch (settings.m_rateControlMode) {
-    case ALVR_CBR:
-        if (settings.m_fillerData) {
-            av_dict_set(&opt, "nal-hrd", "cbr", 0);
+    // SVT-AV1 picks its CBR rate control from the maximum rate being the bitrate
+    if (m_codec != ALVR_CODEC_AV1) {
+        switch (settings.m_rateControlMode) {
+        case ALVR_CBR:
+            if (settings.m_fillerData) {
+                av_dict_set(&opt, "nal-hrd", "cbr", 0);
+            }
+            break;
+        case ALVR_VBR:
+            av_dict_set(&opt, "nal-hrd", "vbr", 0);
+            break;
         }
-        break;
-    case ALVR_VBR:
-        av_dict_set(&opt, "nal-hrd", "vbr", 0);
-        break;
     }
     m_codecContext->rc_max_rate = m_codecContext->bit_rate;
     m_codecContext->thread_count = settings.m_swThreadCount;
+    // One slice per tile of the client decoder
+    m_codecContext->slices = settings.m_encoderTileColumns * settings.m_encoderTileRows;
+    if (settings.m_encoderSliceSizeBytes > 0) {
+        if (std::string(codec->name) == "libx264") {
+            // Each slice fits in a packet
+            std::string params
+                = "slice-max-size=" + std::to_string(settings.m_encoderSliceSizeBytes);
+            av_dict_set(&opt, "x264-params", params.c_str(), 0);
+        } else {
+            Warn("Packet-sized slices are not supported by %s\n", codec->name);
+        }
+    }
 
     if ((err = avcodec_open2(m_codecContext, codec, &opt)))
         throw MakeException("Cannot open video encoder codec: %d", err);
+    m_openBitrate = m_codecContext->bit_rate;
 
     // Config transfer/encode frames
     m_transferredFrame = av_frame_alloc();
@@ -139,7 +205,21 @@ void VideoEncoderSW::Initialize() {
 void VideoEncoderSW::Shutdown() {
     Debug("Shutting down VideoEncoderSW.\n");
 
+    // Encode the frames that are already copied before the encoders are freed
+    if (m_encodeThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_encodeMutex);
+            m_encodeExiting = true;
+        }
+        m_encodeCv.notify_all();
+        m_encodeThread.join();
+    }
+
     // 清理 ARM64 编码器
+    if (m_arm64PacketThread.joinable()) {
+        m_arm64PacketExiting = true;
+        m_arm64PacketThread.join();
+    }
     if (m_arm64Encoder) {
         m_arm64Encoder->Shutdown();
         m_arm64Encoder.reset();
@@ -157,6 +237,13 @@ void VideoEncoderSW::Shutdown() {
         sws_freeContext(m_scalerContext);
         m_scalerContext = nullptr;
     }
+    m_rgbaToYuv.reset();
+    m_yuvPipelines.clear();
+    m_yuvTexture.Reset();
+    for (auto& texture : m_sharedTextures) {
+        texture.Reset();
+    }
+    m_sharedFence.Reset();
 
     Debug("Successfully shutdown VideoEncoderSW.\n");
 }
@@ -164,34 +251,102 @@ void VideoEncoderSW::Shutdown() {
 void VideoEncoderSW::Transmit(
     ID3D11Texture2D* pTexture, uint64_t presentationTime, uint64_t targetTimestampNs, bool insertIDR
 ) {
-    // 如果使用 ARM64 编码器，需要先准备 staging texture 然后发送
-    if (m_useArm64Encoder) {
-        // Setup staging texture if not defined yet
-        if (!m_stagingTex) {
-            HRESULT hr = SetupStagingTexture(pTexture);
-            if (FAILED(hr)) {
-                Error("Failed to create staging texture: %p %ls", hr, GetErrorStr(hr).c_str());
-                return;
-            }
+    TraceScope scope("VideoEncoderSW::Transmit", targetTimestampNs);
+    pTexture = ConvertToYuv(pTexture);
+    if (!pTexture) {
+        return;
+    }
+
+    if (m_arm64FrameSharing) {
+        if (m_sharedFence || SetupSharedTextures(pTexture)) {
+            TransmitSharedTexture(pTexture, targetTimestampNs, insertIDR);
+            return;
         }
+        Warn("ARM64 encoder can't use shared textures, reading the frames back");
+        m_arm64FrameSharing = false;
+    }
 
-        // Copy texture to CPU accessible memory
-        HRESULT hr = CopyTexture(pTexture);
+    // Setup staging textures if not defined yet; we can only define them here as we now have the
+    // texture's size
+    if (!m_stagingRing[0].texture) {
+        HRESULT hr = SetupStagingTexture(pTexture);
         if (FAILED(hr)) {
-            Error("Failed to copy texture: %p %ls", hr, GetErrorStr(hr).c_str());
+            Error("Failed to create staging texture: %p %ls", hr, GetErrorStr(hr).c_str());
             return;
         }
+        Debug("Success in creating staging textures");
+
+        m_encodeThread = std::thread(&VideoEncoderSW::EncodeLoop, this);
+    }
+
+    // The pending slots follow each other in the ring, so the next one is free once fewer than
+    // all of them are pending
+    {
+        std::unique_lock<std::mutex> lock(m_encodeMutex);
+        m_encodeCv.wait(lock, [this] { return m_pendingSlots.size() < STAGING_RING_SIZE; });
+    }
+
+    /// SteamVR crashes if the swapchain textures are set to staging, which is needed to be read by
+    /// the CPU. Unless there's another solution we have to copy the texture every time, which is
+    /// gonna be another performance hit.
+    StagingSlot& slot = m_stagingRing[m_nextSlot];
+    CopyTexture(pTexture, slot.texture.Get());
+    slot.targetTimestampNs = targetTimestampNs;
+    slot.insertIDR = insertIDR;
+    // Submit the copy now, the encode thread only polls for its completion
+    m_d3dRender->GetContext()->Flush();
+
+    {
+        std::lock_guard<std::mutex> lock(m_encodeMutex);
+        m_pendingSlots.push_back(m_nextSlot);
+    }
+    m_encodeCv.notify_all();
+    m_nextSlot = (m_nextSlot + 1) % STAGING_RING_SIZE;
+}
+
+void VideoEncoderSW::EncodeLoop() {
+    Debug("VideoEncoderSW: Start encode thread. Id=%d\n", GetCurrentThreadId());
+
+    while (true) {
+        size_t slotIndex;
+        {
+            std::unique_lock<std::mutex> lock(m_encodeMutex);
+            m_encodeCv.wait(lock, [this] { return m_encodeExiting || !m_pendingSlots.empty(); });
+            if (m_pendingSlots.empty()) {
+                return;
+            }
+            slotIndex = m_pendingSlots.front();
+        }
+
+        // The slot stays pending while it's mapped, so that Transmit doesn't copy into it
+        StagingSlot& slot = m_stagingRing[slotIndex];
+        HRESULT hr = MapStagingTexture(slot.texture.Get());
+        if (SUCCEEDED(hr)) {
+            EncodeStagedFrame(slot.targetTimestampNs, slot.insertIDR);
+            m_d3dRender->GetContext()->Unmap(slot.texture.Get(), 0);
+        } else {
+            Error("Failed to map staging texture: %p %ls", hr, GetErrorStr(hr).c_str());
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_encodeMutex);
+            m_pendingSlots.pop_front();
+        }
+        m_encodeCv.notify_all();
+    }
+}
 
-        // 通过 ARM64 编码器处理
+void VideoEncoderSW::EncodeStagedFrame(uint64_t targetTimestampNs, bool insertIDR) {
+    // 如果使用 ARM64 编码器，直接发送 staging texture 的数据
+    if (m_useArm64Encoder) {
         uint32_t dataSize = m_stagingTexMap.RowPitch * m_stagingTexDesc.Height;
-        if (Settings::Instance().m_enableHdr) {
+        if (m_stagingTexDesc.Format == DXGI_FORMAT_NV12
+            || m_stagingTexDesc.Format == DXGI_FORMAT_P010) {
             // NV12/P010 有额外的 UV plane
             dataSize += m_stagingTexMap.RowPitch * (m_stagingTexDesc.Height / 2);
         }
 
         TransmitViaArm64((uint8_t*)m_stagingTexMap.pData, dataSize, targetTimestampNs, insertIDR);
-
-        m_d3dRender->GetContext()->Unmap(m_stagingTex.Get(), 0);
         return;
     }
 
@@ -202,42 +357,46 @@ void VideoEncoderSW::Transmit(
         m_codecContext->bit_rate = params.bitrate_bps;
         m_codecContext->framerate = AVRational { (int)params.framerate, 1 };
         m_codecContext->rc_buffer_size = m_codecContext->bit_rate / params.framerate * 1.1;
+        // A frame can't be larger than the VBV buffer
+        if (params.max_frame_bits > 0) {
+            m_codecContext->rc_buffer_size
+                = std::min<int64_t>(m_codecContext->rc_buffer_size, params.max_frame_bits);
+        }
         m_codecContext->rc_max_rate = m_codecContext->bit_rate;
-    }
 
-    // Setup staging texture if not defined yet; we can only define it here as we now have the
-    // texture's size
-    if (!m_stagingTex) {
-        HRESULT hr = SetupStagingTexture(pTexture);
-        if (FAILED(hr)) {
-            Error("Failed to create staging texture: %p %ls", hr, GetErrorStr(hr).c_str());
-            return;
+        if (m_codec == ALVR_CODEC_AV1
+            && SvtAv1Config::NeedsReopen(m_openBitrate, m_codecContext->bit_rate)) {
+            ReopenSvtAv1();
+            insertIDR = true;
         }
-        Debug("Success in creating staging texture");
     }
 
-    // Copy texture and map it to memory
-    /// SteamVR crashes if the swapchain textures are set to staging, which is needed to be read by
-    /// the CPU. Unless there's another solution we have to copy the texture every time, which is
-    /// gonna be another performance hit.
-    HRESULT hr = CopyTexture(pTexture);
-    if (FAILED(hr)) {
-        Error("Failed to copy texture to staging: %p %ls", hr, GetErrorStr(hr).c_str());
-        return;
-    }
-    // Debug("Success in mapping staging texture");
-
     // 确定输入纹理的像素格式
-    // HDR 模式使用 NV12/P010 (semi-planar)，非 HDR 使用 RGBA
+    // HDR 模式和 GPU 颜色转换使用 NV12/P010 (semi-planar)，否则使用 RGBA
     AVPixelFormat inputFormat = AV_PIX_FMT_RGBA;
-    if (Settings::Instance().m_enableHdr) {
-        // NV12/P010 是 semi-planar 格式 (Y plane + interleaved UV plane)
-        inputFormat = Settings::Instance().m_use10bitEncoder ? AV_PIX_FMT_P010 : AV_PIX_FMT_NV12;
+    if (m_stagingTexDesc.Format == DXGI_FORMAT_NV12) {
+        inputFormat = AV_PIX_FMT_NV12;
+    } else if (m_stagingTexDesc.Format == DXGI_FORMAT_P010) {
+        inputFormat = AV_PIX_FMT_P010;
+    }
+
+    // The scaler is only needed if the frame isn't already in the encoder's size and format
+    bool passthrough = inputFormat == m_codecContext->pix_fmt
+        && (int)m_stagingTexDesc.Width == m_codecContext->width
+        && (int)m_stagingTexDesc.Height == m_codecContext->height;
+
+    // Without scaling, the SIMD converter of the frame bands is faster than swscale
+    bool convertOnly = inputFormat == AV_PIX_FMT_RGBA
+        && m_codecContext->pix_fmt == AV_PIX_FMT_YUV420P
+        && (int)m_stagingTexDesc.Width == m_codecContext->width
+        && (int)m_stagingTexDesc.Height == m_codecContext->height;
+    if (convertOnly && !m_rgbaToYuv) {
+        m_rgbaToYuv = std::make_unique<RgbaToYuv420>();
     }
 
     // Setup software scaler if not defined yet; we can only define it here as we now have the
     // texture's size
-    if (!m_scalerContext) {
+    if (!passthrough && !convertOnly && !m_scalerContext) {
         m_scalerContext = sws_getContext(
             m_stagingTexDesc.Width,
             m_stagingTexDesc.Height,
@@ -252,7 +411,6 @@ void VideoEncoderSW::Transmit(
         );
         if (!m_scalerContext) {
             Error("Couldn't initialize SWScaler.");
-            m_d3dRender->GetContext()->Unmap(m_stagingTex.Get(), 0);
             return;
         }
         Debug("Successfully initialized SWScaler.");
@@ -264,7 +422,7 @@ void VideoEncoderSW::Transmit(
     m_transferredFrame->format = inputFormat;
     m_transferredFrame->pts = targetTimestampNs;
 
-    if (Settings::Instance().m_enableHdr) {
+    if (inputFormat != AV_PIX_FMT_RGBA) {
         // NV12/P010 有 2 个平面: Y plane 和 interleaved UV plane
         m_transferredFrame->data[0] = (uint8_t*)m_stagingTexMap.pData;
         m_transferredFrame->data[1]
@@ -277,39 +435,68 @@ void VideoEncoderSW::Transmit(
         m_transferredFrame->linesize[0] = m_stagingTexMap.RowPitch;
     }
 
-    // Use SWScaler for scaling
-    if (sws_scale(
-            m_scalerContext,
-            m_transferredFrame->data,
-            m_transferredFrame->linesize,
-            0,
-            m_transferredFrame->height,
+    // Use SWScaler for scaling. In passthrough the mapped texture is encoded directly, the encoder
+    // copies it before avcodec_send_frame returns
+    AVFrame* frame = m_transferredFrame;
+    if (convertOnly) {
+        m_rgbaToYuv->Convert(
+            m_transferredFrame->data[0],
+            m_transferredFrame->linesize[0],
+            m_stagingTexDesc.Width,
+            m_stagingTexDesc.Height,
             m_encoderFrame->data,
             m_encoderFrame->linesize
-        )
-        == 0) {
-        Error("SWScale failed.");
-        m_d3dRender->GetContext()->Unmap(m_stagingTex.Get(), 0);
-        return;
+        );
+        frame = m_encoderFrame;
+    } else if (!passthrough) {
+        if (sws_scale(
+                m_scalerContext,
+                m_transferredFrame->data,
+                m_transferredFrame->linesize,
+                0,
+                m_transferredFrame->height,
+                m_encoderFrame->data,
+                m_encoderFrame->linesize
+            )
+            == 0) {
+            Error("SWScale failed.");
+            return;
+        }
+        // Debug("SWScale succeeded.");
+        frame = m_encoderFrame;
     }
-    // Debug("SWScale succeeded.");
 
     // Send frame for encoding
-    m_encoderFrame->pict_type = insertIDR ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
-    m_encoderFrame->pts = targetTimestampNs;
+    frame->pict_type = insertIDR ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    frame->pts = targetTimestampNs;
 
     int err;
-    if ((err = avcodec_send_frame(m_codecContext, m_encoderFrame)) < 0) {
+    if ((err = avcodec_send_frame(m_codecContext, frame)) < 0) {
         Error("Encoding frame failed: err code %d", err);
-        m_d3dRender->GetContext()->Unmap(m_stagingTex.Get(), 0);
         return;
     }
     // Debug("Send frame succeeded.");
 
+    SendPackets(targetTimestampNs);
+}
+
+void VideoEncoderSW::SendPackets(uint64_t targetTimestampNs) {
+    // libsvtav1 only polls the output of SVT-AV1, its frame is waited for so that it isn't sent
+    // with the next one. Unless it takes more than two frame intervals
+    bool waitFrame = m_codec == ALVR_CODEC_AV1 && targetTimestampNs != 0;
+    auto deadline = std::chrono::steady_clock::now()
+        + std::chrono::duration<double>(2.0 / av_q2d(m_codecContext->framerate));
+
     // Retrieve frames from encoding and send them until buffer is emptied
+    int err;
     while (true) {
         AVPacket* packet = av_packet_alloc();
         err = avcodec_receive_packet(m_codecContext, packet);
+        if (err == AVERROR(EAGAIN) && waitFrame && std::chrono::steady_clock::now() < deadline) {
+            av_packet_free(&packet);
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            continue;
+        }
         if (err != 0) {
             av_packet_free(&packet);
             break;
@@ -318,14 +505,62 @@ void VideoEncoderSW::Transmit(
         bool isIdr = (packet->flags & AV_PKT_FLAG_KEY) != 0;
         ParseFrameNals(m_codec, packet->data, packet->size, packet->pts, isIdr);
         // Debug("Sent encoded packet to client");
+        waitFrame = waitFrame && (uint64_t)packet->pts != targetTimestampNs;
         av_packet_free(&packet);
     }
     if (err == AVERROR(EINVAL)) {
         Error("Received encoded frame failed: err code %d", err);
     }
+}
 
-    // Unmap the copied texture and delete it
-    m_d3dRender->GetContext()->Unmap(m_stagingTex.Get(), 0);
+AVDictionary* VideoEncoderSW::SvtAv1Options() {
+    AVDictionary* opt = NULL;
+    int preset = SvtAv1Config::Preset(m_renderWidth, m_renderHeight, m_refreshRate);
+    std::string params = SvtAv1Config::Params(m_renderWidth, m_renderHeight);
+    av_dict_set_int(&opt, "preset", preset, 0);
+    av_dict_set(&opt, "svtav1-params", params.c_str(), 0);
+    Info("SVT-AV1: preset %d, %s\n", preset, params.c_str());
+    return opt;
+}
+
+void VideoEncoderSW::ReopenSvtAv1() {
+    // Not retried before the bitrate changes that much again
+    m_openBitrate = m_codecContext->bit_rate;
+
+    AVCodecContext* context = avcodec_alloc_context3(m_codecContext->codec);
+    if (context == NULL) {
+        Error("Failed to allocate encoder %s", m_codecContext->codec->name);
+        return;
+    }
+    context->width = m_codecContext->width;
+    context->height = m_codecContext->height;
+    context->time_base = m_codecContext->time_base;
+    context->framerate = m_codecContext->framerate;
+    context->sample_aspect_ratio = m_codecContext->sample_aspect_ratio;
+    context->pix_fmt = m_codecContext->pix_fmt;
+    context->color_range = m_codecContext->color_range;
+    context->color_primaries = m_codecContext->color_primaries;
+    context->color_trc = m_codecContext->color_trc;
+    context->colorspace = m_codecContext->colorspace;
+    context->max_b_frames = 0;
+    context->bit_rate = m_codecContext->bit_rate;
+    context->rc_buffer_size = m_codecContext->rc_buffer_size;
+    context->rc_max_rate = m_codecContext->rc_max_rate;
+
+    AVDictionary* opt = SvtAv1Options();
+    int err = avcodec_open2(context, m_codecContext->codec, &opt);
+    av_dict_free(&opt);
+    if (err) {
+        Error("Cannot reopen video encoder codec, keeping its bitrate: %d", err);
+        avcodec_free_context(&context);
+        return;
+    }
+
+    // The frames still in the previous encoder are sent before it's replaced
+    avcodec_send_frame(m_codecContext, NULL);
+    SendPackets(0);
+    avcodec_free_context(&m_codecContext);
+    m_codecContext = context;
 }
 
 HRESULT VideoEncoderSW::SetupStagingTexture(ID3D11Texture2D* pTexture) {
@@ -342,14 +577,141 @@ HRESULT VideoEncoderSW::SetupStagingTexture(ID3D11Texture2D* pTexture) {
     m_stagingTexDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
     m_stagingTexDesc.MiscFlags = 0;
 
-    return m_d3dRender->GetDevice()->CreateTexture2D(&m_stagingTexDesc, nullptr, &m_stagingTex);
+    for (StagingSlot& slot : m_stagingRing) {
+        HRESULT hr
+            = m_d3dRender->GetDevice()->CreateTexture2D(&m_stagingTexDesc, nullptr, &slot.texture);
+        if (FAILED(hr)) {
+            for (StagingSlot& created : m_stagingRing) {
+                created.texture.Reset();
+            }
+            return hr;
+        }
+    }
+    return S_OK;
 }
 
-HRESULT VideoEncoderSW::CopyTexture(ID3D11Texture2D* pTexture) {
-    m_d3dRender->GetContext()->CopyResource(m_stagingTex.Get(), pTexture);
-    return m_d3dRender->GetContext()->Map(
-        m_stagingTex.Get(), 0, D3D11_MAP_READ, 0, &m_stagingTexMap
-    );
+void VideoEncoderSW::CopyTexture(ID3D11Texture2D* pTexture, ID3D11Texture2D* stagingTexture) {
+    m_d3dRender->GetContext()->CopyResource(stagingTexture, pTexture);
+}
+
+HRESULT VideoEncoderSW::MapStagingTexture(ID3D11Texture2D* stagingTexture) {
+    // Polled, as a blocking Map would hold the immediate context until the copy is done
+    while (true) {
+        HRESULT hr = m_d3dRender->GetContext()->Map(
+            stagingTexture, 0, D3D11_MAP_READ, D3D11_MAP_FLAG_DO_NOT_WAIT, &m_stagingTexMap
+        );
+        if (hr != DXGI_ERROR_WAS_STILL_DRAWING) {
+            return hr;
+        }
+        std::this_thread::yield();
+    }
+}
+
+ID3D11Texture2D* VideoEncoderSW::ConvertToYuv(ID3D11Texture2D* pTexture) {
+    if (!m_gpuColorConversion) {
+        return pTexture;
+    }
+
+    // Runs on the encoder thread while the present thread composites on the same context
+    ContextLock lock(m_d3dRender->GetContext());
+    ID3D11Device* device = m_d3dRender->GetDevice();
+    try {
+        if (!m_yuvTexture) {
+            struct YUVParams {
+                float offset[4];
+                float yCoeff[4];
+                float uCoeff[4];
+                float vCoeff[4];
+
+                float renderWidth;
+                float renderHeight;
+                float _padding0;
+                float _padding1;
+            };
+
+            D3D11_TEXTURE2D_DESC desc;
+            pTexture->GetDesc(&desc);
+
+            // BT.709 full range, as configured on the codec context
+            YUVParams paramStruct_bt709_8bit_full
+                = { { 0.0000000f, 0.5019608f, 0.5019608f, 0.0f }, // offset
+                    { 0.2126000f, 0.7152000f, 0.0722000f, 0.0f }, // yCoeff
+                    { -0.1141228f, -0.3839164f, 0.4980392f, 0.0f }, // uCoeff
+                    { 0.4980392f, -0.4523719f, -0.0456673f, 0.0f }, // vCoeff
+                    (float)desc.Width,
+                    (float)desc.Height,
+                    0.0,
+                    0.0 };
+
+            YUVParams paramStruct_bt709_10bit_full
+                = { { 0.0000000f, 0.5004888f, 0.5004888f, 0.0f }, // offset
+                    { 0.2126000f, 0.7152000f, 0.0722000f, 0.0f }, // yCoeff
+                    { -0.1144601f, -0.3850511f, 0.4995112f, 0.0f }, // uCoeff
+                    { 0.4995112f, -0.4537090f, -0.0458023f, 0.0f }, // vCoeff
+                    (float)desc.Width,
+                    (float)desc.Height,
+                    0.0,
+                    0.0 };
+
+            bool use10bit = Settings::Instance().m_use10bitEncoder;
+            m_yuvBuffer = CreateBuffer(
+                device, use10bit ? paramStruct_bt709_10bit_full : paramStruct_bt709_8bit_full
+            );
+
+            std::vector<uint8_t> quadShaderCSO(
+                QUAD_SHADER_CSO_PTR, QUAD_SHADER_CSO_PTR + QUAD_SHADER_CSO_LEN
+            );
+            m_quadVertexShader = CreateVertexShader(device, quadShaderCSO);
+
+            m_yuvTexture = CreateTexture(
+                device, desc.Width, desc.Height, use10bit ? DXGI_FORMAT_P010 : DXGI_FORMAT_NV12
+            );
+        }
+
+        auto pipeline = std::find_if(
+            m_yuvPipelines.begin(),
+            m_yuvPipelines.end(),
+            [&](const auto& entry) { return entry.first == pTexture; }
+        );
+        if (pipeline == m_yuvPipelines.end()) {
+            std::vector<uint8_t> yuv420ShaderCSO(
+                RGBTOYUV420_CSO_PTR, RGBTOYUV420_CSO_PTR + RGBTOYUV420_CSO_LEN
+            );
+
+            auto yuvPipeline = std::make_unique<RenderPipelineYUV>(device);
+            yuvPipeline->Initialize(
+                { pTexture },
+                m_quadVertexShader.Get(),
+                yuv420ShaderCSO,
+                m_yuvTexture.Get(),
+                m_yuvBuffer.Get()
+            );
+            m_yuvPipelines.emplace_back(pTexture, std::move(yuvPipeline));
+            pipeline = std::prev(m_yuvPipelines.end());
+        }
+
+        pipeline->second->Render();
+    } catch (Exception e) {
+        // Once the staging textures are set up the frames can't change format anymore
+        if (m_stagingRing[0].texture) {
+            Error("GPU color conversion failed: %s", e.what());
+            return nullptr;
+        }
+        Warn("GPU color conversion not available, converting on the CPU: %s", e.what());
+        m_gpuColorConversion = false;
+        m_yuvPipelines.clear();
+        m_yuvTexture.Reset();
+        return pTexture;
+    }
+
+    // Unbind so that the next frame can be copied to the input texture and the staging copy
+    // doesn't read a bound render target
+    ID3D11DeviceContext* context = m_d3dRender->GetContext();
+    ID3D11ShaderResourceView* nullView = nullptr;
+    context->OMSetRenderTargets(0, nullptr, nullptr);
+    context->PSSetShaderResources(0, 1, &nullView);
+
+    return m_yuvTexture.Get();
 }
 
 AVCodecID VideoEncoderSW::ToFFMPEGCodec(ALVR_CODEC codec) {
@@ -396,6 +758,8 @@ bool VideoEncoderSW::TryInitArm64Encoder() {
     m_arm64Encoder = std::make_unique<Arm64EncoderIpc::EncoderIpcClient>();
     if (m_arm64Encoder->Initialize(m_renderWidth, m_renderHeight, codecStr)) {
         m_useArm64Encoder = true;
+        m_arm64PacketExiting = false;
+        m_arm64PacketThread = std::thread(&VideoEncoderSW::Arm64PacketLoop, this);
         Info(
             "ARM64 encoder initialized successfully, using out-of-process encoding (%s)\n",
             codecStr.c_str()
@@ -416,12 +780,14 @@ bool VideoEncoderSW::TransmitViaArm64(
         return false;
     }
 
+    UpdateArm64EncoderParams();
+
     // 确定像素格式
-    const auto& settings = Settings::Instance();
     Arm64EncoderIpc::PixelFormat format = Arm64EncoderIpc::PixelFormat::RGBA;
-    if (settings.m_enableHdr) {
-        format = settings.m_use10bitEncoder ? Arm64EncoderIpc::PixelFormat::P010
-                                            : Arm64EncoderIpc::PixelFormat::NV12;
+    if (m_stagingTexDesc.Format == DXGI_FORMAT_NV12) {
+        format = Arm64EncoderIpc::PixelFormat::NV12;
+    } else if (m_stagingTexDesc.Format == DXGI_FORMAT_P010) {
+        format = Arm64EncoderIpc::PixelFormat::P010;
     }
 
     // 发送帧给 ARM64 编码器
@@ -439,18 +805,181 @@ bool VideoEncoderSW::TransmitViaArm64(
         return false;
     }
 
-    // 接收编码后的数据包
-    std::vector<uint8_t> packet;
-    uint64_t pts;
-    bool isIdr;
+    return true;
+}
 
-    if (m_arm64Encoder->ReceivePacket(packet, pts, isIdr)) {
-        // 发送到客户端
-        ParseFrameNals(m_codec, packet.data(), packet.size(), pts, isIdr);
-        return true;
+bool VideoEncoderSW::SetupSharedTextures(ID3D11Texture2D* pTexture) {
+    D3D11_TEXTURE2D_DESC desc;
+    pTexture->GetDesc(&desc);
+    if (desc.Format != DXGI_FORMAT_NV12) {
+        return false;
     }
 
-    return false;
+    ComPtr<ID3D11Device5> device5;
+    HRESULT hr = m_d3dRender->GetDevice()->QueryInterface(IID_PPV_ARGS(&device5));
+    if (SUCCEEDED(hr)) {
+        hr = m_d3dRender->GetContext()->QueryInterface(IID_PPV_ARGS(&m_context4));
+    }
+
+    // NT handles, so that the encoder process can open them on its own device
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+    desc.CPUAccessFlags = 0;
+    desc.MiscFlags = D3D11_RESOURCE_MISC_SHARED | D3D11_RESOURCE_MISC_SHARED_NTHANDLE;
+
+    HANDLE textureHandles[Arm64EncoderIpc::FRAME_SLOT_COUNT] = {};
+    HANDLE fenceHandle = nullptr;
+    for (uint64_t i = 0; i < Arm64EncoderIpc::FRAME_SLOT_COUNT && SUCCEEDED(hr); i++) {
+        hr = device5->CreateTexture2D(&desc, nullptr, &m_sharedTextures[i]);
+        ComPtr<IDXGIResource1> resource;
+        if (SUCCEEDED(hr)) {
+            hr = m_sharedTextures[i].As(&resource);
+        }
+        if (SUCCEEDED(hr)) {
+            hr = resource->CreateSharedHandle(
+                nullptr,
+                DXGI_SHARED_RESOURCE_READ | DXGI_SHARED_RESOURCE_WRITE,
+                nullptr,
+                &textureHandles[i]
+            );
+        }
+    }
+    if (SUCCEEDED(hr)) {
+        hr = device5->CreateFence(0, D3D11_FENCE_FLAG_SHARED, IID_PPV_ARGS(&m_sharedFence));
+    }
+    if (SUCCEEDED(hr)) {
+        hr = m_sharedFence->CreateSharedHandle(nullptr, GENERIC_ALL, nullptr, &fenceHandle);
+    }
+
+    DXGI_ADAPTER_DESC adapterDesc = {};
+    ComPtr<IDXGIDevice> dxgiDevice;
+    ComPtr<IDXGIAdapter> adapter;
+    if (SUCCEEDED(hr)) {
+        hr = device5.As(&dxgiDevice);
+    }
+    if (SUCCEEDED(hr)) {
+        hr = dxgiDevice->GetAdapter(&adapter);
+    }
+    if (SUCCEEDED(hr)) {
+        hr = adapter->GetDesc(&adapterDesc);
+    }
+
+    bool accepted = false;
+    if (SUCCEEDED(hr)) {
+        accepted = m_arm64Encoder->SetupSharedTextures(
+            textureHandles, fenceHandle, adapterDesc.AdapterLuid
+        );
+    } else {
+        Error("Failed to create shared textures: %p %ls", hr, GetErrorStr(hr).c_str());
+    }
+
+    // The encoder process has its own handles by now
+    for (HANDLE handle : textureHandles) {
+        if (handle) {
+            CloseHandle(handle);
+        }
+    }
+    if (fenceHandle) {
+        CloseHandle(fenceHandle);
+    }
+
+    if (!accepted) {
+        for (auto& texture : m_sharedTextures) {
+            texture.Reset();
+        }
+        m_sharedFence.Reset();
+        m_context4.Reset();
+        return false;
+    }
+
+    Info("ARM64 encoder reads the frames from shared textures");
+    return true;
+}
+
+void VideoEncoderSW::TransmitSharedTexture(
+    ID3D11Texture2D* pTexture, uint64_t targetTimestampNs, bool insertIDR
+) {
+    UpdateArm64EncoderParams();
+
+    int slot = m_arm64Encoder->AcquireFrameSlot();
+    if (slot < 0) {
+        return;
+    }
+
+    // The encoder process waits for the fence before it reads the texture
+    m_d3dRender->GetContext()->CopyResource(m_sharedTextures[slot].Get(), pTexture);
+    m_sharedFenceValue++;
+    m_context4->Signal(m_sharedFence.Get(), m_sharedFenceValue);
+    m_d3dRender->GetContext()->Flush();
+
+    D3D11_TEXTURE2D_DESC desc;
+    pTexture->GetDesc(&desc);
+    if (!m_arm64Encoder->SendSharedFrame(
+            desc.Width, desc.Height, m_sharedFenceValue, targetTimestampNs, insertIDR
+        )) {
+        Error("Failed to send shared frame to ARM64 encoder\n");
+    }
+}
+
+void VideoEncoderSW::UpdateArm64EncoderParams() {
+    auto params = GetDynamicEncoderParams();
+    if (params.updated) {
+        m_bitrateInMBits = params.bitrate_bps / 1'000'000;
+        m_arm64Encoder->SetEncoderParams(params.bitrate_bps, (uint32_t)params.framerate);
+    }
+}
+
+void VideoEncoderSW::Arm64PacketLoop() {
+    Debug("VideoEncoderSW: Start ARM64 packet thread. Id=%d\n", GetCurrentThreadId());
+    Info(
+        "%s\n",
+        ApplyThreadRole(ThreadRole::EncoderOutput, Settings::Instance().m_encoderOutputThread)
+            .c_str()
+    );
+
+    // 编码器统计, logged once per second
+    auto statsStart = std::chrono::steady_clock::now();
+    uint64_t encodeTimeSumUs = 0;
+    uint32_t packetCount = 0;
+    uint32_t qpSum = 0;
+    uint32_t qpCount = 0;
+
+    while (!m_arm64PacketExiting) {
+        // 接收编码后的数据包
+        uint8_t* packet;
+        Arm64EncoderIpc::PacketHeader header;
+        if (!m_arm64Encoder->ReceivePacket(packet, header, 100)) {
+            continue;
+        }
+
+        // 发送到客户端. ParseFrameNals copies the packet, so the slot can be released after it
+        ParseFrameNals(m_codec, packet, header.size, header.timestamp_ns, header.is_idr != 0);
+        m_arm64Encoder->ReleasePacket();
+
+        encodeTimeSumUs += header.encode_time_us;
+        packetCount++;
+        if (header.qp != Arm64EncoderIpc::UNKNOWN_QP) {
+            qpSum += header.qp;
+            qpCount++;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - statsStart >= std::chrono::seconds(1)) {
+            Debug(
+                "ARM64 encoder: %u packets, encode time %.2f ms, QP %.1f\n",
+                packetCount,
+                encodeTimeSumUs / 1000.0 / packetCount,
+                qpCount ? (double)qpSum / qpCount : -1.0
+            );
+            statsStart = now;
+            encodeTimeSumUs = 0;
+            packetCount = 0;
+            qpSum = 0;
+            qpCount = 0;
+        }
+    }
 }
 
 #endif // ALVR_GPL
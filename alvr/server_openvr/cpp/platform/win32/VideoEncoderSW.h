@@ -2,11 +2,19 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <d3d11_4.h>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <wrl.h>
 
 #include "ALVR-common/packet_types.h"
 #include "Arm64EncoderIpc.h"
+#include "RgbaToYuv420.h"
 #include "VideoEncoder.h"
+#include "d3d-render-utils/RenderPipelineYUV.h"
 #include "shared/d3drender.h"
 
 extern "C" {
@@ -39,34 +47,97 @@ public:
         bool insertIDR
     );
     HRESULT SetupStagingTexture(ID3D11Texture2D* pTexture);
-    HRESULT CopyTexture(ID3D11Texture2D* pTexture);
+    void CopyTexture(ID3D11Texture2D* pTexture, ID3D11Texture2D* stagingTexture);
+    HRESULT MapStagingTexture(ID3D11Texture2D* stagingTexture);
 
 private:
+    void EncodeLoop();
+    // Encodes the frame mapped in m_stagingTexMap
+    void EncodeStagedFrame(uint64_t targetTimestampNs, bool insertIDR);
+    // Sends the packets the encoder has, waiting for the one of targetTimestampNs with SVT-AV1
+    void SendPackets(uint64_t targetTimestampNs);
+    // Options of libsvtav1 from SvtAv1Config
+    AVDictionary* SvtAv1Options();
+    // libavcodec can't change the bitrate of an open SVT-AV1 encoder, it's replaced by one opened
+    // with the new bitrate. The next frame must be a key frame
+    void ReopenSvtAv1();
+
+    // Renders the frame into m_yuvTexture and returns it, or returns the frame itself if the
+    // conversion isn't enabled
+    ID3D11Texture2D* ConvertToYuv(ID3D11Texture2D* pTexture);
+
     std::shared_ptr<CD3DRender> m_d3dRender;
 
     // In-process FFmpeg encoding (fallback)
     AVCodecContext* m_codecContext = nullptr;
     AVFrame *m_transferredFrame = nullptr, *m_encoderFrame = nullptr;
     SwsContext* m_scalerContext = nullptr;
-
-    ComPtr<ID3D11Texture2D> m_stagingTex;
+    // Replaces the scaler when the frame only needs the RGBA to YUV 4:2:0 conversion
+    std::unique_ptr<RgbaToYuv420> m_rgbaToYuv;
+
+    // Transmit copies each frame to the next staging texture and returns, the encode thread maps
+    // and encodes them in order. So the copy of a frame overlaps the encode of the previous one.
+    static const size_t STAGING_RING_SIZE = 3;
+    struct StagingSlot {
+        ComPtr<ID3D11Texture2D> texture;
+        uint64_t targetTimestampNs = 0;
+        bool insertIDR = false;
+    };
+    StagingSlot m_stagingRing[STAGING_RING_SIZE];
+    size_t m_nextSlot = 0;
     D3D11_TEXTURE2D_DESC m_stagingTexDesc;
+    // Only used by the encode thread
     D3D11_MAPPED_SUBRESOURCE m_stagingTexMap;
 
+    std::thread m_encodeThread;
+    std::mutex m_encodeMutex;
+    std::condition_variable m_encodeCv;
+    std::deque<size_t> m_pendingSlots;
+    bool m_encodeExiting = false;
+
+    // GPU color conversion. There is one pipeline per input texture, as the pipeline is bound to
+    // its input view.
+    bool m_gpuColorConversion = false;
+    ComPtr<ID3D11Texture2D> m_yuvTexture;
+    ComPtr<ID3D11Buffer> m_yuvBuffer;
+    ComPtr<ID3D11VertexShader> m_quadVertexShader;
+    std::vector<std::pair<ID3D11Texture2D*, std::unique_ptr<d3d_render_utils::RenderPipelineYUV>>>
+        m_yuvPipelines;
+
     ALVR_CODEC m_codec;
     int m_refreshRate;
     int m_renderWidth;
     int m_renderHeight;
     int m_bitrateInMBits;
+    // Bitrate the SVT-AV1 encoder was opened with
+    int64_t m_openBitrate = 0;
 
     // ARM64 out-of-process encoder via IPC
     std::unique_ptr<Arm64EncoderIpc::EncoderIpcClient> m_arm64Encoder;
     bool m_useArm64Encoder = false;
+    // Packets are read while the next frames are sent, so that the encoder process can pipeline
+    std::thread m_arm64PacketThread;
+    std::atomic<bool> m_arm64PacketExiting = false;
 
     // 尝试初始化 ARM64 编码器，失败则使用内置 FFmpeg
     bool TryInitArm64Encoder();
     // 通过 ARM64 编码器处理帧
     bool TransmitViaArm64(const uint8_t* data, uint32_t size, uint64_t timestampNs, bool insertIDR);
+    void Arm64PacketLoop();
+    // Forwards the bitrate and framerate of the adaptive bitrate to the ARM64 encoder
+    void UpdateArm64EncoderParams();
+    // Creates the shared textures and hands them to the ARM64 encoder
+    bool SetupSharedTextures(ID3D11Texture2D* pTexture);
+    void
+    TransmitSharedTexture(ID3D11Texture2D* pTexture, uint64_t targetTimestampNs, bool insertIDR);
+
+    // Shared texture mode of the ARM64 encoder, the frames go through m_sharedTextures and the
+    // staging textures aren't used
+    bool m_arm64FrameSharing = false;
+    ComPtr<ID3D11Texture2D> m_sharedTextures[Arm64EncoderIpc::FRAME_SLOT_COUNT];
+    ComPtr<ID3D11Fence> m_sharedFence;
+    ComPtr<ID3D11DeviceContext4> m_context4;
+    uint64_t m_sharedFenceValue = 0;
 };
 
 #endif // ALVR_GPL
@@ -0,0 +1,106 @@
+#include "VideoScaler.h"
+
+#include "alvr_server/Logger.h"
+#include "d3d-render-utils/RenderUtils.h"
+
+VideoScaler::VideoScaler(
+    ID3D11Device* device,
+    ID3D11DeviceContext* context,
+    uint32_t inputWidth,
+    uint32_t inputHeight,
+    uint32_t outputWidth,
+    uint32_t outputHeight
+) {
+    OK_OR_THROW(
+        device->QueryInterface(IID_PPV_ARGS(&mVideoDevice)), "Failed to get the video device."
+    );
+    OK_OR_THROW(
+        context->QueryInterface(IID_PPV_ARGS(&mVideoContext)), "Failed to get the video context."
+    );
+    mContext = context;
+
+    D3D11_VIDEO_PROCESSOR_CONTENT_DESC contentDesc = {};
+    contentDesc.InputFrameFormat = D3D11_VIDEO_FRAME_FORMAT_PROGRESSIVE;
+    contentDesc.InputWidth = inputWidth;
+    contentDesc.InputHeight = inputHeight;
+    contentDesc.OutputWidth = outputWidth;
+    contentDesc.OutputHeight = outputHeight;
+    contentDesc.Usage = D3D11_VIDEO_USAGE_PLAYBACK_NORMAL;
+    OK_OR_THROW(
+        mVideoDevice->CreateVideoProcessorEnumerator(&contentDesc, &mEnumerator),
+        "Failed to create the video processor enumerator."
+    );
+    OK_OR_THROW(
+        mVideoDevice->CreateVideoProcessor(mEnumerator.Get(), 0, &mProcessor),
+        "Failed to create the video processor."
+    );
+
+    // Full range, like the stream. The YCbCr fields are ignored for RGB frames
+    D3D11_VIDEO_PROCESSOR_COLOR_SPACE colorSpace = {};
+    colorSpace.RGB_Range = 0;
+    colorSpace.YCbCr_Matrix = 1;
+    colorSpace.Nominal_Range = D3D11_VIDEO_PROCESSOR_NOMINAL_RANGE_0_255;
+    mVideoContext->VideoProcessorSetStreamColorSpace(mProcessor.Get(), 0, &colorSpace);
+    mVideoContext->VideoProcessorSetOutputColorSpace(mProcessor.Get(), &colorSpace);
+    mVideoContext->VideoProcessorSetStreamAutoProcessingMode(mProcessor.Get(), 0, FALSE);
+}
+
+bool VideoScaler::Blit(
+    ID3D11Texture2D* input, ID3D11Texture2D* output, uint32_t width, uint32_t height
+) {
+    ID3D11VideoProcessorInputView* inputView = GetInputView(input);
+    ID3D11VideoProcessorOutputView* outputView = GetOutputView(output);
+    if (!inputView || !outputView) {
+        return false;
+    }
+
+    // The stream and output rectangles must not change before the blit
+    d3d_render_utils::ContextLock lock(mContext.Get());
+    RECT rect = { 0, 0, (LONG)width, (LONG)height };
+    mVideoContext->VideoProcessorSetStreamDestRect(mProcessor.Get(), 0, TRUE, &rect);
+    mVideoContext->VideoProcessorSetOutputTargetRect(mProcessor.Get(), TRUE, &rect);
+
+    D3D11_VIDEO_PROCESSOR_STREAM stream = {};
+    stream.Enable = TRUE;
+    stream.pInputSurface = inputView;
+    HRESULT hr = mVideoContext->VideoProcessorBlt(mProcessor.Get(), outputView, 0, 1, &stream);
+    if (FAILED(hr)) {
+        Warn("VideoScaler: VideoProcessorBlt failed %p %ls\n", hr, GetErrorStr(hr).c_str());
+        return false;
+    }
+    return true;
+}
+
+ID3D11VideoProcessorInputView* VideoScaler::GetInputView(ID3D11Texture2D* texture) {
+    auto& view = mInputViews[texture];
+    if (!view) {
+        D3D11_VIDEO_PROCESSOR_INPUT_VIEW_DESC viewDesc = {};
+        viewDesc.ViewDimension = D3D11_VPIV_DIMENSION_TEXTURE2D;
+        HRESULT hr = mVideoDevice->CreateVideoProcessorInputView(
+            texture, mEnumerator.Get(), &viewDesc, &view
+        );
+        if (FAILED(hr)) {
+            Warn("VideoScaler: input view failed %p %ls\n", hr, GetErrorStr(hr).c_str());
+            mInputViews.erase(texture);
+            return nullptr;
+        }
+    }
+    return view.Get();
+}
+
+ID3D11VideoProcessorOutputView* VideoScaler::GetOutputView(ID3D11Texture2D* texture) {
+    auto& view = mOutputViews[texture];
+    if (!view) {
+        D3D11_VIDEO_PROCESSOR_OUTPUT_VIEW_DESC viewDesc = {};
+        viewDesc.ViewDimension = D3D11_VPOV_DIMENSION_TEXTURE2D;
+        HRESULT hr = mVideoDevice->CreateVideoProcessorOutputView(
+            texture, mEnumerator.Get(), &viewDesc, &view
+        );
+        if (FAILED(hr)) {
+            Warn("VideoScaler: output view failed %p %ls\n", hr, GetErrorStr(hr).c_str());
+            mOutputViews.erase(texture);
+            return nullptr;
+        }
+    }
+    return view.Get();
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <d3d11.h>
+#include <map>
+#include <wrl.h>
+
+// Scales and converts frames with the D3D11 video processor, which runs on the video engine
+// instead of the shader cores. The views are created on first use and kept, the frames are
+// expected to come from a few textures only.
+class VideoScaler {
+public:
+    // Throws if the video processor can't be used. The sizes are hints for the driver, Blit can
+    // write a smaller rectangle
+    VideoScaler(
+        ID3D11Device* device,
+        ID3D11DeviceContext* context,
+        uint32_t inputWidth,
+        uint32_t inputHeight,
+        uint32_t outputWidth,
+        uint32_t outputHeight
+    );
+
+    // Scales the whole input into the top left width x height rectangle of the output. The output
+    // must be bindable as a render target. Returns false on failure, which is logged
+    bool Blit(ID3D11Texture2D* input, ID3D11Texture2D* output, uint32_t width, uint32_t height);
+
+private:
+    ID3D11VideoProcessorInputView* GetInputView(ID3D11Texture2D* texture);
+    ID3D11VideoProcessorOutputView* GetOutputView(ID3D11Texture2D* texture);
+
+    Microsoft::WRL::ComPtr<ID3D11DeviceContext> mContext;
+    Microsoft::WRL::ComPtr<ID3D11VideoDevice> mVideoDevice;
+    Microsoft::WRL::ComPtr<ID3D11VideoContext> mVideoContext;
+    Microsoft::WRL::ComPtr<ID3D11VideoProcessorEnumerator> mEnumerator;
+    Microsoft::WRL::ComPtr<ID3D11VideoProcessor> mProcessor;
+    std::map<ID3D11Texture2D*, Microsoft::WRL::ComPtr<ID3D11VideoProcessorInputView>> mInputViews;
+    std::map<ID3D11Texture2D*, Microsoft::WRL::ComPtr<ID3D11VideoProcessorOutputView>>
+        mOutputViews;
+};
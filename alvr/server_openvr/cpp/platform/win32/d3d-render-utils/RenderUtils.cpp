@@ -7,6 +7,22 @@ using Microsoft::WRL::ComPtr;
 
 namespace d3d_render_utils {
 
+ContextLock::ContextLock(ID3D11DeviceContext* context) {
+    if (SUCCEEDED(QUERY(context, &mMultithread)) && mMultithread->GetMultithreadProtected()) {
+        mMultithread->Enter();
+    } else if (mMultithread) {
+        mMultithread->Release();
+        mMultithread = nullptr;
+    }
+}
+
+ContextLock::~ContextLock() {
+    if (mMultithread) {
+        mMultithread->Leave();
+        mMultithread->Release();
+    }
+}
+
 void GetAdapterInfo(ID3D11Device* d3dDevice, int32_t& adapterIndex, std::wstring& adapterName) {
     ComPtr<IDXGIDevice> dxgiDevice;
     OK_OR_THROW(QUERY(d3dDevice, &dxgiDevice), "Failed to query DXGI device.");
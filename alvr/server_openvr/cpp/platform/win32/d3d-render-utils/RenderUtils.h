@@ -23,8 +23,26 @@
     }
 #define QUERY(from, ppd3d) from->QueryInterface(__uuidof(*(ppd3d)), (void**)(ppd3d))
 
+struct ID3D11Multithread;
+
 namespace d3d_render_utils {
 
+// The immediate contexts are multithread protected, which only makes each call atomic. The present
+// and encoder threads share them, so a sequence that binds state and then draws, dispatches or
+// blits with it holds this lock throughout, and the other thread's calls can't land in between.
+// Recursive. Does nothing on a context that isn't multithread protected
+class ContextLock {
+public:
+    explicit ContextLock(ID3D11DeviceContext* context);
+    ~ContextLock();
+
+    ContextLock(const ContextLock&) = delete;
+    ContextLock& operator=(const ContextLock&) = delete;
+
+private:
+    ID3D11Multithread* mMultithread = nullptr;
+};
+
 void GetAdapterInfo(ID3D11Device* d3dDevice, int32_t& adapterIndex, std::wstring& adapterName);
 
 ID3D11Device* CreateDevice(IDXGIAdapter* dxgiAdapter = nullptr);
@@ -0,0 +1,426 @@
+#include "NvEncConfig.h"
+#include "NvEncReferences.h"
+
+#include <algorithm>
+
+#include "alvr_server/FoveatedQpMap.h"
+#include "alvr_server/Logger.h"
+#include "alvr_server/Settings.h"
+
+NvEncConfig::NvEncConfig(int codec, bool use10bit, uint32_t subFrameSlices, bool asyncOutput)
+    : m_codec(codec)
+    , m_use10bit(use10bit)
+    , m_subFrameSlices(subFrameSlices)
+    , m_asyncOutput(asyncOutput) { }
+
+void NvEncConfig::Fill(
+    NvEncoder& encoder,
+    NV_ENC_INITIALIZE_PARAMS& initializeParams,
+    int refreshRate,
+    int width,
+    int height,
+    uint64_t bitrate_bps
+) {
+    auto& encodeConfig = *initializeParams.encodeConfig;
+
+    GUID encoderGUID;
+    switch (m_codec) {
+    case ALVR_CODEC_H264:
+        encoderGUID = NV_ENC_CODEC_H264_GUID;
+        break;
+    case ALVR_CODEC_HEVC:
+        encoderGUID = NV_ENC_CODEC_HEVC_GUID;
+        break;
+    case ALVR_CODEC_AV1:
+        encoderGUID = NV_ENC_CODEC_AV1_GUID;
+        break;
+    }
+
+    GUID qualityPreset;
+    // See recommended NVENC settings for low-latency encoding.
+    // https://docs.nvidia.com/video-technologies/video-codec-sdk/nvenc-video-encoder-api-prog-guide/#recommended-nvenc-settings
+    switch (Settings::Instance().m_nvencQualityPreset) {
+    case 7:
+        qualityPreset = NV_ENC_PRESET_P7_GUID;
+        break;
+    case 6:
+        qualityPreset = NV_ENC_PRESET_P6_GUID;
+        break;
+    case 5:
+        qualityPreset = NV_ENC_PRESET_P5_GUID;
+        break;
+    case 4:
+        qualityPreset = NV_ENC_PRESET_P4_GUID;
+        break;
+    case 3:
+        qualityPreset = NV_ENC_PRESET_P3_GUID;
+        break;
+    case 2:
+        qualityPreset = NV_ENC_PRESET_P2_GUID;
+        break;
+    case 1:
+    default:
+        qualityPreset = NV_ENC_PRESET_P1_GUID;
+        break;
+    }
+
+    NV_ENC_TUNING_INFO tuningPreset
+        = static_cast<NV_ENC_TUNING_INFO>(Settings::Instance().m_nvencTuningPreset);
+
+    encoder.CreateDefaultEncoderParams(
+        &initializeParams, encoderGUID, qualityPreset, tuningPreset
+    );
+
+    initializeParams.encodeWidth = initializeParams.darWidth = width;
+    initializeParams.encodeHeight = initializeParams.darHeight = height;
+
+    initializeParams.enableWeightedPrediction
+        = Settings::Instance().m_nvencEnableWeightedPrediction;
+#if NVENCAPI_MAJOR_VERSION > 12 || (NVENCAPI_MAJOR_VERSION == 12 && NVENCAPI_MINOR_VERSION >= 1)
+    // H.264 frames are always encoded by a single engine
+    if (m_codec != ALVR_CODEC_H264) {
+        initializeParams.splitEncodeMode = Settings::Instance().m_nvencSplitEncode;
+    }
+#endif
+
+    // 16 is recommended when using reference frame invalidation. But it has caused bad visual
+    // quality. Now, use 0 (use default).
+    uint32_t maxNumRefFrames = 0;
+    uint32_t gopLength = NVENC_INFINITE_GOPLENGTH;
+
+    if (Settings::Instance().m_nvencMaxNumRefFrames != -1) {
+        maxNumRefFrames = Settings::Instance().m_nvencMaxNumRefFrames;
+    }
+    if (Settings::Instance().m_nvencGopLength != -1) {
+        gopLength = Settings::Instance().m_nvencGopLength;
+    }
+
+    // The NVENC overrides take precedence. Gradual intra refresh starts each wave right after the
+    // previous one, so that every frame refreshes the same share of the picture
+    m_intraRefresh = Settings::Instance().m_nvencEnableIntraRefresh;
+    int64_t intraRefreshPeriod = Settings::Instance().m_nvencIntraRefreshPeriod;
+    int64_t intraRefreshCount = Settings::Instance().m_nvencIntraRefreshCount;
+    if (Settings::Instance().m_gradualIntraRefresh) {
+        m_intraRefresh = true;
+        if (intraRefreshPeriod == -1) {
+            intraRefreshPeriod = Settings::Instance().m_gradualIntraRefreshPeriod;
+        }
+        if (intraRefreshCount == -1) {
+            // Must be smaller than the period
+            intraRefreshCount = intraRefreshPeriod - 1;
+        }
+    }
+
+    // Per picture LTR mode, the frames to mark and to recover from are picked by Transmit and
+    // InvalidateReferences. Not with intra refresh, losses then insert an IDR
+    m_useLtr = Settings::Instance().m_referenceFrameInvalidation && !m_intraRefresh
+        && m_codec != ALVR_CODEC_AV1 && Settings::Instance().m_encoderTemporalLayers <= 1
+        && encoder.GetCapabilityValue(encoderGUID, NV_ENC_CAPS_NUM_MAX_LTR_FRAMES)
+            >= NvEncReferences::LTR_COUNT;
+
+    switch (m_codec) {
+    case ALVR_CODEC_H264: {
+        auto& config = encodeConfig.encodeCodecConfig.h264Config;
+        config.repeatSPSPPS = 1;
+        config.enableIntraRefresh = m_intraRefresh;
+
+        if (intraRefreshPeriod != -1) {
+            config.intraRefreshPeriod = intraRefreshPeriod;
+        }
+        if (intraRefreshCount != -1) {
+            config.intraRefreshCnt = intraRefreshCount;
+        }
+
+        switch (Settings::Instance().m_entropyCoding) {
+        case ALVR_CABAC:
+            config.entropyCodingMode = NV_ENC_H264_ENTROPY_CODING_MODE_CABAC;
+            break;
+        case ALVR_CAVLC:
+            config.entropyCodingMode = NV_ENC_H264_ENTROPY_CODING_MODE_CAVLC;
+            break;
+        }
+
+        config.maxNumRefFrames = maxNumRefFrames;
+        config.idrPeriod = gopLength;
+        if (m_useLtr) {
+            config.enableLTR = 1;
+            config.ltrNumFrames = NvEncReferences::LTR_COUNT;
+            config.ltrTrustMode = 0;
+        }
+
+        // The SVC prefix NAL before each slice carries its layer, which the sender drops frames by
+        uint32_t temporalLayers = std::min(
+            Settings::Instance().m_encoderTemporalLayers,
+            (uint32_t)encoder.GetCapabilityValue(
+                encoderGUID, NV_ENC_CAPS_NUM_MAX_TEMPORAL_LAYERS
+            )
+        );
+        if (temporalLayers > 1) {
+            config.enableTemporalSVC = 1;
+            config.numTemporalLayers = temporalLayers;
+            config.maxTemporalLayers = temporalLayers;
+            if (maxNumRefFrames != 0) {
+                config.maxNumRefFrames = std::max(maxNumRefFrames, (temporalLayers - 2) * 2);
+            }
+        }
+
+        if (Settings::Instance().m_fillerData) {
+            config.enableFillerDataInsertion = Settings::Instance().m_rateControlMode == ALVR_CBR;
+        }
+
+        config.h264VUIParameters.videoSignalTypePresentFlag = 1;
+        config.h264VUIParameters.videoFormat = NV_ENC_VUI_VIDEO_FORMAT_UNSPECIFIED;
+        config.h264VUIParameters.videoFullRangeFlag = 1;
+        config.h264VUIParameters.colourDescriptionPresentFlag = 1;
+        if (Settings::Instance().m_enableHdr) {
+            config.h264VUIParameters.colourPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT2020;
+            config.h264VUIParameters.transferCharacteristics
+                = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
+            config.h264VUIParameters.colourMatrix = NV_ENC_VUI_MATRIX_COEFFS_BT2020_NCL;
+        } else {
+            config.h264VUIParameters.colourPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT709;
+            config.h264VUIParameters.transferCharacteristics
+                = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
+            config.h264VUIParameters.colourMatrix = NV_ENC_VUI_MATRIX_COEFFS_BT709;
+        }
+    } break;
+    case ALVR_CODEC_HEVC: {
+        auto& config = encodeConfig.encodeCodecConfig.hevcConfig;
+        if (Settings::Instance().m_encoderTemporalLayers > 1) {
+            Warn("NvEnc: Temporal layers are only supported with H264\n");
+        }
+        config.repeatSPSPPS = 1;
+        config.enableIntraRefresh = m_intraRefresh;
+
+        if (intraRefreshPeriod != -1) {
+            config.intraRefreshPeriod = intraRefreshPeriod;
+        }
+        if (intraRefreshCount != -1) {
+            config.intraRefreshCnt = intraRefreshCount;
+        }
+
+        config.maxNumRefFramesInDPB = maxNumRefFrames;
+        if (FoveatedQpMap::IsEnabled()) {
+            // The size of the CTBs the QP map is built for
+            config.maxCUSize = NV_ENC_HEVC_CUSIZE_32x32;
+        }
+        config.idrPeriod = gopLength;
+        if (m_useLtr) {
+            config.enableLTR = 1;
+            config.ltrNumFrames = NvEncReferences::LTR_COUNT;
+            config.ltrTrustMode = 0;
+        }
+
+        if (m_use10bit) {
+            encodeConfig.encodeCodecConfig.hevcConfig.pixelBitDepthMinus8 = 2;
+        }
+
+        if (Settings::Instance().m_fillerData) {
+            config.enableFillerDataInsertion = Settings::Instance().m_rateControlMode == ALVR_CBR;
+        }
+
+        config.hevcVUIParameters.videoSignalTypePresentFlag = 1;
+        config.hevcVUIParameters.videoFormat = NV_ENC_VUI_VIDEO_FORMAT_UNSPECIFIED;
+        config.hevcVUIParameters.videoFullRangeFlag = 1;
+        config.hevcVUIParameters.colourDescriptionPresentFlag = 1;
+        if (Settings::Instance().m_enableHdr) {
+            config.hevcVUIParameters.colourPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT2020;
+            config.hevcVUIParameters.transferCharacteristics
+                = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
+            config.hevcVUIParameters.colourMatrix = NV_ENC_VUI_MATRIX_COEFFS_BT2020_NCL;
+        } else {
+            config.hevcVUIParameters.colourPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT709;
+            config.hevcVUIParameters.transferCharacteristics
+                = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
+            config.hevcVUIParameters.colourMatrix = NV_ENC_VUI_MATRIX_COEFFS_BT709;
+        }
+    } break;
+    case ALVR_CODEC_AV1: {
+        auto& config = encodeConfig.encodeCodecConfig.av1Config;
+        if (Settings::Instance().m_encoderTemporalLayers > 1) {
+            Warn("NvEnc: Temporal layers are only supported with H264\n");
+        }
+        config.repeatSeqHdr = 1;
+        config.enableIntraRefresh = m_intraRefresh;
+
+        if (intraRefreshPeriod != -1) {
+            config.intraRefreshPeriod = intraRefreshPeriod;
+        }
+        if (intraRefreshCount != -1) {
+            config.intraRefreshCnt = intraRefreshCount;
+        }
+
+        config.maxNumRefFramesInDPB = maxNumRefFrames;
+        config.idrPeriod = gopLength;
+
+        if (m_use10bit) {
+            config.pixelBitDepthMinus8 = 2;
+        }
+
+        if (Settings::Instance().m_fillerData) {
+            config.enableBitstreamPadding = Settings::Instance().m_rateControlMode == ALVR_CBR;
+        }
+
+        config.chromaFormatIDC = 1; // 4:2:0, 4:4:4 currently not supported
+        config.colorRange = 1;
+        if (Settings::Instance().m_enableHdr) {
+            config.colorPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT2020;
+            config.transferCharacteristics = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
+            config.matrixCoefficients = NV_ENC_VUI_MATRIX_COEFFS_BT2020_NCL;
+        } else {
+            config.colorPrimaries = NV_ENC_VUI_COLOR_PRIMARIES_BT709;
+            config.transferCharacteristics = NV_ENC_VUI_TRANSFER_CHARACTERISTIC_SRGB;
+            config.matrixCoefficients = NV_ENC_VUI_MATRIX_COEFFS_BT709;
+        }
+    } break;
+    }
+
+    // One slice per tile of the client decoder. H264 and HEVC slices are bands of the frame, the
+    // sub-frame output and the packet-sized slices below take over with their own
+    uint32_t tileColumns = Settings::Instance().m_encoderTileColumns;
+    uint32_t tileRows = Settings::Instance().m_encoderTileRows;
+    if (tileColumns * tileRows > 1) {
+        if (m_codec == ALVR_CODEC_H264) {
+            encodeConfig.encodeCodecConfig.h264Config.sliceMode = 3;
+            encodeConfig.encodeCodecConfig.h264Config.sliceModeData = tileColumns * tileRows;
+        } else if (m_codec == ALVR_CODEC_HEVC) {
+            encodeConfig.encodeCodecConfig.hevcConfig.sliceMode = 3;
+            encodeConfig.encodeCodecConfig.hevcConfig.sliceModeData = tileColumns * tileRows;
+        } else {
+            encodeConfig.encodeCodecConfig.av1Config.numTileColumns = tileColumns;
+            encodeConfig.encodeCodecConfig.av1Config.numTileRows = tileRows;
+        }
+    }
+
+    if (m_subFrameSlices > 0) {
+        initializeParams.enableEncodeAsync = 0;
+        initializeParams.enableSubFrameWrite = 1;
+        if (m_codec == ALVR_CODEC_H264) {
+            encodeConfig.encodeCodecConfig.h264Config.sliceMode = 3;
+            encodeConfig.encodeCodecConfig.h264Config.sliceModeData = m_subFrameSlices;
+        } else {
+            encodeConfig.encodeCodecConfig.hevcConfig.sliceMode = 3;
+            encodeConfig.encodeCodecConfig.hevcConfig.sliceModeData = m_subFrameSlices;
+        }
+    }
+
+    // Slices of at most that many bytes, each sent in its own packet. With sub-frame output they
+    // are still sent as soon as they are encoded
+    uint32_t sliceSize = Settings::Instance().m_encoderSliceSizeBytes;
+    if (sliceSize > 0) {
+        if (m_codec == ALVR_CODEC_H264) {
+            encodeConfig.encodeCodecConfig.h264Config.sliceMode = 1;
+            encodeConfig.encodeCodecConfig.h264Config.sliceModeData = sliceSize;
+        } else if (m_codec == ALVR_CODEC_HEVC) {
+            encodeConfig.encodeCodecConfig.hevcConfig.sliceMode = 1;
+            encodeConfig.encodeCodecConfig.hevcConfig.sliceModeData = sliceSize;
+        } else {
+            Warn("NvEnc: packet-sized slices aren't supported for AV1\n");
+        }
+    }
+
+    // Disable automatic IDR insertion by NVENC. We need to manually insert IDR when packet is
+    // dropped if don't use reference frame invalidation.
+    encodeConfig.gopLength = gopLength;
+    encodeConfig.frameIntervalP = 1;
+
+    // B frames are reordered, each one is held back until the next P frame is encoded. Only the
+    // async output retrieves the frames in a separate thread, the synchronous one expects each
+    // frame back from the call that encoded it
+    if (Settings::Instance().m_nvencPFrameStrategy != -1) {
+        encodeConfig.frameIntervalP = Settings::Instance().m_nvencPFrameStrategy;
+        if (encodeConfig.frameIntervalP > 1 && !m_asyncOutput) {
+            Warn("NvEnc: B frames need the async output, encoding P frames only\n");
+            encodeConfig.frameIntervalP = 1;
+        }
+    }
+    // Lookahead delays the output by its depth as well
+    encodeConfig.rcParams.enableLookahead = 0;
+    encodeConfig.rcParams.lookaheadDepth = 0;
+
+    switch (Settings::Instance().m_rateControlMode) {
+    case ALVR_CBR:
+        encodeConfig.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR;
+        break;
+    case ALVR_VBR:
+        encodeConfig.rcParams.rateControlMode = NV_ENC_PARAMS_RC_VBR;
+        break;
+    }
+    encodeConfig.rcParams.lowDelayKeyFrameScale = 1;
+
+    if (Settings::Instance().m_nvencLowDelayKeyFrameScale != -1) {
+        encodeConfig.rcParams.lowDelayKeyFrameScale
+            = Settings::Instance().m_nvencLowDelayKeyFrameScale;
+    }
+
+    FillLoadLevel(initializeParams, 0);
+    if (FoveatedQpMap::IsEnabled()) {
+        // Applied on top of the QP chosen by rate control, which compensates the bits saved at the
+        // edges by lowering the QP of the whole frame
+        encodeConfig.rcParams.qpMapMode = NV_ENC_QP_MAP_DELTA;
+    }
+
+    if (Settings::Instance().m_nvencRateControlMode != -1) {
+        encodeConfig.rcParams.rateControlMode
+            = (NV_ENC_PARAMS_RC_MODE)Settings::Instance().m_nvencRateControlMode;
+    }
+
+    FillRateControl(initializeParams, refreshRate, bitrate_bps, 0);
+}
+
+void NvEncConfig::FillLoadLevel(NV_ENC_INITIALIZE_PARAMS& initializeParams, int level) const {
+    auto& encodeConfig = *initializeParams.encodeConfig;
+
+    encodeConfig.rcParams.multiPass = level >= 1
+        ? NV_ENC_MULTI_PASS_DISABLED
+        : static_cast<NV_ENC_MULTI_PASS>(Settings::Instance().m_nvencMultiPass);
+
+    int aqMode = level >= 2 ? 0 : Settings::Instance().m_nvencAdaptiveQuantizationMode;
+    encodeConfig.rcParams.enableAQ = aqMode == SpatialAQ;
+    encodeConfig.rcParams.enableTemporalAQ = aqMode == TemporalAQ;
+}
+
+void NvEncConfig::FillRateControl(
+    NV_ENC_INITIALIZE_PARAMS& initializeParams,
+    int refreshRate,
+    uint64_t bitrate_bps,
+    uint64_t maxFrameBits
+) const {
+    auto& encodeConfig = *initializeParams.encodeConfig;
+
+    initializeParams.frameRateNum = refreshRate;
+    initializeParams.frameRateDen = 1;
+
+    if (Settings::Instance().m_nvencRefreshRate != -1) {
+        initializeParams.frameRateNum = Settings::Instance().m_nvencRefreshRate;
+    }
+
+    uint32_t maxFrameSize = static_cast<uint32_t>(bitrate_bps / refreshRate);
+    Debug("NvEncConfig: maxFrameSize=%d bits\n", maxFrameSize);
+    encodeConfig.rcParams.vbvBufferSize = maxFrameSize * 1.1;
+    encodeConfig.rcParams.vbvInitialDelay = maxFrameSize * 1.1;
+    encodeConfig.rcParams.maxBitRate = static_cast<uint32_t>(bitrate_bps);
+    encodeConfig.rcParams.averageBitRate = static_cast<uint32_t>(bitrate_bps);
+
+    if (Settings::Instance().m_nvencRcBufferSize != -1) {
+        encodeConfig.rcParams.vbvBufferSize = Settings::Instance().m_nvencRcBufferSize;
+    }
+    if (Settings::Instance().m_nvencRcInitialDelay != -1) {
+        encodeConfig.rcParams.vbvInitialDelay = Settings::Instance().m_nvencRcInitialDelay;
+    }
+    if (Settings::Instance().m_nvencRcMaxBitrate != -1) {
+        encodeConfig.rcParams.maxBitRate = Settings::Instance().m_nvencRcMaxBitrate;
+    }
+    if (Settings::Instance().m_nvencRcAverageBitrate != -1) {
+        encodeConfig.rcParams.averageBitRate = Settings::Instance().m_nvencRcAverageBitrate;
+    }
+
+    // NVENC has no limit on the frame size, a frame can't be larger than the VBV buffer though,
+    // the overrides above included
+    if (maxFrameBits > 0) {
+        encodeConfig.rcParams.vbvBufferSize
+            = std::min<uint64_t>(encodeConfig.rcParams.vbvBufferSize, maxFrameBits);
+        encodeConfig.rcParams.vbvInitialDelay
+            = std::min<uint64_t>(encodeConfig.rcParams.vbvInitialDelay, maxFrameBits);
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "NvEncoder.h"
+
+enum AdaptiveQuantizationMode { SpatialAQ = 1, TemporalAQ = 2 };
+
+// The encode config of the NVENC settings, for the D3D11 encoder on Windows and the CUDA one on
+// Linux. Bitrate changes only refill the rate control fields of the config created with Fill
+class NvEncConfig {
+public:
+    // With subFrameSlices > 1 the frames are read back slice by slice, which needs the synchronous
+    // mode. B frames need asyncOutput, the frames are otherwise expected back in encode order
+    NvEncConfig(int codec, bool use10bit, uint32_t subFrameSlices, bool asyncOutput);
+
+    // initializeParams.encodeConfig must point to the config to fill
+    void Fill(
+        NvEncoder& encoder,
+        NV_ENC_INITIALIZE_PARAMS& initializeParams,
+        int refreshRate,
+        int width,
+        int height,
+        uint64_t bitrate_bps
+    );
+    // maxFrameBits bounds the VBV buffer, 0 for no bound
+    void FillRateControl(
+        NV_ENC_INITIALIZE_PARAMS& initializeParams,
+        int refreshRate,
+        uint64_t bitrate_bps,
+        uint64_t maxFrameBits
+    ) const;
+    // Rate control of an EncodeLoadControl level: 1 turns off the multiple passes, 2 also the
+    // adaptive quantization. 0 restores the settings. Changes with a reconfigure, like the bitrate
+    void FillLoadLevel(NV_ENC_INITIALIZE_PARAMS& initializeParams, int level) const;
+    static const int LOAD_LEVELS = 3;
+
+    // Set by Fill. H264 and HEVC only, without intra refresh or temporal layers
+    bool UsesLtr() const { return m_useLtr; }
+
+private:
+    int m_codec;
+    bool m_use10bit;
+    uint32_t m_subFrameSlices;
+    bool m_asyncOutput;
+    bool m_intraRefresh = false;
+    bool m_useLtr = false;
+};
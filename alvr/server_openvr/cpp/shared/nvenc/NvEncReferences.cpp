@@ -0,0 +1,114 @@
+#include "NvEncReferences.h"
+
+#include <algorithm>
+
+#include "alvr_server/Logger.h"
+#include "alvr_server/Settings.h"
+
+NvEncReferences::NvEncReferences(int codec, bool useLtr, NvEncoder& encoder, GUID encodeGuid)
+    : m_codec(codec)
+    , m_useLtr(useLtr)
+    , m_supportsRefInvalidation(
+          Settings::Instance().m_referenceFrameInvalidation
+          && encoder.GetCapabilityValue(encodeGuid, NV_ENC_CAPS_SUPPORT_REF_PIC_INVALIDATION)
+      ) { }
+
+bool NvEncReferences::Invalidate(
+    NvEncoder& encoder,
+    const std::vector<uint64_t>& lostTimestampsNs,
+    uint64_t referenceTimestampNs
+) {
+    // Lost long term references can't be used either
+    int bestLtr = -1;
+    if (m_useLtr) {
+        for (auto& timestampNs : m_ltrTimestamps) {
+            if (std::find(lostTimestampsNs.begin(), lostTimestampsNs.end(), timestampNs)
+                != lostTimestampsNs.end()) {
+                timestampNs = 0;
+            }
+        }
+        for (int i = 0; i < LTR_COUNT; i++) {
+            if (m_ltrTimestamps[i] != 0 && m_ltrTimestamps[i] <= referenceTimestampNs
+                && (bestLtr == -1 || m_ltrTimestamps[i] > m_ltrTimestamps[bestLtr])) {
+                bestLtr = i;
+            }
+        }
+    }
+
+    // The reference must still be in the DPB, which is only known with an explicit DPB size.
+    // Otherwise NVENC itself falls back to an intra frame if no valid reference is left, the long
+    // term reference avoids that
+    int64_t maxNumRefFrames = Settings::Instance().m_nvencMaxNumRefFrames;
+    bool inDpb = maxNumRefFrames > 0 && lostTimestampsNs.size() < (size_t)maxNumRefFrames;
+    if (bestLtr == -1 && (!m_supportsRefInvalidation || (maxNumRefFrames > 0 && !inDpb))) {
+        return false;
+    }
+
+    if (m_supportsRefInvalidation) {
+        try {
+            for (uint64_t timestampNs : lostTimestampsNs) {
+                encoder.InvalidateRefFrame(timestampNs);
+            }
+        } catch (NVENCException e) {
+            Warn("NvEnc InvalidateRefFrames failed. Code=%d %hs\n", e.getErrorCode(), e.what());
+            if (bestLtr == -1) {
+                return false;
+            }
+            inDpb = false;
+        }
+    }
+    if (bestLtr != -1 && !(m_supportsRefInvalidation && inDpb)) {
+        m_forcedLtr = bestLtr;
+    }
+    return true;
+}
+
+void NvEncReferences::ApplyPicParams(
+    NV_ENC_PIC_PARAMS& picParams, uint64_t targetTimestampNs, bool insertIDR
+) {
+    if (!m_useLtr) {
+        return;
+    }
+
+    if (insertIDR) {
+        // An IDR drops all references, it becomes the first long term reference
+        for (auto& timestampNs : m_ltrTimestamps) {
+            timestampNs = 0;
+        }
+        m_forcedLtr = -1;
+        m_framesSinceLtr = LTR_INTERVAL;
+    }
+
+    uint32_t markFrame = 0;
+    uint32_t markFrameIdx = 0;
+    uint32_t useFrames = 0;
+    uint32_t useFrameBitmap = 0;
+    // The frame that recovers from a loss isn't marked, so that it doesn't replace the reference
+    // it's encoded from
+    if (m_forcedLtr != -1) {
+        useFrames = 1;
+        useFrameBitmap = 1u << m_forcedLtr;
+        m_forcedLtr = -1;
+    } else if (m_framesSinceLtr >= LTR_INTERVAL) {
+        markFrame = 1;
+        markFrameIdx = m_nextLtr;
+        m_ltrTimestamps[m_nextLtr] = targetTimestampNs;
+        m_nextLtr = (m_nextLtr + 1) % LTR_COUNT;
+        m_framesSinceLtr = 0;
+    }
+    m_framesSinceLtr++;
+
+    if (m_codec == ALVR_CODEC_H264) {
+        auto& params = picParams.codecPicParams.h264PicParams;
+        params.ltrMarkFrame = markFrame;
+        params.ltrMarkFrameIdx = markFrameIdx;
+        params.ltrUseFrames = useFrames;
+        params.ltrUseFrameBitmap = useFrameBitmap;
+    } else {
+        auto& params = picParams.codecPicParams.hevcPicParams;
+        params.ltrMarkFrame = markFrame;
+        params.ltrMarkFrameIdx = markFrameIdx;
+        params.ltrUseFrames = useFrames;
+        params.ltrUseFrameBitmap = useFrameBitmap;
+    }
+}
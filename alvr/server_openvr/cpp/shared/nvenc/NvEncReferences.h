@@ -0,0 +1,39 @@
+#pragma once
+
+#include "NvEncoder.h"
+
+#include <vector>
+
+// Recovery from lost frames without an IDR. The lost frames are invalidated when the encoder
+// supports it, and with UsesLtr the frames are marked in turn as long term references, which the
+// next frame references after a loss the short term references may not cover
+class NvEncReferences {
+public:
+    // Long term references, marked every LTR_INTERVAL frames
+    static const int LTR_COUNT = 2;
+    static const int LTR_INTERVAL = 8;
+
+    // The frames are identified by the inputTimeStamp they are encoded with, their target
+    // timestamp. Invalidation is checked on the encoder created with encodeGuid
+    NvEncReferences(int codec, bool useLtr, NvEncoder& encoder, GUID encodeGuid);
+
+    // See IDRScheduler::ReferenceInvalidator
+    bool Invalidate(
+        NvEncoder& encoder,
+        const std::vector<uint64_t>& lostTimestampsNs,
+        uint64_t referenceTimestampNs
+    );
+    // Marks or references the long term references in the picture params of the next frame
+    void ApplyPicParams(NV_ENC_PIC_PARAMS& picParams, uint64_t targetTimestampNs, bool insertIDR);
+
+private:
+    int m_codec;
+    bool m_useLtr;
+    bool m_supportsRefInvalidation;
+    // Timestamp of the frame held by each long term reference, 0 if unused
+    uint64_t m_ltrTimestamps[LTR_COUNT] = {};
+    int m_nextLtr = 0;
+    int m_framesSinceLtr = LTR_INTERVAL;
+    // Long term reference the next frame must reference, -1 if none
+    int m_forcedLtr = -1;
+};
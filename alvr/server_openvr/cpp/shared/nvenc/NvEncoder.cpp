@@ -10,9 +10,11 @@
 */
 
 #include "NvEncoder.h"
+#include <thread>
 
 #ifndef _WIN32
 #include <cstring>
+#include <dlfcn.h>
 static inline bool operator==(const GUID &guid1, const GUID &guid2) {
     return !memcmp(&guid1, &guid2, sizeof(GUID));
 }
@@ -581,55 +583,152 @@ void NvEncoder::EndEncode(std::vector<std::vector<uint8_t>> &vPacket)
     GetEncodedPacket(m_vBitstreamOutputBuffer, vPacket, false);
 }
 
+void NvEncoder::SubmitFrame(NV_ENC_PIC_PARAMS *pPicParams)
+{
+    if (!IsHWEncoderInitialized())
+    {
+        NVENC_THROW_ERROR("Encoder device not found", NV_ENC_ERR_NO_ENCODE_DEVICE);
+    }
+
+    int bfrIdx = m_iToSend % m_nEncoderBuffer;
+
+    MapResources(bfrIdx);
+
+    NVENCSTATUS nvStatus = DoEncode(m_vMappedInputBuffers[bfrIdx], m_vBitstreamOutputBuffer[bfrIdx], pPicParams);
+
+    if (nvStatus == NV_ENC_SUCCESS || nvStatus == NV_ENC_ERR_NEED_MORE_INPUT)
+    {
+        m_iToSend++;
+    }
+    else
+    {
+        NVENC_THROW_ERROR("nvEncEncodePicture API failed", nvStatus);
+    }
+}
+
+void NvEncoder::GetSubmittedPacket(std::vector<uint8_t> &packet)
+{
+    // The frame is skipped on failure, so that the next call doesn't retry it
+    try
+    {
+        RetrievePacket(m_vBitstreamOutputBuffer, packet);
+    }
+    catch (...)
+    {
+        m_iGot++;
+        throw;
+    }
+    m_iGot++;
+}
+
 void NvEncoder::GetEncodedPacket(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer, std::vector<std::vector<uint8_t>> &vPacket, bool bOutputDelay)
 {
     unsigned i = 0;
     int iEnd = bOutputDelay ? m_iToSend - m_nOutputDelay : m_iToSend;
     for (; m_iGot < iEnd; m_iGot++)
     {
-        WaitForCompletionEvent(m_iGot % m_nEncoderBuffer);
+        if (vPacket.size() < i + 1)
+        {
+            vPacket.push_back(std::vector<uint8_t>());
+        }
+        RetrievePacket(vOutputBuffer, vPacket[i]);
+        i++;
+    }
+}
+
+void NvEncoder::RetrievePacket(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer, std::vector<uint8_t> &packet)
+{
+    WaitForCompletionEvent(m_iGot % m_nEncoderBuffer);
+    packet.clear();
+
+    if (m_initializeParams.enableSubFrameWrite && m_subFrameCallback)
+    {
+        RetrieveSubFrames(vOutputBuffer[m_iGot % m_nEncoderBuffer]);
+    }
+    else
+    {
         NV_ENC_LOCK_BITSTREAM lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
         lockBitstreamData.outputBitstream = vOutputBuffer[m_iGot % m_nEncoderBuffer];
         lockBitstreamData.doNotWait = false;
+        lockBitstreamData.getRCStats = 1;
         NVENC_API_CALL(m_nvenc.nvEncLockBitstream(m_hEncoder, &lockBitstreamData));
-  
+        m_lastFrameStats = { lockBitstreamData.frameAvgQP, lockBitstreamData.intraMBCount, lockBitstreamData.interMBCount, lockBitstreamData.bitstreamSizeInBytes };
+
         uint8_t *pData = (uint8_t *)lockBitstreamData.bitstreamBufferPtr;
-        if (vPacket.size() < i + 1)
-        {
-            vPacket.push_back(std::vector<uint8_t>());
-        }
-        vPacket[i].clear();
-       
+
         if ((m_initializeParams.encodeGUID == NV_ENC_CODEC_AV1_GUID) && (m_bUseIVFContainer))
         {
             if (m_bWriteIVFFileHeader)
             {
-                m_IVFUtils.WriteFileHeader(vPacket[i], MAKE_FOURCC('A', 'V', '0', '1'), m_initializeParams.encodeWidth, m_initializeParams.encodeHeight, m_initializeParams.frameRateNum, m_initializeParams.frameRateDen, 0xFFFF);
+                m_IVFUtils.WriteFileHeader(packet, MAKE_FOURCC('A', 'V', '0', '1'), m_initializeParams.encodeWidth, m_initializeParams.encodeHeight, m_initializeParams.frameRateNum, m_initializeParams.frameRateDen, 0xFFFF);
                 m_bWriteIVFFileHeader = false;
             }
 
-            m_IVFUtils.WriteFrameHeader(vPacket[i], lockBitstreamData.bitstreamSizeInBytes, lockBitstreamData.outputTimeStamp);
+            m_IVFUtils.WriteFrameHeader(packet, lockBitstreamData.bitstreamSizeInBytes, lockBitstreamData.outputTimeStamp);
         }
-        vPacket[i].insert(vPacket[i].end(), &pData[0], &pData[lockBitstreamData.bitstreamSizeInBytes]);
-        
-        i++;
+        packet.insert(packet.end(), &pData[0], &pData[lockBitstreamData.bitstreamSizeInBytes]);
 
         NVENC_API_CALL(m_nvenc.nvEncUnlockBitstream(m_hEncoder, lockBitstreamData.outputBitstream));
+    }
 
-        if (m_vMappedInputBuffers[m_iGot % m_nEncoderBuffer])
+    if (m_vMappedInputBuffers[m_iGot % m_nEncoderBuffer])
+    {
+        NVENC_API_CALL(m_nvenc.nvEncUnmapInputResource(m_hEncoder, m_vMappedInputBuffers[m_iGot % m_nEncoderBuffer]));
+        m_vMappedInputBuffers[m_iGot % m_nEncoderBuffer] = nullptr;
+    }
+
+    if (m_bMotionEstimationOnly && m_vMappedRefBuffers[m_iGot % m_nEncoderBuffer])
+    {
+        NVENC_API_CALL(m_nvenc.nvEncUnmapInputResource(m_hEncoder, m_vMappedRefBuffers[m_iGot % m_nEncoderBuffer]));
+        m_vMappedRefBuffers[m_iGot % m_nEncoderBuffer] = nullptr;
+    }
+}
+
+void NvEncoder::RetrieveSubFrames(NV_ENC_OUTPUT_PTR outputBuffer)
+{
+    uint32_t sentSize = 0;
+    while (true)
+    {
+        NV_ENC_LOCK_BITSTREAM lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
+        lockBitstreamData.outputBitstream = outputBuffer;
+        lockBitstreamData.doNotWait = true;
+        lockBitstreamData.getRCStats = 1;
+        NVENCSTATUS nvStatus = m_nvenc.nvEncLockBitstream(m_hEncoder, &lockBitstreamData);
+        if (nvStatus == NV_ENC_ERR_LOCK_BUSY)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        NVENC_API_CALL(nvStatus);
+
+        // The bitstream only grows by whole slices, hwEncodeStatus is 2 once the frame is complete
+        bool complete = lockBitstreamData.hwEncodeStatus == 2;
+        uint32_t size = lockBitstreamData.bitstreamSizeInBytes;
+        if (size > sentSize || complete)
         {
-            NVENC_API_CALL(m_nvenc.nvEncUnmapInputResource(m_hEncoder, m_vMappedInputBuffers[m_iGot % m_nEncoderBuffer]));
-            m_vMappedInputBuffers[m_iGot % m_nEncoderBuffer] = nullptr;
+            m_subFrameCallback((const uint8_t *)lockBitstreamData.bitstreamBufferPtr + sentSize, size - sentSize, complete);
+            sentSize = size;
+        }
+        if (complete)
+        {
+            m_lastFrameStats = { lockBitstreamData.frameAvgQP, lockBitstreamData.intraMBCount, lockBitstreamData.interMBCount, size };
         }
 
-        if (m_bMotionEstimationOnly && m_vMappedRefBuffers[m_iGot % m_nEncoderBuffer])
+        NVENC_API_CALL(m_nvenc.nvEncUnlockBitstream(m_hEncoder, lockBitstreamData.outputBitstream));
+        if (complete)
         {
-            NVENC_API_CALL(m_nvenc.nvEncUnmapInputResource(m_hEncoder, m_vMappedRefBuffers[m_iGot % m_nEncoderBuffer]));
-            m_vMappedRefBuffers[m_iGot % m_nEncoderBuffer] = nullptr;
+            return;
         }
+        // The slices take a fraction of a millisecond each, sleeping would overshoot them
+        std::this_thread::yield();
     }
 }
 
+void NvEncoder::SetSubFrameCallback(std::function<void(const uint8_t *data, uint32_t size, bool last)> callback)
+{
+    m_subFrameCallback = std::move(callback);
+}
+
 bool NvEncoder::Reconfigure(const NV_ENC_RECONFIGURE_PARAMS *pReconfigureParams)
 {
     NVENC_API_CALL(m_nvenc.nvEncReconfigureEncoder(m_hEncoder, const_cast<NV_ENC_RECONFIGURE_PARAMS*>(pReconfigureParams)));
@@ -648,6 +747,11 @@ bool NvEncoder::Reconfigure(const NV_ENC_RECONFIGURE_PARAMS *pReconfigureParams)
     return true;
 }
 
+void NvEncoder::InvalidateRefFrame(uint64_t invalidRefFrameTimeStamp)
+{
+    NVENC_API_CALL(m_nvenc.nvEncInvalidateRefFrames(m_hEncoder, invalidRefFrameTimeStamp));
+}
+
 NV_ENC_REGISTERED_PTR NvEncoder::RegisterResource(void *pBuffer, NV_ENC_INPUT_RESOURCE_TYPE eResourceType,
     int width, int height, int pitch, NV_ENC_BUFFER_FORMAT bufferFormat, NV_ENC_BUFFER_USAGE bufferUsage, 
     NV_ENC_FENCE_POINT_D3D12* pInputFencePoint)
@@ -12,7 +12,14 @@
 #pragma once
 
 #include <vector>
+// On Linux the header of nv-codec-headers, which the CUDA loader includes too and which is newer
+// than the vendored one
+#if __has_include(<ffnvcodec/nvEncodeAPI.h>)
+#include <ffnvcodec/nvEncodeAPI.h>
+#else
 #include "alvr_server/nvEncodeAPI.h"
+#endif
+#include <functional>
 #include <stdint.h>
 #include <mutex>
 #include <string>
@@ -109,6 +116,13 @@ public:
     */
     bool Reconfigure(const NV_ENC_RECONFIGURE_PARAMS *pReconfigureParams);
 
+    /**
+    *  @brief  This function is used to invalidate a reference frame, identified by the
+    *  NV_ENC_PIC_PARAMS::inputTimeStamp it was encoded with. The next frames don't reference it.
+    *  Requires NV_ENC_CAPS_SUPPORT_REF_PIC_INVALIDATION.
+    */
+    void InvalidateRefFrame(uint64_t invalidRefFrameTimeStamp);
+
     /**
     *  @brief  This function is used to get the next available input buffer.
     *  Applications must call this function to obtain a pointer to the next
@@ -126,6 +140,28 @@ public:
     */
     virtual void EncodeFrame(std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_PIC_PARAMS *pPicParams = nullptr);
 
+    /**
+    *  @brief  This function is used to submit a frame without waiting for its output.
+    *  The output is retrieved in submission order with GetSubmittedPacket(), which can be called
+    *  from another thread. The application must not submit more than GetEncoderBufferCount()
+    *  frames which were not retrieved yet, as their input and output buffers are reused.
+    */
+    void SubmitFrame(NV_ENC_PIC_PARAMS *pPicParams = nullptr);
+
+    /**
+    *  @brief  This function is used to wait for the oldest frame passed to SubmitFrame() and
+    *  copy its bitstream to packet.
+    */
+    void GetSubmittedPacket(std::vector<uint8_t> &packet);
+
+    /**
+    *  @brief  This function is used to receive the bitstream while the frame is still encoding.
+    *  With NV_ENC_INITIALIZE_PARAMS::enableSubFrameWrite the slices completed so far are passed to
+    *  callback as they come out of the encoder, and the packets of the frame are left empty.
+    *  last is set on the call completing the frame, possibly with no data.
+    */
+    void SetSubFrameCallback(std::function<void(const uint8_t *data, uint32_t size, bool last)> callback);
+
     /**
     *  @brief  This function to flush the encoder queue.
     *  The encoder might be queuing frames for B picture encoding or lookahead;
@@ -164,6 +200,23 @@ public:
     */
     int GetEncodeHeight() const { return m_nHeight; }
 
+    /**
+    *  @brief  Rate control statistics of a frame. The blocks are macroblocks for H264, CTBs for
+    *  HEVC and superblocks for AV1.
+    */
+    struct FrameStats
+    {
+        uint32_t averageQp;
+        uint32_t intraBlocks;
+        uint32_t interBlocks;
+        uint32_t sizeInBytes;
+    };
+
+    /**
+    *  @brief  This function is used to get the statistics of the frame retrieved last.
+    */
+    const FrameStats &GetLastFrameStats() const { return m_lastFrameStats; }
+
     /**
     *   @brief  This function is used to get the current frame size based on pixel format.
     */
@@ -361,6 +414,18 @@ private:
     */
     void GetEncodedPacket(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer, std::vector<std::vector<uint8_t>> &vPacket, bool bOutputDelay);
 
+    /**
+    *  @brief This is a private function which is used to lock the bitstream of the frame
+    *         m_iGot, copy it to packet and release its input buffer.
+    */
+    void RetrievePacket(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer, std::vector<uint8_t> &packet);
+
+    /**
+    *  @brief This is a private function which is used to poll the bitstream of the frame m_iGot
+    *         and pass its slices to the sub-frame callback until the frame is complete.
+    */
+    void RetrieveSubFrames(NV_ENC_OUTPUT_PTR outputBuffer);
+
     /**
     *  @brief This is a private function which is used to initialize the bitstream buffers.
     *  This is only used in the encoding mode.
@@ -441,6 +506,8 @@ private:
     bool m_bEncoderInitialized = false;
     uint32_t m_nExtraOutputDelay = 3; // To ensure encode and graphics can work in parallel, m_nExtraOutputDelay should be set to at least 1
     std::vector<NV_ENC_OUTPUT_PTR> m_vBitstreamOutputBuffer;
+    std::function<void(const uint8_t *data, uint32_t size, bool last)> m_subFrameCallback;
+    FrameStats m_lastFrameStats = {};
     std::vector<NV_ENC_OUTPUT_PTR> m_vMVDataOutputBuffer;
     uint32_t m_nMaxEncodeWidth = 0;
     uint32_t m_nMaxEncodeHeight = 0;
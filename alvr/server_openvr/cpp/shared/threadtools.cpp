@@ -1,6 +1,24 @@
 //===================== Copyright (c) Valve Corporation. All Rights Reserved. ======================
 #include "threadtools.h"
 
+#include <chrono>
+
+#if defined( _M_X64 ) || defined( _M_IX86 ) || defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define CPU_RELAX() _mm_pause()
+#else
+#define CPU_RELAX() std::this_thread::yield()
+#endif
+
+#ifdef _WIN32
+#pragma comment( lib, "Synchronization.lib" )
+#elif defined( __linux__ )
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
 //--------------------------------------------------------------------------------------------------
 //--------------------------------------------------------------------------------------------------
 CThread::CThread()
@@ -36,43 +54,122 @@ void CThread::Join()
 	}
 }
 
-#ifdef _WIN32
+#if defined( _WIN32 ) || defined( __linux__ )
+// A few microseconds, about the time the other thread takes to get to the event
+static const int k_nSpinCount = 256;
+
 //--------------------------------------------------------------------------------------------------
 //--------------------------------------------------------------------------------------------------
 CThreadEvent::CThreadEvent( bool bManualReset )
+	: m_bManualReset( bManualReset )
+	, m_nState( 0 )
+	, m_nWaiters( 0 )
+{}
+
+//--------------------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------------------
+bool CThreadEvent::Wait( uint32_t nTimeoutMs )
 {
-	m_hSyncObject = CreateEvent( NULL, bManualReset, FALSE, NULL );
+	for ( int i = 0; i < k_nSpinCount; i++ )
+	{
+		if ( TryConsume() )
+		{
+			return true;
+		}
+		CPU_RELAX();
+	}
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds( nTimeoutMs );
+
+	// Counted before the state is checked again, so that Set either sees the waiter or is seen
+	m_nWaiters.fetch_add( 1 );
+	bool bSignaled = false;
+	while ( !( bSignaled = TryConsume() ) )
+	{
+		uint32_t nRemainingMs = INFINITE;
+		if ( nTimeoutMs != INFINITE )
+		{
+			auto now = std::chrono::steady_clock::now();
+			if ( now >= deadline )
+			{
+				break;
+			}
+			nRemainingMs = (uint32_t)std::chrono::ceil<std::chrono::milliseconds>( deadline - now ).count();
+		}
+		Block( nRemainingMs );
+	}
+	m_nWaiters.fetch_sub( 1 );
+
+	return bSignaled;
 }
 
 //--------------------------------------------------------------------------------------------------
 //--------------------------------------------------------------------------------------------------
-CThreadEvent::~CThreadEvent()
+bool CThreadEvent::Set()
 {
-	if ( m_hSyncObject )
+	m_nState.store( 1 );
+	if ( m_nWaiters.load() > 0 )
 	{
-		CloseHandle( m_hSyncObject );
+		Wake();
 	}
+	return true;
 }
 
 //--------------------------------------------------------------------------------------------------
 //--------------------------------------------------------------------------------------------------
-bool CThreadEvent::Wait( uint32_t nTimeoutMs )
+bool CThreadEvent::Reset()
 {
-	return WaitForSingleObject( m_hSyncObject, nTimeoutMs ) == WAIT_OBJECT_0;
+	m_nState.store( 0, std::memory_order_relaxed );
+	return true;
 }
 
 //--------------------------------------------------------------------------------------------------
 //--------------------------------------------------------------------------------------------------
-bool CThreadEvent::Set()
+bool CThreadEvent::TryConsume()
 {
-	return SetEvent( m_hSyncObject ) != 0;
+	if ( m_bManualReset )
+	{
+		return m_nState.load( std::memory_order_acquire ) == 1;
+	}
+	uint32_t nSignaled = 1;
+	return m_nState.compare_exchange_strong( nSignaled, 0, std::memory_order_acquire );
 }
 
 //--------------------------------------------------------------------------------------------------
+// Returns once woken, on timeout, or right away if the event is no longer unsignaled
 //--------------------------------------------------------------------------------------------------
-bool CThreadEvent::Reset()
+void CThreadEvent::Block( uint32_t nTimeoutMs )
+{
+	uint32_t nUnsignaled = 0;
+#ifdef _WIN32
+	WaitOnAddress( &m_nState, &nUnsignaled, sizeof( nUnsignaled ), nTimeoutMs );
+#else
+	timespec timeout;
+	timeout.tv_sec = nTimeoutMs / 1000;
+	timeout.tv_nsec = ( nTimeoutMs % 1000 ) * 1000000;
+	syscall( SYS_futex, reinterpret_cast<uint32_t *>( &m_nState ), FUTEX_WAIT_PRIVATE, nUnsignaled,
+		nTimeoutMs == INFINITE ? nullptr : &timeout, nullptr, 0 );
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+// A manual reset event releases every waiter, an auto reset one only the waiter that consumes it
+//--------------------------------------------------------------------------------------------------
+void CThreadEvent::Wake()
 {
-	return ResetEvent( m_hSyncObject ) != 0;
+#ifdef _WIN32
+	if ( m_bManualReset )
+	{
+		WakeByAddressAll( &m_nState );
+	}
+	else
+	{
+		WakeByAddressSingle( &m_nState );
+	}
+#else
+	syscall( SYS_futex, reinterpret_cast<uint32_t *>( &m_nState ), FUTEX_WAKE_PRIVATE,
+		m_bManualReset ? INT32_MAX : 1, nullptr, nullptr, 0 );
+#endif
 }
 
 #endif
@@ -5,11 +5,17 @@
 //==================================================================================================
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <thread>
 #ifdef _WIN32
 #include <windows.h>
 #endif
 
+#ifndef INFINITE
+#define INFINITE 0xFFFFFFFF
+#endif
+
 #define THREAD_PRIORITY_MOST_URGENT 15
 
 class CThread
@@ -25,16 +31,25 @@ private:
 	std::thread *m_pThread;
 };
 
-#ifdef _WIN32
+#if defined( _WIN32 ) || defined( __linux__ )
+// Event between the threads of the process. Wait spins briefly on the state before blocking on
+// its address (WaitOnAddress, futex), and Set only enters the kernel when a thread is blocked, so
+// a handoff to a thread that is already waiting or about to wait costs no system call.
 class CThreadEvent
 {
 public:
 	CThreadEvent( bool bManualReset = false );
-	~CThreadEvent();
 	bool Wait( uint32_t nTimeoutMs = INFINITE );
 	bool Set();
 	bool Reset();
 private:
-	HANDLE m_hSyncObject;
+	bool TryConsume();
+	void Block( uint32_t nTimeoutMs );
+	void Wake();
+
+	bool m_bManualReset;
+	// 1 while signaled, blocked on as a 32 bit word
+	std::atomic<uint32_t> m_nState;
+	std::atomic<uint32_t> m_nWaiters;
 };
 #endif
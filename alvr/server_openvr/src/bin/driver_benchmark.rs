@@ -0,0 +1,162 @@
+// Micro-benchmarks of the primitives the driver runs each frame or tracking tick: the pose
+// history, the NAL parsing, the controller skeleton, the tracker updates, the button dispatch and
+// the property cache. The time and allocations of each call are logged, and the run fails if one
+// of them allocates once warmed up. The driver settings come from the session.
+
+#[allow(
+    non_camel_case_types,
+    non_upper_case_globals,
+    dead_code,
+    non_snake_case,
+    clippy::unseparated_literal_suffix
+)]
+mod bindings {
+    include!(concat!(env!("OUT_DIR"), "/bindings.rs"));
+}
+use bindings::*;
+
+use alvr_filesystem as afs;
+use std::{
+    env,
+    ffi::{CStr, CString, c_char},
+    path::PathBuf,
+    process::ExitCode,
+    ptr,
+};
+
+const HELP: &str = "\
+Usage: alvr_driver_benchmark [OPTIONS]
+
+Options:
+  --session <PATH>        Session file with the driver settings [default: the build's]
+  --iterations <COUNT>    Timed calls of each primitive [default: 100000]
+  --trackers <COUNT>      Body trackers updated by each tracking tick [default: 8]
+  --bitstream <PATH>      Bitstream written by alvr_encode_benchmark --output to parse instead of
+                          the synthetic frames of its codec
+  --codec <CODEC>         Codec of the bitstream: h264, hevc or av1 [default: h264]
+  -h, --help              Print this help
+";
+
+struct Args {
+    session: PathBuf,
+    bitstream: Option<CString>,
+    config: FfiDriverBenchmarkConfig,
+}
+
+// None if only the help was asked for
+fn parse_args() -> Result<Option<Args>, String> {
+    let mut args = Args {
+        session: afs::Layout::new(&afs::streamer_build_dir()).session(),
+        bitstream: None,
+        config: FfiDriverBenchmarkConfig {
+            iterations: 100_000,
+            bodyTrackerCount: 8,
+            bitstreamPath: ptr::null(),
+            bitstreamCodec: 0,
+        },
+    };
+
+    let mut iter = env::args().skip(1);
+    while let Some(arg) = iter.next() {
+        let mut value = || iter.next().ok_or(format!("Missing value for {arg}"));
+        let parse_error = |value: &str| format!("Invalid value for {arg}: {value}");
+
+        match arg.as_str() {
+            "--session" => args.session = PathBuf::from(value()?),
+            "--iterations" => {
+                let value = value()?;
+                args.config.iterations = value.parse().map_err(|_| parse_error(&value))?;
+            }
+            "--trackers" => {
+                let value = value()?;
+                args.config.bodyTrackerCount = value.parse().map_err(|_| parse_error(&value))?;
+            }
+            "--bitstream" => {
+                args.bitstream = Some(CString::new(value()?).map_err(|e| e.to_string())?)
+            }
+            "--codec" => {
+                // Same values as ALVR_CODEC
+                args.config.bitstreamCodec = match value()?.as_str() {
+                    "h264" => 0,
+                    "hevc" => 1,
+                    "av1" => 2,
+                    other => return Err(parse_error(other)),
+                }
+            }
+            "-h" | "--help" => {
+                print!("{HELP}");
+                return Ok(None);
+            }
+            other => return Err(format!("Unknown argument {other}\n\n{HELP}")),
+        }
+    }
+
+    Ok(Some(args))
+}
+
+fn log(level: &str, string_ptr: *const c_char) {
+    let message = unsafe { CStr::from_ptr(string_ptr) }.to_string_lossy();
+    if level.is_empty() {
+        println!("{message}");
+    } else {
+        eprintln!("{level}: {message}");
+    }
+}
+
+extern "C" fn log_error(string_ptr: *const c_char) {
+    log("ERROR", string_ptr);
+}
+
+extern "C" fn log_warn(string_ptr: *const c_char) {
+    log("WARN", string_ptr);
+}
+
+extern "C" fn log_info(string_ptr: *const c_char) {
+    log("", string_ptr);
+}
+
+extern "C" fn log_debug(_string_ptr: *const c_char) {
+    // The debug messages of the devices would be mixed with the results
+}
+
+extern "C" fn log_periodically(_tag: *const c_char, string_ptr: *const c_char) {
+    log("", string_ptr);
+}
+
+fn main() -> ExitCode {
+    let args = match parse_args() {
+        Ok(Some(args)) => args,
+        Ok(None) => return ExitCode::SUCCESS,
+        Err(message) => {
+            eprintln!("{message}");
+            return ExitCode::FAILURE;
+        }
+    };
+
+    let session = CString::new(args.session.to_string_lossy().to_string()).unwrap();
+    let mut config = args.config;
+    config.bitstreamPath = args
+        .bitstream
+        .as_ref()
+        .map_or(ptr::null(), |path| path.as_ptr());
+
+    let ok = unsafe {
+        g_sessionPath = session.as_ptr();
+
+        LogError = Some(log_error);
+        LogWarn = Some(log_warn);
+        LogInfo = Some(log_info);
+        LogDebug = Some(log_debug);
+        LogEncoder = Some(log_debug);
+        LogPeriodically = Some(log_periodically);
+        PathStringToHash = Some(alvr_server_core::alvr_path_to_id);
+
+        RunDriverBenchmark(&config)
+    };
+
+    if ok {
+        ExitCode::SUCCESS
+    } else {
+        ExitCode::FAILURE
+    }
+}
@@ -0,0 +1,232 @@
+// Offline benchmark of the driver's compositor and encoders. Frames are fed at a fixed
+// resolution, codec and bitrate without SteamVR or a client, then the encode latency, throughput,
+// bitstream size and quality are logged. The other encoder settings come from the session.
+
+#[path = "../graphics.rs"]
+mod graphics;
+
+#[allow(
+    non_camel_case_types,
+    non_upper_case_globals,
+    dead_code,
+    non_snake_case,
+    clippy::unseparated_literal_suffix
+)]
+mod bindings {
+    include!(concat!(env!("OUT_DIR"), "/bindings.rs"));
+}
+use bindings::*;
+
+use alvr_filesystem as afs;
+use std::{
+    env,
+    ffi::{CStr, CString, c_char},
+    path::PathBuf,
+    process::ExitCode,
+    ptr,
+};
+
+const HELP: &str = "\
+Usage: alvr_encode_benchmark [OPTIONS]
+
+Options:
+  --session <PATH>        Session file with the encoder settings [default: the build's]
+  --backend <BACKEND>     auto, software, amf, nvenc, qsv or vaapi [default: auto]
+  --codec <CODEC>         h264, hevc or av1 [default: h264]
+  --10bit                 Use the 10 bit encoder (HEVC and AV1)
+  --resolution <WxH>      Combined size of both eyes [default: 2880x1600]
+  --fps <FPS>             [default: 72]
+  --bitrate <MBPS>        [default: 30]
+  --frames <COUNT>        Measured frames [default: 600]
+  --warmup <COUNT>        Frames encoded before measuring [default: 30]
+  --input <PATH>          Raw RGBA frames of the resolution, looped over [default: synthetic]
+  --replay <PATH>         Frame recording of the streamer to loop over instead, which sets the
+                          resolution, fps, bitrate and IDR frames
+  --output <PATH>         Write the bitstream to this file
+  --no-quality            Don't decode the bitstream to compute PSNR and SSIM
+  --driver                Present the frames to the driver as SteamVR would and let its encoder
+                          thread composite and encode them with the passes of the session, to
+                          measure the whole cost from present to the NALs. Only the auto and
+                          software backends apply, quality is not measured
+  --probe                 Encode with each backend at the codec, resolution and fps of the
+                          session instead, then save the results next to it for the driver to
+                          start the fastest one. Only --bitrate, --frames and --warmup apply
+  -h, --help              Print this help
+";
+
+struct Args {
+    session: PathBuf,
+    input: Option<CString>,
+    replay: Option<CString>,
+    output: Option<CString>,
+    probe: bool,
+    config: FfiEncodeBenchmarkConfig,
+}
+
+// None if only the help was asked for
+fn parse_args() -> Result<Option<Args>, String> {
+    let mut args = Args {
+        session: afs::Layout::new(&afs::streamer_build_dir()).session(),
+        input: None,
+        replay: None,
+        output: None,
+        probe: false,
+        config: FfiEncodeBenchmarkConfig {
+            backend: FfiEncodeBenchmarkBackend_ENCODE_BENCHMARK_BACKEND_AUTO,
+            codec: 0,
+            use10bit: false,
+            width: 2880,
+            height: 1600,
+            framerate: 72.0,
+            bitrateBps: 30_000_000,
+            warmupFrames: 30,
+            frameCount: 600,
+            inputPath: ptr::null(),
+            replayPath: ptr::null(),
+            outputPath: ptr::null(),
+            measureQuality: true,
+            driverPath: false,
+        },
+    };
+
+    let mut iter = env::args().skip(1);
+    while let Some(arg) = iter.next() {
+        let mut value = || iter.next().ok_or(format!("Missing value for {arg}"));
+        let parse_error = |value: &str| format!("Invalid value for {arg}: {value}");
+
+        match arg.as_str() {
+            "--session" => args.session = PathBuf::from(value()?),
+            "--backend" => {
+                args.config.backend = match value()?.as_str() {
+                    "auto" => FfiEncodeBenchmarkBackend_ENCODE_BENCHMARK_BACKEND_AUTO,
+                    "software" => FfiEncodeBenchmarkBackend_ENCODE_BENCHMARK_BACKEND_SOFTWARE,
+                    "amf" => FfiEncodeBenchmarkBackend_ENCODE_BENCHMARK_BACKEND_AMF,
+                    "nvenc" => FfiEncodeBenchmarkBackend_ENCODE_BENCHMARK_BACKEND_NVENC,
+                    "qsv" => FfiEncodeBenchmarkBackend_ENCODE_BENCHMARK_BACKEND_QSV,
+                    "vaapi" => FfiEncodeBenchmarkBackend_ENCODE_BENCHMARK_BACKEND_VAAPI,
+                    other => return Err(parse_error(other)),
+                }
+            }
+            "--codec" => {
+                // Same values as ALVR_CODEC
+                args.config.codec = match value()?.as_str() {
+                    "h264" => 0,
+                    "hevc" => 1,
+                    "av1" => 2,
+                    other => return Err(parse_error(other)),
+                }
+            }
+            "--10bit" => args.config.use10bit = true,
+            "--resolution" => {
+                let value = value()?;
+                let (width, height) = value
+                    .split_once('x')
+                    .and_then(|(w, h)| Some((w.parse().ok()?, h.parse().ok()?)))
+                    .ok_or(parse_error(&value))?;
+                args.config.width = width;
+                args.config.height = height;
+            }
+            "--fps" => {
+                let value = value()?;
+                args.config.framerate = value.parse().map_err(|_| parse_error(&value))?;
+            }
+            "--bitrate" => {
+                let value = value()?;
+                let mbps = value.parse::<f64>().map_err(|_| parse_error(&value))?;
+                args.config.bitrateBps = (mbps * 1e6) as u64;
+            }
+            "--frames" => {
+                let value = value()?;
+                args.config.frameCount = value.parse().map_err(|_| parse_error(&value))?;
+            }
+            "--warmup" => {
+                let value = value()?;
+                args.config.warmupFrames = value.parse().map_err(|_| parse_error(&value))?;
+            }
+            "--input" => args.input = Some(CString::new(value()?).map_err(|e| e.to_string())?),
+            "--replay" => args.replay = Some(CString::new(value()?).map_err(|e| e.to_string())?),
+            "--output" => args.output = Some(CString::new(value()?).map_err(|e| e.to_string())?),
+            "--no-quality" => args.config.measureQuality = false,
+            "--driver" => args.config.driverPath = true,
+            "--probe" => args.probe = true,
+            "-h" | "--help" => {
+                print!("{HELP}");
+                return Ok(None);
+            }
+            other => return Err(format!("Unknown argument {other}\n\n{HELP}")),
+        }
+    }
+
+    Ok(Some(args))
+}
+
+fn log(level: &str, string_ptr: *const c_char) {
+    let message = unsafe { CStr::from_ptr(string_ptr) }.to_string_lossy();
+    if level.is_empty() {
+        println!("{message}");
+    } else {
+        eprintln!("{level}: {message}");
+    }
+}
+
+extern "C" fn log_error(string_ptr: *const c_char) {
+    log("ERROR", string_ptr);
+}
+
+extern "C" fn log_warn(string_ptr: *const c_char) {
+    log("WARN", string_ptr);
+}
+
+extern "C" fn log_info(string_ptr: *const c_char) {
+    log("", string_ptr);
+}
+
+extern "C" fn log_debug(string_ptr: *const c_char) {
+    log("DEBUG", string_ptr);
+}
+
+extern "C" fn log_periodically(_tag: *const c_char, string_ptr: *const c_char) {
+    log("", string_ptr);
+}
+
+fn main() -> ExitCode {
+    let args = match parse_args() {
+        Ok(Some(args)) => args,
+        Ok(None) => return ExitCode::SUCCESS,
+        Err(message) => {
+            eprintln!("{message}");
+            return ExitCode::FAILURE;
+        }
+    };
+
+    let session = CString::new(args.session.to_string_lossy().to_string()).unwrap();
+    let mut config = args.config;
+    config.inputPath = args.input.as_ref().map_or(ptr::null(), |path| path.as_ptr());
+    config.replayPath = args.replay.as_ref().map_or(ptr::null(), |path| path.as_ptr());
+    config.outputPath = args.output.as_ref().map_or(ptr::null(), |path| path.as_ptr());
+
+    graphics::initialize_shaders();
+
+    let ok = unsafe {
+        g_sessionPath = session.as_ptr();
+
+        LogError = Some(log_error);
+        LogWarn = Some(log_warn);
+        LogInfo = Some(log_info);
+        LogDebug = Some(log_debug);
+        LogEncoder = Some(log_debug);
+        LogPeriodically = Some(log_periodically);
+
+        if args.probe {
+            RunEncoderProbe(&config)
+        } else {
+            RunEncodeBenchmark(&config)
+        }
+    };
+
+    if ok {
+        ExitCode::SUCCESS
+    } else {
+        ExitCode::FAILURE
+    }
+}
@@ -6,6 +6,16 @@ static COMPRESS_AXIS_ALIGNED_CSO: &[u8] =
 static COLOR_CORRECTION_CSO: &[u8] =
     include_bytes!("../cpp/platform/win32/ColorCorrectionPixelShader.cso");
 static RGBTOYUV420_CSO: &[u8] = include_bytes!("../cpp/platform/win32/rgbtoyuv420.cso");
+// Compiled at runtime, specialized for the enabled post-processing features
+static FUSED_POST_PROCESS_HLSL: &[u8] =
+    include_bytes!("../cpp/alvr_server/shader/FusedPostProcessCS.hlsl");
+static STATIC_TILES_HLSL: &[u8] = include_bytes!("../cpp/alvr_server/shader/StaticTilesCS.hlsl");
+static OVERLAY_COVERAGE_HLSL: &[u8] =
+    include_bytes!("../cpp/alvr_server/shader/OverlayCoverageCS.hlsl");
+static HIDDEN_AREA_MASK_HLSL: &[u8] =
+    include_bytes!("../cpp/alvr_server/shader/HiddenAreaMask.hlsl");
+static FRAME_RENDER_FX: &[u8] = include_bytes!("../cpp/alvr_server/shader/FrameRender.fx");
+static FRAME_UPSCALE_HLSL: &[u8] = include_bytes!("../cpp/alvr_server/shader/FrameUpscalePS.hlsl");
 
 static QUAD_SHADER_COMP_SPV: &[u8] = include_bytes!("../cpp/platform/linux/shader/quad.comp.spv");
 static COLOR_SHADER_COMP_SPV: &[u8] = include_bytes!("../cpp/platform/linux/shader/color.comp.spv");
@@ -27,6 +37,18 @@ pub fn initialize_shaders() {
         crate::COLOR_CORRECTION_CSO_LEN = COLOR_CORRECTION_CSO.len() as _;
         crate::RGBTOYUV420_CSO_PTR = RGBTOYUV420_CSO.as_ptr();
         crate::RGBTOYUV420_CSO_LEN = RGBTOYUV420_CSO.len() as _;
+        crate::FUSED_POST_PROCESS_HLSL_PTR = FUSED_POST_PROCESS_HLSL.as_ptr();
+        crate::FUSED_POST_PROCESS_HLSL_LEN = FUSED_POST_PROCESS_HLSL.len() as _;
+        crate::STATIC_TILES_HLSL_PTR = STATIC_TILES_HLSL.as_ptr();
+        crate::STATIC_TILES_HLSL_LEN = STATIC_TILES_HLSL.len() as _;
+        crate::OVERLAY_COVERAGE_HLSL_PTR = OVERLAY_COVERAGE_HLSL.as_ptr();
+        crate::OVERLAY_COVERAGE_HLSL_LEN = OVERLAY_COVERAGE_HLSL.len() as _;
+        crate::HIDDEN_AREA_MASK_HLSL_PTR = HIDDEN_AREA_MASK_HLSL.as_ptr();
+        crate::HIDDEN_AREA_MASK_HLSL_LEN = HIDDEN_AREA_MASK_HLSL.len() as _;
+        crate::FRAME_RENDER_FX_PTR = FRAME_RENDER_FX.as_ptr();
+        crate::FRAME_RENDER_FX_LEN = FRAME_RENDER_FX.len() as _;
+        crate::FRAME_UPSCALE_HLSL_PTR = FRAME_UPSCALE_HLSL.as_ptr();
+        crate::FRAME_UPSCALE_HLSL_LEN = FRAME_UPSCALE_HLSL.len() as _;
         crate::QUAD_SHADER_COMP_SPV_PTR = QUAD_SHADER_COMP_SPV.as_ptr();
         crate::QUAD_SHADER_COMP_SPV_LEN = QUAD_SHADER_COMP_SPV.len() as _;
         crate::COLOR_SHADER_COMP_SPV_PTR = COLOR_SHADER_COMP_SPV.as_ptr();
@@ -23,13 +23,16 @@ use alvr_common::{
 };
 use alvr_filesystem as afs;
 use alvr_packets::{ButtonValue, Haptics};
-use alvr_server_core::{HandType, ServerCoreContext, ServerCoreEvent};
+use alvr_server_core::{
+    DriverCounters, EncoderStats, FrameStageTimestamps, GpuUtilization, HandType,
+    ServerCoreContext, ServerCoreEvent, VideoPayload,
+};
 use alvr_session::{CodecType, ControllersConfig};
 use std::{
     collections::VecDeque,
     ffi::{CString, OsStr, c_char, c_void},
     ptr,
-    sync::{Once, mpsc},
+    sync::{Once, OnceLock, mpsc},
     thread,
     time::{Duration, Instant},
 };
@@ -37,9 +40,13 @@ use std::{
 static SERVER_CORE_CONTEXT: RwLock<Option<ServerCoreContext>> = RwLock::new(None);
 static LOCAL_VIEW_PARAMS: RwLock<[ViewParams; 2]> = RwLock::new([ViewParams::DUMMY; 2]);
 static HEAD_POSE_QUEUE: Mutex<VecDeque<(Duration, Pose)>> = Mutex::new(VecDeque::new());
+static HAPTICS_SENDER: OnceLock<mpsc::Sender<Haptics>> = OnceLock::new();
 
 fn event_loop(events_receiver: mpsc::Receiver<ServerCoreEvent>) {
     thread::spawn(move || {
+        // This thread submits the tracking to SteamVR
+        unsafe { ApplyTrackingThreadPolicy() };
+
         if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
             context.start_connection();
         }
@@ -54,7 +61,7 @@ fn event_loop(events_receiver: mpsc::Receiver<ServerCoreEvent>) {
 
             match event {
                 ServerCoreEvent::SetOpenvrProperty { device_id, prop } => {
-                    props::set_openvr_prop(None, device_id, prop)
+                    props::set_openvr_prop(device_id, prop)
                 }
                 ServerCoreEvent::ClientConnected => unsafe {
                     if InitializeStreaming() {
@@ -222,19 +229,24 @@ fn event_loop(events_receiver: mpsc::Receiver<ServerCoreEvent>) {
                             predictHandSkeleton: predict_hand_skeleton,
                         };
 
-                        let ffi_body_tracker_motions = if track_body || detached_controllers {
-                            tracking::BODY_TRACKER_IDS
-                                .iter()
-                                .filter_map(|id| {
-                                    Some(tracking::to_ffi_motion(
-                                        *id,
-                                        context.get_device_motion(*id, poll_timestamp)?,
-                                    ))
-                                })
-                                .collect::<Vec<_>>()
-                        } else {
-                            vec![]
-                        };
+                        // One slot per BODY_TRACKER_IDS entry, kept on the stack since this runs
+                        // for every tracking update
+                        let mut ffi_body_tracker_motions = [FfiDeviceMotion::default(); 8];
+                        let mut ffi_body_tracker_motion_count = 0;
+                        if track_body || detached_controllers {
+                            for id in tracking::BODY_TRACKER_IDS.iter() {
+                                if let Some(motion) = context.get_device_motion(*id, poll_timestamp)
+                                {
+                                    ffi_body_tracker_motions[ffi_body_tracker_motion_count] =
+                                        tracking::to_ffi_motion(*id, motion);
+                                    ffi_body_tracker_motion_count += 1;
+                                }
+                            }
+                        }
+
+                        let ffi_eye_gaze = context
+                            .get_eye_gaze(poll_timestamp)
+                            .and_then(tracking::to_ffi_eye_gaze);
 
                         // There are two pairs of controllers/hand tracking devices registered in
                         // OpenVR, two lefts and two rights. If enabled with use_separate_hand_trackers,
@@ -248,31 +260,60 @@ fn event_loop(events_receiver: mpsc::Receiver<ServerCoreEvent>) {
                                 ffi_left_hand_data,
                                 ffi_right_hand_data,
                                 ffi_body_tracker_motions.as_ptr(),
-                                ffi_body_tracker_motions.len() as i32,
+                                ffi_body_tracker_motion_count as i32,
+                                if let Some(gaze) = &ffi_eye_gaze {
+                                    gaze
+                                } else {
+                                    ptr::null()
+                                },
                             )
                         };
                     }
                 }
                 ServerCoreEvent::Buttons(entries) => {
-                    for entry in entries {
-                        let value = match entry.value {
-                            ButtonValue::Binary(value) => FfiButtonValue {
-                                type_: FfiButtonType_BUTTON_TYPE_BINARY,
-                                __bindgen_anon_1: FfiButtonValue__bindgen_ty_1 {
-                                    binary: value.into(),
+                    let events = entries
+                        .iter()
+                        .map(|entry| FfiButtonEvent {
+                            buttonID: entry.path_id,
+                            value: match entry.value {
+                                ButtonValue::Binary(value) => FfiButtonValue {
+                                    type_: FfiButtonType_BUTTON_TYPE_BINARY,
+                                    __bindgen_anon_1: FfiButtonValue__bindgen_ty_1 {
+                                        binary: value.into(),
+                                    },
+                                },
+                                ButtonValue::Scalar(value) => FfiButtonValue {
+                                    type_: FfiButtonType_BUTTON_TYPE_SCALAR,
+                                    __bindgen_anon_1: FfiButtonValue__bindgen_ty_1 {
+                                        scalar: value,
+                                    },
                                 },
                             },
+                        })
+                        .collect::<Vec<_>>();
 
-                            ButtonValue::Scalar(value) => FfiButtonValue {
-                                type_: FfiButtonType_BUTTON_TYPE_SCALAR,
-                                __bindgen_anon_1: FfiButtonValue__bindgen_ty_1 { scalar: value },
-                            },
-                        };
-                        unsafe { SetButton(entry.path_id, value) };
-                    }
+                    unsafe { SetButtons(events.as_ptr(), events.len() as i32) };
                 }
                 ServerCoreEvent::RequestIDR => unsafe { RequestIDR() },
+                ServerCoreEvent::VideoFramesLost {
+                    last_received_timestamp,
+                } => unsafe { ReportVideoFramesLost(last_received_timestamp.as_nanos() as u64) },
                 ServerCoreEvent::CaptureFrame => unsafe { CaptureFrame() },
+                ServerCoreEvent::CaptureTrace { path, duration } => {
+                    if let Ok(path) = CString::new(path.to_string_lossy().as_bytes()) {
+                        unsafe { CaptureTrace(path.as_ptr(), duration.as_secs_f32()) };
+                    }
+                }
+                ServerCoreEvent::DumpFlightRecorder(path) => {
+                    if let Ok(path) = CString::new(path.to_string_lossy().as_bytes()) {
+                        unsafe { DumpFlightRecorder(path.as_ptr()) };
+                    }
+                }
+                ServerCoreEvent::RecordFrames { path, frame_count } => {
+                    if let Ok(path) = CString::new(path.to_string_lossy().as_bytes()) {
+                        unsafe { RecordFrames(path.as_ptr(), frame_count) };
+                    }
+                }
                 ServerCoreEvent::GameRenderLatencyFeedback(game_latency) => {
                     if cfg!(target_os = "linux") && game_latency.as_secs_f32() > 0.25 {
                         let now = Instant::now();
@@ -342,19 +383,53 @@ pub unsafe extern "C" fn register_buttons(instance_ptr: *mut c_void, device_id:
     }
 }
 
+// SteamVR hands out the haptic events in RunFrame, which only queues them here. The session lock
+// and the socket are left to the haptics thread so that they don't delay the other driver events
 extern "C" fn send_haptics(device_id: u64, duration_s: f32, frequency: f32, amplitude: f32) {
     if let Ok(duration) = Duration::try_from_secs_f32(duration_s)
-        && let Some(context) = &*SERVER_CORE_CONTEXT.read()
+        && let Some(sender) = HAPTICS_SENDER.get()
     {
-        context.send_haptics(Haptics {
-            device_id,
-            duration,
-            frequency,
-            amplitude,
-        });
+        sender
+            .send(Haptics {
+                device_id,
+                duration,
+                frequency,
+                amplitude,
+            })
+            .ok();
     }
 }
 
+fn haptics_loop(receiver: mpsc::Receiver<Haptics>) {
+    thread::spawn(move || {
+        unsafe { ApplyTrackingThreadPolicy() };
+
+        while let Ok(first) = receiver.recv() {
+            // A pulse replaces the one the controller is playing, so the pulses of a device that
+            // queued up behind the send are merged into the strongest and longest of them
+            let mut pending = vec![first];
+            while let Ok(haptics) = receiver.try_recv() {
+                if let Some(queued) = pending
+                    .iter_mut()
+                    .find(|queued| queued.device_id == haptics.device_id)
+                {
+                    queued.duration = queued.duration.max(haptics.duration);
+                    queued.frequency = haptics.frequency;
+                    queued.amplitude = queued.amplitude.max(haptics.amplitude);
+                } else {
+                    pending.push(haptics);
+                }
+            }
+
+            if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
+                for haptics in pending {
+                    context.send_haptics(haptics);
+                }
+            }
+        }
+    });
+}
+
 extern "C" fn set_video_config_nals(buffer_ptr: *const u8, len: i32, codec: i32) {
     let codec = if codec == 0 {
         CodecType::H264
@@ -373,10 +448,77 @@ extern "C" fn set_video_config_nals(buffer_ptr: *const u8, len: i32, codec: i32)
     }
 }
 
-extern "C" fn send_video(timestamp_ns: u64, buffer_ptr: *mut u8, len: i32, is_idr: bool) {
+extern "C" fn send_spectator_video(buffer_ptr: *const u8, len: i32) {
+    let buffer = unsafe { std::slice::from_raw_parts(buffer_ptr, len as usize) }.to_vec();
+
+    if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
+        context.send_spectator_video(buffer);
+    }
+}
+
+fn nal_slices(ranges: &[FfiNalRange]) -> impl Iterator<Item = &[u8]> {
+    ranges
+        .iter()
+        .filter(|range| range.len > 0)
+        .map(|range| unsafe { std::slice::from_raw_parts(range.data, range.len as usize) })
+}
+
+// Encoded frame still owned by the C++ encoder, which is released once sent
+struct EncoderNals {
+    ranges: Vec<FfiNalRange>,
+    release: unsafe extern "C" fn(*mut c_void),
+    release_context: *mut c_void,
+}
+
+// The encoder keeps the ranges alive until release, which can be called from any thread
+unsafe impl Send for EncoderNals {}
+
+impl VideoPayload for EncoderNals {
+    fn for_each_chunk(&self, f: &mut dyn FnMut(&[u8])) {
+        nal_slices(&self.ranges).for_each(f);
+    }
+}
+
+impl Drop for EncoderNals {
+    fn drop(&mut self) {
+        unsafe { (self.release)(self.release_context) };
+    }
+}
+
+extern "C" fn send_video(
+    timestamp_ns: u64,
+    ranges_ptr: *const FfiNalRange,
+    range_count: i32,
+    is_idr: bool,
+    is_last_slice: bool,
+    temporal_id: i32,
+    release: Option<unsafe extern "C" fn(*mut c_void)>,
+    release_context: *mut c_void,
+) {
+    let ranges = if range_count > 0 {
+        unsafe { std::slice::from_raw_parts(ranges_ptr, range_count as usize) }
+    } else {
+        &[]
+    };
+
+    // Take ownership first so the encoder memory is released on every path
+    let payload: Box<dyn VideoPayload> = if let Some(release) = release {
+        Box::new(EncoderNals {
+            ranges: ranges.to_vec(),
+            release,
+            release_context,
+        })
+    } else {
+        let mut buffer = Vec::new();
+        for slice in nal_slices(ranges) {
+            buffer.extend_from_slice(slice);
+        }
+
+        Box::new(buffer)
+    };
+
     if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
         let timestamp = Duration::from_nanos(timestamp_ns);
-        let buffer = unsafe { std::slice::from_raw_parts(buffer_ptr, len as usize) };
 
         let Some(head_pose) = HEAD_POSE_QUEUE
             .lock()
@@ -400,7 +542,14 @@ extern "C" fn send_video(timestamp_ns: u64, buffer_ptr: *mut u8, len: i32, is_id
             },
         ];
 
-        context.send_video_nal(timestamp, global_view_params, is_idr, buffer.to_vec());
+        context.send_video_nal(
+            timestamp,
+            global_view_params,
+            is_idr,
+            is_last_slice,
+            temporal_id.clamp(0, u8::MAX as i32) as u8,
+            payload,
+        );
     }
 }
 
@@ -412,12 +561,36 @@ extern "C" fn get_dynamic_encoder_params() -> FfiDynamicEncoderParams {
             updated: 1,
             bitrate_bps: params.bitrate_bps as u64,
             framerate: params.framerate,
+            max_frame_bits: params.max_frame_bytes.map_or(0, |bytes| bytes as u64 * 8),
         }
     } else {
         FfiDynamicEncoderParams::default()
     }
 }
 
+extern "C" fn report_encoder_stats(stats: FfiEncoderStats) {
+    if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
+        context.report_encoder_stats(
+            stats.isIdr != 0,
+            EncoderStats {
+                average_qp: (stats.averageQp >= 0.0).then_some(stats.averageQp),
+                intra_ratio: (stats.intraRatio >= 0.0).then_some(stats.intraRatio),
+                vbv_overflow: stats.vbvOverflow != 0,
+                psnr: (stats.psnr >= 0.0).then_some(stats.psnr),
+                ssim: (stats.ssim >= 0.0).then_some(stats.ssim),
+            },
+        );
+    }
+}
+
+extern "C" fn should_encode_frame() -> bool {
+    if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
+        context.should_encode_frame()
+    } else {
+        true
+    }
+}
+
 extern "C" fn report_composed(timestamp_ns: u64, offset_ns: u64) {
     if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
         context.report_composed(
@@ -427,12 +600,83 @@ extern "C" fn report_composed(timestamp_ns: u64, offset_ns: u64) {
     }
 }
 
+extern "C" fn report_missed_vsyncs(count: u64) {
+    if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
+        context.report_missed_vsyncs(count as usize);
+    }
+}
+
 extern "C" fn report_present(timestamp_ns: u64, offset_ns: u64) {
     if let Some(context) = &*SERVER_CORE_CONTEXT.read() {
         context.report_present(
             Duration::from_nanos(timestamp_ns),
             Duration::from_nanos(offset_ns),
         );
+
+        // Present is called once per frame, so this keeps up with the traces ring
+        let mut traces = [FfiFrameTrace::default(); 8];
+        let count = unsafe { PopFrameTraces(traces.as_mut_ptr(), traces.len() as _) } as usize;
+        if count > 0 {
+            let frames = traces[..count]
+                .iter()
+                .map(|trace| {
+                    let stage = |stage: FfiFrameTraceStage| {
+                        let timestamp_ns = trace.stageTimestampsNs[stage as usize];
+                        (timestamp_ns != 0).then(|| Duration::from_nanos(timestamp_ns))
+                    };
+
+                    FrameStageTimestamps {
+                        present: stage(FfiFrameTraceStage_FRAME_TRACE_PRESENT),
+                        pose_matched: stage(FfiFrameTraceStage_FRAME_TRACE_POSE_MATCHED),
+                        composite_begin: stage(FfiFrameTraceStage_FRAME_TRACE_COMPOSITE_BEGIN),
+                        composite_end: stage(FfiFrameTraceStage_FRAME_TRACE_COMPOSITE_END),
+                        encode_submit: stage(FfiFrameTraceStage_FRAME_TRACE_ENCODE_SUBMIT),
+                        encode_complete: stage(FfiFrameTraceStage_FRAME_TRACE_ENCODE_COMPLETE),
+                        first_nal_sent: stage(FfiFrameTraceStage_FRAME_TRACE_FIRST_NAL_SENT),
+                        last_nal_sent: stage(FfiFrameTraceStage_FRAME_TRACE_LAST_NAL_SENT),
+                    }
+                })
+                .collect::<Vec<_>>();
+
+            context.report_frame_stages(&frames);
+        }
+
+        let mut counters = [0; FfiDriverCounter_DRIVER_COUNTER_COUNT as usize];
+        unsafe { GetDriverCounters(counters.as_mut_ptr()) };
+        context.report_driver_counters(DriverCounters {
+            frames_without_pose: counters
+                [FfiDriverCounter_DRIVER_COUNTER_FRAMES_WITHOUT_POSE as usize],
+            idrs_inserted: counters[FfiDriverCounter_DRIVER_COUNTER_IDRS_INSERTED as usize],
+            acquire_sync_failures: counters
+                [FfiDriverCounter_DRIVER_COUNTER_ACQUIRE_SYNC_FAILURES as usize],
+            nal_bytes: counters[FfiDriverCounter_DRIVER_COUNTER_NAL_BYTES as usize],
+            static_frames_skipped: counters
+                [FfiDriverCounter_DRIVER_COUNTER_STATIC_FRAMES_SKIPPED as usize],
+            duplicate_frames: counters[FfiDriverCounter_DRIVER_COUNTER_DUPLICATE_FRAMES as usize],
+            send_queue_frames: counters[FfiDriverCounter_DRIVER_COUNTER_SEND_QUEUE_FRAMES as usize],
+            send_queue_depth_sum: counters
+                [FfiDriverCounter_DRIVER_COUNTER_SEND_QUEUE_DEPTH_SUM as usize],
+            send_queue_dropped_frames: counters
+                [FfiDriverCounter_DRIVER_COUNTER_SEND_QUEUE_DROPPED_FRAMES as usize],
+        });
+
+        let mut samples = [FfiGpuUtilization::default(); 4];
+        let count = unsafe { PopGpuUtilization(samples.as_mut_ptr(), samples.len() as _) } as usize;
+        if count > 0 {
+            let known = |value: f32| (value >= 0.0).then_some(value);
+            let samples = samples[..count]
+                .iter()
+                .map(|sample| GpuUtilization {
+                    timestamp: Duration::from_nanos(sample.timestampNs),
+                    graphics_percent: known(sample.graphicsPercent),
+                    encoder_percent: known(sample.encoderPercent),
+                    pcie_rx_mbytes_per_sec: known(sample.pcieRxMBps),
+                    pcie_tx_mbytes_per_sec: known(sample.pcieTxMBps),
+                })
+                .collect::<Vec<_>>();
+
+            context.report_gpu_utilization(&samples);
+        }
     }
 }
 
@@ -464,6 +708,31 @@ extern "C" fn wait_for_vsync() {
     }
 }
 
+extern "C" fn get_client_pipeline_timing() -> FfiClientPipelineTiming {
+    SERVER_CORE_CONTEXT
+        .read()
+        .as_ref()
+        .and_then(|ctx| ctx.client_pipeline_timing())
+        .map(|(total, network, client)| FfiClientPipelineTiming {
+            totalLatencyNs: total.as_nanos() as u64,
+            networkLatencyNs: network.as_nanos() as u64,
+            clientLatencyNs: client.as_nanos() as u64,
+        })
+        .unwrap_or_default()
+}
+
+extern "C" fn get_vsync_timing() -> FfiVsyncTiming {
+    SERVER_CORE_CONTEXT
+        .read()
+        .as_ref()
+        .and_then(|ctx| ctx.vsync_timing())
+        .map(|(until_next_vsync, interval)| FfiVsyncTiming {
+            untilNextVsyncNs: until_next_vsync.as_nanos() as u64,
+            intervalNs: interval.as_nanos() as u64,
+        })
+        .unwrap_or_default()
+}
+
 pub extern "C" fn shutdown_driver() {
     SERVER_CORE_CONTEXT.write().take();
 }
@@ -521,6 +790,9 @@ pub unsafe extern "C" fn HmdDriverFactory(
             )
             .unwrap()
             .into_raw();
+            g_logDir = CString::new(filesystem_layout.log_dir.to_string_lossy().to_string())
+                .unwrap()
+                .into_raw();
         };
 
         graphics::initialize_shaders();
@@ -539,11 +811,17 @@ pub unsafe extern "C" fn HmdDriverFactory(
             DriverReadyIdle = Some(driver_ready_idle);
             HapticsSend = Some(send_haptics);
             SetVideoConfigNals = Some(set_video_config_nals);
-            VideoSend = Some(send_video);
+            VideoSendV = Some(send_video);
+            SpectatorSend = Some(send_spectator_video);
             GetDynamicEncoderParams = Some(get_dynamic_encoder_params);
+            ReportEncoderStats = Some(report_encoder_stats);
+            ShouldEncodeFrame = Some(should_encode_frame);
             ReportComposed = Some(report_composed);
+            ReportMissedVsyncs = Some(report_missed_vsyncs);
             ReportPresent = Some(report_present);
             WaitForVSync = Some(wait_for_vsync);
+            GetVsyncTiming = Some(get_vsync_timing);
+            GetClientPipelineTiming = Some(get_client_pipeline_timing);
             ShutdownRuntime = Some(shutdown_driver);
 
             // When there is already a ALVR dashboard running, initialize the HMD device early to
@@ -559,6 +837,10 @@ pub unsafe extern "C" fn HmdDriverFactory(
         *SERVER_CORE_CONTEXT.write() = Some(context);
 
         event_loop(events_receiver);
+
+        let (haptics_sender, haptics_receiver) = mpsc::channel();
+        HAPTICS_SENDER.set(haptics_sender).ok();
+        haptics_loop(haptics_receiver);
     });
 
     unsafe { CppOpenvrEntryPoint(interface_name, return_code) }
@@ -17,11 +17,12 @@ use alvr_session::{
     ControllersEmulationMode, HeadsetEmulationMode, OpenvrPropKey, OpenvrPropType, OpenvrProperty,
 };
 use std::{
+    cell::RefCell,
     ffi::{CString, c_char, c_void},
     ptr,
 };
 
-pub fn set_openvr_prop(instance_ptr: Option<*mut c_void>, device_id: u64, prop: OpenvrProperty) {
+fn to_ffi_prop(device_id: u64, prop: OpenvrProperty) -> Option<FfiOpenvrProperty> {
     let key = prop.key as u32;
     let ty = alvr_session::openvr_prop_key_to_type(prop.key);
     let value = prop.value;
@@ -97,20 +98,20 @@ pub fn set_openvr_prop(instance_ptr: Option<*mut c_void>, device_id: u64, prop:
             prop.key
         );
 
-        return;
+        return None;
     };
 
     debug!("Setting {device_name} OpenVR prop: {:?}={value}", prop.key);
 
-    let ffi_prop = FfiOpenvrProperty {
+    Some(FfiOpenvrProperty {
         key,
         type_,
         value: ffi_value,
-    };
+    })
+}
 
-    if let Some(instance_ptr) = instance_ptr {
-        unsafe { crate::SetOpenvrProperty(instance_ptr, ffi_prop) }
-    } else {
+pub fn set_openvr_prop(device_id: u64, prop: OpenvrProperty) {
+    if let Some(ffi_prop) = to_ffi_prop(device_id, prop) {
         unsafe { crate::SetOpenvrPropByDeviceID(device_id, ffi_prop) }
     }
 }
@@ -191,22 +192,29 @@ pub extern "C" fn get_serial_number(device_id: u64, out_str: *mut c_char) -> u64
     len as u64
 }
 
+// Handed to the driver in one call, which sets them in one pass when the device activates
 #[unsafe(no_mangle)]
 pub extern "C" fn set_device_openvr_props(instance_ptr: *mut c_void, device_id: u64) {
+    let props = device_openvr_props(device_id);
+
+    unsafe { crate::SetOpenvrProperties(instance_ptr, props.as_ptr(), props.len() as u32) };
+}
+
+fn device_openvr_props(device_id: u64) -> Vec<FfiOpenvrProperty> {
     #[expect(clippy::enum_glob_use)]
     use OpenvrPropKey::*;
 
     let settings = alvr_server_core::settings();
 
+    let props = RefCell::new(vec![]);
     let set_prop = |key, value: &str| {
-        set_openvr_prop(
-            Some(instance_ptr),
-            device_id,
-            OpenvrProperty {
-                key,
-                value: value.into(),
-            },
-        );
+        let prop = OpenvrProperty {
+            key,
+            value: value.into(),
+        };
+        if let Some(ffi_prop) = to_ffi_prop(device_id, prop) {
+            props.borrow_mut().push(ffi_prop);
+        }
     };
 
     let set_icons = |base_path: &str| {
@@ -655,4 +663,6 @@ pub extern "C" fn set_device_openvr_props(instance_ptr: *mut c_void, device_id:
             }
         }
     }
+
+    props.into_inner()
 }
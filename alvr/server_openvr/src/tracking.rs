@@ -1,4 +1,6 @@
-use crate::{FfiDeviceMotion, FfiFov, FfiHandSkeleton, FfiPose, FfiQuat, FfiViewParams};
+use crate::{
+    FfiDeviceMotion, FfiEyeGaze, FfiFov, FfiHandSkeleton, FfiPose, FfiQuat, FfiViewParams,
+};
 use alvr_common::{
     BODY_CHEST_ID, BODY_HIPS_ID, BODY_LEFT_ELBOW_ID, BODY_LEFT_FOOT_ID, BODY_LEFT_KNEE_ID,
     BODY_RIGHT_ELBOW_ID, BODY_RIGHT_FOOT_ID, BODY_RIGHT_KNEE_ID, DeviceMotion, Fov, HAND_LEFT_ID,
@@ -70,6 +72,16 @@ pub fn to_ffi_view_params(params: ViewParams) -> FfiViewParams {
     }
 }
 
+// None when looking sideways or backwards, where the gaze doesn't hit the view plane
+pub fn to_ffi_eye_gaze(gaze: Quat) -> Option<FfiEyeGaze> {
+    let direction = gaze * Vec3::NEG_Z;
+
+    (-direction.z > 0.01).then(|| FfiEyeGaze {
+        tangentX: direction.x / -direction.z,
+        tangentY: direction.y / -direction.z,
+    })
+}
+
 fn get_hand_skeleton_offsets(config: &HeadsetConfig) -> (Pose, Pose) {
     let left_offset;
     let right_offset;
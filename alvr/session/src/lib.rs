@@ -38,7 +38,20 @@ pub struct OpenvrConfig {
     pub tracking_ref_only: bool,
     pub enable_vive_tracker_proxy: bool,
     pub minimum_idr_interval_ms: u64,
+    pub reference_frame_invalidation: bool,
+    pub skip_static_frames: bool,
+    pub skip_duplicate_frames: bool,
+    pub late_latch_pose: bool,
+    pub share_depth_swap_textures: bool,
+    pub dynamic_resolution_enabled: bool,
+    pub dynamic_resolution_full_mbps: u32,
+    pub dynamic_resolution_min_scale: f32,
+    pub spectator_stream_enabled: bool,
+    pub spectator_width: u32,
+    pub spectator_framerate_divisor: u32,
+    pub spectator_bitrate_mbps: u32,
     pub adapter_index: u32,
+    pub encoder_adapter_index: i32,
     pub codec: u8,
     pub h264_profile: u32,
     pub refresh_rate: u32,
@@ -53,16 +66,44 @@ pub struct OpenvrConfig {
     pub use_amf_preproc: bool,
     pub amf_preproc_sigma: u32,
     pub amf_preproc_tor: u32,
+    pub amf_drain_threads: bool,
+    pub amf_quality_probe_interval: u32,
     pub encoder_quality_preset: u32,
     pub rate_control_mode: u32,
     pub filler_data: bool,
+    pub gradual_intra_refresh: bool,
+    pub gradual_intra_refresh_period: u32,
+    pub encoder_frame_queue_depth: u32,
+    pub encoder_target_latency_ms: u32,
+    // 0 if the overlays aren't given a lower QP
+    pub encoder_overlay_qp_reduction: u32,
+    pub encoder_warmup_frames: u32,
+    pub encoder_temporal_layers: u32,
+    // 0 if the slices aren't sized to the packets
+    pub encoder_slice_size_bytes: u32,
+    // 0 if the frames are sent from the encoder threads
+    pub encoder_send_queue_depth: u32,
+    pub encoder_send_queue_drop_oldest: bool,
+    pub encoder_low_latency_headers: bool,
+    pub encoder_frame_metadata: bool,
+    pub encoder_load_budget_percent: u32,
+    pub encoder_tile_columns: u32,
+    pub encoder_tile_rows: u32,
     pub entropy_coding: u32,
     pub force_sw_encoding: bool,
     pub sw_thread_count: u32,
+    pub sw_sub_frame_output: bool,
+    pub sw_gpu_color_conversion: bool,
+    pub sw_arm64_frame_sharing: bool,
     pub controller_is_tracker: bool,
     pub controllers_enabled: bool,
     pub body_tracking_vive_enabled: bool,
     pub body_tracking_has_legs: bool,
+    pub pose_filter_head: bool,
+    pub pose_filter_trackers: bool,
+    pub pose_filter_min_cutoff_hz: f32,
+    pub pose_filter_beta: f32,
+    pub pose_filter_tracker_prediction_s: f32,
     pub enable_foveated_encoding: bool,
     pub foveation_center_size_x: f32,
     pub foveation_center_size_y: f32,
@@ -70,14 +111,43 @@ pub struct OpenvrConfig {
     pub foveation_center_shift_y: f32,
     pub foveation_edge_ratio_x: f32,
     pub foveation_edge_ratio_y: f32,
+    pub foveated_qp_max_delta: u32,
+    pub foveated_qp_follow_gaze: bool,
+    pub enable_radial_foveation: bool,
+    pub radial_foveation_center_radius: f32,
+    pub radial_foveation_edge_ratio: f32,
     pub enable_color_correction: bool,
     pub brightness: f32,
     pub contrast: f32,
     pub saturation: f32,
     pub gamma: f32,
     pub sharpening: f32,
+    pub color_lut_path: String,
+    // 0 without the hidden area mask
+    pub hidden_area_mask_radius: f32,
+    pub edge_adaptive_upscaling: bool,
     pub linux_async_compute: bool,
     pub linux_async_reprojection: bool,
+    pub linux_pipelined_encoding: bool,
+    pub linux_async_output: bool,
+    pub linux_single_frame_vbv: bool,
+    pub linux_swapchain_images: u32,
+    pub linux_dma_buf_swapchain: bool,
+    pub linux_direct_submit: bool,
+    pub linux_encode_device: String,
+    pub linux_vaapi_color_correction: bool,
+    pub linux_vaapi_async_depth: u32,
+    pub linux_vaapi_denoise: u32,
+    pub linux_vaapi_denoise_max_bitrate_mbps: u32,
+    pub thread_encoder_priority: u32,
+    pub thread_encoder_cpu_mask: u64,
+    pub thread_encoder_output_priority: u32,
+    pub thread_encoder_output_cpu_mask: u64,
+    pub thread_vsync_priority: u32,
+    pub thread_vsync_cpu_mask: u64,
+    pub thread_tracking_priority: u32,
+    pub thread_tracking_cpu_mask: u64,
+    pub gpu_priority: u32,
     pub nvenc_quality_preset: u32,
     pub nvenc_tuning_preset: u32,
     pub nvenc_multi_pass: u32,
@@ -96,7 +166,12 @@ pub struct OpenvrConfig {
     pub rc_max_bitrate: i64,
     pub rc_average_bitrate: i64,
     pub nvenc_enable_weighted_prediction: bool,
+    pub nvenc_async_output: bool,
+    pub nvenc_head_motion_hints: bool,
+    pub nvenc_split_encode: u32,
+    pub nvenc_sub_frame_slices: u32,
     pub capture_frame_dir: String,
+    pub capture_frame_count: u32,
     pub amd_bitrate_corruption_fix: bool,
     pub use_separate_hand_trackers: bool,
 
@@ -145,6 +220,7 @@ impl Default for SessionConfig {
                 target_eye_resolution_width: 800,
                 target_eye_resolution_height: 900,
                 adapter_index: 0,
+                encoder_adapter_index: -1,
                 refresh_rate: 60,
                 controllers_enabled: false,
                 body_tracking_vive_enabled: false,
@@ -70,6 +70,18 @@ pub enum NvencTuningPreset {
     Lossless = 4,
 }
 
+// Values of NV_ENC_SPLIT_ENCODE_MODE
+#[repr(u32)]
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
+pub enum NvencSplitEncode {
+    Auto = 0,
+    #[schema(strings(display_name = "2 engines"))]
+    TwoEngines = 2,
+    #[schema(strings(display_name = "3 engines"))]
+    ThreeEngines = 3,
+    Disabled = 15,
+}
+
 #[repr(u32)]
 #[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
 pub enum NvencMultiPass {
@@ -157,6 +169,33 @@ Temporal: Helps improve overall encoding quality, very small trade-off in speed.
     pub rc_average_bitrate: i64,
     #[schema(flag = "steamvr-restart")]
     pub enable_weighted_prediction: bool,
+    #[schema(strings(
+        display_name = "Async output",
+        help = "Retrieve encoded frames on a separate thread, so that the next frame can be submitted while the previous one is still encoding"
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub async_output: bool,
+    #[schema(strings(
+        display_name = "Head motion hints",
+        help = "Guide the motion search of H.264 and HEVC with the head rotation between frames, so that fast head turns are encoded with fewer bits"
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub head_motion_hints: bool,
+    #[cfg_attr(not(target_os = "linux"), schema(flag = "hidden"))]
+    #[schema(strings(
+        display_name = "Split frame encoding",
+        help = r"This works only on Linux with HEVC or AV1. GPUs with several NVENC engines encode horizontal strips of each frame in parallel, which cuts the encode time of high resolution frames. The client receives a single stream. Auto lets the driver decide. The encoder built on FFmpeg needs FFmpeg 7.0 or newer for it."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub split_encode: NvencSplitEncode,
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        display_name = "Sub-frame slices",
+        help = r"This works only on Windows with H.264 or HEVC, and not with async output. Each frame is encoded as this many slices, which are sent while the rest of the frame is still encoding. 1 sends the frames whole."
+    ))]
+    #[schema(gui(slider(min = 1, max = 8)))]
+    #[schema(flag = "steamvr-restart")]
+    pub sub_frame_slices: u32,
 }
 
 #[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
@@ -188,6 +227,23 @@ Does not work with the "Reduce color banding" option, requires enabling "Use pre
         flag = "steamvr-restart"
     )]
     pub enable_pre_analysis: bool,
+    #[schema(
+        strings(
+            display_name = "Drain on separate threads",
+            help = "Submit frames without waiting for their output, which is retrieved from each AMF component on its own thread"
+        ),
+        flag = "steamvr-restart"
+    )]
+    pub drain_threads: bool,
+    #[schema(
+        strings(
+            display_name = "Quality probe interval",
+            help = r#"Every this many frames, the encoder measures the PSNR and SSIM of its reconstructed frame against the input. They are averaged into the bitrate statistics next to the QP, for tuning the quality preset against the bitrate. 0 disables it"#
+        ),
+        flag = "steamvr-restart"
+    )]
+    #[schema(gui(slider(min = 0, max = 300, step = 10)))]
+    pub quality_probe_interval: u32,
 }
 
 #[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
@@ -195,14 +251,41 @@ Does not work with the "Reduce color banding" option, requires enabling "Use pre
 pub struct SoftwareEncodingConfig {
     #[schema(strings(
         display_name = "Force software encoding",
-        help = "Forces the encoder to use CPU instead of GPU"
+        help = "Forces the encoder to use CPU instead of GPU. The software encoder uses H264, or SVT-AV1 when the codec is AV1 and the encoder has at least 8 threads"
     ))]
     #[schema(flag = "steamvr-restart")]
     pub force_software_encoding: bool,
 
-    #[schema(strings(display_name = "Encoder thread count"))]
+    #[schema(strings(
+        display_name = "Encoder thread count",
+        help = "0 picks the count automatically. On Linux that is one thread per physical performance core, leaving one core to SteamVR"
+    ))]
     #[schema(flag = "steamvr-restart")]
     pub thread_count: u32,
+
+    #[cfg_attr(not(target_os = "linux"), schema(flag = "hidden"))]
+    #[schema(strings(
+        display_name = "Send slices early",
+        help = "Send each slice as soon as it's encoded, so that the network transfer overlaps the rest of the encode. Linux only."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub sub_frame_output: bool,
+
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        display_name = "GPU color conversion",
+        help = "Convert the frame to YUV on the GPU before reading it back. This halves the readback size, and the CPU color conversion is skipped when no scaling is needed. Windows only."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub gpu_color_conversion: bool,
+
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        display_name = "Share frames with the ARM64 encoder",
+        help = "Pass the frames to the ARM64 encoder process as shared GPU textures, encoded with the Media Foundation hardware encoder, instead of reading them back. Falls back to the readback if the encoder process can't use them. Windows on ARM only."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub arm64_frame_sharing: bool,
 }
 
 #[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
@@ -236,7 +319,7 @@ pub struct EncoderConfig {
     #[schema(flag = "steamvr-restart")]
     #[schema(strings(
         display_name = "Quality preset",
-        help = "Controls overall quality preset of the encoder. Works only on Windows AMD AMF, Linux VAAPI (AMD/Intel)."
+        help = "Controls overall quality preset of the encoder. Works only on Windows AMD AMF and Intel QSV, Linux VAAPI (AMD/Intel)."
     ))]
     pub quality_preset: EncoderQualityPreset,
 
@@ -287,6 +370,101 @@ CABAC produces better compression but it's significantly slower and may lead to
     #[schema(flag = "steamvr-restart")]
     pub encoding_gamma: Option<f32>,
 
+    #[schema(strings(
+        display_name = "Gradual intra refresh",
+        help = r#"Refreshes a band of the picture in every frame instead of sending full IDR frames. Frame sizes stay flat, but packet loss is still repaired with an IDR frame, or by invalidating the lost references when the encoder supports it.
+Not supported on Linux with VAAPI."#
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub intra_refresh: Switch<IntraRefreshConfig>,
+
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        help = r#"Composited frames that can wait for the encoder. With 1, a frame the encoder didn't get to is replaced by the next one, so the latest frame is always encoded.
+With more, short encode spikes are absorbed and every frame is encoded in order, the oldest one being dropped when the queue is full. Each frame adds to the latency while the encoder catches up."#
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    #[schema(gui(slider(min = 1, max = 4)))]
+    pub frame_queue_depth: u32,
+
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        display_name = "Overlay QP reduction",
+        help = r#"Lowers the encoder QP where SteamVR overlays and dashboards cover the game, so that their text stays legible at low bitrates. Rate control takes the bits from the rest of the frame, the overall bitrate doesn't change.
+Windows only. Uses the QP map with NVENC and the ROI map with AMF, where the overlays get the highest importance."#
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    #[schema(gui(slider(min = 1, max = 15)))]
+    pub overlay_qp_reduction: Option<u32>,
+
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        help = r#"Blank frames composited and encoded while SteamVR starts, before any client connects, and thrown away. The driver and encoder do their lazy setup on them instead of on the first frames of the stream, which otherwise come with a latency spike. 0 to disable.
+Windows only."#
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    #[schema(gui(slider(min = 0, max = 10)))]
+    pub warmup_frames: u32,
+
+    #[schema(strings(
+        help = r#"Motion-to-photon latency, as reported by the client, that the encoder paces itself for. Above it, the frames waiting for the encoder are skipped to the latest one, and on Linux the encode of a frame is no longer overlapped with the composition of the next one."#
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    #[schema(gui(slider(min = 10, max = 200, step = 5)), suffix = "ms")]
+    pub target_latency_ms: Option<u32>,
+
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        help = r#"Encodes the frames in temporal layers. The frames of the upper layers aren't referenced by the base layer, so when the network can't keep up they are dropped without corrupting the stream, instead of requesting an IDR frame.
+Costs some compression efficiency. Supported by NVENC with H264 and by AMF."#
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    #[schema(gui(slider(min = 1, max = 3)))]
+    pub temporal_layers: u32,
+
+    #[schema(strings(
+        help = r#"Splits the frames in slices that each fit in a single network packet. A lost packet then only damages its slice, the client decodes the rest of the frame and the next one is repaired without an IDR frame, unless "Avoid video glitching" is set. Costs some compression efficiency.
+Supported by NVENC and x264 with H264 and HEVC. AMF uses a slice count estimated from the bitrate."#
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub packet_sized_slices: bool,
+
+    #[schema(strings(
+        help = r#"Hands the encoded frames to a separate thread that sends them, so that a stall of the network side doesn't delay the encoding of the next frame. When the queue is full, frames are dropped and the stream recovers with an IDR frame, except for the frames of the upper temporal layers."#
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub send_queue: Switch<SendQueueConfig>,
+
+    #[schema(strings(
+        display_name = "Low latency decoder headers",
+        help = r#"Rewrites the SPS of H264 and the VPS and SPS of HEVC to signal that no frame is reordered, which some headset decoders need to output each frame as soon as it's decoded instead of holding about one more. Also removes the filler data and the SEI messages, except the recovery points of the gradual intra refresh."#
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub low_latency_decoder_headers: bool,
+
+    #[schema(strings(
+        display_name = "In-band frame metadata",
+        help = r#"Sends the target timestamp, the reprojection flags and, with the IDR frames, the tile layout and the foveation parameters of each frame in the video stream itself, as an SEI message for H264 and HEVC or a metadata OBU for AV1. The decoders skip it."#
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub in_band_frame_metadata: bool,
+
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        display_name = "Adaptive encoder load",
+        help = r#"Watches the encode time of the frames and, while it exceeds its share of the frame interval, turns off the costlier encoder features: the multiple passes, then the adaptive quantization. They come back once the encode time has headroom again. NVENC on Windows only."#
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub adaptive_encoder_load: Switch<AdaptiveEncoderLoadConfig>,
+
+    #[schema(strings(
+        display_name = "Decoder tiles",
+        help = r#"Splits the frames in a grid that the headset decoder can decode in parallel, which lowers the decode latency at high resolutions. AV1 uses tiles. H264 and HEVC use as many slices, as bands, except with VAAPI which has HEVC tiles.
+Supported by NVENC, AMF, VAAPI and x264."#
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub decoder_tiles: DecoderTilesConfig,
+
     #[schema(strings(display_name = "HDR"))]
     #[schema(flag = "steamvr-restart")]
     pub hdr: HDRConfig,
@@ -397,6 +575,93 @@ pub enum BitrateMode {
     },
 }
 
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
+pub enum DecoderTilesConfig {
+    #[schema(strings(
+        help = "The layout the client reports for its decoder, a single tile if none"
+    ))]
+    Auto,
+    Custom {
+        #[schema(gui(slider(min = 1, max = 8)))]
+        columns: u32,
+        #[schema(gui(slider(min = 1, max = 8)))]
+        rows: u32,
+    },
+}
+
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
+pub struct AdaptiveEncoderLoadConfig {
+    #[schema(strings(
+        display_name = "Encode time budget",
+        help = "Share of the frame interval the encode of a frame may take"
+    ))]
+    #[schema(gui(slider(min = 30, max = 100, step = 5)), suffix = "%")]
+    pub budget_percent: u32,
+}
+
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, Copy, PartialEq)]
+pub enum SendQueueFullPolicy {
+    #[schema(strings(
+        help = "The oldest frames waiting in the queue are dropped, the latest ones are sent"
+    ))]
+    DropOldest,
+    #[schema(strings(
+        display_name = "Request IDR",
+        help = "The new frame is dropped and an IDR frame is requested right away, the frames in the queue are still sent"
+    ))]
+    RequestIdr,
+}
+
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
+pub struct SendQueueConfig {
+    #[schema(strings(display_name = "Queue depth"))]
+    #[schema(gui(slider(min = 1, max = 8)), suffix = " frames")]
+    pub depth_frames: u32,
+
+    #[schema(strings(display_name = "When full"))]
+    pub full_policy: SendQueueFullPolicy,
+}
+
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
+pub struct IntraRefreshConfig {
+    #[schema(strings(
+        display_name = "Refresh period",
+        help = "Number of frames over which every part of the picture is intra coded once. A lost frame is repaired within this many frames."
+    ))]
+    #[schema(gui(slider(min = 10, max = 600, step = 10)), suffix = " frames")]
+    pub period_frames: u32,
+}
+
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
+pub struct DynamicResolutionConfig {
+    #[schema(strings(
+        display_name = "Full resolution bitrate",
+        help = "At this bitrate and above the full resolution is encoded. Below it the pixel count follows the bitrate."
+    ))]
+    #[schema(gui(slider(min = 10, max = 200, step = 5)), suffix = " Mbps")]
+    pub full_resolution_mbps: u32,
+    #[schema(strings(
+        display_name = "Minimum scale",
+        help = "Lowest scale of the width and height"
+    ))]
+    #[schema(gui(slider(min = 0.25, max = 1.0, step = 0.05)))]
+    pub min_scale: f32,
+}
+
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
+pub struct SpectatorStreamConfig {
+    #[schema(gui(slider(min = 320, max = 1920, step = 16)), suffix = " px")]
+    pub width: u32,
+    #[schema(strings(
+        display_name = "Framerate divisor",
+        help = "Only one frame out of this many is encoded for the spectators"
+    ))]
+    #[schema(gui(slider(min = 1, max = 6)))]
+    pub framerate_divisor: u32,
+    #[schema(gui(slider(min = 1, max = 20)), suffix = " Mbps")]
+    pub bitrate_mbps: u32,
+}
+
 #[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
 pub struct BitrateAdaptiveFramerateConfig {
     #[schema(strings(
@@ -408,6 +673,19 @@ pub struct BitrateAdaptiveFramerateConfig {
     pub framerate_reset_threshold_multiplier: f32,
 }
 
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
+pub struct FramerateDecimationConfig {
+    #[schema(strings(help = "The full framerate is restored a quarter above it"))]
+    #[schema(flag = "real-time")]
+    #[schema(gui(slider(min = 1, max = 100, logarithmic)), suffix = "Mbps")]
+    pub below_mbps: u64,
+
+    #[schema(strings(help = "One composited frame in this many is encoded"))]
+    #[schema(flag = "real-time")]
+    #[schema(gui(slider(min = 2, max = 4)))]
+    pub divider: u32,
+}
+
 #[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
 #[schema(collapsible)]
 pub struct BitrateConfig {
@@ -420,6 +698,18 @@ pub struct BitrateConfig {
     #[schema(flag = "real-time")]
     pub adapt_to_framerate: Switch<BitrateAdaptiveFramerateConfig>,
 
+    #[schema(strings(
+        help = "Limits the size of each frame, IDRs and scene cuts included, to what the measured network throughput carries in a frame interval"
+    ))]
+    #[schema(flag = "real-time")]
+    pub cap_frame_size: bool,
+
+    #[schema(strings(
+        help = "Below a bitrate, only part of the composited frames are encoded, each with as many times the bits. The headset reprojects the last frame in between"
+    ))]
+    #[schema(flag = "real-time")]
+    pub framerate_decimation: Switch<FramerateDecimationConfig>,
+
     #[schema(strings(help = "Controls the smoothness during calculations"))]
     pub history_size: usize,
 
@@ -489,6 +779,48 @@ pub struct FoveatedEncodingConfig {
     #[schema(gui(slider(min = 1.0, max = 10.0, step = 1.0)))]
     #[schema(flag = "steamvr-restart")]
     pub edge_ratio_y: f32,
+
+    #[schema(strings(
+        display_name = "Encoder quality falloff",
+        help = "Raise the encoder QP from the center region towards the edges of each eye, so that rate control moves the bits to the center. Applies even if the client doesn't support foveated encoding. Uses a QP map with NVENC, the ROI map of AMF and VA-API regions of interest, if the driver supports them."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub qp_falloff: Switch<FoveatedQpFalloffConfig>,
+
+    #[schema(strings(
+        help = "Compress each eye around the center of the lens instead of along each axis, like the lens falloff. The corners get compressed the most, which allows a lower encode resolution. The center region and edge ratio settings above are not used. Only supported by the Windows driver."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub radial: Switch<RadialFoveationConfig>,
+}
+
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
+pub struct RadialFoveationConfig {
+    #[schema(strings(
+        help = "Radius of the full resolution region around the lens center, relative to the distance from the lens center to the edge of the eye"
+    ))]
+    #[schema(gui(slider(min = 0.0, max = 0.9, step = 0.01)))]
+    #[schema(flag = "steamvr-restart")]
+    pub center_radius: f32,
+
+    #[schema(strings(help = "Compression at the edges of the eye, the corners get more"))]
+    #[schema(gui(slider(min = 1.0, max = 10.0, step = 0.5)))]
+    #[schema(flag = "steamvr-restart")]
+    pub edge_ratio: f32,
+}
+
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
+pub struct FoveatedQpFalloffConfig {
+    #[schema(strings(display_name = "Max QP offset"))]
+    #[schema(gui(slider(min = 1, max = 20)))]
+    #[schema(flag = "steamvr-restart")]
+    pub max_qp_delta: u32,
+
+    #[schema(strings(
+        help = "Centers the full quality region on the eye gaze when the headset tracks the eyes"
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub follow_eye_gaze: bool,
 }
 
 #[repr(C)]
@@ -689,6 +1021,16 @@ pub struct UpscalingConfig {
     pub upscale_factor: f32,
 }
 
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, PartialEq)]
+pub struct HiddenAreaMaskConfig {
+    #[schema(strings(
+        help = "Size of the visible ellipse. At 1 it touches the edges of the field of view, above only the corners are masked"
+    ))]
+    #[schema(gui(slider(min = 0.8, max = 1.4, step = 0.01)))]
+    #[schema(flag = "steamvr-restart")]
+    pub radius: f32,
+}
+
 #[derive(SettingsSchema, Serialize, Deserialize, Clone)]
 pub struct VideoConfig {
     #[schema(flag = "real-time")]
@@ -712,6 +1054,29 @@ If you want to reduce the amount of pixelation on the edges, increase the center
     #[schema(flag = "steamvr-restart")]
     pub color_correction: Switch<ColorCorrectionConfig>,
 
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        display_name = "Color LUT file",
+        help = "Path of a .cube 3D LUT applied to the frames after the color correction, e.g. from a display calibration. Its input is sRGB encoded. Empty for none. Windows only"
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub color_lut_path: String,
+
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        help = "Fill the pixels outside of an ellipse inscribed in the field of view of each eye with black, as they are hidden by the lens. They are neither composited nor color corrected, and the encoder spends almost no bits on them. Windows only."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub hidden_area_mask: Switch<HiddenAreaMaskConfig>,
+
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        display_name = "Edge-adaptive upscaling",
+        help = "Upscale the game frames to the encode resolution along their edges, like FSR 1, instead of bilinear filtering. The game can then render at a lower resolution than the stream for about the same sharpness, the sharpening of the color correction finishes the upscale. Windows only, on Linux SteamVR resamples the game frames before the driver gets them."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub edge_adaptive_upscaling: bool,
+
     #[schema(
         strings(
             display_name = "Maximum buffering",
@@ -732,6 +1097,53 @@ If you want to reduce the amount of pixelation on the edges, increase the center
     #[schema(flag = "real-time")]
     pub enforce_server_frame_pacing: bool,
 
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        help = r"Shifts the frame start of SteamVR so that frames reach the headset just before its display needs them, instead of waiting there. The margin follows how much the compositor, encoder and network times vary. Requires server frame pacing."
+    ))]
+    pub adaptive_server_frame_pacing: bool,
+
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        help = r"This works only on Windows. Frames identical to the previous one are not encoded, which saves bitrate and encoder time when the game presents the same frame again. The comparison costs a short compute pass per frame."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub skip_static_frames: bool,
+
+    #[schema(strings(
+        help = r"When the game misses a frame, SteamVR presents the last one again with the same pose. With this enabled, such frames are not composited and encoded again, and the client keeps showing the previous one."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub skip_duplicate_frames: bool,
+
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        help = r"This works only on Windows. Each frame is turned to the newest head orientation when it is composited, and sent as if it was rendered with it. With skip duplicate frames disabled, the frames the game misses are sent again with the current head rotation instead of juddering. The head translation is not corrected."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub late_latch_pose: bool,
+
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        help = r"This works only on Windows. The depth textures SteamVR asks for are never read, so a single one is created for all the depth swap texture sets of a game with the same size and format, instead of three per set. This saves hundreds of MB of VRAM at high resolutions."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub share_depth_swap_textures: bool,
+
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        help = r"This works only on Windows with NVIDIA GPUs. When the bitrate drops, the frames are downscaled before being encoded instead of losing detail to compression artifacts. The resolution changes with an IDR frame, and the client upscales the decoded frames."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub dynamic_resolution: Switch<DynamicResolutionConfig>,
+
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        help = r"This works only on Windows with NVIDIA GPUs. A downscaled copy of the stream is encoded in H.264 with a second NVENC session, for an observer screen. It's served as raw H.264 on the /api/spectator websocket of the web server."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub spectator_stream: Switch<SpectatorStreamConfig>,
+
     #[schema(flag = "steamvr-restart")]
     pub encoder_config: EncoderConfig,
 
@@ -766,6 +1178,15 @@ If you want to reduce the amount of pixelation on the edges, increase the center
     #[schema(flag = "steamvr-restart")]
     pub adapter_index: u32,
 
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        display_name = "Encoder adapter index",
+        help = r"Adapter that encodes the frames composited on the one above, for laptops with an integrated and a dedicated GPU or desktops with a second card. The frames are copied through system memory.
+-1: encode on the compositor adapter, or on the first other adapter with a hardware encoder if it has none"
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub encoder_adapter_index: i32,
+
     #[schema(strings(display_name = "Client-side foveation"))]
     pub clientside_foveation: Switch<ClientsideFoveationConfig>,
 
@@ -949,6 +1370,37 @@ pub struct BodyTrackingConfig {
     pub tracked: bool,
 }
 
+#[derive(SettingsSchema, Serialize, Deserialize, Clone)]
+#[schema(collapsible)]
+pub struct DriverPoseFilterConfig {
+    #[schema(strings(
+        help = "Smooth the headset pose too. This adds latency to the view, only use it if the headset tracking is jittery."
+    ))]
+    pub filter_head: bool,
+
+    #[schema(strings(display_name = "Filter body trackers"))]
+    pub filter_trackers: bool,
+
+    #[schema(strings(
+        display_name = "Minimum cutoff",
+        help = "Cutoff frequency when the device is still. Lower values remove more jitter."
+    ))]
+    #[schema(gui(slider(min = 0.1, max = 20.0, logarithmic)), suffix = "Hz")]
+    pub min_cutoff_hz: f32,
+
+    #[schema(strings(
+        help = "How much the cutoff frequency rises with the speed of the device. Higher values reduce the lag during fast movements."
+    ))]
+    #[schema(gui(slider(min = 0.0, max = 50.0, step = 0.5)))]
+    pub beta: f32,
+
+    #[schema(strings(
+        help = "Extrapolate the body trackers along their velocity to compensate for the tracking latency."
+    ))]
+    #[schema(gui(slider(min = 0, max = 100, step = 5)), suffix = "ms")]
+    pub tracker_prediction_ms: u64,
+}
+
 #[derive(SettingsSchema, Serialize, Deserialize, Clone)]
 #[schema(collapsible)]
 pub struct VMCConfig {
@@ -1296,6 +1748,12 @@ Because of runtime limitations, this option is ignored when body tracking is act
     #[schema(flag = "steamvr-restart")]
     pub body_tracking: Switch<BodyTrackingConfig>,
 
+    #[schema(flag = "steamvr-restart")]
+    #[schema(strings(
+        help = "Smooth the poses submitted to SteamVR with a One Euro filter, driven by the velocities sent by the headset."
+    ))]
+    pub driver_pose_filter: Switch<DriverPoseFilterConfig>,
+
     #[schema(flag = "steamvr-restart")]
     #[schema(strings(display_name = "VMC"))]
     pub vmc: Switch<VMCConfig>,
@@ -1435,6 +1893,12 @@ This could happen on TCP. A IDR frame is requested in this case."#
     #[schema(gui(slider(min = 5, max = 1000, step = 5)), suffix = "ms")]
     pub minimum_idr_interval_ms: u64,
 
+    #[schema(strings(
+        help = r#"When the network drops a video packet, the encoder stops referencing the frames the client didn't receive instead of sending an IDR frame. Supported by NVENC and AMF, other encoders send an IDR frame. Not used with "Avoid video glitching"."#
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub reference_frame_invalidation: bool,
+
     #[schema(strings(display_name = "DSCP (packet prio hints)"))]
     pub dscp: Option<DscpTos>,
 }
@@ -1540,6 +2004,29 @@ pub struct CaptureConfig {
 
     #[schema(flag = "steamvr-restart")]
     pub capture_frame_dir: String,
+
+    #[schema(strings(
+        display_name = "Capture frame burst",
+        help = "Consecutive frames saved as PNG by Capture frame. The copies are read back and written in the background, frames of the burst are skipped if the disk can't keep up"
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    #[schema(gui(slider(min = 1, max = 60)), suffix = " frames")]
+    pub capture_frame_count: u32,
+
+    #[schema(strings(
+        display_name = "Trace capture duration",
+        help = "Length of the Chrome trace (chrome://tracing, ui.perfetto.dev) of the streamer written to the log folder by Capture trace"
+    ))]
+    #[schema(gui(slider(min = 1, max = 60)), suffix = "s")]
+    pub trace_duration_s: u64,
+
+    #[cfg_attr(not(target_os = "linux"), schema(flag = "hidden"))]
+    #[schema(strings(
+        display_name = "Frame recording length",
+        help = "Frames of the game saved to the log folder by Record frames, for replays with the encode benchmark. Linux only. Each frame can take up to 4 bytes per pixel"
+    ))]
+    #[schema(gui(slider(min = 10, max = 3600, step = 10)), suffix = " frames")]
+    pub frame_recording_count: u32,
 }
 
 #[derive(SettingsSchema, Serialize, Deserialize, Clone)]
@@ -1554,6 +2041,112 @@ pub struct Patches {
     ))]
     #[schema(flag = "steamvr-restart")]
     pub linux_async_reprojection: bool,
+    #[schema(strings(
+        help = "Composite the next frame while the previous one is still being encoded. Reduces latency when encoding takes a large part of the frame time.",
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub linux_pipelined_encoding: bool,
+    #[schema(strings(
+        help = "Collect the encoded frames on a separate thread, so that compositing the next frame doesn't wait for the encoder. A frame the encoder is late with is sent with the next one instead of being dropped.",
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub linux_async_output: bool,
+    #[schema(strings(
+        help = "Size the rate control buffer of the encoders to one frame at the current framerate, so that no frame takes longer than a frame interval to send. Otherwise the buffer is 10% larger, which costs less quality on scene changes.",
+    ))]
+    pub linux_single_frame_vbv: bool,
+    #[schema(strings(
+        help = "Images SteamVR renders to in turn. 2 gives the lowest latency, 4 lets a slow GPU render ahead while the previous frames are still being encoded.",
+    ))]
+    #[schema(gui(slider(min = 2, max = 4)))]
+    #[schema(flag = "steamvr-restart")]
+    pub linux_swapchain_images: u32,
+    #[schema(strings(
+        help = "Share the images SteamVR renders to as dma-bufs with an explicit DRM format modifier instead of opaque Vulkan memory. Falls back to opaque memory if the GPU doesn't support modifiers.",
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub linux_dma_buf_swapchain: bool,
+    #[schema(strings(
+        help = "Hand each frame to the encoder from the thread that presents it, instead of waking up a separate thread of the Vulkan layer for it.",
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub linux_direct_submit: bool,
+    #[schema(strings(
+        help = "Render node of the GPU that encodes with VA-API, e.g. /dev/dri/renderD129, while SteamVR keeps rendering on its GPU. Empty encodes on the GPU SteamVR renders on, \"auto\" picks another GPU that can encode the codec. Frames are shared with linear dma-bufs, which costs some bandwidth.",
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub linux_encode_device: String,
+    #[schema(strings(
+        help = "Apply the brightness and contrast of the color correction with the VA-API video processor of the encoding GPU instead of a compositor pass. Only used when sharpening is 0, saturation 0 and gamma 1, and when the driver output matches the compositor within 2 levels on a test frame.",
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub linux_vaapi_color_correction: bool,
+    #[schema(strings(
+        help = "Frames the VA-API encoder works on at once. With 2, a frame is encoded while the next one is composited and comes out one frame later. Not used with pipelined encoding or async output, which already overlap the encode.",
+    ))]
+    #[schema(gui(slider(min = 1, max = 2)))]
+    #[schema(flag = "steamvr-restart")]
+    pub linux_vaapi_async_depth: u32,
+    #[schema(strings(
+        help = "Strength of the noise reduction of the VA-API video processor before encoding, 0 disables it. Grainy games then take fewer bits for the same perceived quality, at the cost of some fine detail. Skipped if the driver can't denoise.",
+    ))]
+    #[schema(gui(slider(min = 0, max = 64)))]
+    #[schema(flag = "steamvr-restart")]
+    pub linux_vaapi_denoise: u32,
+    #[schema(strings(
+        help = "The noise reduction only runs while the bitrate is at most this, above it the noise costs little and the detail is kept. 0 always denoises.",
+    ))]
+    #[schema(gui(slider(min = 0, max = 200, step = 5)), suffix = "Mbps")]
+    #[schema(flag = "steamvr-restart")]
+    pub linux_vaapi_denoise_max_bitrate_mbps: u32,
+}
+
+#[repr(u32)]
+#[derive(SettingsSchema, Serialize, Deserialize, Clone, Copy, PartialEq)]
+#[schema(gui = "button_group")]
+pub enum ThreadPriority {
+    Default = 0,
+    High = 1,
+    Realtime = 2,
+}
+
+#[derive(SettingsSchema, Serialize, Deserialize, Clone)]
+#[schema(collapsible)]
+pub struct ThreadRoleConfig {
+    #[schema(strings(
+        help = "High and Realtime use MMCSS on Windows. On Linux Realtime asks for SCHED_FIFO and High for a lower nice value, which need CAP_SYS_NICE or a matching rtprio/nice limit. What was granted is written to the log."
+    ))]
+    pub priority: ThreadPriority,
+    #[schema(strings(
+        help = "Cores the thread may run on, from 0 to 62. Empty lets the OS choose."
+    ))]
+    pub cpu_affinity: Vec<u32>,
+}
+
+#[derive(SettingsSchema, Serialize, Deserialize, Clone)]
+pub struct DriverThreadsConfig {
+    #[schema(strings(help = "Thread that hands the composited frames to the encoder"))]
+    #[schema(flag = "steamvr-restart")]
+    pub encoder: ThreadRoleConfig,
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        help = "Threads that retrieve the encoded frames from NVENC, AMF or the ARM64 software encoder. Windows only."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub encoder_output: ThreadRoleConfig,
+    #[cfg_attr(not(target_os = "linux"), schema(flag = "hidden"))]
+    #[schema(strings(help = "Thread pacing the frames of the Vulkan layer. Linux only."))]
+    #[schema(flag = "steamvr-restart")]
+    pub vsync: ThreadRoleConfig,
+    #[schema(strings(help = "Thread that submits the tracking to SteamVR"))]
+    #[schema(flag = "steamvr-restart")]
+    pub tracking: ThreadRoleConfig,
+    #[cfg_attr(not(target_os = "windows"), schema(flag = "hidden"))]
+    #[schema(strings(
+        help = "GPU scheduling priority of the composition and encoder input copies, so that they don't queue behind the game's work. Realtime needs ALVR to run as administrator and falls back to High otherwise. Windows only."
+    ))]
+    #[schema(flag = "steamvr-restart")]
+    pub gpu_priority: ThreadPriority,
 }
 
 #[derive(SettingsSchema, Serialize, Deserialize, Clone)]
@@ -1569,6 +2162,7 @@ pub struct ExtraConfig {
     pub logging: LoggingConfig,
     #[cfg_attr(not(target_os = "linux"), schema(flag = "hidden"))]
     pub patches: Patches,
+    pub driver_threads: DriverThreadsConfig,
 
     #[schema(
         strings(help = "Linear and angular velocity multiplier for debug purposes.
@@ -1616,6 +2210,17 @@ pub fn session_settings_default() -> SettingsDefault {
         },
         content: vec![],
     };
+    let default_thread_role = ThreadRoleConfigDefault {
+        gui_collapsed: true,
+        priority: ThreadPriorityDefault {
+            variant: ThreadPriorityDefaultVariant::Default,
+        },
+        cpu_affinity: VectorDefault {
+            gui_collapsed: true,
+            element: 0,
+            content: vec![],
+        },
+    };
     let socket_buffer = SocketBufferSizeDefault {
         Custom: 100000,
         variant: SocketBufferSizeDefaultVariant::Maximum,
@@ -1675,12 +2280,33 @@ pub fn session_settings_default() -> SettingsDefault {
                 },
             },
             adapter_index: 0,
+            encoder_adapter_index: -1,
             transcoding_view_resolution: view_resolution.clone(),
             emulated_headset_view_resolution: view_resolution,
             preferred_fps: 72.,
             max_buffering_frames: 2.0,
             buffering_history_weight: 0.90,
             enforce_server_frame_pacing: true,
+            adaptive_server_frame_pacing: false,
+            skip_static_frames: false,
+            skip_duplicate_frames: false,
+            late_latch_pose: false,
+            share_depth_swap_textures: true,
+            dynamic_resolution: SwitchDefault {
+                enabled: false,
+                content: DynamicResolutionConfigDefault {
+                    full_resolution_mbps: 60,
+                    min_scale: 0.5,
+                },
+            },
+            spectator_stream: SwitchDefault {
+                enabled: false,
+                content: SpectatorStreamConfigDefault {
+                    width: 1280,
+                    framerate_divisor: 2,
+                    bitrate_mbps: 4,
+                },
+            },
             bitrate: BitrateConfigDefault {
                 gui_collapsed: false,
                 mode: BitrateModeDefault {
@@ -1724,6 +2350,14 @@ pub fn session_settings_default() -> SettingsDefault {
                         framerate_reset_threshold_multiplier: 2.0,
                     },
                 },
+                cap_frame_size: false,
+                framerate_decimation: SwitchDefault {
+                    enabled: false,
+                    content: FramerateDecimationConfigDefault {
+                        below_mbps: 30,
+                        divider: 2,
+                    },
+                },
                 history_size: 256,
                 image_corruption_fix: false,
             },
@@ -1750,6 +2384,44 @@ pub fn session_settings_default() -> SettingsDefault {
                     set: false,
                     content: 1.0,
                 },
+                intra_refresh: SwitchDefault {
+                    enabled: false,
+                    content: IntraRefreshConfigDefault { period_frames: 90 },
+                },
+                frame_queue_depth: 1,
+                overlay_qp_reduction: OptionalDefault {
+                    set: false,
+                    content: 6,
+                },
+                warmup_frames: 3,
+                target_latency_ms: OptionalDefault {
+                    set: false,
+                    content: 60,
+                },
+                temporal_layers: 1,
+                packet_sized_slices: false,
+                send_queue: SwitchDefault {
+                    enabled: false,
+                    content: SendQueueConfigDefault {
+                        depth_frames: 3,
+                        full_policy: SendQueueFullPolicyDefault {
+                            variant: SendQueueFullPolicyDefaultVariant::DropOldest,
+                        },
+                    },
+                },
+                low_latency_decoder_headers: false,
+                in_band_frame_metadata: false,
+                adaptive_encoder_load: SwitchDefault {
+                    enabled: false,
+                    content: AdaptiveEncoderLoadConfigDefault { budget_percent: 75 },
+                },
+                decoder_tiles: DecoderTilesConfigDefault {
+                    Custom: DecoderTilesConfigCustomDefault {
+                        columns: 2,
+                        rows: 1,
+                    },
+                    variant: DecoderTilesConfigDefaultVariant::Auto,
+                },
                 hdr: HDRConfigDefault {
                     gui_collapsed: true,
                     enable: OptionalDefault {
@@ -1787,6 +2459,12 @@ pub fn session_settings_default() -> SettingsDefault {
                     rc_max_bitrate: -1,
                     rc_average_bitrate: -1,
                     enable_weighted_prediction: false,
+                    async_output: false,
+                    head_motion_hints: false,
+                    split_encode: NvencSplitEncodeDefault {
+                        variant: NvencSplitEncodeDefaultVariant::Auto,
+                    },
+                    sub_frame_slices: 1,
                 },
                 quality_preset: EncoderQualityPresetDefault {
                     variant: EncoderQualityPresetDefaultVariant::Speed,
@@ -1799,11 +2477,16 @@ pub fn session_settings_default() -> SettingsDefault {
                     use_preproc: false,
                     preproc_sigma: 4,
                     preproc_tor: 7,
+                    drain_threads: false,
+                    quality_probe_interval: 0,
                 },
                 software: SoftwareEncodingConfigDefault {
                     gui_collapsed: true,
                     force_software_encoding: false,
                     thread_count: 0,
+                    sub_frame_output: false,
+                    gpu_color_conversion: false,
+                    arm64_frame_sharing: false,
                 },
             },
             mediacodec_extra_options: {
@@ -1843,6 +2526,20 @@ pub fn session_settings_default() -> SettingsDefault {
                     center_shift_y: 0.1,
                     edge_ratio_x: 4.,
                     edge_ratio_y: 5.,
+                    qp_falloff: SwitchDefault {
+                        enabled: false,
+                        content: FoveatedQpFalloffConfigDefault {
+                            max_qp_delta: 6,
+                            follow_eye_gaze: true,
+                        },
+                    },
+                    radial: SwitchDefault {
+                        enabled: false,
+                        content: RadialFoveationConfigDefault {
+                            center_radius: 0.5,
+                            edge_ratio: 4.,
+                        },
+                    },
                 },
             },
             clientside_foveation: SwitchDefault {
@@ -1875,6 +2572,12 @@ pub fn session_settings_default() -> SettingsDefault {
                     sharpening: 0.5,
                 },
             },
+            color_lut_path: "".into(),
+            hidden_area_mask: SwitchDefault {
+                enabled: false,
+                content: HiddenAreaMaskConfigDefault { radius: 1.1 },
+            },
+            edge_adaptive_upscaling: false,
         },
         audio: AudioConfigDefault {
             game_audio: SwitchDefault {
@@ -1966,6 +2669,17 @@ pub fn session_settings_default() -> SettingsDefault {
                     tracked: true,
                 },
             },
+            driver_pose_filter: SwitchDefault {
+                enabled: false,
+                content: DriverPoseFilterConfigDefault {
+                    gui_collapsed: true,
+                    filter_head: false,
+                    filter_trackers: true,
+                    min_cutoff_hz: 2.0,
+                    beta: 10.0,
+                    tracker_prediction_ms: 0,
+                },
+            },
             vmc: SwitchDefault {
                 enabled: false,
                 content: VMCConfigDefault {
@@ -2145,6 +2859,7 @@ pub fn session_settings_default() -> SettingsDefault {
             max_queued_server_video_frames: 1024,
             avoid_video_glitching: false,
             minimum_idr_interval_ms: 100,
+            reference_frame_invalidation: false,
             enable_on_connect_script: false,
             enable_on_disconnect_script: false,
             allow_untrusted_http: false,
@@ -2206,10 +2921,33 @@ pub fn session_settings_default() -> SettingsDefault {
                 } else {
                     "".into()
                 },
+                capture_frame_count: 1,
+                trace_duration_s: 10,
+                frame_recording_count: 300,
             },
             patches: PatchesDefault {
                 linux_async_compute: false,
                 linux_async_reprojection: false,
+                linux_pipelined_encoding: false,
+                linux_async_output: false,
+                linux_single_frame_vbv: true,
+                linux_swapchain_images: 3,
+                linux_dma_buf_swapchain: false,
+                linux_direct_submit: false,
+                linux_encode_device: "".into(),
+                linux_vaapi_color_correction: false,
+                linux_vaapi_async_depth: 1,
+                linux_vaapi_denoise: 0,
+                linux_vaapi_denoise_max_bitrate_mbps: 60,
+            },
+            driver_threads: DriverThreadsConfigDefault {
+                encoder: default_thread_role.clone(),
+                encoder_output: default_thread_role.clone(),
+                vsync: default_thread_role.clone(),
+                tracking: default_thread_role,
+                gpu_priority: ThreadPriorityDefault {
+                    variant: ThreadPriorityDefaultVariant::Realtime,
+                },
             },
             velocities_multiplier: 1.0,
             open_setup_wizard: alvr_common::is_stable() || alvr_common::is_nightly(),
@@ -39,6 +39,14 @@ const SHARD_PREFIX_SIZE: usize = mem::size_of::<u32>() // packet length - field
     + mem::size_of::<u32>() // shards count
     + mem::size_of::<u32>(); // shards index
 
+/// Largest payload that a packet with this header can have without being split in several shards
+pub fn single_shard_payload_size<H: Serialize>(max_packet_size: usize, header: &H) -> usize {
+    let header_size =
+        bincode::serde::encode_to_vec(header, config::standard()).map_or(0, |bytes| bytes.len());
+
+    max_packet_size.saturating_sub(SHARD_PREFIX_SIZE + header_size)
+}
+
 /// Memory buffer that contains a hidden prefix
 #[derive(Default)]
 pub struct Buffer<H = ()> {
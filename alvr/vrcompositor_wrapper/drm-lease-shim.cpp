@@ -6,6 +6,8 @@
 #include <sys/stat.h>
 #include <xf86drmMode.h>
 
+#include <algorithm>
+#include <cmath>
 #include <fstream>
 #include <filesystem>
 
@@ -202,6 +204,27 @@ extern "C" void *SDL_LoadFunction(void *handle, const char *name)
     return real_SDL_LoadFunction(handle, name);
 }
 
+// The mode of the stream, with reduced blanking timings (CVT-RB) so that the pixel clock gives
+// back the exact refresh rate. vrcompositor paces itself on it, without a clock it assumes 90Hz
+static void fill_stream_mode(drmModeModeInfo *mode, int width, int height, int refresh)
+{
+    mode->hdisplay = width;
+    mode->hsync_start = width + 48;
+    mode->hsync_end = width + 80;
+    mode->htotal = width + 160;
+    mode->vdisplay = height;
+    mode->vsync_start = height + 3;
+    mode->vsync_end = height + 8;
+    // At least 460us of vertical blanking, and the porches and sync
+    int vblank = (int)ceil(460e-6 * refresh * height / (1 - 460e-6 * refresh));
+    mode->vtotal = height + std::max(vblank, 14);
+    mode->vrefresh = refresh;
+    mode->clock = (uint32_t)ceil((double)mode->htotal * mode->vtotal * refresh / 1000.);
+    mode->flags = DRM_MODE_FLAG_PHSYNC | DRM_MODE_FLAG_NVSYNC;
+    mode->type = DRM_MODE_TYPE_DRIVER | DRM_MODE_TYPE_PREFERRED;
+    snprintf(mode->name, DRM_DISPLAY_MODE_LEN, "%dx%d@%d", width, height, refresh);
+}
+
 extern "C" drmModeConnectorPtr drmModeGetConnector(int fd, uint32_t connectorId)
 {
     LOG("CALL drmModeGetConnector(%d, %u)", fd, connectorId);
@@ -217,10 +240,15 @@ extern "C" drmModeConnectorPtr drmModeGetConnector(int fd, uint32_t connectorId)
         picojson::parse(v, json);
         auto config = v.get("openvr_config");
 
+        free(con->modes);
         con->count_modes = 1;
         con->modes = (drmModeModeInfo*)calloc(1, sizeof(drmModeModeInfo));
-        con->modes->hdisplay = config.get("eye_resolution_width").get<int64_t>() * 2;
-        con->modes->vdisplay = config.get("eye_resolution_height").get<int64_t>();
+        fill_stream_mode(
+            con->modes,
+            config.get("eye_resolution_width").get<int64_t>() * 2,
+            config.get("eye_resolution_height").get<int64_t>(),
+            config.get("refresh_rate").get<int64_t>()
+        );
     }
     return con;
 }
@@ -27,6 +27,7 @@
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 
 #include <vulkan/vk_layer.h>
 
@@ -37,6 +38,7 @@
 #include "swapchain_api.hpp"
 #include "util/custom_allocator.hpp"
 #include "util/extension_list.hpp"
+#include "util/logger.h"
 #include "wsi/wsi_factory.hpp"
 #include "layer.h"
 
@@ -51,7 +53,9 @@ static const VkLayerProperties global_layer = {
     "ALVR capture layer",
 };
 static const VkExtensionProperties device_extension[] = {
-    {VK_KHR_SWAPCHAIN_EXTENSION_NAME, VK_KHR_SWAPCHAIN_SPEC_VERSION}};
+    {VK_KHR_SWAPCHAIN_EXTENSION_NAME, VK_KHR_SWAPCHAIN_SPEC_VERSION},
+    {VK_KHR_PRESENT_ID_EXTENSION_NAME, VK_KHR_PRESENT_ID_SPEC_VERSION},
+    {VK_KHR_PRESENT_WAIT_EXTENSION_NAME, VK_KHR_PRESENT_WAIT_SPEC_VERSION}};
 static const VkExtensionProperties instance_extension[] = {
     {VK_KHR_SURFACE_EXTENSION_NAME, VK_KHR_SURFACE_SPEC_VERSION}};
 
@@ -248,6 +252,51 @@ VKAPI_ATTR VkResult create_device(VkPhysicalDevice physicalDevice,
         return result;
     }
 
+    /* Sharing the swapchain images as dma-bufs is optional, the images are exported as opaque fds
+     * without these extensions. */
+    const char *dma_buf_extensions[] = {VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME,
+                                        VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME,
+                                        VK_KHR_IMAGE_FORMAT_LIST_EXTENSION_NAME};
+    bool dma_buf_export = false;
+    if (Settings::Instance().m_dmaBufSwapchain) {
+        util::extension_list device_extensions{allocator};
+        result = device_extensions.add(physicalDevice);
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+        dma_buf_export = true;
+        for (const char *ext : dma_buf_extensions) {
+            dma_buf_export = dma_buf_export && device_extensions.contains(ext);
+        }
+        if (dma_buf_export) {
+            result = enabled_extensions.add(dma_buf_extensions, std::size(dma_buf_extensions));
+            if (result != VK_SUCCESS) {
+                return result;
+            }
+        } else {
+            Warn("The device doesn't support DRM format modifiers, sharing the swapchain as "
+                 "opaque fds\n");
+        }
+    }
+
+    /* The layer implements present id and present wait for its swapchains, the ICD only needs to
+     * see them if it supports them for its own. */
+    const char *present_wait_extensions[] = {VK_KHR_PRESENT_ID_EXTENSION_NAME,
+                                             VK_KHR_PRESENT_WAIT_EXTENSION_NAME};
+    if (enabled_extensions.contains(VK_KHR_PRESENT_ID_EXTENSION_NAME) ||
+        enabled_extensions.contains(VK_KHR_PRESENT_WAIT_EXTENSION_NAME)) {
+        util::extension_list device_extensions{allocator};
+        result = device_extensions.add(physicalDevice);
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+        for (const char *ext : present_wait_extensions) {
+            if (!device_extensions.contains(ext)) {
+                enabled_extensions.remove(ext);
+            }
+        }
+    }
+
     util::vector<const char *> modified_enabled_extensions{allocator};
     if (!enabled_extensions.get_extension_strings(modified_enabled_extensions)) {
         return VK_ERROR_OUT_OF_HOST_MEMORY;
@@ -308,6 +357,10 @@ VKAPI_ATTR VkResult create_device(VkPhysicalDevice physicalDevice,
     std::unique_ptr<device_private_data> device{
         new device_private_data{inst_data, physicalDevice, *pDevice, table, loader_callback}};
     device->display = std::make_unique<wsi::display>();
+    device->dma_buf_export = dma_buf_export &&
+                             device->disp.GetImageDrmFormatModifierPropertiesEXT &&
+                             inst_data.disp.GetPhysicalDeviceFormatProperties2 &&
+                             inst_data.disp.GetPhysicalDeviceImageFormatProperties2;
     device_private_data::set(*pDevice, std::move(device));
     return VK_SUCCESS;
 }
@@ -337,11 +390,29 @@ wsi_layer_vkCreateDevice(VkPhysicalDevice physicalDevice, const VkDeviceCreateIn
     return layer::create_device(physicalDevice, pCreateInfo, pAllocator, pDevice);
 }
 
+/* The layer implements present id and present wait whether the ICD does or not. */
+VKAPI_ATTR void VKAPI_CALL wsi_layer_vkGetPhysicalDeviceFeatures2(
+    VkPhysicalDevice physicalDevice, VkPhysicalDeviceFeatures2 *pFeatures) {
+    layer::instance_private_data::get(physicalDevice)
+        .disp.GetPhysicalDeviceFeatures2(physicalDevice, pFeatures);
+
+    for (auto *next = reinterpret_cast<VkBaseOutStructure *>(pFeatures->pNext); next;
+         next = next->pNext) {
+        if (next->sType == VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR) {
+            reinterpret_cast<VkPhysicalDevicePresentIdFeaturesKHR *>(next)->presentId = VK_TRUE;
+        } else if (next->sType == VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR) {
+            reinterpret_cast<VkPhysicalDevicePresentWaitFeaturesKHR *>(next)->presentWait =
+                VK_TRUE;
+        }
+    }
+}
+
 VKAPI_ATTR VkResult VKAPI_CALL wsi_layer_vkEnumerateDeviceExtensionProperties(
     VkPhysicalDevice physicalDevice, const char *pLayerName, uint32_t *pCount,
     VkExtensionProperties *pProperties) {
     if (pLayerName && !strcmp(pLayerName, layer::global_layer.layerName))
-        return layer::extension_properties(1, layer::device_extension, pCount, pProperties);
+        return layer::extension_properties(std::size(layer::device_extension),
+                                           layer::device_extension, pCount, pProperties);
 
     assert(physicalDevice);
     return layer::instance_private_data::get(physicalDevice)
@@ -378,6 +449,7 @@ PFN_vkVoidFunction VKAPI_CALL wsi_layer_vkGetDeviceProcAddr(VkDevice device,
     GET_PROC_ADDR(vkDestroyFence);
     GET_PROC_ADDR(vkWaitForFences);
     GET_PROC_ADDR(vkGetFenceStatus);
+    GET_PROC_ADDR(vkWaitForPresentKHR);
 
     return layer::device_private_data::get(device).disp.GetDeviceProcAddr(device, funcName);
 }
@@ -395,6 +467,9 @@ wsi_layer_vkGetInstanceProcAddr(VkInstance instance, const char *funcName) {
     GET_PROC_ADDR(vkGetPhysicalDeviceSurfaceFormatsKHR);
     GET_PROC_ADDR(vkGetPhysicalDeviceSurfacePresentModesKHR);
     GET_PROC_ADDR(vkEnumerateDeviceExtensionProperties);
+    GET_PROC_ADDR(vkGetPhysicalDeviceFeatures2);
+    if (!strcmp(funcName, "vkGetPhysicalDeviceFeatures2KHR"))
+        return (PFN_vkVoidFunction)&wsi_layer_vkGetPhysicalDeviceFeatures2;
     GET_PROC_ADDR(vkEnumerateInstanceExtensionProperties);
     GET_PROC_ADDR(vkEnumerateInstanceLayerProperties);
 
@@ -26,13 +26,13 @@
 
 #include "wsi/wsi_factory.hpp"
 
-#include <unordered_map>
-
 namespace layer {
 
-static std::mutex g_data_lock;
-static std::unordered_map<void *, std::unique_ptr<instance_private_data>> g_instance_data;
-static std::unordered_map<void *, std::unique_ptr<device_private_data>> g_device_data;
+/* Looked up by every intercepted call, from all the threads of the compositor. The maps own the
+ * private data: it is deleted when its key is erased or replaced.
+ */
+static util::cow_map<void *, instance_private_data *> g_instance_data;
+static util::cow_map<void *, device_private_data *> g_device_data;
 
 template <typename object_type, typename get_proc_type>
 static PFN_vkVoidFunction get_proc_helper(object_type obj, get_proc_type get_proc,
@@ -81,14 +81,14 @@ static inline void *get_key(dispatchable_type dispatchable_object) {
 }
 
 void instance_private_data::set(VkInstance inst, std::unique_ptr<instance_private_data> inst_data) {
-    scoped_mutex lock(g_data_lock);
-    g_instance_data[get_key(inst)] = std::move(inst_data);
+    delete g_instance_data.insert_or_assign(get_key(inst), inst_data.release());
 }
 
 template <typename dispatchable_type>
 static instance_private_data &get_instance_private_data(dispatchable_type dispatchable_object) {
-    scoped_mutex lock(g_data_lock);
-    return *g_instance_data[get_key(dispatchable_object)];
+    instance_private_data *inst_data = g_instance_data.find(get_key(dispatchable_object));
+    assert(inst_data != nullptr);
+    return *inst_data;
 }
 
 instance_private_data &instance_private_data::get(VkInstance instance) {
@@ -118,17 +118,15 @@ bool instance_private_data::do_icds_support_surface(VkPhysicalDevice, VkSurfaceK
 }
 
 bool instance_private_data::should_layer_handle_surface(VkSurfaceKHR surface) {
-    return surfaces.find(surface) != surfaces.end();
+    return surfaces.contains(surface);
 }
 
 void instance_private_data::destroy(VkInstance inst) {
-    scoped_mutex lock(g_data_lock);
-    g_instance_data.erase(get_key(inst));
+    delete g_instance_data.erase(get_key(inst));
 }
 
 void instance_private_data::add_surface(VkSurfaceKHR surface) {
-    scoped_mutex lock(g_data_lock);
-    surfaces.insert(surface);
+    surfaces.insert_or_assign(surface, true);
 }
 
 device_private_data::device_private_data(instance_private_data &inst_data,
@@ -139,14 +137,14 @@ device_private_data::device_private_data(instance_private_data &inst_data,
       physical_device{phys_dev}, device{dev} {}
 
 void device_private_data::set(VkDevice dev, std::unique_ptr<device_private_data> dev_data) {
-    scoped_mutex lock(g_data_lock);
-    g_device_data[get_key(dev)] = std::move(dev_data);
+    delete g_device_data.insert_or_assign(get_key(dev), dev_data.release());
 }
 
 template <typename dispatchable_type>
 static device_private_data &get_device_private_data(dispatchable_type dispatchable_object) {
-    scoped_mutex lock(g_data_lock);
-    return *g_device_data[get_key(dispatchable_object)];
+    device_private_data *dev_data = g_device_data.find(get_key(dispatchable_object));
+    assert(dev_data != nullptr);
+    return *dev_data;
 }
 
 device_private_data &device_private_data::get(VkDevice device) {
@@ -158,15 +156,13 @@ device_private_data &device_private_data::get(VkQueue queue) {
 }
 
 void device_private_data::add_layer_swapchain(VkSwapchainKHR swapchain) {
-    scoped_mutex lock(swapchains_lock);
-    swapchains.insert(swapchain);
+    swapchains.insert_or_assign(swapchain, true);
 }
 
 bool device_private_data::layer_owns_all_swapchains(const VkSwapchainKHR *swapchain,
                                                     uint32_t swapchain_count) const {
-    scoped_mutex lock(swapchains_lock);
     for (uint32_t i = 0; i < swapchain_count; i++) {
-        if (swapchains.find(swapchain[i]) == swapchains.end()) {
+        if (!swapchains.contains(swapchain[i])) {
             return false;
         }
     }
@@ -182,7 +178,6 @@ bool device_private_data::can_icds_create_swapchain(VkSurfaceKHR vk_surface) {
 }
 
 void device_private_data::destroy(VkDevice dev) {
-    scoped_mutex lock(g_data_lock);
-    g_device_data.erase(get_key(dev));
+    delete g_device_data.erase(get_key(dev));
 }
 } /* namespace layer */
@@ -24,6 +24,7 @@
 
 #pragma once
 
+#include "util/cow_map.hpp"
 #include "util/platform_set.hpp"
 #include "wsi/display.hpp"
 
@@ -34,7 +35,6 @@
 #include <cassert>
 #include <memory>
 #include <mutex>
-#include <unordered_set>
 
 using scoped_mutex = std::lock_guard<std::mutex>;
 
@@ -53,6 +53,10 @@ namespace layer {
     REQUIRED(GetPhysicalDeviceProperties2)                                                          \
     REQUIRED(GetPhysicalDeviceMemoryProperties)                                                    \
     REQUIRED(GetPhysicalDeviceImageFormatProperties)                                               \
+    OPTIONAL(GetPhysicalDeviceImageFormatProperties2)                                              \
+    OPTIONAL(GetPhysicalDeviceFormatProperties2)                                                   \
+    OPTIONAL(GetPhysicalDeviceExternalSemaphoreProperties)                                         \
+    REQUIRED(GetPhysicalDeviceFeatures2)                                                           \
     REQUIRED(EnumerateDeviceExtensionProperties)                                                   \
     OPTIONAL(GetPhysicalDeviceSurfaceCapabilitiesKHR)                                              \
     OPTIONAL(GetPhysicalDeviceSurfaceFormatsKHR)                                                   \
@@ -104,6 +108,7 @@ struct instance_dispatch_table {
     REQUIRED(DestroyImage)                                                                         \
     REQUIRED(GetImageMemoryRequirements)                                                           \
     REQUIRED(BindImageMemory)                                                                      \
+    REQUIRED(GetImageSubresourceLayout)                                                            \
     REQUIRED(AllocateMemory)                                                                       \
     REQUIRED(FreeMemory)                                                                           \
     REQUIRED(CreateFence)                                                                          \
@@ -120,7 +125,10 @@ struct instance_dispatch_table {
     OPTIONAL(GetFenceStatus)                                                                       \
     OPTIONAL(GetMemoryFdKHR)                                                                       \
     OPTIONAL(CreateSemaphore)                                                                      \
-    OPTIONAL(GetSemaphoreFdKHR)
+    OPTIONAL(DestroySemaphore)                                                                     \
+    OPTIONAL(GetSemaphoreFdKHR)                                                                    \
+    OPTIONAL(GetImageDrmFormatModifierPropertiesEXT)                                             \
+    OPTIONAL(WaitForPresentKHR)
 
 struct device_dispatch_table {
     VkResult populate(VkDevice dev, PFN_vkGetDeviceProcAddr get_proc);
@@ -199,7 +207,7 @@ class instance_private_data {
     const PFN_vkSetInstanceLoaderData SetInstanceLoaderData;
     const util::wsi_platform_set enabled_layer_platforms;
 
-    std::unordered_set<VkSurfaceKHR> surfaces;
+    util::cow_map<VkSurfaceKHR, bool> surfaces;
 };
 
 class device_private_data {
@@ -256,9 +264,12 @@ class device_private_data {
     const VkDevice device;
 
     std::unique_ptr<wsi::display> display;
+    /* VK_EXT_image_drm_format_modifier and VK_EXT_external_memory_dma_buf were enabled, so that
+     * the swapchain images can be shared as dma-bufs. */
+    bool dma_buf_export = false;
   private:
-    std::unordered_set<VkSwapchainKHR> swapchains;
-    mutable std::mutex swapchains_lock;
+    /* Checked by every present and acquire, without a lock. */
+    util::cow_map<VkSwapchainKHR, bool> swapchains;
 };
 
 } /* namespace layer */
@@ -1,6 +1,7 @@
 #include "settings.h"
 #define PICOJSON_USE_INT64
 #include "alvr_server/include/picojson.h"
+#include <algorithm>
 #include <string>
 #include <fstream>
 #include <streambuf>
@@ -8,6 +9,7 @@
 #include <cstdlib>
 #include "layer.h"
 #include "util/logger.h"
+#include "platform/linux/protocol.h"
 
 using namespace std;
 
@@ -48,10 +50,22 @@ void Settings::Load()
 		m_renderHeight = config.get("eye_resolution_height").get<int64_t>();
 
 		m_refreshRate = (int)config.get("refresh_rate").get<int64_t>();
+
+		m_swapchainImages = std::clamp(
+			(uint32_t)config.get("linux_swapchain_images").get<int64_t>(),
+			2u,
+			init_packet::max_images);
+		m_dmaBufSwapchain = config.get("linux_dma_buf_swapchain").get<bool>();
+		m_directSubmit = config.get("linux_direct_submit").get<bool>();
+		m_vsyncThread.priority = (ThreadPriority)config.get("thread_vsync_priority").get<int64_t>();
+		m_vsyncThread.cpuMask = (uint64_t)config.get("thread_vsync_cpu_mask").get<int64_t>();
 		
 		Debug("Config JSON: %hs\n", json.c_str());
 		Info("Render Target: %d %d\n", m_renderWidth, m_renderHeight);
 		Info("Refresh Rate: %d\n", m_refreshRate);
+		Info("Swapchain images: %u\n", m_swapchainImages);
+		Info("Dma-buf swapchain: %d\n", m_dmaBufSwapchain);
+		Info("Direct submit: %d\n", m_directSubmit);
 		m_loaded = true;
 	}
 	catch (std::exception &e)
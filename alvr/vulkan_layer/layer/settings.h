@@ -2,6 +2,7 @@
 
 #include <string>
 #include <cstdint>
+#include "alvr_server/ThreadPolicy.h"
 
 class Settings
 {
@@ -24,4 +25,8 @@ public:
 	int m_refreshRate;
 	uint32_t m_renderWidth;
 	uint32_t m_renderHeight;
+	uint32_t m_swapchainImages = 3;
+	bool m_dmaBufSwapchain = false;
+	bool m_directSubmit = false;
+	ThreadRoleConfig m_vsyncThread;
 };
@@ -129,6 +129,14 @@ VKAPI_ATTR VkResult wsi_layer_vkQueuePresentKHR(VkQueue queue,
         return device_data.disp.QueuePresentKHR(queue, pPresentInfo);
     }
 
+    const VkPresentIdKHR *present_ids = nullptr;
+    for (auto *next = reinterpret_cast<const VkBaseInStructure *>(pPresentInfo->pNext); next;
+         next = next->pNext) {
+        if (next->sType == VK_STRUCTURE_TYPE_PRESENT_ID_KHR) {
+            present_ids = reinterpret_cast<const VkPresentIdKHR *>(next);
+        }
+    }
+
     VkResult ret = VK_SUCCESS;
     for (uint32_t i = 0; i < pPresentInfo->swapchainCount; ++i) {
         VkSwapchainKHR swapc = pPresentInfo->pSwapchains[i];
@@ -136,7 +144,13 @@ VKAPI_ATTR VkResult wsi_layer_vkQueuePresentKHR(VkQueue queue,
         wsi::swapchain_base *sc = reinterpret_cast<wsi::swapchain_base *>(swapc);
         assert(sc != nullptr);
 
-        VkResult res = sc->queue_present(queue, pPresentInfo, pPresentInfo->pImageIndices[i]);
+        uint64_t present_id = 0;
+        if (present_ids != nullptr && present_ids->pPresentIds != nullptr &&
+            i < present_ids->swapchainCount) {
+            present_id = present_ids->pPresentIds[i];
+        }
+        VkResult res =
+            sc->queue_present(queue, pPresentInfo, pPresentInfo->pImageIndices[i], present_id);
 
         if (pPresentInfo->pResults != nullptr) {
             pPresentInfo->pResults[i] = res;
@@ -163,4 +177,16 @@ VKAPI_ATTR VkResult wsi_layer_vkGetSwapchainCounterEXT(VkDevice device, VkSwapch
     return VK_SUCCESS;
 }
 
+VKAPI_ATTR VkResult wsi_layer_vkWaitForPresentKHR(VkDevice device, VkSwapchainKHR swapchain,
+                                                 uint64_t presentId, uint64_t timeout) {
+    layer::device_private_data &device_data = layer::device_private_data::get(device);
+    if (!device_data.layer_owns_swapchain(swapchain)) {
+        return device_data.disp.WaitForPresentKHR(device, swapchain, presentId, timeout);
+    }
+
+    assert(swapchain != VK_NULL_HANDLE);
+    wsi::swapchain_base *sc = reinterpret_cast<wsi::swapchain_base *>(swapchain);
+    return sc->wait_for_present(presentId, timeout);
+}
+
 } /* extern "C" */
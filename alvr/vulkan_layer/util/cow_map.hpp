@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace util {
+
+/**
+ * @brief Map that is looked up on every intercepted call, but only changes when Vulkan objects are
+ * created or destroyed.
+ *
+ * Lookups read the current table without taking a lock. Writers copy the table under a mutex,
+ * change the copy and publish it. A replaced table may still be walked by a lookup that loaded it
+ * just before, so it is kept until the map is destroyed: the writes are rare enough for these to
+ * stay a handful of small tables.
+ */
+template <typename Key, typename Value> class cow_map {
+  public:
+    cow_map() = default;
+    cow_map(const cow_map &) = delete;
+    cow_map &operator=(const cow_map &) = delete;
+    ~cow_map() { delete m_table.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Lock free lookup.
+     * @return The value of @p key, or a value initialized one if it isn't in the map.
+     */
+    Value find(const Key &key) const noexcept {
+        const table *current = m_table.load(std::memory_order_acquire);
+        if (current == nullptr) {
+            return Value{};
+        }
+        auto it = current->find(key);
+        return it == current->end() ? Value{} : it->second;
+    }
+
+    bool contains(const Key &key) const noexcept {
+        const table *current = m_table.load(std::memory_order_acquire);
+        return current != nullptr && current->find(key) != current->end();
+    }
+
+    /**
+     * @return The value @p key had before, value initialized if it was not in the map.
+     */
+    Value insert_or_assign(const Key &key, Value value) {
+        return update([&](table &copy) {
+            Value previous{};
+            auto it = copy.find(key);
+            if (it != copy.end()) {
+                previous = std::move(it->second);
+            }
+            copy[key] = std::move(value);
+            return previous;
+        });
+    }
+
+    /**
+     * @return The value @p key had, value initialized if it was not in the map.
+     */
+    Value erase(const Key &key) {
+        return update([&](table &copy) {
+            Value previous{};
+            auto it = copy.find(key);
+            if (it != copy.end()) {
+                previous = std::move(it->second);
+                copy.erase(it);
+            }
+            return previous;
+        });
+    }
+
+  private:
+    using table = std::unordered_map<Key, Value>;
+
+    template <typename Change> Value update(Change change) {
+        std::lock_guard<std::mutex> lock(m_write_lock);
+        const table *current = m_table.load(std::memory_order_relaxed);
+        auto copy = current != nullptr ? std::make_unique<table>(*current)
+                                       : std::make_unique<table>();
+        Value previous = change(*copy);
+        m_table.store(copy.release(), std::memory_order_release);
+        if (current != nullptr) {
+            m_retired.emplace_back(current);
+        }
+        return previous;
+    }
+
+    std::atomic<const table *> m_table{nullptr};
+    std::mutex m_write_lock;
+    std::vector<std::unique_ptr<const table>> m_retired;
+};
+
+} /* namespace util */
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+
+namespace util {
+
+/**
+ * @brief Vector with its capacity reserved inline, for the bookkeeping of the swapchain that has a
+ * known bound and must not allocate.
+ *
+ * Mirrors the try_... methods of util::vector, which fail instead of allocating past the capacity.
+ */
+template <typename T, size_t capacity> class fixed_vector {
+  public:
+    /* @brief Like std::vector::push_back, but non throwing.
+     * @return @c false iff the vector is full.
+     */
+    bool try_push_back(const T &value) noexcept {
+        if (m_size == capacity) {
+            return false;
+        }
+        m_data[m_size++] = value;
+        return true;
+    }
+
+    void clear() noexcept { m_size = 0; }
+
+    size_t size() const noexcept { return m_size; }
+    bool empty() const noexcept { return m_size == 0; }
+
+    T *data() noexcept { return m_data.data(); }
+    const T *data() const noexcept { return m_data.data(); }
+
+    T &operator[](size_t index) noexcept {
+        assert(index < m_size);
+        return m_data[index];
+    }
+    const T &operator[](size_t index) const noexcept {
+        assert(index < m_size);
+        return m_data[index];
+    }
+
+    T *begin() noexcept { return m_data.data(); }
+    T *end() noexcept { return m_data.data() + m_size; }
+    const T *begin() const noexcept { return m_data.data(); }
+    const T *end() const noexcept { return m_data.data() + m_size; }
+
+  private:
+    std::array<T, capacity> m_data{};
+    size_t m_size = 0;
+};
+
+} /* namespace util */
@@ -1,5 +1,8 @@
 #include "pose.hpp"
 
+#include "logger.h"
+
+#include <atomic>
 #include <cmath>
 #include <string.h>
 
@@ -58,20 +61,18 @@ bool check_pose(const TrackedDevicePose_t & p)
 
 }
 
-// For a smooth experience, the correct pose for a frame must be known.
-// Of course this is not part of vulkan parameters, so we must inspect
-// the stack.
-// First we look for the correct function (CRenderThread::UpdateAsync),
-// then we scan all the local variables, and check for a suitable one.
-// Such a variable is a TrackedDevicePose_t, with both booleans to true,
-// which we compare to 1 to avoid false positives, a tracking result of
-// 200, and a rotation matrix (A*transpose(A)) close to identity.
-const TrackedDevicePose_t & find_pose_in_call_stack()
+namespace {
+
+// Presents after a walk that found nothing before walking again, the pose isn't on the stack of
+// every caller and a walk costs much more than a present
+const uint64_t FAILED_WALK_BACKOFF = 90;
+
+std::atomic<uint64_t> stack_walks{0};
+
+// Walks up to CRenderThread::UpdateAsync and scans its frame, nullptr if there is no valid pose
+TrackedDevicePose_t * walk_stack_for_pose()
 {
-  static TrackedDevicePose_t * res;
-  if (res != nullptr)
-    return *res;
-  static TrackedDevicePose_t notfound;
+  uint64_t walk = stack_walks.fetch_add(1, std::memory_order_relaxed) + 1;
   unw_context_t ctx;
   unw_getcontext(&ctx);
   unw_cursor_t cursor;
@@ -92,12 +93,59 @@ const TrackedDevicePose_t & find_pose_in_call_stack()
         TrackedDevicePose_t * p = (TrackedDevicePose_t *) addr;
         if (check_pose(*p))
         {
-          res = p;
-          return *p;
+          Info("Pose found in the stack of %s at offset %zu, walk %llu\n",
+               name, size_t(addr - sp), (unsigned long long)walk);
+          return p;
         }
       }
-      return notfound;
+      Debug("No pose in the stack of %s, walk %llu\n", name, (unsigned long long)walk);
+      return nullptr;
     }
   }
-  return notfound;
+  Debug("No compositor frame in the stack, walk %llu\n", (unsigned long long)walk);
+  return nullptr;
+}
+
+}
+
+// For a smooth experience, the correct pose for a frame must be known.
+// Of course this is not part of vulkan parameters, so we must inspect
+// the stack.
+// First we look for the correct function (CRenderThread::UpdateAsync),
+// then we scan all the local variables, and check for a suitable one.
+// Such a variable is a TrackedDevicePose_t, with both booleans to true,
+// which we compare to 1 to avoid false positives, a tracking result of
+// 200, and a rotation matrix (A*transpose(A)) close to identity.
+//
+// The variable stays at the same address for as long as the compositor presents from the same
+// thread, so the address is cached per thread and the stack is only walked again once the pose
+// found there stops passing check_pose. If the walk doesn't find a better one, the cached address
+// is still the most likely place of the pose, e.g. while the tracking is lost.
+const TrackedDevicePose_t & find_pose_in_call_stack()
+{
+  thread_local TrackedDevicePose_t * cached;
+  thread_local uint64_t skipped_walks;
+  static TrackedDevicePose_t notfound;
+  if (cached != nullptr and check_pose(*cached))
+    return *cached;
+
+  if (skipped_walks > 0)
+  {
+    skipped_walks--;
+    return cached ? *cached : notfound;
+  }
+
+  TrackedDevicePose_t * found = walk_stack_for_pose();
+  if (found != nullptr)
+  {
+    cached = found;
+    return *found;
+  }
+  skipped_walks = FAILED_WALK_BACKOFF;
+  return cached ? *cached : notfound;
+}
+
+uint64_t pose_stack_walks()
+{
+  return stack_walks.load(std::memory_order_relaxed);
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 struct HmdMatrix34_t
 {
   float m[3][4];
@@ -24,3 +26,6 @@ struct TrackedDevicePose_t
 };
 
 const TrackedDevicePose_t & find_pose_in_call_stack();
+
+// Stack walks done by find_pose_in_call_stack, which should stop growing once the pose is found
+uint64_t pose_stack_walks();
@@ -1,8 +1,50 @@
 #include "display.hpp"
 
-#include"layer/settings.h"
+#include "layer/settings.h"
+#include "platform/linux/protocol.h"
+#include "util/logger.h"
 
-#include <chrono>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+uint64_t wsi::display::now_ns()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+namespace {
+// The sleep ends this long before the deadline, the rest is spun. Covers the usual timer slack
+// and scheduling latency without burning much of a core
+const uint64_t SPIN_NS = 200'000;
+// Vsyncs over which the jitter is reported
+const uint64_t JITTER_REPORT_FRAMES = 1000;
+
+void sleep_until_ns(uint64_t deadline_ns)
+{
+  if (deadline_ns > wsi::display::now_ns() + SPIN_NS) {
+    uint64_t wake_ns = deadline_ns - SPIN_NS;
+    timespec ts = {time_t(wake_ns / 1'000'000'000), long(wake_ns % 1'000'000'000)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+    }
+  }
+  while (wsi::display::now_ns() < deadline_ns) {
+  }
+}
+
+long futex(std::atomic<uint32_t> &word, int op, uint32_t value, const timespec *timeout)
+{
+  static_assert(sizeof(word) == sizeof(uint32_t));
+  return syscall(SYS_futex, &word, op, value, timeout, nullptr, FUTEX_BITSET_MATCH_ANY);
+}
+}
 
 wsi::display::display()
 {
@@ -15,34 +57,114 @@ VkFence wsi::display::get_vsync_fence()
   vsync_fence = reinterpret_cast<VkFence>(this);
   m_vsync_thread = std::thread([this]()
       {
-      auto refresh = Settings::Instance().m_refreshRate;
-      auto next_frame = std::chrono::steady_clock::now();
-      auto frame_time = std::chrono::duration_cast<decltype(next_frame)::duration>(std::chrono::duration<double>(1. / refresh));
+      Info("%s\n", ApplyThreadRole(ThreadRole::Vsync, Settings::Instance().m_vsyncThread).c_str());
+      const uint64_t nominal_interval_ns = 1'000'000'000 / Settings::Instance().m_refreshRate;
+      uint64_t next_frame = now_ns() + nominal_interval_ns;
+      bool locked = false;
       while (not m_exiting) {
-        std::this_thread::sleep_until(next_frame);
-        m_signaled = true;
-        m_cond.notify_all();
+        // Absolute deadlines, so that the wakeup latency of a frame doesn't delay the next ones
+        sleep_until_ns(next_frame);
+        report_jitter(int64_t(now_ns() - next_frame), locked);
         m_vsync_count += 1;
-        next_frame += frame_time;
+        m_vsync_futex.fetch_add(1, std::memory_order_release);
+        futex(m_vsync_futex, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr);
+        next_frame = next_vsync(next_frame, nominal_interval_ns, locked);
       }
       });
   }
-  m_signaled = false;
+  m_fence_vsync = m_vsync_count + 1;
   return vsync_fence;
 }
 
+uint64_t wsi::display::next_vsync(uint64_t previous_ns, uint64_t nominal_interval_ns, bool &locked)
+{
+  uint64_t vsync_ns = 0;
+  uint64_t interval_ns = 0;
+  {
+    std::lock_guard<std::mutex> lock(m_vsync_clock_mutex);
+    const vsync_clock *clock = m_vsync_clock;
+    if (clock) {
+      uint32_t sequence;
+      do {
+        sequence = clock->sequence.load(std::memory_order_acquire);
+        vsync_ns = clock->vsync_ns.load(std::memory_order_relaxed);
+        interval_ns = clock->interval_ns.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+      } while ((sequence & 1) or sequence != clock->sequence.load(std::memory_order_relaxed));
+    }
+  }
+
+  // Way off the nominal rate means the streamer isn't locked to a client yet
+  locked = interval_ns > nominal_interval_ns / 2 and interval_ns < nominal_interval_ns * 2;
+  if (not locked) {
+    return previous_ns + nominal_interval_ns;
+  }
+
+  // The client vsync at least half an interval after the previous one, so that a phase
+  // correction neither skips a vsync nor fires one twice
+  int64_t since_clock_ns = int64_t(previous_ns + interval_ns / 2 - vsync_ns);
+  // Rounded up, the division truncates toward zero
+  int64_t intervals = since_clock_ns / int64_t(interval_ns);
+  if (since_clock_ns > 0 and since_clock_ns % int64_t(interval_ns) != 0) {
+    intervals += 1;
+  }
+  return vsync_ns + intervals * int64_t(interval_ns);
+}
+
+void wsi::display::report_jitter(int64_t late_ns, bool locked)
+{
+  uint64_t jitter_ns = std::abs(late_ns);
+  m_jitter_sum_ns += jitter_ns;
+  m_jitter_max_ns = std::max(m_jitter_max_ns, jitter_ns);
+  m_jitter_frames += 1;
+  if (m_jitter_frames == JITTER_REPORT_FRAMES) {
+    Info("vsync jitter: average %.1fus, max %.1fus (%s)\n",
+         m_jitter_sum_ns / 1e3 / m_jitter_frames,
+         m_jitter_max_ns / 1e3,
+         locked ? "locked to the client" : "free running");
+    m_jitter_frames = 0;
+    m_jitter_sum_ns = 0;
+    m_jitter_max_ns = 0;
+  }
+}
+
 wsi::display::~display() {
-  std::unique_lock<std::mutex> lock(m_mutex);
   m_exiting = true;
   if (m_vsync_thread.joinable())
     m_vsync_thread.join();
 }
 
-bool wsi::display::wait_for_vsync(uint64_t timeoutNs)
+bool wsi::display::wait_for_vsync_after(uint64_t count, uint64_t timeoutNs)
+{
+  // Vulkan timeouts are relative, UINT64_MAX waits forever
+  const uint64_t start_ns = now_ns();
+  const uint64_t deadline_ns =
+      timeoutNs > UINT64_MAX - start_ns ? UINT64_MAX : start_ns + timeoutNs;
+  const timespec ts = {time_t(deadline_ns / 1'000'000'000), long(deadline_ns % 1'000'000'000)};
+  while (true) {
+    // Read the futex word first, a vsync coming after it makes the wait return immediately
+    uint32_t futex_value = m_vsync_futex.load(std::memory_order_acquire);
+    if (m_vsync_count > count) {
+      return true;
+    }
+    if (now_ns() >= deadline_ns) {
+      return false;
+    }
+    // Absolute timeout on CLOCK_MONOTONIC, unlike FUTEX_WAIT
+    futex(m_vsync_futex,
+          FUTEX_WAIT_BITSET_PRIVATE,
+          futex_value,
+          deadline_ns == UINT64_MAX ? nullptr : &ts);
+  }
+}
+
+uint64_t wsi::display::on_present()
 {
-  if (!m_signaled) {
-    std::unique_lock<std::mutex> lock(m_mutex);
-    return m_cond.wait_for(lock, std::chrono::nanoseconds(timeoutNs)) == std::cv_status::no_timeout;
+  uint64_t vsync = m_vsync_count;
+  uint64_t last = m_last_present_vsync.exchange(vsync);
+  // Before the first vsync nothing can be missed
+  if (last != 0 and vsync > last + 1) {
+    m_missed_vsyncs += vsync - last - 1;
   }
-  return true;
+  return vsync;
 }
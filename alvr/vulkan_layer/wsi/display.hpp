@@ -1,9 +1,11 @@
 #pragma once
 
 #include <atomic>
+#include <mutex>
 #include <vulkan/vulkan.h>
 #include <thread>
-#include <condition_variable>
+
+struct vsync_clock;
 
 namespace wsi {
 
@@ -12,22 +14,65 @@ class display {
     display();
     ~display();
 
+    // CLOCK_MONOTONIC, which the streamer shares
+    static uint64_t now_ns();
+
     VkFence get_vsync_fence();
     VkFence peek_vsync_fence() { return vsync_fence;};
 
-    bool is_signaled() const { return m_signaled; }
-    bool wait_for_vsync(uint64_t timeoutNs);
+    // The fence signals on the first vsync after it was registered by get_vsync_fence
+    bool is_signaled() const { return m_vsync_count >= m_fence_vsync; }
+    bool wait_for_vsync(uint64_t timeoutNs)
+    {
+      return wait_for_vsync_after(m_fence_vsync - 1, timeoutNs);
+    }
+    // Waits until m_vsync_count is over count, false on timeout
+    bool wait_for_vsync_after(uint64_t count, uint64_t timeoutNs);
+
+    // Called on each present, counts the vsyncs that passed without one. Returns the vsync count
+    uint64_t on_present();
+    uint64_t missed_vsyncs() const { return m_missed_vsyncs; }
+
+    // Clock of the client display shared by the streamer, vsyncs free run at the refresh rate of
+    // the settings while it's null
+    void set_vsync_clock(const vsync_clock *clock)
+    {
+      std::lock_guard<std::mutex> lock(m_vsync_clock_mutex);
+      m_vsync_clock = clock;
+    }
+    // Only if it's still the current one, a new swapchain may already have replaced it. The vsync
+    // thread is done reading it on return, so it can be unmapped
+    void unset_vsync_clock(const vsync_clock *clock)
+    {
+      std::lock_guard<std::mutex> lock(m_vsync_clock_mutex);
+      if (m_vsync_clock == clock)
+        m_vsync_clock = nullptr;
+    }
 
     std::atomic<uint64_t> m_vsync_count{0};
 
   private:
+    // Deadline of the vsync after the one at previous_ns
+    uint64_t next_vsync(uint64_t previous_ns, uint64_t nominal_interval_ns, bool &locked);
+    void report_jitter(int64_t late_ns, bool locked);
+
     std::atomic_bool m_thread_running{false};
     std::atomic_bool m_exiting{false};
     std::thread m_vsync_thread;
     VkFence vsync_fence = VK_NULL_HANDLE;
-    std::mutex m_mutex;
-    std::condition_variable m_cond;
-    std::atomic_bool m_signaled = false;
+    std::atomic<uint64_t> m_fence_vsync{0};
+    // Futex word, incremented along with m_vsync_count
+    std::atomic<uint32_t> m_vsync_futex{0};
+    std::atomic<uint64_t> m_last_present_vsync{0};
+    std::atomic<uint64_t> m_missed_vsyncs{0};
+    // Held by the vsync thread while it reads the clock
+    std::mutex m_vsync_clock_mutex;
+    const vsync_clock *m_vsync_clock = nullptr;
+
+    // Only accessed by the vsync thread
+    uint64_t m_jitter_frames = 0;
+    uint64_t m_jitter_sum_ns = 0;
+    uint64_t m_jitter_max_ns = 0;
 };
 
 } // namespace wsi
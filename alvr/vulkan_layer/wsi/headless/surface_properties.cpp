@@ -34,6 +34,7 @@
 
 #include <layer/private_data.hpp>
 #include "layer/settings.h"
+#include "platform/linux/protocol.h"
 
 #include "surface_properties.hpp"
 
@@ -51,10 +52,10 @@ VkResult
 surface_properties::get_surface_capabilities(VkPhysicalDevice physical_device, VkSurfaceKHR surface,
                                              VkSurfaceCapabilitiesKHR *surface_capabilities) {
     UNUSED(surface);
-    /* Image count limits */
-    surface_capabilities->minImageCount = 1;
-    /* There is no maximum theoretically speaking */
-    surface_capabilities->maxImageCount = UINT32_MAX;
+    /* Image count limits. vrcompositor takes the minimum, so this is what the streamer uses */
+    surface_capabilities->minImageCount = Settings::Instance().m_swapchainImages;
+    /* The fds of all the images go to the encoder in a single message */
+    surface_capabilities->maxImageCount = init_packet::max_images;
 
     /* Surface extents */
     surface_capabilities->currentExtent = surface_capabilities->maxImageExtent =
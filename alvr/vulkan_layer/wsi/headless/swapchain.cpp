@@ -28,14 +28,20 @@
  * @brief Contains the implementation for a headless swapchain.
  */
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstdlib>
 #include <errno.h>
+#include <linux/futex.h>
 #include <new>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/un.h>
 #include <unistd.h>
 #include <vulkan/vulkan.h>
@@ -57,11 +63,21 @@ struct image_data {
 };
 
 swapchain::swapchain(layer::device_private_data &dev_data, const VkAllocationCallbacks *pAllocator)
-    : wsi::swapchain_base(dev_data, pAllocator), m_display(*dev_data.display) {}
+    : wsi::swapchain_base(dev_data, pAllocator), m_display(*dev_data.display) {
+    std::string socket_path = ipc_socket_path();
+    m_socket_address.sun_family = AF_UNIX;
+    strncpy(m_socket_address.sun_path, socket_path.c_str(), sizeof(m_socket_address.sun_path) - 1);
+}
 
 swapchain::~swapchain() {
     /* Call the base's teardown */
     close(m_socket);
+    if (m_ring) {
+        m_display.unset_vsync_clock(&m_ring->vsync);
+        munmap(m_ring, sizeof(present_ring));
+    }
+    if (m_event_fd != -1)
+        close(m_event_fd);
     teardown();
 }
 
@@ -73,12 +89,37 @@ VkResult swapchain::create_image(const VkImageCreateInfo &image_create,
       | VK_IMAGE_USAGE_TRANSFER_DST_BIT
       | VK_IMAGE_USAGE_SAMPLED_BIT
       | VK_IMAGE_USAGE_STORAGE_BIT;
+
+    // All the images share the handle type, chosen with the first one
+    if (m_image_memory.empty() && m_device_data.dma_buf_export && find_dma_buf_modifiers()) {
+        m_memory_handle_type = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+    }
+
+    std::vector<uint64_t> modifiers;
+    for (const auto &modifier : m_modifiers) {
+        modifiers.push_back(modifier.drmFormatModifier);
+    }
+    VkImageDrmFormatModifierListCreateInfoEXT modifier_list = {};
+    modifier_list.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_LIST_CREATE_INFO_EXT;
+    modifier_list.drmFormatModifierCount = modifiers.size();
+    modifier_list.pDrmFormatModifiers = modifiers.data();
+
+    VkExternalMemoryImageCreateInfo dma_buf_info = {};
+    dma_buf_info.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
+    dma_buf_info.pNext = &modifier_list;
+    dma_buf_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+
+    if (m_memory_handle_type == VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT) {
+        m_create_info.pNext = &dma_buf_info;
+        m_create_info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+    }
     res = m_device_data.disp.CreateImage(m_device, &m_create_info, nullptr, &image.image);
+    // The chain is on the stack, and m_create_info is later sent in the init_packet
+    m_create_info.pNext = nullptr;
+    m_create_info.pQueueFamilyIndices = nullptr;
     if (res != VK_SUCCESS) {
         return res;
     }
-    m_create_info.pNext = nullptr;
-    m_create_info.pQueueFamilyIndices = nullptr;
 
     VkMemoryRequirements memory_requirements;
     m_device_data.disp.GetImageMemoryRequirements(m_device, image.image, &memory_requirements);
@@ -97,7 +138,7 @@ VkResult swapchain::create_image(const VkImageCreateInfo &image_create,
 
     VkExportMemoryAllocateInfo export_info = {};
     export_info.sType = VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO;
-    export_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+    export_info.handleTypes = m_memory_handle_type;
 
     VkMemoryDedicatedAllocateInfo ded_info = {};
     ded_info.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
@@ -109,7 +150,9 @@ VkResult swapchain::create_image(const VkImageCreateInfo &image_create,
     mem_info.allocationSize = memory_requirements.size;
     mem_info.memoryTypeIndex = mem_type_idx;
     mem_info.pNext = &ded_info;
-    m_mem_index = mem_type_idx;
+    init_image memory = {};
+    memory.memory_size = memory_requirements.size;
+    memory.mem_index = uint32_t(mem_type_idx);
     image_data *data = nullptr;
 
     /* Create image_data */
@@ -135,6 +178,19 @@ VkResult swapchain::create_image(const VkImageCreateInfo &image_create,
         return res;
     }
 
+    if (m_memory_handle_type == VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT) {
+        res = get_dma_buf_layout(image.image, memory);
+        if (res != VK_SUCCESS) {
+            Error("GetImageDrmFormatModifierPropertiesEXT failed\n");
+            destroy_image(image);
+            return res;
+        }
+    }
+    if (not m_image_memory.try_push_back(memory)) {
+        destroy_image(image);
+        return VK_ERROR_OUT_OF_HOST_MEMORY;
+    }
+
     /* Initialize presentation fence. */
     VkFenceCreateInfo fence_info = {VK_STRUCTURE_TYPE_FENCE_CREATE_INFO, nullptr, 0};
     res = m_device_data.disp.CreateFence(m_device, &fence_info, nullptr, &image.present_fence);
@@ -148,7 +204,7 @@ VkResult swapchain::create_image(const VkImageCreateInfo &image_create,
     fd_info.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR;
     fd_info.pNext = NULL;
     fd_info.memory = data->memory;
-    fd_info.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+    fd_info.handleType = m_memory_handle_type;
 
     int fd;
     res = m_device_data.disp.GetMemoryFdKHR(m_device, &fd_info, &fd);
@@ -157,7 +213,11 @@ VkResult swapchain::create_image(const VkImageCreateInfo &image_create,
         destroy_image(image);
         return res;
     }
-    m_fds.push_back(fd);
+    if (not m_fds.try_push_back(fd)) {
+        close(fd);
+        destroy_image(image);
+        return VK_ERROR_OUT_OF_HOST_MEMORY;
+    }
     Debug("GetMemoryFdKHR returned fd=%d\n", fd);
 
     VkExportSemaphoreCreateInfo exp_info = {};
@@ -191,33 +251,192 @@ VkResult swapchain::create_image(const VkImageCreateInfo &image_create,
         destroy_image(image);
         return res;
     }
-    m_fds.push_back(fd);
+    if (not m_fds.try_push_back(fd)) {
+        close(fd);
+        destroy_image(image);
+        return VK_ERROR_OUT_OF_HOST_MEMORY;
+    }
     Debug("GetSemaphoreFdKHR returned fd=%d\n", fd);
 
+    if (sync_fd_exportable()) {
+        VkExportSemaphoreCreateInfo sync_exp_info = {};
+        sync_exp_info.sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO;
+        sync_exp_info.handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+
+        VkSemaphoreCreateInfo sync_sem_info = {};
+        sync_sem_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        sync_sem_info.pNext = &sync_exp_info;
+
+        // Optional, the encoder waits on the timeline value without it
+        if (m_device_data.disp.CreateSemaphore(m_device, &sync_sem_info, nullptr,
+                                               &image.sync_semaphore) != VK_SUCCESS) {
+            image.sync_semaphore = VK_NULL_HANDLE;
+        }
+    }
+
     return res;
 }
 
+bool swapchain::sync_fd_exportable() {
+    const auto &disp = m_device_data.instance_data.disp;
+    if (disp.GetPhysicalDeviceExternalSemaphoreProperties == nullptr) {
+        return false;
+    }
+
+    VkPhysicalDeviceExternalSemaphoreInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_SEMAPHORE_INFO;
+    info.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+    VkExternalSemaphoreProperties props = {};
+    props.sType = VK_STRUCTURE_TYPE_EXTERNAL_SEMAPHORE_PROPERTIES;
+    disp.GetPhysicalDeviceExternalSemaphoreProperties(m_device_data.physical_device, &info,
+                                                      &props);
+    return props.externalSemaphoreFeatures & VK_EXTERNAL_SEMAPHORE_FEATURE_EXPORTABLE_BIT;
+}
+
+bool swapchain::send_sync_fd(uint64_t packet_index, int fd) {
+    present_sync_message message{.packet_index = packet_index};
+    struct iovec iov = {&message, sizeof(message)};
+    char ctrl_buf[CMSG_SPACE(sizeof(int))] = {};
+
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl_buf;
+    msg.msg_controllen = sizeof(ctrl_buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+    // The socket is non blocking, a full one drops the sync_file rather than the frame
+    return sendmsg(m_socket, &msg, MSG_NOSIGNAL) == sizeof(message);
+}
+
+bool swapchain::find_dma_buf_modifiers() {
+    const auto &disp = m_device_data.instance_data.disp;
+    const VkPhysicalDevice physical_device = m_device_data.physical_device;
+
+    VkDrmFormatModifierPropertiesListEXT modifier_list = {};
+    modifier_list.sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT;
+    VkFormatProperties2 format_props = {};
+    format_props.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
+    format_props.pNext = &modifier_list;
+    disp.GetPhysicalDeviceFormatProperties2(physical_device, m_create_info.format, &format_props);
+    std::vector<VkDrmFormatModifierPropertiesEXT> modifiers(modifier_list.drmFormatModifierCount);
+    modifier_list.pDrmFormatModifierProperties = modifiers.data();
+    disp.GetPhysicalDeviceFormatProperties2(physical_device, m_create_info.format, &format_props);
+
+    // Keep those the image can be created with and exported from, the driver picks one of them
+    m_modifiers.clear();
+    for (const auto &modifier : modifiers) {
+        if (modifier.drmFormatModifierPlaneCount > 4) {
+            continue;
+        }
+
+        VkPhysicalDeviceImageDrmFormatModifierInfoEXT modifier_info = {};
+        modifier_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT;
+        modifier_info.drmFormatModifier = modifier.drmFormatModifier;
+        modifier_info.sharingMode = m_create_info.sharingMode;
+        modifier_info.queueFamilyIndexCount = m_create_info.queueFamilyIndexCount;
+        modifier_info.pQueueFamilyIndices = m_create_info.pQueueFamilyIndices;
+
+        VkPhysicalDeviceExternalImageFormatInfo external_info = {};
+        external_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_IMAGE_FORMAT_INFO;
+        external_info.pNext = &modifier_info;
+        external_info.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+
+        VkPhysicalDeviceImageFormatInfo2 format_info = {};
+        format_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
+        format_info.pNext = &external_info;
+        format_info.format = m_create_info.format;
+        format_info.type = m_create_info.imageType;
+        format_info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+        format_info.usage = m_create_info.usage;
+        format_info.flags = m_create_info.flags;
+
+        VkExternalImageFormatProperties external_props = {};
+        external_props.sType = VK_STRUCTURE_TYPE_EXTERNAL_IMAGE_FORMAT_PROPERTIES;
+        VkImageFormatProperties2 props = {};
+        props.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
+        props.pNext = &external_props;
+
+        if (disp.GetPhysicalDeviceImageFormatProperties2(physical_device, &format_info, &props) !=
+            VK_SUCCESS) {
+            continue;
+        }
+        const VkExternalMemoryFeatureFlags features =
+            external_props.externalMemoryProperties.externalMemoryFeatures;
+        if ((features & VK_EXTERNAL_MEMORY_FEATURE_EXPORTABLE_BIT) and
+            (features & VK_EXTERNAL_MEMORY_FEATURE_IMPORTABLE_BIT)) {
+            m_modifiers.push_back(modifier);
+        }
+    }
+
+    if (m_modifiers.empty()) {
+        Warn("No DRM format modifier for the swapchain format %d, sharing it as opaque fds\n",
+             int(m_create_info.format));
+        return false;
+    }
+    Info("Sharing the swapchain as dma-bufs, %zu usable modifiers\n", m_modifiers.size());
+    return true;
+}
+
+VkResult swapchain::get_dma_buf_layout(VkImage image, init_image &memory) {
+    VkImageDrmFormatModifierPropertiesEXT modifier_props = {};
+    modifier_props.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_PROPERTIES_EXT;
+    VkResult res = m_device_data.disp.GetImageDrmFormatModifierPropertiesEXT(m_device, image,
+                                                                             &modifier_props);
+    if (res != VK_SUCCESS) {
+        return res;
+    }
+    memory.drm_modifier = modifier_props.drmFormatModifier;
+
+    memory.plane_count = 0;
+    for (const auto &modifier : m_modifiers) {
+        if (modifier.drmFormatModifier == memory.drm_modifier) {
+            memory.plane_count = modifier.drmFormatModifierPlaneCount;
+        }
+    }
+    if (memory.plane_count == 0) {
+        return VK_ERROR_INITIALIZATION_FAILED;
+    }
+
+    const VkImageAspectFlagBits plane_aspects[] = {VK_IMAGE_ASPECT_MEMORY_PLANE_0_BIT_EXT,
+                                                   VK_IMAGE_ASPECT_MEMORY_PLANE_1_BIT_EXT,
+                                                   VK_IMAGE_ASPECT_MEMORY_PLANE_2_BIT_EXT,
+                                                   VK_IMAGE_ASPECT_MEMORY_PLANE_3_BIT_EXT};
+    for (uint32_t i = 0; i < memory.plane_count; i++) {
+        VkImageSubresource subresource = {};
+        subresource.aspectMask = plane_aspects[i];
+        VkSubresourceLayout layout;
+        m_device_data.disp.GetImageSubresourceLayout(m_device, image, &subresource, &layout);
+        memory.plane_offsets[i] = uint32_t(layout.offset);
+        memory.plane_strides[i] = uint32_t(layout.rowPitch);
+    }
+    Debug("Swapchain image modifier=0x%llx planes=%u stride=%u\n",
+          (unsigned long long)memory.drm_modifier, memory.plane_count, memory.plane_strides[0]);
+    return VK_SUCCESS;
+}
+
 int swapchain::send_fds() {
     // This function does the arcane magic for sending
     // file descriptors over unix domain sockets
     // Stolen from https://gist.github.com/kokjo/75cec0f466fc34fa2922
     //
-    // There will always be 6 fds (for the 3 images and sempahores created in the swapchain) so we can avoid
-    // dynamic length. Initially, I tried to send the length in the normal data field (msg.msg_iov /
-    // data) but for some reason it was emptied on arrival, no matter what I did.
+    // The count of fds follows from init_packet::num_images, which the encoder already read.
     //
     struct msghdr msg;
     struct iovec iov[1];
     struct cmsghdr *cmsg = NULL;
-    assert(m_fds.size() == 6);
-    int fds[6];
-    char ctrl_buf[CMSG_SPACE(sizeof(fds))];
+    assert(m_fds.size() == init_fd_count(m_image_memory.size()));
+    const size_t fds_size = m_fds.size() * sizeof(int);
+    char ctrl_buf[CMSG_SPACE(sizeof(int) * init_fd_count(init_packet::max_images))];
     char data[1];
 
-    std::copy(m_fds.begin(), m_fds.end(), fds);
-
     memset(&msg, 0, sizeof(struct msghdr));
-    memset(ctrl_buf, 0, CMSG_SPACE(sizeof(fds)));
+    memset(ctrl_buf, 0, sizeof(ctrl_buf));
 
     iov[0].iov_base = data;
     iov[0].iov_len = sizeof(data);
@@ -226,28 +445,27 @@ int swapchain::send_fds() {
     msg.msg_namelen = 0;
     msg.msg_iov = iov;
     msg.msg_iovlen = 1;
-    msg.msg_controllen = CMSG_SPACE(sizeof(fds));
+    msg.msg_controllen = CMSG_SPACE(fds_size);
     msg.msg_control = ctrl_buf;
 
     cmsg = CMSG_FIRSTHDR(&msg);
     cmsg->cmsg_level = SOL_SOCKET;
     cmsg->cmsg_type = SCM_RIGHTS;
-    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    cmsg->cmsg_len = CMSG_LEN(fds_size);
 
-    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), m_fds.data(), fds_size);
 
     int ret = sendmsg(m_socket, &msg, 0);
 
     for (auto fd: m_fds)
       close(fd);
+    m_fds.clear();
 
     return ret;
 }
 
 bool swapchain::try_connect() {
     Debug("swapchain::try_connect\n");
-    m_socketPath = getenv("XDG_RUNTIME_DIR");
-    m_socketPath += "/alvr-ipc";
 
     int ret;
     if (m_socket == -1) {
@@ -258,12 +476,7 @@ bool swapchain::try_connect() {
         }
     }
 
-    struct sockaddr_un name;
-    memset(&name, 0, sizeof(name));
-    name.sun_family = AF_UNIX;
-    strncpy(name.sun_path, m_socketPath.c_str(), sizeof(name.sun_path) - 1);
-
-    ret = connect(m_socket, (const struct sockaddr *)&name, sizeof(name));
+    ret = connect(m_socket, (const struct sockaddr *)&m_socket_address, sizeof(m_socket_address));
     if (ret == -1) {
         return false; // we will try again next frame
     }
@@ -277,10 +490,14 @@ bool swapchain::try_connect() {
     m_device_data.instance_data.disp.GetPhysicalDeviceProperties2(m_device_data.physical_device,
                                                                   &props);
 
+    // The surface capabilities keep it in range
+    assert(m_image_memory.size() == m_swapchain_images.size());
+    assert(m_image_memory.size() <= init_packet::max_images);
+
     init_packet init{.num_images = uint32_t(m_swapchain_images.size()),
       .device_uuid = {},
       .image_create_info = m_create_info,
-      .mem_index = m_mem_index,
+      .memory_handle_type = m_memory_handle_type,
       .source_pid = getpid()};
     memcpy(init.device_uuid.data(), props11.deviceUUID, VK_UUID_SIZE);
     ret = write(m_socket, &init, sizeof(init));
@@ -288,6 +505,33 @@ bool swapchain::try_connect() {
         perror("write");
         exit(1);
     }
+    ret = write(m_socket, m_image_memory.data(), m_image_memory.size() * sizeof(init_image));
+    if (ret == -1) {
+        perror("write");
+        exit(1);
+    }
+
+    int ring_fd = memfd_create("alvr-present-ring", MFD_CLOEXEC);
+    if (ring_fd == -1 || ftruncate(ring_fd, sizeof(present_ring)) == -1) {
+        perror("memfd_create");
+        exit(1);
+    }
+    void *ring =
+        mmap(nullptr, sizeof(present_ring), PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+    if (ring == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    m_ring = new (ring) present_ring{};
+    m_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_event_fd == -1) {
+        perror("eventfd");
+        exit(1);
+    }
+    // The images take all but the last two slots
+    bool pushed = m_fds.try_push_back(ring_fd) && m_fds.try_push_back(dup(m_event_fd));
+    assert(pushed);
+    (void)pushed;
 
     ret = send_fds();
     if (ret == -1) {
@@ -296,26 +540,96 @@ bool swapchain::try_connect() {
     }
     Debug("swapchain sent fds\n");
 
+    m_display.set_vsync_clock(&m_ring->vsync);
+    m_shared_ring.store(m_ring, std::memory_order_release);
+    m_connect_missed_vsyncs = m_display.missed_vsyncs();
+
     return true;
 }
 
+uint64_t swapchain::newest_pose_timestamp() {
+    const present_ring *ring = m_shared_ring.load(std::memory_order_acquire);
+    if (!ring) {
+        return 0;
+    }
+    return ring->newest_pose_ns.load(std::memory_order_acquire);
+}
+
+bool swapchain::encoder_hung_up() const {
+    pollfd fd = {.fd = m_socket, .events = 0, .revents = 0};
+    return poll(&fd, 1, 0) == 1 && (fd.revents & (POLLHUP | POLLERR));
+}
+
+VkResult swapchain::wait_for_present(uint64_t present_id, uint64_t timeout) {
+    const present_ring *ring = m_shared_ring.load(std::memory_order_acquire);
+    if (!ring) {
+        return swapchain_base::wait_for_present(present_id, timeout);
+    }
+
+    // The consumed id stops moving if the encoder goes away, so the futex is waited on in slices
+    // and the socket checked in between
+    constexpr uint64_t slice_ns = 100000000;
+    const auto start = std::chrono::steady_clock::now();
+    while (true) {
+        uint32_t sequence = ring->consumed_sequence.load(std::memory_order_acquire);
+        if (ring->consumed_present_id.load(std::memory_order_acquire) >= present_id) {
+            return VK_SUCCESS;
+        }
+
+        uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+        if (timeout != UINT64_MAX && elapsed >= timeout) {
+            return VK_TIMEOUT;
+        }
+        // The driver closes the socket when the encoder thread ends or the driver goes down, the
+        // presents then complete once the page flip thread presented them
+        if (encoder_hung_up()) {
+            return swapchain_base::wait_for_present(
+                present_id, timeout == UINT64_MAX ? UINT64_MAX : timeout - elapsed);
+        }
+
+        uint64_t wait_ns = timeout == UINT64_MAX ? slice_ns : std::min(slice_ns, timeout - elapsed);
+        timespec wait = {};
+        wait.tv_sec = wait_ns / 1000000000;
+        wait.tv_nsec = wait_ns % 1000000000;
+        // Returns right away if the encoder consumed a present since the load above
+        syscall(SYS_futex, &ring->consumed_sequence, FUTEX_WAIT, sequence, &wait, nullptr, 0);
+    }
+}
+
 void swapchain::submit_image(uint32_t pending_index) {
     const auto & pose = m_swapchain_images[pending_index].pose.mDeviceToAbsoluteTracking.m;
+    uint64_t vsync = m_display.on_present();
     if (!m_connected) {
         m_connected = try_connect();
     }
+    int &sync_fd = m_swapchain_images[pending_index].sync_fd;
     if (m_connected) {
-        int ret;
-        present_packet packet;
+        uint64_t index = m_ring->write_index.load(std::memory_order_relaxed);
+        present_packet &packet = m_ring->packets[index % present_ring::size];
+        // Sent ahead of the packet, so that the encoder has it once it reads the packet
+        packet.has_sync_fd = sync_fd != -1 && send_sync_fd(index, sync_fd);
         packet.image = pending_index;
-        packet.frame = m_display.m_vsync_count;
+        packet.frame = vsync;
         packet.semaphore_value = m_swapchain_images[pending_index].semaphore_value;
         memcpy(&packet.pose, pose, sizeof(packet.pose));
-        ret = write(m_socket, &packet, sizeof(packet));
-        if (ret == -1) {
+        packet.newest_pose_ns = m_swapchain_images[pending_index].newest_pose_ns;
+        packet.present_ns = m_swapchain_images[pending_index].present_ns;
+        packet.present_id = m_swapchain_images[pending_index].present_id;
+        m_ring->missed_vsyncs.store(
+            m_display.missed_vsyncs() - m_connect_missed_vsyncs, std::memory_order_relaxed);
+        m_ring->write_index.store(index + 1, std::memory_order_release);
+
+        uint64_t signal = 1;
+        if (write(m_event_fd, &signal, sizeof(signal)) == -1 && errno != EAGAIN) {
             //FIXME: try to reconnect?
         }
     }
+    if (sync_fd != -1) {
+        close(sync_fd);
+        sync_fd = -1;
+    }
 }
 
 void swapchain::present_image(uint32_t pending_index) {
@@ -335,6 +649,16 @@ void swapchain::destroy_image(wsi::swapchain_image &image) {
             m_device_data.disp.DestroyImage(m_device, image.image, get_allocation_callbacks());
             image.image = VK_NULL_HANDLE;
         }
+
+        if (image.sync_semaphore != VK_NULL_HANDLE) {
+            m_device_data.disp.DestroySemaphore(m_device, image.sync_semaphore, nullptr);
+            image.sync_semaphore = VK_NULL_HANDLE;
+        }
+    }
+
+    if (image.sync_fd != -1) {
+        close(image.sync_fd);
+        image.sync_fd = -1;
     }
 
     if (image.data != nullptr) {
@@ -30,6 +30,8 @@
 
 #pragma once
 
+#include <atomic>
+#include <sys/un.h>
 #include <vector>
 
 #include <vulkan/vk_icd.h>
@@ -37,6 +39,7 @@
 #include <wsi/swapchain_base.hpp>
 
 #include "platform/linux/protocol.h"
+#include "util/fixed_vector.hpp"
 
 namespace wsi {
 namespace headless {
@@ -92,16 +95,58 @@ class swapchain : public wsi::swapchain_base {
      */
     void destroy_image(wsi::swapchain_image &image);
 
+    uint64_t newest_pose_timestamp();
+
+    /**
+     * @brief Completes the presents once the encoder consumed them, or once presented while it
+     * isn't connected.
+     */
+    VkResult wait_for_present(uint64_t present_id, uint64_t timeout) override;
+
   private:
+    /**
+     * @brief Finds the DRM format modifiers the images can be exported as dma-bufs with.
+     *
+     * @return Whether there is any, otherwise the images are exported as opaque fds.
+     */
+    bool find_dma_buf_modifiers();
+    VkResult get_dma_buf_layout(VkImage image, init_image &memory);
+
+    /**
+     * @brief Whether the images can signal a binary semaphore exported as a sync_file along with
+     * their timeline semaphore.
+     */
+    bool sync_fd_exportable();
+
     bool try_connect();
+    /**
+     * @brief Whether the driver closed the socket, which it does when the encoder thread ends.
+     */
+    bool encoder_hung_up() const;
     int send_fds();
+    /**
+     * @brief Sends the sync_file of the present that goes in the ring at @p packet_index.
+     *
+     * @return Whether the encoder is going to receive it.
+     */
+    bool send_sync_fd(uint64_t packet_index, int fd);
     int m_socket = -1;
-    std::string m_socketPath;
+    // Built once, connecting is retried on every present until the streamer is up
+    sockaddr_un m_socket_address = {};
     bool m_connected = false;
-    std::vector<int> m_fds;
+    present_ring *m_ring = nullptr;
+    // m_ring once connected, for the threads that present
+    std::atomic<const present_ring *> m_shared_ring{nullptr};
+    int m_event_fd = -1;
+    util::fixed_vector<int, init_fd_count(init_packet::max_images)> m_fds;
     VkImageCreateInfo m_create_info;
-    size_t m_mem_index;
+    util::fixed_vector<init_image, init_packet::max_images> m_image_memory;
+    VkExternalMemoryHandleTypeFlagBits m_memory_handle_type =
+        VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+    std::vector<VkDrmFormatModifierPropertiesEXT> m_modifiers;
     display &m_display;
+    // Missed vsyncs of the display when the ring was created, the ring only counts the later ones
+    uint64_t m_connect_missed_vsyncs = 0;
     uint32_t in_flight_index = UINT32_MAX;
 };
 
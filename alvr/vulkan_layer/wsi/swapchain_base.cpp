@@ -31,8 +31,10 @@
  * that is not specific to how images are created or presented.
  */
 
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <chrono>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
@@ -41,6 +43,7 @@
 #include <vulkan/vulkan.h>
 
 #include "display.hpp"
+#include "layer/settings.h"
 #include "swapchain_base.hpp"
 
 #if VULKAN_WSI_DEBUG > 0
@@ -76,7 +79,10 @@ void swapchain_base::page_flip_thread() {
         uint32_t pending_index = m_pending_buffer_pool.ring[m_pending_buffer_pool.head];
         m_pending_buffer_pool.head = (m_pending_buffer_pool.head + 1) % m_pending_buffer_pool.size;
 
-        submit_image(pending_index);
+        /* In direct submit mode queue_present already handed the image to the encoder. */
+        if (not m_direct_submit) {
+            submit_image(pending_index);
+        }
 
         /* We wait for the fence of the oldest pending image to be signalled. */
         vk_res = m_device_data.disp.WaitForFences(
@@ -113,7 +119,27 @@ void swapchain_base::page_flip_thread() {
         else {
             present_image(pending_index);
         }
+
+        if (sc_images[pending_index].present_id > 0) {
+            std::lock_guard<std::mutex> lock(m_presented_mutex);
+            m_presented_id = std::max(m_presented_id, sc_images[pending_index].present_id);
+            m_presented_condition.notify_all();
+        }
+    }
+}
+
+VkResult swapchain_base::wait_for_present(uint64_t present_id, uint64_t timeout) {
+    std::unique_lock<std::mutex> lock(m_presented_mutex);
+    auto presented = [&] { return m_presented_id >= present_id; };
+    /* Longer timeouts would overflow the clock, they are as good as waiting indefinitely. */
+    constexpr uint64_t MAX_TIMED_WAIT = 24ull * 3600 * 1000000000;
+    if (timeout > MAX_TIMED_WAIT) {
+        m_presented_condition.wait(lock, presented);
+        return VK_SUCCESS;
     }
+    return m_presented_condition.wait_for(lock, std::chrono::nanoseconds(timeout), presented)
+               ? VK_SUCCESS
+               : VK_TIMEOUT;
 }
 
 void swapchain_base::unpresent_image(uint32_t presented_index) {
@@ -129,7 +155,8 @@ void swapchain_base::unpresent_image(uint32_t presented_index) {
 swapchain_base::swapchain_base(layer::device_private_data &dev_data,
                                const VkAllocationCallbacks *callbacks)
     : m_device_data(dev_data), m_page_flip_thread_run(true), m_thread_sem_defined(false),
-      m_first_present(true), m_pending_buffer_pool{nullptr, 0, 0, 0},
+      m_first_present(true), m_direct_submit(Settings::Instance().m_directSubmit),
+      m_pending_buffer_pool{nullptr, 0, 0, 0},
       m_allocator(callbacks, VK_SYSTEM_ALLOCATION_SCOPE_OBJECT), m_swapchain_images(m_allocator),
       m_surface(VK_NULL_HANDLE), m_present_mode(VK_PRESENT_MODE_IMMEDIATE_KHR),
       m_descendant(VK_NULL_HANDLE), m_ancestor(VK_NULL_HANDLE), m_device(VK_NULL_HANDLE),
@@ -410,11 +437,13 @@ VkResult swapchain_base::get_swapchain_images(uint32_t *swapchain_image_count,
 }
 
 VkResult swapchain_base::queue_present(VkQueue queue, const VkPresentInfoKHR *present_info,
-                                       const uint32_t image_index) {
+                                       const uint32_t image_index, uint64_t present_id) {
     VkResult result;
     bool descendent_started_presenting = false;
 
+    const uint64_t present_ns = display::now_ns();
     const auto & pose = find_pose_in_call_stack();
+    uint64_t newest_pose_ns = newest_pose_timestamp();
 
     if (m_descendant != VK_NULL_HANDLE) {
         auto *desc = reinterpret_cast<swapchain_base *>(m_descendant);
@@ -433,12 +462,16 @@ VkResult swapchain_base::queue_present(VkQueue queue, const VkPresentInfoKHR *pr
      */
     VkPipelineStageFlags pipeline_stage_flags = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
 
-    uint64_t signal_value = ++m_swapchain_images[image_index].semaphore_value;
+    auto &image = m_swapchain_images[image_index];
+    /* The value of the binary semaphore is ignored. */
+    const uint64_t signal_values[2] = {++image.semaphore_value, 0};
+    const VkSemaphore signal_semaphores[2] = {image.semaphore, image.sync_semaphore};
+    const uint32_t signal_count = image.sync_semaphore != VK_NULL_HANDLE ? 2 : 1;
 
     VkTimelineSemaphoreSubmitInfo timeline_info = {};
     timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
-    timeline_info.signalSemaphoreValueCount = 1;
-    timeline_info.pSignalSemaphoreValues = &signal_value;
+    timeline_info.signalSemaphoreValueCount = signal_count;
+    timeline_info.pSignalSemaphoreValues = signal_values;
 
     VkSubmitInfo submit_info = {VK_STRUCTURE_TYPE_SUBMIT_INFO,
                                 &timeline_info,
@@ -447,8 +480,8 @@ VkResult swapchain_base::queue_present(VkQueue queue, const VkPresentInfoKHR *pr
                                 &pipeline_stage_flags,
                                 0,
                                 NULL,
-                                1,
-                                &m_swapchain_images[image_index].semaphore};
+                                signal_count,
+                                signal_semaphores};
 
     assert(m_swapchain_images[image_index].status == swapchain_image::ACQUIRED);
     result =
@@ -463,6 +496,24 @@ VkResult swapchain_base::queue_present(VkQueue queue, const VkPresentInfoKHR *pr
         return result;
     }
 
+    /* Exporting the sync_file unsignals the binary semaphore for the next present, so it's done
+     * even if the image isn't going to be submitted. The encoder falls back to the timeline value
+     * when there is no sync_file. */
+    if (image.sync_semaphore != VK_NULL_HANDLE) {
+        if (image.sync_fd != -1) {
+            close(image.sync_fd);
+            image.sync_fd = -1;
+        }
+        VkSemaphoreGetFdInfoKHR sync_fd_info = {};
+        sync_fd_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR;
+        sync_fd_info.semaphore = image.sync_semaphore;
+        sync_fd_info.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+        if (m_device_data.disp.GetSemaphoreFdKHR(m_device, &sync_fd_info, &image.sync_fd) !=
+            VK_SUCCESS) {
+            image.sync_fd = -1;
+        }
+    }
+
     /* If the descendant has started presenting, we should release the image
      * however we do not want to block inside the main thread so we mark it
      * as free and let the page flip thread take care of it. */
@@ -479,6 +530,16 @@ VkResult swapchain_base::queue_present(VkQueue queue, const VkPresentInfoKHR *pr
 
     m_swapchain_images[image_index].status = swapchain_image::PENDING;
     m_swapchain_images[image_index].pose = pose;
+    m_swapchain_images[image_index].newest_pose_ns = newest_pose_ns;
+    m_swapchain_images[image_index].present_ns = present_ns;
+    m_swapchain_images[image_index].present_id = present_id;
+
+    /* The encoder waits on the timeline semaphore value signalled by the submit above, not on the
+     * present fence, so the image can be handed over right away. The page flip thread still waits
+     * for the fence before recycling the image. */
+    if (m_direct_submit) {
+        submit_image(image_index);
+    }
 
     m_pending_buffer_pool.ring[m_pending_buffer_pool.tail] = image_index;
     m_pending_buffer_pool.tail = (m_pending_buffer_pool.tail + 1) % m_pending_buffer_pool.size;
@@ -30,6 +30,8 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <mutex>
 #include <pthread.h>
 #include <semaphore.h>
 #include <thread>
@@ -59,8 +61,17 @@ struct swapchain_image {
     VkFence present_fence{VK_NULL_HANDLE};
     VkSemaphore semaphore{VK_NULL_HANDLE};
     uint64_t semaphore_value = 0;
+    // Binary semaphore signalled along with semaphore, VK_NULL_HANDLE if it can't be exported as
+    // a sync_file. sync_fd is its sync_file from the last present, until the image is submitted
+    VkSemaphore sync_semaphore{VK_NULL_HANDLE};
+    int sync_fd = -1;
 
     TrackedDevicePose_t pose;
+    uint64_t newest_pose_ns = 0;
+    // display::now_ns() when the image was queued for present
+    uint64_t present_ns = 0;
+    // VkPresentIdKHR of the present, 0 if none
+    uint64_t present_id = 0;
 };
 
 /**
@@ -127,12 +138,28 @@ class swapchain_base {
      *
      * @param imageIndex The index of the image to be presented.
      *
+     * @param present_id The VkPresentIdKHR of the image, 0 if none.
+     *
      * @return If queue submission fails returns error of vkQueueSubmit, if the
      * swapchain has a descendant who started presenting returns VK_ERROR_OUT_OF_DATE_KHR,
      * otherwise returns VK_SUCCESS.
      */
     VkResult queue_present(VkQueue queue, const VkPresentInfoKHR *present_info,
-                           const uint32_t image_index);
+                           const uint32_t image_index, uint64_t present_id);
+
+    /**
+     * @brief Implements vkWaitForPresentKHR.
+     *
+     * A present is complete once the page flip thread presented it. Implementations that hand the
+     * images to a consumer complete them when it is done with them instead.
+     *
+     * @param present_id The id to wait for, the presents before it are complete along with it.
+     *
+     * @param timeout Nanoseconds to wait for, UINT64_MAX waits indefinitely.
+     *
+     * @return VK_SUCCESS once complete, VK_TIMEOUT if it wasn't within the timeout.
+     */
+    virtual VkResult wait_for_present(uint64_t present_id, uint64_t timeout);
 
   protected:
     layer::device_private_data &m_device_data;
@@ -187,6 +214,11 @@ class swapchain_base {
      */
     bool m_first_present;
 
+    /**
+     * @brief Whether queue_present calls submit_image itself instead of the page flip thread.
+     */
+    const bool m_direct_submit;
+
     /**
      * @brief In order to present the images in a FIFO order we implement
      * a ring buffer to hold the images queued for presentation. Since the
@@ -346,6 +378,15 @@ class swapchain_base {
      */
     virtual VkResult get_free_buffer(uint64_t *timeout) { return VK_SUCCESS; }
 
+    /**
+     * @brief Target timestamp of the newest pose the streamer gave to SteamVR
+     *
+     * Read along with the pose of a presented image, which can't be newer.
+     *
+     * @return The timestamp, 0 if it isn't known.
+     */
+    virtual uint64_t newest_pose_timestamp() { return 0; }
+
   private:
     /**
      * @brief Wait for a buffer to become free.
@@ -390,6 +431,13 @@ class swapchain_base {
 
     uint32_t m_last_acquired_image = 0;
 
+    /**
+     * @brief Newest present id the page flip thread presented, for wait_for_present.
+     */
+    uint64_t m_presented_id = 0;
+    std::mutex m_presented_mutex;
+    std::condition_variable m_presented_condition;
+
     std::vector<VkFence> m_fences;
 };
 
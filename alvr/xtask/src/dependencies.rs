@@ -123,6 +123,7 @@ pub fn prepare_linux_deps(enable_nvenc: bool) {
     sh.create_dir(&deps_path).unwrap();
 
     build_x264_linux(&deps_path);
+    build_svt_av1_linux(&deps_path);
     build_ffmpeg_linux(enable_nvenc, &deps_path);
 }
 
@@ -159,6 +160,68 @@ pub fn build_x264_linux(deps_path: &Path) {
     cmd!(sh, "make install").run().unwrap();
 }
 
+// Linked into FFmpeg for the libsvtav1 software AV1 encoder
+pub fn build_svt_av1_linux(deps_path: &Path) {
+    let sh = Shell::new().unwrap();
+
+    command::download_and_extract_tar(
+        "https://gitlab.com/AOMediaCodec/SVT-AV1/-/archive/v1.4.1/SVT-AV1-v1.4.1.tar.bz2",
+        deps_path,
+    )
+    .unwrap();
+
+    let final_path = deps_path.join("SVT-AV1");
+
+    fs::rename(deps_path.join("SVT-AV1-v1.4.1"), &final_path).unwrap();
+
+    let flags = [
+        "-DCMAKE_BUILD_TYPE=Release",
+        "-DCMAKE_INSTALL_LIBDIR=lib",
+        "-DCMAKE_POSITION_INDEPENDENT_CODE=ON",
+        "-DBUILD_SHARED_LIBS=OFF",
+        "-DBUILD_APPS=OFF",
+        "-DBUILD_DEC=OFF",
+    ];
+
+    let install_prefix = format!(
+        "-DCMAKE_INSTALL_PREFIX={}",
+        final_path.join("alvr_build").display()
+    );
+    let pc_path = final_path.join("alvr_build/lib/pkgconfig/SvtAv1Enc.pc");
+
+    let _push_guard = sh.push_dir(final_path);
+
+    cmd!(sh, "cmake -S . -B build {install_prefix} {flags...}")
+        .run()
+        .unwrap();
+
+    let nproc = cmd!(sh, "nproc").read().unwrap();
+    cmd!(sh, "cmake --build build -j{nproc}").run().unwrap();
+    cmd!(sh, "cmake --install build").run().unwrap();
+
+    // The library is static, whatever links it also needs its private dependencies. They are made
+    // public here, so that FFmpeg doesn't have to query all of its dependencies with --static
+    let pc = fs::read_to_string(&pc_path).unwrap();
+    let private_libs = pc
+        .lines()
+        .filter_map(|line| line.strip_prefix("Libs.private:"))
+        .collect::<Vec<_>>()
+        .join(" ");
+    let pc = pc
+        .lines()
+        .filter(|line| !line.starts_with("Libs.private:"))
+        .map(|line| {
+            if line.starts_with("Libs:") {
+                format!("{line} {private_libs}")
+            } else {
+                line.to_owned()
+            }
+        })
+        .collect::<Vec<_>>()
+        .join("\n");
+    fs::write(&pc_path, pc + "\n").unwrap();
+}
+
 pub fn build_ffmpeg_linux(enable_nvenc: bool, deps_path: &Path) {
     let sh = Shell::new().unwrap();
 
@@ -192,6 +255,12 @@ pub fn build_ffmpeg_linux(enable_nvenc: bool, deps_path: &Path) {
         "--enable-hwaccel=hevc_vaapi",
         "--enable-hwaccel=av1_vaapi",
         "--enable-filter=scale_vaapi",
+        "--enable-filter=procamp_vaapi",
+        "--enable-libsvtav1",
+        "--enable-encoder=libsvtav1",
+        // Software decoders for the quality metrics of the encode benchmark
+        "--enable-decoder=h264",
+        "--enable-decoder=hevc",
         "--enable-vulkan",
         "--enable-libdrm",
         "--enable-pic",
@@ -204,8 +273,11 @@ pub fn build_ffmpeg_linux(enable_nvenc: bool, deps_path: &Path) {
     //
     let config_vars = r#"-Wl,-rpath,'$$$$ORIGIN'"#;
 
+    let svt_av1_pkg_path = deps_path.join("SVT-AV1/alvr_build/lib/pkgconfig");
+
     let _push_guard = sh.push_dir(final_path);
     let _env_vars = sh.push_env("LDSOFLAGS", config_vars);
+    let _pkg_config_path = sh.push_env("PKG_CONFIG_PATH", &svt_av1_pkg_path);
 
     // Patches ffmpeg for workarounds and patches that have yet to be unstreamed
     let ffmpeg_command = "for p in ../../../alvr/xtask/patches/*; do patch -p1 < $p; done";
@@ -273,8 +345,9 @@ pub fn build_ffmpeg_linux(enable_nvenc: bool, deps_path: &Path) {
             ];
 
             let env_vars = format!(
-                "PKG_CONFIG_PATH='{}'",
-                header_build_dir.join("lib/pkgconfig").display()
+                "PKG_CONFIG_PATH='{}:{}'",
+                header_build_dir.join("lib/pkgconfig").display(),
+                svt_av1_pkg_path.display()
             );
             let flags_combined = flags.join(" ");
             let nvenc_flags_combined = nvenc_flags.join(" ");